@@ -6,6 +6,7 @@
 #include "caffe/common.hpp"
 #include "caffe/syncedmem.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/half.hpp"
 
 namespace caffe {
 
@@ -13,10 +14,16 @@ template <typename Dtype>
 class Blob {
  public:
   Blob()
-       : num_(0), channels_(0), height_(0), width_(0), count_(0), data_(),
-       diff_() {}
+       : num_(0), channels_(0), height_(0), width_(0), count_(0),
+       capacity_(0), data_(), diff_() {}
   explicit Blob(const int num, const int channels, const int height,
     const int width);
+  // Changes the shape of the blob. The memory is only reallocated when the
+  // new count is larger than the capacity; otherwise the current memory,
+  // whose contents are left as they are, is kept, including memory shared
+  // with ShareData and ShareDiff. The diff memory is only created when the
+  // diff is first accessed, so blobs that are only used forward never have
+  // one.
   void Reshape(const int num, const int channels, const int height,
     const int width);
   void ReshapeLike(const Blob& other);
@@ -24,18 +31,27 @@ class Blob {
   inline int channels() const { return channels_; }
   inline int height() const { return height_; }
   inline int width() const { return width_; }
-  inline int count() const {return count_; }
-  inline int offset(const int n, const int c = 0, const int h = 0,
+  // The count, capacity and offsets are 64-bit: a blob may hold more than
+  // 2^31 elements, e.g. a large batch of large images, though each of its
+  // dimensions fits an int.
+  inline int64_t count() const {return count_; }
+  // The number of elements the blob can hold without reallocating.
+  inline int64_t capacity() const { return capacity_; }
+  // The index of element (n, c, h, w). The layers compute offsets inside
+  // their loops over the images, so the bounds are only checked in debug
+  // builds.
+  inline int64_t offset(const int n, const int c = 0, const int h = 0,
       const int w = 0) const {
-    CHECK_GE(n, 0);
-    CHECK_LE(n, num_);
-    CHECK_GE(channels_, 0);
-    CHECK_LE(c, channels_);
-    CHECK_GE(height_, 0);
-    CHECK_LE(h, height_);
-    CHECK_GE(width_, 0);
-    CHECK_LE(w, width_);
-    return ((n * channels_ + c) * height_ + h) * width_ + w;
+    DCHECK_GE(n, 0);
+    DCHECK_LE(n, num_);
+    DCHECK_GE(c, 0);
+    DCHECK_LE(c, channels_);
+    DCHECK_GE(h, 0);
+    DCHECK_LE(h, height_);
+    DCHECK_GE(w, 0);
+    DCHECK_LE(w, width_);
+    return ((static_cast<int64_t>(n) * channels_ + c) * height_ + h) *
+        width_ + w;
   }
   // Copy from source. If copy_diff is false, we copy the data; if copy_diff
   // is true, we copy the diff.
@@ -54,17 +70,27 @@ class Blob {
 
   inline const shared_ptr<SyncedMemory>& data() const {
     CHECK(data_);
+    RestoreHalfData();
     return data_;
   }
 
   inline const shared_ptr<SyncedMemory>& diff() const {
-    CHECK(diff_);
+    CreateDiff();
     return diff_;
   }
+  // Whether the diff has been accessed since the last reallocation.
+  inline bool has_diff() const { return diff_.get() != NULL; }
 
   const Dtype* cpu_data() const;
   void set_cpu_data(Dtype* data);
+  // Makes the data live in segment from offset (in bytes) on, e.g. the
+  // outputs of a net for another process to read once cpu_data() has been
+  // called (see SyncedMemory::set_cpu_segment). A Reshape to a larger count
+  // moves the data out of the segment.
+  void set_cpu_segment(const shared_ptr<SharedMemorySegment>& segment,
+      const size_t offset);
   const Dtype* gpu_data() const;
+  void set_gpu_data(Dtype* data);
   const Dtype* cpu_diff() const;
   const Dtype* gpu_diff() const;
   Dtype* mutable_cpu_data();
@@ -73,7 +99,8 @@ class Blob {
   Dtype* mutable_gpu_diff();
   void Update();
   void FromProto(const BlobProto& proto);
-  void ToProto(BlobProto* proto, bool write_diff = false) const;
+  void ToProto(BlobProto* proto, bool write_diff = false,
+      const BlobProto::Encoding encoding = BlobProto::REPEATED) const;
 
   // Set the data_/diff_ shared_ptr to point to the SyncedMemory holding the
   // data_/diff_ of Blob other -- useful in layers which simply perform a copy
@@ -82,15 +109,57 @@ class Blob {
   // shared_ptr calls its destructor when reset with the = operator.
   void ShareData(const Blob& other);
   void ShareDiff(const Blob& other);
+  // Makes the data/diff of this blob use memory, which may be larger than
+  // the blob and shared with other blobs -- used by Net to share the memory
+  // of blobs that are not needed at the same time.
+  void ShareDataMemory(const shared_ptr<SyncedMemory>& memory);
+  void ShareDiffMemory(const shared_ptr<SyncedMemory>& memory);
+  // Makes the data/diff of this blob, shaped as it is, a view of the count()
+  // elements of the data/diff of other from offset on (see the SyncedMemory
+  // view constructor): e.g. of images [i, j) of other, shaped j - i x
+  // channels x height x width, at other.offset(i), or of a range of channels
+  // of a single image. The view shares the memory and the cpu/gpu head of
+  // other, which it keeps alive: Reshape-ing this blob beyond count() gives it
+  // memory of its own again, and reallocating other leaves the view on the
+  // old memory.
+  void ShareDataView(const Blob& other, const int64_t offset);
+  void ShareDiffView(const Blob& other, const int64_t offset);
+  // Stores the data in half precision (see util/half.hpp), releasing its
+  // Dtype memory -- used by inference only nets for their weights. cpu_data
+  // and gpu_data then expand it into scratch, which must hold count elements
+  // and may be shared with other blobs: the data they return is only valid
+  // until the next blob sharing scratch is read. The blob is back to Dtype
+  // data after a mutable access or a reallocation.
+  void StoreDataAsHalf(const shared_ptr<SyncedMemory>& scratch);
+  inline bool half_data() const { return half_data_.get() != NULL; }
+  // Accounts the data and the diff memory against the given tags in the
+  // MemoryPool (see SyncedMemory::set_tag), also once reallocated -- used by
+  // Net to account the blobs against their layers.
+  void set_memory_tags(const MemoryTag& data_tag, const MemoryTag& diff_tag);
 
  protected:
+  // Replaces the data memory by one of exactly count elements if the
+  // capacity is larger, before the data is set to outside memory.
+  void FitDataToCount();
+  // Creates the diff memory if it does not exist yet.
+  void CreateDiff() const;
+  // Expands the half data back into the data memory, if it is stored in half
+  // precision.
+  void RestoreHalfData() const;
+
   shared_ptr<SyncedMemory> data_;
-  shared_ptr<SyncedMemory> diff_;
+  mutable shared_ptr<SyncedMemory> diff_;
+  // The data in half precision, and the memory it is expanded into
+  mutable shared_ptr<SyncedMemory> half_data_;
+  mutable shared_ptr<SyncedMemory> half_scratch_;
+  MemoryTag data_tag_;
+  MemoryTag diff_tag_;
   int num_;
   int channels_;
   int height_;
   int width_;
-  int count_;
+  int64_t count_;
+  int64_t capacity_;
 
   DISABLE_COPY_AND_ASSIGN(Blob);
 };  // class Blob
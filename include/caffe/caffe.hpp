@@ -9,8 +9,10 @@
 #include "caffe/blob.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/layer.hpp"
+#include "caffe/mpi_sync.hpp"
 #include "caffe/net.hpp"
 #include "caffe/solver.hpp"
+#include "caffe/solver_sweep.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/vision_layers.hpp"
 
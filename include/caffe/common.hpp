@@ -4,11 +4,19 @@
 #define CAFFE_COMMON_HPP_
 
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/tss.hpp>
 #include <cublas_v2.h>
 #include <cuda.h>
 #include <curand.h>
+#include <cusparse_v2.h>
 #include <driver_types.h>  // cuda driver types
 #include <glog/logging.h>
+#include <limits.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
 
 // Disable the copy and assignment operator for a class.
 #define DISABLE_COPY_AND_ASSIGN(classname) \
@@ -47,11 +55,21 @@ private:\
       << caffe::curandGetErrorString(status); \
   } while (0)
 
-// CUDA: grid stride looping
-#define CUDA_KERNEL_LOOP(i, n) \
-  for (int i = blockIdx.x * blockDim.x + threadIdx.x; \
+#define CUSPARSE_CHECK(condition) \
+  do { \
+    cusparseStatus_t status = condition; \
+    CHECK_EQ(status, CUSPARSE_STATUS_SUCCESS) << " " \
+      << caffe::cusparseGetErrorString(status); \
+  } while (0)
+
+// CUDA: grid stride looping, with an index of type Index: int64_t for the
+// kernels over more elements than an int indexes (see CAFFE_INT32_INDEX).
+#define CUDA_KERNEL_LOOP_T(Index, i, n) \
+  for (Index i = static_cast<Index>(blockIdx.x) * blockDim.x + threadIdx.x; \
        i < (n); \
-       i += blockDim.x * gridDim.x)
+       i += static_cast<Index>(blockDim.x) * gridDim.x)
+
+#define CUDA_KERNEL_LOOP(i, n) CUDA_KERNEL_LOOP_T(int, i, n)
 
 // CUDA: check for error after kernel execution and exit loudly if there is one.
 #define CUDA_POST_KERNEL_CHECK CUDA_CHECK(cudaPeekAtLastError())
@@ -69,15 +87,18 @@ using boost::shared_ptr;
 
 
 // A singleton class to hold common caffe stuff, such as the handler that
-// caffe is going to use for cublas, curand, etc.
+// caffe is going to use for cublas, curand, etc. There is one instance per
+// thread, created at its first use, so that threads driving different devices
+// (see P2PSync) each have their own handles, mode and phase; a thread that
+// runs layers sets them up first.
 class Caffe {
  public:
   ~Caffe();
   inline static Caffe& Get() {
-    if (!singleton_.get()) {
-      singleton_.reset(new Caffe());
+    if (!thread_instance_.get()) {
+      thread_instance_.reset(new Caffe());
     }
-    return *singleton_;
+    return *thread_instance_;
   }
   enum Brew { CPU, GPU };
   enum Phase { TRAIN, TEST };
@@ -97,7 +118,7 @@ class Caffe {
     shared_ptr<Generator> generator_;
   };
 
-  // Getters for boost rng, curand, and cublas handles
+  // Getters for boost rng, curand, cublas and cusparse handles
   inline static RNG& rng_stream() {
     if (!Get().random_generator_) {
       Get().random_generator_.reset(new RNG());
@@ -108,6 +129,31 @@ class Caffe {
   inline static curandGenerator_t curand_generator() {
     return Get().curand_generator_;
   }
+  inline static cusparseHandle_t cusparse_handle() {
+    return Get().cusparse_handle_;
+  }
+  // The descriptor of a general matrix with zero based indices, for the
+  // sparse matrices the cusparse calls take
+  inline static cusparseMatDescr_t cusparse_matrix_descr() {
+    return Get().cusparse_matrix_descr_;
+  }
+  // A pool of kNumCudaStreams streams of the current device, for the layers
+  // to issue independent work to, e.g. the GEMMs of the groups of a
+  // convolution. Stream i % kNumCudaStreams is returned. The streams
+  // synchronize with the default stream: work issued there waits for theirs,
+  // and the other way around.
+  static const int kNumCudaStreams = 4;
+  static cudaStream_t cuda_stream(const int i);
+  // Makes the cublas calls go to stream i of the pool, or to the default
+  // stream if i is negative.
+  static void set_cublas_stream(const int i);
+  // The number of blocks of CAFFE_CUDA_NUM_THREADS threads the current
+  // device runs at the same time, as many as its multiprocessors hold,
+  // queried at the first use on the device.
+  inline static int max_blocks() {
+    const int max_blocks = Get().max_blocks_;
+    return max_blocks ? max_blocks : QueryMaxBlocks();
+  }
 
   // Returns the mode: running on CPU or GPU.
   inline static Brew mode() { return Get().mode_; }
@@ -121,46 +167,145 @@ class Caffe {
   inline static void set_mode(Brew mode) { Get().mode_ = mode; }
   // Sets the phase.
   inline static void set_phase(Phase phase) { Get().phase_ = phase; }
+  // The number of threads the CPU layers may split a batch over, when Caffe
+  // is built with OpenMP (USE_OPENMP); 1 by default.
+  inline static int cpu_threads() { return Get().cpu_threads_; }
+  static void set_cpu_threads(const int cpu_threads);
+  // The file the engines picked by timing are kept in across runs (see
+  // util/engine_cache.hpp); none by default.
+  inline static const std::string& engine_cache_file() {
+    return Get().engine_cache_file_;
+  }
+  inline static void set_engine_cache_file(
+      const std::string& engine_cache_file) {
+    Get().engine_cache_file_ = engine_cache_file;
+  }
+  // The settings of a thread, for the threads it starts to run layers the
+  // same way, e.g. inference workers: they start out with the defaults. The
+  // device is -1 without one, and so is the NUMA node the thread is bound to
+  // (see util/numa.hpp).
+  struct ThreadSettings {
+    Brew mode;
+    Phase phase;
+    int device;
+    int numa_node;
+    int cpu_threads;
+    std::string engine_cache_file;
+  };
+  static ThreadSettings thread_settings();
+  // Applies settings to the calling thread. When it is the first use of
+  // Caffe in the thread, its handles are created on the device directly.
+  static void set_thread_settings(const ThreadSettings& settings);
   // Sets the random seed of both boost and curand
   static void set_random_seed(const unsigned int seed);
-  // Sets the device. Since we have cublas and curand stuff, set device also
-  // requires us to reset those values.
+  // Sets the device. Since we have cublas, curand and cusparse stuff, set
+  // device also requires us to reset those values.
   static void SetDevice(const int device_id);
+  // Lets device access the memory of peer directly if it can, so that their
+  // copies do not go through the host.
+  static void EnablePeerAccess(const int device, const int peer);
   // Prints the current GPU status.
   static void DeviceQuery();
 
  protected:
   cublasHandle_t cublas_handle_;
   curandGenerator_t curand_generator_;
+  cusparseHandle_t cusparse_handle_;
+  cusparseMatDescr_t cusparse_matrix_descr_;
   shared_ptr<RNG> random_generator_;
+  // Created at the first use
+  std::vector<cudaStream_t> cuda_streams_;
+  // 0 until queried
+  int max_blocks_;
 
   Brew mode_;
   Phase phase_;
-  static shared_ptr<Caffe> singleton_;
+  int cpu_threads_;
+  std::string engine_cache_file_;
+  static boost::thread_specific_ptr<Caffe> thread_instance_;
 
  private:
   // The private constructor to avoid duplicate instantiation.
   Caffe();
+  // Sets max_blocks_ for the current device, and returns it.
+  static int QueryMaxBlocks();
 
   DISABLE_COPY_AND_ASSIGN(Caffe);
 };
 
+// Runs the calling thread in mode while in scope, e.g. a layer placed on a
+// device of its own (see LayerParameter.device).
+class ModeScope {
+ public:
+  explicit ModeScope(const Caffe::Brew mode)
+      : previous_mode_(Caffe::mode()) {
+    Caffe::set_mode(mode);
+  }
+  ~ModeScope() { Caffe::set_mode(previous_mode_); }
+
+ private:
+  const Caffe::Brew previous_mode_;
+
+  DISABLE_COPY_AND_ASSIGN(ModeScope);
+};
+
+// Makes device, if not negative, the current device of the calling thread
+// while in scope, e.g. to update a parameter kept on another device (see
+// Layer::param_device). Only kernels may run in it: the cublas, curand and
+// cusparse handles of the thread stay those of its own device.
+class DeviceScope {
+ public:
+  explicit DeviceScope(const int device) : previous_device_(-1) {
+    if (device < 0) {
+      return;
+    }
+    CUDA_CHECK(cudaGetDevice(&previous_device_));
+    if (previous_device_ == device) {
+      previous_device_ = -1;
+      return;
+    }
+    CUDA_CHECK(cudaSetDevice(device));
+  }
+  ~DeviceScope() {
+    if (previous_device_ >= 0) {
+      CUDA_CHECK(cudaSetDevice(previous_device_));
+    }
+  }
+
+ private:
+  int previous_device_;
+
+  DISABLE_COPY_AND_ASSIGN(DeviceScope);
+};
+
 // NVIDIA_CUDA-5.5_Samples/common/inc/helper_cuda.h
 const char* cublasGetErrorString(cublasStatus_t error);
 const char* curandGetErrorString(curandStatus_t error);
+const char* cusparseGetErrorString(cusparseStatus_t error);
 
-// CUDA: thread number configuration.
-// Use 1024 threads per block, which requires cuda sm_2x or above,
-// or fall back to attempt compatibility (best of luck to you).
-#if __CUDA_ARCH__ >= 200
-    const int CAFFE_CUDA_NUM_THREADS = 1024;
-#else
-    const int CAFFE_CUDA_NUM_THREADS = 512;
-#endif
+// CUDA: thread number configuration. The same on the host, which launches
+// the kernels with it, and on the device, whose kernels may size their
+// shared memory with it: 512 threads, which every device runs at full
+// occupancy and which leaves the kernels up to 64 registers a thread on
+// those of 32K registers a block.
+const int CAFFE_CUDA_NUM_THREADS = 512;
+
+// CUDA: number of blocks for threads, capped at those the current device
+// runs at the same time (see Caffe::max_blocks): the kernels loop over N
+// with CUDA_KERNEL_LOOP, so the threads of a capped grid take several
+// elements each rather than blocks waiting for others to finish.
+inline int CAFFE_GET_BLOCKS(const int64_t N) {
+  return static_cast<int>(std::min<int64_t>(
+      (N + CAFFE_CUDA_NUM_THREADS - 1) / CAFFE_CUDA_NUM_THREADS,
+      Caffe::max_blocks()));
+}
 
-// CUDA: number of blocks for threads.
-inline int CAFFE_GET_BLOCKS(const int N) {
-  return (N + CAFFE_CUDA_NUM_THREADS - 1) / CAFFE_CUDA_NUM_THREADS;
+// CUDA: whether a kernel looping over N elements may index them with an int,
+// cheaper than an int64_t on the device: its grid stride loop must not
+// overflow past the last of them.
+inline bool CAFFE_INT32_INDEX(const int64_t N) {
+  return N <= INT_MAX - static_cast<int64_t>(CAFFE_CUDA_NUM_THREADS) *
+      Caffe::max_blocks();
 }
 
 
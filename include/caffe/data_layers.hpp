@@ -3,6 +3,7 @@
 #ifndef CAFFE_DATA_LAYERS_HPP_
 #define CAFFE_DATA_LAYERS_HPP_
 
+#include <deque>
 #include <string>
 #include <utility>
 #include <vector>
@@ -16,14 +17,36 @@
 #include "caffe/common.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/db.hpp"
+#include "caffe/util/file_list.hpp"
+#include "caffe/util/file_reader.hpp"
+#include "caffe/util/image_cache.hpp"
+#include "caffe/util/shuffled_db_reader.hpp"
+#include "caffe/util/window_list.hpp"
 
 namespace caffe {
 
 #define HDF5_DATA_DATASET_NAME "data"
 #define HDF5_DATA_LABEL_NAME "label"
 
+template <typename Dtype>
+class HDF5OutputLayer;
+
+// This function is used to create a pthread that writes the queued batches.
+template <typename Dtype>
+void* HDF5OutputLayerWrite(void* layer_pointer);
+
+// Appends the data and labels of every Forward to the chunked, extendable
+// datasets of an HDF5 file. Forward only copies the bottom blobs into one of
+// write_batches buffers, which a writer thread appends to the file, so that
+// the computation waits for the file only when the writer falls that many
+// batches behind. As with the HDF5DataLayer, only the writer thread makes
+// HDF5 calls between SetUp and the destructor.
 template <typename Dtype>
 class HDF5OutputLayer : public Layer<Dtype> {
+  friend void* HDF5OutputLayerWrite<Dtype>(void* layer_pointer);
+
  public:
   explicit HDF5OutputLayer(const LayerParameter& param);
   virtual ~HDF5OutputLayer();
@@ -40,20 +63,57 @@ class HDF5OutputLayer : public Layer<Dtype> {
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
-  virtual void SaveBlobs();
+  // Waits for a free buffer and copies the bottom blobs, on the GPU if gpu
+  // is set, into it, for the writer thread.
+  virtual void QueueBatch(const vector<Blob<Dtype>*>& bottom, const bool gpu);
+  // Writes the queued batches and stops the writer thread.
+  virtual void JoinWriteThread();
 
   std::string file_name_;
   hid_t file_id_;
-  Blob<Dtype> data_blob_;
-  Blob<Dtype> label_blob_;
+  hid_t data_dataset_id_;
+  hid_t label_dataset_id_;
+  // The values per row of the datasets
+  int data_row_size_;
+  int label_row_size_;
+  pthread_t thread_;
+  // The ring of write buffers: Forward fills the free ones, and the writer
+  // thread hands them back once written.
+  vector<shared_ptr<Blob<Dtype> > > write_data_;
+  vector<shared_ptr<Blob<Dtype> > > write_label_;
+  BlockingQueue<int> write_free_;
+  BlockingQueue<int> write_full_;
 };
 
 
+template <typename Dtype>
+class HDF5DataLayer;
+
+// This function is used to create a pthread that prefetches the data.
+template <typename Dtype>
+void* HDF5DataLayerPrefetch(void* layer_pointer);
+
+// This function fills the prefetch buffer batch_id with the next batch.
+template <typename Dtype>
+void HDF5DataLayerPrefetchBatch(HDF5DataLayer<Dtype>* layer,
+    const int batch_id);
+
+// Reads the rows of the HDF5 files listed in the source on a prefetch thread,
+// a batch at a time, so that memory use does not depend on the size of the
+// files. Only the prefetch thread makes HDF5 calls once SetUp returns, but
+// unless the HDF5 library is built thread safe, other HDF5 users in the same
+// process should not run at the same time.
 template <typename Dtype>
 class HDF5DataLayer : public Layer<Dtype> {
+  // The functions used to perform prefetching.
+  friend void* HDF5DataLayerPrefetch<Dtype>(void* layer_pointer);
+  friend void HDF5DataLayerPrefetchBatch<Dtype>(HDF5DataLayer<Dtype>* layer,
+      const int batch_id);
+
  public:
   explicit HDF5DataLayer(const LayerParameter& param)
-      : Layer<Dtype>(param) {}
+      : Layer<Dtype>(param), file_id_(-1), data_dataset_id_(-1),
+        label_dataset_id_(-1) {}
   virtual ~HDF5DataLayer();
   virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
@@ -67,35 +127,124 @@ class HDF5DataLayer : public Layer<Dtype> {
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
-  virtual void LoadHDF5FileData(const char* filename);
+  // Opens filename to read its rows from the first one on, closing the
+  // previous file.
+  virtual void OpenHDF5File(const char* filename);
+  virtual void CloseHDF5File();
+  // Moves on to the first row of the next file.
+  virtual void NextHDF5File();
+  virtual void ShuffleFiles();
+
+  virtual void CreatePrefetchThread();
+  virtual void JoinPrefetchThread();
+  virtual unsigned int PrefetchRand();
 
   std::vector<std::string> hdf_filenames_;
   unsigned int num_files_;
   unsigned int current_file_;
+  // The open file, its datasets, and the next row to read from them.
+  hid_t file_id_;
+  hid_t data_dataset_id_;
+  hid_t label_dataset_id_;
+  hsize_t file_rows_;
   hsize_t current_row_;
-  Blob<Dtype> data_blob_;
-  Blob<Dtype> label_blob_;
+  // The shapes of the datasets of the open file; these are never allocated.
+  Blob<Dtype> data_shape_;
+  Blob<Dtype> label_shape_;
+  shared_ptr<Caffe::RNG> prefetch_rng_;
+  pthread_t thread_;
+  // The ring of prefetch buffers, as for the DataLayer.
+  vector<shared_ptr<Blob<Dtype> > > prefetch_data_;
+  vector<shared_ptr<Blob<Dtype> > > prefetch_label_;
+  BlockingQueue<int> prefetch_free_;
+  BlockingQueue<int> prefetch_full_;
 };
 
 // TODO: DataLayer, ImageDataLayer, and WindowDataLayer all have the
 // same basic structure and a lot of duplicated code.
 
+template <typename Dtype>
+class DataLayer;
+
+// The wall clock time a DataLayer, ImageDataLayer or WindowDataLayer spent
+// on the batches Forward used, to tell whether the prefetching or the
+// computation is the bottleneck of training.
+struct DataLayerStats {
+  DataLayerStats()
+      : batches(0), wait_ms(0), prefetch_ms(0), read_ms(0), parse_ms(0),
+        decode_ms(0), transform_ms(0), copy_ms(0) {}
+
+  int batches;
+  // Forward waiting for the prefetch thread
+  double wait_ms;
+  // The prefetch thread producing the batches, reading, decoding and
+  // transforming included
+  double prefetch_ms;
+  // Reading the database, or waiting for the image files read ahead
+  double read_ms;
+  // The stages below are summed over the prefetch workers.
+  // Parsing the serialized datums
+  double parse_ms;
+  // Decoding the encoded images, along with reading the image files that are
+  // read and decoded at once
+  double decode_ms;
+  // Cropping, mirroring, warping and scaling the images into the batch
+  double transform_ms;
+  // Copying the batches to the device in the prefetch thread, if it has a
+  // stream to do so, and to the top blobs in CPU mode
+  double copy_ms;
+};
+
+// The share of a prefetched batch that one prefetch worker is responsible
+// for: the worker transforms items [item_begin, item_end) of the batch using
+// its own random number stream.
+template <typename Dtype>
+struct DataLayerPrefetchWorkerContext {
+  DataLayer<Dtype>* layer;
+  int batch_id;
+  int worker_id;
+  int item_begin;
+  int item_end;
+  // The time the worker spent parsing, decoding and transforming its share
+  // of the batch
+  double parse_ms;
+  double decode_ms;
+  double transform_ms;
+};
+
 // This function is used to create a pthread that prefetches the data.
 template <typename Dtype>
 void* DataLayerPrefetch(void* layer_pointer);
 
+// This function fills the prefetch buffer batch_id with the next batch.
+template <typename Dtype>
+void DataLayerPrefetchBatch(DataLayer<Dtype>* layer, const int batch_id);
+
+// This function is run by each prefetch worker to decode and transform its
+// share of the batch.
+template <typename Dtype>
+void* DataLayerPrefetchWorker(void* context_pointer);
+
 template <typename Dtype>
 class DataLayer : public Layer<Dtype> {
-  // The function used to perform prefetching.
+  // The functions used to perform prefetching.
   friend void* DataLayerPrefetch<Dtype>(void* layer_pointer);
+  friend void DataLayerPrefetchBatch<Dtype>(DataLayer<Dtype>* layer,
+      const int batch_id);
+  friend void* DataLayerPrefetchWorker<Dtype>(void* context_pointer);
 
  public:
   explicit DataLayer(const LayerParameter& param)
-      : Layer<Dtype>(param) {}
+      : Layer<Dtype>(param), prefetch_stream_(NULL), gpu_transform_(false),
+        gpu_resident_(false) {}
   virtual ~DataLayer();
   virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
 
+  // The time spent on the batches Forward used since the last ResetStats.
+  const DataLayerStats& stats() const { return stats_; }
+  void ResetStats() { stats_ = DataLayerStats(); }
+
  protected:
   virtual Dtype Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
@@ -108,31 +257,127 @@ class DataLayer : public Layer<Dtype> {
 
   virtual void CreatePrefetchThread();
   virtual void JoinPrefetchThread();
-  virtual unsigned int PrefetchRand();
-
-  shared_ptr<Caffe::RNG> prefetch_rng_;
-  shared_ptr<leveldb::DB> db_;
-  shared_ptr<leveldb::Iterator> iter_;
+  // Waits for the next prefetched batch, and returns its buffer, adding the
+  // time it took to stats_.
+  int PopPrefetchedBatch();
+  virtual unsigned int PrefetchRand(const int worker_id);
+  // Transforms the pixels of prefetched batch batch_id into top_data, as
+  // Forward_gpu does on the device when gpu_transform_ is set.
+  virtual void TransformPixels_cpu(const int batch_id, Dtype* top_data);
+  // Reads every datum of the shard into resident_pixels_ and
+  // resident_labels_, and sends them to the device.
+  virtual void LoadResidentData();
+  // Sets resident_batch_ to the items of the next batch, moving on to the
+  // next pass, reshuffled if asked to, at the end of the data.
+  virtual void NextResidentBatch();
+  // Forward_cpu when gpu_resident_ is set, in case the mode changed since
+  // SetUp: the batch is transformed on the host with host random numbers.
+  virtual void ResidentForward_cpu(vector<Blob<Dtype>*>* top);
+  virtual void ResidentForward_gpu(vector<Blob<Dtype>*>* top);
+
+  // One random number stream per prefetch worker.
+  vector<shared_ptr<Caffe::RNG> > prefetch_rngs_;
+  vector<DataLayerPrefetchWorkerContext<Dtype> > prefetch_workers_;
+  // The serialized datums of the batch being prefetched, read sequentially
+  // from the database before being handed out to the workers.
+  vector<std::string> prefetch_values_;
+  shared_ptr<DB> db_;
+  shared_ptr<DBCursor> cursor_;
+  // With data_param().shuffle(), what the prefetch thread reads the datums
+  // from instead of cursor_
+  shared_ptr<ShuffledDBReader> shuffled_reader_;
   int datum_channels_;
   int datum_height_;
   int datum_width_;
   int datum_size_;
   pthread_t thread_;
-  shared_ptr<Blob<Dtype> > prefetch_data_;
-  shared_ptr<Blob<Dtype> > prefetch_label_;
+  // The ring of prefetch buffers. The indices of the buffers waiting to be
+  // filled travel to the prefetch thread through prefetch_free_ and those of
+  // the filled batches come back through prefetch_full_; a negative index
+  // asks the prefetch thread to exit.
+  vector<shared_ptr<Blob<Dtype> > > prefetch_data_;
+  vector<shared_ptr<Blob<Dtype> > > prefetch_label_;
+  // The phase Forward was running in when it handed each buffer back.
+  vector<Caffe::Phase> prefetch_phase_;
+  // The time the prefetch thread spent on the batch in each buffer, and that
+  // summed over the batches Forward popped. Each travels with its buffer, so
+  // only the thread holding the buffer touches it.
+  vector<DataLayerStats> prefetch_stats_;
+  DataLayerStats stats_;
+  BlockingQueue<int> prefetch_free_;
+  BlockingQueue<int> prefetch_full_;
+  // In GPU mode, the stream the prefetch thread copies the filled batches to
+  // the device on, and the device it does so for.
+  cudaStream_t prefetch_stream_;
+  int prefetch_device_;
+  // With data_param().gpu_transform() in GPU mode, the prefetch buffers hold
+  // the uint8 pixels of the batches and the h_off, w_off and mirror of each
+  // of their items, and Forward_gpu transforms them on the device;
+  // prefetch_data_ is then only used for its shape.
+  bool gpu_transform_;
+  vector<shared_ptr<SyncedMemory> > prefetch_pixels_;
+  vector<shared_ptr<SyncedMemory> > prefetch_crops_;
+  // With data_param().gpu_resident() in GPU mode, the uint8 pixels and the
+  // labels of all the datums of the shard, and there is no prefetch thread.
+  // resident_order_ is the order of the items for the current pass, and
+  // resident_position_ the position in it of the next one; resident_batch_
+  // holds the items of the batch and resident_rand_ 3 random numbers per
+  // item for its crop and mirror.
+  bool gpu_resident_;
+  shared_ptr<SyncedMemory> resident_pixels_;
+  Blob<Dtype> resident_labels_;
+  vector<int> resident_order_;
+  int resident_position_;
+  shared_ptr<SyncedMemory> resident_batch_;
+  shared_ptr<SyncedMemory> resident_rand_;
   Blob<Dtype> data_mean_;
+  // The per channel mean values, used instead of data_mean_ if given.
+  vector<Dtype> mean_values_;
   bool output_labels_;
+  // The phase of the batch being prefetched.
   Caffe::Phase phase_;
 };
 
+template <typename Dtype>
+class ImageDataLayer;
+
+// The share of a prefetched batch that one prefetch worker is responsible
+// for, as for the DataLayer.
+template <typename Dtype>
+struct ImageDataLayerPrefetchWorkerContext {
+  ImageDataLayer<Dtype>* layer;
+  int batch_id;
+  int worker_id;
+  int item_begin;
+  int item_end;
+  // The time the worker spent waiting for the reads, decoding and
+  // transforming its share of the batch
+  double read_ms;
+  double decode_ms;
+  double transform_ms;
+};
+
 // This function is used to create a pthread that prefetches the data.
 template <typename Dtype>
 void* ImageDataLayerPrefetch(void* layer_pointer);
 
+// This function fills the prefetch buffer batch_id with the next batch.
+template <typename Dtype>
+void ImageDataLayerPrefetchBatch(ImageDataLayer<Dtype>* layer,
+    const int batch_id);
+
+// This function is run by each prefetch worker to decode and transform the
+// images of its share of the batch.
+template <typename Dtype>
+void* ImageDataLayerPrefetchWorker(void* context_pointer);
+
 template <typename Dtype>
 class ImageDataLayer : public Layer<Dtype> {
-  // The function used to perform prefetching.
+  // The functions used to perform prefetching.
   friend void* ImageDataLayerPrefetch<Dtype>(void* layer_pointer);
+  friend void ImageDataLayerPrefetchBatch<Dtype>(ImageDataLayer<Dtype>* layer,
+      const int batch_id);
+  friend void* ImageDataLayerPrefetchWorker<Dtype>(void* context_pointer);
 
  public:
   explicit ImageDataLayer(const LayerParameter& param)
@@ -141,6 +386,10 @@ class ImageDataLayer : public Layer<Dtype> {
   virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
 
+  // The time spent on the batches Forward used since the last ResetStats.
+  const DataLayerStats& stats() const { return stats_; }
+  void ResetStats() { stats_ = DataLayerStats(); }
+
  protected:
   virtual Dtype Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
@@ -152,42 +401,131 @@ class ImageDataLayer : public Layer<Dtype> {
       const bool propagate_down, vector<Blob<Dtype>*>* bottom) { return; }
 
   virtual void ShuffleImages();
+  // The line of lines_ to read next, moving on, and shuffling at the end of
+  // an epoch.
+  int NextLine();
+  // Puts each image in the bucket of the closest aspect ratio, see
+  // ImageDataParameter.bucket_height.
+  void AssignBuckets();
 
   virtual void CreatePrefetchThread();
   virtual void JoinPrefetchThread();
+  // Waits for the next prefetched batch, and returns its buffer, adding the
+  // time it took to stats_.
+  int PopPrefetchedBatch();
   virtual unsigned int PrefetchRand();
+  virtual unsigned int PrefetchRand(const int worker_id);
 
+  // The random number stream used to shuffle the images.
   shared_ptr<Caffe::RNG> prefetch_rng_;
-  vector<std::pair<std::string, int> > lines_;
+  // One random number stream per prefetch worker, used for cropping and
+  // mirroring.
+  vector<shared_ptr<Caffe::RNG> > prefetch_rngs_;
+  vector<ImageDataLayerPrefetchWorkerContext<Dtype> > prefetch_workers_;
+  // The images of the batch being prefetched, picked sequentially in the
+  // order of lines_order_ before being handed out to the workers.
+  vector<std::pair<std::string, int> > prefetch_lines_;
+  // The decoded images, if image_data_param().cache_size_mb() is set.
+  shared_ptr<ImageCache> image_cache_;
+  // With image_data_param().io_threads(), the reader of the image files,
+  // the lines picked ahead with their reads, NULL for the images that were
+  // cached then, and the reads of the batch being prefetched.
+  shared_ptr<AsyncFileReader> file_reader_;
+  std::deque<std::pair<int, shared_ptr<FileRead> > > read_ahead_;
+  vector<shared_ptr<FileRead> > prefetch_reads_;
+  FileList lines_;
+  // The indices of lines_ in the order they are read, which shuffling
+  // permutes instead of the file names themselves.
+  vector<int> lines_order_;
   int lines_id_;
+  // With buckets, the shape of each, the bucket of each line of lines_, and
+  // the lines picked but not batched yet of each bucket, a batch being
+  // taken from the first to hold batch_size of them
+  vector<int> bucket_heights_;
+  vector<int> bucket_widths_;
+  vector<int> line_buckets_;
+  vector<std::deque<int> > bucket_lines_;
   int datum_channels_;
   int datum_height_;
   int datum_width_;
   int datum_size_;
   pthread_t thread_;
-  shared_ptr<Blob<Dtype> > prefetch_data_;
-  shared_ptr<Blob<Dtype> > prefetch_label_;
+  // The ring of prefetch buffers. The indices of the buffers waiting to be
+  // filled travel to the prefetch thread through prefetch_free_ and those of
+  // the filled batches come back through prefetch_full_; a negative index
+  // asks the prefetch thread to exit.
+  vector<shared_ptr<Blob<Dtype> > > prefetch_data_;
+  vector<shared_ptr<Blob<Dtype> > > prefetch_label_;
+  // The phase Forward was running in when it handed each buffer back.
+  vector<Caffe::Phase> prefetch_phase_;
+  // The time the prefetch thread spent on the batch in each buffer, and that
+  // summed over the batches Forward popped. Each travels with its buffer, so
+  // only the thread holding the buffer touches it.
+  vector<DataLayerStats> prefetch_stats_;
+  DataLayerStats stats_;
+  BlockingQueue<int> prefetch_free_;
+  BlockingQueue<int> prefetch_full_;
   Blob<Dtype> data_mean_;
+  // The per channel mean values, used instead of data_mean_ if given.
+  vector<Dtype> mean_values_;
+  // The phase of the batch being prefetched.
   Caffe::Phase phase_;
 };
 
 
+template <typename Dtype>
+class WindowDataLayer;
+
+// The share of the windows of a prefetched batch that one prefetch worker
+// crops and warps: items [item_begin, item_end) of the processing order.
+template <typename Dtype>
+struct WindowDataLayerPrefetchWorkerContext {
+  WindowDataLayer<Dtype>* layer;
+  int batch_id;
+  int item_begin;
+  int item_end;
+  // The time the worker spent reading and decoding the images, and cropping
+  // and warping the windows of its share of the batch
+  double decode_ms;
+  double transform_ms;
+  // With gpu_transform, the bytes of the images the worker copied to its
+  // region of the pixels of the batch
+  int pixel_bytes;
+};
+
 // This function is used to create a pthread that prefetches the window data.
 template <typename Dtype>
 void* WindowDataLayerPrefetch(void* layer_pointer);
 
+// This function fills the prefetch buffer batch_id with the next batch.
+template <typename Dtype>
+void WindowDataLayerPrefetchBatch(WindowDataLayer<Dtype>* layer,
+    const int batch_id);
+
+// This function is run by each prefetch worker to crop and warp its share of
+// the windows of the batch.
+template <typename Dtype>
+void* WindowDataLayerPrefetchWorker(void* context_pointer);
+
 template <typename Dtype>
 class WindowDataLayer : public Layer<Dtype> {
-  // The function used to perform prefetching.
+  // The functions used to perform prefetching.
   friend void* WindowDataLayerPrefetch<Dtype>(void* layer_pointer);
+  friend void WindowDataLayerPrefetchBatch<Dtype>(
+      WindowDataLayer<Dtype>* layer, const int batch_id);
+  friend void* WindowDataLayerPrefetchWorker<Dtype>(void* context_pointer);
 
  public:
   explicit WindowDataLayer(const LayerParameter& param)
-      : Layer<Dtype>(param) {}
+      : Layer<Dtype>(param), gpu_transform_(false), max_image_bytes_(0) {}
   virtual ~WindowDataLayer();
   virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
 
+  // The time spent on the batches Forward used since the last ResetStats.
+  const DataLayerStats& stats() const { return stats_; }
+  void ResetStats() { stats_ = DataLayerStats(); }
+
  protected:
   virtual Dtype Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
@@ -200,17 +538,68 @@ class WindowDataLayer : public Layer<Dtype> {
 
   virtual void CreatePrefetchThread();
   virtual void JoinPrefetchThread();
+  // Waits for the next prefetched batch, and returns its buffer, adding the
+  // time it took to stats_.
+  int PopPrefetchedBatch();
   virtual unsigned int PrefetchRand();
+  // Warps the windows of prefetched batch batch_id into top_data, as
+  // Forward_gpu does on the device when gpu_transform_ is set.
+  virtual void TransformWindows_cpu(const int batch_id, Dtype* top_data);
+
+  // The parameters of the warp of a window, per item of a batch, with
+  // gpu_transform_: the offset of its image in the pixels of the batch and
+  // the width of the image, the x, y, width and height of the window in the
+  // image, the x and y of the warped window in the item, its width and
+  // height (0 if the image could not be read), and whether it is mirrored.
+  static const int kWarpParams = 11;
 
   shared_ptr<Caffe::RNG> prefetch_rng_;
+  vector<WindowDataLayerPrefetchWorkerContext<Dtype> > prefetch_workers_;
+  // The indices of the windows sampled for the batch being prefetched and
+  // whether to mirror them. The workers process them in prefetch_order_, by
+  // (image index, item) so that an image is decoded once for all of its
+  // windows in the batch.
+  vector<int> prefetch_windows_;
+  vector<bool> prefetch_mirror_;
+  vector<std::pair<int, int> > prefetch_order_;
+  // The decoded images, if window_data_param().cache_size_mb() is set.
+  shared_ptr<ImageCache> image_cache_;
   pthread_t thread_;
-  shared_ptr<Blob<Dtype> > prefetch_data_;
-  shared_ptr<Blob<Dtype> > prefetch_label_;
+  // The ring of prefetch buffers. The indices of the buffers waiting to be
+  // filled travel to the prefetch thread through prefetch_free_ and those of
+  // the filled batches come back through prefetch_full_; a negative index
+  // asks the prefetch thread to exit.
+  vector<shared_ptr<Blob<Dtype> > > prefetch_data_;
+  vector<shared_ptr<Blob<Dtype> > > prefetch_label_;
+  // The time the prefetch thread spent on the batch in each buffer, and that
+  // summed over the batches Forward popped, as for the DataLayer.
+  vector<DataLayerStats> prefetch_stats_;
+  DataLayerStats stats_;
+  BlockingQueue<int> prefetch_free_;
+  BlockingQueue<int> prefetch_full_;
+  // With window_data_param().gpu_transform() in GPU mode, the prefetch
+  // buffers hold the interleaved uint8 pixels of the images of the batches,
+  // and the kWarpParams of each of their items, and Forward_gpu warps the
+  // windows on the device; prefetch_data_ is then only used for its shape.
+  // Each worker copies the images of its share of the batch to a region of
+  // max_image_bytes_ per item, starting at item_begin, and the bytes of each
+  // region are kept per batch in prefetch_pixel_bytes_, for Forward_gpu to
+  // copy those only to gpu_pixels_.
+  bool gpu_transform_;
+  int max_image_bytes_;
+  vector<shared_ptr<SyncedMemory> > prefetch_pixels_;
+  vector<shared_ptr<SyncedMemory> > prefetch_warps_;
+  vector<vector<int> > prefetch_pixel_bytes_;
+  shared_ptr<SyncedMemory> gpu_pixels_;
+  // The mean image; with gpu_transform_, one of the crop size filled with
+  // the mean_values_ if they are given.
   Blob<Dtype> data_mean_;
-  vector<std::pair<std::string, vector<int> > > image_database_;
-  enum WindowField { IMAGE_INDEX, LABEL, OVERLAP, X1, Y1, X2, Y2, NUM };
-  vector<vector<float> > fg_windows_;
-  vector<vector<float> > bg_windows_;
+  // The per channel mean values, used instead of data_mean_ if given.
+  vector<Dtype> mean_values_;
+  WindowList windows_;
+  // The indices in windows_ of the foreground and background windows.
+  vector<int> fg_windows_;
+  vector<int> bg_windows_;
 };
 
 }  // namespace caffe
@@ -1,8 +1,8 @@
 // Copyright 2014 BVLC and contributors.
 
 // Fillers are random number generators that fills a blob using the specified
-// algorithm. The expectation is that they are only going to be used during
-// initialization time and will not involve any GPUs.
+// algorithm. They draw counter-based Philox numbers, on the GPU in GPU mode
+// and over the CPU threads otherwise, the same either way for a given seed.
 
 #ifndef CAFFE_FILLER_HPP
 #define CAFFE_FILLER_HPP
@@ -11,7 +11,6 @@
 
 #include "caffe/common.hpp"
 #include "caffe/blob.hpp"
-#include "caffe/syncedmem.hpp"
 #include "caffe/util/math_functions.hpp"
 #include "caffe/proto/caffe.pb.h"
 
@@ -24,6 +23,34 @@ class Filler {
   virtual ~Filler() {}
   virtual void Fill(Blob<Dtype>* blob) = 0;
  protected:
+  // A key of Philox numbers of its own for each fill, drawn from the Caffe
+  // RNG so that fills follow its seed
+  static void NewKey(uint32_t key[2]) {
+    key[0] = caffe_rng_rand();
+    key[1] = caffe_rng_rand();
+  }
+  // Fills the data of blob where it is used in the current mode.
+  static void FillUniform(const Dtype a, const Dtype b, const uint32_t key[2],
+      Blob<Dtype>* blob) {
+    if (Caffe::mode() == Caffe::GPU) {
+      caffe_gpu_philox_uniform<Dtype>(blob->count(), a, b, key,
+          blob->mutable_gpu_data());
+    } else {
+      caffe_philox_uniform<Dtype>(blob->count(), a, b, key,
+          blob->mutable_cpu_data());
+    }
+  }
+  static void FillGaussian(const Dtype mu, const Dtype sigma,
+      const uint32_t key[2], Blob<Dtype>* blob) {
+    if (Caffe::mode() == Caffe::GPU) {
+      caffe_gpu_philox_gaussian<Dtype>(blob->count(), mu, sigma, key,
+          blob->mutable_gpu_data());
+    } else {
+      caffe_philox_gaussian<Dtype>(blob->count(), mu, sigma, key,
+          blob->mutable_cpu_data());
+    }
+  }
+
   FillerParameter filler_param_;
 };  // class Filler
 
@@ -34,12 +61,13 @@ class ConstantFiller : public Filler<Dtype> {
   explicit ConstantFiller(const FillerParameter& param)
       : Filler<Dtype>(param) {}
   virtual void Fill(Blob<Dtype>* blob) {
-    Dtype* data = blob->mutable_cpu_data();
     const int count = blob->count();
     const Dtype value = this->filler_param_.value();
     CHECK(count);
-    for (int i = 0; i < count; ++i) {
-      data[i] = value;
+    if (Caffe::mode() == Caffe::GPU) {
+      caffe_gpu_set(count, value, blob->mutable_gpu_data());
+    } else {
+      caffe_set(count, value, blob->mutable_cpu_data());
     }
     CHECK_EQ(this->filler_param_.sparse(), -1)
          << "Sparsity not supported by this Filler.";
@@ -53,8 +81,10 @@ class UniformFiller : public Filler<Dtype> {
       : Filler<Dtype>(param) {}
   virtual void Fill(Blob<Dtype>* blob) {
     CHECK(blob->count());
-    caffe_rng_uniform<Dtype>(blob->count(), Dtype(this->filler_param_.min()),
-        Dtype(this->filler_param_.max()), blob->mutable_cpu_data());
+    uint32_t key[2];
+    this->NewKey(key);
+    this->FillUniform(Dtype(this->filler_param_.min()),
+        Dtype(this->filler_param_.max()), key, blob);
     CHECK_EQ(this->filler_param_.sparse(), -1)
          << "Sparsity not supported by this Filler.";
   }
@@ -66,10 +96,11 @@ class GaussianFiller : public Filler<Dtype> {
   explicit GaussianFiller(const FillerParameter& param)
       : Filler<Dtype>(param) {}
   virtual void Fill(Blob<Dtype>* blob) {
-    Dtype* data = blob->mutable_cpu_data();
     CHECK(blob->count());
-    caffe_rng_gaussian<Dtype>(blob->count(), Dtype(this->filler_param_.mean()),
-        Dtype(this->filler_param_.std()), blob->mutable_cpu_data());
+    uint32_t key[2];
+    this->NewKey(key);
+    this->FillGaussian(Dtype(this->filler_param_.mean()),
+        Dtype(this->filler_param_.std()), key, blob);
     int sparse = this->filler_param_.sparse();
     CHECK_GE(sparse, -1);
     if (sparse >= 0) {
@@ -81,17 +112,16 @@ class GaussianFiller : public Filler<Dtype> {
       CHECK_EQ(blob->channels(), 1);
       int num_inputs = blob->height();
       Dtype non_zero_probability = Dtype(sparse) / Dtype(num_inputs);
-      rand_vec_.reset(new SyncedMemory(blob->count() * sizeof(int)));
-      int* mask = reinterpret_cast<int*>(rand_vec_->mutable_cpu_data());
-      caffe_rng_bernoulli(blob->count(), non_zero_probability, mask);
-      for (int i = 0; i < blob->count(); ++i) {
-        data[i] *= mask[i];
+      // The mask is stream 1 of the key of the weights.
+      if (Caffe::mode() == Caffe::GPU) {
+        caffe_gpu_philox_bernoulli_mask(blob->count(), non_zero_probability,
+            key, blob->mutable_gpu_data());
+      } else {
+        caffe_philox_bernoulli_mask(blob->count(), non_zero_probability, key,
+            blob->mutable_cpu_data());
       }
     }
   }
-
- protected:
-  shared_ptr<SyncedMemory> rand_vec_;
 };
 
 template <typename Dtype>
@@ -100,11 +130,13 @@ class PositiveUnitballFiller : public Filler<Dtype> {
   explicit PositiveUnitballFiller(const FillerParameter& param)
       : Filler<Dtype>(param) {}
   virtual void Fill(Blob<Dtype>* blob) {
-    Dtype* data = blob->mutable_cpu_data();
     DCHECK(blob->count());
-    caffe_rng_uniform<Dtype>(blob->count(), 0, 1, blob->mutable_cpu_data());
+    uint32_t key[2];
+    this->NewKey(key);
+    this->FillUniform(Dtype(0), Dtype(1), key, blob);
     // We expect the filler to not be called very frequently, so we will
     // just use a simple implementation
+    Dtype* data = blob->mutable_cpu_data();
     int dim = blob->count() / blob->num();
     CHECK(dim);
     for (int i = 0; i < blob->num(); ++i) {
@@ -138,8 +170,9 @@ class XavierFiller : public Filler<Dtype> {
     CHECK(blob->count());
     int fan_in = blob->count() / blob->num();
     Dtype scale = sqrt(Dtype(3) / fan_in);
-    caffe_rng_uniform<Dtype>(blob->count(), -scale, scale,
-        blob->mutable_cpu_data());
+    uint32_t key[2];
+    this->NewKey(key);
+    this->FillUniform(-scale, scale, key, blob);
     CHECK_EQ(this->filler_param_.sparse(), -1)
          << "Sparsity not supported by this Filler.";
   }
@@ -19,7 +19,9 @@ class Layer {
   // to SetUp(), where the dimensions of the bottom blobs are provided to the
   // layer.
   explicit Layer(const LayerParameter& param)
-    : layer_param_(param) {
+    : layer_param_(param), accumulate_param_diffs_(false),
+      accumulate_bottom_diffs_(false), recomputing_(false), device_id_(-1),
+      device_loss_(NULL) {
       // The only thing we do is to copy blobs if there are any.
       if (layer_param_.blobs_size() > 0) {
         blobs_.resize(layer_param_.blobs_size());
@@ -33,6 +35,18 @@ class Layer {
   // SetUp: your function should implement this.
   virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) = 0;
+  // Reshape: adapts a layer set up already to bottoms of another num, e.g.
+  // another batch size, leaving its parameters as they are. By default the
+  // tops take the num of the first bottom and keep their other dimensions;
+  // layers with buffers or state depending on the num override it. Layers
+  // without bottoms keep their shape.
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  // Whether Reshape also adapts the layer to bottoms of another height and
+  // width, e.g. the batches of the buckets of an ImageDataLayer, reshaping
+  // its tops to them or checking that it can take them. The net checks
+  // that the bottoms of the other layers keep the shape SetUp saw.
+  virtual bool can_reshape_spatially() const { return false; }
 
   // Forward and backward wrappers. You should implement the cpu and
   // gpu specific implementations instead, and should not change these
@@ -42,12 +56,104 @@ class Layer {
   inline void Backward(const vector<Blob<Dtype>*>& top,
       const bool propagate_down,
       vector<Blob<Dtype>*>* bottom);
+  // Forward and Backward in mode, the mode() of the layer, with the calling
+  // thread already in it: those of the execution plan of Net, which
+  // resolves the modes of its layers once rather than on every pass.
+  inline Dtype ForwardIn(const Caffe::Brew mode,
+      const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top);
+  inline void BackwardIn(const Caffe::Brew mode,
+      const vector<Blob<Dtype>*>& top, const bool propagate_down,
+      vector<Blob<Dtype>*>* bottom);
 
   // Returns the vector of blobs.
   vector<shared_ptr<Blob<Dtype> > >& blobs() {
     return blobs_;
   }
 
+  // Whether Backward adds the gradients of the parameters to their diffs,
+  // rather than overwriting them, e.g. to sum them over several batches.
+  inline bool accumulate_param_diffs() const {
+    return accumulate_param_diffs_;
+  }
+  inline void set_accumulate_param_diffs(const bool accumulate) {
+    accumulate_param_diffs_ = accumulate;
+  }
+  // Whether Backward adds the gradient of the bottom to its diff, rather than
+  // overwriting it -- set by the net on the consumers of a split that share
+  // its bottom diff (see NetParameter.accumulate_split_diffs). Only layers
+  // with one bottom whose can_accumulate_bottom_diffs() is true support it.
+  inline bool accumulate_bottom_diffs() const {
+    return accumulate_bottom_diffs_;
+  }
+  inline void set_accumulate_bottom_diffs(const bool accumulate) {
+    CHECK(!accumulate || can_accumulate_bottom_diffs())
+        << layer_param_.name() << " cannot accumulate its bottom diff.";
+    accumulate_bottom_diffs_ = accumulate;
+  }
+  virtual bool can_accumulate_bottom_diffs() const { return false; }
+  // Whether Forward runs again over the bottoms of the last pass, to compute
+  // the tops the net freed since (see NetParameter.checkpoint_interval): the
+  // layers drawing random numbers in Forward then reuse those of that pass.
+  inline bool recomputing() const { return recomputing_; }
+  inline void set_recomputing(const bool recomputing) {
+    recomputing_ = recomputing;
+  }
+  // Whether Backward computes the gradient of blobs_[param_id], by default
+  // that of every one; the net skips those with a blobs_lr of 0.
+  inline bool param_propagate_down(const int param_id) const {
+    return param_id >= param_propagate_down_.size() ||
+        param_propagate_down_[param_id];
+  }
+  inline void set_param_propagate_down(const int param_id,
+      const bool propagate_down) {
+    if (param_propagate_down_.size() <= param_id) {
+      param_propagate_down_.resize(param_id + 1, true);
+    }
+    param_propagate_down_[param_id] = propagate_down;
+  }
+
+  // The mode the layer runs in: that of layer_param().device() if set, the
+  // mode of the calling thread otherwise.
+  inline Caffe::Brew mode() const {
+    switch (layer_param_.device()) {
+    case LayerParameter_Device_CPU:
+      return Caffe::CPU;
+    case LayerParameter_Device_GPU:
+      return Caffe::GPU;
+    default:
+      return Caffe::mode();
+    }
+  }
+
+  // The GPU the layer runs on when not the device of the net, e.g. that of
+  // its stage of a Pipeline; -1 otherwise.
+  inline int device_id() const { return device_id_; }
+  inline void set_device_id(const int device_id) { device_id_ = device_id; }
+  // The GPU blobs_[param_id] is kept on and used from, when not the device
+  // of the net, e.g. by a layer split model parallel over several GPUs;
+  // device_id() by default. The solver updates it there.
+  virtual int param_device(const int param_id) const { return device_id_; }
+  // A scalar on the device, or NULL, the default: when set, the loss layers
+  // whose Forward_gpu supports it (softmax with loss, Euclidean, hinge,
+  // multinomial logistic and infogain losses) add their loss to it there
+  // and return 0, so that the host does not wait for the device to read
+  // the loss (see Net::set_device_loss). Forward_cpu ignores it.
+  inline Dtype* device_loss() const { return device_loss_; }
+  inline void set_device_loss(Dtype* device_loss) {
+    device_loss_ = device_loss;
+  }
+  // Whether the loss layer can give the loss of each item of its bottoms:
+  // once set_item_losses(true), Forward writes them into item_losses() in
+  // the TRAIN phase, e.g. for the net to select the hard examples of the
+  // batch (see Net::set_hard_examples).
+  virtual bool can_compute_item_losses() const { return false; }
+  inline void set_item_losses(const bool item_losses) {
+    CHECK(!item_losses || can_compute_item_losses())
+        << layer_param_.name() << " cannot give the losses of its items.";
+    item_losses_.reset(item_losses ? new Blob<Dtype>() : NULL);
+  }
+  inline const Blob<Dtype>* item_losses() const { return item_losses_.get(); }
+
   // Returns the layer parameter
   const LayerParameter& layer_param() { return layer_param_; }
   // Writes the layer parameter to a protocol buffer
@@ -58,6 +164,13 @@ class Layer {
   LayerParameter layer_param_;
   // The vector that stores the parameters as a set of blobs.
   vector<shared_ptr<Blob<Dtype> > > blobs_;
+  bool accumulate_param_diffs_;
+  bool accumulate_bottom_diffs_;
+  bool recomputing_;
+  vector<bool> param_propagate_down_;
+  int device_id_;
+  Dtype* device_loss_;
+  shared_ptr<Blob<Dtype> > item_losses_;
 
   // Forward functions: compute the layer output
   // (and loss layers return the loss; other layers return the dummy value 0.)
@@ -85,13 +198,45 @@ class Layer {
   DISABLE_COPY_AND_ASSIGN(Layer);
 };  // class Layer
 
+template <typename Dtype>
+void Layer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+    vector<Blob<Dtype>*>* top) {
+  if (bottom.empty()) {
+    return;
+  }
+  for (int i = 0; i < top->size(); ++i) {
+    Blob<Dtype>* top_blob = (*top)[i];
+    // A layer run in place has its top reshaped already.
+    if (top_blob == bottom[0]) {
+      continue;
+    }
+    top_blob->Reshape(bottom[0]->num(), top_blob->channels(),
+        top_blob->height(), top_blob->width());
+  }
+}
+
 // Forward and backward wrappers. You should implement the cpu and
 // gpu specific implementations instead, and should not change these
 // functions.
 template <typename Dtype>
 inline Dtype Layer<Dtype>::Forward(const vector<Blob<Dtype>*>& bottom,
     vector<Blob<Dtype>*>* top) {
-  switch (Caffe::mode()) {
+  ModeScope mode_scope(mode());
+  return ForwardIn(Caffe::mode(), bottom, top);
+}
+
+template <typename Dtype>
+inline void Layer<Dtype>::Backward(const vector<Blob<Dtype>*>& top,
+    const bool propagate_down,
+    vector<Blob<Dtype>*>* bottom) {
+  ModeScope mode_scope(mode());
+  BackwardIn(Caffe::mode(), top, propagate_down, bottom);
+}
+
+template <typename Dtype>
+inline Dtype Layer<Dtype>::ForwardIn(const Caffe::Brew mode,
+    const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
+  switch (mode) {
   case Caffe::CPU:
     return Forward_cpu(bottom, top);
   case Caffe::GPU:
@@ -103,10 +248,10 @@ inline Dtype Layer<Dtype>::Forward(const vector<Blob<Dtype>*>& bottom,
 }
 
 template <typename Dtype>
-inline void Layer<Dtype>::Backward(const vector<Blob<Dtype>*>& top,
-    const bool propagate_down,
+inline void Layer<Dtype>::BackwardIn(const Caffe::Brew mode,
+    const vector<Blob<Dtype>*>& top, const bool propagate_down,
     vector<Blob<Dtype>*>* bottom) {
-  switch (Caffe::mode()) {
+  switch (mode) {
   case Caffe::CPU:
     Backward_cpu(top, propagate_down, bottom);
     break;
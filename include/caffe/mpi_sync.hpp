@@ -0,0 +1,94 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_MPI_SYNC_HPP_
+#define CAFFE_MPI_SYNC_HPP_
+
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/syncedmem.hpp"
+
+namespace caffe {
+
+// The processes of a training over several nodes, started by mpirun. MPI is
+// only used when built with USE_MPI (see Makefile.config); otherwise, as when
+// not started by mpirun, there is a single process, of rank 0.
+void MPIInit(int* argc, char*** argv);
+void MPIFinalize();
+int MPIRank();
+int MPISize();
+
+// Synchronizes the train nets of the MPISize() processes of a data parallel
+// training, each running a Solver on its own share of the data (see
+// DataParameter.num_shards). Of a staleness of 0, the gradients are averaged
+// before every update, as for a batch MPISize() times larger. Otherwise each
+// process updates its weights from its own gradients, and the weights are
+// averaged every staleness + 1 iterations: they drift at most that many
+// updates apart, for as many times fewer exchanges.
+template <typename Dtype>
+class MPISync {
+ public:
+  MPISync(Net<Dtype>* net, const int staleness);
+  virtual ~MPISync() {}
+
+  // Sets the weights of every process to those of rank 0.
+  void BroadcastWeights();
+  // Called after the backward pass of each iteration: averages the gradients
+  // and the losses of the processes if the staleness is 0. Returns the mean
+  // loss, or loss itself if only the weights are averaged.
+  Dtype SyncGradients(const Dtype loss);
+  // Has SyncGradients send the gradients encoded, each parameter blob in
+  // turn (see SolverParameter.gradient_compression), every process then
+  // gathering the encodings of all of them rather than summing the
+  // gradients, and decoding them in the same order.
+  void set_gradient_compression(
+      const SolverParameter_GradientCompression compression,
+      const float top_k, const bool error_feedback);
+  // Called after the update of iteration iter: averages the weights if the
+  // staleness is above 0 and it is their turn.
+  void SyncWeights(const int iter);
+
+ protected:
+  // Copies the data, or the diffs, of the parameters of net_ to buffer_ and
+  // back: of the memory of each blob, or of all of them at once if they are
+  // packed.
+  void Pack(const bool diff);
+  void Unpack(const bool diff);
+  // Sums the first count values of buffer_ over the processes, in place.
+  void Allreduce(const int count);
+  // SyncGradients with a compression
+  Dtype SyncCompressedGradients(const Dtype loss);
+
+  Net<Dtype>* net_;
+  int staleness_;
+  // The memory of the data and of the diffs of the parameters, and the
+  // number of values of each
+  vector<shared_ptr<SyncedMemory> > data_parts_;
+  vector<shared_ptr<SyncedMemory> > diff_parts_;
+  vector<int> part_counts_;
+  int param_count_;
+  // The parameters, followed by the loss, on the host
+  shared_ptr<SyncedMemory> buffer_;
+  // The offset in buffer_ and the count of each parameter blob
+  vector<int> param_offsets_;
+  vector<int> param_counts_;
+  SolverParameter_GradientCompression compression_;
+  float top_k_;
+  // What the encodings lost of each value of buffer_, empty without error
+  // feedback
+  vector<Dtype> errors_;
+  // The encoding of the loss and the gradients of this process, and those
+  // of all of them, of the sizes and at the offsets given
+  vector<char> message_;
+  vector<char> messages_;
+  vector<int> message_sizes_;
+  vector<int> message_offsets_;
+
+  DISABLE_COPY_AND_ASSIGN(MPISync);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_MPI_SYNC_HPP_
@@ -3,6 +3,8 @@
 #ifndef CAFFE_NET_HPP_
 #define CAFFE_NET_HPP_
 
+#include <stdint.h>
+
 #include <map>
 #include <string>
 #include <vector>
@@ -11,6 +13,8 @@
 #include "caffe/common.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/raw_weights.hpp"
 
 using std::map;
 using std::vector;
@@ -24,25 +28,96 @@ class Net {
  public:
   explicit Net(const NetParameter& param);
   explicit Net(const string& param_file);
-  virtual ~Net() {}
+  // Builds an inference only net that shares the parameters of the layers of
+  // weights with the same names, e.g. to run the same model with another
+  // batch size, or in another thread: only its activations are its own. The
+  // parameters are synced to the current mode first, so that the nets
+  // sharing them only read them and may run concurrently; weights should
+  // then neither be trained nor store its weights in half precision.
+  Net(const NetParameter& param, Net* weights);
+  virtual ~Net();
+
+  // Initialize a network with the network parameter, sharing the parameters
+  // of weights unless NULL.
+  void Init(const NetParameter& param, Net* weights = NULL);
 
-  // Initialize a network with the network parameter.
-  void Init(const NetParameter& param);
+  // Reshapes the inputs of the net to batch_size items, and every layer to
+  // them (see Layer::Reshape), without setting the layers up again: the
+  // parameters stay as they are, and the blobs keep their memory unless they
+  // outgrow it. Data layers keep the batch size of their parameters.
+  void Reshape(const int batch_size);
 
   // Run forward with the input blobs already fed separately. You can get the
   // input blobs using input_blobs().
   const vector<Blob<Dtype>*>& ForwardPrefilled(Dtype* loss = NULL);
+  // Run forward the layers from start to end, both included, with the inputs
+  // already fed, returning their loss. The layers before start must have run
+  // forward already for ForwardFrom.
+  Dtype ForwardFromTo(const int start, const int end);
+  Dtype ForwardFrom(const int start);
+  Dtype ForwardTo(const int end);
+  // Runs forward only the layers that the blobs named depend on, skipping
+  // the others, e.g. the classifier and the loss when features are
+  // extracted. The layers writing a blob in place after it was computed,
+  // e.g. a ReLU, are run too, the blob then being as after a full forward
+  // pass.
+  void ForwardBlobs(const vector<string>& blob_names);
+  // Runs forward up to the layer named, included, or only the layers the
+  // blob named depends on.
+  void ForwardTo(const string& name);
+  // Runs the net forward over num items, batch by batch, the last one padded
+  // with zeros: input i of the net reads inputs[i], the num items of that
+  // input one after the other, and the blobs named output_names write theirs
+  // into outputs, e.g. numpy arrays, without going through the memory of the
+  // blobs. In GPU mode the copy of each batch to the device runs on a
+  // stream of its own from pinned memory while the previous batch is
+  // computed; in CPU mode full batches are read in place, so no layer may
+  // compute in place on an input. The input blobs keep the data they held
+  // before.
+  void ForwardAll(const int num, const vector<const Dtype*>& inputs,
+      const vector<string>& output_names, const vector<Dtype*>& outputs);
   // Run forward using a set of bottom blobs, and return the result.
   const vector<Blob<Dtype>*>& Forward(const vector<Blob<Dtype>* > & bottom,
       Dtype* loss = NULL);
+  // Runs forward one batch of num items read from the memory of the caller,
+  // the net being reshaped to num if its batch is another: input i of the
+  // net reads inputs[i], in the layout of its blob, in place unless a layer
+  // computes in place on that input, in which case it is copied. Output i is
+  // copied into outputs[i] unless it is NULL (or outputs is empty); the
+  // output blobs returned can be read instead, as views of the outputs valid
+  // until the net runs again. The input blobs keep the data they held
+  // before.
+  const vector<Blob<Dtype>*>& ForwardBuffers(const int num,
+      const vector<const Dtype*>& inputs, const vector<Dtype*>& outputs,
+      Dtype* loss = NULL);
   // Run forward using a serialized BlobProtoVector and return the result
-  // as a serialized BlobProtoVector
+  // as a serialized BlobProtoVector. This copies each input and output
+  // three times; ForwardBuffers reads and writes them where they are.
   string Forward(const string& input_blob_protos, Dtype* loss = NULL);
 
   // The network backward should take no input and output, since it solely
   // computes the gradient w.r.t the parameters, and the data has already
   // been provided during the forward pass.
   void Backward();
+  // Runs backward the layers from start down to end, both included, e.g.
+  // those of a stage of a Pipeline. The layers after start must have run
+  // backward already.
+  void BackwardFromTo(const int start, const int end);
+
+  // Told by Backward of each layer with parameters in turn, once it has
+  // issued the computation of their gradients (the kernels may still be
+  // running on the device), so that they can be sent on while the earlier
+  // layers compute theirs (see P2PSync). Layers that need no backward pass
+  // are told about too, in their place.
+  class BackwardCallback {
+   public:
+    virtual ~BackwardCallback() {}
+    virtual void GradientsReady(const int layer_id) = 0;
+  };
+  // The callback, or NULL, the default, for none. It is not owned.
+  void set_backward_callback(BackwardCallback* callback) {
+    backward_callback_ = callback;
+  }
 
   Dtype ForwardBackward(const vector<Blob<Dtype>* > & bottom) {
     Dtype loss;
@@ -50,9 +125,79 @@ class Net {
     Backward();
     return loss;
   }
+  // With num_hard > 0, ForwardBackwardHardExamples runs backward over the
+  // num_hard items of the highest loss of each batch only (online hard
+  // example mining), as given by the one loss layer that computes the
+  // losses of items (see Layer::can_compute_item_losses). The batch is that
+  // of the inputs of the net and of the tops of the data layers before the
+  // other layers; num_hard must be smaller. 0 turns it off.
+  void set_hard_examples(const int num_hard);
+  inline int hard_examples() const { return num_hard_; }
+  // Runs forward over the batch, then again, and backward, over its hard
+  // examples, compacted into the first num_hard items of the batch blobs,
+  // which are then shaped for the whole batch again. Returns the loss of
+  // the whole batch. The layers reading the batch must support Reshape.
+  Dtype ForwardBackwardHardExamples();
+
+  // The profile of a layer over the passes since the profiles were reset:
+  // the time of its forward and backward passes, the growth of the memory
+  // pool over them (see MemoryPool), and estimates of their operations.
+  struct LayerProfile {
+    int forward_passes;
+    int backward_passes;
+    double forward_ms;
+    double backward_ms;
+    int64_t allocated_bytes;
+    double forward_flops;
+    double backward_flops;
+  };
+  // With profiling on, the forward and backward passes time each layer with
+  // a Timer, which synchronizes the device after each one. The profiles
+  // start out reset. Turn it on in the mode the net is run in.
+  void set_profiling(const bool profiling);
+  inline bool profiling() const { return profile_timer_.get() != NULL; }
+  inline const vector<LayerProfile>& layer_profiles() const {
+    return layer_profiles_;
+  }
+  void ResetProfiles();
+  // Appends the profiles to filename, with iter, as one JSON object per line
+  // if filename ends with ".json", as CSV otherwise, a row per layer under a
+  // header written to a new file.
+  void WriteProfiles(const string& filename, const int iter);
 
   // Updates the network weights based on the diff values computed.
   void Update();
+  // Has Backward add the gradients of the parameters to their diffs rather
+  // than overwrite them (see Layer::accumulate_param_diffs), to sum them over
+  // several batches.
+  void set_accumulate_param_diffs(const bool accumulate);
+  // Multiplies the diffs of the parameters by scale.
+  void ScaleParamDiffs(const Dtype scale);
+  // In GPU mode, has the loss layers that support it add their losses to a
+  // scalar on the device rather than return them (see Layer::device_loss),
+  // so that the forward passes do not wait for the device and the host
+  // queues the next kernels ahead. The forward passes then return the losses
+  // of the other layers only, and device_loss() the sum of those added to the
+  // scalar since ResetDeviceLoss(). The scalar starts at 0. Layers run on
+  // another device than that of the net keep returning their losses.
+  void set_device_loss(const bool device_loss);
+  inline bool has_device_loss() const { return device_loss_.get() != NULL; }
+  // Reads the losses summed on the device, waiting for it
+  Dtype device_loss();
+  // Zeroes them, without waiting for the device
+  void ResetDeviceLoss();
+  // Gives the data and diffs of the blobs, but the inputs of the net, back to
+  // the MemoryPool, the next pass allocating them again: e.g. for the nets of
+  // a ModelScheduler, of which only a few run at a time, to hold device
+  // memory for their activations only while they run.
+  void ReleaseActivations();
+  // Moves the data of all the parameters into one contiguous memory, and
+  // their diffs into another, each blob then being a view of its part (see
+  // SyncedMemory), so that they can be copied, reduced or updated at once.
+  // Each blob starts at a multiple of 256 bytes; the padding between them
+  // stays 0. A blob later reshaped to a larger count gets memory of its own
+  // again.
+  void PackParams();
 
   // For an already initialized net, ShareTrainedLayersWith() implicitly copies
   // (i.e., using no additional memory) the already trained layers from another
@@ -61,12 +206,21 @@ class Net {
   // For an already initialized net, CopyTrainedLayersFrom() copies the already
   // trained layers from another net parameter instance.
   void CopyTrainedLayersFrom(const NetParameter& param);
+  // The same from raw weights (see RawWeightsFile), that an inference only
+  // net of floats with unpacked parameters shares rather than copies,
+  // keeping the file mapped as long as the net lives.
+  void CopyTrainedLayersFrom(const shared_ptr<RawWeightsFile>& raw_weights);
+  // The same from a file of either kind.
   void CopyTrainedLayersFrom(const string trained_filename);
-  // Writes the net to a proto.
-  void ToProto(NetParameter* param, bool write_diff = false);
+  // Writes the net to a proto, without the blobs of the layers unless
+  // write_blobs.
+  void ToProto(NetParameter* param, bool write_diff = false,
+      bool write_blobs = true);
 
   // returns the network name.
   inline const string& name() { return name_; }
+  // Whether the net was built for inference only, see NetParameter.
+  inline bool inference() const { return inference_; }
   // returns the layer names
   inline const vector<string>& layer_names() { return layer_names_; }
   // returns the blob names
@@ -84,6 +238,21 @@ class Net {
   // returns the parameter learning rate multipliers
   inline vector<float>& params_lr() {return params_lr_; }
   inline vector<float>& params_weight_decay() { return params_weight_decay_; }
+  // The mode the parameter param_id is used in, that of its layer
+  inline Caffe::Brew param_mode(const int param_id) const {
+    return layers_[param_layers_[param_id]]->mode();
+  }
+  // The device the parameter param_id is kept on, if not that of the net,
+  // -1 otherwise (see Layer::param_device)
+  inline int param_device(const int param_id) const {
+    return layers_[param_layers_[param_id]]->param_device(
+        param_layer_indices_[param_id]);
+  }
+  // The memory of the parameters and of their diffs once packed, NULL
+  // before, and their number of values, padding included
+  inline const shared_ptr<SyncedMemory>& params_data() { return params_data_; }
+  inline const shared_ptr<SyncedMemory>& params_diff() { return params_diff_; }
+  inline int params_count() const { return params_count_; }
   // Input and output blob numbers
   inline int num_inputs() { return net_input_blobs_.size(); }
   inline int num_outputs() { return net_output_blobs_.size(); }
@@ -103,12 +272,128 @@ class Net {
   // Function to get misc parameters, e.g. the learning rate multiplier and
   // weight decay.
   void GetLearningRateAndWeightDecay();
+  // Assigns the intermediate blobs to as few shared buffers as their
+  // lifetimes allow, see NetParameter.share_blob_memory.
+  void ShareBlobMemory();
+  // Makes the bottoms of the concat layers of zero_copy_concats_ views into
+  // their tops, see NetParameter.zero_copy_concat, or gives them memory of
+  // their own again, for good, once their parts are no longer contiguous.
+  void ShareConcatMemory();
+  // Makes the tops of the splits flagged in split_diff_shared_ share the diff
+  // of their bottom, see NetParameter.accumulate_split_diffs.
+  void ShareSplitDiffs();
+  // Stores the weights of half_weights_ in half precision, if they are not
+  // yet, see NetParameter.half_precision_weights.
+  void StoreWeightsAsHalf();
+  // Reshapes the layers from start on to their bottoms (see Reshape).
+  void ReshapeLayers(const int start);
+  // Sets needed[i] for the layers that the blobs of blob_ids depend on.
+  void LayersNeeded(const vector<int>& blob_ids, vector<bool>* needed);
+  // Fills the staging blobs of slot with the items of batch of inputs, as
+  // ForwardAll reads them, starting their copy to the device on stream in
+  // GPU mode. Returns the blobs the inputs are to share.
+  vector<Blob<Dtype>*> StageBatch(const int num, const int batch,
+      const int slot, const vector<const Dtype*>& inputs,
+      const cudaStream_t stream);
+  // Runs layer i forward or backward, profiling it if profiling. The layers
+  // after a layer without bottoms whose tops change shape are reshaped.
+  Dtype ForwardLayer(const int i);
+  Dtype ProfileForwardLayer(const int i);
+  void BackwardLayer(const int i);
+  // Builds plan_ for the mode of the calling thread.
+  void BuildPlan();
+  // Sets root[i] to the blob whose data blob i shares, through the tops of
+  // split and flatten layers, i itself for the others.
+  void AliasRoots(vector<int>* root);
+  // Plans the offloads of NetParameter.offload_activations.
+  void PlanOffloads();
+  // Starts offloading the blobs whose last use in Forward is layer, after
+  // finishing the offloads started before.
+  void OffloadAfter(const int layer);
+  // Waits for the offloads started to be done, and gives their device memory
+  // back to the pool.
+  void FinishOffloads();
+  // Starts bringing back the blobs offloaded after the Forward of layer, to
+  // overlap with the Backward of the layer before it.
+  void Prefetch(const int layer);
+  // Makes the work issued next, the Backward of layer, wait for its blobs to
+  // be back, prefetching them first if they are not on their way yet.
+  void WaitForPrefetch(const int layer);
+  // Plans the segments of NetParameter.checkpoint_interval.
+  void PlanRecompute(const NetParameter& param);
+  struct RecomputeSegment;
+  // Runs the layers of segment forward again, recomputing its blobs.
+  void Recompute(const RecomputeSegment& segment);
+  // Frees the data of the blobs of segment, and their diffs if diffs.
+  void FreeRecomputed(const RecomputeSegment& segment, const bool diffs);
+  struct PlanStep;
+  // Runs the layer of step forward or backward.
+  static Dtype ForwardStep(const PlanStep& step);
+  static void BackwardStep(const PlanStep& step);
+  // Makes the parameters of layer, not set up yet, those of source.
+  static void ShareLayerParams(Layer<Dtype>* source, Layer<Dtype>* layer);
 
   // Individual layers in the net
   vector<shared_ptr<Layer<Dtype> > > layers_;
   vector<string> layer_names_;
   map<string, int> layer_names_index_;
   vector<bool> layer_need_backward_;
+  // Whether the bottoms of each layer need backward, e.g. not the data
+  vector<bool> layer_propagate_down_;
+  // The MemoryPool owner the memory of each layer is accounted against
+  vector<int> layer_memory_owners_;
+  // A layer of the execution plan: what ForwardLayer and BackwardLayer read
+  // on every pass, resolved once after Init for the mode of plan_mode_. The
+  // plan is rebuilt by a pass in another mode.
+  struct PlanStep {
+    Layer<Dtype>* layer;
+    vector<Blob<Dtype>*>* bottom;
+    vector<Blob<Dtype>*>* top;
+    Caffe::Brew mode;
+    // Whether mode is the layer's own, not plan_mode_, and so switched to
+    bool own_mode;
+    bool propagate_down;
+    int memory_owner;
+    const char* name;
+  };
+  vector<PlanStep> plan_;
+  Caffe::Brew plan_mode_;
+  // The data of a blob, and of the blobs aliasing it (tops in place and the
+  // tops of split and flatten layers), offloaded after its last use in
+  // Forward with NetParameter.offload_activations.
+  struct Offload {
+    int blob_id;
+    int last_use;
+    // The memory while offloaded, until its prefetch is waited for
+    shared_ptr<SyncedMemory> memory;
+    bool freed;
+    bool prefetching;
+    // The end of the last copy of the memory
+    cudaEvent_t done;
+  };
+  vector<Offload> offloads_;
+  // The offloads by the layer of their last use
+  vector<vector<int> > layer_offloads_;
+  // The streams of the copies to the host and back, created at the first
+  // offload, and the event marking the work of the layers issued so far
+  cudaStream_t offload_streams_[2];
+  cudaEvent_t layers_done_;
+  // The layers from begin to end, both included, between two checkpoints of
+  // NetParameter.checkpoint_interval, end being the second one: the blobs
+  // freed after the Forward of end, and the layers computing them again
+  // ahead of its Backward
+  struct RecomputeSegment {
+    int begin;
+    int end;
+    vector<int> layer_ids;
+    vector<int> blob_ids;
+    // Whether a layer of the segment needs backward
+    bool need_backward;
+  };
+  vector<RecomputeSegment> recompute_segments_;
+  // The segment each layer begins and ends, -1 for none
+  vector<int> segment_begun_by_;
+  vector<int> segment_ended_by_;
   // blobs stores the blobs that store intermediate results between the
   // layers.
   vector<shared_ptr<Blob<Dtype> > > blobs_;
@@ -123,18 +408,65 @@ class Net {
   // top_vecs stores the vectors containing the output for each layer
   vector<vector<Blob<Dtype>*> > top_vecs_;
   vector<vector<int> > top_id_vecs_;
+  // The channels, height and width of the bottoms of each layer at SetUp,
+  // which those of the layers that cannot reshape spatially keep
+  vector<vector<int> > bottom_shapes_;
   // blob indices for the input and the output of the net
   vector<int> net_input_blob_indices_;
   vector<int> net_output_blob_indices_;
   vector<Blob<Dtype>*> net_input_blobs_;
   vector<Blob<Dtype>*> net_output_blobs_;
+  // Whether the blobs share buffers (see ShareBlobMemory), and the batch
+  // size the buffers were sized for
+  bool share_blob_memory_;
+  int shared_batch_size_;
+  // The concat layers whose bottoms are views into their top, in order
+  vector<int> zero_copy_concats_;
+  // Whether each blob is a split top sharing the diff of the split bottom
+  vector<bool> split_diff_shared_;
   string name_;
+  bool inference_;
   // The parameters in the network.
   vector<shared_ptr<Blob<Dtype> > > params_;
   // the learning rate multipliers
   vector<float> params_lr_;
   // the weight decay multipliers
   vector<float> params_weight_decay_;
+  // The index of the layer of each parameter
+  vector<int> param_layers_;
+  // The index of each parameter in the blobs of its layer
+  vector<int> param_layer_indices_;
+  // The packed memory of the parameters, see PackParams
+  shared_ptr<SyncedMemory> params_data_;
+  shared_ptr<SyncedMemory> params_diff_;
+  int params_count_;
+  // The weights stored in half precision, and the memory they are expanded
+  // into, as large as the largest of them
+  vector<Blob<Dtype>*> half_weights_;
+  shared_ptr<SyncedMemory> half_scratch_;
+  // The raw weights the parameters share
+  vector<shared_ptr<RawWeightsFile> > raw_weights_;
+  BackwardCallback* backward_callback_;
+  // The timer of the profiling, NULL without, and the profiles
+  shared_ptr<Timer> profile_timer_;
+  // The losses summed on the device, or NULL without set_device_loss()
+  shared_ptr<Blob<Dtype> > device_loss_;
+  // The hard examples of each batch, 0 without set_hard_examples(), the
+  // loss layer giving their losses, the blobs of the batch and the first
+  // layer reading them
+  int num_hard_;
+  int hard_loss_layer_;
+  vector<Blob<Dtype>*> batch_blobs_;
+  int batch_start_;
+  vector<LayerProfile> layer_profiles_;
+  // The two slots of ForwardAll, each a blob per input: the pinned staging
+  // blobs the batches are copied to, and in CPU mode the views of the
+  // inputs read in place.
+  vector<shared_ptr<Blob<Dtype> > > staging_blobs_[2];
+  vector<shared_ptr<Blob<Dtype> > > staging_views_[2];
+  // A blob per input, the views of the inputs ForwardBuffers reads in place
+  // or the copies of those a layer computes in place on
+  vector<shared_ptr<Blob<Dtype> > > buffer_blobs_;
   DISABLE_COPY_AND_ASSIGN(Net);
 };
 
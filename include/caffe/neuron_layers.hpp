@@ -3,6 +3,8 @@
 #ifndef CAFFE_NEURON_LAYERS_HPP_
 #define CAFFE_NEURON_LAYERS_HPP_
 
+#include <stdint.h>
+
 #include <string>
 #include <utility>
 #include <vector>
@@ -16,6 +18,7 @@
 #include "caffe/common.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/fuse_neurons.hpp"
 
 #define HDF5_DATA_DATASET_NAME "data"
 #define HDF5_DATA_LABEL_NAME "label"
@@ -33,6 +36,10 @@ class NeuronLayer : public Layer<Dtype> {
      : Layer<Dtype>(param) {}
   virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
+  // The top takes the shape of the bottom.
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  virtual bool can_reshape_spatially() const { return true; }
 };
 
 /* BNLLLayer
@@ -68,6 +75,10 @@ class BNLLLayer : public NeuronLayer<Dtype> {
   y = x * mask * scale
 
   y' = mask * scale
+
+  The mask is not stored: it is drawn from a counter-based RNG (Philox) keyed
+  by a seed picked at each forward pass, and drawn again in the backward pass
+  and in a forward pass recomputing the top (see Layer::recomputing).
 */
 template <typename Dtype>
 class DropoutLayer : public NeuronLayer<Dtype> {
@@ -87,12 +98,44 @@ class DropoutLayer : public NeuronLayer<Dtype> {
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
 
-  shared_ptr<SyncedMemory> rand_vec_;
+  // The Philox key of the mask of the last forward pass
+  uint32_t mask_key_[2];
   Dtype threshold_;
   Dtype scale_;
   unsigned int uint_thres_;
 };
 
+/* FusedNeuronLayer
+  Runs the ReLU, sigmoid, tanh and dropout layers of fused_neuron_param one
+  after the other, in a single pass over the blob, forward and backward. Net
+  substitutes it for chains of in place neuron layers (see
+  util/fuse_neurons.hpp). The dropout masks are those the dropout layers
+  would draw, and Backward only reads the top.
+*/
+template <typename Dtype>
+class FusedNeuronLayer : public NeuronLayer<Dtype> {
+ public:
+  explicit FusedNeuronLayer(const LayerParameter& param)
+      : NeuronLayer<Dtype>(param) {}
+  virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+
+ protected:
+  virtual Dtype Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  virtual Dtype Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const bool propagate_down, vector<Blob<Dtype>*>* bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const bool propagate_down, vector<Blob<Dtype>*>* bottom);
+
+  // Picks the phase and the keys of the dropout masks of a forward pass.
+  void PrepareForward();
+
+  FusedNeuronOps ops_;
+};
+
 /* PowerLayer
   y = (shift + scale * x) ^ power
 
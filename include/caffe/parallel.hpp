@@ -0,0 +1,244 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_PARALLEL_HPP_
+#define CAFFE_PARALLEL_HPP_
+
+#include <cuda_runtime.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/syncedmem.hpp"
+#include "caffe/util/blocking_queue.hpp"
+
+namespace caffe {
+
+// Runs the training iterations of a net data parallel over several GPUs (see
+// SolverParameter.device_ids). Replica 0 is the net itself, run by the calling
+// thread on the current device; each other device gets a replica of its own,
+// built and run by a thread of its own. The replicas form a tree, the parent
+// of replica r > 0 being r with its highest bit cleared, so that it is
+// log2(number of devices) deep: in each iteration the weights are copied
+// down the tree and the gradients summed up it, every copy being a peer to
+// peer one between two devices. The gradients are summed layer by layer as
+// the backward pass gets them (see Net::BackwardCallback), by a reducer
+// thread per replica on a stream of its own, so that the copies of the last
+// layers, often the large inner product ones, overlap with the computation
+// of the first ones.
+template <typename Dtype>
+class P2PSync {
+ public:
+  // net_param is that of net before SetShard, and device_ids the devices of
+  // the replicas, that of net first. The replicas of a random_seed of at
+  // least 0 are seeded with random_seed + their index.
+  P2PSync(Net<Dtype>* net, const NetParameter& net_param,
+      const vector<int>& device_ids, const int64_t random_seed);
+  virtual ~P2PSync();
+
+  // Copies the weights of net to every replica, runs ForwardBackward on all
+  // of them, and leaves the mean of their gradients in the diffs of net.
+  // Returns the mean of their losses.
+  Dtype ForwardBackward();
+
+  // Sets the DATA layers of net_param to read the share of replica shard_id
+  // of num_shards, of the share they read already, if any.
+  static void SetShard(const int shard_id, const int num_shards,
+      NetParameter* net_param);
+
+ protected:
+  struct Replica : public Net<Dtype>::BackwardCallback {
+    // Hands layer_id to the reducer.
+    virtual void GradientsReady(const int layer_id);
+
+    P2PSync<Dtype>* sync;
+    int id;
+    int device;
+    shared_ptr<Net<Dtype> > owned_net;
+    Net<Dtype>* net;
+    int parent;
+    vector<int> children;
+    // The loss of the replica, and of its descendants once summed
+    Dtype loss;
+    // 1 to run an iteration, 0 to stop, from the parent
+    BlockingQueue<int> iterations;
+    // The layers whose gradients the backward pass computed, in its order,
+    // for the reducer, and -1 to stop it
+    BlockingQueue<int> ready_layers;
+    // The layers whose gradients are summed with those of the descendants,
+    // for the parent
+    BlockingQueue<int> summed_layers;
+    // The end of the iterations of the reducer
+    BlockingQueue<int> reducer_done;
+    // Recorded on the default stream when each layer is ready
+    vector<cudaEvent_t> layer_ready_events;
+    // The stream of the reducer, not synchronizing with the default stream
+    cudaStream_t reducer_stream;
+    // A diff of a child, copied to the device of the replica
+    shared_ptr<SyncedMemory> child_diff;
+    pthread_t thread;
+    pthread_t reducer_thread;
+  };
+
+  static void* ReplicaThread(void* replica_pointer);
+  static void* ReducerThread(void* replica_pointer);
+  // Starts and stops the reducer of replica, from the thread of the replica.
+  void StartReducer(Replica* replica);
+  void StopReducer(Replica* replica);
+  // One iteration of replica, once its parent has its weights.
+  void RunIteration(Replica* replica);
+  // Sums the gradients of layer_id of the children of replica into its own.
+  void ReduceLayer(Replica* replica, const int layer_id);
+
+  NetParameter net_param_;
+  int64_t random_seed_;
+  // The settings of the calling thread, for the threads of the replicas
+  Caffe::ThreadSettings settings_;
+  int64_t max_param_count_;
+  // The layer with parameters the backward pass ends with
+  int last_backward_layer_;
+  vector<shared_ptr<Replica> > replicas_;
+  // The ids of the replicas built by their threads
+  BlockingQueue<int> replicas_built_;
+
+  DISABLE_COPY_AND_ASSIGN(P2PSync);
+};
+
+// Runs the training iterations of a net pipeline parallel over several GPUs
+// (see SolverParameter.pipeline_devices). The layers of the net are cut into
+// stages, in order, each run by a thread of its own on its device, which
+// keeps the parameters of its layers. Each iteration runs a number of micro
+// batches, each through a replica of the net of its own, the net itself
+// being the first: the replicas share the parameters and the diffs of the
+// net, and only their activations are their own. A stage runs forward its
+// layers of every micro batch in turn, once the previous stage has, then
+// backward once the next stage has, adding up the gradients. The blobs
+// between the stages are read from the device of the stage that computes
+// them, peer to peer, so the stages are best cut at small blobs.
+template <typename Dtype>
+class Pipeline {
+ public:
+  // net_param is that of net before SetShard, net being its shard 0 of
+  // num_micro_batches, and devices those of the stages, that of net first.
+  // stage_layers are the names of the first layers of the stages after the
+  // first; when empty the stages get about the same numbers of operations.
+  Pipeline(Net<Dtype>* net, const NetParameter& net_param,
+      const vector<int>& devices, const vector<string>& stage_layers,
+      const int num_micro_batches);
+  virtual ~Pipeline();
+
+  // Runs forward and backward every micro batch, and leaves the mean of
+  // their gradients in the diffs of net. Returns the mean of their losses.
+  Dtype ForwardBackward();
+
+  // The first layer of each stage
+  inline const vector<int>& stage_starts() const { return stage_starts_; }
+
+ protected:
+  struct Stage {
+    Pipeline<Dtype>* pipeline;
+    int id;
+    int device;
+    // Its layers, from start to end, both included
+    int start;
+    int end;
+    // 1 to run an iteration, 0 to stop
+    BlockingQueue<int> iterations;
+    // The micro batches the previous stage ran forward, and those the next
+    // stage ran backward
+    BlockingQueue<int> forward_ready;
+    BlockingQueue<int> backward_ready;
+    // The loss of its layers over the micro batches
+    Dtype loss;
+    pthread_t thread;
+  };
+
+  static void* StageThread(void* stage_pointer);
+  // One iteration of stage, over every micro batch.
+  void RunIteration(Stage* stage);
+  // The first layers of the stages, of about the same numbers of operations
+  // (see Net::LayerProfile).
+  void BalanceStages(Net<Dtype>* net, const int num_stages);
+
+  // The replicas of the micro batches, net first, and those owned
+  vector<Net<Dtype>*> nets_;
+  vector<shared_ptr<Net<Dtype> > > owned_nets_;
+  vector<int> stage_starts_;
+  vector<shared_ptr<Stage> > stages_;
+  // The ids of the stages done with their iteration
+  BlockingQueue<int> stages_done_;
+  // The settings of the calling thread, for the threads of the stages
+  Caffe::ThreadSettings settings_;
+
+  DISABLE_COPY_AND_ASSIGN(Pipeline);
+};
+
+// Runs the training iterations of a net Hogwild style over several CPU
+// threads (see SolverParameter.hogwild_threads). Replica 0 is the net
+// itself, run by the calling thread; each other thread builds and runs a
+// replica of its own, reading its own share of the data, whose weights are
+// those of the net, and updates them with its own gradients as soon as it
+// has them. The updates take no lock: those of different threads race, and
+// may lose some of each other's changes of the same weights, which is rare
+// enough for the sparse gradients of most nets not to slow training down
+// (Recht et al., "Hogwild!"). The threads run one iteration each per
+// iteration of the solver, so that none runs while the solver tests or
+// snapshots.
+template <typename Dtype>
+class Hogwild {
+ public:
+  // Updates the weights, shared by net, a replica, with its gradients, on
+  // the thread of the replica.
+  typedef void (*UpdateFunction)(void* context, Net<Dtype>* net);
+
+  // net_param is that of net before SetShard, net being its shard 0 of
+  // num_threads. The replicas of a random_seed of at least 0 are seeded with
+  // random_seed + their index.
+  Hogwild(Net<Dtype>* net, const NetParameter& net_param,
+      const int num_threads, const int64_t random_seed,
+      UpdateFunction update, void* update_context);
+  virtual ~Hogwild();
+
+  // Has the other threads run ForwardBackward on their replicas and update
+  // the weights, while the calling thread runs ForwardBackward on net, and
+  // waits for them. Returns the mean of the losses; net is left for the
+  // caller to update.
+  Dtype ForwardBackward();
+
+ protected:
+  struct Replica {
+    Hogwild<Dtype>* hogwild;
+    int id;
+    shared_ptr<Net<Dtype> > net;
+    Dtype loss;
+    // 1 to run an iteration, 0 to stop
+    BlockingQueue<int> iterations;
+    pthread_t thread;
+  };
+
+  static void* ReplicaThread(void* replica_pointer);
+
+  Net<Dtype>* net_;
+  NetParameter net_param_;
+  int64_t random_seed_;
+  UpdateFunction update_;
+  void* update_context_;
+  // The settings of the calling thread, for the threads of the replicas
+  Caffe::ThreadSettings settings_;
+  // The replicas other than net
+  vector<shared_ptr<Replica> > replicas_;
+  // The ids of the replicas built by their threads, and of those done with
+  // their iteration
+  BlockingQueue<int> replicas_built_;
+  BlockingQueue<int> replicas_done_;
+
+  DISABLE_COPY_AND_ASSIGN(Hogwild);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_PARALLEL_HPP_
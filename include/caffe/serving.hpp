@@ -0,0 +1,221 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_SERVING_HPP_
+#define CAFFE_SERVING_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/util/blocking_queue.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+// A request queued to a server, waiting for its outputs
+struct ServingRequest {
+  const float* image;
+  vector<float>* outputs;
+  boost::posix_time::ptime queued;
+  // 0 once served
+  BlockingQueue<int> served;
+};
+
+// The requests a server served since it started or was reset.
+struct ServingStats {
+  ServingStats()
+      : requests(0), batches(0), batch_items(0), late_requests(0),
+        elapsed_ms(0), latency_histogram(kLatencyBuckets, 0) {}
+
+  // The latencies are counted in buckets of powers of two milliseconds:
+  // bucket 0 holds those under 1 ms, bucket i > 0 those in [2^(i-1), 2^i) ms
+  // and the last all the longer ones.
+  static const int kLatencyBuckets = 16;
+
+  // The latency under which a share p of the requests were served, the upper
+  // end of the bucket it falls in.
+  double LatencyPercentile(const double p) const;
+  // Counts batch, just served, in batch_size items, of which the requests
+  // served after max_latency_ms are late.
+  void AddBatch(const vector<ServingRequest*>& batch, const int batch_size,
+      const float max_latency_ms);
+
+  int64_t requests;
+  int64_t batches;
+  // The items of these batches, of which the requests filled
+  // requests / batch_items
+  int64_t batch_items;
+  // The requests served later than their latency target
+  int64_t late_requests;
+  double elapsed_ms;
+  // The time from the queuing of each request to its outputs
+  vector<int64_t> latency_histogram;
+};
+
+// An inference net starting with a MemoryDataLayer, run over batches of
+// requests, padded with zeros: their outputs are the item of their image of
+// every output blob, one after the other.
+class ServedNet {
+ public:
+  explicit ServedNet(const shared_ptr<Net<float> >& net);
+
+  // Runs batch, of at most batch_size() requests, through the net and sets
+  // their outputs, without signaling them.
+  void Run(const vector<ServingRequest*>& batch);
+
+  Net<float>* net() { return net_.get(); }
+  int batch_size() const { return batch_size_; }
+  int image_size() const { return image_size_; }
+  int output_size() const { return output_size_; }
+
+ protected:
+  shared_ptr<Net<float> > net_;
+  MemoryDataLayer<float>* data_layer_;
+  int batch_size_;
+  int image_size_;
+  int output_size_;
+  // The batch and its labels, given to the memory data layer
+  vector<float> batch_data_;
+  vector<float> batch_labels_;
+
+  DISABLE_COPY_AND_ASSIGN(ServedNet);
+};
+
+// Serves the requests of several threads, e.g. of an RPC service, with one
+// inference net: the requests are queued and run together, as many as the
+// batch of the net holds, or those that arrived within max_latency_ms of the
+// first one waiting, whichever comes first. The net, which must start with a
+// MemoryDataLayer, is run by a thread of its own with the settings of the
+// thread that created the server. Batches that are not full are padded with
+// zeros, the net running over a whole batch anyway.
+class BatchingServer {
+ public:
+  BatchingServer(const shared_ptr<Net<float> >& net,
+      const float max_latency_ms);
+  virtual ~BatchingServer();
+
+  // Queues image, of the channels x height x width of the memory data layer,
+  // and waits for the outputs of the net for it: the item of the image of
+  // every output blob, one after the other.
+  void Serve(const float* image, vector<float>* outputs);
+
+  int batch_size() const { return served_net_.batch_size(); }
+  // The size of an image, and of the outputs for it
+  int image_size() const { return served_net_.image_size(); }
+  int output_size() const { return served_net_.output_size(); }
+  ServingStats stats();
+  void ResetStats();
+  // Logs the throughput, the batch fill and percentiles of the latency.
+  void LogStats();
+
+ protected:
+  static void* ServerThread(void* server_pointer);
+  // Runs batch, of at most batch_size() requests, through the net.
+  void RunBatch(const vector<ServingRequest*>& batch);
+
+  ServedNet served_net_;
+  float max_latency_ms_;
+  Caffe::ThreadSettings settings_;
+  // The requests waiting, oldest first, behind mutex_; condition_ is
+  // signaled as they come, and when the server stops.
+  std::deque<ServingRequest*> pending_;
+  bool stopping_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t condition_;
+  ServingStats stats_;
+  boost::posix_time::ptime stats_start_;
+  pthread_t thread_;
+
+  DISABLE_COPY_AND_ASSIGN(BatchingServer);
+};
+
+// How a ModelScheduler serves a model
+struct ModelOptions {
+  ModelOptions() : priority(0), max_latency_ms(5) {}
+
+  // Of the models with a batch ready, those of the highest priority run
+  // first, and among those the one whose oldest request is due first.
+  int priority;
+  // The latency target of the requests: a batch that is not full is run
+  // once its oldest request has waited max_latency_ms less the time the
+  // last batches of the model took to run.
+  float max_latency_ms;
+};
+
+// Serves the requests of several models, e.g. many small ones, on one
+// device with num_workers threads, each running a batch of one model at a
+// time, the next one from the models with a batch ready (see ModelOptions).
+// A model is served by one or more nets, each starting with a
+// MemoryDataLayer and run by one worker at a time: replicas built with
+// Net(param, weights) share its weights, and let several workers run its
+// batches at once. The workers have the settings of the thread that created
+// the scheduler, each with a Caffe context, and so cuBLAS handle, of its own
+// (see Caffe::ThreadSettings). All the nets allocate from the MemoryPool;
+// with release_activations, each gives the memory of its activations back
+// to it after each batch (see Net::ReleaseActivations), the models then
+// holding the memory of num_workers batches at most, besides their weights.
+class ModelScheduler {
+ public:
+  ModelScheduler(const int num_workers, const bool release_activations);
+  virtual ~ModelScheduler();
+
+  // Adds a model served by nets, all of the same batch, image and outputs,
+  // and returns its id, from 0 on.
+  int AddModel(const string& name, const vector<shared_ptr<Net<float> > >&
+      nets, const ModelOptions& options);
+  // Queues image for model, and waits for the outputs for it (see
+  // BatchingServer::Serve).
+  void Serve(const int model, const float* image, vector<float>* outputs);
+
+  int num_models();
+  const ServedNet& served_net(const int model);
+  ServingStats stats(const int model);
+  void ResetStats();
+  // Logs the stats of each model (see BatchingServer::LogStats), with the
+  // requests served later than its target.
+  void LogStats();
+
+ protected:
+  struct Model {
+    string name;
+    ModelOptions options;
+    vector<shared_ptr<ServedNet> > nets;
+    // Those not run by a worker
+    vector<ServedNet*> idle_nets;
+    std::deque<ServingRequest*> pending;
+    // The average time the last batches took to run
+    double run_ms;
+    ServingStats stats;
+  };
+
+  static void* WorkerThread(void* scheduler_pointer);
+  // Returns the model whose batch runs next, or NULL with in wait_ms the
+  // time until one is ready, -1 for none.
+  Model* NextModel(double* wait_ms);
+
+  bool release_activations_;
+  Caffe::ThreadSettings settings_;
+  // The models, their requests and idle nets, behind mutex_; condition_ is
+  // signaled as requests come, and broadcast as nets become idle and when
+  // the scheduler stops.
+  vector<shared_ptr<Model> > models_;
+  int num_pending_;
+  bool stopping_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t condition_;
+  boost::posix_time::ptime stats_start_;
+  vector<pthread_t> threads_;
+
+  DISABLE_COPY_AND_ASSIGN(ModelScheduler);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_SERVING_HPP_
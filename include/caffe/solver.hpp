@@ -3,9 +3,17 @@
 #ifndef CAFFE_OPTIMIZATION_SOLVER_HPP_
 #define CAFFE_OPTIMIZATION_SOLVER_HPP_
 
+#include <pthread.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
 #include <string>
 #include <vector>
 
+#include "caffe/common.hpp"
+#include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/nvtx.hpp"
+
 namespace caffe {
 
 template <typename Dtype>
@@ -18,7 +26,7 @@ class Solver {
   // in a non-zero iter number to resume training for a pre-trained net.
   virtual void Solve(const char* resume_file = NULL);
   inline void Solve(const string resume_file) { Solve(resume_file.c_str()); }
-  virtual ~Solver() {}
+  virtual ~Solver();
   inline shared_ptr<Net<Dtype> > net() { return net_; }
 
  protected:
@@ -27,14 +35,51 @@ class Solver {
   virtual void PreSolve() {}
   // Get the update value for the current iteration.
   virtual void ComputeUpdateValue() = 0;
+  // Updates the weights for the current iteration: by default the update
+  // value followed by Net::Update. Solvers may do both at once.
+  virtual void ApplyUpdate() {
+    {
+      NvtxRange range("ComputeUpdateValue");
+      ComputeUpdateValue();
+    }
+    NvtxRange range("Update");
+    net_->Update();
+  }
+  // Updates the weights net, a replica of net_ training Hogwild style,
+  // shares with net_ (see Hogwild), with the gradients of net.
+  virtual void ApplyReplicaUpdate(Net<Dtype>* net) {
+    LOG(FATAL) << "This solver cannot train Hogwild style.";
+  }
+  static void UpdateReplica(void* solver_pointer, Net<Dtype>* net);
   // The Solver::Snapshot function implements the basic snapshotting utility
-  // that stores the learned net. You should implement the SnapshotSolverState()
-  // function that produces a SolverState protocol buffer that needs to be
-  // written to disk together with the learned net.
+  // that stores the learned net and the solver state, the blobs of which you
+  // should return from SolverStateBlobs(). Snapshot only copies the weights
+  // and the state blobs to pinned host memory; a thread of its own writes
+  // them to disk meanwhile. Of its two copies, Snapshot only waits for one to
+  // be written if both are still being written.
   void Snapshot();
-  // The test routine
+  // The test routine: tests the current weights, or has the test thread
+  // test a copy of them if test_async.
   void Test();
-  virtual void SnapshotSolverState(SolverState* state) = 0;
+  // Runs the test net and logs its results, for the weights of iter.
+  void RunTest(const int iter);
+  // Logs the time the data layers of the net spent per batch since it last
+  // did, to tell whether training waits for the data.
+  void LogDataStats();
+  // The learning rate of the current iteration, for the telemetry; 0 for a
+  // solver without one.
+  virtual Dtype CurrentLearningRate() { return Dtype(0); }
+  // Adds the times of the layer profiles of net_ since the last call to the
+  // telemetry, before the profiles are reset or the telemetry written.
+  void AccumulateTelemetry();
+  // Writes the telemetry of the iterations since it was last written to
+  // telemetry_file, and resets it.
+  void WriteTelemetry();
+  // The random seed of this process, for a random_seed of at least 0
+  int64_t RandomSeed();
+  // Binds the calling thread to the NUMA node of numa_binding.
+  void BindNumaNode();
+  virtual vector<shared_ptr<Blob<Dtype> > >& SolverStateBlobs() = 0;
   // The Restore function implements how one should restore the solver to a
   // previously snapshotted state. You should implement the RestoreSolverState()
   // function that restores the state from a SolverState protocol buffer.
@@ -42,10 +87,85 @@ class Solver {
   virtual void RestoreSolverState(const SolverState& state) = 0;
 
   SolverParameter param_;
+  // The train net of this process, before it is shared out among its devices
+  NetParameter train_net_param_;
   int iter_;
   shared_ptr<Net<Dtype> > net_;
   shared_ptr<Net<Dtype> > test_net_;
 
+  // The times of the passes of net_: in its data layers, without bottoms,
+  // and forward and backward through the others
+  struct PassTimes {
+    PassTimes() : data_ms(0), forward_ms(0), backward_ms(0) {}
+
+    double data_ms;
+    double forward_ms;
+    double backward_ms;
+  };
+  // The telemetry (see SolverParameter.telemetry_file) since it was last
+  // written, and the times of the profiles already added to it
+  struct Telemetry {
+    Telemetry()
+        : iters(0), images(0), update_ms(0),
+          start(boost::posix_time::microsec_clock::local_time()) {}
+
+    int iters;
+    int64_t images;
+    PassTimes passes;
+    double update_ms;
+    boost::posix_time::ptime start;
+  };
+  Telemetry telemetry_;
+  PassTimes telemetry_profiled_;
+
+  // The weights and the state blobs of a snapshot, on the host
+  struct StagedSnapshot {
+    int iter;
+    // The net without the blobs of its layers, and the number of each
+    NetParameter net_param;
+    vector<int> num_layer_blobs;
+    vector<shared_ptr<Blob<Dtype> > > params;
+    vector<shared_ptr<Blob<Dtype> > > state;
+  };
+  static void* SnapshotThread(void* solver_pointer);
+  // Copies the data, and the diffs if with_diff, of blobs to staged, which
+  // they get the shape of.
+  void StageBlobs(const vector<shared_ptr<Blob<Dtype> > >& blobs,
+      const bool with_diff, vector<shared_ptr<Blob<Dtype> > >* staged);
+  void WriteSnapshot(StagedSnapshot* staged);
+  // Waits for the snapshots being written.
+  void FinishSnapshots();
+
+  StagedSnapshot staged_snapshots_[2];
+  // The staged snapshots free to be reused, and those to be written, NULL
+  // stopping the thread
+  BlockingQueue<StagedSnapshot*> free_snapshots_;
+  BlockingQueue<StagedSnapshot*> pending_snapshots_;
+  bool snapshot_thread_started_;
+  pthread_t snapshot_thread_;
+
+  // The asynchronous test (see SolverParameter.test_async): the parameters
+  // of the layers of net_ that the test net has layers of the same name of
+  // are copied to the host, then by the test thread to those layers.
+  static void* TestThread(void* solver_pointer);
+  void StartTest();
+  // Waits for the test being run, if any.
+  void FinishTests();
+
+  vector<shared_ptr<Blob<Dtype> > > test_sources_;
+  vector<shared_ptr<Blob<Dtype> > > test_targets_;
+  // The mode of the layer of each target in the test net
+  vector<Caffe::Brew> test_target_modes_;
+  vector<shared_ptr<Blob<Dtype> > > test_staged_;
+  Caffe::ThreadSettings test_settings_;
+  // The iterations of the weights to test, -1 stopping the thread, and
+  // those of the weights tested
+  BlockingQueue<int> pending_tests_;
+  BlockingQueue<int> finished_tests_;
+  bool test_running_;
+  bool test_thread_started_;
+  pthread_t test_thread_;
+
   DISABLE_COPY_AND_ASSIGN(Solver);
 };
 
@@ -61,8 +181,20 @@ class SGDSolver : public Solver<Dtype> {
  protected:
   virtual void PreSolve();
   Dtype GetLearningRate();
+  virtual Dtype CurrentLearningRate() { return GetLearningRate(); }
   virtual void ComputeUpdateValue();
-  virtual void SnapshotSolverState(SolverState * state);
+  // The update value and Net::Update in one pass over each parameter, by
+  // UpdateParam, which leaves the diffs as they are.
+  virtual void ApplyUpdate();
+  // The same for a replica: the history is that of net_.
+  virtual void ApplyReplicaUpdate(Net<Dtype>* net);
+  // Updates param, the parameter param_id of net_ or of a replica, with its
+  // learning rate and weight decay.
+  virtual void UpdateParam(Blob<Dtype>* param, const int param_id,
+      const Dtype rate, const Dtype decay);
+  virtual vector<shared_ptr<Blob<Dtype> > >& SolverStateBlobs() {
+    return history_;
+  }
   virtual void RestoreSolverState(const SolverState& state);
   // history maintains the historical momentum data.
   vector<shared_ptr<Blob<Dtype> > > history_;
@@ -70,6 +202,46 @@ class SGDSolver : public Solver<Dtype> {
   DISABLE_COPY_AND_ASSIGN(SGDSolver);
 };
 
+// SGD with Nesterov's accelerated momentum: the gradient is in effect taken
+// at the weights the momentum leads to.
+template <typename Dtype>
+class NesterovSolver : public SGDSolver<Dtype> {
+ public:
+  explicit NesterovSolver(const SolverParameter& param)
+      : SGDSolver<Dtype>(param) {}
+  explicit NesterovSolver(const string& param_file)
+      : SGDSolver<Dtype>(param_file) {}
+
+ protected:
+  virtual void UpdateParam(Blob<Dtype>* param, const int param_id,
+      const Dtype rate, const Dtype decay);
+
+  DISABLE_COPY_AND_ASSIGN(NesterovSolver);
+};
+
+// AdaGrad: the learning rate of each weight is divided by the root of the
+// sum of its squared gradients so far, kept in the history. It takes no
+// momentum.
+template <typename Dtype>
+class AdaGradSolver : public SGDSolver<Dtype> {
+ public:
+  explicit AdaGradSolver(const SolverParameter& param)
+      : SGDSolver<Dtype>(param) { CheckNoMomentum(); }
+  explicit AdaGradSolver(const string& param_file)
+      : SGDSolver<Dtype>(param_file) { CheckNoMomentum(); }
+
+ protected:
+  void CheckNoMomentum();
+  virtual void UpdateParam(Blob<Dtype>* param, const int param_id,
+      const Dtype rate, const Dtype decay);
+
+  DISABLE_COPY_AND_ASSIGN(AdaGradSolver);
+};
+
+// Returns a new solver of param.solver_type.
+template <typename Dtype>
+Solver<Dtype>* GetSolver(const SolverParameter& param);
+
 
 }  // namespace caffe
 
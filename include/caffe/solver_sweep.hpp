@@ -0,0 +1,95 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_SOLVER_SWEEP_HPP_
+#define CAFFE_SOLVER_SWEEP_HPP_
+
+#include <pthread.h>
+
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+// Trains the solvers of a hyperparameter sweep at once, e.g. of several
+// base_lr and weight_decay, over the same train net, sharing its data: the
+// data layers of the net (those without bottoms, each giving data and
+// labels) are run once per batch by a data net of their own, on the calling
+// thread in CPU mode, and each batch is given to all the solvers. Each
+// solver trains on a thread of its own, on its own device_id in GPU mode,
+// a replica of the net whose data layers are MEMORY_DATA layers of the same
+// names fed by the data net (see MemoryDataLayer::set_feed). The reads and
+// the decoding of the data are thus done once for all the solvers, which
+// keep within a few batches of the slowest of them. The test nets, if any,
+// are each solver's own.
+template <typename Dtype>
+class SolverSweep {
+ public:
+  // The train net is the train_net of params[0]; the solvers differ in the
+  // rest of their params, which give them their device_id and their
+  // snapshot_prefix. They are trained from scratch, each on one device and
+  // one thread, in one process.
+  explicit SolverSweep(const vector<SolverParameter>& params);
+  virtual ~SolverSweep();
+
+  // Trains all the solvers to their max_iter, and returns once they are.
+  void Solve();
+
+ protected:
+  typedef typename MemoryDataLayer<Dtype>::Feed Feed;
+
+  struct Sweep {
+    SolverSweep<Dtype>* solver_sweep;
+    int id;
+    SolverParameter param;
+    // The batches of each data layer, and whether the solver is done with
+    // them, guarded by mutex_
+    vector<shared_ptr<Feed> > feeds;
+    bool done;
+    pthread_t thread;
+  };
+
+  // Deletes a batch once no solver holds it anymore, and gives its place in
+  // flight back to the data net.
+  class BatchDeleter {
+   public:
+    explicit BatchDeleter(BlockingQueue<int>* free_batches)
+        : free_batches_(free_batches) {}
+    void operator()(MemoryBatch<Dtype>* batch) const {
+      delete batch;
+      free_batches_->push(0);
+    }
+
+   private:
+    BlockingQueue<int>* free_batches_;
+  };
+
+  static void* SolverThread(void* sweep_pointer);
+  // Runs data_net and gives its batches to the solvers not done, until none
+  // is left.
+  void FeedSolvers(Net<Dtype>* data_net);
+
+  vector<SolverParameter> params_;
+  NetParameter train_net_param_;
+  // The data layers of the train net, and the net of those alone
+  vector<int> data_layers_;
+  NetParameter data_net_param_;
+  vector<shared_ptr<Sweep> > sweeps_;
+  // Guards the feeds and done of the sweeps
+  pthread_mutex_t mutex_;
+  int num_done_;
+  // A token per batch that may be in flight
+  BlockingQueue<int> free_batches_;
+  // The settings of the calling thread, for the threads of the solvers
+  Caffe::ThreadSettings settings_;
+
+  DISABLE_COPY_AND_ASSIGN(SolverSweep);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_SOLVER_SWEEP_HPP_
@@ -3,12 +3,18 @@
 #ifndef CAFFE_SYNCEDMEM_HPP_
 #define CAFFE_SYNCEDMEM_HPP_
 
+#include <cuda_runtime.h>
+
 #include <cstdlib>
+#include <string>
 
 #include "caffe/common.hpp"
+#include "caffe/util/memory_pool.hpp"
 
 namespace caffe {
 
+class SharedMemorySegment;
+
 // Theoretically, CaffeMallocHost and CaffeFreeHost should simply call the
 // cudaMallocHost and cudaFree functions in order to create pinned memory.
 // However, those codes rely on the existence of a cuda GPU (I don't know
@@ -22,35 +28,161 @@ namespace caffe {
 // are constantly accessing them the memory pages almost always stays in
 // the physical memory (assuming we have large enough memory installed), and
 // does not seem to create a memory bottleneck here.
+//
+// Pinned memory is still needed for copies to overlap with computation, so
+// callers may ask for it. CaffeMallocHost then tries cudaMallocHost and falls
+// back to malloc if that fails (e.g. on a machine without GPU), and returns
+// whether pinned memory was obtained.
+//
+// All the memory goes through the caching MemoryPool, so that reallocating
+// blocks of the same size does not go back to malloc and cudaMalloc, and is
+// accounted against the tag it is allocated with.
 
-inline void CaffeMallocHost(void** ptr, size_t size) {
-  *ptr = malloc(size);
+inline bool CaffeMallocHost(void** ptr, size_t size, const bool pinned,
+    const MemoryTag& tag = MemoryTag()) {
+  MemoryPool::Kind kind = pinned ? MemoryPool::PINNED : MemoryPool::HOST;
+  *ptr = MemoryPool::Get().Allocate(size, &kind, tag);
+  return kind == MemoryPool::PINNED;
 }
 
 inline void CaffeFreeHost(void* ptr) {
-  free(ptr);
+  MemoryPool::Get().Free(ptr);
+}
+
+inline void CaffeMallocDevice(void** ptr, size_t size,
+    const MemoryTag& tag = MemoryTag()) {
+  MemoryPool::Kind kind = MemoryPool::DEVICE;
+  *ptr = MemoryPool::Get().Allocate(size, &kind, tag);
+}
+
+inline void CaffeFreeDevice(void* ptr) {
+  MemoryPool::Get().Free(ptr);
 }
 
 
+// Counts of the copies between host and device made by SyncedMemory.
+struct TransferStats {
+  TransferStats()
+      : to_device(0), to_device_bytes(0), to_host(0), to_host_bytes(0) {}
+
+  size_t to_device;
+  size_t to_device_bytes;
+  size_t to_host;
+  size_t to_host_bytes;
+};
+
 class SyncedMemory {
  public:
   SyncedMemory()
       : cpu_ptr_(NULL), gpu_ptr_(NULL), size_(0), head_(UNINITIALIZED),
-        own_cpu_data_(false) {}
+        own_cpu_data_(false), own_gpu_data_(false), pinned_(false),
+        cpu_pinned_(false), offset_(0) {}
   explicit SyncedMemory(size_t size)
       : cpu_ptr_(NULL), gpu_ptr_(NULL), size_(size), head_(UNINITIALIZED),
-        own_cpu_data_(false) {}
+        own_cpu_data_(false), own_gpu_data_(false), pinned_(false),
+        cpu_pinned_(false), offset_(0) {}
+  // A view of the size bytes of parent from offset on, e.g. of one parameter
+  // blob of a Net whose parameters are in one memory (see Net::PackParams):
+  // it reads and writes the memory of parent, and shares its head.
+  SyncedMemory(const shared_ptr<SyncedMemory>& parent, size_t offset,
+      size_t size)
+      : cpu_ptr_(NULL), gpu_ptr_(NULL), size_(size), head_(UNINITIALIZED),
+        own_cpu_data_(false), own_gpu_data_(false), pinned_(false),
+        cpu_pinned_(false), parent_(parent), offset_(offset) {
+    CHECK_LE(offset + size, parent->size());
+  }
   ~SyncedMemory();
   const void* cpu_data();
   void set_cpu_data(void* data);
+  // Same as set_cpu_data with the bytes of segment from offset on, which
+  // the memory keeps mapped as long as it uses them: other processes
+  // mapping it read and write the cpu data in place (see
+  // SharedMemorySegment). As for set_cpu_data, the cpu data is current.
+  void set_cpu_segment(const shared_ptr<SharedMemorySegment>& segment,
+      const size_t offset);
   const void* gpu_data();
+  // Same as set_cpu_data for device memory: the memory uses data, which it
+  // does not own, as its gpu data without copying it.
+  void set_gpu_data(void* data);
   void* mutable_cpu_data();
   void* mutable_gpu_data();
+  // Asks for the cpu data to live in pinned memory. This only affects
+  // allocations made afterwards, so it should be called before the first
+  // cpu_data access.
+  void set_pinned(const bool pinned) { pinned_ = pinned; }
+  bool pinned() { return parent_ ? parent_->pinned() : cpu_pinned_; }
+  // The tag the memory is accounted against in the MemoryPool, that of the
+  // MemoryScope it is allocated in by default. A view is accounted as part
+  // of its parent.
+  void set_tag(const MemoryTag& tag);
+  // Starts copying the cpu data to the gpu on the given stream and marks the
+  // memory as synced. The gpu data must not be used before the stream has
+  // been synchronized. The copy is only asynchronous if the cpu data is
+  // pinned.
+  void async_gpu_push(const cudaStream_t& stream);
+  // The other way around: starts copying the gpu data to the cpu on stream,
+  // into pinned memory if the cpu data is not allocated yet, and marks the
+  // memory as synced. The cpu data must not be used before the stream has
+  // been synchronized. Returns false, doing nothing, unless the gpu data is
+  // owned, e.g. for views and set_gpu_data, and current.
+  bool async_cpu_pull(const cudaStream_t& stream);
+  // Gives the gpu memory of synced memory back to the MemoryPool, leaving
+  // the head at the cpu: the next gpu access copies the data back. Does
+  // nothing if the memory is not synced, e.g. written on the gpu since.
+  void free_gpu_data();
+  // Gives both the cpu and the gpu memory back to the MemoryPool, the memory
+  // then being as new: the next access allocates it again, filled with 0.
+  // Does nothing for views and for memory not owned, e.g. set_cpu_data.
+  void free_data();
   enum SyncedHead { UNINITIALIZED, HEAD_AT_CPU, HEAD_AT_GPU, SYNCED };
-  SyncedHead head() { return head_; }
+  SyncedHead head() { return parent_ ? parent_->head() : head_; }
   size_t size() { return size_; }
+  // The offset of a view in its parent, 0 for the others
+  size_t offset() const { return offset_; }
+
+  // Tracing of the copies between host and device, of all threads, to find
+  // the hidden round trips that slow down GPU training, e.g. a layer reading
+  // cpu_data in GPU mode. A round trip is a copy to the host in GPU mode, or
+  // a copy to a device the memory was on already, made in the pass of a
+  // layer (see TraceScope); the first copies of the parameters and of the
+  // data to the device are expected.
+  enum TraceMode {
+    TRACE_OFF,
+    // Counts the copies, overall and by layer
+    TRACE_COUNT,
+    // Also logs each of them
+    TRACE_LOG,
+    // Also logs an error for each round trip
+    TRACE_STRICT
+  };
+  static void set_trace_mode(const TraceMode mode);
+  static TraceMode trace_mode();
+  // The copies since the last ResetTransfers, overall and by layer ("" for
+  // those made outside the passes of the layers).
+  static TransferStats transfers();
+  static TransferStats layer_transfers(const std::string& layer_name);
+  static void ResetTransfers();
+  // Logs the copies since the last ResetTransfers, e.g. of an iteration.
+  static void LogTransfers();
+
+  // Attributes the copies the calling thread makes while in scope to a layer,
+  // e.g. in its Forward. Only used if the tracing is on.
+  class TraceScope {
+   public:
+    explicit TraceScope(const std::string& layer_name);
+    ~TraceScope();
+
+   protected:
+    const std::string* previous_layer_name_;
+    bool active_;
+
+    DISABLE_COPY_AND_ASSIGN(TraceScope);
+  };
 
  private:
+  // Counts a copy of size bytes, and logs it as the trace mode asks.
+  static void TraceTransfer(const bool to_device, const size_t size,
+      const bool round_trip);
   void to_cpu();
   void to_gpu();
   void* cpu_ptr_;
@@ -58,6 +190,16 @@ class SyncedMemory {
   size_t size_;
   SyncedHead head_;
   bool own_cpu_data_;
+  bool own_gpu_data_;
+  // Whether pinned memory was requested, and whether cpu_ptr_ actually is.
+  bool pinned_;
+  bool cpu_pinned_;
+  // The memory this one is a view of, if any
+  shared_ptr<SyncedMemory> parent_;
+  size_t offset_;
+  // The shared memory segment of the cpu data, if any
+  shared_ptr<SharedMemorySegment> segment_;
+  MemoryTag tag_;
 
   DISABLE_COPY_AND_ASSIGN(SyncedMemory);
 };  // class SyncedMemory
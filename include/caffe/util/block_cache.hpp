@@ -0,0 +1,64 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_BLOCK_CACHE_H_
+#define CAFFE_UTIL_BLOCK_CACHE_H_
+
+#include <pthread.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "caffe/common.hpp"
+
+using std::string;
+
+namespace caffe {
+
+// A cache of blocks of remote files in a local directory, bounded in size:
+// once the blocks held take more than capacity bytes, the least recently
+// used ones are deleted. The blocks found in the directory when the cache is
+// created are kept, the most recently used first, so that a restarted job
+// finds its working set there. It can be shared between threads; processes
+// should have directories of their own.
+class DiskBlockCache {
+ public:
+  DiskBlockCache(const string& dir, const size_t capacity);
+  ~DiskBlockCache();
+
+  // Returns false if the block of key is not in the cache.
+  bool Get(const string& key, string* data);
+  // Blocks larger than the capacity are not cached.
+  void Put(const string& key, const string& data);
+
+  size_t capacity() const { return capacity_; }
+  // The number of bytes of the cached blocks.
+  size_t size();
+  // The number of cached blocks.
+  size_t count();
+
+ protected:
+  // The file of the block of key, named by a hash of it; the file starts
+  // with key, to tell collisions apart.
+  string FileName(const string& key) const;
+  // Deletes the least recently used blocks until the size is within the
+  // capacity, with the lock held.
+  void Evict();
+
+  typedef std::list<std::pair<string, size_t> > BlockList;
+
+  const string dir_;
+  // The file names and sizes of the blocks; the least recently used last
+  BlockList blocks_;
+  std::map<string, BlockList::iterator> index_;
+  const size_t capacity_;
+  size_t size_;
+  pthread_mutex_t mutex_;
+
+  DISABLE_COPY_AND_ASSIGN(DiskBlockCache);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_BLOCK_CACHE_H_
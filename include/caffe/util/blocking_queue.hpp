@@ -0,0 +1,79 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_BLOCKING_QUEUE_H_
+#define CAFFE_UTIL_BLOCKING_QUEUE_H_
+
+#include <pthread.h>
+
+#include <queue>
+
+#include "glog/logging.h"
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+// A simple unbounded FIFO queue that can be shared between threads. pop()
+// blocks until an element is available. The data layers use a pair of these
+// to pass prefetch buffer indices back and forth between the prefetch thread
+// and Forward, which bounds the number of batches in flight.
+template <typename T>
+class BlockingQueue {
+ public:
+  BlockingQueue() {
+    CHECK(!pthread_mutex_init(&mutex_, NULL)) << "Mutex init failed.";
+    CHECK(!pthread_cond_init(&condition_, NULL)) << "Condition init failed.";
+  }
+  ~BlockingQueue() {
+    pthread_cond_destroy(&condition_);
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  void push(const T& t) {
+    pthread_mutex_lock(&mutex_);
+    queue_.push(t);
+    pthread_mutex_unlock(&mutex_);
+    pthread_cond_signal(&condition_);
+  }
+
+  // Returns false without blocking if the queue is empty.
+  bool try_pop(T* t) {
+    pthread_mutex_lock(&mutex_);
+    const bool popped = !queue_.empty();
+    if (popped) {
+      *t = queue_.front();
+      queue_.pop();
+    }
+    pthread_mutex_unlock(&mutex_);
+    return popped;
+  }
+
+  T pop() {
+    pthread_mutex_lock(&mutex_);
+    while (queue_.empty()) {
+      pthread_cond_wait(&condition_, &mutex_);
+    }
+    T t = queue_.front();
+    queue_.pop();
+    pthread_mutex_unlock(&mutex_);
+    return t;
+  }
+
+  size_t size() {
+    pthread_mutex_lock(&mutex_);
+    const size_t size = queue_.size();
+    pthread_mutex_unlock(&mutex_);
+    return size;
+  }
+
+ protected:
+  std::queue<T> queue_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t condition_;
+
+  DISABLE_COPY_AND_ASSIGN(BlockingQueue);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_BLOCKING_QUEUE_H_
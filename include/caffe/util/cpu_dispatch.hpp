@@ -0,0 +1,31 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_CPU_DISPATCH_H_
+#define CAFFE_UTIL_CPU_DISPATCH_H_
+
+namespace caffe {
+
+// Marks the definition of a hot CPU kernel (im2col, pooling, LRN, the vector
+// math, the data transformations) to be compiled for AVX2 and for SSE4.2
+// besides the baseline of the build, the loader picking once, from CPUID,
+// the best clone the CPU runs: one library then gets each machine its best
+// kernels. It takes USE_CPU_DISPATCH and GCC 6 or later on x86, and does
+// nothing otherwise. The clones leave out FMA, so that their results are
+// those of the baseline on every machine. Functions inlined into a kernel
+// are compiled with it; a kernel itself is no longer inlined.
+#if defined(USE_CPU_DISPATCH) && defined(__GNUC__) && !defined(__clang__) && \
+    __GNUC__ >= 6 && (defined(__x86_64__) || defined(__i386__))
+#define CAFFE_CPU_DISPATCH_CLONES
+#define CAFFE_CPU_DISPATCH \
+  __attribute__((target_clones("avx2", "sse4.2", "default")))
+#else
+#define CAFFE_CPU_DISPATCH
+#endif
+
+// The clone of the kernels the CPU runs, "avx2", "sse4.2" or "default",
+// always "default" when they are not cloned.
+const char* CpuDispatchTarget();
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_CPU_DISPATCH_H_
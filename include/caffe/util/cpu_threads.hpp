@@ -0,0 +1,94 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_CPU_THREADS_H_
+#define CAFFE_UTIL_CPU_THREADS_H_
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <algorithm>
+
+#include "caffe/common.hpp"
+#include "caffe/util/mkl_alternate.hpp"
+
+namespace caffe {
+
+// The number of threads a CPU layer splits num independent pieces of work
+// (e.g. the images of a batch) over: Caffe::cpu_threads(), at most num, and
+// always 1 when Caffe is built without OpenMP.
+inline int CpuLayerThreads(const int64_t num) {
+#ifdef _OPENMP
+  return static_cast<int>(std::max<int64_t>(1,
+      std::min<int64_t>(Caffe::cpu_threads(), num)));
+#else
+  return 1;
+#endif
+}
+
+// The elements per thread under which an elementwise CPU function keeps its
+// loop serial, starting the threads costing more than they save
+const int kCpuElementwiseGrain = 1 << 15;
+
+// The threads an elementwise CPU function of n elements splits its loop over:
+// one per kCpuElementwiseGrain elements, and only the calling thread within
+// a parallel loop of a layer, whose threads already have the cores.
+inline int CpuElementwiseThreads(const int64_t n) {
+#ifdef _OPENMP
+  if (omp_in_parallel()) {
+    return 1;
+  }
+#endif
+  return CpuLayerThreads(n / kCpuElementwiseGrain);
+}
+
+// The parallel for pragma of the loops above over num_threads threads, for
+// the loops of macros, which cannot hold a #pragma
+#ifdef _OPENMP
+#define CAFFE_OMP_PARALLEL_FOR \
+  _Pragma("omp parallel for num_threads(num_threads) if (num_threads > 1)")
+#else
+#define CAFFE_OMP_PARALLEL_FOR
+#endif
+
+// The id of the calling thread in a parallel loop of a layer, 0 outside one.
+inline int CpuThreadId() {
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+// Makes the BLAS calls of the calling thread single threaded while in scope,
+// if serial is true, so that the threads of a layer do not each start as many
+// MKL threads as there are cores. Other BLAS libraries are left alone (an
+// OpenMP OpenBLAS already runs single threaded in a parallel region).
+class SerialBlasScope {
+ public:
+  explicit SerialBlasScope(const bool serial)
+      : serial_(serial), previous_threads_(0) {
+#ifdef USE_MKL
+    if (serial_) {
+      previous_threads_ = mkl_set_num_threads_local(1);
+    }
+#endif
+  }
+  ~SerialBlasScope() {
+#ifdef USE_MKL
+    if (serial_) {
+      mkl_set_num_threads_local(previous_threads_);
+    }
+#endif
+  }
+
+ private:
+  bool serial_;
+  int previous_threads_;
+
+  DISABLE_COPY_AND_ASSIGN(SerialBlasScope);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_CPU_THREADS_H_
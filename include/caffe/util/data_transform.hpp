@@ -0,0 +1,83 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_DATA_TRANSFORM_H_
+#define CAFFE_UTIL_DATA_TRANSFORM_H_
+
+#include <stdint.h>
+
+namespace caffe {
+
+// The transformation shared by the data layers: converts uint8 pixels to
+// Dtype, subtracts the mean and scales them, i.e.
+//   dst[i] = (src[i * src_stride] - mean[i]) * scale  for i in [0, length).
+// The mean goes with the source pixels. If mirror is set, dst holds the
+// flipped row: dst[i] = (src[j * src_stride] - mean[j]) * scale with
+// j = length - 1 - i, while dst is still written left to right. src_stride
+// lets the pixels of one channel be read out of interleaved (e.g. OpenCV)
+// data.
+template <typename Dtype>
+void TransformRow(const int length, const uint8_t* src, const int src_stride,
+    const bool mirror, const Dtype* mean, const Dtype scale, Dtype* dst);
+
+// Transforms the crop_size x crop_size window at (h_off, w_off) of a
+// channels x height x width uint8 image into dst, optionally mirrored. mean
+// has the shape of the image and is read at the same positions as the
+// pixels. A crop_size of 0 transforms the whole image.
+template <typename Dtype>
+void TransformImage(const uint8_t* data, const int channels,
+    const int height, const int width, const int h_off, const int w_off,
+    const int crop_size, const bool mirror, const Dtype* mean,
+    const Dtype scale, Dtype* dst);
+
+// Same as TransformRow, but subtracts the same mean_value from every pixel.
+template <typename Dtype>
+void TransformRowMeanValue(const int length, const uint8_t* src,
+    const int src_stride, const bool mirror, const Dtype mean_value,
+    const Dtype scale, Dtype* dst);
+
+// Same as TransformImage, but with one mean value per channel instead of a
+// mean image.
+template <typename Dtype>
+void TransformImageMeanValues(const uint8_t* data, const int channels,
+    const int height, const int width, const int h_off, const int w_off,
+    const int crop_size, const bool mirror, const Dtype* mean_values,
+    const Dtype scale, Dtype* dst);
+
+// The transformation of the float_data of a datum, whose values are already
+// floats: dst[i] = (src[i] - mean[i]) * scale for i in [0, length).
+template <typename Dtype>
+void TransformFloats(const int length, const float* src, const Dtype* mean,
+    const Dtype scale, Dtype* dst);
+
+// Same as TransformFloats, but subtracts the same mean_value from every
+// value.
+template <typename Dtype>
+void TransformFloatsMeanValue(const int length, const float* src,
+    const Dtype mean_value, const Dtype scale, Dtype* dst);
+
+// Resizes a height x width x channels image, the channels interleaved as
+// pycaffe holds images, to new_height x new_width with bilinear
+// interpolation. The pixel centers are aligned and the borders clamped.
+template <typename Dtype>
+void ResizeImage(const Dtype* src, const int height, const int width,
+    const int channels, const int new_height, const int new_width,
+    Dtype* dst);
+
+// The preprocessing of pycaffe's Net.preprocess: transforms the
+// crop_height x crop_width window at (h_off, w_off) of a
+// height x width x channels image into a channels x crop_height x crop_width
+// dst, optionally mirrored:
+//   dst[c][h][w] = src[h + h_off][w + w_off][channel_order[c]] * scale
+//       - mean[c][h][w]
+// Unlike in TransformImage, the mean goes with the destination pixels.
+// channel_order and mean may be NULL for the identity and no mean.
+template <typename Dtype>
+void PreprocessImage(const Dtype* src, const int height, const int width,
+    const int channels, const int h_off, const int w_off,
+    const int crop_height, const int crop_width, const bool mirror,
+    const int* channel_order, const Dtype scale, const Dtype* mean,
+    Dtype* dst);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_DATA_TRANSFORM_H_
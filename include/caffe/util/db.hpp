@@ -0,0 +1,210 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_DB_HPP_
+#define CAFFE_UTIL_DB_HPP_
+
+#include <lmdb.h>
+
+#include <string>
+
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+
+#include "caffe/common.hpp"
+#include "caffe/proto/caffe.pb.h"
+
+using std::string;
+
+namespace caffe {
+
+// A cursor walking the records of a DB in key order. The pointer returned by
+// value_data() points into the DB's own buffers (the memory map for lmdb)
+// rather than into a copy, and is only valid until the cursor moves.
+class DBCursor {
+ public:
+  DBCursor() {}
+  virtual ~DBCursor() {}
+  virtual void SeekToFirst() = 0;
+  // Moves to the last record, e.g. to find where an interrupted write stopped.
+  virtual void SeekToLast() = 0;
+  // Moves to the first record whose key is key or after it.
+  virtual void SeekToKey(const string& key) = 0;
+  virtual void Next() = 0;
+  virtual bool valid() = 0;
+  virtual string key() = 0;
+  virtual const char* value_data() = 0;
+  virtual size_t value_size() = 0;
+  // Returns a copy of the current value.
+  string value() { return string(value_data(), value_size()); }
+
+  DISABLE_COPY_AND_ASSIGN(DBCursor);
+};
+
+// A batch of writes, applied to the DB when committed. The transaction can
+// keep being used after a commit; writes not committed when it is deleted are
+// discarded.
+class DBTransaction {
+ public:
+  DBTransaction() {}
+  virtual ~DBTransaction() {}
+  virtual void Put(const string& key, const string& value) = 0;
+  virtual void Commit() = 0;
+
+  DISABLE_COPY_AND_ASSIGN(DBTransaction);
+};
+
+// A key-value store of serialized records, such as the Datums read by the
+// DataLayer. Use GetDB to get one for a given backend.
+class DB {
+ public:
+  enum Mode { READ, WRITE, NEW };
+
+  DB() {}
+  virtual ~DB() {}
+  // Opens the DB at source. READ opens an existing DB, WRITE creates it if
+  // needed and NEW fails if it already exists.
+  virtual void Open(const string& source, Mode mode) = 0;
+  virtual void Close() = 0;
+  // The caller takes ownership of the returned cursor or transaction, which
+  // must be deleted before the DB is closed.
+  virtual DBCursor* NewCursor() = 0;
+  virtual DBTransaction* NewTransaction() = 0;
+
+  DISABLE_COPY_AND_ASSIGN(DB);
+};
+
+class LevelDBCursor : public DBCursor {
+ public:
+  explicit LevelDBCursor(leveldb::Iterator* iter)
+      : iter_(iter) { SeekToFirst(); }
+  ~LevelDBCursor() { delete iter_; }
+  virtual void SeekToFirst() { iter_->SeekToFirst(); }
+  virtual void SeekToLast() { iter_->SeekToLast(); }
+  virtual void SeekToKey(const string& key) { iter_->Seek(key); }
+  virtual void Next() { iter_->Next(); }
+  virtual bool valid() { return iter_->Valid(); }
+  virtual string key() { return iter_->key().ToString(); }
+  virtual const char* value_data() { return iter_->value().data(); }
+  virtual size_t value_size() { return iter_->value().size(); }
+
+ private:
+  leveldb::Iterator* iter_;
+};
+
+class LevelDBTransaction : public DBTransaction {
+ public:
+  explicit LevelDBTransaction(leveldb::DB* db) : db_(db) { CHECK(db_); }
+  virtual void Put(const string& key, const string& value) {
+    batch_.Put(key, value);
+  }
+  virtual void Commit();
+
+ private:
+  leveldb::DB* db_;
+  leveldb::WriteBatch batch_;
+};
+
+class LevelDB : public DB {
+ public:
+  LevelDB() : db_(NULL) {}
+  virtual ~LevelDB() { Close(); }
+  virtual void Open(const string& source, Mode mode);
+  virtual void Close() {
+    delete db_;
+    db_ = NULL;
+  }
+  virtual DBCursor* NewCursor();
+  virtual DBTransaction* NewTransaction() {
+    return new LevelDBTransaction(db_);
+  }
+
+ private:
+  leveldb::DB* db_;
+};
+
+class LMDBCursor : public DBCursor {
+ public:
+  LMDBCursor(MDB_txn* txn, MDB_cursor* cursor)
+      : txn_(txn), cursor_(cursor), valid_(false) { SeekToFirst(); }
+  ~LMDBCursor() {
+    mdb_cursor_close(cursor_);
+    mdb_txn_abort(txn_);
+  }
+  virtual void SeekToFirst() { Seek(MDB_FIRST); }
+  virtual void SeekToLast() { Seek(MDB_LAST); }
+  virtual void SeekToKey(const string& key);
+  virtual void Next() { Seek(MDB_NEXT); }
+  virtual bool valid() { return valid_; }
+  virtual string key() {
+    return string(static_cast<const char*>(mdb_key_.mv_data),
+        mdb_key_.mv_size);
+  }
+  virtual const char* value_data() {
+    return static_cast<const char*>(mdb_value_.mv_data);
+  }
+  virtual size_t value_size() { return mdb_value_.mv_size; }
+
+ private:
+  void Seek(MDB_cursor_op op);
+
+  MDB_txn* txn_;
+  MDB_cursor* cursor_;
+  MDB_val mdb_key_, mdb_value_;
+  bool valid_;
+};
+
+class LMDBTransaction : public DBTransaction {
+ public:
+  LMDBTransaction(MDB_env* env, MDB_dbi dbi);
+  ~LMDBTransaction() { mdb_txn_abort(txn_); }
+  virtual void Put(const string& key, const string& value);
+  virtual void Commit();
+
+ private:
+  MDB_env* env_;
+  MDB_dbi dbi_;
+  MDB_txn* txn_;
+};
+
+class LMDB : public DB {
+ public:
+  LMDB() : env_(NULL) {}
+  virtual ~LMDB() { Close(); }
+  virtual void Open(const string& source, Mode mode);
+  virtual void Close() {
+    if (env_ != NULL) {
+      mdb_dbi_close(env_, dbi_);
+      mdb_env_close(env_);
+      env_ = NULL;
+    }
+  }
+  virtual DBCursor* NewCursor();
+  virtual DBTransaction* NewTransaction();
+
+ private:
+  MDB_env* env_;
+  MDB_dbi dbi_;
+};
+
+// The caller takes ownership of the returned, unopened DB.
+DB* GetDB(DataParameter::DB backend);
+// Same as above, with the backend given by name ("leveldb", "lmdb" or
+// "remote").
+DB* GetDB(const string& backend);
+// The DB of the backend of param, with its options, e.g. the fetching and
+// caching of a REMOTE one.
+DB* GetDB(const DataParameter& param);
+
+// The DB at source, opened for reading once per process: the layers of the
+// train and test nets, or of data parallel replicas, reading the same source
+// share it, which leveldb's lock would otherwise forbid. It is closed once
+// no one holds it anymore. Its cursors may be used from several threads at
+// once. Only lmdbs can be read by several processes at the same time.
+shared_ptr<DB> GetSharedDB(DataParameter::DB backend, const string& source);
+// Same as above, for the source and the options of param. The layers sharing
+// the DB share the options of the first one.
+shared_ptr<DB> GetSharedDB(const DataParameter& param);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_DB_HPP_
@@ -0,0 +1,70 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef _CAFFE_UTIL_DEPTHWISE_CONV_HPP_
+#define _CAFFE_UTIL_DEPTHWISE_CONV_HPP_
+
+namespace caffe {
+
+// The direct convolution of a layer whose group is its number of channels:
+// each channel c of the num images (num x channels x height x width, zero
+// padded by pad_h and pad_w) is convolved by its own multiplier kernels
+// alone, the weights (channels * multiplier x 1 x kernel_h x kernel_w),
+// into the outputs c * multiplier to (c + 1) * multiplier - 1 of the top
+// (num x channels * multiplier x height_out x width_out). As a GEMM per
+// channel, it would only multiply matrices of multiplier rows.
+
+// Sets the top, adding bias (channels * multiplier values) unless it is NULL
+// and then applying a ReLU if relu.
+template <typename Dtype>
+void depthwise_conv_forward_cpu(const Dtype* bottom, const int num,
+    const int channels, const int height, const int width,
+    const int multiplier, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_out, const int width_out, const Dtype* weight,
+    const Dtype* bias, const bool relu, Dtype* top);
+
+// Sets the bottom diff from the top diff, or adds to it if accumulate.
+template <typename Dtype>
+void depthwise_conv_backward_bottom_cpu(const Dtype* top_diff,
+    const int num, const int channels, const int height, const int width,
+    const int multiplier, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_out, const int width_out, const Dtype* weight,
+    const bool accumulate, Dtype* bottom_diff);
+
+// Adds the gradient of the weights to weight_diff.
+template <typename Dtype>
+void depthwise_conv_backward_weight_cpu(const Dtype* bottom,
+    const Dtype* top_diff, const int num, const int channels,
+    const int height, const int width, const int multiplier,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int height_out,
+    const int width_out, Dtype* weight_diff);
+
+template <typename Dtype>
+void depthwise_conv_forward_gpu(const Dtype* bottom, const int num,
+    const int channels, const int height, const int width,
+    const int multiplier, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_out, const int width_out, const Dtype* weight,
+    const Dtype* bias, const bool relu, Dtype* top);
+
+template <typename Dtype>
+void depthwise_conv_backward_bottom_gpu(const Dtype* top_diff,
+    const int num, const int channels, const int height, const int width,
+    const int multiplier, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_out, const int width_out, const Dtype* weight,
+    const bool accumulate, Dtype* bottom_diff);
+
+template <typename Dtype>
+void depthwise_conv_backward_weight_gpu(const Dtype* bottom,
+    const Dtype* top_diff, const int num, const int channels,
+    const int height, const int width, const int multiplier,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int height_out,
+    const int width_out, Dtype* weight_diff);
+
+}  // namespace caffe
+
+#endif  // _CAFFE_UTIL_DEPTHWISE_CONV_HPP_
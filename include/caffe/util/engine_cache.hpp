@@ -0,0 +1,28 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_ENGINE_CACHE_H_
+#define CAFFE_UTIL_ENGINE_CACHE_H_
+
+#include <string>
+
+namespace caffe {
+
+using std::string;
+
+// The engines picked by timing the candidates of a layer (e.g. the AUTO
+// convolution engine), keyed by a description of the layer shape. The choices
+// are kept for the life of the process and, when Caffe::engine_cache_file()
+// is set, read from and appended to that file, one "key engine" line per
+// choice, so that later runs skip the timing. Setting another file forgets the
+// choices of the previous one.
+
+// Returns the key of a layer description on the current device: the mode,
+// and the GPU name or the number of CPU threads, come first.
+string EngineCacheKey(const string& layer_description);
+// Returns whether an engine was stored under key, and sets *engine to it.
+bool LookupEngine(const string& key, int* engine);
+void StoreEngine(const string& key, const int engine);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_ENGINE_CACHE_H_
@@ -0,0 +1,32 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_FEATURE_CACHE_H_
+#define CAFFE_UTIL_FEATURE_CACHE_H_
+
+#include <string>
+
+#include "caffe/proto/caffe.pb.h"
+
+using std::string;
+
+namespace caffe {
+
+// Splits param, a train net fine-tuned above its frozen lower layers, at the
+// blob boundary, to train the upper layers from a cache of the boundary (see
+// tools/cache_features.cpp):
+//  - prefix is the layers of param up to the last one writing boundary, to
+//    run once over the data to write the cache, reading it in order;
+//  - suffix is the other layers, after a DATA layer of the name of the data
+//    layer of param, the first one, reading the cache from cache_source with
+//    cache_backend. It gives boundary and the label, the second top of the
+//    data layer if any, in batches of the same size, shuffled if the data
+//    layer shuffles.
+// The layers of suffix may only read the blobs written in suffix, boundary
+// and the label. Returns the name of the label, empty without one.
+string SplitNetAtBlob(const NetParameter& param, const string& boundary,
+    const string& cache_source, const DataParameter::DB cache_backend,
+    NetParameter* prefix, NetParameter* suffix);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_FEATURE_CACHE_H_
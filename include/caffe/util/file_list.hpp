@@ -0,0 +1,48 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_FILE_LIST_H_
+#define CAFFE_UTIL_FILE_LIST_H_
+
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+
+using std::string;
+using std::vector;
+
+namespace caffe {
+
+// A list of labeled file names kept in one arena of characters, each name
+// followed by a '\0', with the offset and label of each file alongside: a
+// few bytes per file on top of its name rather than a string of its own,
+// so that lists of hundreds of millions of files stay compact and load
+// quickly.
+class FileList {
+ public:
+  FileList() {}
+
+  // Appends the "filename label" pairs read from source, returning the
+  // number of files read.
+  size_t ReadFile(const string& source);
+  void Add(const string& filename, const int label);
+  // Releases the memory reserved for names not yet added.
+  void Trim();
+
+  size_t size() const { return labels_.size(); }
+  const char* filename(const size_t i) const {
+    return &names_[offsets_[i]];
+  }
+  int label(const size_t i) const { return labels_[i]; }
+
+ protected:
+  vector<char> names_;
+  vector<size_t> offsets_;
+  vector<int> labels_;
+
+  DISABLE_COPY_AND_ASSIGN(FileList);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_FILE_LIST_H_
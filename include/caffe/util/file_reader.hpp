@@ -0,0 +1,67 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_FILE_READER_H_
+#define CAFFE_UTIL_FILE_READER_H_
+
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/blocking_queue.hpp"
+
+using std::string;
+
+namespace caffe {
+
+// A file an AsyncFileReader reads into memory.
+struct FileRead {
+  string filename;
+  string contents;
+  // Set once the read is over, successful or not
+  bool done;
+  bool ok;
+};
+
+// Reads whole files into memory on a pool of I/O threads, as many at a time
+// as it has threads, so that the latency of a networked filesystem is paid
+// once for many files instead of once per file, and so that the threads
+// decoding them never wait on a read of their own. With direct, files are
+// read with O_DIRECT, around the page cache, which a dataset read once per
+// epoch only pollutes; filesystems without it are read normally.
+class AsyncFileReader {
+ public:
+  AsyncFileReader(const int num_threads, const bool direct);
+  // Waits for the reads in progress; those not started fail.
+  ~AsyncFileReader();
+
+  // Starts reading filename, after the reads already asked for.
+  shared_ptr<FileRead> Read(const string& filename);
+  // Blocks until read is over. Returns false, having logged why, if the file
+  // could not be read.
+  bool Wait(const FileRead& read);
+
+  int num_threads() const { return threads_.size(); }
+
+ protected:
+  static void* ReaderThread(void* reader_pointer);
+  // Reads the file of read in the calling thread, into buffer, aligned and
+  // grown as O_DIRECT needs.
+  bool ReadFile(FileRead* read, std::vector<char>* buffer);
+  void Finish(FileRead* read, const bool ok);
+
+  const bool direct_;
+  std::vector<pthread_t> threads_;
+  // The reads not started yet; NULL stops a thread.
+  BlockingQueue<shared_ptr<FileRead> > pending_;
+  bool stopping_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t done_;
+
+  DISABLE_COPY_AND_ASSIGN(AsyncFileReader);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_FILE_READER_H_
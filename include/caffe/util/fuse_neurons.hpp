@@ -0,0 +1,172 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_FUSE_NEURONS_H_
+#define CAFFE_UTIL_FUSE_NEURONS_H_
+
+#include <stdint.h>
+
+#include <cmath>
+
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/philox.hpp"
+
+namespace caffe {
+
+// Copy a NetParameter (with splits inserted and the neuron layers already
+// rewritten in place) in which each chain of consecutive neuron layers that
+// run in place on the top of the first one is replaced by a single
+// FUSED_NEURON layer, named after them joined by '+', with the same bottom
+// and top. The first layer of a chain may be a ReLU, sigmoid, tanh or
+// dropout layer, the others ReLU or dropout layers: their bottom follows from
+// their top wherever their Backward needs it, so that the fused Backward only
+// reads the final top. A chain holds at most kMaxFusedNeurons layers.
+// Before that, a ReLU layer in place on the top of the convolution or inner
+// product layer just before it is removed and run by that layer instead, with
+// its fused_relu parameter set: the layer keeps its name, and so its weights.
+void FuseNeuronLayers(const NetParameter& param, NetParameter* param_fused);
+
+// Whether a layer of the given type can be fused, as the first layer of a
+// chain or after it.
+bool CanFuseNeuron(const LayerParameter_LayerType type, const bool first);
+
+// The most neuron layers a FusedNeuronLayer runs
+const int kMaxFusedNeurons = 8;
+// The elements run at once: those of the 4 words of a Philox call, so that
+// the masks of the dropout layers are those of DropoutLayer.
+const int kFusedNeuronBlockSize = 4;
+
+// The neuron layers a FusedNeuronLayer runs, plain data passed by value to
+// the kernels.
+struct FusedNeuronOps {
+  enum Type { RELU, SIGMOID, TANH, DROPOUT };
+  int num_ops;
+  int type[kMaxFusedNeurons];
+  // Whether the dropout layers drop (only in the TRAIN phase), their
+  // threshold and scale, and the Philox key of their mask, as in DropoutLayer
+  bool train;
+  unsigned int threshold[kMaxFusedNeurons];
+  double scale[kMaxFusedNeurons];
+  uint32_t key[kMaxFusedNeurons][2];
+};
+
+// Draws the mask words of dropout op k for the elements of block.
+PHILOX_HOST_DEVICE inline void FusedNeuronMask(const FusedNeuronOps& ops,
+    const int k, const int block, uint32_t random[kFusedNeuronBlockSize]) {
+  const uint32_t counter[4] = { static_cast<uint32_t>(block), 0, 0, 0 };
+  philox4x32(counter, ops.key[k], random);
+}
+
+// Runs the ops forward on the elements of block, out = ops(in). out may be
+// in.
+template <typename Dtype>
+PHILOX_HOST_DEVICE inline void FusedNeuronForwardBlock(
+    const FusedNeuronOps& ops, const int block, const int count,
+    const Dtype* in, Dtype* out) {
+  const int begin = block * kFusedNeuronBlockSize;
+  const int size = count - begin < kFusedNeuronBlockSize ?
+      count - begin : kFusedNeuronBlockSize;
+  Dtype values[kFusedNeuronBlockSize];
+  for (int j = 0; j < size; ++j) {
+    values[j] = in[begin + j];
+  }
+  for (int k = 0; k < ops.num_ops; ++k) {
+    switch (ops.type[k]) {
+    case FusedNeuronOps::RELU:
+      for (int j = 0; j < size; ++j) {
+        values[j] = values[j] > 0 ? values[j] : Dtype(0);
+      }
+      break;
+    case FusedNeuronOps::SIGMOID:
+      for (int j = 0; j < size; ++j) {
+        values[j] = 1. / (1. + exp(-values[j]));
+      }
+      break;
+    case FusedNeuronOps::TANH:
+      for (int j = 0; j < size; ++j) {
+        const Dtype exp2x = exp(2 * values[j]);
+        values[j] = (exp2x - Dtype(1)) / (exp2x + Dtype(1));
+      }
+      break;
+    case FusedNeuronOps::DROPOUT:
+      if (ops.train) {
+        uint32_t random[kFusedNeuronBlockSize];
+        FusedNeuronMask(ops, k, block, random);
+        for (int j = 0; j < size; ++j) {
+          values[j] = values[j] * (random[j] > ops.threshold[k]) *
+              Dtype(ops.scale[k]);
+        }
+      }
+      break;
+    }
+  }
+  for (int j = 0; j < size; ++j) {
+    out[begin + j] = values[j];
+  }
+}
+
+// Runs the ops backward on the elements of block in the TRAIN phase, from
+// the final top data and diff. bottom_diff may be top_diff.
+template <typename Dtype>
+PHILOX_HOST_DEVICE inline void FusedNeuronBackwardBlock(
+    const FusedNeuronOps& ops, const int block, const int count,
+    const Dtype* top_data, const Dtype* top_diff, Dtype* bottom_diff) {
+  const int begin = block * kFusedNeuronBlockSize;
+  const int size = count - begin < kFusedNeuronBlockSize ?
+      count - begin : kFusedNeuronBlockSize;
+  // The top of each op, and the mask words of the dropout ops
+  Dtype tops[kMaxFusedNeurons][kFusedNeuronBlockSize];
+  uint32_t random[kMaxFusedNeurons][kFusedNeuronBlockSize];
+  const int last = ops.num_ops - 1;
+  for (int j = 0; j < size; ++j) {
+    tops[last][j] = top_data[begin + j];
+  }
+  for (int k = last; k >= 0; --k) {
+    if (ops.type[k] == FusedNeuronOps::DROPOUT) {
+      FusedNeuronMask(ops, k, block, random[k]);
+    }
+    if (k == 0) {
+      break;
+    }
+    // The bottom of op k, a ReLU or dropout op. Where it is lost (0 for the
+    // ReLU, dropped for the dropout), op k passes no gradient, and 0 serves.
+    for (int j = 0; j < size; ++j) {
+      if (ops.type[k] == FusedNeuronOps::RELU) {
+        tops[k - 1][j] = tops[k][j];
+      } else {
+        tops[k - 1][j] = random[k][j] > ops.threshold[k] ?
+            tops[k][j] / Dtype(ops.scale[k]) : Dtype(0);
+      }
+    }
+  }
+  Dtype diffs[kFusedNeuronBlockSize];
+  for (int j = 0; j < size; ++j) {
+    diffs[j] = top_diff[begin + j];
+  }
+  for (int k = last; k >= 0; --k) {
+    for (int j = 0; j < size; ++j) {
+      const Dtype top = tops[k][j];
+      switch (ops.type[k]) {
+      case FusedNeuronOps::RELU:
+        diffs[j] = diffs[j] * (top > 0);
+        break;
+      case FusedNeuronOps::SIGMOID:
+        diffs[j] = diffs[j] * top * (1. - top);
+        break;
+      case FusedNeuronOps::TANH:
+        diffs[j] = diffs[j] * (1 - top * top);
+        break;
+      case FusedNeuronOps::DROPOUT:
+        diffs[j] = diffs[j] * (random[k][j] > ops.threshold[k]) *
+            Dtype(ops.scale[k]);
+        break;
+      }
+    }
+  }
+  for (int j = 0; j < size; ++j) {
+    bottom_diff[begin + j] = diffs[j];
+  }
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_FUSE_NEURONS_H_
@@ -0,0 +1,42 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_GRADIENT_COMPRESSION_H_
+#define CAFFE_UTIL_GRADIENT_COMPRESSION_H_
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "caffe/proto/caffe.pb.h"
+
+namespace caffe {
+
+// The encodings of the gradients MPISync sends over the network (see
+// SolverParameter.gradient_compression), applied to a parameter blob at a
+// time:
+//  - HALF stores each value as a half (see util/half.hpp);
+//  - INT8 as an int8, of a scale of the largest absolute value over 127 (see
+//    util/quantize.hpp);
+//  - TOP_K only the top_k share of the values of the largest absolute
+//    values, at least one, with their indices, the others counting as 0.
+// With error feedback, the values each encoding loses are kept and added to
+// the gradient of the next iteration before it is encoded, so that they are
+// sent late rather than never.
+
+// Appends the encoding of the n values of x to message. Unless error is
+// NULL, the n values of error are added to x first, and set to what the
+// encoding then loses.
+template <typename Dtype>
+void EncodeGradient(const SolverParameter_GradientCompression compression,
+    const int n, const Dtype* x, const float top_k, Dtype* error,
+    std::vector<char>* message);
+
+// Adds to y the n values decoded from message at *offset, and moves *offset
+// past them.
+template <typename Dtype>
+void DecodeAddGradient(const SolverParameter_GradientCompression compression,
+    const int n, const std::vector<char>& message, size_t* offset, Dtype* y);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_GRADIENT_COMPRESSION_H_
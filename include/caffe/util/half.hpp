@@ -0,0 +1,88 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_HALF_H_
+#define CAFFE_UTIL_HALF_H_
+
+#include <stdint.h>
+
+#ifdef __CUDACC__
+#define HALF_HOST_DEVICE __host__ __device__
+#else
+#define HALF_HOST_DEVICE
+#endif
+
+namespace caffe {
+
+// The bits of an IEEE 754 half precision number, used to store data with
+// half the memory of float. The values are converted to and from float to
+// compute with them.
+typedef uint16_t float16;
+
+// Rounds x to the nearest half, ties to even. Values too large become
+// infinities.
+HALF_HOST_DEVICE inline float16 float_to_half(const float x) {
+  union { float f; uint32_t u; } bits;
+  bits.f = x;
+  const uint32_t sign = (bits.u >> 16) & 0x8000;
+  const uint32_t abs = bits.u & 0x7fffffff;
+  if (abs >= 0x7f800000) {
+    // Infinity, or NaN, kept quiet
+    return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+  }
+  if (abs >= 0x477ff000) {
+    // At least 65520, halfway above the largest half
+    return sign | 0x7c00;
+  }
+  if (abs < 0x38800000) {
+    // Below the smallest normal half, 2^-14: a multiple of 2^-24
+    const int shift = 126 - static_cast<int>(abs >> 23);
+    if (shift > 24) {
+      return sign;
+    }
+    const uint32_t mantissa = (abs & 0x7fffff) | 0x800000;
+    uint32_t result = mantissa >> shift;
+    const uint32_t rest = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (result & 1))) {
+      ++result;
+    }
+    return sign | result;
+  }
+  // Rebias the exponent from 127 to 15 and round the mantissa to 10 bits; a
+  // carry goes to the exponent.
+  uint32_t result = (abs - 0x38000000) >> 13;
+  const uint32_t rest = abs & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (result & 1))) {
+    ++result;
+  }
+  return sign | result;
+}
+
+HALF_HOST_DEVICE inline float half_to_float(const float16 h) {
+  const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  int exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  union { float f; uint32_t u; } bits;
+  if (exponent == 0x1f) {
+    bits.u = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent == 0) {
+    if (mantissa == 0) {
+      bits.u = sign;
+    } else {
+      // Normalize the subnormal half.
+      exponent = 1;
+      while (!(mantissa & 0x400)) {
+        mantissa <<= 1;
+        --exponent;
+      }
+      bits.u = sign | ((exponent + 112) << 23) | ((mantissa & 0x3ff) << 13);
+    }
+  } else {
+    bits.u = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  }
+  return bits.f;
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_HALF_H_
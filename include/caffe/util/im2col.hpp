@@ -5,25 +5,56 @@
 
 namespace caffe {
 
+// Unrolls the kernel_h x kernel_w windows of an image, padded with pad_h rows
+// and pad_w columns of zeros and a stride_h and stride_w apart, into the
+// columns of data_col, channels * kernel_h * kernel_w rows of height_col *
+// width_col, height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1.
 template <typename Dtype>
 void im2col_cpu(const Dtype* data_im, const int channels,
-    const int height, const int width, const int ksize, const int pad,
-    const int stride, Dtype* data_col);
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* data_col);
+
+// Unrolls num consecutive images into one matrix with the columns of the
+// first image, then those of the second one, etc., so that a convolution of
+// all of them is a single matrix product.
+template <typename Dtype>
+void im2col_batch_cpu(const Dtype* data_im, const int num, const int channels,
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* data_col);
 
 template <typename Dtype>
 void col2im_cpu(const Dtype* data_col, const int channels,
-    const int height, const int width, const int psize, const int pad,
-    const int stride, Dtype* data_im);
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* data_im);
+
+// The CUDA kernels of im2col_gpu and col2im_gpu. The plain ones run a thread
+// per window, or image element, over all of the image. The tiled ones, of
+// square kernels of 3, 5 or 11 with the same padding and stride both ways,
+// stage bands of rows of a channel in shared memory, so that they read and
+// write the image and the columns with consecutive threads. AUTO times both
+// the first time a shape is seen and keeps the faster, with the engine cache
+// (see engine_cache.hpp); the plain ones run the shapes the tiled ones do
+// not.
+enum Im2colGpuKernel {
+  IM2COL_GPU_AUTO = 0,
+  IM2COL_GPU_PLAIN = 1,
+  IM2COL_GPU_TILED = 2
+};
 
 template <typename Dtype>
 void im2col_gpu(const Dtype* data_im, const int channels,
-    const int height, const int width, const int ksize, const int pad,
-    const int stride, Dtype* data_col);
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* data_col, const Im2colGpuKernel kernel = IM2COL_GPU_AUTO);
 
 template <typename Dtype>
 void col2im_gpu(const Dtype* data_col, const int channels,
-    const int height, const int width, const int psize, const int pad,
-    const int stride, Dtype* data_im);
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* data_im, const Im2colGpuKernel kernel = IM2COL_GPU_AUTO);
 
 }  // namespace caffe
 
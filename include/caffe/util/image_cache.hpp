@@ -0,0 +1,56 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_IMAGE_CACHE_H_
+#define CAFFE_UTIL_IMAGE_CACHE_H_
+
+#include <pthread.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "opencv2/core/core.hpp"
+
+#include "caffe/common.hpp"
+
+using std::string;
+
+namespace caffe {
+
+// A bounded cache of decoded images keyed by file name, which can be shared
+// between threads. Once the images held take more than capacity bytes, the
+// least recently used ones are dropped. The cached images share their pixels
+// with the ones handed out by Get, so these must not be modified.
+class ImageCache {
+ public:
+  explicit ImageCache(const size_t capacity);
+  ~ImageCache();
+
+  // Returns false if the image of filename is not in the cache.
+  bool Get(const string& filename, cv::Mat* cv_img);
+  // Images larger than the capacity are not cached.
+  void Put(const string& filename, const cv::Mat& cv_img);
+
+  size_t capacity() const { return capacity_; }
+  // The number of bytes of the cached images.
+  size_t size();
+  // The number of cached images.
+  size_t count();
+
+ protected:
+  typedef std::list<std::pair<string, cv::Mat> > ImageList;
+
+  // The least recently used image comes last.
+  ImageList images_;
+  std::map<string, ImageList::iterator> index_;
+  const size_t capacity_;
+  size_t size_;
+  pthread_mutex_t mutex_;
+
+  DISABLE_COPY_AND_ASSIGN(ImageCache);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_IMAGE_CACHE_H_
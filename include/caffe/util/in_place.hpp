@@ -0,0 +1,36 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef _CAFFE_UTIL_IN_PLACE_HPP_
+#define _CAFFE_UTIL_IN_PLACE_HPP_
+
+#include <map>
+#include <string>
+
+#include "caffe/proto/caffe.pb.h"
+
+using std::map;
+using std::string;
+
+namespace caffe {
+
+// Copy a NetParameter (with splits already inserted) in which the neuron
+// layers that can safely overwrite their bottom run in place, and the
+// eltwise SUM and MAX layers on their first bottom. A layer is
+// rewritten when its bottom is only used by it, is not an input of the net or
+// the output of a split layer, its top is not an output of the net (whose
+// name would change), and, unless the net is inference only, when
+// neither the layer nor the one producing its bottom needs the overwritten
+// values in Backward. The blobs of the rewritten layers are renamed after
+// their bottom; renamed_blobs maps their old names to the new ones.
+void RewriteInPlace(const NetParameter& param, NetParameter* param_in_place,
+    map<string, string>* renamed_blobs);
+
+// Whether a layer of the given type can run in place, and whether a layer of
+// the given type still computes its Backward correctly when its top is
+// overwritten by an in place layer after it.
+bool CanRunInPlace(const LayerParameter_LayerType type, const bool inference);
+bool CanOverwriteTop(const LayerParameter_LayerType type, const bool inference);
+
+}  // namespace caffe
+
+#endif  // _CAFFE_UTIL_IN_PLACE_HPP_
@@ -8,6 +8,7 @@
 #include "google/protobuf/message.h"
 #include "hdf5.h"
 #include "hdf5_hl.h"
+#include "opencv2/core/core.hpp"
 #include "caffe/proto/caffe.pb.h"
 
 #include "caffe/blob.hpp"
@@ -60,6 +61,19 @@ inline void WriteProtoToBinaryFile(
   WriteProtoToBinaryFile(proto, filename.c_str());
 }
 
+// Decodes the image at filename into an 8 bit, 3 channel (BGR) cv::Mat,
+// resized if height and width are not zero.
+bool ReadImageToCVMat(const string& filename, const int height,
+    const int width, cv::Mat* cv_img);
+// The same for the contents of an image file, the size bytes at data, e.g.
+// read by an AsyncFileReader. Returns false if they cannot be decoded.
+bool DecodeImageToCVMat(const char* data, const int size, const int height,
+    const int width, cv::Mat* cv_img);
+// Gets the height and width of the image at filename from the header of a
+// JPEG or PNG file, decoding other files. Returns false if the file cannot
+// be read.
+bool ReadImageSize(const string& filename, int* height, int* width);
+
 bool ReadImageToDatum(const string& filename, const int label,
     const int height, const int width, Datum* datum);
 
@@ -68,6 +82,25 @@ inline bool ReadImageToDatum(const string& filename, const int label,
   return ReadImageToDatum(filename, label, 0, 0, datum);
 }
 
+// Stores the contents of the image file at filename in an encoded datum, which
+// is several times smaller than the pixels. The image is decoded once to
+// check it and to get its shape.
+bool ReadImageToEncodedDatum(const string& filename, const int label,
+    Datum* datum);
+
+// Decodes the encoded image in the size bytes at data into channels x height
+// x width uint8 pixels, in the layout of an unencoded datum. Returns false if
+// the image cannot be decoded or does not have this shape.
+bool DecodeImageToPixels(const char* data, const int size, const int channels,
+    const int height, const int width, string* pixels);
+
+// Parses a serialized Datum without copying its uint8 data out of the
+// buffer: *data is set to point at the data inside the buffer (or to NULL if
+// there is none) and *data_size to its length, while datum receives the other
+// fields. The buffer has to outlive any use of *data.
+bool ParseDatumWithoutData(const void* buffer, const int size, Datum* datum,
+    const char** data, int* data_size);
+
 template <typename Dtype>
 void hdf5_load_nd_dataset_helper(
   hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
@@ -78,10 +111,33 @@ void hdf5_load_nd_dataset(
   hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
   Blob<Dtype>* blob);
 
+// Reads num_rows rows (slices along the first dimension) of the dataset,
+// starting at first_row, into data, so that only the rows needed are read
+// from the file rather than the whole dataset.
+template <typename Dtype>
+void hdf5_load_nd_dataset_rows(
+  hid_t dataset_id, const hsize_t first_row, const hsize_t num_rows,
+  Dtype* data);
+
 template <typename Dtype>
 void hdf5_save_nd_dataset(
   const hid_t file_id, const string dataset_name, const Blob<Dtype>& blob);
 
+// Creates an empty dataset of channels x height x width rows to which
+// hdf5_append_nd_dataset_rows adds rows without limit. It is stored in
+// chunks of chunk_rows rows, deflated at compression_level unless it is 0.
+// The caller closes the dataset.
+template <typename Dtype>
+hid_t hdf5_create_extendable_dataset(
+  const hid_t file_id, const string& dataset_name, const int channels,
+  const int height, const int width, const int chunk_rows,
+  const int compression_level);
+
+// Writes num_rows rows of data after the last row of an extendable dataset.
+template <typename Dtype>
+void hdf5_append_nd_dataset_rows(
+  const hid_t dataset_id, const hsize_t num_rows, const Dtype* data);
+
 }  // namespace caffe
 
 #endif   // CAFFE_UTIL_IO_H_
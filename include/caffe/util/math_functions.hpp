@@ -9,6 +9,8 @@
 
 #include "glog/logging.h"
 
+#include "caffe/util/cpu_threads.hpp"
+#include "caffe/util/half.hpp"
 #include "caffe/util/mkl_alternate.hpp"
 
 namespace caffe {
@@ -40,45 +42,124 @@ void caffe_gpu_gemv(const CBLAS_TRANSPOSE TransA, const int M, const int N,
     const Dtype alpha, const Dtype* A, const Dtype* x, const Dtype beta,
     Dtype* y);
 
+// The level 1 functions, the copies and the solver updates, which run over
+// whole blobs, take 64-bit lengths: the BLAS calls, of int lengths, go in
+// chunks beyond them, and the kernels use 32-bit indices whenever the length
+// allows it (see CAFFE_INT32_INDEX).
 template <typename Dtype>
-void caffe_axpy(const int N, const Dtype alpha, const Dtype* X,
+void caffe_axpy(const int64_t N, const Dtype alpha, const Dtype* X,
     Dtype* Y);
 
 template <typename Dtype>
-void caffe_gpu_axpy(const int N, const Dtype alpha, const Dtype* X,
+void caffe_gpu_axpy(const int64_t N, const Dtype alpha, const Dtype* X,
     Dtype* Y);
 
 template <typename Dtype>
-void caffe_cpu_axpby(const int N, const Dtype alpha, const Dtype* X,
+void caffe_cpu_axpby(const int64_t N, const Dtype alpha, const Dtype* X,
     const Dtype beta, Dtype* Y);
 
 template <typename Dtype>
-void caffe_gpu_axpby(const int N, const Dtype alpha, const Dtype* X,
+void caffe_gpu_axpby(const int64_t N, const Dtype alpha, const Dtype* X,
     const Dtype beta, Dtype* Y);
 
 template <typename Dtype>
-void caffe_copy(const int N, const Dtype *X, Dtype *Y);
+void caffe_copy(const int64_t N, const Dtype *X, Dtype *Y);
 
 template <typename Dtype>
-void caffe_set(const int N, const Dtype alpha, Dtype *X);
+void caffe_set(const int64_t N, const Dtype alpha, Dtype *X);
 
 template <typename Dtype>
-void caffe_gpu_set(const int N, const Dtype alpha, Dtype *X);
+void caffe_gpu_set(const int64_t N, const Dtype alpha, Dtype *X);
 
 template <typename Dtype>
-void caffe_gpu_copy(const int N, const Dtype *X, Dtype *Y);
+void caffe_gpu_copy(const int64_t N, const Dtype *X, Dtype *Y);
 
 template <typename Dtype>
-void caffe_add_scalar(const int N, const Dtype alpha, Dtype *X);
+void caffe_add_scalar(const int64_t N, const Dtype alpha, Dtype *X);
 
 template <typename Dtype>
-void caffe_gpu_add_scalar(const int N, const Dtype alpha, Dtype *X);
+void caffe_gpu_add_scalar(const int64_t N, const Dtype alpha, Dtype *X);
 
+// Adds bias[c] (unless bias is NULL) to the inner elements of each channel c
+// of y, num x channels x inner, and clamps y at 0 if relu: the epilogue of
+// the GEMMs of the convolution and inner product layers.
 template <typename Dtype>
-void caffe_scal(const int N, const Dtype alpha, Dtype *X);
+void caffe_cpu_add_bias(const int num, const int channels, const int inner,
+    const Dtype* bias, const bool relu, Dtype* y);
 
 template <typename Dtype>
-void caffe_gpu_scal(const int N, const Dtype alpha, Dtype *X);
+void caffe_gpu_add_bias(const int num, const int channels, const int inner,
+    const Dtype* bias, const bool relu, Dtype* y);
+
+// Zeroes diff where y, the top of a ReLU, is not positive: the backward pass
+// of a ReLU applied in place by an epilogue.
+template <typename Dtype>
+void caffe_cpu_relu_mask(const int n, const Dtype* y, Dtype* diff);
+
+template <typename Dtype>
+void caffe_gpu_relu_mask(const int n, const Dtype* y, Dtype* diff);
+
+// The SGD update of n weights in one pass over them:
+//   history = momentum * history + rate * (diff + decay * data)
+//   data -= history
+// in place of the separate passes of the history, the weight decay, the copy
+// to diff and Blob::Update. diff is left as it is.
+template <typename Dtype>
+void caffe_cpu_sgd_update(const int64_t n, const Dtype rate,
+    const Dtype momentum, const Dtype decay, const Dtype* diff,
+    Dtype* history, Dtype* data);
+
+template <typename Dtype>
+void caffe_gpu_sgd_update(const int64_t n, const Dtype rate,
+    const Dtype momentum, const Dtype decay, const Dtype* diff,
+    Dtype* history, Dtype* data);
+
+// The same for SGD with Nesterov's accelerated momentum:
+//   history' = momentum * history + rate * (diff + decay * data)
+//   data -= (1 + momentum) * history' - momentum * history
+//   history = history'
+template <typename Dtype>
+void caffe_cpu_nesterov_update(const int64_t n, const Dtype rate,
+    const Dtype momentum, const Dtype decay, const Dtype* diff,
+    Dtype* history, Dtype* data);
+
+template <typename Dtype>
+void caffe_gpu_nesterov_update(const int64_t n, const Dtype rate,
+    const Dtype momentum, const Dtype decay, const Dtype* diff,
+    Dtype* history, Dtype* data);
+
+// And for AdaGrad, history being the sum of the squared gradients:
+//   g = diff + decay * data
+//   history += g * g
+//   data -= rate * g / (sqrt(history) + delta)
+template <typename Dtype>
+void caffe_cpu_adagrad_update(const int64_t n, const Dtype rate,
+    const Dtype delta, const Dtype decay, const Dtype* diff, Dtype* history,
+    Dtype* data);
+
+template <typename Dtype>
+void caffe_gpu_adagrad_update(const int64_t n, const Dtype rate,
+    const Dtype delta, const Dtype decay, const Dtype* diff, Dtype* history,
+    Dtype* data);
+
+// Converts x to half precision storage and back (see util/half.hpp).
+template <typename Dtype>
+void caffe_cpu_to_half(const int64_t n, const Dtype* x, float16* y);
+
+template <typename Dtype>
+void caffe_gpu_to_half(const int64_t n, const Dtype* x, float16* y);
+
+template <typename Dtype>
+void caffe_cpu_from_half(const int64_t n, const float16* x, Dtype* y);
+
+template <typename Dtype>
+void caffe_gpu_from_half(const int64_t n, const float16* x, Dtype* y);
+
+template <typename Dtype>
+void caffe_scal(const int64_t N, const Dtype alpha, Dtype *X);
+
+template <typename Dtype>
+void caffe_gpu_scal(const int64_t N, const Dtype alpha, Dtype *X);
 
 template <typename Dtype>
 void caffe_sqr(const int N, const Dtype* a, Dtype* y);
@@ -141,14 +222,63 @@ void caffe_rng_bernoulli(const int n, const Dtype p, int* r);
 template <typename Dtype>
 void caffe_gpu_rng_bernoulli(const int n, const Dtype p, int* r);
 
+// Fill r with the n numbers of stream 0 of key (see philox_uniform_block
+// in util/philox.hpp), uniform in (a, b] or Gaussian: the same whatever the
+// number of threads they are drawn by, on the CPU and on the GPU.
+template <typename Dtype>
+void caffe_philox_uniform(const int n, const Dtype a, const Dtype b,
+    const uint32_t key[2], Dtype* r);
+
+template <typename Dtype>
+void caffe_gpu_philox_uniform(const int n, const Dtype a, const Dtype b,
+    const uint32_t key[2], Dtype* r);
+
+template <typename Dtype>
+void caffe_philox_gaussian(const int n, const Dtype mu, const Dtype sigma,
+    const uint32_t key[2], Dtype* r);
+
+template <typename Dtype>
+void caffe_gpu_philox_gaussian(const int n, const Dtype mu, const Dtype sigma,
+    const uint32_t key[2], Dtype* r);
+
+// Zeroes the elements of r but those whose uniform number of stream 1 of key
+// is at most p, which are each kept with probability p.
+template <typename Dtype>
+void caffe_philox_bernoulli_mask(const int n, const Dtype p,
+    const uint32_t key[2], Dtype* r);
+
+template <typename Dtype>
+void caffe_gpu_philox_bernoulli_mask(const int n, const Dtype p,
+    const uint32_t key[2], Dtype* r);
+
+// Without MKL, the single precision exp, log, tanh, sigmoid and powx are
+// the SIMD ones of util/simd_math.hpp, within a few ulp.
 template <typename Dtype>
 void caffe_exp(const int n, const Dtype* a, Dtype* y);
 
 template <typename Dtype>
-Dtype caffe_cpu_dot(const int n, const Dtype* x, const Dtype* y);
+void caffe_log(const int n, const Dtype* a, Dtype* y);
+
+template <typename Dtype>
+void caffe_tanh(const int n, const Dtype* a, Dtype* y);
+
+// y[i] = 1 / (1 + exp(-a[i]))
+template <typename Dtype>
+void caffe_sigmoid(const int n, const Dtype* a, Dtype* y);
 
 template <typename Dtype>
-void caffe_gpu_dot(const int n, const Dtype* x, const Dtype* y, Dtype* out);
+Dtype caffe_cpu_dot(const int64_t n, const Dtype* x, const Dtype* y);
+
+template <typename Dtype>
+void caffe_gpu_dot(const int64_t n, const Dtype* x, const Dtype* y, Dtype* out);
+
+// *out += alpha * the dot product of x and y, or the sum of x if y is NULL,
+// with out on the device: unlike caffe_gpu_dot, the host does not wait for
+// the result. One block of threads sums the vector, for short ones such as
+// those of losses.
+template <typename Dtype>
+void caffe_gpu_dot_add(const int n, const Dtype* x, const Dtype* y,
+    const Dtype alpha, Dtype* out);
 
 template <typename Dtype>
 int caffe_cpu_hamming_distance(const int n, const Dtype* x, const Dtype* y);
@@ -159,10 +289,14 @@ uint32_t caffe_gpu_hamming_distance(const int n, const Dtype* x,
 
 // Returns the sum of the absolute values of the elements of vector x
 template <typename Dtype>
-Dtype caffe_cpu_asum(const int n, const Dtype* x);
+Dtype caffe_cpu_asum(const int64_t n, const Dtype* x);
+
+template <typename Dtype>
+void caffe_gpu_asum(const int64_t n, const Dtype* x, Dtype* y);
 
+// Returns the largest element of vector x, of n > 0 elements
 template <typename Dtype>
-void caffe_gpu_asum(const int n, const Dtype* x, Dtype* y);
+Dtype caffe_cpu_max(const int n, const Dtype* x);
 
 // the branchless, type-safe version from
 // http://stackoverflow.com/questions/1903954/is-there-a-standard-sign-function-signum-sgn-in-c-c
@@ -181,6 +315,8 @@ inline char caffe_sign(Dtype val) {
   template<typename Dtype> \
   void caffe_cpu_##name(const int n, const Dtype* x, Dtype* y) { \
     CHECK_GT(n, 0); CHECK(x); CHECK(y); \
+    const int num_threads = CpuElementwiseThreads(n); \
+    CAFFE_OMP_PARALLEL_FOR \
     for (int i = 0; i < n; ++i) { \
       operation; \
     } \
@@ -0,0 +1,200 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_MEMORY_POOL_H_
+#define CAFFE_UTIL_MEMORY_POOL_H_
+
+#include <pthread.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+// Usage counters of a MemoryPool, in bytes unless noted otherwise.
+struct MemoryPoolStats {
+  // The size of the blocks handed out and not freed yet, and the part of it
+  // that was asked for; the difference is lost to the rounding to size
+  // classes.
+  size_t in_use;
+  size_t requested;
+  // The largest in_use seen.
+  size_t peak_in_use;
+  // The size of the freed blocks kept for reuse.
+  size_t cached;
+  // The number of allocations, and how many of them reused a cached block.
+  size_t allocations;
+  size_t cache_hits;
+  // The size of the host blocks in use or cached backed by huge pages.
+  size_t huge_pages;
+};
+
+// What a block of memory is used for, in the usage report of a MemoryPool.
+enum MemoryCategory {
+  MEMORY_OTHER,
+  // The data and the diffs of the blobs between the layers of a net
+  MEMORY_ACTIVATIONS,
+  MEMORY_GRADIENTS,
+  // The parameters of the layers and their diffs
+  MEMORY_PARAMS,
+  MEMORY_PARAM_GRADIENTS,
+  // The memory the layers keep for themselves, e.g. the im2col columns
+  MEMORY_BUFFERS,
+  // E.g. the momentum history
+  MEMORY_SOLVER,
+  NUM_MEMORY_CATEGORIES
+};
+
+// The owner, e.g. a layer, and the category a block of memory is accounted
+// against. The owners are the ids MemoryPool::Owner gives to names; a tag of
+// a negative owner stands for that of the MemoryScope the block is allocated
+// in, if any.
+struct MemoryTag {
+  MemoryTag() : owner(-1), category(MEMORY_OTHER) {}
+  MemoryTag(const int owner, const MemoryCategory category)
+      : owner(owner), category(category) {}
+
+  int owner;
+  MemoryCategory category;
+};
+
+// The bytes of host and device memory of an owner or a category, in use and
+// at their peak.
+struct MemoryUsage {
+  MemoryUsage() : host(0), device(0), peak_host(0), peak_device(0) {}
+
+  size_t host;
+  size_t device;
+  size_t peak_host;
+  size_t peak_device;
+};
+
+// A caching allocator of host, pinned host and device memory, used by
+// SyncedMemory. Sizes are rounded up to size classes (four per power of two)
+// and freed blocks are kept in per class free lists, so that nets built and
+// blobs reshaped over and over mostly avoid malloc and cudaMalloc, the latter
+// synchronizing the device. Device blocks are cached per device. Host blocks
+// of at least huge_page_threshold bytes are backed by 2 MB transparent huge
+// pages, when the kernel has them, for fewer TLB misses over large blobs,
+// e.g. the weights of the GEMMs of CPU training. The pool is shared by all
+// threads.
+class MemoryPool {
+ public:
+  enum Kind { HOST, PINNED, DEVICE };
+
+  static MemoryPool& Get();
+
+  // Returns a block of at least size bytes of the given kind, on the current
+  // device for DEVICE. If pinned memory cannot be had (e.g. on a machine
+  // without GPU), a HOST block is returned instead, and *kind is set to the
+  // kind actually allocated. The block is accounted against tag.
+  void* Allocate(const size_t size, Kind* kind,
+      const MemoryTag& tag = MemoryTag());
+  // Returns a block obtained from Allocate to the pool.
+  void Free(void* ptr);
+  // Accounts a block obtained from Allocate against tag from now on.
+  void Retag(void* ptr, const MemoryTag& tag);
+  // Frees the cached blocks of the given kind.
+  void ReleaseCached(const Kind kind);
+  void ReleaseCached();
+  // With caching off, freed blocks are released at once.
+  void set_caching(const bool caching);
+  bool caching() const { return caching_; }
+  // The size from which host blocks are backed by huge pages, 0 (the
+  // default) for none. Setting it logs whether the kernel has them; without
+  // them, blocks are backed by normal pages.
+  void set_huge_page_threshold(const size_t threshold);
+  size_t huge_page_threshold() const { return huge_page_threshold_; }
+  MemoryPoolStats stats();
+  // Logs the stats, with the share of the held memory lost to size class
+  // rounding and to cached blocks.
+  void LogStats();
+
+  // The id of the owner of the given name, e.g. of a layer, registered on
+  // first use. Owner 0 is the unknown one.
+  int Owner(const std::string& name);
+  // The usage of the blocks in use, by category and by owner (the one of the
+  // given name, registered or not), with the largest in use seen.
+  MemoryUsage category_usage(const MemoryCategory category);
+  MemoryUsage owner_usage(const std::string& name);
+  // Logs the usage by category, in all and by owner, the owners of the
+  // largest peaks first, to size e.g. the batches to the memory of a device.
+  void LogUsage();
+  static const char* CategoryName(const MemoryCategory category);
+
+  // The size of the blocks handed out for a request of size bytes.
+  static size_t SizeClass(const size_t size);
+
+ protected:
+  MemoryPool();
+
+  // The free lists are keyed by kind, device and size; the device of host
+  // memory is the NUMA node of the thread (-1 unbound), so that a bound
+  // thread only gets blocks first touched on its node back. Blocks backed by
+  // huge pages are kept apart.
+  struct BlockKey {
+    Kind kind;
+    int device;
+    size_t size;
+    bool huge_pages;
+    bool operator<(const BlockKey& other) const;
+  };
+  struct Block {
+    BlockKey key;
+    size_t requested;
+    MemoryTag tag;
+  };
+
+  // The tag a block of the given tag is accounted against, in the current
+  // MemoryScope.
+  MemoryTag ResolveTag(const MemoryTag& tag);
+  // Adds a block to, or removes it from, the usage, with the lock held.
+  void Account(const Block& block, const bool add);
+
+  // Allocates and frees memory for real, without the lock held.
+  static void* DoAllocate(const BlockKey& key);
+  static void DoFree(void* ptr, const BlockKey& key);
+
+  std::map<BlockKey, std::vector<void*> > free_lists_;
+  // The blocks handed out
+  std::map<void*, Block> blocks_;
+  bool caching_;
+  size_t huge_page_threshold_;
+  // Whether the kernel backs memory with transparent huge pages on madvise
+  bool huge_pages_available_;
+  MemoryPoolStats stats_;
+  // The names of the owners, by id, their usage, and that of the categories
+  // and of all the memory
+  std::vector<std::string> owner_names_;
+  std::map<std::string, int> owner_ids_;
+  std::vector<MemoryUsage> owner_usage_;
+  MemoryUsage category_usage_[NUM_MEMORY_CATEGORIES];
+  MemoryUsage total_usage_;
+  // The tag of the MemoryScope of each thread
+  boost::thread_specific_ptr<MemoryTag> scope_tag_;
+  pthread_mutex_t mutex_;
+
+  friend class MemoryScope;
+
+  DISABLE_COPY_AND_ASSIGN(MemoryPool);
+};
+
+// Accounts the memory the calling thread allocates without an owner of its
+// own against tag while in scope, e.g. the buffers a layer allocates in its
+// Forward against the layer. Scopes nest.
+class MemoryScope {
+ public:
+  explicit MemoryScope(const MemoryTag& tag);
+  ~MemoryScope();
+
+ protected:
+  MemoryTag previous_tag_;
+
+  DISABLE_COPY_AND_ASSIGN(MemoryScope);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_MEMORY_POOL_H_
@@ -14,6 +14,8 @@ extern "C" {
 }
 #include <math.h>
 
+#include "caffe/util/simd_math.hpp"
+
 // Functions that caffe uses but are not present if MKL is not linked.
 
 // A simple way to define the vsl unary functions. The operation should
@@ -34,11 +36,32 @@ extern "C" {
   }
 
 DEFINE_VSL_UNARY_FUNC(Sqr, y[i] = a[i] * a[i]);
-DEFINE_VSL_UNARY_FUNC(Exp, y[i] = exp(a[i]));
+
+// The same, the single precision function being simd_func of simd_math.hpp
+#define DEFINE_VSL_UNARY_FUNC_SIMD(name, operation, simd_func) \
+  template<typename Dtype> \
+  void v##name(const int n, const Dtype* a, Dtype* y) { \
+    CHECK_GT(n, 0); CHECK(a); CHECK(y); \
+    for (int i = 0; i < n; ++i) { operation; } \
+  } \
+  inline void vs##name( \
+    const int n, const float* a, float* y) { \
+    CHECK_GT(n, 0); CHECK(a); CHECK(y); \
+    caffe::simd_func(n, a, y); \
+  } \
+  inline void vd##name( \
+      const int n, const double* a, double* y) { \
+    v##name<double>(n, a, y); \
+  }
+
+DEFINE_VSL_UNARY_FUNC_SIMD(Exp, y[i] = exp(a[i]), simd_exp);
+DEFINE_VSL_UNARY_FUNC_SIMD(Ln, y[i] = log(a[i]), simd_log);
+DEFINE_VSL_UNARY_FUNC_SIMD(Tanh, y[i] = tanh(a[i]), simd_tanh);
 
 // A simple way to define the vsl unary functions with singular parameter b.
-// The operation should be in the form e.g. y[i] = pow(a[i], b)
-#define DEFINE_VSL_UNARY_FUNC_WITH_PARAM(name, operation) \
+// The operation should be in the form e.g. y[i] = pow(a[i], b), the single
+// precision function simd_func of simd_math.hpp.
+#define DEFINE_VSL_UNARY_FUNC_WITH_PARAM(name, operation, simd_func) \
   template<typename Dtype> \
   void v##name(const int n, const Dtype* a, const Dtype b, Dtype* y) { \
     CHECK_GT(n, 0); CHECK(a); CHECK(y); \
@@ -46,18 +69,20 @@ DEFINE_VSL_UNARY_FUNC(Exp, y[i] = exp(a[i]));
   } \
   inline void vs##name( \
     const int n, const float* a, const float b, float* y) { \
-    v##name<float>(n, a, b, y); \
+    CHECK_GT(n, 0); CHECK(a); CHECK(y); \
+    caffe::simd_func(n, a, b, y); \
   } \
   inline void vd##name( \
       const int n, const double* a, const float b, double* y) { \
     v##name<double>(n, a, b, y); \
   }
 
-DEFINE_VSL_UNARY_FUNC_WITH_PARAM(Powx, y[i] = pow(a[i], b));
+DEFINE_VSL_UNARY_FUNC_WITH_PARAM(Powx, y[i] = pow(a[i], b), simd_powx);
 
 // A simple way to define the vsl binary functions. The operation should
-// be in the form e.g. y[i] = a[i] + b[i]
-#define DEFINE_VSL_BINARY_FUNC(name, operation) \
+// be in the form e.g. y[i] = a[i] + b[i], the single precision function
+// simd_func of simd_math.hpp.
+#define DEFINE_VSL_BINARY_FUNC(name, operation, simd_func) \
   template<typename Dtype> \
   void v##name(const int n, const Dtype* a, const Dtype* b, Dtype* y) { \
     CHECK_GT(n, 0); CHECK(a); CHECK(b); CHECK(y); \
@@ -65,17 +90,18 @@ DEFINE_VSL_UNARY_FUNC_WITH_PARAM(Powx, y[i] = pow(a[i], b));
   } \
   inline void vs##name( \
     const int n, const float* a, const float* b, float* y) { \
-    v##name<float>(n, a, b, y); \
+    CHECK_GT(n, 0); CHECK(a); CHECK(b); CHECK(y); \
+    caffe::simd_func(n, a, b, y); \
   } \
   inline void vd##name( \
       const int n, const double* a, const double* b, double* y) { \
     v##name<double>(n, a, b, y); \
   }
 
-DEFINE_VSL_BINARY_FUNC(Add, y[i] = a[i] + b[i]);
-DEFINE_VSL_BINARY_FUNC(Sub, y[i] = a[i] - b[i]);
-DEFINE_VSL_BINARY_FUNC(Mul, y[i] = a[i] * b[i]);
-DEFINE_VSL_BINARY_FUNC(Div, y[i] = a[i] / b[i]);
+DEFINE_VSL_BINARY_FUNC(Add, y[i] = a[i] + b[i], simd_add);
+DEFINE_VSL_BINARY_FUNC(Sub, y[i] = a[i] - b[i], simd_sub);
+DEFINE_VSL_BINARY_FUNC(Mul, y[i] = a[i] * b[i], simd_mul);
+DEFINE_VSL_BINARY_FUNC(Div, y[i] = a[i] / b[i], simd_div);
 
 // In addition, MKL comes with an additional function axpby that is not present
 // in standard blas. We will simply use a two-step (inefficient, of course) way
@@ -0,0 +1,23 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_NUMA_H_
+#define CAFFE_UTIL_NUMA_H_
+
+namespace caffe {
+
+// Binds the calling thread to the CPUs of NUMA node node and makes it
+// allocate its memory there: the pages of the host memory it touches first
+// (SyncedMemory clears its data as it allocates it) land on the node. The
+// threads it starts afterwards, e.g. the prefetch threads of the data layers
+// and the BLAS threads, inherit the binding. A negative node unbinds the
+// thread. It takes USE_NUMA (libnuma); without it, it only warns.
+void BindToNumaNode(const int node);
+// The node the calling thread is bound to, -1 if it is not.
+int ThreadNumaNode();
+// The node the GPU device is attached to, -1 if it is unknown (one node,
+// or without USE_NUMA).
+int GpuNumaNode(const int device);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_NUMA_H_
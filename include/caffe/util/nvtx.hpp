@@ -0,0 +1,34 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_NVTX_H_
+#define CAFFE_UTIL_NVTX_H_
+
+#ifdef USE_NVTX
+#include <nvToolsExt.h>
+#endif
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+// Marks the lifetime of the range with its name on the timelines of nvprof
+// and Nsight, e.g. the Forward of a layer, so that the kernels line up with
+// the layers and the solver steps that launch them. Ranges nest. Only built
+// in with USE_NVTX (see Makefile.config); otherwise a range compiles to
+// nothing. name must outlive the range.
+class NvtxRange {
+ public:
+#ifdef USE_NVTX
+  explicit NvtxRange(const char* name) { nvtxRangePushA(name); }
+  ~NvtxRange() { nvtxRangePop(); }
+#else
+  explicit NvtxRange(const char* name) {}
+#endif
+
+ private:
+  DISABLE_COPY_AND_ASSIGN(NvtxRange);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_NVTX_H_
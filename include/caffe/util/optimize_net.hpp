@@ -0,0 +1,35 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_OPTIMIZE_NET_H_
+#define CAFFE_UTIL_OPTIMIZE_NET_H_
+
+#include "caffe/proto/caffe.pb.h"
+
+namespace caffe {
+
+// Copy param, a net run in the TEST phase, whose layers take the weights of
+// the layers of the same name in trained, without the layers that only copy
+// or transform their bottom by an affine map at test time, the next or
+// previous convolution and inner product layers computing that map instead:
+//  - dropout layers, and power layers of power 1, scale 1 and shift 0, are
+//    removed, the layers reading their top reading their bottom instead;
+//  - a power layer of power 1, y = shift + scale x, whose bottom is only read
+//    by it and written by a convolution or inner product layer (without a
+//    fused ReLU) is folded into that layer: W' = scale W,
+//    b' = scale b + shift;
+//  - otherwise, one whose top is only read by convolution (without padding,
+//    whose zeros the map would not be applied to) or inner product layers is
+//    folded into them: W' = scale W, b' = b + shift sum(W);
+//  - likewise, the scale and the mean_value of a data or image data layer
+//    (without a mean_file) are folded into the layers reading its data,
+//    which it then gives untransformed.
+// A layer is kept wherever removing it would rename an output of the net or
+// change a blob another layer reads. The outputs are those of param, up to
+// the rounding of the folded weights, and the layers with weights keep their
+// names. Layers whose bias is added are given a bias_term.
+void OptimizeNetForInference(const NetParameter& param,
+    const NetParameter& trained, NetParameter* param_optimized);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_OPTIMIZE_NET_H_
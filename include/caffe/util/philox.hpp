@@ -0,0 +1,88 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_PHILOX_H_
+#define CAFFE_UTIL_PHILOX_H_
+
+#include <stdint.h>
+
+#include <cmath>
+
+#ifdef __CUDACC__
+#define PHILOX_HOST_DEVICE __host__ __device__
+#else
+#define PHILOX_HOST_DEVICE
+#endif
+
+namespace caffe {
+
+// Philox4x32-10, the counter-based RNG of Salmon et al., "Parallel Random
+// Numbers: As Easy as 1, 2, 3" (SC 2011): maps a 128-bit counter and a 64-bit
+// key to 4 random 32-bit words. With no state, the numbers of any counter can
+// be computed in any order, by any thread, on the CPU or the GPU alike.
+PHILOX_HOST_DEVICE inline void philox4x32(const uint32_t counter[4],
+    const uint32_t key[2], uint32_t out[4]) {
+  uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2],
+      c3 = counter[3];
+  uint32_t k0 = key[0], k1 = key[1];
+  for (int round = 0; round < 10; ++round) {
+    const uint64_t product0 = static_cast<uint64_t>(0xD2511F53u) * c0;
+    const uint64_t product1 = static_cast<uint64_t>(0xCD9E8D57u) * c2;
+    const uint32_t hi0 = static_cast<uint32_t>(product0 >> 32);
+    const uint32_t hi1 = static_cast<uint32_t>(product1 >> 32);
+    c0 = hi1 ^ c1 ^ k0;
+    c1 = static_cast<uint32_t>(product1);
+    c2 = hi0 ^ c3 ^ k1;
+    c3 = static_cast<uint32_t>(product0);
+    k0 += 0x9E3779B9u;
+    k1 += 0xBB67AE85u;
+  }
+  out[0] = c0;
+  out[1] = c1;
+  out[2] = c2;
+  out[3] = c3;
+}
+
+// The uniform number in (0, 1] of a Philox word
+template <typename Dtype>
+PHILOX_HOST_DEVICE inline Dtype philox_uniform(const uint32_t word) {
+  return (static_cast<Dtype>(word) + Dtype(1)) * Dtype(2.3283064365386963e-10);
+}
+
+// The numbers of a stream of key are those of the counters (i, stream), 4 a
+// counter: these fill block i of 4 elements, the same for a stream and a key
+// whatever thread computes them, on the CPU or the GPU (but for the last
+// bits of the Gaussian ones). Uniform in (a, b]:
+template <typename Dtype>
+PHILOX_HOST_DEVICE inline void philox_uniform_block(const uint32_t block,
+    const uint32_t stream, const uint32_t key[2], const Dtype a,
+    const Dtype b, Dtype out[4]) {
+  const uint32_t counter[4] = { block, stream, 0, 0 };
+  uint32_t random[4];
+  philox4x32(counter, key, random);
+  for (int i = 0; i < 4; ++i) {
+    out[i] = a + (b - a) * philox_uniform<Dtype>(random[i]);
+  }
+}
+
+// Gaussian of mean mu and standard deviation sigma, by Box-Muller on the
+// two pairs of words:
+template <typename Dtype>
+PHILOX_HOST_DEVICE inline void philox_gaussian_block(const uint32_t block,
+    const uint32_t stream, const uint32_t key[2], const Dtype mu,
+    const Dtype sigma, Dtype out[4]) {
+  const uint32_t counter[4] = { block, stream, 0, 0 };
+  uint32_t random[4];
+  philox4x32(counter, key, random);
+  for (int i = 0; i < 4; i += 2) {
+    const Dtype radius =
+        sqrt(Dtype(-2) * log(philox_uniform<Dtype>(random[i])));
+    const Dtype angle =
+        Dtype(6.283185307179586) * philox_uniform<Dtype>(random[i + 1]);
+    out[i] = mu + sigma * radius * cos(angle);
+    out[i + 1] = mu + sigma * radius * sin(angle);
+  }
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_PHILOX_H_
@@ -0,0 +1,76 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_POOLING_H_
+#define CAFFE_UTIL_POOLING_H_
+
+namespace caffe {
+
+// The CPU pooling of PoolingLayer, one height x width channel at a time into
+// pooled_height x pooled_width outputs, with kernel_h x kernel_w windows a
+// stride_h and stride_w apart. The windows of stride_w 2 that lie inside the
+// image are computed four outputs at a time with SSE2 for float. The
+// elements of each window are still visited in the order of the plain
+// loops, so the results are the same to the bit.
+// Kernels of kSeparablePoolKernelSize and larger in either dimension cost
+// the same per output whatever their size: max pooling takes the max of the
+// rows of each window and then of those maxes, both with sliding windows,
+// and the same element as the plain loops; average pooling reads the sums of
+// the windows off a summed-area table, which rounds differently. Windows
+// covering the whole channel, as in global pooling, are reduced directly.
+const int kSeparablePoolKernelSize = 7;
+
+inline bool UseSeparablePool(const int kernel_h, const int kernel_w) {
+  return kernel_h >= kSeparablePoolKernelSize ||
+      kernel_w >= kSeparablePoolKernelSize;
+}
+
+// Sets each output to the max of its window (no padding), and, unless mask is
+// NULL, its mask to the index h * width + w of the first element of the
+// window holding the max.
+template <typename Dtype>
+void max_pool_cpu(const Dtype* bottom, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int stride_h,
+    const int stride_w, const int pooled_height, const int pooled_width,
+    Dtype* top, Dtype* mask);
+
+// Sets each output to the mean of its window, padded with pad_h rows and
+// pad_w columns of zeros.
+template <typename Dtype>
+void ave_pool_cpu(const Dtype* bottom, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int stride_h,
+    const int stride_w, const int pad_h, const int pad_w,
+    const int pooled_height, const int pooled_width, Dtype* top);
+
+// Adds the diff of each output to the diff of the elements of its window
+// equal to its max.
+template <typename Dtype>
+void max_pool_backward_cpu(const Dtype* bottom, const Dtype* top,
+    const Dtype* top_diff, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int stride_h,
+    const int stride_w, const int pooled_height, const int pooled_width,
+    Dtype* bottom_diff);
+
+// Sets each output to an element of its window (no padding) drawn with a
+// probability proportional to its value, the values being nonnegative, e.g.
+// the outputs of a ReLU: the element at which the cumulative sum of the
+// window reaches rand times its sum, rand being uniform in [0, 1), one per
+// output. rand is overwritten with the index h * width + w + index_offset of
+// each element drawn; it may be the same array as index.
+template <typename Dtype>
+void sto_pool_train_cpu(const Dtype* bottom, const int height,
+    const int width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pooled_height,
+    const int pooled_width, const int index_offset, const Dtype* rand,
+    Dtype* top, Dtype* index);
+
+// Sets each output to the elements of its window weighted by their
+// probability in sto_pool_train_cpu, the sum of their squares over their sum.
+template <typename Dtype>
+void sto_pool_test_cpu(const Dtype* bottom, const int height,
+    const int width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pooled_height,
+    const int pooled_width, Dtype* top);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_POOLING_H_
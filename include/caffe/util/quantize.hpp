@@ -0,0 +1,50 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_QUANTIZE_H_
+#define CAFFE_UTIL_QUANTIZE_H_
+
+#include <stdint.h>
+
+namespace caffe {
+
+// Symmetric linear quantization to int8: x is stored as q = round(x / scale),
+// clamped to [-127, 127], and recovered as q * scale.
+
+// The largest K of caffe_cpu_gemm_s8, whose int32 sums of K products of
+// values in [-127, 127] cannot overflow
+const int kMaxInt8GemmK = 1 << 17;
+
+// The largest absolute value of x
+template <typename Dtype>
+Dtype caffe_cpu_amax(const int n, const Dtype* x);
+
+template <typename Dtype>
+void caffe_cpu_quantize(const int n, const Dtype* x, const Dtype scale,
+    int8_t* q);
+
+// Quantizes each row of x, rows x cols, by its own scale, the largest
+// absolute value of the row over 127, stored in scales.
+template <typename Dtype>
+void caffe_cpu_quantize_rows(const int rows, const int cols, const Dtype* x,
+    int8_t* q, Dtype* scales);
+
+// Quantizes x, rows x cols, into its transpose q, cols x rows.
+template <typename Dtype>
+void caffe_cpu_quantize_transpose(const int rows, const int cols,
+    const Dtype* x, const Dtype scale, int8_t* q);
+
+// C = A B^T in int32 for int8 A, M x K, and B, N x K, both row major, so that
+// both operands are read along K.
+void caffe_cpu_gemm_s8(const int M, const int N, const int K,
+    const int8_t* A, const int8_t* B, int32_t* C);
+
+// y = C * scale, each row m also scaled by row_scales[m] and each column n by
+// col_scales[n] unless they are NULL: the float result of caffe_cpu_gemm_s8.
+template <typename Dtype>
+void caffe_cpu_dequantize(const int M, const int N, const int32_t* C,
+    const Dtype scale, const Dtype* row_scales, const Dtype* col_scales,
+    Dtype* y);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_QUANTIZE_H_
@@ -0,0 +1,64 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_RAW_WEIGHTS_H_
+#define CAFFE_UTIL_RAW_WEIGHTS_H_
+
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/proto/caffe.pb.h"
+
+using std::string;
+using std::vector;
+
+namespace caffe {
+
+// A file of trained weights as raw float arrays, which Net maps into memory
+// and copies, or shares, without parsing a NetParameter (see
+// Net::CopyTrainedLayersFrom). It holds the magic "CAFFEWTS", the version
+// and the number of layers, then for each layer with blobs its name, the
+// number of its blobs and, for each blob, its 4 dimensions followed by its
+// data, which starts at a multiple of kRawWeightsAlignment bytes. The
+// numbers are 32 bit unsigned integers, in the byte order of the machine.
+const int kRawWeightsAlignment = 64;
+
+// Writes the blobs of the layers of param to filename.
+void WriteRawWeights(const NetParameter& param, const string& filename);
+
+// Whether filename starts as a raw weights file.
+bool IsRawWeightsFile(const string& filename);
+
+// A raw weights file, mapped into memory as long as the object lives. The
+// pages written to are copied, the file itself never changes.
+class RawWeightsFile {
+ public:
+  struct RawBlob {
+    int num;
+    int channels;
+    int height;
+    int width;
+    float* data;
+  };
+
+  explicit RawWeightsFile(const string& filename);
+  ~RawWeightsFile();
+
+  int num_layers() const { return layer_names_.size(); }
+  const string& layer_name(const int i) const { return layer_names_[i]; }
+  const vector<RawBlob>& layer_blobs(const int i) const {
+    return layer_blobs_[i];
+  }
+
+ private:
+  void* map_;
+  size_t size_;
+  vector<string> layer_names_;
+  vector<vector<RawBlob> > layer_blobs_;
+
+  DISABLE_COPY_AND_ASSIGN(RawWeightsFile);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_RAW_WEIGHTS_H_
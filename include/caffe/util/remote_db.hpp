@@ -0,0 +1,174 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_REMOTE_DB_HPP_
+#define CAFFE_UTIL_REMOTE_DB_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <fstream>  // NOLINT(readability/streams)
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/block_cache.hpp"
+#include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/db.hpp"
+
+using std::string;
+
+namespace caffe {
+
+// Reads byte ranges of a file: a local path, or, with USE_CURL (libcurl), an
+// http or https URL, e.g. of an object store bucket (public or presigned;
+// requests are not signed). Each thread needs its own, which keeps its
+// connection open from one read to the next.
+class RangeFetcher {
+ public:
+  RangeFetcher();
+  ~RangeFetcher();
+
+  // Reads the size bytes of url from offset, or the whole file for a size of
+  // 0. Returns false, having logged why, if they cannot be read.
+  bool Fetch(const string& url, const uint64_t offset, const size_t size,
+      string* data);
+
+ protected:
+  bool FetchFile(const string& path, const uint64_t offset,
+      const size_t size, string* data);
+  bool FetchURL(const string& url, const uint64_t offset, const size_t size,
+      string* data);
+
+  // The curl handle, created at the first URL
+  void* curl_;
+
+  DISABLE_COPY_AND_ASSIGN(RangeFetcher);
+};
+
+class RemoteDB;
+
+// Walks the records of the shards of a RemoteDB in order, reading them from
+// the blocks of the DB, and asking for the fetch_ahead_blocks blocks after
+// the one it is in, across the shards, to be fetched meanwhile.
+class RemoteDBCursor : public DBCursor {
+ public:
+  explicit RemoteDBCursor(RemoteDB* db);
+  virtual void SeekToFirst() { Load(0, 0); }
+  virtual void SeekToLast();
+  // Only for the DBs whose records are sorted by key
+  virtual void SeekToKey(const string& key);
+  virtual void Next();
+  virtual bool valid() { return valid_; }
+  virtual string key() { return key_; }
+  virtual const char* value_data() { return value_.data(); }
+  virtual size_t value_size() { return value_.size(); }
+
+ protected:
+  // Reads the record at offset in shard, or the first one of the shards
+  // after it at its end; the cursor is invalid past the last shard.
+  void Load(int shard, uint64_t offset);
+  // Copies the size bytes of the current shard from offset to data.
+  void Read(uint64_t offset, const size_t size, char* data);
+  uint32_t ReadSize(const uint64_t offset);
+
+  RemoteDB* db_;
+  int shard_;
+  uint64_t offset_;
+  uint64_t next_offset_;
+  bool valid_;
+  string key_;
+  string value_;
+  // The block read last
+  int block_shard_;
+  int64_t block_id_;
+  shared_ptr<const string> block_;
+};
+
+// Appends the records put to the shards of a RemoteDB being written.
+class RemoteDBTransaction : public DBTransaction {
+ public:
+  explicit RemoteDBTransaction(RemoteDB* db) : db_(db) {}
+  virtual void Put(const string& key, const string& value) {
+    records_.push_back(std::make_pair(key, value));
+  }
+  virtual void Commit();
+
+ protected:
+  RemoteDB* db_;
+  std::vector<std::pair<string, string> > records_;
+};
+
+// A read only database of record shards (RecordShard) listed by a
+// RecordManifest at the source, e.g. in object storage, read in blocks by
+// byte range requests: training starts without a copy of the database, and
+// with a cache_dir (DataParameter) the local disk only holds the blocks read
+// most recently. The blocks are fetched by a pool of fetch_threads, which the
+// cursors ask for the blocks they read next. Opened with NEW or WRITE, it
+// writes the shards of a new database, of about 64 MB each, at the local path
+// source-00000 etc., and the manifest at source, to be uploaded, e.g. from
+// convert_imageset with the backend "remote".
+class RemoteDB : public DB {
+ public:
+  explicit RemoteDB(const DataParameter& param);
+  virtual ~RemoteDB();
+  virtual void Open(const string& source, Mode mode);
+  virtual void Close();
+  virtual DBCursor* NewCursor();
+  virtual DBTransaction* NewTransaction();
+
+  const RecordManifest& manifest() const { return manifest_; }
+  size_t block_size() const { return block_size_; }
+  int fetch_ahead_blocks() const { return param_.fetch_ahead_blocks(); }
+  // Block block of shard, waiting for it to be fetched if need be. Fails if
+  // it cannot be read.
+  shared_ptr<const string> GetBlock(const int shard, const int64_t block);
+  // Starts fetching block block of shard, unless it is already.
+  void Prefetch(const int shard, const int64_t block);
+
+ protected:
+  typedef std::pair<int, int64_t> BlockId;
+  struct Fetch {
+    shared_ptr<string> data;
+    bool done;
+    bool ok;
+    // The order they were started in
+    uint64_t stamp;
+  };
+
+  static void* FetchThread(void* db_pointer);
+  // Reads a block from the cache or from its shard, trying again a few times.
+  bool FetchBlock(RangeFetcher* fetcher, const BlockId& id, string* data);
+  // Queues the fetch of a block with the lock held, dropping the oldest
+  // fetched blocks no cursor came for.
+  shared_ptr<Fetch> StartFetch(const BlockId& id);
+  void Append(const std::vector<std::pair<string, string> >& records);
+  void WriteManifest();
+
+  const DataParameter param_;
+  const size_t block_size_;
+  string source_;
+  RecordManifest manifest_;
+  std::vector<string> shard_urls_;
+  shared_ptr<DiskBlockCache> cache_;
+  std::vector<pthread_t> threads_;
+  // The blocks to fetch; a negative shard stops a thread.
+  BlockingQueue<BlockId> queue_;
+  std::map<BlockId, shared_ptr<Fetch> > fetches_;
+  uint64_t stamp_;
+  bool stopping_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t fetched_;
+  // The shard being written, if writing
+  bool writing_;
+  shared_ptr<std::ofstream> shard_file_;
+  string last_key_;
+
+  friend class RemoteDBTransaction;
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_REMOTE_DB_HPP_
@@ -0,0 +1,48 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_SHARED_MEMORY_H_
+#define CAFFE_UTIL_SHARED_MEMORY_H_
+
+#include <string>
+
+#include "caffe/common.hpp"
+
+using std::string;
+
+namespace caffe {
+
+// A POSIX shared memory segment mapped in this process, for processes on
+// the same host to pass tensors without copying them, e.g. a frontend and
+// the worker processes running its nets: blobs can keep their host data in
+// a segment (see Blob::set_cpu_segment, MemoryDataLayer::ResetShared). The
+// segment gives no synchronization of its own: the processes tell each other
+// when the data is ready some other way, e.g. over a socket.
+class SharedMemorySegment {
+ public:
+  enum Mode { CREATE, OPEN };
+
+  // CREATE creates the segment name ("/" followed by a name, as for
+  // shm_open) of size bytes filled with 0, failing if it exists, and
+  // unlinks the name once deleted: the processes that still have it mapped
+  // keep it until they unmap it. OPEN maps the existing segment name, of the
+  // size it was created with, size being ignored.
+  SharedMemorySegment(const string& name, const Mode mode,
+      const size_t size = 0);
+  ~SharedMemorySegment();
+
+  const string& name() const { return name_; }
+  void* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ protected:
+  const string name_;
+  const Mode mode_;
+  void* data_;
+  size_t size_;
+
+  DISABLE_COPY_AND_ASSIGN(SharedMemorySegment);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_SHARED_MEMORY_H_
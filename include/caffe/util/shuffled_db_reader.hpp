@@ -0,0 +1,64 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_SHUFFLED_DB_READER_H_
+#define CAFFE_UTIL_SHUFFLED_DB_READER_H_
+
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/db.hpp"
+
+using std::string;
+using std::vector;
+
+namespace caffe {
+
+// Reads the values of a DB in an order drawn again at every pass, at about
+// the speed of a sequential read. The records are split into blocks of
+// block_size consecutive keys; every pass visits the blocks in a random order
+// and the records of each block, read sequentially, in a random order. A
+// readahead thread reads up to readahead blocks ahead of Next. With
+// num_shards, only the blocks whose index modulo num_shards is shard_id are
+// read. The constructor walks the keys of the DB once to split it.
+class ShuffledDBReader {
+ public:
+  ShuffledDBReader(DB* db, const int block_size, const int readahead,
+      const int num_shards, const int shard_id, const unsigned int seed);
+  ~ShuffledDBReader();
+
+  // The next value, valid until the following call.
+  const string& Next();
+  int num_blocks() const { return block_keys_.size(); }
+
+ private:
+  static void* ReadAheadThread(void* reader_pointer);
+  // Reads the records of block into values, shuffled.
+  void ReadBlock(const int block, DBCursor* cursor, vector<string>* values);
+  unsigned int Rand();
+
+  DB* db_;
+  const int block_size_;
+  // The first key of each block of the shard
+  vector<string> block_keys_;
+  // Only used by the readahead thread
+  shared_ptr<Caffe::RNG> rng_;
+  // The ring of blocks, as for the prefetch buffers of the data layers:
+  // the readahead thread fills the free ones and Next hands them back.
+  vector<vector<string> > blocks_;
+  BlockingQueue<int> free_;
+  BlockingQueue<int> full_;
+  // The block Next reads from, or -1, and the position in it
+  int current_;
+  int position_;
+  pthread_t thread_;
+
+  DISABLE_COPY_AND_ASSIGN(ShuffledDBReader);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_SHUFFLED_DB_READER_H_
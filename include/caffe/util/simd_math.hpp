@@ -0,0 +1,38 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_SIMD_MATH_H_
+#define CAFFE_UTIL_SIMD_MATH_H_
+
+namespace caffe {
+
+// Single precision vector math, 4 elements at a time with SSE2 when it is
+// available and with the C library otherwise: the vsExp, vsLn, vsPowx and
+// vsTanh of mkl_alternate.hpp when Caffe is built without MKL. The
+// polynomials are those of Cephes; y may be a. The error from the exact
+// result is at most
+//   simd_exp      1 ulp
+//   simd_log      1 ulp
+//   simd_tanh     2 ulp
+//   simd_sigmoid  3 ulp
+//   simd_powx     3 + 2 |b log(a)| ulp
+// (the C library is within 0.5 to 1 ulp).
+// Inputs outside the range of the polynomials (those whose result is not a
+// normal number, non-positive and non-normal logarithms, NaNs) fall back
+// to the C library, 4 at a time, and are as accurate as it is.
+void simd_exp(const int n, const float* a, float* y);
+void simd_log(const int n, const float* a, float* y);
+void simd_powx(const int n, const float* a, const float b, float* y);
+void simd_tanh(const int n, const float* a, float* y);
+// y[i] = 1 / (1 + exp(-a[i]))
+void simd_sigmoid(const int n, const float* a, float* y);
+// The arithmetic of vsAdd, vsSub, vsMul and vsDiv, exact, whose loops the
+// compiler vectorizes, for each clone of CAFFE_CPU_DISPATCH (see
+// cpu_dispatch.hpp) as are the functions above.
+void simd_add(const int n, const float* a, const float* b, float* y);
+void simd_sub(const int n, const float* a, const float* b, float* y);
+void simd_mul(const int n, const float* a, const float* b, float* y);
+void simd_div(const int n, const float* a, const float* b, float* y);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_SIMD_MATH_H_
@@ -0,0 +1,46 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_SPARSE_H_
+#define CAFFE_UTIL_SPARSE_H_
+
+#include <vector>
+
+#include "caffe/proto/caffe.pb.h"
+
+namespace caffe {
+
+// Compressed sparse rows (CSR) of a rows x cols matrix: values holds its
+// nonzero values row by row, columns the column of each, and row_start the
+// index in values of the first value of each row, followed by the number of
+// values, rows + 1 entries in all.
+
+// The CSR of x, rows x cols, keeping the values whose absolute value is
+// above threshold.
+template <typename Dtype>
+void caffe_cpu_dense_to_csr(const int rows, const int cols, const Dtype* x,
+    const Dtype threshold, std::vector<Dtype>* values,
+    std::vector<int>* row_start, std::vector<int>* columns);
+
+// C = B A^T for the CSR A, N x K, and the dense B, M x K, both row major: the
+// product of an inner product layer with sparse weights. Unless M is 1,
+// buffer holds (K + N) * M values, for the transposes of B and C.
+template <typename Dtype>
+void caffe_cpu_gemm_csr(const int M, const int N, const int K,
+    const Dtype* values, const int* row_start, const int* columns,
+    const Dtype* B, Dtype* C, Dtype* buffer);
+
+// The same, on the GPU; nnz is the number of values of A.
+template <typename Dtype>
+void caffe_gpu_gemm_csr(const int M, const int N, const int K, const int nnz,
+    const Dtype* values, const int* row_start, const int* columns,
+    const Dtype* B, Dtype* C);
+
+// Stores the data of proto in CSR over rows of width values (see
+// BlobProto), keeping the values whose absolute value is above threshold, if
+// at most max_density of them are kept. Returns whether it did.
+bool SparsifyBlobProto(const float threshold, const float max_density,
+    BlobProto* proto);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_SPARSE_H_
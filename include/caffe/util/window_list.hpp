@@ -0,0 +1,97 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_WINDOW_LIST_H_
+#define CAFFE_UTIL_WINDOW_LIST_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+
+using std::string;
+using std::vector;
+
+namespace caffe {
+
+// The images and windows of a window file, as read by the WindowDataLayer,
+// in flat arrays: the file of each image in one arena of '\0' terminated
+// paths, its channels, height and width, and one fixed size record per
+// window. The text window file holds, for each image,
+//    # image_index
+//    img_path (abs path)
+//    channels
+//    height
+//    width
+//    num_windows
+//    class_index overlap x1 y1 x2 y2 (num_windows lines)
+// Parsing it is slow for millions of windows, so the arrays can be written
+// to a binary cache file, which later runs map into memory instead. It holds
+// a header (the magic "CAFFEWIN", the version, the numbers of images and of
+// windows, the size of the paths and the size and modification time of the
+// window file it was written for) then the offsets of the paths, the
+// windows, the sizes of the images and the paths, in the byte order of the
+// machine.
+class WindowList {
+ public:
+  struct Window {
+    // The index of the image of the window in the list, the order in which
+    // the images come in the window file.
+    int32_t image_index;
+    int32_t label;
+    float overlap;
+    int32_t x1;
+    int32_t y1;
+    int32_t x2;
+    int32_t y2;
+  };
+
+  WindowList();
+  ~WindowList();
+
+  // Reads the text window_file or, if cache_file is not empty, the cache
+  // file written for it. The cache file is written if it does not exist or
+  // was written for another version of window_file.
+  void Read(const string& window_file, const string& cache_file);
+
+  int num_images() const { return num_images_; }
+  const char* image_path(const int i) const {
+    return names_ + image_offsets_[i];
+  }
+  int image_channels(const int i) const { return image_sizes_[3 * i]; }
+  int image_height(const int i) const { return image_sizes_[3 * i + 1]; }
+  int image_width(const int i) const { return image_sizes_[3 * i + 2]; }
+  size_t num_windows() const { return num_windows_; }
+  const Window& window(const size_t i) const { return windows_[i]; }
+
+ protected:
+  void ReadText(const string& window_file);
+  // Returns false if cache_file does not exist or was not written for a
+  // window file of source_size bytes modified at source_mtime.
+  bool MapCache(const string& cache_file, const int64_t source_size,
+      const int64_t source_mtime);
+  void WriteCache(const string& cache_file, const int64_t source_size,
+      const int64_t source_mtime) const;
+
+  int num_images_;
+  size_t num_windows_;
+  // Into the storage vectors when read from the window file, into map_ when
+  // from the cache file.
+  const uint64_t* image_offsets_;
+  const int32_t* image_sizes_;
+  const char* names_;
+  const Window* windows_;
+  vector<uint64_t> image_offset_storage_;
+  vector<int32_t> image_size_storage_;
+  vector<char> name_storage_;
+  vector<Window> window_storage_;
+  void* map_;
+  size_t map_size_;
+
+  DISABLE_COPY_AND_ASSIGN(WindowList);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_WINDOW_LIST_H_
@@ -0,0 +1,61 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef CAFFE_UTIL_WINDOW_SHAPE_H_
+#define CAFFE_UTIL_WINDOW_SHAPE_H_
+
+#include <glog/logging.h>
+
+namespace caffe {
+
+// The kernel, stride and padding of the height and of the width of the
+// windows of a ConvolutionParameter or a PoolingParameter: kernel_size,
+// stride and pad give both dimensions the same value, kernel_h and
+// kernel_w, etc. values of their own.
+struct WindowShape {
+  int kernel_h;
+  int kernel_w;
+  int stride_h;
+  int stride_w;
+  int pad_h;
+  int pad_w;
+};
+
+// Reads the shape of param, a ConvolutionParameter or a PoolingParameter,
+// failing if both forms of a field are set or the kernel is missing.
+template <typename Param>
+WindowShape GetWindowShape(const Param& param) {
+  WindowShape shape;
+  if (param.has_kernel_size()) {
+    CHECK(!param.has_kernel_h() && !param.has_kernel_w())
+        << "The kernel is either kernel_size or kernel_h and kernel_w.";
+    shape.kernel_h = shape.kernel_w = param.kernel_size();
+  } else {
+    CHECK(param.has_kernel_h() && param.has_kernel_w())
+        << "The kernel is either kernel_size or kernel_h and kernel_w.";
+    shape.kernel_h = param.kernel_h();
+    shape.kernel_w = param.kernel_w();
+  }
+  if (param.has_stride_h() || param.has_stride_w()) {
+    CHECK(param.has_stride_h() && param.has_stride_w() && !param.has_stride())
+        << "The stride is either stride or stride_h and stride_w.";
+    shape.stride_h = param.stride_h();
+    shape.stride_w = param.stride_w();
+  } else {
+    shape.stride_h = shape.stride_w = param.stride();
+  }
+  if (param.has_pad_h() || param.has_pad_w()) {
+    CHECK(!param.has_pad())
+        << "The padding is either pad or pad_h and pad_w.";
+    shape.pad_h = param.pad_h();
+    shape.pad_w = param.pad_w();
+  } else {
+    shape.pad_h = shape.pad_w = param.pad();
+  }
+  CHECK_GT(shape.stride_h, 0);
+  CHECK_GT(shape.stride_w, 0);
+  return shape;
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_WINDOW_SHAPE_H_
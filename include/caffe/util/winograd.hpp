@@ -0,0 +1,54 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifndef _CAFFE_UTIL_WINOGRAD_HPP_
+#define _CAFFE_UTIL_WINOGRAD_HPP_
+
+namespace caffe {
+
+// The transforms of the Winograd minimal filtering algorithm F(2x2, 3x3),
+// which computes each 2x2 tile of the output of a 3x3, stride 1 convolution
+// from a 4x4 tile of the input with 16 multiplications instead of 36. Once
+// the filters and the input tiles are transformed, the 16 elements of the
+// tiles are 16 independent matrix products over the channels; the products
+// are transformed back into the output.
+
+// The number of tiles along an output dimension of the given size
+inline int winograd_tiles(const int size_out) { return (size_out + 1) / 2; }
+
+// Transforms the filters weights (num_output x channels x 3 x 3) into the
+// matrices transformed (16 x num_output x channels).
+template <typename Dtype>
+void winograd_transform_weights_cpu(const Dtype* weights,
+    const int num_output, const int channels, Dtype* transformed);
+
+// Transforms the overlapping 4x4 tiles of the image data_im (channels x
+// height x width, zero padded by pad) into the matrices transformed (16 x
+// channels x tiles).
+template <typename Dtype>
+void winograd_transform_input_cpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int pad, Dtype* transformed);
+
+// Transforms the products (16 x num_output x tiles) back into the output
+// data_out (num_output x height_out x width_out), adding bias (num_output
+// values) unless it is NULL.
+template <typename Dtype>
+void winograd_transform_output_cpu(const Dtype* transformed,
+    const int num_output, const int height_out, const int width_out,
+    const Dtype* bias, Dtype* data_out);
+
+template <typename Dtype>
+void winograd_transform_weights_gpu(const Dtype* weights,
+    const int num_output, const int channels, Dtype* transformed);
+
+template <typename Dtype>
+void winograd_transform_input_gpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int pad, Dtype* transformed);
+
+template <typename Dtype>
+void winograd_transform_output_gpu(const Dtype* transformed,
+    const int num_output, const int height_out, const int width_out,
+    const Dtype* bias, Dtype* data_out);
+
+}  // namespace caffe
+
+#endif  // _CAFFE_UTIL_WINOGRAD_HPP_
@@ -14,6 +14,8 @@
 #include "caffe/loss_layers.hpp"
 #include "caffe/data_layers.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/shared_memory.hpp"
 
 namespace caffe {
 
@@ -29,6 +31,9 @@ class ConcatLayer : public Layer<Dtype> {
       : Layer<Dtype>(param) {}
   virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  virtual bool can_reshape_spatially() const { return true; }
 
  protected:
   virtual Dtype Forward_cpu(const vector<Blob<Dtype>*>& bottom,
@@ -58,6 +63,12 @@ class ConvolutionLayer : public Layer<Dtype> {
       : Layer<Dtype>(param) {}
   virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  // A 1x1 convolution computes the bottom diff with a GEMM, which can add to
+  // it; col2im cannot.
+  virtual bool can_accumulate_bottom_diffs() const { return is_1x1_; }
+  virtual bool can_reshape_spatially() const { return true; }
 
  protected:
   virtual Dtype Forward_cpu(const vector<Blob<Dtype>*>& bottom,
@@ -68,33 +79,104 @@ class ConvolutionLayer : public Layer<Dtype> {
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
+  // Convolves batch_size images with weight, unrolled in col_data, into
+  // top_data, going through batch_top_data if there can be more than one
+  // image.
+  void ForwardImages_cpu(const Dtype* bottom_data, const Dtype* weight,
+      const int batch_size, Dtype* col_data, Dtype* batch_top_data,
+      Dtype* top_data);
+  // The forward pass of a depthwise layer
+  Dtype DepthwiseForward_cpu(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  Dtype DepthwiseForward_gpu(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  // The forward pass of the WINOGRAD engine
+  Dtype WinogradForward_cpu(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  Dtype WinogradForward_gpu(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  // Makes bias_multiplier_ hold at least count ones.
+  void ReserveBiasMultiplier(const int count);
+  // Returns the fastest engine that can compute the layer, timing the
+  // candidates unless the engine cache already knows the layer shape.
+  ConvolutionParameter_Engine TuneEngine(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  // The forward pass with INT8 precision
+  Dtype Int8Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
 
-  int kernel_size_;
-  int stride_;
+  int kernel_h_;
+  int kernel_w_;
+  int stride_h_;
+  int stride_w_;
   int num_;
   int channels_;
-  int pad_;
+  int pad_h_;
+  int pad_w_;
   int height_;
   int width_;
   int num_output_;
   int group_;
+  // Whether the kernel is 1x1, with stride 1 and no padding, in which case
+  // the bottom is used as its own column buffer
+  bool is_1x1_;
+  // Whether the group is the number of channels, above 1, in which case each
+  // channel is convolved alone by direct kernels (see util/depthwise_conv.hpp)
+  // rather than by a GEMM of M_ rows per channel, without columns
+  bool depthwise_;
   Blob<Dtype> col_buffer_;
+  // With keep_columns, the columns of every image of the batch, written by
+  // Forward and read by Backward
+  bool keep_columns_;
+  Blob<Dtype> kept_col_buffer_;
   shared_ptr<SyncedMemory> bias_multiplier_;
   bool bias_term_;
+  bool fused_relu_;
   int M_;
   int K_;
   int N_;
+  // The number of images convolved at once by Forward_cpu, the columns of all
+  // of them, and their outputs before they are copied to the top, for each
+  // thread of Forward_cpu
+  int cpu_batch_size_;
+  Blob<Dtype> batch_col_buffer_;
+  Blob<Dtype> batch_top_buffer_;
+  // With the WINOGRAD engine, the transformed weights, the transformed input
+  // tiles of an image, and their products, each as 16 matrices
+  ConvolutionParameter_Engine engine_;
+  Blob<Dtype> winograd_weights_;
+  Blob<Dtype> winograd_input_;
+  Blob<Dtype> winograd_output_;
+  // With INT8 precision (see QuantizationParameter), the range of the bottom,
+  // the int8 weights and their scales, and for each thread of
+  // Int8Forward_cpu, the columns of an image, transposed in int8, and their
+  // int32 products for a group
+  bool int8_;
+  Dtype int8_bottom_range_;
+  shared_ptr<SyncedMemory> int8_weights_;
+  shared_ptr<SyncedMemory> int8_weight_scales_;
+  shared_ptr<SyncedMemory> int8_columns_;
+  shared_ptr<SyncedMemory> int8_products_;
 };
 
-/* EltwiseProductLayer
+/* EltwiseLayer
+  Computes the SUM (each bottom weighted by its coeff), PROD or MAX of any
+  number of bottoms, element by element, in a single pass over them in each
+  direction. For SUM and MAX, whose Backward reads neither the bottoms nor
+  the top, it may run in place on its first bottom (see util/in_place.hpp).
+  The gradient of each bottom of a PROD is the product of the other bottoms,
+  not the top divided by the bottom, which is safe from zeros.
 */
 template <typename Dtype>
-class EltwiseProductLayer : public Layer<Dtype> {
+class EltwiseLayer : public Layer<Dtype> {
  public:
-  explicit EltwiseProductLayer(const LayerParameter& param)
+  explicit EltwiseLayer(const LayerParameter& param)
       : Layer<Dtype>(param) {}
   virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  virtual bool can_reshape_spatially() const { return true; }
 
  protected:
   virtual Dtype Forward_cpu(const vector<Blob<Dtype>*>& bottom,
@@ -105,6 +187,30 @@ class EltwiseProductLayer : public Layer<Dtype> {
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
+
+  EltwiseParameter_EltwiseOp op_;
+  // The coefficient of each bottom for SUM
+  Blob<Dtype> coeffs_;
+  // The bottom giving each element of the top for MAX
+  Blob<Dtype> max_idx_;
+  // The device arrays of the data and of the diffs of the bottoms, for the
+  // kernels to read them all at once
+  shared_ptr<SyncedMemory> data_pointers_;
+  shared_ptr<SyncedMemory> diff_pointers_;
+};
+
+/* EltwiseProductLayer
+  The EltwiseLayer computing the PROD of its bottoms, for ELTWISE_PRODUCT.
+*/
+template <typename Dtype>
+class EltwiseProductLayer : public EltwiseLayer<Dtype> {
+ public:
+  explicit EltwiseProductLayer(const LayerParameter& param)
+      : EltwiseLayer<Dtype>(param) {
+    this->layer_param_.mutable_eltwise_param()->set_operation(
+        EltwiseParameter_EltwiseOp_PROD);
+    this->layer_param_.mutable_eltwise_param()->clear_coeff();
+  }
 };
 
 template <typename Dtype>
@@ -148,12 +254,15 @@ class Im2colLayer : public Layer<Dtype> {
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
 
-  int kernel_size_;
-  int stride_;
+  int kernel_h_;
+  int kernel_w_;
+  int stride_h_;
+  int stride_w_;
   int channels_;
   int height_;
   int width_;
-  int pad_;
+  int pad_h_;
+  int pad_w_;
 };
 
 /* InnerProductLayer
@@ -163,8 +272,18 @@ class InnerProductLayer : public Layer<Dtype> {
  public:
   explicit InnerProductLayer(const LayerParameter& param)
       : Layer<Dtype>(param) {}
+  virtual ~InnerProductLayer();
   virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  virtual bool can_accumulate_bottom_diffs() const { return true; }
+  // Reshape checks that each item keeps its size.
+  virtual bool can_reshape_spatially() const { return true; }
+  virtual int param_device(const int param_id) const {
+    return slices_.size() ?
+        slices_[param_id % slices_.size()]->device : this->device_id_;
+  }
 
  protected:
   virtual Dtype Forward_cpu(const vector<Blob<Dtype>*>& bottom,
@@ -175,18 +294,90 @@ class InnerProductLayer : public Layer<Dtype> {
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
+  // The forward pass with INT8 precision
+  void Int8Forward_cpu(const Dtype* bottom_data, Dtype* top_data);
+  // Makes ones hold at least count ones.
+  static void ReserveOnes(const int count, shared_ptr<SyncedMemory>* ones);
+  // At the first forward pass with max_sparse_density set, stores the
+  // weights in compressed sparse rows if they are sparse enough.
+  void CheckSparseWeights();
+
+  // With device_ids, the slices of the outputs, each computed on its GPU by
+  // a thread of its own, which runs the commands the layer gives it.
+  enum SliceCommand { SLICE_STOP, SLICE_SET_UP, SLICE_FORWARD,
+      SLICE_BACKWARD };
+  struct Slice {
+    InnerProductLayer<Dtype>* layer;
+    int id;
+    int device;
+    // The outputs [begin, begin + count) of the layer
+    int begin;
+    int count;
+    BlockingQueue<int> commands;
+    // On the device of the slice: the bottom, its top then top diff, its
+    // bottom diff and the ones of the bias gradient
+    shared_ptr<SyncedMemory> bottom;
+    shared_ptr<SyncedMemory> top;
+    shared_ptr<SyncedMemory> bottom_diff;
+    shared_ptr<SyncedMemory> bias_multiplier;
+    pthread_t thread;
+  };
+  // Splits the weights and the bias filled for all the outputs, or checks
+  // those of the slices given, and starts the threads of the slices.
+  void SetUpSlices();
+  void StopSlices();
+  static void* SliceThread(void* slice_pointer);
+  // Has every slice run command, once the device of the layer is done with
+  // the blobs of the pass.
+  void RunSlices(const SliceCommand command);
+  // The GPU passes of slice, run by its thread
+  void ForwardSlice(Slice* slice);
+  void BackwardSlice(Slice* slice);
+  Dtype ModelParallelForward_gpu(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  void ModelParallelBackward_gpu(const vector<Blob<Dtype>*>& top,
+      const bool propagate_down, vector<Blob<Dtype>*>* bottom);
 
   int M_;
   int K_;
   int N_;
   bool bias_term_;
+  bool fused_relu_;
   shared_ptr<SyncedMemory> bias_multiplier_;
+  // With INT8 precision (see QuantizationParameter), the range of the bottom,
+  // the int8 weights and their scales, and the int8 bottom and its int32
+  // products with the weights
+  bool int8_;
+  Dtype int8_bottom_range_;
+  shared_ptr<SyncedMemory> int8_weights_;
+  shared_ptr<SyncedMemory> int8_weight_scales_;
+  shared_ptr<SyncedMemory> int8_bottom_;
+  shared_ptr<SyncedMemory> int8_products_;
+  // With sparse weights (see max_sparse_density), their compressed sparse
+  // rows (see util/sparse.hpp) and the buffer of caffe_cpu_gemm_csr
+  Dtype max_sparse_density_;
+  bool sparse_checked_;
+  bool sparse_;
+  int sparse_nnz_;
+  shared_ptr<SyncedMemory> sparse_values_;
+  shared_ptr<SyncedMemory> sparse_row_start_;
+  shared_ptr<SyncedMemory> sparse_columns_;
+  shared_ptr<SyncedMemory> sparse_buffer_;
+  // With device_ids, the slices, the ids of those done with their command,
+  // and the settings of the thread of the layer, for those of the slices
+  vector<shared_ptr<Slice> > slices_;
+  BlockingQueue<int> slices_done_;
+  Caffe::ThreadSettings settings_;
+  // The blobs of the pass the slices run, on the device of the layer, and
+  // the bottom diffs of the slices, copied there to be summed
+  const Dtype* pass_bottom_data_;
+  Dtype* pass_top_data_;
+  const Dtype* pass_top_diff_;
+  bool pass_propagate_down_;
+  Dtype* pass_bottom_diffs_;
+  shared_ptr<SyncedMemory> slice_bottom_diffs_;
 };
 
-// Forward declare PoolingLayer and SplitLayer for use in LRNLayer.
-template <typename Dtype> class PoolingLayer;
-template <typename Dtype> class SplitLayer;
-
 /* LRNLayer
   Local Response Normalization
 */
@@ -197,6 +388,9 @@ class LRNLayer : public Layer<Dtype> {
       : Layer<Dtype>(param) {}
   virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  virtual bool can_reshape_spatially() const { return true; }
 
  protected:
   virtual Dtype Forward_cpu(const vector<Blob<Dtype>*>& bottom,
@@ -212,13 +406,17 @@ class LRNLayer : public Layer<Dtype> {
       vector<Blob<Dtype>*>* top);
   virtual Dtype CrossChannelForward_gpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
-  virtual Dtype WithinChannelForward(const vector<Blob<Dtype>*>& bottom,
+  virtual Dtype WithinChannelForward_cpu(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  virtual Dtype WithinChannelForward_gpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
   virtual void CrossChannelBackward_cpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
   virtual void CrossChannelBackward_gpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
-  virtual void WithinChannelBackward(const vector<Blob<Dtype>*>& top,
+  virtual void WithinChannelBackward_cpu(const vector<Blob<Dtype>*>& top,
+      const bool propagate_down, vector<Blob<Dtype>*>* bottom);
+  virtual void WithinChannelBackward_gpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
 
   int size_;
@@ -230,41 +428,57 @@ class LRNLayer : public Layer<Dtype> {
   int height_;
   int width_;
 
-  // Fields used for normalization ACROSS_CHANNELS
-  // scale_ stores the intermediate summing results
+  // scale_ stores the intermediate summing results: 1 + alpha_ / n times
+  // the sum of the squares of the window of each input, of the size_
+  // channels around it ACROSS_CHANNELS (n = size_), of the size_ x size_
+  // positions around it in its channel WITHIN_CHANNEL (n = size_^2).
   Blob<Dtype> scale_;
-
-  // Fields used for normalization WITHIN_CHANNEL
-  shared_ptr<SplitLayer<Dtype> > split_layer_;
-  vector<Blob<Dtype>*> split_top_vec_;
-  shared_ptr<PowerLayer<Dtype> > square_layer_;
-  Blob<Dtype> square_input_;
-  Blob<Dtype> square_output_;
-  vector<Blob<Dtype>*> square_bottom_vec_;
-  vector<Blob<Dtype>*> square_top_vec_;
-  shared_ptr<PoolingLayer<Dtype> > pool_layer_;
-  Blob<Dtype> pool_output_;
-  vector<Blob<Dtype>*> pool_top_vec_;
-  shared_ptr<PowerLayer<Dtype> > power_layer_;
-  Blob<Dtype> power_output_;
-  vector<Blob<Dtype>*> power_top_vec_;
-  shared_ptr<EltwiseProductLayer<Dtype> > product_layer_;
-  Blob<Dtype> product_data_input_;
-  vector<Blob<Dtype>*> product_bottom_vec_;
 };
 
 /* PoolingLayer
 */
+// A batch of a MemoryDataLayer fed by a queue (see MemoryDataLayer::set_feed)
+template <typename Dtype>
+struct MemoryBatch {
+  Blob<Dtype> data;
+  Blob<Dtype> labels;
+};
+
 template <typename Dtype>
 class MemoryDataLayer : public Layer<Dtype> {
  public:
+  typedef BlockingQueue<shared_ptr<MemoryBatch<Dtype> > > Feed;
+
   explicit MemoryDataLayer(const LayerParameter& param)
-      : Layer<Dtype>(param) {}
+      : Layer<Dtype>(param), feed_(NULL), stage_stream_(NULL) {}
+  virtual ~MemoryDataLayer();
   virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
   // Reset should accept const pointers, but can't, because the memory
   //  will be given to Blob, which is mutable
   void Reset(Dtype* data, Dtype* label, int n);
+  // Same as Reset, with the arrays in device memory. They are used in place
+  // in GPU mode, and copied to the host as needed in CPU mode.
+  void ResetGPU(Dtype* data, Dtype* label, int n);
+  // Queues host arrays to be used once all the batches of the current ones
+  // have been, so that the next chunk of a dataset can be prepared while the
+  // current one is used. The arrays must stay valid until a later Reset or
+  // ResetNext call, or until has_next() is false again.
+  void ResetNext(Dtype* data, Dtype* label, int n);
+  // Same as Reset, with the n items of data followed by their n labels in
+  // segment, from offset (in bytes) on, which the layer keeps mapped until
+  // the next Reset: another process, e.g. the frontend of a serving worker,
+  // writes the inputs in place.
+  void ResetShared(const shared_ptr<SharedMemorySegment>& segment,
+      const size_t offset, int n);
+  // Has each Forward pop its batch from feed instead, of the shape of the
+  // tops, e.g. to share the batches of one data net among the nets of
+  // several solvers (see SolverSweep). The batch is held, its host memory
+  // used by the tops, until the next Forward; the same batch may be given
+  // to other layers at once, so the layers above must not write the data in
+  // place in CPU mode. feed must outlive the layer, or a later set_feed(NULL).
+  void set_feed(Feed* feed);
+  bool has_next() { return next_data_ != NULL; }
   int datum_channels() { return datum_channels_; }
   int datum_height() { return datum_height_; }
   int datum_width() { return datum_width_; }
@@ -273,13 +487,31 @@ class MemoryDataLayer : public Layer<Dtype> {
  protected:
   virtual Dtype Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
+  virtual Dtype Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
   virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom) { return; }
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom) { return; }
 
+  // Moves on to the next batch, and to the queued arrays after the last
+  // batch of the current ones.
+  virtual void NextBatch();
+  // Starts copying the rows of the host arrays data and labels (of n rows)
+  // from start on into stage buffer, stage_batches batches at most.
+  virtual void StageWindow(const int buffer, const Dtype* data,
+      const Dtype* labels, const int n, const int start);
+  // Whether stage buffer holds the current batch.
+  bool Staged(const int buffer) const;
+  // Waits for the copies in flight and forgets the staged windows.
+  virtual void ClearStage();
+
   Dtype* data_;
   Dtype* labels_;
+  bool data_on_gpu_;
+  Dtype* next_data_;
+  Dtype* next_labels_;
+  int next_n_;
   int datum_channels_;
   int datum_height_;
   int datum_width_;
@@ -287,6 +519,24 @@ class MemoryDataLayer : public Layer<Dtype> {
   int batch_size_;
   int n_;
   int pos_;
+  // The segment of data_ and labels_ after ResetShared
+  shared_ptr<SharedMemorySegment> segment_;
+  // The queue of the batches after set_feed, and the current one
+  Feed* feed_;
+  shared_ptr<MemoryBatch<Dtype> > batch_;
+  // With memory_data_param().stage_batches() in GPU mode, host arrays are
+  // copied to the device a window of batches at a time into one of two
+  // buffers, while the window after it is copied into the other one on
+  // stage_stream_. stage_data_[i] holds the rows [stage_start_[i],
+  // stage_start_[i] + stage_rows_[i]) of the array stage_source_[i].
+  int stage_batches_;
+  Blob<Dtype> stage_data_[2];
+  Blob<Dtype> stage_labels_[2];
+  const Dtype* stage_source_[2];
+  int stage_start_[2];
+  int stage_rows_[2];
+  int stage_current_;
+  cudaStream_t stage_stream_;
 };
 
 template <typename Dtype>
@@ -296,6 +546,9 @@ class PoolingLayer : public Layer<Dtype> {
       : Layer<Dtype>(param) {}
   virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  virtual bool can_reshape_spatially() const { return true; }
 
  protected:
   virtual Dtype Forward_cpu(const vector<Blob<Dtype>*>& bottom,
@@ -306,16 +559,74 @@ class PoolingLayer : public Layer<Dtype> {
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
-
-  int kernel_size_;
-  int stride_;
-  int pad_;
+  // Shapes row_pool_ and row_argmax_ to num images, if they are used.
+  void ReshapeRowPool(const int num);
+  // Sets height_ and width_ to those of bottom, and the kernel of global
+  // pooling and the pooled shape that follow from them.
+  void SetInputShape(const Blob<Dtype>& bottom);
+
+  int kernel_h_;
+  int kernel_w_;
+  int stride_h_;
+  int stride_w_;
+  int pad_h_;
+  int pad_w_;
+  // Whether the kernel is the whole input, pooled into one output a channel
+  bool global_pooling_;
   int channels_;
   int height_;
   int width_;
   int pooled_height_;
   int pooled_width_;
   Blob<Dtype> rand_idx_;
+  // With store_argmax, the index h * width + w in its channel of the max of
+  // each window
+  bool store_argmax_;
+  Blob<Dtype> max_idx_;
+  // The max, or sum, of each row of the windows of kernels of
+  // kSeparablePoolKernelSize and larger on the GPU, num x channels x height
+  // x pooled_width, and the column of each max
+  Blob<Dtype> row_pool_;
+  Blob<Dtype> row_argmax_;
+};
+
+/* ROIPoolingLayer
+  Max pools the regions of interest of bottom[1], R x 5 x 1 x 1 of
+  (item of bottom[0], x1, y1, x2, y2) in image coordinates, each into a
+  pooled_h x pooled_w grid of the features of bottom[0], so that top is
+  R x channels x pooled_h x pooled_w: the regions, as many windows of an
+  image as wanted, are then classified from a single pass of the
+  convolutions over the image rather than one per warped window.
+*/
+template <typename Dtype>
+class ROIPoolingLayer : public Layer<Dtype> {
+ public:
+  explicit ROIPoolingLayer(const LayerParameter& param)
+      : Layer<Dtype>(param) {}
+  virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+
+ protected:
+  virtual Dtype Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  virtual Dtype Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const bool propagate_down, vector<Blob<Dtype>*>* bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const bool propagate_down, vector<Blob<Dtype>*>* bottom);
+
+  int channels_;
+  int height_;
+  int width_;
+  int pooled_height_;
+  int pooled_width_;
+  Dtype spatial_scale_;
+  // The index h * width + w in its channel of the max of each bin, -1 for
+  // the empty bins
+  Blob<Dtype> max_idx_;
 };
 
 /* SoftmaxLayer
@@ -337,11 +648,6 @@ class SoftmaxLayer : public Layer<Dtype> {
       const bool propagate_down, vector<Blob<Dtype>*>* bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
      const bool propagate_down, vector<Blob<Dtype>*>* bottom);
-
-  // sum_multiplier is just used to carry out sum using blas
-  Blob<Dtype> sum_multiplier_;
-  // scale is an intermediate blob to hold temporary results.
-  Blob<Dtype> scale_;
 };
 
 /* SoftmaxWithLossLayer
@@ -350,7 +656,8 @@ class SoftmaxLayer : public Layer<Dtype> {
   It is preferred over separate softmax + multinomiallogisticloss
   layers due to more numerically stable gradients.
 
-  In test, this layer could be replaced by simple softmax layer.
+  In test, this layer could be replaced by simple softmax layer. In the TEST
+  phase, the loss is computed without writing out the probabilities.
 */
 template <typename Dtype>
 class SoftmaxWithLossLayer : public Layer<Dtype> {
@@ -359,6 +666,9 @@ class SoftmaxWithLossLayer : public Layer<Dtype> {
       : Layer<Dtype>(param), softmax_layer_(new SoftmaxLayer<Dtype>(param)) {}
   virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  virtual bool can_compute_item_losses() const { return true; }
 
  protected:
   virtual Dtype Forward_cpu(const vector<Blob<Dtype>*>& bottom,
@@ -370,9 +680,16 @@ class SoftmaxWithLossLayer : public Layer<Dtype> {
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
      const bool propagate_down, vector<Blob<Dtype>*>* bottom);
 
+  // Returns the loss of the TEST phase, computed from the bottom.
+  Dtype TestLoss(const vector<Blob<Dtype>*>& bottom);
+
   shared_ptr<SoftmaxLayer<Dtype> > softmax_layer_;
   // prob stores the output probability of the layer.
   Blob<Dtype> prob_;
+  // exp_row holds the exps of a row for the TEST phase loss.
+  Blob<Dtype> exp_row_;
+  // The loss, summed on the device
+  Blob<Dtype> loss_;
   // Vector holders to call the underlying softmax layer forward and backward.
   vector<Blob<Dtype>*> softmax_bottom_vec_;
   vector<Blob<Dtype>*> softmax_top_vec_;
@@ -387,6 +704,9 @@ class SplitLayer : public Layer<Dtype> {
       : Layer<Dtype>(param) {}
   virtual void SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top);
+  virtual bool can_reshape_spatially() const { return true; }
 
  protected:
   virtual Dtype Forward_cpu(const vector<Blob<Dtype>*>& bottom,
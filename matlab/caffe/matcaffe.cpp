@@ -4,6 +4,9 @@
 // caffe::Caffe functions so that one could easily call it from matlab.
 // Note that for matlab, we will simply use float as the data type.
 
+#include <pthread.h>
+
+#include <map>
 #include <string>
 #include <vector>
 
@@ -14,10 +17,48 @@
 
 using namespace caffe;  // NOLINT(build/namespaces)
 
-// The pointer to the internal caffe::Net instance
-static shared_ptr<Net<float> > net_;
+// The nets loaded, by handle, and the handle of the current one, which the
+// commands use when they are not given a handle: the last one initialized,
+// or selected with set_net; 0 for none. Several models can stay loaded
+// this way. Handles are not reused. The registry is guarded by nets_mutex_
+// for mex files called from threads of their own.
+static std::map<int, shared_ptr<Net<float> > > nets_;
+static int current_handle_ = 0;
+static int next_handle_ = 1;
+static pthread_mutex_t nets_mutex_ = PTHREAD_MUTEX_INITIALIZER;
 static int init_key = -2;
 
+// Takes the handle off the front of the arguments if there is one, a numeric
+// scalar, and returns its net, or the current net. Fails if there is none.
+static shared_ptr<Net<float> > get_net(int* nrhs, const mxArray*** prhs) {
+  int handle = current_handle_;
+  if (*nrhs > 0 && mxIsNumeric((*prhs)[0]) &&
+      mxGetNumberOfElements((*prhs)[0]) == 1) {
+    handle = static_cast<int>(mxGetScalar((*prhs)[0]));
+    --*nrhs;
+    ++*prhs;
+  }
+  pthread_mutex_lock(&nets_mutex_);
+  std::map<int, shared_ptr<Net<float> > >::iterator it = nets_.find(handle);
+  shared_ptr<Net<float> > net;
+  if (it != nets_.end()) {
+    net = it->second;
+  }
+  pthread_mutex_unlock(&nets_mutex_);
+  if (!net) {
+    LOG(ERROR) << "No net of handle " << handle;
+    mexErrMsgTxt("No such net, call init or load first");
+  }
+  return net;
+}
+
+static void free_nets() {
+  pthread_mutex_lock(&nets_mutex_);
+  nets_.clear();
+  current_handle_ = 0;
+  pthread_mutex_unlock(&nets_mutex_);
+}
+
 // Five things to be aware of:
 //   caffe uses row-major order
 //   matlab uses column-major order
@@ -42,14 +83,24 @@ static int init_key = -2;
 // If you have multiple images, cat them with cat(4, ...)
 //
 // The actual forward function. It takes in a cell array of 4-D arrays as
-// input and outputs a cell array.
-
-static mxArray* do_forward(const mxArray* const bottom) {
-  vector<Blob<float>*>& input_blobs = net_->input_blobs();
-  CHECK_EQ(static_cast<unsigned int>(mxGetDimensions(bottom)[0]),
-      input_blobs.size());
+// input and outputs a cell array, or writes the outputs into mx_out, a cell
+// array of single arrays of the sizes of the outputs, if not NULL.
+
+static mxArray* do_forward(Net<float>* net, const mxArray* const bottom,
+    mxArray* mx_out = NULL) {
+  vector<Blob<float>*>& input_blobs = net->input_blobs();
+  if (!mxIsCell(bottom) ||
+      mxGetNumberOfElements(bottom) != input_blobs.size()) {
+    mexErrMsgTxt("The input must be a cell array of one array per input");
+  }
   for (unsigned int i = 0; i < input_blobs.size(); ++i) {
     const mxArray* const elem = mxGetCell(bottom, i);
+    if (!mxIsSingle(elem) ||
+        mxGetNumberOfElements(elem) != input_blobs[i]->count()) {
+      LOG(ERROR) << "Input " << i << " must be single, of "
+          << input_blobs[i]->count() << " elements";
+      mexErrMsgTxt("Wrong input array");
+    }
     const float* const data_ptr =
         reinterpret_cast<const float* const>(mxGetPr(elem));
     switch (Caffe::mode()) {
@@ -65,15 +116,33 @@ static mxArray* do_forward(const mxArray* const bottom) {
       LOG(FATAL) << "Unknown Caffe mode.";
     }  // switch (Caffe::mode())
   }
-  const vector<Blob<float>*>& output_blobs = net_->ForwardPrefilled();
-  mxArray* mx_out = mxCreateCellMatrix(output_blobs.size(), 1);
+  const vector<Blob<float>*>& output_blobs = net->ForwardPrefilled();
+  if (mx_out) {
+    if (!mxIsCell(mx_out) ||
+        mxGetNumberOfElements(mx_out) != output_blobs.size()) {
+      mexErrMsgTxt("The outputs must be a cell array of one array per"
+          " output");
+    }
+  } else {
+    mx_out = mxCreateCellMatrix(output_blobs.size(), 1);
+  }
   for (unsigned int i = 0; i < output_blobs.size(); ++i) {
-    // internally data is stored as (width, height, channels, num)
-    // where width is the fastest dimension
-    mwSize dims[4] = {output_blobs[i]->width(), output_blobs[i]->height(),
-      output_blobs[i]->channels(), output_blobs[i]->num()};
-    mxArray* mx_blob =  mxCreateNumericArray(4, dims, mxSINGLE_CLASS, mxREAL);
-    mxSetCell(mx_out, i, mx_blob);
+    mxArray* mx_blob = mxGetCell(mx_out, i);
+    if (mx_blob) {
+      if (!mxIsSingle(mx_blob) ||
+          mxGetNumberOfElements(mx_blob) != output_blobs[i]->count()) {
+        LOG(ERROR) << "Output " << i << " must be single, of "
+            << output_blobs[i]->count() << " elements";
+        mexErrMsgTxt("Wrong output array");
+      }
+    } else {
+      // internally data is stored as (width, height, channels, num)
+      // where width is the fastest dimension
+      mwSize dims[4] = {output_blobs[i]->width(), output_blobs[i]->height(),
+        output_blobs[i]->channels(), output_blobs[i]->num()};
+      mx_blob = mxCreateNumericArray(4, dims, mxSINGLE_CLASS, mxREAL);
+      mxSetCell(mx_out, i, mx_blob);
+    }
     float* data_ptr = reinterpret_cast<float*>(mxGetPr(mx_blob));
     switch (Caffe::mode()) {
     case Caffe::CPU:
@@ -92,9 +161,9 @@ static mxArray* do_forward(const mxArray* const bottom) {
   return mx_out;
 }
 
-static mxArray* do_backward(const mxArray* const top_diff) {
-  vector<Blob<float>*>& output_blobs = net_->output_blobs();
-  vector<Blob<float>*>& input_blobs = net_->input_blobs();
+static mxArray* do_backward(Net<float>* net, const mxArray* const top_diff) {
+  vector<Blob<float>*>& output_blobs = net->output_blobs();
+  vector<Blob<float>*>& input_blobs = net->input_blobs();
   CHECK_EQ(static_cast<unsigned int>(mxGetDimensions(top_diff)[0]),
       output_blobs.size());
   // First, copy the output diff
@@ -116,7 +185,7 @@ static mxArray* do_backward(const mxArray* const top_diff) {
     }  // switch (Caffe::mode())
   }
   // LOG(INFO) << "Start";
-  net_->Backward();
+  net->Backward();
   // LOG(INFO) << "End";
   mxArray* mx_out = mxCreateCellMatrix(input_blobs.size(), 1);
   for (unsigned int i = 0; i < input_blobs.size(); ++i) {
@@ -144,9 +213,9 @@ static mxArray* do_backward(const mxArray* const top_diff) {
   return mx_out;
 }
 
-static mxArray* do_get_weights() {
-  const vector<shared_ptr<Layer<float> > >& layers = net_->layers();
-  const vector<string>& layer_names = net_->layer_names();
+static mxArray* do_get_weights(Net<float>* net) {
+  const vector<shared_ptr<Layer<float> > >& layers = net->layers();
+  const vector<string>& layer_names = net->layer_names();
 
   // Step 1: count the number of layers with weights
   int num_layers = 0;
@@ -224,7 +293,8 @@ static mxArray* do_get_weights() {
 }
 
 static void get_weights(MEX_ARGS) {
-  plhs[0] = do_get_weights();
+  shared_ptr<Net<float> > net = get_net(&nrhs, &prhs);
+  plhs[0] = do_get_weights(net.get());
 }
 
 static void set_mode_cpu(MEX_ARGS) {
@@ -257,20 +327,40 @@ static void get_init_key(MEX_ARGS) {
   plhs[0] = mxCreateDoubleScalar(init_key);
 }
 
+// Loads the net of the files given, returning its handle.
+static int load_net(const mxArray* param_arg, const mxArray* model_arg) {
+  char* param_file = mxArrayToString(param_arg);
+  char* model_file = mxArrayToString(model_arg);
+
+  shared_ptr<Net<float> > net(new Net<float>(string(param_file)));
+  net->CopyTrainedLayersFrom(string(model_file));
+
+  mxFree(param_file);
+  mxFree(model_file);
+
+  pthread_mutex_lock(&nets_mutex_);
+  const int handle = next_handle_++;
+  nets_[handle] = net;
+  if (!current_handle_) {
+    current_handle_ = handle;
+  }
+  pthread_mutex_unlock(&nets_mutex_);
+  mexAtExit(free_nets);
+  return handle;
+}
+
+// Replaces the current net, or loads the first one.
 static void init(MEX_ARGS) {
   if (nrhs != 2) {
     LOG(ERROR) << "Only given " << nrhs << " arguments";
     mexErrMsgTxt("Wrong number of arguments");
   }
 
-  char* param_file = mxArrayToString(prhs[0]);
-  char* model_file = mxArrayToString(prhs[1]);
-
-  net_.reset(new Net<float>(string(param_file)));
-  net_->CopyTrainedLayersFrom(string(model_file));
-
-  mxFree(param_file);
-  mxFree(model_file);
+  pthread_mutex_lock(&nets_mutex_);
+  nets_.erase(current_handle_);
+  current_handle_ = 0;
+  pthread_mutex_unlock(&nets_mutex_);
+  load_net(prhs[0], prhs[1]);
 
   init_key = random();  // NOLINT(caffe/random_fn)
 
@@ -279,38 +369,99 @@ static void init(MEX_ARGS) {
   }
 }
 
+// Loads another net, keeping those loaded, and returns its handle. It only
+// becomes the current net if there is none.
+static void load(MEX_ARGS) {
+  if (nrhs != 2) {
+    LOG(ERROR) << "Only given " << nrhs << " arguments";
+    mexErrMsgTxt("Wrong number of arguments");
+  }
+
+  plhs[0] = mxCreateDoubleScalar(load_net(prhs[0], prhs[1]));
+}
+
+static void set_net(MEX_ARGS) {
+  if (nrhs != 1) {
+    LOG(ERROR) << "Only given " << nrhs << " arguments";
+    mexErrMsgTxt("Wrong number of arguments");
+  }
+
+  const int handle = static_cast<int>(mxGetScalar(prhs[0]));
+  pthread_mutex_lock(&nets_mutex_);
+  const bool loaded = nets_.count(handle);
+  if (loaded) {
+    current_handle_ = handle;
+  }
+  pthread_mutex_unlock(&nets_mutex_);
+  if (!loaded) {
+    LOG(ERROR) << "No net of handle " << handle;
+    mexErrMsgTxt("No such net, call init or load first");
+  }
+}
+
+// Frees the net of the handle given, or all of them.
 static void reset(MEX_ARGS) {
-  if (net_) {
-    net_.reset();
-    init_key = -2;
-    LOG(INFO) << "Network reset, call init before use it again";
+  if (nrhs == 0) {
+    if (nets_.size()) {
+      free_nets();
+      init_key = -2;
+      LOG(INFO) << "Network reset, call init before use it again";
+    }
+    return;
   }
+  const int handle = static_cast<int>(mxGetScalar(prhs[0]));
+  pthread_mutex_lock(&nets_mutex_);
+  nets_.erase(handle);
+  if (handle == current_handle_) {
+    current_handle_ = 0;
+  }
+  pthread_mutex_unlock(&nets_mutex_);
 }
 
 static void forward(MEX_ARGS) {
+  shared_ptr<Net<float> > net = get_net(&nrhs, &prhs);
   if (nrhs != 1) {
     LOG(ERROR) << "Only given " << nrhs << " arguments";
     mexErrMsgTxt("Wrong number of arguments");
   }
 
-  plhs[0] = do_forward(prhs[0]);
+  plhs[0] = do_forward(net.get(), prhs[0]);
+}
+
+// caffe('forward_into', [handle,] input, outputs) writes the outputs into the
+// arrays of the outputs cell array, sized as forward returns them, instead
+// of allocating new ones: reuse the same outputs from batch to batch. The
+// arrays are written in place, so they should not share their data with
+// other variables, e.g. create them with zeros rather than copy them.
+static void forward_into(MEX_ARGS) {
+  shared_ptr<Net<float> > net = get_net(&nrhs, &prhs);
+  if (nrhs != 2) {
+    LOG(ERROR) << "Only given " << nrhs << " arguments";
+    mexErrMsgTxt("Wrong number of arguments");
+  }
+
+  do_forward(net.get(), prhs[0], const_cast<mxArray*>(prhs[1]));
 }
 
 static void backward(MEX_ARGS) {
+  shared_ptr<Net<float> > net = get_net(&nrhs, &prhs);
   if (nrhs != 1) {
     LOG(ERROR) << "Only given " << nrhs << " arguments";
     mexErrMsgTxt("Wrong number of arguments");
   }
 
-  plhs[0] = do_backward(prhs[0]);
+  plhs[0] = do_backward(net.get(), prhs[0]);
 }
 
 static void is_initialized(MEX_ARGS) {
-  if (!net_) {
-    plhs[0] = mxCreateDoubleScalar(0);
-  } else {
-    plhs[0] = mxCreateDoubleScalar(1);
+  int handle = current_handle_;
+  if (nrhs > 0) {
+    handle = static_cast<int>(mxGetScalar(prhs[0]));
   }
+  pthread_mutex_lock(&nets_mutex_);
+  const bool initialized = nets_.count(handle);
+  pthread_mutex_unlock(&nets_mutex_);
+  plhs[0] = mxCreateDoubleScalar(initialized ? 1 : 0);
 }
 
 /** -----------------------------------------------------------------
@@ -324,8 +475,11 @@ struct handler_registry {
 static handler_registry handlers[] = {
   // Public API functions
   { "forward",            forward         },
+  { "forward_into",       forward_into    },
   { "backward",           backward        },
   { "init",               init            },
+  { "load",               load            },
+  { "set_net",            set_net         },
   { "is_initialized",     is_initialized  },
   { "set_mode_cpu",       set_mode_cpu    },
   { "set_mode_gpu",       set_mode_gpu    },
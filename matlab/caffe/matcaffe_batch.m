@@ -51,6 +51,8 @@ IMAGE_MEAN = d.image_mean;
 num_images = length(list_im);
 scores = zeros(dim,num_images,'single');
 num_batches = ceil(length(list_im)/batch_size)
+% the outputs are written into the same array batch after batch
+output_data = {zeros(1,1,dim,batch_size,'single')};
 initic=tic;
 for bb = 1 : num_batches
     batchtic = tic;
@@ -60,10 +62,10 @@ for bb = 1 : num_batches
     toc, tic
     fprintf('Batch %d out of %d %.2f%% Complete ETA %.2f seconds\n',...
         bb,num_batches,bb/num_batches*100,toc(initic)/bb*(num_batches-bb));
-    output_data = caffe('forward', {input_data});
+    caffe('forward_into', {input_data}, output_data);
     toc
-    output_data = squeeze(output_data{1});
-    scores(:,range) = output_data(:,mod(range-1,batch_size)+1);
+    batch_scores = squeeze(output_data{1});
+    scores(:,range) = batch_scores(:,mod(range-1,batch_size)+1);
     toc(batchtic)
 end
 toc(initic);
@@ -5,16 +5,20 @@
 
 #define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
 
+#include <pthread.h>
+
 #include "boost/python.hpp"
 #include "boost/python/suite/indexing/vector_indexing_suite.hpp"
 #include "numpy/arrayobject.h"
 
 // these need to be included after boost on OS X
+#include <algorithm>  // NOLINT(build/include_order)
 #include <string>  // NOLINT(build/include_order)
 #include <vector>  // NOLINT(build/include_order)
 #include <fstream>  // NOLINT
 
 #include "caffe/caffe.hpp"
+#include "caffe/util/data_transform.hpp"
 
 // Temporary solution for numpy < 1.7 versions: old macro, no promises.
 // You're strongly advised to upgrade to >= 1.7.
@@ -25,6 +29,7 @@
 
 
 using namespace caffe;  // NOLINT(build/namespaces)
+using boost::python::dict;
 using boost::python::extract;
 using boost::python::len;
 using boost::python::list;
@@ -45,12 +50,63 @@ static void CheckFile(const string& filename) {
     f.close();
 }
 
+// The mutex serializing the calls of the Python threads on a net and its
+// solver, shared by the copies of its wrapper
+class NetMutex {
+ public:
+  NetMutex() { pthread_mutex_init(&mutex_, NULL); }
+  ~NetMutex() { pthread_mutex_destroy(&mutex_); }
+  pthread_mutex_t* get() { return &mutex_; }
+
+ private:
+  pthread_mutex_t mutex_;
+
+  DISABLE_COPY_AND_ASSIGN(NetMutex);
+};
+
+// Runs the computations of a net, forward, backward or solving, without the
+// GIL, so that other Python threads, e.g. decoding the next batch, run
+// meanwhile. The mutex of the net is held, and waited for without the GIL
+// too, so that no other thread changes the net or replaces the arrays it
+// reads in the meantime.
+class ComputeScope {
+ public:
+  explicit ComputeScope(NetMutex* mutex)
+      : mutex_(mutex), thread_state_(PyEval_SaveThread()) {
+    pthread_mutex_lock(mutex_->get());
+  }
+  ~ComputeScope() {
+    pthread_mutex_unlock(mutex_->get());
+    PyEval_RestoreThread(thread_state_);
+  }
+
+ private:
+  NetMutex* mutex_;
+  PyThreadState* thread_state_;
+};
+
+// Holds the mutex of a net, waited for without the GIL, for calls that
+// change the net with the GIL, e.g. to give it arrays to read.
+class NetLock {
+ public:
+  explicit NetLock(NetMutex* mutex) : mutex_(mutex) {
+    PyThreadState* thread_state = PyEval_SaveThread();
+    pthread_mutex_lock(mutex_->get());
+    PyEval_RestoreThread(thread_state);
+  }
+  ~NetLock() { pthread_mutex_unlock(mutex_->get()); }
+
+ private:
+  NetMutex* mutex_;
+};
+
 // wrap shared_ptr<Blob<float> > in a class that we construct in C++ and pass
 // to Python
 class CaffeBlob {
  public:
-  CaffeBlob(const shared_ptr<Blob<float> > &blob, const string& name)
-      : blob_(blob), name_(name) {}
+  CaffeBlob(const shared_ptr<Blob<float> > &blob, const string& name,
+      const shared_ptr<NetMutex>& mutex)
+      : blob_(blob), name_(name), mutex_(mutex) {}
 
   string name() const { return name_; }
   int num() const { return blob_->num(); }
@@ -67,6 +123,8 @@ class CaffeBlob {
  protected:
   shared_ptr<Blob<float> > blob_;
   string name_;
+  // The mutex of the net, held while the memory is synced to the host
+  shared_ptr<NetMutex> mutex_;
 };
 
 
@@ -80,9 +138,13 @@ class CaffeBlobWrap : public CaffeBlob {
 
   object get_data() {
       npy_intp dims[] = {num(), channels(), height(), width()};
+      float* data;
+      {
+        NetLock lock(mutex_.get());
+        data = blob_->mutable_cpu_data();
+      }
 
-      PyObject *obj = PyArray_SimpleNewFromData(4, dims, NPY_FLOAT32,
-                                                blob_->mutable_cpu_data());
+      PyObject *obj = PyArray_SimpleNewFromData(4, dims, NPY_FLOAT32, data);
       PyArray_SetBaseObject(reinterpret_cast<PyArrayObject *>(obj), self_);
       Py_INCREF(self_);
       handle<> h(obj);
@@ -92,9 +154,13 @@ class CaffeBlobWrap : public CaffeBlob {
 
   object get_diff() {
       npy_intp dims[] = {num(), channels(), height(), width()};
+      float* diff;
+      {
+        NetLock lock(mutex_.get());
+        diff = blob_->mutable_cpu_diff();
+      }
 
-      PyObject *obj = PyArray_SimpleNewFromData(4, dims, NPY_FLOAT32,
-                                                blob_->mutable_cpu_diff());
+      PyObject *obj = PyArray_SimpleNewFromData(4, dims, NPY_FLOAT32, diff);
       PyArray_SetBaseObject(reinterpret_cast<PyArrayObject *>(obj), self_);
       Py_INCREF(self_);
       handle<> h(obj);
@@ -109,17 +175,45 @@ class CaffeBlobWrap : public CaffeBlob {
 
 class CaffeLayer {
  public:
-  CaffeLayer(const shared_ptr<Layer<float> > &layer, const string &name)
-    : layer_(layer), name_(name) {}
+  CaffeLayer(const shared_ptr<Layer<float> > &layer, const string &name,
+      const shared_ptr<NetMutex>& mutex)
+    : layer_(layer), name_(name), mutex_(mutex) {}
 
   string name() const { return name_; }
   vector<CaffeBlob> blobs() {
     vector<CaffeBlob> result;
     for (int i = 0; i < layer_->blobs().size(); ++i) {
-      result.push_back(CaffeBlob(layer_->blobs()[i], name_));
+      result.push_back(CaffeBlob(layer_->blobs()[i], name_, mutex_));
+    }
+    return result;
+  }
+
+  // The time a DataLayer spent on its batches since reset_data_stats (see
+  // DataLayerStats), empty for the other layers.
+  dict data_stats() {
+    dict result;
+    DataLayer<float>* data_layer =
+        dynamic_cast<DataLayer<float>*>(layer_.get());
+    if (data_layer) {
+      const DataLayerStats& stats = data_layer->stats();
+      result["batches"] = stats.batches;
+      result["wait_ms"] = stats.wait_ms;
+      result["prefetch_ms"] = stats.prefetch_ms;
+      result["read_ms"] = stats.read_ms;
+      result["parse_ms"] = stats.parse_ms;
+      result["decode_ms"] = stats.decode_ms;
+      result["transform_ms"] = stats.transform_ms;
+      result["copy_ms"] = stats.copy_ms;
     }
     return result;
   }
+  void reset_data_stats() {
+    DataLayer<float>* data_layer =
+        dynamic_cast<DataLayer<float>*>(layer_.get());
+    if (data_layer) {
+      data_layer->ResetStats();
+    }
+  }
 
   // this is here only to satisfy boost's vector_indexing_suite
   bool operator == (const CaffeLayer &other) {
@@ -129,6 +223,7 @@ class CaffeLayer {
  protected:
   shared_ptr<Layer<float> > layer_;
   string name_;
+  shared_ptr<NetMutex> mutex_;
 };
 
 
@@ -137,18 +232,19 @@ struct CaffeNet {
   // For cases where parameters will be determined later by the Python user,
   // create a Net with unallocated parameters (which will not be zero-filled
   // when accessed).
-  explicit CaffeNet(string param_file) {
+  explicit CaffeNet(string param_file) : mutex_(new NetMutex()) {
     Init(param_file);
   }
 
-  CaffeNet(string param_file, string pretrained_param_file) {
+  CaffeNet(string param_file, string pretrained_param_file)
+      : mutex_(new NetMutex()) {
     Init(param_file);
     CheckFile(pretrained_param_file);
     net_->CopyTrainedLayersFrom(pretrained_param_file);
   }
 
   explicit CaffeNet(shared_ptr<Net<float> > net)
-      : net_(net) {}
+      : net_(net), mutex_(new NetMutex()) {}
 
   void Init(string param_file) {
     CheckFile(param_file);
@@ -181,24 +277,20 @@ struct CaffeNet {
     }
   }
 
-  void Forward() {
-    net_->ForwardPrefilled();
-  }
-
-  void Backward() {
-    net_->Backward();
-  }
-
-  void set_input_arrays(object data_obj, object labels_obj) {
-    // check that this network has an input MemoryDataLayer
+  // check that this network has an input MemoryDataLayer
+  shared_ptr<MemoryDataLayer<float> > memory_data_layer(const string& caller) {
     shared_ptr<MemoryDataLayer<float> > md_layer =
       boost::dynamic_pointer_cast<MemoryDataLayer<float> >(net_->layers()[0]);
     if (!md_layer) {
-      throw std::runtime_error("set_input_arrays may only be called if the"
+      throw std::runtime_error(caller + " may only be called if the"
           " first layer is a MemoryDataLayer");
     }
+    return md_layer;
+  }
 
-    // check that we were passed appropriately-sized contiguous memory
+  // check that we were passed appropriately-sized contiguous memory
+  void check_input_arrays(shared_ptr<MemoryDataLayer<float> > md_layer,
+      object data_obj, object labels_obj) {
     PyArrayObject* data_arr =
         reinterpret_cast<PyArrayObject*>(data_obj.ptr());
     PyArrayObject* labels_arr =
@@ -214,27 +306,241 @@ struct CaffeNet {
       throw std::runtime_error("first dimensions of input arrays must be a"
           " multiple of batch size");
     }
+  }
+
+  void Forward() {
+    ComputeScope compute(mutex_.get());
+    net_->ForwardPrefilled();
+  }
+
+  // Runs only the layers the blobs named depend on.
+  void ForwardBlobs(list blob_names) {
+    vector<string> names;
+    for (int i = 0; i < len(blob_names); ++i) {
+      names.push_back(extract<string>(blob_names[i]));
+    }
+    ComputeScope compute(mutex_.get());
+    net_->ForwardBlobs(names);
+  }
+
+  // Runs the net over all the items of input_arrays, one N x C x H x W
+  // float32 array per net input, writing the outputs named into the
+  // preallocated output_arrays (see Net::ForwardAll).
+  void ForwardAll(list input_arrays, list output_names, list output_arrays) {
+    if (len(input_arrays) != net_->num_inputs()) {
+      throw std::runtime_error("Wrong number of input arrays");
+    }
+    if (len(output_names) != len(output_arrays)) {
+      throw std::runtime_error("Wrong number of output arrays");
+    }
+    int num = -1;
+    vector<const float*> inputs;
+    for (int i = 0; i < len(input_arrays); ++i) {
+      PyArrayObject* arr = reinterpret_cast<PyArrayObject*>(
+          object(input_arrays[i]).ptr());
+      const Blob<float>* blob = net_->input_blobs()[i];
+      check_contiguous_array(arr, "input array", blob->channels(),
+          blob->height(), blob->width());
+      if (num >= 0 && PyArray_DIMS(arr)[0] != num) {
+        throw std::runtime_error("input arrays must have the same first"
+            " dimension");
+      }
+      num = PyArray_DIMS(arr)[0];
+      inputs.push_back(static_cast<float*>(PyArray_DATA(arr)));
+    }
+    vector<string> names;
+    vector<float*> outputs;
+    for (int i = 0; i < len(output_names); ++i) {
+      names.push_back(extract<string>(output_names[i]));
+      if (!net_->has_blob(names[i])) {
+        throw std::runtime_error("Unknown blob " + names[i]);
+      }
+      const Blob<float>* blob = net_->blob_by_name(names[i]).get();
+      PyArrayObject* arr = reinterpret_cast<PyArrayObject*>(
+          object(output_arrays[i]).ptr());
+      check_contiguous_array(arr, "output array", blob->channels(),
+          blob->height(), blob->width());
+      if (PyArray_DIMS(arr)[0] != num) {
+        throw std::runtime_error("output arrays must have as many items as"
+            " the inputs");
+      }
+      outputs.push_back(static_cast<float*>(PyArray_DATA(arr)));
+    }
+    ComputeScope compute(mutex_.get());
+    net_->ForwardAll(num, inputs, names, outputs);
+  }
+
+  // Runs forward from the layer named on, the layers before having run
+  // already, e.g. to pool other regions of the same features.
+  void ForwardFrom(string layer_name) {
+    if (!net_->has_layer(layer_name)) {
+      throw std::runtime_error("Unknown layer " + layer_name);
+    }
+    const vector<string>& names = net_->layer_names();
+    const int start = std::find(names.begin(), names.end(), layer_name)
+        - names.begin();
+    ComputeScope compute(mutex_.get());
+    net_->ForwardFrom(start);
+  }
+
+  void Backward() {
+    ComputeScope compute(mutex_.get());
+    net_->Backward();
+  }
+
+  void set_input_arrays(object data_obj, object labels_obj) {
+    shared_ptr<MemoryDataLayer<float> > md_layer =
+        memory_data_layer("set_input_arrays");
+    check_input_arrays(md_layer, data_obj, labels_obj);
+    NetLock lock(mutex_.get());
 
     // hold references
     input_data_ = data_obj;
     input_labels_ = labels_obj;
+    next_input_data_ = object();
+    next_input_labels_ = object();
 
+    PyArrayObject* data_arr =
+        reinterpret_cast<PyArrayObject*>(data_obj.ptr());
+    PyArrayObject* labels_arr =
+        reinterpret_cast<PyArrayObject*>(labels_obj.ptr());
     md_layer->Reset(static_cast<float*>(PyArray_DATA(data_arr)),
         static_cast<float*>(PyArray_DATA(labels_arr)),
         PyArray_DIMS(data_arr)[0]);
   }
 
+  // Queues arrays to be used once all the batches of the current input arrays
+  // have been, so that the next chunk of a dataset can be loaded while the
+  // current one is used.
+  void set_next_input_arrays(object data_obj, object labels_obj) {
+    shared_ptr<MemoryDataLayer<float> > md_layer =
+        memory_data_layer("set_next_input_arrays");
+    check_input_arrays(md_layer, data_obj, labels_obj);
+    NetLock lock(mutex_.get());
+
+    // the layer moved on to the previously queued arrays, which are now the
+    // current ones
+    if (!md_layer->has_next() && next_input_data_.ptr() != Py_None) {
+      input_data_ = next_input_data_;
+      input_labels_ = next_input_labels_;
+    }
+    next_input_data_ = data_obj;
+    next_input_labels_ = labels_obj;
+
+    PyArrayObject* data_arr =
+        reinterpret_cast<PyArrayObject*>(data_obj.ptr());
+    PyArrayObject* labels_arr =
+        reinterpret_cast<PyArrayObject*>(labels_obj.ptr());
+    md_layer->ResetNext(static_cast<float*>(PyArray_DATA(data_arr)),
+        static_cast<float*>(PyArray_DATA(labels_arr)),
+        PyArray_DIMS(data_arr)[0]);
+  }
+
+  // Preprocesses images, a list of H' x W' x K float32 arrays, straight into
+  // the input blob named as Net.preprocess would: each image is resized to
+  // image_height x image_width if it is not that size already, and either
+  // its center crop of the size of the blob is taken, or, if oversample, the
+  // crops of its four corners, its center and their mirrors, 10 items per
+  // image. The items of the blob left after them are zeroed. mean is None or
+  // a K x H x W float32 array, channel_order empty for the identity.
+  void preprocess_batch(string input_name, list images, int image_height,
+      int image_width, bool oversample, float scale, list channel_order,
+      object mean_obj) {
+    if (!net_->has_blob(input_name)) {
+      throw std::runtime_error("Unknown input " + input_name);
+    }
+    Blob<float>* blob = net_->blob_by_name(input_name).get();
+    const int channels = blob->channels();
+    const int crop_height = blob->height();
+    const int crop_width = blob->width();
+    const int crops = oversample ? 10 : 1;
+    if (len(images) * crops > blob->num()) {
+      throw std::runtime_error("More images than the batch holds");
+    }
+    if (image_height < crop_height || image_width < crop_width) {
+      throw std::runtime_error("Images are smaller than the input blob");
+    }
+    vector<int> order;
+    for (int i = 0; i < len(channel_order); ++i) {
+      order.push_back(extract<int>(channel_order[i]));
+    }
+    if (order.size() && order.size() != channels) {
+      throw std::runtime_error("Channel order has wrong number of channels");
+    }
+    const float* mean = NULL;
+    if (mean_obj.ptr() != Py_None) {
+      PyArrayObject* mean_arr =
+          reinterpret_cast<PyArrayObject*>(mean_obj.ptr());
+      if (!(PyArray_FLAGS(mean_arr) & NPY_ARRAY_C_CONTIGUOUS) ||
+          PyArray_TYPE(mean_arr) != NPY_FLOAT32 ||
+          PyArray_SIZE(mean_arr) != blob->count() / blob->num()) {
+        throw std::runtime_error("mean must be a C contiguous float32 array"
+            " of the shape of an input item");
+      }
+      mean = static_cast<float*>(PyArray_DATA(mean_arr));
+    }
+    // The images stay referenced by the caller's list while the GIL is
+    // released.
+    vector<const float*> data;
+    vector<int> heights, widths;
+    for (int i = 0; i < len(images); ++i) {
+      PyArrayObject* arr = reinterpret_cast<PyArrayObject*>(
+          object(images[i]).ptr());
+      if (!(PyArray_FLAGS(arr) & NPY_ARRAY_C_CONTIGUOUS) ||
+          PyArray_TYPE(arr) != NPY_FLOAT32 || PyArray_NDIM(arr) != 3 ||
+          PyArray_DIMS(arr)[2] != channels) {
+        throw std::runtime_error("images must be C contiguous float32"
+            " H x W x K arrays");
+      }
+      data.push_back(static_cast<float*>(PyArray_DATA(arr)));
+      heights.push_back(PyArray_DIMS(arr)[0]);
+      widths.push_back(PyArray_DIMS(arr)[1]);
+    }
+
+    ComputeScope compute(mutex_.get());
+    const int item_size = blob->count() / blob->num();
+    float* dst = blob->mutable_cpu_data();
+    vector<float> resized(image_height * image_width * channels);
+    // The corners and the center, mirrored for the last 5 crops
+    const int h_offs[] = {0, 0, image_height - crop_height,
+        image_height - crop_height, (image_height - crop_height) / 2};
+    const int w_offs[] = {0, image_width - crop_width, 0,
+        image_width - crop_width, (image_width - crop_width) / 2};
+    for (int i = 0; i < data.size(); ++i) {
+      const float* image = data[i];
+      if (heights[i] != image_height || widths[i] != image_width) {
+        ResizeImage(image, heights[i], widths[i], channels, image_height,
+            image_width, &resized[0]);
+        image = &resized[0];
+      }
+      for (int j = 0; j < crops; ++j) {
+        const int k = oversample ? j % 5 : 4;
+        PreprocessImage(image, image_height, image_width, channels,
+            h_offs[k], w_offs[k], crop_height, crop_width, j >= 5,
+            order.size() ? &order[0] : NULL, scale, mean, dst);
+        dst += item_size;
+      }
+    }
+    caffe_set(blob->count() - data.size() * crops * item_size, 0.f, dst);
+  }
+
   // The caffe::Caffe utility functions.
   void set_mode_cpu() { Caffe::set_mode(Caffe::CPU); }
   void set_mode_gpu() { Caffe::set_mode(Caffe::GPU); }
+  void set_cpu_threads(int cpu_threads) { Caffe::set_cpu_threads(cpu_threads); }
   void set_phase_train() { Caffe::set_phase(Caffe::TRAIN); }
   void set_phase_test() { Caffe::set_phase(Caffe::TEST); }
   void set_device(int device_id) { Caffe::SetDevice(device_id); }
+  void reshape(int batch_size) {
+    ComputeScope compute(mutex_.get());
+    net_->Reshape(batch_size);
+  }
 
   vector<CaffeBlob> blobs() {
     vector<CaffeBlob> result;
     for (int i = 0; i < net_->blobs().size(); ++i) {
-      result.push_back(CaffeBlob(net_->blobs()[i], net_->blob_names()[i]));
+      result.push_back(CaffeBlob(net_->blobs()[i], net_->blob_names()[i],
+          mutex_));
     }
     return result;
   }
@@ -242,7 +548,8 @@ struct CaffeNet {
   vector<CaffeLayer> layers() {
     vector<CaffeLayer> result;
     for (int i = 0; i < net_->layers().size(); ++i) {
-      result.push_back(CaffeLayer(net_->layers()[i], net_->layer_names()[i]));
+      result.push_back(CaffeLayer(net_->layers()[i], net_->layer_names()[i],
+          mutex_));
     }
     return result;
   }
@@ -267,9 +574,12 @@ struct CaffeNet {
 
   // The pointer to the internal caffe::Net instant.
   shared_ptr<Net<float> > net_;
+  shared_ptr<NetMutex> mutex_;
   // if taking input from an ndarray, we need to hold references
   object input_data_;
   object input_labels_;
+  object next_input_data_;
+  object next_input_labels_;
 };
 
 class CaffeSGDSolver {
@@ -285,10 +595,14 @@ class CaffeSGDSolver {
   }
 
   shared_ptr<CaffeNet> net() { return net_; }
-  void Solve() { return solver_->Solve(); }
+  void Solve() {
+    ComputeScope compute(net_->mutex_.get());
+    solver_->Solve();
+  }
   void SolveResume(const string& resume_file) {
     CheckFile(resume_file);
-    return solver_->Solve(resume_file);
+    ComputeScope compute(net_->mutex_.get());
+    solver_->Solve(resume_file);
   }
 
  protected:
@@ -305,17 +619,24 @@ BOOST_PYTHON_MODULE(_caffe) {
       "Net", boost::python::init<string, string>())
       .def(boost::python::init<string>())
       .def("_forward",          &CaffeNet::Forward)
+      .def("_forward_blobs",    &CaffeNet::ForwardBlobs)
+      .def("_forward_all",      &CaffeNet::ForwardAll)
+      .def("_forward_from",     &CaffeNet::ForwardFrom)
       .def("_backward",         &CaffeNet::Backward)
       .def("set_mode_cpu",      &CaffeNet::set_mode_cpu)
       .def("set_mode_gpu",      &CaffeNet::set_mode_gpu)
+      .def("set_cpu_threads",   &CaffeNet::set_cpu_threads)
       .def("set_phase_train",   &CaffeNet::set_phase_train)
       .def("set_phase_test",    &CaffeNet::set_phase_test)
       .def("set_device",        &CaffeNet::set_device)
+      .def("reshape",           &CaffeNet::reshape)
+      .def("_preprocess_batch", &CaffeNet::preprocess_batch)
       .add_property("_blobs",   &CaffeNet::blobs)
       .add_property("layers",   &CaffeNet::layers)
       .add_property("inputs",   &CaffeNet::inputs)
       .add_property("outputs",  &CaffeNet::outputs)
-      .def("_set_input_arrays", &CaffeNet::set_input_arrays);
+      .def("_set_input_arrays", &CaffeNet::set_input_arrays)
+      .def("_set_next_input_arrays", &CaffeNet::set_next_input_arrays);
 
   boost::python::class_<CaffeBlob, CaffeBlobWrap>(
       "Blob", boost::python::no_init)
@@ -331,7 +652,9 @@ BOOST_PYTHON_MODULE(_caffe) {
   boost::python::class_<CaffeLayer>(
       "Layer", boost::python::no_init)
       .add_property("name",  &CaffeLayer::name)
-      .add_property("blobs", &CaffeLayer::blobs);
+      .add_property("blobs", &CaffeLayer::blobs)
+      .add_property("data_stats", &CaffeLayer::data_stats)
+      .def("reset_data_stats", &CaffeLayer::reset_data_stats);
 
   boost::python::class_<CaffeSGDSolver, boost::noncopyable>(
       "SGDSolver", boost::python::init<string>())
@@ -346,4 +669,6 @@ BOOST_PYTHON_MODULE(_caffe) {
       .def(vector_indexing_suite<vector<CaffeLayer>, true>());
 
   import_array();
+  // Creates the GIL, which the computations release.
+  PyEval_InitThreads();
 }
@@ -56,27 +56,21 @@ class Classifier(caffe.Net):
         predictions: (N x C) ndarray of class probabilities
                      for N images and C classes.
         """
-        # Scale to standardize input dimensions.
-        inputs = np.asarray([caffe.io.resize_image(im, self.image_dims)
-                             for im in inputs])
-
-        if oversample:
-            # Generate center, corner, and mirrored crops.
-            inputs = caffe.io.oversample(inputs, self.crop_dims)
-        else:
-            # Take center crop.
-            center = np.array(self.image_dims) / 2.0
-            crop = np.tile(center, (1, 2))[0] + np.concatenate([
-                -self.crop_dims / 2.0,
-                self.crop_dims / 2.0
-            ])
-            inputs = inputs[:, crop[0]:crop[2], crop[1]:crop[3], :]
-
-        # Classify
-        caffe_in = np.asarray([self.preprocess(self.inputs[0], in_)
-                    for in_ in inputs])
-        out = self.forward_all(**{self.inputs[0]: caffe_in})
-        predictions = out[self.outputs[0]].squeeze(axis=(2,3))
+        # Resize, crop, and preprocess each batch straight into the input
+        # blob, as many inputs per batch as their crops fit.
+        in_ = self.inputs[0]
+        crops = 10 if oversample else 1
+        per_batch = self.blobs[in_].num / crops
+        if per_batch == 0:
+            raise Exception('Oversampling needs a batch size of at least 10.')
+        inputs = list(inputs)
+        predictions = []
+        for i in range(0, len(inputs), per_batch):
+            num = self.preprocess_batch(in_, inputs[i:i + per_batch],
+                                        self.image_dims, oversample)
+            out = self.forward()
+            predictions.extend(out[self.outputs[0]][:num].copy())
+        predictions = np.asarray(predictions).squeeze(axis=(2,3))
 
         # For oversampling, average predictions across crops.
         if oversample:
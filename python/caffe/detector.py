@@ -91,6 +91,61 @@ class Detector(caffe.Net):
         return detections
 
 
+    def detect_windows_dense(self, images_windows, rois_input='rois',
+                             roi_layer='roi_pool5'):
+        """
+        Do windowed detection as detect_windows() does, but run the
+        convolutions once over each image and classify the windows from their
+        pooled features rather than run the whole net on every warped window.
+        The net takes the image through one input and the windows through
+        rois_input, R x 5 x 1 x 1, R windows at a time, which the ROI_POOLING
+        layer roi_layer pools (see ROIPoolingParameter). The image is resized
+        to the input dimensions, and the windows with it.
+
+        Take
+        images_windows: (image filename, window list) iterable.
+        rois_input: name of the input of the windows.
+        roi_layer: name of the layer pooling the windows.
+
+        Give
+        detections: list of {filename: image filename, window: crop coordinates,
+            predictions: prediction vector} dicts.
+        """
+        image_input = [in_ for in_ in self.inputs if in_ != rois_input][0]
+        image_dims = np.array(self.blobs[image_input].data.shape[2:])
+        num_rois = self.blobs[rois_input].num
+        detections = []
+        for image_fname, windows in images_windows:
+            image = caffe.io.load_image(image_fname).astype(np.float32)
+            self.preprocess_batch(image_input, [image])
+            # Windows are (ymin, xmin, ymax, xmax) crops of the image and
+            # the regions (item, x1, y1, x2, y2) of the input, both ends in.
+            scale = image_dims.astype(np.float32) / image.shape[:2]
+            windows_ = np.asarray(windows, dtype=np.float32)
+            rois = np.zeros((len(windows_), 5, 1, 1), dtype=np.float32)
+            rois[:, 1, 0, 0] = windows_[:, 1] * scale[1]
+            rois[:, 2, 0, 0] = windows_[:, 0] * scale[0]
+            rois[:, 3, 0, 0] = (windows_[:, 3] - 1) * scale[1]
+            rois[:, 4, 0, 0] = (windows_[:, 2] - 1) * scale[0]
+            # The convolutions run for the first windows only.
+            predictions = []
+            for i in range(0, len(rois), num_rois):
+                chunk = rois[i:i + num_rois]
+                rois_blob = self.blobs[rois_input].data
+                rois_blob[...] = 0
+                rois_blob[:len(chunk)] = chunk
+                out = self.forward(start=roi_layer if i else None)
+                predictions.extend(
+                    out[self.outputs[0]][:len(chunk)].squeeze(axis=(2,3)))
+            for window, prediction in zip(windows, predictions):
+                detections.append({
+                    'window': window,
+                    'prediction': prediction.copy(),
+                    'filename': image_fname
+                })
+        return detections
+
+
     def detect_selective_search(self, image_fnames):
         """
         Do windowed detection over Selective Search proposals by extracting
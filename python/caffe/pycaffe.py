@@ -35,12 +35,16 @@ def _Net_params(self):
                         if len(lr.blobs) > 0])
 
 
-def _Net_forward(self, blobs=None, **kwargs):
+def _Net_forward(self, blobs=None, prune=False, start=None, **kwargs):
     """
     Forward pass: prepare inputs and run the net forward.
 
     Take
     blobs: list of blobs to return in addition to output blobs.
+    prune: run only the layers that blobs depend on, and return only blobs,
+           e.g. to extract features without running the classifier.
+    start: name of the layer to run from, the layers before it having run
+           already, e.g. to pool other regions of the same conv features.
     kwargs: Keys are input blob names and values are blob ndarrays.
             For formatting inputs for Caffe, see Net.preprocess().
             If None, input is taken from data layers.
@@ -50,6 +54,8 @@ def _Net_forward(self, blobs=None, **kwargs):
     """
     if blobs is None:
         blobs = []
+    if prune and not blobs:
+        raise Exception('A pruned forward pass needs the blobs to compute.')
 
     if kwargs:
         if set(kwargs.keys()) != set(self.inputs):
@@ -63,7 +69,13 @@ def _Net_forward(self, blobs=None, **kwargs):
                 raise Exception('{} blob is not 4-d'.format(in_))
             self.blobs[in_].data[...] = blob
 
-    self._forward()
+    if prune:
+        self._forward_blobs(list(blobs))
+        return {out: self.blobs[out].data for out in set(blobs)}
+    if start is not None:
+        self._forward_from(start)
+    else:
+        self._forward()
 
     # Unpack blobs to extract
     outs = {out: self.blobs[out].data for out in set(self.outputs + blobs)}
@@ -106,7 +118,9 @@ def _Net_backward(self, diffs=None, **kwargs):
 
 def _Net_forward_all(self, blobs=None, **kwargs):
     """
-    Run net forward in batches.
+    Run net forward in batches, in C++: the inputs are read in place, or
+    copied to the device while the previous batch is computed, and the
+    outputs are written straight into the result arrays.
 
     Take
     blobs: list of blobs to extract as in forward()
@@ -114,22 +128,20 @@ def _Net_forward_all(self, blobs=None, **kwargs):
             Refer to forward().
 
     Give
-    all_outs: {blob name: list of blobs} dict.
+    all_outs: {blob name: blob ndarray} dict.
     """
-    # Collect outputs from batches
-    all_outs = {out: [] for out in set(self.outputs + (blobs or []))}
-    for batch in self._batch(kwargs):
-        outs = self.forward(blobs=blobs, **batch)
-        for out, out_blob in outs.iteritems():
-            all_outs[out].extend(out_blob.copy())
-    # Package in ndarray.
-    for out in all_outs:
-        all_outs[out] = np.asarray(all_outs[out])
-    # Discard padding.
-    pad = len(all_outs.itervalues().next()) - len(kwargs.itervalues().next())
-    if pad:
-        for out in all_outs:
-            all_outs[out] = all_outs[out][:-pad]
+    if set(kwargs.keys()) != set(self.inputs):
+        raise Exception('Input blob arguments do not match net inputs.')
+    inputs = [np.ascontiguousarray(kwargs[in_], dtype=np.float32)
+              for in_ in self.inputs]
+    num = len(inputs[0])
+    out_names = list(set(self.outputs + (blobs or [])))
+    # The shapes are read without syncing the blobs to the host.
+    blobs_ = self.blobs
+    all_outs = {out: np.empty((num, blobs_[out].channels, blobs_[out].height,
+                               blobs_[out].width), dtype=np.float32)
+                for out in out_names}
+    self._forward_all(inputs, out_names, [all_outs[out] for out in out_names])
     return all_outs
 
 
@@ -273,6 +285,44 @@ def _Net_preprocess(self, input_name, input_):
     return caffe_in
 
 
+def _Net_preprocess_batch(self, input_name, inputs, image_dims=None,
+                          oversample=False):
+    """
+    Format a batch of inputs for Caffe as Net.preprocess() does, in C++ and
+    straight into the input blob, then take center crops or, if oversample,
+    the center, corner, and mirrored crops as caffe.io.oversample() does.
+    Call forward() without inputs afterwards. Resizing is bilinear with
+    clamped borders, which can differ slightly from caffe.io.resize_image()
+    at the edges.
+
+    Take
+    input_name: name of input blob to preprocess into
+    inputs: iterable of (H' x W' x K) ndarrays, at most the batch size of
+            them, or a tenth of it when oversampling.
+    image_dims: (height, width) to resize the inputs to before cropping.
+                Default is the input blob dimensions.
+    oversample: 10 crops per input when True, one center crop when False.
+
+    Give
+    num: the number of items filled in the batch; the rest are zeroed.
+    """
+    in_shape = self.blobs[input_name].data.shape
+    if image_dims is None:
+        image_dims = in_shape[2:]
+    input_scale = getattr(self, 'input_scale', {}).get(input_name) or 1
+    channel_order = getattr(self, 'channel_swap', {}).get(input_name) or []
+    mean = getattr(self, 'mean', {}).get(input_name)
+    if mean is not None:
+        # Broadcast channel means to the shape of an input item.
+        mean = np.ascontiguousarray(mean * np.ones(in_shape[1:]),
+                                    dtype=np.float32)
+    inputs = [np.ascontiguousarray(in_, dtype=np.float32) for in_ in inputs]
+    self._preprocess_batch(input_name, inputs, int(image_dims[0]),
+                           int(image_dims[1]), oversample,
+                           float(input_scale), list(channel_order), mean)
+    return len(inputs) * (10 if oversample else 1)
+
+
 def _Net_deprocess(self, input_name, input_):
     """
     Invert Caffe formatting; see Net.preprocess().
@@ -304,6 +354,18 @@ def _Net_set_input_arrays(self, data, labels):
     return self._set_input_arrays(data, labels)
 
 
+def _Net_set_next_input_arrays(self, data, labels):
+    """
+    Queue input arrays for the MemoryDataLayer, used once all the batches of
+    the current ones have been: the next chunk of a dataset can be loaded
+    while the net goes through the current one.
+    """
+    if labels.ndim == 1:
+        labels = np.ascontiguousarray(labels[:, np.newaxis, np.newaxis,
+                                             np.newaxis])
+    return self._set_next_input_arrays(data, labels)
+
+
 def _Net_batch(self, blobs):
     """
     Batch blob lists according to net's batch size.
@@ -347,6 +409,8 @@ Net.set_mean = _Net_set_mean
 Net.set_input_scale = _Net_set_input_scale
 Net.set_channel_swap = _Net_set_channel_swap
 Net.preprocess = _Net_preprocess
+Net.preprocess_batch = _Net_preprocess_batch
 Net.deprocess = _Net_deprocess
 Net.set_input_arrays = _Net_set_input_arrays
+Net.set_next_input_arrays = _Net_set_next_input_arrays
 Net._batch = _Net_batch
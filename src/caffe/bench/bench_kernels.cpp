@@ -0,0 +1,325 @@
+// Copyright 2014 BVLC and contributors.
+//
+// Times the math, im2col, pooling and LRN kernels on their own, over the
+// shapes of the layers of the reference AlexNet and CIFAR-10 nets, and
+// prints the time of a call and its GFLOP/s and GB/s as CSV, to compare
+// optimizations of the kernels. The bytes are those read and written once
+// each; the flops those of the multiply-adds.
+// Usage (built by make bench, or run by make runbench):
+//    bench_kernels.bin [CPU/GPU] [device_id=0] [iterations=10]
+
+#include <glog/logging.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/vision_layers.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/im2col.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+// A kernel on buffers of its own, set up by its constructor.
+class Kernel {
+ public:
+  virtual ~Kernel() {}
+  virtual void Run() = 0;
+};
+
+static void Fill(Blob<float>* blob) {
+  FillerParameter filler_param;
+  GaussianFiller<float> filler(filler_param);
+  filler.Fill(blob);
+}
+
+// C = A B, A being M x K and B K x N.
+class GemmKernel : public Kernel {
+ public:
+  GemmKernel(const int M, const int N, const int K)
+      : M_(M), N_(N), K_(K), A_(1, 1, M, K), B_(1, 1, K, N), C_(1, 1, M, N) {
+    Fill(&A_);
+    Fill(&B_);
+  }
+  virtual void Run() {
+    if (Caffe::mode() == Caffe::GPU) {
+      caffe_gpu_gemm<float>(CblasNoTrans, CblasNoTrans, M_, N_, K_, 1.,
+          A_.gpu_data(), B_.gpu_data(), 0., C_.mutable_gpu_data());
+    } else {
+      caffe_cpu_gemm<float>(CblasNoTrans, CblasNoTrans, M_, N_, K_, 1.,
+          A_.cpu_data(), B_.cpu_data(), 0., C_.mutable_cpu_data());
+    }
+  }
+
+ protected:
+  int M_, N_, K_;
+  Blob<float> A_, B_, C_;
+};
+
+// im2col, or col2im back, with the GPU kernel variant.
+class Im2colKernel : public Kernel {
+ public:
+  Im2colKernel(const int channels, const int size, const int kernel_size,
+      const int pad, const int stride, const int out_size, const bool col2im,
+      const Im2colGpuKernel variant)
+      : channels_(channels), size_(size), kernel_size_(kernel_size),
+        pad_(pad), stride_(stride), col2im_(col2im), variant_(variant),
+        image_(1, channels, size, size),
+        columns_(1, channels * kernel_size * kernel_size, out_size,
+            out_size) {
+    Fill(&image_);
+    Fill(&columns_);
+  }
+  virtual void Run() {
+    if (Caffe::mode() == Caffe::GPU && col2im_) {
+      col2im_gpu(columns_.gpu_data(), channels_, size_, size_, kernel_size_,
+          kernel_size_, pad_, pad_, stride_, stride_,
+          image_.mutable_gpu_data(), variant_);
+    } else if (Caffe::mode() == Caffe::GPU) {
+      im2col_gpu(image_.gpu_data(), channels_, size_, size_, kernel_size_,
+          kernel_size_, pad_, pad_, stride_, stride_,
+          columns_.mutable_gpu_data(), variant_);
+    } else if (col2im_) {
+      col2im_cpu(columns_.cpu_data(), channels_, size_, size_, kernel_size_,
+          kernel_size_, pad_, pad_, stride_, stride_,
+          image_.mutable_cpu_data());
+    } else {
+      im2col_cpu(image_.cpu_data(), channels_, size_, size_, kernel_size_,
+          kernel_size_, pad_, pad_, stride_, stride_,
+          columns_.mutable_cpu_data());
+    }
+  }
+
+ protected:
+  int channels_, size_, kernel_size_, pad_, stride_;
+  bool col2im_;
+  Im2colGpuKernel variant_;
+  Blob<float> image_, columns_;
+};
+
+// y = 0.9 x + 0.1 y, as in the momentum update.
+class AxpbyKernel : public Kernel {
+ public:
+  explicit AxpbyKernel(const int n) : n_(n), x_(1, 1, 1, n), y_(1, 1, 1, n) {
+    Fill(&x_);
+    Fill(&y_);
+  }
+  virtual void Run() {
+    if (Caffe::mode() == Caffe::GPU) {
+      caffe_gpu_axpby<float>(n_, 0.9, x_.gpu_data(), 0.1,
+          y_.mutable_gpu_data());
+    } else {
+      caffe_cpu_axpby<float>(n_, 0.9, x_.cpu_data(), 0.1,
+          y_.mutable_cpu_data());
+    }
+  }
+
+ protected:
+  int n_;
+  Blob<float> x_, y_;
+};
+
+// The forward pass of a layer, e.g. a pooling or an LRN one.
+class LayerKernel : public Kernel {
+ public:
+  LayerKernel(Layer<float>* layer, const int num, const int channels,
+      const int size)
+      : layer_(layer), bottom_blob_(num, channels, size, size),
+        bottom_(1, &bottom_blob_), top_(1, &top_blob_) {
+    Fill(&bottom_blob_);
+    layer_->SetUp(bottom_, &top_);
+  }
+  virtual void Run() {
+    layer_->Forward(bottom_, &top_);
+  }
+  const Blob<float>& top() const { return top_blob_; }
+
+ protected:
+  shared_ptr<Layer<float> > layer_;
+  Blob<float> bottom_blob_, top_blob_;
+  vector<Blob<float>*> bottom_, top_;
+};
+
+// Times iterations calls of kernel, after a first one, and prints them.
+static void Report(const string& name, const string& shape, Kernel* kernel,
+    const int iterations, const double flops, const double bytes) {
+  kernel->Run();
+  Timer timer;
+  timer.Start();
+  for (int i = 0; i < iterations; ++i) {
+    kernel->Run();
+  }
+  const double ms = timer.MilliSeconds() / iterations;
+  printf("%s,%s,%s,%.4f,%.3f,%.3f\n", name.c_str(),
+      Caffe::mode() == Caffe::GPU ? "GPU" : "CPU", shape.c_str(), ms,
+      ms > 0 ? flops / ms / 1e6 : 0., ms > 0 ? bytes / ms / 1e6 : 0.);
+  fflush(stdout);
+}
+
+// The convolutions of the reference nets, for one image
+struct ConvShape {
+  const char* name;
+  int channels;
+  int size;
+  int kernel_size;
+  int pad;
+  int stride;
+  int num_output;
+  int group;
+};
+
+static const ConvShape kConvShapes[] = {
+  {"alexnet_conv1", 3, 227, 11, 0, 4, 96, 1},
+  {"alexnet_conv2", 96, 27, 5, 2, 1, 256, 2},
+  {"alexnet_conv3", 256, 13, 3, 1, 1, 384, 1},
+  {"alexnet_conv4", 384, 13, 3, 1, 1, 384, 2},
+  {"alexnet_conv5", 384, 13, 3, 1, 1, 256, 2},
+  {"cifar_conv1", 3, 32, 5, 2, 1, 32, 1},
+  {"cifar_conv2", 32, 16, 5, 2, 1, 32, 1},
+  {"cifar_conv3", 32, 8, 5, 2, 1, 64, 1},
+};
+
+// The inner products of the reference nets, over their batches
+struct InnerProductShape {
+  const char* name;
+  int batch_size;
+  int inputs;
+  int outputs;
+};
+
+static const InnerProductShape kInnerProductShapes[] = {
+  {"alexnet_fc6", 256, 9216, 4096},
+  {"alexnet_fc7", 256, 4096, 4096},
+  {"alexnet_fc8", 256, 4096, 1000},
+  {"cifar_ip1", 100, 1024, 10},
+};
+
+// The pooling and LRN layers of the reference nets, over small batches
+struct MapShape {
+  const char* name;
+  int num;
+  int channels;
+  int size;
+  int kernel_size;
+  int stride;
+};
+
+static const MapShape kPoolingShapes[] = {
+  {"alexnet_pool1", 10, 96, 55, 3, 2},
+  {"alexnet_pool5", 10, 256, 13, 3, 2},
+  {"cifar_pool1", 100, 32, 32, 3, 2},
+};
+
+static const MapShape kLRNShapes[] = {
+  {"alexnet_norm1", 10, 96, 55, 5, 1},
+  {"alexnet_norm2", 10, 256, 27, 5, 1},
+  {"cifar_norm1", 100, 32, 16, 3, 1},
+};
+
+template <typename Shape, int n>
+static int Size(const Shape (&)[n]) {
+  return n;
+}
+
+static string ShapeString(const char* name, const int a, const int b,
+    const int c) {
+  char buffer[128];
+  snprintf(buffer, sizeof(buffer), "%s %dx%dx%d", name, a, b, c);
+  return buffer;
+}
+
+void BenchKernels(const int iterations) {
+  printf("kernel,mode,shape,ms,gflops,gbytes_per_second\n");
+  for (int i = 0; i < Size(kConvShapes); ++i) {
+    const ConvShape& s = kConvShapes[i];
+    const int out_size = (s.size + 2 * s.pad - s.kernel_size) / s.stride + 1;
+    const int M = s.num_output / s.group;
+    const int K = s.channels / s.group * s.kernel_size * s.kernel_size;
+    const int N = out_size * out_size;
+    // The GEMM of one group, as the convolution layer computes it
+    GemmKernel gemm(M, N, K);
+    Report("gemm", ShapeString(s.name, M, N, K), &gemm, iterations,
+        2. * M * N * K, 4. * (M * K + K * N + M * N));
+    // The plain and the tiled GPU kernels, the CPU having one of each
+    const Im2colGpuKernel variants[] = { IM2COL_GPU_PLAIN, IM2COL_GPU_TILED };
+    const char* variant_names[] = { "plain", "tiled" };
+    const int num_variants = Caffe::mode() == Caffe::GPU ? 2 : 1;
+    for (int j = 0; j < 2 * num_variants; ++j) {
+      const bool col2im = j >= num_variants;
+      const int variant = j % num_variants;
+      Im2colKernel im2col(s.channels, s.size, s.kernel_size, s.pad,
+          s.stride, out_size, col2im, variants[variant]);
+      string name = col2im ? "col2im" : "im2col";
+      if (Caffe::mode() == Caffe::GPU) {
+        name += string("_") + variant_names[variant];
+      }
+      Report(name, ShapeString(s.name, s.channels, s.size, s.kernel_size),
+          &im2col, iterations, 0,
+          4. * (s.channels * s.size * s.size + s.group * K * N));
+    }
+  }
+  for (int i = 0; i < Size(kInnerProductShapes); ++i) {
+    const InnerProductShape& s = kInnerProductShapes[i];
+    GemmKernel gemm(s.batch_size, s.outputs, s.inputs);
+    Report("gemm", ShapeString(s.name, s.batch_size, s.outputs, s.inputs),
+        &gemm, iterations, 2. * s.batch_size * s.outputs * s.inputs,
+        4. * (s.batch_size * s.inputs + s.inputs * s.outputs +
+            s.batch_size * s.outputs));
+    // The momentum update of the weights
+    const int count = s.inputs * s.outputs;
+    AxpbyKernel axpby(count);
+    Report("axpby", ShapeString(s.name, 1, s.outputs, s.inputs), &axpby,
+        iterations, 2. * count, 4. * 3 * count);
+  }
+  for (int i = 0; i < Size(kPoolingShapes); ++i) {
+    const MapShape& s = kPoolingShapes[i];
+    LayerParameter layer_param;
+    PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+    pooling_param->set_pool(PoolingParameter_PoolMethod_MAX);
+    pooling_param->set_kernel_size(s.kernel_size);
+    pooling_param->set_stride(s.stride);
+    LayerKernel pooling(new PoolingLayer<float>(layer_param), s.num,
+        s.channels, s.size);
+    const double bottom_count = 1. * s.num * s.channels * s.size * s.size;
+    Report("max_pooling", ShapeString(s.name, s.num, s.channels, s.size),
+        &pooling, iterations, pooling.top().count() * s.kernel_size *
+        s.kernel_size, 4. * (bottom_count + pooling.top().count()));
+  }
+  for (int i = 0; i < Size(kLRNShapes); ++i) {
+    const MapShape& s = kLRNShapes[i];
+    LayerParameter layer_param;
+    layer_param.mutable_lrn_param()->set_local_size(s.kernel_size);
+    LayerKernel lrn(new LRNLayer<float>(layer_param), s.num, s.channels,
+        s.size);
+    const double count = 1. * s.num * s.channels * s.size * s.size;
+    // The scale is kept for the backward pass.
+    Report("lrn", ShapeString(s.name, s.num, s.channels, s.size), &lrn,
+        iterations, 2. * count * s.kernel_size, 4. * 3 * count);
+  }
+}
+
+}  // namespace caffe
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc > 4) {
+    LOG(ERROR) << "bench_kernels [CPU/GPU] [device_id=0] [iterations=10]";
+    return 1;
+  }
+  if (argc > 1 && strcmp(argv[1], "GPU") == 0) {
+    caffe::Caffe::SetDevice(argc > 2 ? atoi(argv[2]) : 0);
+    caffe::Caffe::set_mode(caffe::Caffe::GPU);
+  } else {
+    caffe::Caffe::set_mode(caffe::Caffe::CPU);
+  }
+  const int iterations = argc > 3 ? atoi(argv[3]) : 10;
+  CHECK_GT(iterations, 0);
+  caffe::BenchKernels(iterations);
+  return 0;
+}
@@ -3,9 +3,15 @@
 #include <cuda_runtime.h>
 #include <cublas_v2.h>
 
+#include <algorithm>
+#include <cstring>
+#include <string>
+
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
 #include "caffe/syncedmem.hpp"
+#include "caffe/util/cpu_threads.hpp"
+#include "caffe/util/half.hpp"
 #include "caffe/util/math_functions.hpp"
 
 namespace caffe {
@@ -21,13 +27,23 @@ void Blob<Dtype>::Reshape(const int num, const int channels, const int height,
   channels_ = channels;
   height_ = height;
   width_ = width;
-  count_ = num_ * channels_ * height_ * width_;
-  if (count_) {
-    data_.reset(new SyncedMemory(count_ * sizeof(Dtype)));
-    diff_.reset(new SyncedMemory(count_ * sizeof(Dtype)));
-  } else {
-    data_.reset(reinterpret_cast<SyncedMemory*>(NULL));
-    diff_.reset(reinterpret_cast<SyncedMemory*>(NULL));
+  count_ = static_cast<int64_t>(num_) * channels_ * height_ * width_;
+  if (count_ > capacity_) {
+    capacity_ = count_;
+    data_.reset(new SyncedMemory(capacity_ * sizeof(Dtype)));
+    data_->set_tag(data_tag_);
+    diff_.reset();
+    half_data_.reset();
+    half_scratch_.reset();
+  }
+}
+
+template <typename Dtype>
+void Blob<Dtype>::CreateDiff() const {
+  CHECK(data_);
+  if (!diff_) {
+    diff_.reset(new SyncedMemory(capacity_ * sizeof(Dtype)));
+    diff_->set_tag(diff_tag_);
   }
 }
 
@@ -38,61 +54,164 @@ void Blob<Dtype>::ReshapeLike(const Blob<Dtype>& other) {
 
 template <typename Dtype>
 Blob<Dtype>::Blob(const int num, const int channels, const int height,
-    const int width) {
+    const int width)
+    : capacity_(0) {
   Reshape(num, channels, height, width);
 }
 
 template <typename Dtype>
 const Dtype* Blob<Dtype>::cpu_data() const {
   CHECK(data_);
+  if (half_data_) {
+    Dtype* data = reinterpret_cast<Dtype*>(half_scratch_->mutable_cpu_data());
+    caffe_cpu_from_half(count_,
+        reinterpret_cast<const float16*>(half_data_->cpu_data()), data);
+    return data;
+  }
   return (const Dtype*)data_->cpu_data();
 }
 
 template <typename Dtype>
 void Blob<Dtype>::set_cpu_data(Dtype* data) {
   CHECK(data);
+  half_data_.reset();
+  FitDataToCount();
   data_->set_cpu_data(data);
 }
 
+template <typename Dtype>
+void Blob<Dtype>::set_cpu_segment(
+    const shared_ptr<SharedMemorySegment>& segment, const size_t offset) {
+  half_data_.reset();
+  FitDataToCount();
+  data_->set_cpu_segment(segment, offset);
+}
+
 template <typename Dtype>
 const Dtype* Blob<Dtype>::gpu_data() const {
   CHECK(data_);
+  if (half_data_) {
+    Dtype* data = reinterpret_cast<Dtype*>(half_scratch_->mutable_gpu_data());
+    caffe_gpu_from_half(count_,
+        reinterpret_cast<const float16*>(half_data_->gpu_data()), data);
+    return data;
+  }
   return (const Dtype*)data_->gpu_data();
 }
 
+template <typename Dtype>
+void Blob<Dtype>::set_gpu_data(Dtype* data) {
+  CHECK(data);
+  half_data_.reset();
+  FitDataToCount();
+  data_->set_gpu_data(data);
+}
+
+template <typename Dtype>
+void Blob<Dtype>::StoreDataAsHalf(const shared_ptr<SyncedMemory>& scratch) {
+  CHECK(data_);
+  CHECK_GE(scratch->size(), count_ * sizeof(Dtype));
+  if (!half_data_) {
+    shared_ptr<SyncedMemory> half_data(
+        new SyncedMemory(count_ * sizeof(float16)));
+    half_data->set_tag(data_tag_);
+    if (Caffe::mode() == Caffe::GPU) {
+      caffe_gpu_to_half(count_, gpu_data(),
+          reinterpret_cast<float16*>(half_data->mutable_gpu_data()));
+    } else {
+      caffe_cpu_to_half(count_, cpu_data(),
+          reinterpret_cast<float16*>(half_data->mutable_cpu_data()));
+    }
+    half_data_ = half_data;
+    // The data memory is only allocated again if the data is restored.
+    data_.reset(new SyncedMemory(count_ * sizeof(Dtype)));
+    data_->set_tag(data_tag_);
+    capacity_ = count_;
+  }
+  half_scratch_ = scratch;
+}
+
+template <typename Dtype>
+void Blob<Dtype>::set_memory_tags(const MemoryTag& data_tag,
+    const MemoryTag& diff_tag) {
+  data_tag_ = data_tag;
+  diff_tag_ = diff_tag;
+  if (data_) {
+    data_->set_tag(data_tag_);
+  }
+  if (diff_) {
+    diff_->set_tag(diff_tag_);
+  }
+  if (half_data_) {
+    half_data_->set_tag(data_tag_);
+  }
+}
+
+template <typename Dtype>
+void Blob<Dtype>::RestoreHalfData() const {
+  if (!half_data_) {
+    return;
+  }
+  if (Caffe::mode() == Caffe::GPU) {
+    caffe_gpu_from_half(count_,
+        reinterpret_cast<const float16*>(half_data_->gpu_data()),
+        reinterpret_cast<Dtype*>(data_->mutable_gpu_data()));
+  } else {
+    caffe_cpu_from_half(count_,
+        reinterpret_cast<const float16*>(half_data_->cpu_data()),
+        reinterpret_cast<Dtype*>(data_->mutable_cpu_data()));
+  }
+  half_data_.reset();
+  half_scratch_.reset();
+}
+
+template <typename Dtype>
+void Blob<Dtype>::FitDataToCount() {
+  CHECK(data_);
+  // The memory syncs all of its size between host and device, which must
+  // then not be more than the count elements given by the caller.
+  if (data_->size() != count_ * sizeof(Dtype)) {
+    data_.reset(new SyncedMemory(count_ * sizeof(Dtype)));
+    data_->set_tag(data_tag_);
+    capacity_ = count_;
+  }
+}
+
 template <typename Dtype>
 const Dtype* Blob<Dtype>::cpu_diff() const {
-  CHECK(diff_);
+  CreateDiff();
   return (const Dtype*)diff_->cpu_data();
 }
 
 template <typename Dtype>
 const Dtype* Blob<Dtype>::gpu_diff() const {
-  CHECK(diff_);
+  CreateDiff();
   return (const Dtype*)diff_->gpu_data();
 }
 
 template <typename Dtype>
 Dtype* Blob<Dtype>::mutable_cpu_data() {
   CHECK(data_);
+  RestoreHalfData();
   return reinterpret_cast<Dtype*>(data_->mutable_cpu_data());
 }
 
 template <typename Dtype>
 Dtype* Blob<Dtype>::mutable_gpu_data() {
   CHECK(data_);
+  RestoreHalfData();
   return reinterpret_cast<Dtype*>(data_->mutable_gpu_data());
 }
 
 template <typename Dtype>
 Dtype* Blob<Dtype>::mutable_cpu_diff() {
-  CHECK(diff_);
+  CreateDiff();
   return reinterpret_cast<Dtype*>(diff_->mutable_cpu_data());
 }
 
 template <typename Dtype>
 Dtype* Blob<Dtype>::mutable_gpu_diff() {
-  CHECK(diff_);
+  CreateDiff();
   return reinterpret_cast<Dtype*>(diff_->mutable_gpu_data());
 }
 
@@ -100,29 +219,65 @@ template <typename Dtype>
 void Blob<Dtype>::ShareData(const Blob& other) {
   CHECK_EQ(count_, other.count());
   data_ = other.data();
+  half_data_.reset();
+  // Only reuse as much memory as both the data and the diff have.
+  capacity_ = std::min(capacity_, other.capacity());
 }
 
 template <typename Dtype>
 void Blob<Dtype>::ShareDiff(const Blob& other) {
   CHECK_EQ(count_, other.count());
   diff_ = other.diff();
+  capacity_ = std::min(capacity_, other.capacity());
+}
+
+template <typename Dtype>
+void Blob<Dtype>::ShareDataMemory(const shared_ptr<SyncedMemory>& memory) {
+  CHECK_GE(memory->size(), count_ * sizeof(Dtype));
+  data_ = memory;
+  half_data_.reset();
+  capacity_ = std::min(capacity_,
+      static_cast<int64_t>(memory->size() / sizeof(Dtype)));
+}
+
+template <typename Dtype>
+void Blob<Dtype>::ShareDiffMemory(const shared_ptr<SyncedMemory>& memory) {
+  CHECK_GE(memory->size(), count_ * sizeof(Dtype));
+  diff_ = memory;
+  capacity_ = std::min(capacity_,
+      static_cast<int64_t>(memory->size() / sizeof(Dtype)));
+}
+
+template <typename Dtype>
+void Blob<Dtype>::ShareDataView(const Blob& other, const int64_t offset) {
+  CHECK_GE(offset, 0);
+  CHECK_LE(offset + count_, other.count());
+  ShareDataMemory(shared_ptr<SyncedMemory>(new SyncedMemory(other.data(),
+      offset * sizeof(Dtype), count_ * sizeof(Dtype))));
+}
+
+template <typename Dtype>
+void Blob<Dtype>::ShareDiffView(const Blob& other, const int64_t offset) {
+  CHECK_GE(offset, 0);
+  CHECK_LE(offset + count_, other.count());
+  ShareDiffMemory(shared_ptr<SyncedMemory>(new SyncedMemory(other.diff(),
+      offset * sizeof(Dtype), count_ * sizeof(Dtype))));
 }
 
 template <typename Dtype>
 void Blob<Dtype>::Update() {
+  RestoreHalfData();
   // We will perform update based on where the data is located.
   switch (data_->head()) {
   case SyncedMemory::HEAD_AT_CPU:
     // perform computation on CPU
-    caffe_axpy<Dtype>(count_, Dtype(-1),
-        reinterpret_cast<const Dtype*>(diff_->cpu_data()),
+    caffe_axpy<Dtype>(count_, Dtype(-1), cpu_diff(),
         reinterpret_cast<Dtype*>(data_->mutable_cpu_data()));
     break;
   case SyncedMemory::HEAD_AT_GPU:
   case SyncedMemory::SYNCED:
     // perform computation on GPU
-    caffe_gpu_axpy<Dtype>(count_, Dtype(-1),
-        reinterpret_cast<const Dtype*>(diff_->gpu_data()),
+    caffe_gpu_axpy<Dtype>(count_, Dtype(-1), gpu_diff(),
         reinterpret_cast<Dtype*>(data_->mutable_gpu_data()));
     break;
   default:
@@ -143,19 +298,19 @@ void Blob<Dtype>::CopyFrom(const Blob& source, bool copy_diff, bool reshape) {
   switch (Caffe::mode()) {
   case Caffe::GPU:
     if (copy_diff) {
-      CUDA_CHECK(cudaMemcpy(diff_->mutable_gpu_data(), source.gpu_diff(),
+      CUDA_CHECK(cudaMemcpy(mutable_gpu_diff(), source.gpu_diff(),
           sizeof(Dtype) * count_, cudaMemcpyDeviceToDevice));
     } else {
-      CUDA_CHECK(cudaMemcpy(data_->mutable_gpu_data(), source.gpu_data(),
+      CUDA_CHECK(cudaMemcpy(mutable_gpu_data(), source.gpu_data(),
           sizeof(Dtype) * count_, cudaMemcpyDeviceToDevice));
     }
     break;
   case Caffe::CPU:
     if (copy_diff) {
-      memcpy(diff_->mutable_cpu_data(), source.cpu_diff(),
+      memcpy(mutable_cpu_diff(), source.cpu_diff(),
           sizeof(Dtype) * count_);
     } else {
-      memcpy(data_->mutable_cpu_data(), source.cpu_data(),
+      memcpy(mutable_cpu_data(), source.cpu_data(),
         sizeof(Dtype) * count_);
     }
     break;
@@ -164,39 +319,153 @@ void Blob<Dtype>::CopyFrom(const Blob& source, bool copy_diff, bool reshape) {
   }
 }
 
+// The values of the protos are floats, or halves in RAW_HALF, converted from
+// and to the Dtype with a copy when it is float, and over the CPU threads
+// otherwise.
+template <typename Dtype>
+static void ConvertValues(const int64_t n, const float* from, Dtype* to) {
+  const int num_threads = CpuElementwiseThreads(n);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int64_t i = 0; i < n; ++i) {
+    to[i] = from[i];
+  }
+}
+
+template <typename Dtype>
+static void ConvertValues(const int64_t n, const Dtype* from, float* to) {
+  const int num_threads = CpuElementwiseThreads(n);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int64_t i = 0; i < n; ++i) {
+    to[i] = from[i];
+  }
+}
+
+static void ConvertValues(const int64_t n, const float* from, float* to) {
+  memcpy(to, from, n * sizeof(float));
+}
+
+template <typename Dtype>
+static void HalvesToValues(const int64_t n, const float16* from, Dtype* to) {
+  const int num_threads = CpuElementwiseThreads(n);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int64_t i = 0; i < n; ++i) {
+    to[i] = half_to_float(from[i]);
+  }
+}
+
+template <typename Dtype>
+static void ValuesToHalves(const int64_t n, const Dtype* from, float16* to) {
+  const int num_threads = CpuElementwiseThreads(n);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int64_t i = 0; i < n; ++i) {
+    to[i] = float_to_half(from[i]);
+  }
+}
+
+// Reads the n values of raw, encoded as encoding, into values.
+template <typename Dtype>
+static void ReadRawValues(const std::string& raw,
+    const BlobProto::Encoding encoding, const int64_t n, Dtype* values) {
+  switch (encoding) {
+  case BlobProto::RAW_FLOAT:
+    CHECK_EQ(raw.size(), n * sizeof(float)) << "Wrong size of raw blob.";
+    ConvertValues(n, reinterpret_cast<const float*>(raw.data()), values);
+    break;
+  case BlobProto::RAW_HALF:
+    CHECK_EQ(raw.size(), n * sizeof(float16)) << "Wrong size of raw blob.";
+    HalvesToValues(n, reinterpret_cast<const float16*>(raw.data()), values);
+    break;
+  default:
+    LOG(FATAL) << "Unknown raw blob encoding: " << encoding;
+  }
+}
+
+template <typename Dtype>
+static void WriteRawValues(const int64_t n, const Dtype* values,
+    const BlobProto::Encoding encoding, std::string* raw) {
+  switch (encoding) {
+  case BlobProto::RAW_FLOAT:
+    raw->resize(n * sizeof(float));
+    ConvertValues(n, values, reinterpret_cast<float*>(&(*raw)[0]));
+    break;
+  case BlobProto::RAW_HALF:
+    raw->resize(n * sizeof(float16));
+    ValuesToHalves(n, values, reinterpret_cast<float16*>(&(*raw)[0]));
+    break;
+  default:
+    LOG(FATAL) << "Unknown raw blob encoding: " << encoding;
+  }
+}
+
 template <typename Dtype>
 void Blob<Dtype>::FromProto(const BlobProto& proto) {
+  // The data is overwritten: no need to restore the half data.
+  half_data_.reset();
   Reshape(proto.num(), proto.channels(), proto.height(), proto.width());
   // copy data
   Dtype* data_vec = mutable_cpu_data();
-  for (int i = 0; i < count_; ++i) {
-    data_vec[i] = proto.data(i);
-  }
-  if (proto.diff_size() > 0) {
-    Dtype* diff_vec = mutable_cpu_diff();
-    for (int i = 0; i < count_; ++i) {
-      diff_vec[i] = proto.diff(i);
+  if (proto.sparse_row_start_size() > 0) {
+    // Compressed sparse rows of width values (see BlobProto)
+    const int rows = width_ > 0 ? count_ / width_ : 0;
+    CHECK_EQ(proto.sparse_row_start_size(), rows + 1);
+    CHECK_EQ(proto.sparse_column_size(), proto.data_size());
+    CHECK_EQ(proto.sparse_row_start(rows), proto.data_size());
+    caffe_set(count_, Dtype(0), data_vec);
+    for (int i = 0; i < rows; ++i) {
+      for (int j = proto.sparse_row_start(i); j < proto.sparse_row_start(i + 1);
+          ++j) {
+        CHECK_LT(proto.sparse_column(j), width_);
+        data_vec[i * width_ + proto.sparse_column(j)] = proto.data(j);
+      }
     }
+  } else if (proto.encoding() != BlobProto::REPEATED) {
+    ReadRawValues(proto.raw_data(), proto.encoding(), count_, data_vec);
+  } else {
+    CHECK_EQ(proto.data_size(), count_) << "Wrong number of blob values.";
+    ConvertValues(count_, proto.data().data(), data_vec);
+  }
+  if (proto.encoding() != BlobProto::REPEATED && proto.has_raw_diff()) {
+    ReadRawValues(proto.raw_diff(), proto.encoding(), count_,
+        mutable_cpu_diff());
+  } else if (proto.diff_size() > 0) {
+    CHECK_EQ(proto.diff_size(), count_) << "Wrong number of blob values.";
+    ConvertValues(count_, proto.diff().data(), mutable_cpu_diff());
   }
 }
 
 template <typename Dtype>
-void Blob<Dtype>::ToProto(BlobProto* proto, bool write_diff) const {
+void Blob<Dtype>::ToProto(BlobProto* proto, bool write_diff,
+    const BlobProto::Encoding encoding) const {
   proto->set_num(num_);
   proto->set_channels(channels_);
   proto->set_height(height_);
   proto->set_width(width_);
   proto->clear_data();
   proto->clear_diff();
-  const Dtype* data_vec = cpu_data();
-  for (int i = 0; i < count_; ++i) {
-    proto->add_data(data_vec[i]);
+  proto->clear_raw_data();
+  proto->clear_raw_diff();
+  proto->set_encoding(encoding);
+  if (encoding != BlobProto::REPEATED) {
+    WriteRawValues(count_, cpu_data(), encoding, proto->mutable_raw_data());
+    if (write_diff) {
+      WriteRawValues(count_, cpu_diff(), encoding, proto->mutable_raw_diff());
+    }
+    return;
   }
+  CHECK_LE(count_, INT_MAX) << "Too many values for a REPEATED blob proto.";
+  proto->mutable_data()->Resize(count_, 0);
+  ConvertValues(count_, cpu_data(), proto->mutable_data()->mutable_data());
   if (write_diff) {
-    const Dtype* diff_vec = cpu_diff();
-    for (int i = 0; i < count_; ++i) {
-      proto->add_diff(diff_vec[i]);
-    }
+    proto->mutable_diff()->Resize(count_, 0);
+    ConvertValues(count_, cpu_diff(), proto->mutable_diff()->mutable_data());
   }
 }
 
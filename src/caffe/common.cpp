@@ -1,14 +1,26 @@
 // Copyright 2014 BVLC and contributors.
 
+#include <algorithm>
 #include <cstdio>
 #include <ctime>
 
 #include "caffe/common.hpp"
+#include "caffe/util/numa.hpp"
 #include "caffe/util/rng.hpp"
 
 namespace caffe {
 
-shared_ptr<Caffe> Caffe::singleton_;
+boost::thread_specific_ptr<Caffe> Caffe::thread_instance_;
+
+// The descriptor stays NULL if cusparse is not available.
+static void CreateCusparseMatrixDescr(cusparseMatDescr_t* descr) {
+  if (cusparseCreateMatDescr(descr) != CUSPARSE_STATUS_SUCCESS) {
+    *descr = NULL;
+    return;
+  }
+  cusparseSetMatType(*descr, CUSPARSE_MATRIX_TYPE_GENERAL);
+  cusparseSetMatIndexBase(*descr, CUSPARSE_INDEX_BASE_ZERO);
+}
 
 
 // curand seeding
@@ -23,8 +35,9 @@ int64_t cluster_seedgen(void) {
 
 Caffe::Caffe()
     : mode_(Caffe::CPU), phase_(Caffe::TRAIN), cublas_handle_(NULL),
-      curand_generator_(NULL),
-      random_generator_() {
+      curand_generator_(NULL), cusparse_handle_(NULL),
+      cusparse_matrix_descr_(NULL), random_generator_(), max_blocks_(0),
+      cpu_threads_(1) {
   // Try to create a cublas handler, and report an error if failed (but we will
   // keep the program running as one might just want to run CPU code).
   if (cublasCreate(&cublas_handle_) != CUBLAS_STATUS_SUCCESS) {
@@ -37,13 +50,87 @@ Caffe::Caffe()
       != CURAND_STATUS_SUCCESS) {
     LOG(ERROR) << "Cannot create Curand generator. Curand won't be available.";
   }
+  // Try to create a cusparse handler, and its matrix descriptor.
+  if (cusparseCreate(&cusparse_handle_) != CUSPARSE_STATUS_SUCCESS) {
+    LOG(ERROR) << "Cannot create Cusparse handle. Cusparse won't be available.";
+    cusparse_handle_ = NULL;
+  }
+  CreateCusparseMatrixDescr(&cusparse_matrix_descr_);
 }
 
 Caffe::~Caffe() {
+  for (int i = 0; i < cuda_streams_.size(); ++i) {
+    cudaStreamDestroy(cuda_streams_[i]);
+  }
   if (cublas_handle_) CUBLAS_CHECK(cublasDestroy(cublas_handle_));
   if (curand_generator_) {
     CURAND_CHECK(curandDestroyGenerator(curand_generator_));
   }
+  if (cusparse_matrix_descr_) {
+    CUSPARSE_CHECK(cusparseDestroyMatDescr(cusparse_matrix_descr_));
+  }
+  if (cusparse_handle_) CUSPARSE_CHECK(cusparseDestroy(cusparse_handle_));
+}
+
+cudaStream_t Caffe::cuda_stream(const int i) {
+  std::vector<cudaStream_t>& streams = Get().cuda_streams_;
+  if (streams.empty()) {
+    streams.resize(kNumCudaStreams);
+    for (int j = 0; j < kNumCudaStreams; ++j) {
+      CUDA_CHECK(cudaStreamCreate(&streams[j]));
+    }
+  }
+  return streams[i % kNumCudaStreams];
+}
+
+void Caffe::set_cublas_stream(const int i) {
+  CUBLAS_CHECK(cublasSetStream(cublas_handle(), i < 0 ? NULL : cuda_stream(i)));
+}
+
+int Caffe::QueryMaxBlocks() {
+  int device;
+  CUDA_CHECK(cudaGetDevice(&device));
+  cudaDeviceProp prop;
+  CUDA_CHECK(cudaGetDeviceProperties(&prop, device));
+  Get().max_blocks_ = std::max(1, prop.multiProcessorCount *
+      (prop.maxThreadsPerMultiProcessor / CAFFE_CUDA_NUM_THREADS));
+  return Get().max_blocks_;
+}
+
+void Caffe::set_cpu_threads(const int cpu_threads) {
+  CHECK_GT(cpu_threads, 0) << "The number of CPU threads must be positive.";
+  Get().cpu_threads_ = cpu_threads;
+}
+
+Caffe::ThreadSettings Caffe::thread_settings() {
+  ThreadSettings settings;
+  settings.mode = mode();
+  settings.phase = phase();
+  if (cudaGetDevice(&settings.device) != cudaSuccess) {
+    // Clear the error.
+    cudaGetLastError();
+    settings.device = -1;
+  }
+  settings.numa_node = ThreadNumaNode();
+  settings.cpu_threads = cpu_threads();
+  settings.engine_cache_file = engine_cache_file();
+  return settings;
+}
+
+void Caffe::set_thread_settings(const ThreadSettings& settings) {
+  if (settings.device >= 0) {
+    if (!thread_instance_.get()) {
+      CUDA_CHECK(cudaSetDevice(settings.device));
+    }
+    SetDevice(settings.device);
+  }
+  if (settings.numa_node >= 0 && settings.numa_node != ThreadNumaNode()) {
+    BindToNumaNode(settings.numa_node);
+  }
+  set_mode(settings.mode);
+  set_phase(settings.phase);
+  set_cpu_threads(settings.cpu_threads);
+  set_engine_cache_file(settings.engine_cache_file);
 }
 
 void Caffe::set_random_seed(const unsigned int seed) {
@@ -69,18 +156,48 @@ void Caffe::SetDevice(const int device_id) {
   if (current_device == device_id) {
     return;
   }
+  for (int i = 0; i < Get().cuda_streams_.size(); ++i) {
+    CUDA_CHECK(cudaStreamDestroy(Get().cuda_streams_[i]));
+  }
+  Get().cuda_streams_.clear();
   if (Get().cublas_handle_) CUBLAS_CHECK(cublasDestroy(Get().cublas_handle_));
   if (Get().curand_generator_) {
     CURAND_CHECK(curandDestroyGenerator(Get().curand_generator_));
   }
+  if (Get().cusparse_handle_) {
+    CUSPARSE_CHECK(cusparseDestroy(Get().cusparse_handle_));
+  }
   CUDA_CHECK(cudaSetDevice(device_id));
+  Get().max_blocks_ = 0;
   CUBLAS_CHECK(cublasCreate(&Get().cublas_handle_));
+  CUSPARSE_CHECK(cusparseCreate(&Get().cusparse_handle_));
   CURAND_CHECK(curandCreateGenerator(&Get().curand_generator_,
       CURAND_RNG_PSEUDO_DEFAULT));
   CURAND_CHECK(curandSetPseudoRandomGeneratorSeed(Get().curand_generator_,
       cluster_seedgen()));
 }
 
+void Caffe::EnablePeerAccess(const int device, const int peer) {
+  int can_access;
+  CUDA_CHECK(cudaDeviceCanAccessPeer(&can_access, device, peer));
+  if (!can_access) {
+    LOG(INFO) << "GPU " << device << " cannot access GPU " << peer
+        << " directly; their copies go through the host.";
+    return;
+  }
+  int current_device;
+  CUDA_CHECK(cudaGetDevice(&current_device));
+  CUDA_CHECK(cudaSetDevice(device));
+  const cudaError_t error = cudaDeviceEnablePeerAccess(peer, 0);
+  if (error == cudaErrorPeerAccessAlreadyEnabled) {
+    // Clear the error.
+    cudaGetLastError();
+  } else {
+    CUDA_CHECK(error);
+  }
+  CUDA_CHECK(cudaSetDevice(current_device));
+}
+
 void Caffe::DeviceQuery() {
   cudaDeviceProp prop;
   int device;
@@ -161,6 +278,30 @@ const char* cublasGetErrorString(cublasStatus_t error) {
   return "Unknown cublas status";
 }
 
+const char* cusparseGetErrorString(cusparseStatus_t error) {
+  switch (error) {
+  case CUSPARSE_STATUS_SUCCESS:
+    return "CUSPARSE_STATUS_SUCCESS";
+  case CUSPARSE_STATUS_NOT_INITIALIZED:
+    return "CUSPARSE_STATUS_NOT_INITIALIZED";
+  case CUSPARSE_STATUS_ALLOC_FAILED:
+    return "CUSPARSE_STATUS_ALLOC_FAILED";
+  case CUSPARSE_STATUS_INVALID_VALUE:
+    return "CUSPARSE_STATUS_INVALID_VALUE";
+  case CUSPARSE_STATUS_ARCH_MISMATCH:
+    return "CUSPARSE_STATUS_ARCH_MISMATCH";
+  case CUSPARSE_STATUS_MAPPING_ERROR:
+    return "CUSPARSE_STATUS_MAPPING_ERROR";
+  case CUSPARSE_STATUS_EXECUTION_FAILED:
+    return "CUSPARSE_STATUS_EXECUTION_FAILED";
+  case CUSPARSE_STATUS_INTERNAL_ERROR:
+    return "CUSPARSE_STATUS_INTERNAL_ERROR";
+  case CUSPARSE_STATUS_MATRIX_TYPE_NOT_SUPPORTED:
+    return "CUSPARSE_STATUS_MATRIX_TYPE_NOT_SUPPORTED";
+  }
+  return "Unknown cusparse status";
+}
+
 const char* curandGetErrorString(curandStatus_t error) {
   switch (error) {
   case CURAND_STATUS_SUCCESS:
@@ -36,10 +36,14 @@ Layer<Dtype>* GetLayer(const LayerParameter& param) {
     return new DropoutLayer<Dtype>(param);
   case LayerParameter_LayerType_EUCLIDEAN_LOSS:
     return new EuclideanLossLayer<Dtype>(param);
+  case LayerParameter_LayerType_ELTWISE:
+    return new EltwiseLayer<Dtype>(param);
   case LayerParameter_LayerType_ELTWISE_PRODUCT:
     return new EltwiseProductLayer<Dtype>(param);
   case LayerParameter_LayerType_FLATTEN:
     return new FlattenLayer<Dtype>(param);
+  case LayerParameter_LayerType_FUSED_NEURON:
+    return new FusedNeuronLayer<Dtype>(param);
   case LayerParameter_LayerType_HDF5_DATA:
     return new HDF5DataLayer<Dtype>(param);
   case LayerParameter_LayerType_HDF5_OUTPUT:
@@ -66,6 +70,8 @@ Layer<Dtype>* GetLayer(const LayerParameter& param) {
     return new PowerLayer<Dtype>(param);
   case LayerParameter_LayerType_RELU:
     return new ReLULayer<Dtype>(param);
+  case LayerParameter_LayerType_ROI_POOLING:
+    return new ROIPoolingLayer<Dtype>(param);
   case LayerParameter_LayerType_SIGMOID:
     return new SigmoidLayer<Dtype>(param);
   case LayerParameter_LayerType_SIGMOID_CROSS_ENTROPY_LOSS:
@@ -24,38 +24,51 @@ void AccuracyLayer<Dtype>::SetUp(
   CHECK_EQ(bottom[1]->channels(), 1);
   CHECK_EQ(bottom[1]->height(), 1);
   CHECK_EQ(bottom[1]->width(), 1);
-  (*top)[0]->Reshape(1, 2, 1, 1);
+  top_k_ = this->layer_param_.accuracy_param().top_k();
+  CHECK_GE(top_k_, 1) << "top_k must be at least 1.";
+  CHECK_LE(top_k_, bottom[0]->count() / bottom[0]->num())
+      << "top_k must not be more than the outputs of an item.";
+  (*top)[0]->Reshape(1, top_k_ > 1 ? 3 : 2, 1, 1);
+  item_stats_.Reshape(bottom[0]->num(), 3, 1, 1);
+}
+
+template <typename Dtype>
+void AccuracyLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+    vector<Blob<Dtype>*>* top) {
+  item_stats_.Reshape(bottom[0]->num(), 3, 1, 1);
 }
 
 template <typename Dtype>
 Dtype AccuracyLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     vector<Blob<Dtype>*>* top) {
   Dtype accuracy = 0;
+  Dtype top_k_accuracy = 0;
   Dtype logprob = 0;
   const Dtype* bottom_data = bottom[0]->cpu_data();
   const Dtype* bottom_label = bottom[1]->cpu_data();
   int num = bottom[0]->num();
   int dim = bottom[0]->count() / bottom[0]->num();
   for (int i = 0; i < num; ++i) {
-    // Accuracy
-    Dtype maxval = -FLT_MAX;
-    int max_id = 0;
+    // The rank of the label among the outputs, ties going to the first
+    // one, so that rank 0 is the first max
+    const int label = static_cast<int>(bottom_label[i]);
+    const Dtype label_value = bottom_data[i * dim + label];
+    int rank = 0;
     for (int j = 0; j < dim; ++j) {
-      if (bottom_data[i * dim + j] > maxval) {
-        maxval = bottom_data[i * dim + j];
-        max_id = j;
-      }
-    }
-    if (max_id == static_cast<int>(bottom_label[i])) {
-      ++accuracy;
+      const Dtype value = bottom_data[i * dim + j];
+      rank += value > label_value || (value == label_value && j < label);
     }
-    Dtype prob = max(bottom_data[i * dim + static_cast<int>(bottom_label[i])],
-                     Dtype(kLOG_THRESHOLD));
+    accuracy += rank == 0;
+    top_k_accuracy += rank < top_k_;
+    Dtype prob = max(label_value, Dtype(kLOG_THRESHOLD));
     logprob -= log(prob);
   }
   // LOG(INFO) << "Accuracy: " << accuracy;
   (*top)[0]->mutable_cpu_data()[0] = accuracy / num;
   (*top)[0]->mutable_cpu_data()[1] = logprob / num;
+  if (top_k_ > 1) {
+    (*top)[0]->mutable_cpu_data()[2] = top_k_accuracy / num;
+  }
   // Accuracy layer should not be used as a loss function.
   return Dtype(0);
 }
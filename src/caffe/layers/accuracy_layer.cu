@@ -0,0 +1,100 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/vision_layers.hpp"
+#include "caffe/util/math_functions.hpp"
+
+using std::max;
+
+namespace caffe {
+
+// The accuracy kernels run blocks of kAccuracyThreads threads, a power of
+// two for the reductions in shared memory.
+const int kAccuracyThreads = 256;
+
+// Sums the values of the threads of the block in buffer, and returns the
+// sum to thread 0.
+template <typename Dtype>
+__device__ Dtype accuracy_block_sum(Dtype value, Dtype* buffer) {
+  buffer[threadIdx.x] = value;
+  __syncthreads();
+  for (int stride = kAccuracyThreads / 2; stride > 0; stride /= 2) {
+    if (threadIdx.x < stride) {
+      buffer[threadIdx.x] += buffer[threadIdx.x + stride];
+    }
+    __syncthreads();
+  }
+  const Dtype result = buffer[0];
+  // buffer is reused by the next reduction
+  __syncthreads();
+  return result;
+}
+
+// One block per item: the rank of its label among its dim outputs, as in
+// Forward_cpu, counted by the threads over the outputs a block apart. Sets
+// the stats of the item to whether the rank is 0, the loss of the label and
+// whether the rank is under top_k.
+template <typename Dtype>
+__global__ void kernel_accuracy_items(const int dim, const Dtype* data,
+    const Dtype* label, const int top_k, const Dtype log_threshold,
+    Dtype* item_stats) {
+  __shared__ Dtype buffer[kAccuracyThreads];
+  const Dtype* row = data + blockIdx.x * dim;
+  const int item_label = static_cast<int>(label[blockIdx.x]);
+  const Dtype label_value = row[item_label];
+  // The counts stay exact in Dtype up to 2^24 outputs.
+  Dtype rank = 0;
+  for (int j = threadIdx.x; j < dim; j += kAccuracyThreads) {
+    rank += row[j] > label_value || (row[j] == label_value && j < item_label);
+  }
+  rank = accuracy_block_sum(rank, buffer);
+  if (threadIdx.x == 0) {
+    Dtype* stats = item_stats + blockIdx.x * 3;
+    stats[0] = rank == 0;
+    stats[1] = -log(max(label_value, log_threshold));
+    stats[2] = rank < top_k;
+  }
+}
+
+// One block: sets top to the means of the stats of the num items, the
+// accuracy, the loss and, with top_k > 1, the top-k accuracy.
+template <typename Dtype>
+__global__ void kernel_accuracy_mean(const int num, const Dtype* item_stats,
+    const int top_k, Dtype* top) {
+  __shared__ Dtype buffer[kAccuracyThreads];
+  for (int k = 0; k < (top_k > 1 ? 3 : 2); ++k) {
+    Dtype sum = 0;
+    for (int i = threadIdx.x; i < num; i += kAccuracyThreads) {
+      sum += item_stats[i * 3 + k];
+    }
+    sum = accuracy_block_sum(sum, buffer);
+    if (threadIdx.x == 0) {
+      top[k] = sum / num;
+    }
+  }
+}
+
+template <typename Dtype>
+Dtype AccuracyLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+    vector<Blob<Dtype>*>* top) {
+  const int num = bottom[0]->num();
+  const int dim = bottom[0]->count() / num;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  kernel_accuracy_items<Dtype><<<num, kAccuracyThreads>>>(
+      dim, bottom[0]->gpu_data(), bottom[1]->gpu_data(), top_k_,
+      Dtype(kLOG_THRESHOLD), item_stats_.mutable_gpu_data());
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  kernel_accuracy_mean<Dtype><<<1, kAccuracyThreads>>>(
+      num, item_stats_.gpu_data(), top_k_, (*top)[0]->mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+  // Accuracy layer should not be used as a loss function.
+  return Dtype(0);
+}
+
+INSTANTIATE_CLASS(AccuracyLayer);
+
+}  // namespace caffe
@@ -44,6 +44,13 @@ void ConcatLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
   CHECK_EQ(count_, (*top)[0]->count());
 }
 
+template <typename Dtype>
+void ConcatLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top) {
+  // SetUp only derives the shape of the top.
+  SetUp(bottom, top);
+}
+
 template <typename Dtype>
 Dtype ConcatLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
@@ -53,7 +60,12 @@ Dtype ConcatLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     for (int i = 0; i < bottom.size(); ++i) {
       const Dtype* bottom_data = bottom[i]->cpu_data();
       int num_elem = bottom[i]->count();
-      caffe_copy(num_elem, bottom_data, top_data+(*top)[0]->offset(offset_num));
+      // A bottom that is a view into the top (see
+      // NetParameter.zero_copy_concat) is in place already.
+      if (bottom_data != top_data + (*top)[0]->offset(offset_num)) {
+        caffe_copy(num_elem, bottom_data,
+          top_data + (*top)[0]->offset(offset_num));
+      }
       offset_num += bottom[i]->num();
     }
   } else if (concat_dim_ == 1) {
@@ -63,8 +75,11 @@ Dtype ConcatLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       int num_elem =
         bottom[i]->channels()*bottom[i]->height()*bottom[i]->width();
       for (int n = 0; n < num_; ++n) {
-        caffe_copy(num_elem, bottom_data+bottom[i]->offset(n),
-          top_data+(*top)[0]->offset(n, offset_channel));
+        if (bottom_data + bottom[i]->offset(n) !=
+            top_data + (*top)[0]->offset(n, offset_channel)) {
+          caffe_copy(num_elem, bottom_data+bottom[i]->offset(n),
+            top_data+(*top)[0]->offset(n, offset_channel));
+        }
       }
       offset_channel += bottom[i]->channels();
     }  // concat_dim_ is guaranteed to be 0 or 1 by SetUp.
@@ -75,14 +90,19 @@ Dtype ConcatLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
 template <typename Dtype>
 void ConcatLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
   const Dtype* top_diff = top[0]->cpu_diff();
   if (concat_dim_ == 0) {
     int offset_num = 0;
     for (int i = 0; i < bottom->size(); ++i) {
       Blob<Dtype>* blob = (*bottom)[i];
       Dtype* bottom_diff = blob->mutable_cpu_diff();
-      caffe_copy(blob->count(),
-        top_diff+top[0]->offset(offset_num), bottom_diff);
+      if (bottom_diff != top_diff + top[0]->offset(offset_num)) {
+        caffe_copy(blob->count(),
+          top_diff+top[0]->offset(offset_num), bottom_diff);
+      }
       offset_num += blob->num();
     }
   } else if (concat_dim_ == 1) {
@@ -92,8 +112,11 @@ void ConcatLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       Dtype* bottom_diff = blob->mutable_cpu_diff();
       int num_elem = blob->channels()*blob->height()*blob->width();
       for (int n = 0; n < num_; ++n) {
-        caffe_copy(num_elem, top_diff+top[0]->offset(n, offset_channel),
-          bottom_diff+blob->offset(n));
+        if (bottom_diff + blob->offset(n) !=
+            top_diff + top[0]->offset(n, offset_channel)) {
+          caffe_copy(num_elem, top_diff+top[0]->offset(n, offset_channel),
+            bottom_diff+blob->offset(n));
+        }
       }
       offset_channel += blob->channels();
     }
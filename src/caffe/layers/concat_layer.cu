@@ -16,8 +16,12 @@ Dtype ConcatLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
     int offset_num = 0;
     for (int i = 0; i < bottom.size(); ++i) {
       const Dtype* bottom_data = bottom[i]->gpu_data();
-      caffe_gpu_copy(bottom[i]->count(), bottom_data,
-        top_data + (*top)[0]->offset(offset_num));
+      // A bottom that is a view into the top (see
+      // NetParameter.zero_copy_concat) is in place already.
+      if (bottom_data != top_data + (*top)[0]->offset(offset_num)) {
+        caffe_gpu_copy(bottom[i]->count(), bottom_data,
+          top_data + (*top)[0]->offset(offset_num));
+      }
       offset_num += bottom[i]->num();
     }
   } else if (concat_dim_ == 1) {
@@ -27,8 +31,11 @@ Dtype ConcatLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       int num_elem =
         bottom[i]->channels() * bottom[i]->height() * bottom[i]->width();
       for (int n = 0; n < num_; ++n) {
-        caffe_gpu_copy(num_elem, bottom_data+bottom[i]->offset(n),
-          top_data + (*top)[0]->offset(n, offset_channel));
+        if (bottom_data + bottom[i]->offset(n) !=
+            top_data + (*top)[0]->offset(n, offset_channel)) {
+          caffe_gpu_copy(num_elem, bottom_data+bottom[i]->offset(n),
+            top_data + (*top)[0]->offset(n, offset_channel));
+        }
       }
       offset_channel += bottom[i]->channels();
     }
@@ -42,14 +49,19 @@ Dtype ConcatLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
 template <typename Dtype>
 void ConcatLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
   const Dtype* top_diff = top[0]->gpu_diff();
   if (concat_dim_ == 0) {
     int offset_num = 0;
     for (int i = 0; i < bottom->size(); ++i) {
       Blob<Dtype>* blob = (*bottom)[i];
       Dtype* bottom_diff = blob->mutable_gpu_diff();
-      caffe_gpu_copy(blob->count(),
-        top_diff + top[0]->offset(offset_num), bottom_diff);
+      if (bottom_diff != top_diff + top[0]->offset(offset_num)) {
+        caffe_gpu_copy(blob->count(),
+          top_diff + top[0]->offset(offset_num), bottom_diff);
+      }
       offset_num += blob->num();
     }
   } else if (concat_dim_ == 1) {
@@ -59,8 +71,12 @@ void ConcatLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
       Dtype* bottom_diff = blob->mutable_gpu_diff();
       int num_elem = blob->channels()*blob->height()*blob->width();
       for (int n = 0; n < num_; ++n) {
-        caffe_gpu_copy(num_elem, top_diff + top[0]->offset(n, offset_channel),
-          bottom_diff + blob->offset(n));
+        if (bottom_diff + blob->offset(n) !=
+            top_diff + top[0]->offset(n, offset_channel)) {
+          caffe_gpu_copy(num_elem,
+            top_diff + top[0]->offset(n, offset_channel),
+            bottom_diff + blob->offset(n));
+        }
       }
       offset_channel += blob->channels();
     }
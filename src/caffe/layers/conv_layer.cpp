@@ -1,12 +1,22 @@
 // Copyright 2014 BVLC and contributors.
 
+#include <algorithm>
+#include <sstream>
+#include <string>
 #include <vector>
 
 #include "caffe/layer.hpp"
 #include "caffe/vision_layers.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/cpu_threads.hpp"
+#include "caffe/util/depthwise_conv.hpp"
+#include "caffe/util/engine_cache.hpp"
 #include "caffe/util/im2col.hpp"
+#include "caffe/util/winograd.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/quantize.hpp"
+#include "caffe/util/window_shape.hpp"
 
 namespace caffe {
 
@@ -15,10 +25,17 @@ void ConvolutionLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
   CHECK_EQ(bottom.size(), 1) << "Conv Layer takes a single blob as input.";
   CHECK_EQ(top->size(), 1) << "Conv Layer takes a single blob as output.";
-  kernel_size_ = this->layer_param_.convolution_param().kernel_size();
-  stride_ = this->layer_param_.convolution_param().stride();
+  const WindowShape shape =
+      GetWindowShape(this->layer_param_.convolution_param());
+  kernel_h_ = shape.kernel_h;
+  kernel_w_ = shape.kernel_w;
+  stride_h_ = shape.stride_h;
+  stride_w_ = shape.stride_w;
+  pad_h_ = shape.pad_h;
+  pad_w_ = shape.pad_w;
+  CHECK_GT(kernel_h_, 0);
+  CHECK_GT(kernel_w_, 0);
   group_ = this->layer_param_.convolution_param().group();
-  pad_ = this->layer_param_.convolution_param().pad();
   num_ = bottom[0]->num();
   channels_ = bottom[0]->channels();
   height_ = bottom[0]->height();
@@ -27,20 +44,59 @@ void ConvolutionLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
   CHECK_GT(num_output_, 0);
   CHECK_EQ(channels_ % group_, 0);
   // The im2col result buffer would only hold one image at a time to avoid
-  // overly large memory usage.
-  int height_out = (height_ + 2 * pad_ - kernel_size_) / stride_ + 1;
-  int width_out = (width_ + 2 * pad_ - kernel_size_) / stride_ + 1;
-  col_buffer_.Reshape(
-      1, channels_ * kernel_size_ * kernel_size_, height_out, width_out);
+  // overly large memory usage. A 1x1 convolution needs none: its columns are
+  // the image itself.
+  int height_out = (height_ + 2 * pad_h_ - kernel_h_) / stride_h_ + 1;
+  int width_out = (width_ + 2 * pad_w_ - kernel_w_) / stride_w_ + 1;
+  is_1x1_ = kernel_h_ == 1 && kernel_w_ == 1 && stride_h_ == 1 &&
+      stride_w_ == 1 && pad_h_ == 0 && pad_w_ == 0;
+  if (!is_1x1_) {
+    col_buffer_.Reshape(
+        1, channels_ * kernel_h_ * kernel_w_, height_out, width_out);
+  }
   // Set the parameters
   CHECK_EQ(num_output_ % group_, 0)
       << "Number of output should be multiples of group.";
   bias_term_ = this->layer_param_.convolution_param().bias_term();
+  fused_relu_ = this->layer_param_.convolution_param().fused_relu();
+  int8_ = this->layer_param_.quantization_param().precision() ==
+      QuantizationParameter_Precision_INT8;
+  int8_bottom_range_ = this->layer_param_.quantization_param().bottom_range();
+  int8_weights_.reset();
   // Figure out the dimensions for individual gemms.
   M_ = num_output_ / group_;
-  K_ = channels_ * kernel_size_ * kernel_size_ / group_;
+  K_ = channels_ * kernel_h_ * kernel_w_ / group_;
   N_ = height_out * width_out;
   (*top)[0]->Reshape(bottom[0]->num(), num_output_, height_out, width_out);
+  // Forward_cpu may unroll several images at once, and on several threads,
+  // in buffers of their own (shaped by Forward_cpu) so that the GPU does not
+  // allocate them.
+  cpu_batch_size_ = std::min<int>(num_,
+      this->layer_param_.convolution_param().cpu_batch_size());
+  CHECK_GT(cpu_batch_size_, 0) << "cpu_batch_size must be positive";
+  // The kept columns are laid out image by image, not batch by batch.
+  keep_columns_ = this->layer_param_.convolution_param().keep_columns() &&
+      !is_1x1_;
+  if (keep_columns_) {
+    cpu_batch_size_ = 1;
+  }
+  engine_ = this->layer_param_.convolution_param().engine();
+  const bool winograd_shape = kernel_h_ == 3 && kernel_w_ == 3 &&
+      stride_h_ == 1 && stride_w_ == 1 && pad_h_ == pad_w_;
+  if (engine_ == ConvolutionParameter_Engine_WINOGRAD) {
+    CHECK(winograd_shape)
+        << "The WINOGRAD engine only computes 3x3 convolutions of stride 1 "
+        << "with the same padding of the height and width.";
+  }
+  // Unless asked for the WINOGRAD engine or INT8, a depthwise layer needs
+  // no tuning: its kernels do the least work.
+  depthwise_ = group_ == channels_ && group_ > 1 && !int8_ &&
+      engine_ != ConvolutionParameter_Engine_WINOGRAD;
+  if (depthwise_) {
+    engine_ = ConvolutionParameter_Engine_IM2COL;
+    keep_columns_ = false;
+    cpu_batch_size_ = 1;
+  }
   // Check if we need to set up the weights
   if (this->blobs_.size() > 0) {
     LOG(INFO) << "Skipping parameter initialization";
@@ -52,7 +108,7 @@ void ConvolutionLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
     }
     // Intialize the weight
     this->blobs_[0].reset(new Blob<Dtype>(
-        num_output_, channels_ / group_, kernel_size_, kernel_size_));
+        num_output_, channels_ / group_, kernel_h_, kernel_w_));
     // fill the weights
     shared_ptr<Filler<Dtype> > weight_filler(GetFiller<Dtype>(
         this->layer_param_.convolution_param().weight_filler()));
@@ -65,44 +121,363 @@ void ConvolutionLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
       bias_filler->Fill(this->blobs_[1].get());
     }
   }
-  // Set up the bias filler
+  // Set up the bias filler, long enough for the images convolved at once.
+  bias_multiplier_.reset();
   if (bias_term_) {
-    bias_multiplier_.reset(new SyncedMemory(N_ * sizeof(Dtype)));
-    Dtype* bias_multiplier_data =
-        reinterpret_cast<Dtype*>(bias_multiplier_->mutable_cpu_data());
-    for (int i = 0; i < N_; ++i) {
-        bias_multiplier_data[i] = 1.;
+    ReserveBiasMultiplier(cpu_batch_size_ * N_);
+  }
+  if (engine_ == ConvolutionParameter_Engine_AUTO) {
+    engine_ = winograd_shape ? TuneEngine(bottom, top) :
+        ConvolutionParameter_Engine_IM2COL;
+  }
+  if (engine_ == ConvolutionParameter_Engine_WINOGRAD) {
+    const int num_tiles = winograd_tiles(height_out) *
+        winograd_tiles(width_out);
+    winograd_weights_.Reshape(16, num_output_, channels_ / group_, 1);
+    winograd_input_.Reshape(16, channels_, num_tiles, 1);
+    winograd_output_.Reshape(16, num_output_, num_tiles, 1);
+    keep_columns_ = false;
+  }
+  if (keep_columns_) {
+    kept_col_buffer_.Reshape(num_, channels_ * kernel_h_ * kernel_w_,
+        height_out, width_out);
+    LOG(INFO) << this->layer_param_.name() << ": keeping the columns of the "
+        << "batch takes " << kept_col_buffer_.count() * sizeof(Dtype)
+        << " bytes";
+  }
+}
+
+template <typename Dtype>
+void ConvolutionLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top) {
+  CHECK_EQ(bottom[0]->channels(), channels_);
+  num_ = bottom[0]->num();
+  // Inputs of another height and width give outputs of another height and
+  // width, the buffers sized by them following. The engine stays the one
+  // SetUp chose.
+  if (bottom[0]->height() != height_ || bottom[0]->width() != width_) {
+    height_ = bottom[0]->height();
+    width_ = bottom[0]->width();
+    const int height_out = (height_ + 2 * pad_h_ - kernel_h_) / stride_h_ + 1;
+    const int width_out = (width_ + 2 * pad_w_ - kernel_w_) / stride_w_ + 1;
+    CHECK_GT(height_out, 0) << "The input is smaller than the kernel.";
+    CHECK_GT(width_out, 0) << "The input is smaller than the kernel.";
+    N_ = height_out * width_out;
+    if (!is_1x1_) {
+      col_buffer_.Reshape(
+          1, channels_ * kernel_h_ * kernel_w_, height_out, width_out);
     }
+    (*top)[0]->Reshape(num_, num_output_, height_out, width_out);
+    if (engine_ == ConvolutionParameter_Engine_WINOGRAD) {
+      const int num_tiles = winograd_tiles(height_out) *
+          winograd_tiles(width_out);
+      winograd_input_.Reshape(16, channels_, num_tiles, 1);
+      winograd_output_.Reshape(16, num_output_, num_tiles, 1);
+    }
+    // The INT8 buffers are made again for N_ by the next pass.
+    int8_weights_.reset();
+  }
+  (*top)[0]->Reshape(num_, num_output_, (*top)[0]->height(),
+      (*top)[0]->width());
+  // The engine tuned for the num SetUp saw is kept, as is the single image
+  // at a time of kept columns.
+  if ((!this->layer_param_.convolution_param().keep_columns() || is_1x1_) &&
+      !depthwise_) {
+    cpu_batch_size_ = std::min<int>(num_,
+        this->layer_param_.convolution_param().cpu_batch_size());
+  }
+  if (bias_term_) {
+    ReserveBiasMultiplier(cpu_batch_size_ * N_);
+  }
+  if (keep_columns_) {
+    kept_col_buffer_.Reshape(num_, channels_ * kernel_h_ * kernel_w_,
+        (*top)[0]->height(), (*top)[0]->width());
   }
 }
 
+template <typename Dtype>
+void ConvolutionLayer<Dtype>::ReserveBiasMultiplier(const int count) {
+  if (bias_multiplier_ && bias_multiplier_->size() >= count * sizeof(Dtype)) {
+    return;
+  }
+  bias_multiplier_.reset(new SyncedMemory(count * sizeof(Dtype)));
+  Dtype* bias_multiplier_data =
+      reinterpret_cast<Dtype*>(bias_multiplier_->mutable_cpu_data());
+  for (int i = 0; i < count; ++i) {
+      bias_multiplier_data[i] = 1.;
+  }
+}
+
+template <typename Dtype>
+ConvolutionParameter_Engine ConvolutionLayer<Dtype>::TuneEngine(
+      const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
+  std::ostringstream description;
+  description << "convolution " << sizeof(Dtype) << " " << num_ << " "
+      << channels_ << " " << height_ << " " << width_ << " " << num_output_
+      << " " << kernel_h_ << " " << kernel_w_ << " " << pad_h_ << " "
+      << pad_w_ << " " << stride_h_ << " " << stride_w_ << " " << group_
+      << " " << cpu_batch_size_;
+  const string key = EngineCacheKey(description.str());
+  int cached_engine;
+  if (LookupEngine(key, &cached_engine) &&
+      ConvolutionParameter_Engine_IsValid(cached_engine)) {
+    return static_cast<ConvolutionParameter_Engine>(cached_engine);
+  }
+  // Each candidate is run by a layer of its own sharing the weights, so that
+  // the buffers of the engines not picked are freed.
+  const ConvolutionParameter_Engine candidates[] = {
+      ConvolutionParameter_Engine_IM2COL,
+      ConvolutionParameter_Engine_WINOGRAD };
+  const int num_candidates = 2;
+  const int kTimedPasses = 3;
+  ConvolutionParameter_Engine best_engine = candidates[0];
+  float best_time = 0;
+  for (int i = 0; i < num_candidates; ++i) {
+    LayerParameter layer_param(this->layer_param_);
+    layer_param.clear_blobs();
+    layer_param.mutable_convolution_param()->set_engine(candidates[i]);
+    ConvolutionLayer<Dtype> layer(layer_param);
+    layer.blobs() = this->blobs_;
+    layer.SetUp(bottom, top);
+    // The first pass allocates the buffers and is not timed.
+    layer.Forward(bottom, top);
+    Timer timer;
+    timer.Start();
+    for (int pass = 0; pass < kTimedPasses; ++pass) {
+      layer.Forward(bottom, top);
+    }
+    timer.Stop();
+    const float time = timer.MilliSeconds() / kTimedPasses;
+    LOG(INFO) << this->layer_param_.name() << ": "
+        << ConvolutionParameter_Engine_Name(candidates[i]) << " takes "
+        << time << " ms";
+    if (i == 0 || time < best_time) {
+      best_engine = candidates[i];
+      best_time = time;
+    }
+  }
+  LOG(INFO) << this->layer_param_.name() << ": using the "
+      << ConvolutionParameter_Engine_Name(best_engine) << " engine";
+  StoreEngine(key, best_engine);
+  return best_engine;
+}
+
 
 template <typename Dtype>
 Dtype ConvolutionLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
+  if (int8_) {
+    return Int8Forward_cpu(bottom, top);
+  }
+  if (engine_ == ConvolutionParameter_Engine_WINOGRAD) {
+    return WinogradForward_cpu(bottom, top);
+  }
+  if (depthwise_) {
+    return DepthwiseForward_cpu(bottom, top);
+  }
+  // The data is made available on the CPU before the threads read it.
   const Dtype* bottom_data = bottom[0]->cpu_data();
   Dtype* top_data = (*top)[0]->mutable_cpu_data();
-  Dtype* col_data = col_buffer_.mutable_cpu_data();
   const Dtype* weight = this->blobs_[0]->cpu_data();
+  if (bias_term_) {
+    this->blobs_[1]->cpu_data();
+    bias_multiplier_->cpu_data();
+  }
+  // The images are convolved cpu_batch_size_ at a time, and the groups of
+  // images split over the threads, each one with its own part of the buffers.
+  const int num_batches = (num_ + cpu_batch_size_ - 1) / cpu_batch_size_;
+  const int num_threads = CpuLayerThreads(num_batches);
+  const int col_size = K_ * group_ * cpu_batch_size_ * N_;
+  const int batch_top_size = num_output_ * cpu_batch_size_ * N_;
+  Dtype* col_data = NULL;
+  if (is_1x1_ && cpu_batch_size_ == 1) {
+    // The images are multiplied as they are.
+  } else if (keep_columns_) {
+    // Each image has its own columns.
+    col_data = kept_col_buffer_.mutable_cpu_data();
+  } else if (num_threads == 1 && cpu_batch_size_ == 1) {
+    col_data = col_buffer_.mutable_cpu_data();
+  } else {
+    batch_col_buffer_.Reshape(num_threads, K_ * group_, cpu_batch_size_, N_);
+    col_data = batch_col_buffer_.mutable_cpu_data();
+  }
+  Dtype* batch_top_data = NULL;
+  if (cpu_batch_size_ > 1) {
+    batch_top_buffer_.Reshape(num_threads, num_output_, cpu_batch_size_, N_);
+    batch_top_data = batch_top_buffer_.mutable_cpu_data();
+  }
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int batch = 0; batch < num_batches; ++batch) {
+    SerialBlasScope serial_blas(num_threads > 1);
+    const int thread_id = CpuThreadId();
+    const int n = batch * cpu_batch_size_;
+    ForwardImages_cpu(bottom_data + bottom[0]->offset(n), weight,
+        std::min(cpu_batch_size_, num_ - n), col_data + (keep_columns_ ?
+        kept_col_buffer_.offset(n) : col_size * thread_id),
+        batch_top_data ? batch_top_data + batch_top_size * thread_id : NULL,
+        top_data + (*top)[0]->offset(n));
+  }
+  return Dtype(0.);
+}
+
+template <typename Dtype>
+void ConvolutionLayer<Dtype>::ForwardImages_cpu(const Dtype* bottom_data,
+      const Dtype* weight, const int batch_size, Dtype* col_data,
+      Dtype* batch_top_data, Dtype* top_data) {
   int weight_offset = M_ * K_;
-  int col_offset = K_ * N_;
-  int top_offset = M_ * N_;
+  // First, im2col, with the columns of the images side by side
+  const int batch_N = batch_size * N_;
+  const Dtype* columns = bottom_data;
+  if (!is_1x1_ || batch_size > 1) {
+    im2col_batch_cpu(bottom_data, batch_size, channels_, height_, width_,
+        kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_,
+        col_data);
+    columns = col_data;
+  }
+  // Second, innerproduct with groups, straight into the top for one image
+  Dtype* output = batch_top_data ? batch_top_data : top_data;
+  for (int g = 0; g < group_; ++g) {
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, batch_N, K_,
+      (Dtype)1., weight + weight_offset * g, columns + K_ * batch_N * g,
+      (Dtype)0., output + M_ * batch_N * g);
+  }
+  // third, add bias and apply the ReLU, on the output still in the cache
+  if (bias_term_ || fused_relu_) {
+    caffe_cpu_add_bias(1, num_output_, batch_N,
+        bias_term_ ? this->blobs_[1]->cpu_data() : NULL, fused_relu_,
+        output);
+  }
+  if (batch_top_data) {
+    // The outputs are laid out channel by channel, with the images side by
+    // side; the top holds them image by image.
+    for (int b = 0; b < batch_size; ++b) {
+      for (int c = 0; c < num_output_; ++c) {
+        caffe_copy(N_, batch_top_data + c * batch_N + b * N_,
+            top_data + (b * num_output_ + c) * N_);
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+Dtype ConvolutionLayer<Dtype>::DepthwiseForward_cpu(
+      const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  Dtype* top_data = (*top)[0]->mutable_cpu_data();
+  const Dtype* weight = this->blobs_[0]->cpu_data();
+  const Dtype* bias = bias_term_ ? this->blobs_[1]->cpu_data() : NULL;
+  const int num_threads = CpuLayerThreads(num_);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int n = 0; n < num_; ++n) {
+    depthwise_conv_forward_cpu(bottom_data + bottom[0]->offset(n), 1,
+        channels_, height_, width_, M_, kernel_h_, kernel_w_, pad_h_, pad_w_,
+        stride_h_, stride_w_, (*top)[0]->height(), (*top)[0]->width(),
+        weight, bias, fused_relu_, top_data + (*top)[0]->offset(n));
+  }
+  return Dtype(0.);
+}
+
+template <typename Dtype>
+Dtype ConvolutionLayer<Dtype>::WinogradForward_cpu(
+      const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  Dtype* top_data = (*top)[0]->mutable_cpu_data();
+  Dtype* weights = winograd_weights_.mutable_cpu_data();
+  Dtype* input = winograd_input_.mutable_cpu_data();
+  Dtype* output = winograd_output_.mutable_cpu_data();
+  const Dtype* bias = bias_term_ ? this->blobs_[1]->cpu_data() : NULL;
+  const int channels_per_group = channels_ / group_;
+  const int num_tiles = winograd_input_.height();
+  winograd_transform_weights_cpu(this->blobs_[0]->cpu_data(), num_output_,
+      channels_per_group, weights);
+  for (int n = 0; n < num_; ++n) {
+    winograd_transform_input_cpu(bottom_data + bottom[0]->offset(n),
+        channels_, height_, width_, pad_h_, input);
+    // One product per element of the tiles and group
+    for (int i = 0; i < 16; ++i) {
+      for (int g = 0; g < group_; ++g) {
+        caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, num_tiles,
+            channels_per_group, (Dtype)1.,
+            weights + winograd_weights_.offset(i, g * M_),
+            input + winograd_input_.offset(i, g * channels_per_group),
+            (Dtype)0., output + winograd_output_.offset(i, g * M_));
+      }
+    }
+    winograd_transform_output_cpu(output, num_output_,
+        (*top)[0]->height(), (*top)[0]->width(), bias,
+        top_data + (*top)[0]->offset(n));
+    if (fused_relu_) {
+      caffe_cpu_add_bias<Dtype>(1, num_output_, N_, NULL, true,
+          top_data + (*top)[0]->offset(n));
+    }
+  }
+  return Dtype(0.);
+}
+
+template <typename Dtype>
+Dtype ConvolutionLayer<Dtype>::Int8Forward_cpu(
+      const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  Dtype* top_data = (*top)[0]->mutable_cpu_data();
+  const Dtype* bias = bias_term_ ? this->blobs_[1]->cpu_data() : NULL;
+  const int num_threads = CpuLayerThreads(num_);
+  if (!int8_weights_) {
+    int8_weights_.reset(new SyncedMemory(num_output_ * K_ * sizeof(int8_t)));
+    int8_weight_scales_.reset(new SyncedMemory(num_output_ * sizeof(Dtype)));
+    caffe_cpu_quantize_rows(num_output_, K_, this->blobs_[0]->cpu_data(),
+        reinterpret_cast<int8_t*>(int8_weights_->mutable_cpu_data()),
+        reinterpret_cast<Dtype*>(int8_weight_scales_->mutable_cpu_data()));
+    int8_columns_.reset(
+        new SyncedMemory(num_threads * N_ * K_ * sizeof(int8_t)));
+    int8_products_.reset(
+        new SyncedMemory(num_threads * M_ * N_ * sizeof(int32_t)));
+  }
+  const int8_t* weights =
+      reinterpret_cast<const int8_t*>(int8_weights_->cpu_data());
+  const Dtype* weight_scales =
+      reinterpret_cast<const Dtype*>(int8_weight_scales_->cpu_data());
+  int8_t* columns =
+      reinterpret_cast<int8_t*>(int8_columns_->mutable_cpu_data());
+  int32_t* products =
+      reinterpret_cast<int32_t*>(int8_products_->mutable_cpu_data());
+  const Dtype bottom_scale = (int8_bottom_range_ > 0 ? int8_bottom_range_ :
+      caffe_cpu_amax(bottom[0]->count(), bottom_data)) / 127;
+  Dtype* col_data = NULL;
+  if (!is_1x1_) {
+    batch_col_buffer_.Reshape(num_threads, K_ * group_, 1, N_);
+    col_data = batch_col_buffer_.mutable_cpu_data();
+  }
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
   for (int n = 0; n < num_; ++n) {
-    // First, im2col
-    im2col_cpu(bottom_data + bottom[0]->offset(n), channels_, height_,
-                      width_, kernel_size_, pad_, stride_, col_data);
-    // Second, innerproduct with groups
+    const int thread_id = CpuThreadId();
+    const Dtype* image_columns = bottom_data + bottom[0]->offset(n);
+    if (!is_1x1_) {
+      Dtype* thread_col_data = col_data + batch_col_buffer_.offset(thread_id);
+      im2col_cpu(image_columns, channels_, height_, width_, kernel_h_,
+          kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_, thread_col_data);
+      image_columns = thread_col_data;
+    }
+    int8_t* thread_columns = columns + N_ * K_ * thread_id;
+    int32_t* thread_products = products + M_ * N_ * thread_id;
+    Dtype* image_top = top_data + (*top)[0]->offset(n);
     for (int g = 0; g < group_; ++g) {
-      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, N_, K_,
-        (Dtype)1., weight + weight_offset * g, col_data + col_offset * g,
-        (Dtype)0., top_data + (*top)[0]->offset(n) + top_offset * g);
+      // The columns of the group, N_ x K_, to be read along K_ as the weights
+      caffe_cpu_quantize_transpose(K_, N_, image_columns + K_ * N_ * g,
+          bottom_scale, thread_columns);
+      caffe_cpu_gemm_s8(M_, N_, K_, weights + M_ * K_ * g, thread_columns,
+          thread_products);
+      caffe_cpu_dequantize(M_, N_, thread_products, bottom_scale,
+          weight_scales + M_ * g, static_cast<const Dtype*>(NULL),
+          image_top + M_ * N_ * g);
     }
-    // third, add bias
-    if (bias_term_) {
-      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, num_output_,
-          N_, 1, (Dtype)1., this->blobs_[1]->cpu_data(),
-          reinterpret_cast<const Dtype*>(bias_multiplier_->cpu_data()),
-          (Dtype)1., top_data + (*top)[0]->offset(n));
+    if (bias_term_ || fused_relu_) {
+      caffe_cpu_add_bias(1, num_output_, N_, bias, fused_relu_, image_top);
     }
   }
   return Dtype(0.);
@@ -111,19 +486,37 @@ Dtype ConvolutionLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
 template <typename Dtype>
 void ConvolutionLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
+  CHECK(!int8_) << "A layer with INT8 precision has no backward pass.";
+  if (fused_relu_) {
+    // The ReLU backward pass, in place like the ReLU layer it replaces
+    caffe_cpu_relu_mask(top[0]->count(), top[0]->cpu_data(),
+        top[0]->mutable_cpu_diff());
+  }
   const Dtype* top_diff = top[0]->cpu_diff();
   const Dtype* weight = this->blobs_[0]->cpu_data();
   Dtype* weight_diff = this->blobs_[0]->mutable_cpu_diff();
   const Dtype* bottom_data = (*bottom)[0]->cpu_data();
   Dtype* bottom_diff = (*bottom)[0]->mutable_cpu_diff();
-  Dtype* col_data = col_buffer_.mutable_cpu_data();
-  Dtype* col_diff = col_buffer_.mutable_cpu_diff();
+  // A 1x1 convolution multiplies the bottom as it is, and its gradient goes
+  // straight to the bottom diff.
+  Dtype* col_buffer_data = NULL;
+  Dtype* col_diff = NULL;
+  if (!is_1x1_ && !depthwise_) {
+    if (!keep_columns_) {
+      col_buffer_data = col_buffer_.mutable_cpu_data();
+    }
+    col_diff = col_buffer_.mutable_cpu_diff();
+  }
+  // The parameters with a learning rate of 0 get no gradient.
+  const bool weight_propagate_down = this->param_propagate_down(0);
   // bias gradient if necessary
   Dtype* bias_diff = NULL;
 
-  if (bias_term_) {
+  if (bias_term_ && this->param_propagate_down(1)) {
     bias_diff = this->blobs_[1]->mutable_cpu_diff();
-    memset(bias_diff, 0, sizeof(Dtype) * this->blobs_[1]->count());
+    if (!this->accumulate_param_diffs_) {
+      memset(bias_diff, 0, sizeof(Dtype) * this->blobs_[1]->count());
+    }
     for (int n = 0; n < num_; ++n) {
       caffe_cpu_gemv<Dtype>(CblasNoTrans, num_output_, N_,
           1., top_diff + top[0]->offset(n),
@@ -132,21 +525,59 @@ void ConvolutionLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     }
   }
 
+  if (weight_propagate_down && !this->accumulate_param_diffs_) {
+    memset(weight_diff, 0, sizeof(Dtype) * this->blobs_[0]->count());
+  }
+  if (depthwise_) {
+    if (weight_propagate_down) {
+      depthwise_conv_backward_weight_cpu(bottom_data, top_diff, num_,
+          channels_, height_, width_, M_, kernel_h_, kernel_w_, pad_h_,
+          pad_w_, stride_h_, stride_w_, top[0]->height(), top[0]->width(),
+          weight_diff);
+    }
+    if (propagate_down) {
+      const int num_threads = CpuLayerThreads(num_);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+      for (int n = 0; n < num_; ++n) {
+        depthwise_conv_backward_bottom_cpu(top_diff + top[0]->offset(n), 1,
+            channels_, height_, width_, M_, kernel_h_, kernel_w_, pad_h_,
+            pad_w_, stride_h_, stride_w_, top[0]->height(), top[0]->width(),
+            weight, this->accumulate_bottom_diffs_,
+            bottom_diff + (*bottom)[0]->offset(n));
+      }
+    }
+    return;
+  }
   int weight_offset = M_ * K_;
   int col_offset = K_ * N_;
   int top_offset = M_ * N_;
-  memset(weight_diff, 0, sizeof(Dtype) * this->blobs_[0]->count());
+  // The col diff of a 1x1 convolution is the bottom diff, which may be added
+  // to (see Layer::accumulate_bottom_diffs).
+  const Dtype col_diff_beta = this->accumulate_bottom_diffs_ ? 1 : 0;
   for (int n = 0; n < num_; ++n) {
-    // since we saved memory in the forward pass by not storing all col data,
-    // we will need to recompute them.
-    im2col_cpu(bottom_data + (*bottom)[0]->offset(n), channels_, height_,
-                      width_, kernel_size_, pad_, stride_, col_data);
+    // Unless the forward pass kept the col data of all the images, we will
+    // need to recompute them.
+    const Dtype* col_data = bottom_data + (*bottom)[0]->offset(n);
+    if (is_1x1_) {
+      col_diff = bottom_diff + (*bottom)[0]->offset(n);
+    } else if (keep_columns_) {
+      col_data = kept_col_buffer_.cpu_data() + kept_col_buffer_.offset(n);
+    } else if (weight_propagate_down) {
+      im2col_cpu(bottom_data + (*bottom)[0]->offset(n), channels_, height_,
+          width_, kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_,
+          col_buffer_data);
+      col_data = col_buffer_data;
+    }
     // gradient w.r.t. weight. Note that we will accumulate diffs.
-    for (int g = 0; g < group_; ++g) {
-      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, M_, K_, N_,
-        (Dtype)1., top_diff + top[0]->offset(n) + top_offset * g,
-        col_data + col_offset * g, (Dtype)1.,
-        weight_diff + weight_offset * g);
+    if (weight_propagate_down) {
+      for (int g = 0; g < group_; ++g) {
+        caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, M_, K_, N_,
+          (Dtype)1., top_diff + top[0]->offset(n) + top_offset * g,
+          col_data + col_offset * g, (Dtype)1.,
+          weight_diff + weight_offset * g);
+      }
     }
     // gradient w.r.t. bottom data, if necessary
     if (propagate_down) {
@@ -154,11 +585,14 @@ void ConvolutionLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
         caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, K_, N_, M_,
           (Dtype)1., weight + weight_offset * g,
           top_diff + top[0]->offset(n) + top_offset * g,
-          (Dtype)0., col_diff + col_offset * g);
+          col_diff_beta, col_diff + col_offset * g);
       }
       // col2im back to the data
-      col2im_cpu(col_diff, channels_, height_, width_, kernel_size_, pad_,
-          stride_, bottom_diff + (*bottom)[0]->offset(n));
+      if (!is_1x1_) {
+        col2im_cpu(col_diff, channels_, height_, width_, kernel_h_,
+            kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_,
+            bottom_diff + (*bottom)[0]->offset(n));
+      }
     }
   }
 }
@@ -4,7 +4,9 @@
 
 #include "caffe/layer.hpp"
 #include "caffe/vision_layers.hpp"
+#include "caffe/util/depthwise_conv.hpp"
 #include "caffe/util/im2col.hpp"
+#include "caffe/util/winograd.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/util/math_functions.hpp"
 
@@ -13,30 +15,104 @@ namespace caffe {
 template <typename Dtype>
 Dtype ConvolutionLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
+  if (engine_ == ConvolutionParameter_Engine_WINOGRAD) {
+    return WinogradForward_gpu(bottom, top);
+  }
+  if (depthwise_) {
+    return DepthwiseForward_gpu(bottom, top);
+  }
   const Dtype* bottom_data = bottom[0]->gpu_data();
   Dtype* top_data = (*top)[0]->mutable_gpu_data();
-  Dtype* col_data = col_buffer_.mutable_gpu_data();
+  Dtype* col_buffer_data = NULL;
+  if (keep_columns_) {
+    col_buffer_data = kept_col_buffer_.mutable_gpu_data();
+  } else if (!is_1x1_) {
+    col_buffer_data = col_buffer_.mutable_gpu_data();
+  }
   const Dtype* weight = this->blobs_[0]->gpu_data();
   int weight_offset = M_ * K_;
   int col_offset = K_ * N_;
   int top_offset = M_ * N_;
   for (int n = 0; n < num_; ++n) {
-    // First, im2col
-    im2col_gpu(bottom_data + bottom[0]->offset(n), channels_, height_,
-                      width_, kernel_size_, pad_, stride_, col_data);
-    // Second, innerproduct with groups
+    // First, im2col, unless the convolution is 1x1 and the image already is
+    // its columns
+    const Dtype* col_data = bottom_data + bottom[0]->offset(n);
+    if (!is_1x1_) {
+      Dtype* image_col_data = col_buffer_data;
+      if (keep_columns_) {
+        image_col_data += kept_col_buffer_.offset(n);
+      }
+      im2col_gpu(bottom_data + bottom[0]->offset(n), channels_, height_,
+          width_, kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_,
+          image_col_data);
+      col_data = image_col_data;
+    }
+    // Second, innerproduct with groups. The GEMMs go to the stream pool to
+    // run at the same time: those of the groups, and of the images too when
+    // there is no im2col, which runs on the default stream and so waits for
+    // the GEMMs of the previous image.
     for (int g = 0; g < group_; ++g) {
+      Caffe::set_cublas_stream(n * group_ + g);
       caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, N_, K_,
         (Dtype)1., weight + weight_offset * g, col_data + col_offset * g,
         (Dtype)0., top_data + (*top)[0]->offset(n) + top_offset * g);
     }
-    // third, add bias
-    if (bias_term_) {
-      caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, num_output_,
-          N_, 1, (Dtype)1., this->blobs_[1]->gpu_data(),
-          reinterpret_cast<const Dtype*>(bias_multiplier_->gpu_data()),
-          (Dtype)1., top_data + (*top)[0]->offset(n));
+  }
+  // third, add bias and apply the ReLU in one kernel, back on the default
+  // stream, which waits for the GEMMs.
+  Caffe::set_cublas_stream(-1);
+  if (bias_term_ || fused_relu_) {
+    caffe_gpu_add_bias(num_, num_output_, N_,
+        bias_term_ ? this->blobs_[1]->gpu_data() : NULL, fused_relu_,
+        top_data);
+  }
+  return Dtype(0.);
+}
+
+template <typename Dtype>
+Dtype ConvolutionLayer<Dtype>::DepthwiseForward_gpu(
+      const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
+  // The whole batch in one kernel
+  depthwise_conv_forward_gpu(bottom[0]->gpu_data(), num_, channels_, height_,
+      width_, M_, kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_,
+      (*top)[0]->height(), (*top)[0]->width(), this->blobs_[0]->gpu_data(),
+      bias_term_ ? this->blobs_[1]->gpu_data() : NULL, fused_relu_,
+      (*top)[0]->mutable_gpu_data());
+  return Dtype(0.);
+}
+
+template <typename Dtype>
+Dtype ConvolutionLayer<Dtype>::WinogradForward_gpu(
+      const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
+  const Dtype* bottom_data = bottom[0]->gpu_data();
+  Dtype* top_data = (*top)[0]->mutable_gpu_data();
+  Dtype* weights = winograd_weights_.mutable_gpu_data();
+  Dtype* input = winograd_input_.mutable_gpu_data();
+  Dtype* output = winograd_output_.mutable_gpu_data();
+  const Dtype* bias = bias_term_ ? this->blobs_[1]->gpu_data() : NULL;
+  const int channels_per_group = channels_ / group_;
+  const int num_tiles = winograd_input_.height();
+  winograd_transform_weights_gpu(this->blobs_[0]->gpu_data(), num_output_,
+      channels_per_group, weights);
+  for (int n = 0; n < num_; ++n) {
+    winograd_transform_input_gpu(bottom_data + bottom[0]->offset(n),
+        channels_, height_, width_, pad_h_, input);
+    // One product per element of the tiles and group
+    for (int i = 0; i < 16; ++i) {
+      for (int g = 0; g < group_; ++g) {
+        caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, num_tiles,
+            channels_per_group, (Dtype)1.,
+            weights + winograd_weights_.offset(i, g * M_),
+            input + winograd_input_.offset(i, g * channels_per_group),
+            (Dtype)0., output + winograd_output_.offset(i, g * M_));
+      }
     }
+    winograd_transform_output_gpu(output, num_output_,
+        (*top)[0]->height(), (*top)[0]->width(), bias,
+        top_data + (*top)[0]->offset(n));
+  }
+  if (fused_relu_) {
+    caffe_gpu_add_bias<Dtype>(num_, num_output_, N_, NULL, true, top_data);
   }
   return Dtype(0.);
 }
@@ -44,20 +120,38 @@ Dtype ConvolutionLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
 template <typename Dtype>
 void ConvolutionLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
+  CHECK(!int8_) << "A layer with INT8 precision has no backward pass.";
+  if (fused_relu_) {
+    // The ReLU backward pass, in place like the ReLU layer it replaces
+    caffe_gpu_relu_mask(top[0]->count(), top[0]->gpu_data(),
+        top[0]->mutable_gpu_diff());
+  }
   const Dtype* top_diff = top[0]->gpu_diff();
   const Dtype* weight = this->blobs_[0]->gpu_data();
   Dtype* weight_diff = this->blobs_[0]->mutable_gpu_diff();
   const Dtype* bottom_data = (*bottom)[0]->gpu_data();
   Dtype* bottom_diff = (*bottom)[0]->mutable_gpu_diff();
-  Dtype* col_data = col_buffer_.mutable_gpu_data();
-  Dtype* col_diff = col_buffer_.mutable_gpu_diff();
+  // A 1x1 convolution multiplies the bottom as it is, and its gradient goes
+  // straight to the bottom diff.
+  Dtype* col_buffer_data = NULL;
+  Dtype* col_diff = NULL;
+  if (!is_1x1_ && !depthwise_) {
+    if (!keep_columns_) {
+      col_buffer_data = col_buffer_.mutable_gpu_data();
+    }
+    col_diff = col_buffer_.mutable_gpu_diff();
+  }
+  // The parameters with a learning rate of 0 get no gradient.
+  const bool weight_propagate_down = this->param_propagate_down(0);
   // bias gradient if necessary
   Dtype* bias_diff = NULL;
 
-  if (bias_term_) {
+  if (bias_term_ && this->param_propagate_down(1)) {
     bias_diff = this->blobs_[1]->mutable_gpu_diff();
-    CUDA_CHECK(cudaMemset(bias_diff, 0,
-        sizeof(Dtype) * this->blobs_[1]->count()));
+    if (!this->accumulate_param_diffs_) {
+      CUDA_CHECK(cudaMemset(bias_diff, 0,
+          sizeof(Dtype) * this->blobs_[1]->count()));
+    }
     for (int n = 0; n < num_; ++n) {
       caffe_gpu_gemv<Dtype>(CblasNoTrans, num_output_, N_,
           1., top_diff + top[0]->offset(n),
@@ -66,36 +160,74 @@ void ConvolutionLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     }
   }
 
+  if (weight_propagate_down && !this->accumulate_param_diffs_) {
+    CUDA_CHECK(cudaMemset(weight_diff, 0,
+        sizeof(Dtype) * this->blobs_[0]->count()));
+  }
+  if (depthwise_) {
+    if (weight_propagate_down) {
+      depthwise_conv_backward_weight_gpu(bottom_data, top_diff, num_,
+          channels_, height_, width_, M_, kernel_h_, kernel_w_, pad_h_,
+          pad_w_, stride_h_, stride_w_, top[0]->height(), top[0]->width(),
+          weight_diff);
+    }
+    if (propagate_down) {
+      depthwise_conv_backward_bottom_gpu(top_diff, num_, channels_, height_,
+          width_, M_, kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_,
+          stride_w_, top[0]->height(), top[0]->width(), weight,
+          this->accumulate_bottom_diffs_, bottom_diff);
+    }
+    return;
+  }
   int weight_offset = M_ * K_;
   int col_offset = K_ * N_;
   int top_offset = M_ * N_;
-  CUDA_CHECK(cudaMemset(weight_diff, 0,
-      sizeof(Dtype) * this->blobs_[0]->count()));
+  // The col diff of a 1x1 convolution is the bottom diff, which may be added
+  // to (see Layer::accumulate_bottom_diffs).
+  const Dtype col_diff_beta = this->accumulate_bottom_diffs_ ? 1 : 0;
   for (int n = 0; n < num_; ++n) {
-    // since we saved memory in the forward pass by not storing all col data,
-    // we will need to recompute them.
-    im2col_gpu(bottom_data + (*bottom)[0]->offset(n), channels_, height_,
-                      width_, kernel_size_, pad_, stride_, col_data);
-    // gradient w.r.t. weight. Note that we will accumulate diffs.
-    for (int g = 0; g < group_; ++g) {
-      caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasTrans, M_, K_, N_,
-        (Dtype)1., top_diff + top[0]->offset(n) + top_offset * g,
-        col_data + col_offset * g, (Dtype)1.,
-        weight_diff + weight_offset * g);
+    // Unless the forward pass kept the col data of all the images, we will
+    // need to recompute them.
+    const Dtype* col_data = bottom_data + (*bottom)[0]->offset(n);
+    if (is_1x1_) {
+      col_diff = bottom_diff + (*bottom)[0]->offset(n);
+    } else if (keep_columns_) {
+      col_data = kept_col_buffer_.gpu_data() + kept_col_buffer_.offset(n);
+    } else if (weight_propagate_down) {
+      im2col_gpu(bottom_data + (*bottom)[0]->offset(n), channels_, height_,
+          width_, kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_,
+          col_buffer_data);
+      col_data = col_buffer_data;
+    }
+    // gradient w.r.t. weight. Note that we will accumulate diffs, so the
+    // GEMMs of a group all go to the same stream of the pool.
+    if (weight_propagate_down) {
+      for (int g = 0; g < group_; ++g) {
+        Caffe::set_cublas_stream(g);
+        caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasTrans, M_, K_, N_,
+          (Dtype)1., top_diff + top[0]->offset(n) + top_offset * g,
+          col_data + col_offset * g, (Dtype)1.,
+          weight_diff + weight_offset * g);
+      }
     }
     // gradient w.r.t. bottom data, if necessary
     if (propagate_down) {
       for (int g = 0; g < group_; ++g) {
+        Caffe::set_cublas_stream(n * group_ + g);
         caffe_gpu_gemm<Dtype>(CblasTrans, CblasNoTrans, K_, N_, M_,
           (Dtype)1., weight + weight_offset * g,
           top_diff + top[0]->offset(n) + top_offset * g,
-          (Dtype)0., col_diff + col_offset * g);
+          col_diff_beta, col_diff + col_offset * g);
+      }
+      // col2im back to the data, on the default stream
+      if (!is_1x1_) {
+        col2im_gpu(col_diff, channels_, height_, width_, kernel_h_,
+            kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_,
+            bottom_diff + (*bottom)[0]->offset(n));
       }
-      // col2im back to the data
-      col2im_gpu(col_diff, channels_, height_, width_, kernel_size_, pad_,
-          stride_, bottom_diff + (*bottom)[0]->offset(n));
     }
   }
+  Caffe::set_cublas_stream(-1);
 }
 
 
@@ -1,121 +1,287 @@
 // Copyright 2014 BVLC and contributors.
 
+#include <cuda_runtime.h>
 #include <stdint.h>
-#include <leveldb/db.h>
 #include <pthread.h>
 
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <algorithm>
 #include <string>
 #include <vector>
 
 #include "caffe/layer.hpp"
+#include "caffe/util/data_transform.hpp"
+#include "caffe/util/db.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/nvtx.hpp"
 #include "caffe/util/rng.hpp"
 #include "caffe/vision_layers.hpp"
 
+using boost::posix_time::microsec_clock;
+using boost::posix_time::ptime;
 using std::string;
 
 namespace caffe {
 
+// The wall clock time since start, in milliseconds: the prefetching and the
+// waits for it are on the host whatever the mode, unlike what Timer measures
+// in GPU mode.
+static double MilliSecondsSince(const ptime& start) {
+  return (microsec_clock::local_time() - start).total_microseconds() / 1000.;
+}
+
+// Moves the cursor n values on, restarting from the first at the end.
+static void AdvanceCursor(const unsigned int n, DBCursor* cursor) {
+  for (unsigned int i = 0; i < n; ++i) {
+    cursor->Next();
+    if (!cursor->valid()) {
+      DLOG(INFO) << "Restarting data prefetching from start.";
+      cursor->SeekToFirst();
+    }
+  }
+}
+
 template <typename Dtype>
-void* DataLayerPrefetch(void* layer_pointer) {
-  CHECK(layer_pointer);
-  DataLayer<Dtype>* layer = static_cast<DataLayer<Dtype>*>(layer_pointer);
+void* DataLayerPrefetchWorker(void* context_pointer) {
+  CHECK(context_pointer);
+  DataLayerPrefetchWorkerContext<Dtype>* context =
+      static_cast<DataLayerPrefetchWorkerContext<Dtype>*>(context_pointer);
+  DataLayer<Dtype>* layer = context->layer;
   CHECK(layer);
+  const int batch_id = context->batch_id;
+  const int worker_id = context->worker_id;
+  context->parse_ms = 0;
+  context->decode_ms = 0;
+  context->transform_ms = 0;
   Datum datum;
-  CHECK(layer->prefetch_data_);
-  Dtype* top_data = layer->prefetch_data_->mutable_cpu_data();
+  // The pixels of encoded datums, reused from one item to the next
+  string decoded;
+  CHECK(layer->prefetch_data_[batch_id]);
+  Dtype* top_data = NULL;
+  if (!layer->gpu_transform_) {
+    top_data = layer->prefetch_data_[batch_id]->mutable_cpu_data();
+  }
   Dtype* top_label;
   if (layer->output_labels_) {
-    top_label = layer->prefetch_label_->mutable_cpu_data();
+    top_label = layer->prefetch_label_[batch_id]->mutable_cpu_data();
   }
   const Dtype scale = layer->layer_param_.data_param().scale();
-  const int batch_size = layer->layer_param_.data_param().batch_size();
   const int crop_size = layer->layer_param_.data_param().crop_size();
   const bool mirror = layer->layer_param_.data_param().mirror();
-
-  if (mirror && crop_size == 0) {
-    LOG(FATAL) << "Current implementation requires mirror and crop_size to be "
-        << "set at the same time.";
-  }
   // datum scales
   const int channels = layer->datum_channels_;
   const int height = layer->datum_height_;
   const int width = layer->datum_width_;
   const int size = layer->datum_size_;
-  const Dtype* mean = layer->data_mean_.cpu_data();
-  for (int item_id = 0; item_id < batch_size; ++item_id) {
-    // get a blob
-    CHECK(layer->iter_);
-    CHECK(layer->iter_->Valid());
-    datum.ParseFromString(layer->iter_->value().ToString());
-    const string& data = datum.data();
+  uint8_t* pixels = NULL;
+  int* crops = NULL;
+  if (layer->gpu_transform_) {
+    pixels = static_cast<uint8_t*>(
+        layer->prefetch_pixels_[batch_id]->mutable_cpu_data());
+    crops = static_cast<int*>(
+        layer->prefetch_crops_[batch_id]->mutable_cpu_data());
+  }
+  // Either mean (the mean image) or mean_values (one per channel) is set.
+  const Dtype* mean = NULL;
+  const Dtype* mean_values = NULL;
+  if (layer->mean_values_.empty()) {
+    mean = layer->data_mean_.cpu_data();
+  } else {
+    mean_values = &layer->mean_values_[0];
+  }
+  for (int item_id = context->item_begin; item_id < context->item_end;
+       ++item_id) {
+    // get a blob, leaving its uint8 data in the serialized value
+    const string& value = layer->prefetch_values_[item_id];
+    const char* data;
+    int data_size;
+    const ptime parse_start = microsec_clock::local_time();
+    CHECK(ParseDatumWithoutData(value.data(), value.size(), &datum, &data,
+                                &data_size));
+    context->parse_ms += MilliSecondsSince(parse_start);
+    if (datum.encoded()) {
+      const ptime decode_start = microsec_clock::local_time();
+      CHECK(DecodeImageToPixels(data, data_size, channels, height, width,
+                                &decoded))
+          << "Could not decode an image of shape " << channels << "x"
+          << height << "x" << width;
+      context->decode_ms += MilliSecondsSince(decode_start);
+      data = decoded.data();
+      data_size = decoded.size();
+    }
+    int h_off = 0;
+    int w_off = 0;
+    bool do_mirror = false;
     if (crop_size) {
-      CHECK(data.size()) << "Image cropping only support uint8 data";
-      int h_off, w_off;
+      CHECK(data_size) << "Image cropping only support uint8 data";
       // We only do random crop when we do training.
       if (layer->phase_ == Caffe::TRAIN) {
-        h_off = layer->PrefetchRand() % (height - crop_size);
-        w_off = layer->PrefetchRand() % (width - crop_size);
+        h_off = layer->PrefetchRand(worker_id) % (height - crop_size);
+        w_off = layer->PrefetchRand(worker_id) % (width - crop_size);
       } else {
         h_off = (height - crop_size) / 2;
         w_off = (width - crop_size) / 2;
       }
-      if (mirror && layer->PrefetchRand() % 2) {
-        // Copy mirrored version
-        for (int c = 0; c < channels; ++c) {
-          for (int h = 0; h < crop_size; ++h) {
-            for (int w = 0; w < crop_size; ++w) {
-              int top_index = ((item_id * channels + c) * crop_size + h)
-                              * crop_size + (crop_size - 1 - w);
-              int data_index = (c * height + h + h_off) * width + w + w_off;
-              Dtype datum_element =
-                  static_cast<Dtype>(static_cast<uint8_t>(data[data_index]));
-              top_data[top_index] = (datum_element - mean[data_index]) * scale;
-            }
-          }
-        }
+      do_mirror = mirror && layer->PrefetchRand(worker_id) % 2;
+    }
+    const ptime transform_start = microsec_clock::local_time();
+    if (layer->gpu_transform_) {
+      // Leave the pixels as they are, to be transformed by Forward_gpu.
+      CHECK_EQ(data_size, size) << "gpu_transform requires uint8 data";
+      memcpy(pixels + item_id * size, data, size);
+      crops[item_id * 3] = h_off;
+      crops[item_id * 3 + 1] = w_off;
+      crops[item_id * 3 + 2] = do_mirror;
+    } else if (crop_size) {
+      Dtype* item_data = top_data + item_id * channels * crop_size * crop_size;
+      if (mean) {
+        TransformImage(reinterpret_cast<const uint8_t*>(data), channels,
+            height, width, h_off, w_off, crop_size, do_mirror, mean, scale,
+            item_data);
       } else {
-        // Normal copy
-        for (int c = 0; c < channels; ++c) {
-          for (int h = 0; h < crop_size; ++h) {
-            for (int w = 0; w < crop_size; ++w) {
-              int top_index = ((item_id * channels + c) * crop_size + h)
-                              * crop_size + w;
-              int data_index = (c * height + h + h_off) * width + w + w_off;
-              Dtype datum_element =
-                  static_cast<Dtype>(static_cast<uint8_t>(data[data_index]));
-              top_data[top_index] = (datum_element - mean[data_index]) * scale;
-            }
-          }
-        }
+        TransformImageMeanValues(reinterpret_cast<const uint8_t*>(data),
+            channels, height, width, h_off, w_off, crop_size, do_mirror,
+            mean_values, scale, item_data);
       }
     } else {
       // we will prefer to use data() first, and then try float_data()
-      if (data.size()) {
-        for (int j = 0; j < size; ++j) {
-          Dtype datum_element =
-              static_cast<Dtype>(static_cast<uint8_t>(data[j]));
-          top_data[item_id * size + j] = (datum_element - mean[j]) * scale;
-        }
+      Dtype* item_data = top_data + item_id * size;
+      if (data_size && mean) {
+        TransformImage(reinterpret_cast<const uint8_t*>(data), channels,
+            height, width, 0, 0, 0, false, mean, scale, item_data);
+      } else if (data_size) {
+        TransformImageMeanValues(reinterpret_cast<const uint8_t*>(data),
+            channels, height, width, 0, 0, 0, false, mean_values, scale,
+            item_data);
       } else {
-        for (int j = 0; j < size; ++j) {
-          top_data[item_id * size + j] =
-              (datum.float_data(j) - mean[j]) * scale;
+        CHECK_EQ(datum.float_data_size(), size)
+            << "The datum has neither data nor float_data of its shape";
+        const float* float_data = datum.float_data().data();
+        if (mean) {
+          TransformFloats(size, float_data, mean, scale, item_data);
+        } else {
+          const int channel_size = height * width;
+          for (int c = 0; c < channels; ++c) {
+            TransformFloatsMeanValue(channel_size,
+                float_data + c * channel_size, mean_values[c], scale,
+                item_data + c * channel_size);
+          }
         }
       }
     }
+    context->transform_ms += MilliSecondsSince(transform_start);
 
     if (layer->output_labels_) {
       top_label[item_id] = datum.label();
     }
-    // go to the next iter
-    layer->iter_->Next();
-    if (!layer->iter_->Valid()) {
-      // We have reached the end. Restart from the first.
-      DLOG(INFO) << "Restarting data prefetching from start.";
-      layer->iter_->SeekToFirst();
+  }
+
+  return static_cast<void*>(NULL);
+}
+
+template <typename Dtype>
+void DataLayerPrefetchBatch(DataLayer<Dtype>* layer, const int batch_id) {
+  CHECK(layer);
+  const int batch_size = layer->layer_param_.data_param().batch_size();
+  const int crop_size = layer->layer_param_.data_param().crop_size();
+  const bool mirror = layer->layer_param_.data_param().mirror();
+
+  if (mirror && crop_size == 0) {
+    LOG(FATAL) << "Current implementation requires mirror and crop_size to be "
+        << "set at the same time.";
+  }
+  // The database cursor is not thread safe, and its values are only valid
+  // until it moves, so the values of the batch are read sequentially here and
+  // only the decoding and transformation are split among the workers.
+  DataLayerStats* stats = &layer->prefetch_stats_[batch_id];
+  const ptime read_start = microsec_clock::local_time();
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    if (layer->shuffled_reader_) {
+      layer->prefetch_values_[item_id] = layer->shuffled_reader_->Next();
+      continue;
     }
+    CHECK(layer->cursor_);
+    CHECK(layer->cursor_->valid());
+    // Reuse the buffer of the previous batch rather than allocating a new
+    // string for every value.
+    layer->prefetch_values_[item_id].assign(layer->cursor_->value_data(),
+                                            layer->cursor_->value_size());
+    // go to the next iter of the shard
+    AdvanceCursor(layer->layer_param_.data_param().num_shards(),
+                  layer->cursor_.get());
+  }
+  stats->read_ms = MilliSecondsSince(read_start);
+  // Worker 0 runs on this thread; the others get a thread each.
+  const int num_workers = layer->prefetch_workers_.size();
+  for (int worker_id = 0; worker_id < num_workers; ++worker_id) {
+    layer->prefetch_workers_[worker_id].batch_id = batch_id;
+  }
+  vector<pthread_t> worker_threads(num_workers);
+  for (int worker_id = 1; worker_id < num_workers; ++worker_id) {
+    CHECK(!pthread_create(&worker_threads[worker_id], NULL,
+          DataLayerPrefetchWorker<Dtype>,
+          static_cast<void*>(&layer->prefetch_workers_[worker_id])))
+        << "Pthread execution failed.";
+  }
+  DataLayerPrefetchWorker<Dtype>(
+      static_cast<void*>(&layer->prefetch_workers_[0]));
+  for (int worker_id = 1; worker_id < num_workers; ++worker_id) {
+    CHECK(!pthread_join(worker_threads[worker_id], NULL))
+        << "Pthread joining failed.";
+  }
+  stats->parse_ms = 0;
+  stats->decode_ms = 0;
+  stats->transform_ms = 0;
+  for (int worker_id = 0; worker_id < num_workers; ++worker_id) {
+    stats->parse_ms += layer->prefetch_workers_[worker_id].parse_ms;
+    stats->decode_ms += layer->prefetch_workers_[worker_id].decode_ms;
+    stats->transform_ms += layer->prefetch_workers_[worker_id].transform_ms;
+  }
+}
+
+template <typename Dtype>
+void* DataLayerPrefetch(void* layer_pointer) {
+  CHECK(layer_pointer);
+  DataLayer<Dtype>* layer = static_cast<DataLayer<Dtype>*>(layer_pointer);
+  CHECK(layer);
+  if (layer->prefetch_stream_) {
+    // The current device is per thread, so select the layer's device here.
+    CUDA_CHECK(cudaSetDevice(layer->prefetch_device_));
+  }
+  // Keep filling buffers as Forward hands them back, until asked to exit.
+  while (true) {
+    const int batch_id = layer->prefetch_free_.pop();
+    if (batch_id < 0) {
+      break;
+    }
+    const ptime prefetch_start = microsec_clock::local_time();
+    NvtxRange range("Prefetch");
+    layer->phase_ = layer->prefetch_phase_[batch_id];
+    DataLayerPrefetchBatch(layer, batch_id);
+    const ptime copy_start = microsec_clock::local_time();
+    if (layer->prefetch_stream_) {
+      // Send the batch to the device before handing it to Forward.
+      if (layer->gpu_transform_) {
+        layer->prefetch_pixels_[batch_id]->async_gpu_push(
+            layer->prefetch_stream_);
+        layer->prefetch_crops_[batch_id]->async_gpu_push(
+            layer->prefetch_stream_);
+      } else {
+        layer->prefetch_data_[batch_id]->data()->async_gpu_push(
+            layer->prefetch_stream_);
+      }
+      if (layer->output_labels_) {
+        layer->prefetch_label_[batch_id]->data()->async_gpu_push(
+            layer->prefetch_stream_);
+      }
+      CUDA_CHECK(cudaStreamSynchronize(layer->prefetch_stream_));
+    }
+    layer->prefetch_stats_[batch_id].copy_ms = MilliSecondsSince(copy_start);
+    layer->prefetch_stats_[batch_id].prefetch_ms =
+        MilliSecondsSince(prefetch_start);
+    layer->prefetch_full_.push(batch_id);
   }
 
   return static_cast<void*>(NULL);
@@ -123,7 +289,13 @@ void* DataLayerPrefetch(void* layer_pointer) {
 
 template <typename Dtype>
 DataLayer<Dtype>::~DataLayer<Dtype>() {
+  if (gpu_resident_) {
+    return;
+  }
   JoinPrefetchThread();
+  if (prefetch_stream_) {
+    CUDA_CHECK(cudaStreamDestroy(prefetch_stream_));
+  }
 }
 
 template <typename Dtype>
@@ -137,59 +309,55 @@ void DataLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
   } else {
     output_labels_ = true;
   }
-  // Initialize the leveldb
-  leveldb::DB* db_temp;
-  leveldb::Options options;
-  options.create_if_missing = false;
-  options.max_open_files = 100;
-  LOG(INFO) << "Opening leveldb " << this->layer_param_.data_param().source();
-  leveldb::Status status = leveldb::DB::Open(
-      options, this->layer_param_.data_param().source(), &db_temp);
-  CHECK(status.ok()) << "Failed to open leveldb "
-      << this->layer_param_.data_param().source() << std::endl
-      << status.ToString();
-  db_.reset(db_temp);
-  iter_.reset(db_->NewIterator(leveldb::ReadOptions()));
-  iter_->SeekToFirst();
+  // Initialize the database, shared with the other layers reading it.
+  db_ = GetSharedDB(this->layer_param_.data_param());
+  cursor_.reset(db_->NewCursor());
   // Check if we would need to randomly skip a few data points
   if (this->layer_param_.data_param().rand_skip()) {
     unsigned int skip = caffe_rng_rand() %
                         this->layer_param_.data_param().rand_skip();
     LOG(INFO) << "Skipping first " << skip << " data points.";
-    while (skip-- > 0) {
-      iter_->Next();
-      if (!iter_->Valid()) {
-        iter_->SeekToFirst();
-      }
-    }
+    AdvanceCursor(skip, cursor_.get());
+  }
+  const int num_shards = this->layer_param_.data_param().num_shards();
+  const int shard_id = this->layer_param_.data_param().shard_id();
+  CHECK_GT(num_shards, 0);
+  CHECK_LT(shard_id, num_shards);
+  if (num_shards > 1) {
+    LOG(INFO) << "Reading shard " << shard_id << " of " << num_shards << ".";
+    AdvanceCursor(shard_id, cursor_.get());
   }
   // Read a data point, and use it to initialize the top blob.
   Datum datum;
-  datum.ParseFromString(iter_->value().ToString());
+  CHECK(cursor_->valid()) << "The database is empty";
+  datum.ParseFromArray(cursor_->value_data(), cursor_->value_size());
   // image
   int crop_size = this->layer_param_.data_param().crop_size();
+  const int batch_size = this->layer_param_.data_param().batch_size();
+  const int prefetch_batches =
+      this->layer_param_.data_param().prefetch_batches();
+  CHECK_GT(prefetch_batches, 0);
+  prefetch_data_.resize(prefetch_batches);
+  prefetch_label_.resize(prefetch_batches);
   if (crop_size > 0) {
-    (*top)[0]->Reshape(this->layer_param_.data_param().batch_size(),
-                       datum.channels(), crop_size, crop_size);
-    prefetch_data_.reset(new Blob<Dtype>(
-        this->layer_param_.data_param().batch_size(), datum.channels(),
-        crop_size, crop_size));
+    (*top)[0]->Reshape(batch_size, datum.channels(), crop_size, crop_size);
   } else {
-    (*top)[0]->Reshape(
-        this->layer_param_.data_param().batch_size(), datum.channels(),
-        datum.height(), datum.width());
-    prefetch_data_.reset(new Blob<Dtype>(
-        this->layer_param_.data_param().batch_size(), datum.channels(),
-        datum.height(), datum.width()));
+    (*top)[0]->Reshape(batch_size, datum.channels(), datum.height(),
+                       datum.width());
+  }
+  for (int batch_id = 0; batch_id < prefetch_batches; ++batch_id) {
+    prefetch_data_[batch_id].reset(new Blob<Dtype>());
+    prefetch_data_[batch_id]->ReshapeLike(*(*top)[0]);
   }
   LOG(INFO) << "output data size: " << (*top)[0]->num() << ","
       << (*top)[0]->channels() << "," << (*top)[0]->height() << ","
       << (*top)[0]->width();
   // label
   if (output_labels_) {
-    (*top)[1]->Reshape(this->layer_param_.data_param().batch_size(), 1, 1, 1);
-    prefetch_label_.reset(
-        new Blob<Dtype>(this->layer_param_.data_param().batch_size(), 1, 1, 1));
+    (*top)[1]->Reshape(batch_size, 1, 1, 1);
+    for (int batch_id = 0; batch_id < prefetch_batches; ++batch_id) {
+      prefetch_label_[batch_id].reset(new Blob<Dtype>(batch_size, 1, 1, 1));
+    }
   }
   // datum size
   datum_channels_ = datum.channels();
@@ -199,7 +367,18 @@ void DataLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
   CHECK_GT(datum_height_, crop_size);
   CHECK_GT(datum_width_, crop_size);
   // check if we want to have mean
-  if (this->layer_param_.data_param().has_mean_file()) {
+  const int num_mean_values =
+      this->layer_param_.data_param().mean_value_size();
+  if (num_mean_values > 0) {
+    CHECK(!this->layer_param_.data_param().has_mean_file())
+        << "Cannot specify both mean_file and mean_value.";
+    CHECK(num_mean_values == 1 || num_mean_values == datum_channels_)
+        << "Specify either one mean_value or one per channel.";
+    for (int c = 0; c < datum_channels_; ++c) {
+      mean_values_.push_back(this->layer_param_.data_param().mean_value(
+          num_mean_values == 1 ? 0 : c));
+    }
+  } else if (this->layer_param_.data_param().has_mean_file()) {
     const string& mean_file = this->layer_param_.data_param().mean_file();
     LOG(INFO) << "Loading mean file from" << mean_file;
     BlobProto blob_proto;
@@ -213,15 +392,102 @@ void DataLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
     // Simply initialize an all-empty mean.
     data_mean_.Reshape(1, datum_channels_, datum_height_, datum_width_);
   }
+  // The transformation on the device only knows about mean images, so turn
+  // the mean values into one.
+  gpu_transform_ = this->layer_param_.data_param().gpu_transform() &&
+      Caffe::mode() == Caffe::GPU;
+  gpu_resident_ = this->layer_param_.data_param().gpu_resident() &&
+      Caffe::mode() == Caffe::GPU;
+  if ((gpu_transform_ || gpu_resident_) && !mean_values_.empty()) {
+    data_mean_.Reshape(1, datum_channels_, datum_height_, datum_width_);
+    const int image_size = datum_height_ * datum_width_;
+    Dtype* mean = data_mean_.mutable_cpu_data();
+    for (int c = 0; c < datum_channels_; ++c) {
+      caffe_set(image_size, mean_values_[c], mean + c * image_size);
+    }
+  }
+  if (gpu_resident_) {
+    CHECK(!this->layer_param_.data_param().mirror() || crop_size)
+        << "Current implementation requires mirror and crop_size to be "
+        << "set at the same time.";
+    LoadResidentData();
+    data_mean_.gpu_data();
+    return;
+  }
+  if (this->layer_param_.data_param().shuffle()) {
+    shuffled_reader_.reset(new ShuffledDBReader(db_.get(),
+        this->layer_param_.data_param().shuffle_block_size(),
+        this->layer_param_.data_param().readahead_blocks(), num_shards,
+        shard_id, caffe_rng_rand()));
+  }
+  if (gpu_transform_) {
+    LOG(INFO) << "Transforming the data on the device.";
+    prefetch_pixels_.resize(prefetch_batches);
+    prefetch_crops_.resize(prefetch_batches);
+    for (int batch_id = 0; batch_id < prefetch_batches; ++batch_id) {
+      prefetch_pixels_[batch_id].reset(
+          new SyncedMemory(batch_size * datum_size_));
+      prefetch_crops_[batch_id].reset(
+          new SyncedMemory(batch_size * 3 * sizeof(int)));
+    }
+  }
+  // In GPU mode, the prefetch thread copies every batch to the device on its
+  // own stream from pinned memory, so that Forward_gpu only has to make a
+  // device to device copy.
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(cudaGetDevice(&prefetch_device_));
+    CUDA_CHECK(cudaStreamCreate(&prefetch_stream_));
+  }
   // Now, start the prefetch thread. Before calling prefetch, we make two
   // cpu_data calls so that the prefetch thread does not accidentally make
   // simultaneous cudaMalloc calls when the main thread is running. In some
-  // GPUs this seems to cause failures if we do not so.
-  prefetch_data_->mutable_cpu_data();
-  if (output_labels_) {
-    prefetch_label_->mutable_cpu_data();
+  // GPUs this seems to cause failures if we do not so. For the same reason
+  // the gpu copies the prefetch thread pushes to are allocated here.
+  for (int batch_id = 0; batch_id < prefetch_batches; ++batch_id) {
+    vector<SyncedMemory*> buffers;
+    if (gpu_transform_) {
+      buffers.push_back(prefetch_pixels_[batch_id].get());
+      buffers.push_back(prefetch_crops_[batch_id].get());
+    } else {
+      buffers.push_back(prefetch_data_[batch_id]->data().get());
+    }
+    if (output_labels_) {
+      buffers.push_back(prefetch_label_[batch_id]->data().get());
+    }
+    for (int i = 0; i < buffers.size(); ++i) {
+      if (prefetch_stream_) {
+        buffers[i]->set_pinned(true);
+        buffers[i]->mutable_gpu_data();
+      }
+      buffers[i]->mutable_cpu_data();
+    }
+  }
+  if (gpu_transform_) {
+    data_mean_.gpu_data();
+  } else if (mean_values_.empty()) {
+    data_mean_.cpu_data();
+  }
+  // Split the batch evenly among the prefetch workers.
+  const int num_workers = std::max(1, std::min(batch_size,
+      static_cast<int>(this->layer_param_.data_param().prefetch_threads())));
+  prefetch_values_.resize(batch_size);
+  prefetch_workers_.resize(num_workers);
+  for (int worker_id = 0; worker_id < num_workers; ++worker_id) {
+    prefetch_workers_[worker_id].layer = this;
+    prefetch_workers_[worker_id].worker_id = worker_id;
+    prefetch_workers_[worker_id].item_begin =
+        batch_size * worker_id / num_workers;
+    prefetch_workers_[worker_id].item_end =
+        batch_size * (worker_id + 1) / num_workers;
+  }
+  LOG(INFO) << "Prefetching " << prefetch_batches << " batch(es) with "
+      << num_workers << " worker(s).";
+  // All buffers start out free to be filled in the current phase.
+  prefetch_phase_.assign(prefetch_batches, Caffe::phase());
+  prefetch_stats_.resize(prefetch_batches);
+  for (int batch_id = 0; batch_id < prefetch_batches; ++batch_id) {
+    prefetch_free_.push(batch_id);
   }
-  data_mean_.cpu_data();
   DLOG(INFO) << "Initializing prefetch";
   CreatePrefetchThread();
   DLOG(INFO) << "Prefetch initialized.";
@@ -230,14 +496,21 @@ void DataLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
 template <typename Dtype>
 void DataLayer<Dtype>::CreatePrefetchThread() {
   phase_ = Caffe::phase();
-  const bool prefetch_needs_rand = (phase_ == Caffe::TRAIN) &&
-      (this->layer_param_.data_param().mirror() ||
-       this->layer_param_.data_param().crop_size());
-  if (prefetch_needs_rand) {
-    const unsigned int prefetch_rng_seed = caffe_rng_rand();
-    prefetch_rng_.reset(new Caffe::RNG(prefetch_rng_seed));
-  } else {
-    prefetch_rng_.reset();
+  // The prefetch thread lives across phase changes, so the random streams are
+  // needed whenever a training batch could be randomly cropped or mirrored.
+  const bool prefetch_needs_rand =
+      this->layer_param_.data_param().mirror() ||
+      this->layer_param_.data_param().crop_size();
+  // Seed the workers in order so that a fixed random seed gives the same
+  // streams every time.
+  prefetch_rngs_.resize(prefetch_workers_.size());
+  for (int worker_id = 0; worker_id < prefetch_rngs_.size(); ++worker_id) {
+    if (prefetch_needs_rand) {
+      const unsigned int prefetch_rng_seed = caffe_rng_rand();
+      prefetch_rngs_[worker_id].reset(new Caffe::RNG(prefetch_rng_seed));
+    } else {
+      prefetch_rngs_[worker_id].reset();
+    }
   }
   // Create the thread.
   CHECK(!pthread_create(&thread_, NULL, DataLayerPrefetch<Dtype>,
@@ -246,34 +519,197 @@ void DataLayer<Dtype>::CreatePrefetchThread() {
 
 template <typename Dtype>
 void DataLayer<Dtype>::JoinPrefetchThread() {
+  // Drop the buffers still waiting to be filled so that the prefetch thread
+  // exits as soon as it has finished the batch in hand.
+  int batch_id;
+  while (prefetch_free_.try_pop(&batch_id)) {}
+  prefetch_free_.push(-1);
   CHECK(!pthread_join(thread_, NULL)) << "Pthread joining failed.";
 }
 
 template <typename Dtype>
-unsigned int DataLayer<Dtype>::PrefetchRand() {
-  CHECK(prefetch_rng_);
+int DataLayer<Dtype>::PopPrefetchedBatch() {
+  const ptime wait_start = microsec_clock::local_time();
+  const int batch_id = prefetch_full_.pop();
+  stats_.wait_ms += MilliSecondsSince(wait_start);
+  const DataLayerStats& batch_stats = prefetch_stats_[batch_id];
+  ++stats_.batches;
+  stats_.prefetch_ms += batch_stats.prefetch_ms;
+  stats_.read_ms += batch_stats.read_ms;
+  stats_.parse_ms += batch_stats.parse_ms;
+  stats_.decode_ms += batch_stats.decode_ms;
+  stats_.transform_ms += batch_stats.transform_ms;
+  stats_.copy_ms += batch_stats.copy_ms;
+  return batch_id;
+}
+
+template <typename Dtype>
+unsigned int DataLayer<Dtype>::PrefetchRand(const int worker_id) {
+  CHECK(prefetch_rngs_[worker_id]);
   caffe::rng_t* prefetch_rng =
-      static_cast<caffe::rng_t*>(prefetch_rng_->generator());
+      static_cast<caffe::rng_t*>(prefetch_rngs_[worker_id]->generator());
   return (*prefetch_rng)();
 }
 
 template <typename Dtype>
 Dtype DataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
-  // First, join the thread
-  JoinPrefetchThread();
+  if (gpu_resident_) {
+    ResidentForward_cpu(top);
+    return Dtype(0.);
+  }
+  // First, wait for the next prefetched batch
+  const int batch_id = PopPrefetchedBatch();
   // Copy the data
-  caffe_copy(prefetch_data_->count(), prefetch_data_->cpu_data(),
-             (*top)[0]->mutable_cpu_data());
+  const ptime copy_start = microsec_clock::local_time();
+  if (gpu_transform_) {
+    // The mode changed since SetUp, so transform here what was left for
+    // Forward_gpu.
+    TransformPixels_cpu(batch_id, (*top)[0]->mutable_cpu_data());
+  } else {
+    caffe_copy(prefetch_data_[batch_id]->count(),
+               prefetch_data_[batch_id]->cpu_data(),
+               (*top)[0]->mutable_cpu_data());
+  }
   if (output_labels_) {
-    caffe_copy(prefetch_label_->count(), prefetch_label_->cpu_data(),
+    caffe_copy(prefetch_label_[batch_id]->count(),
+               prefetch_label_[batch_id]->cpu_data(),
                (*top)[1]->mutable_cpu_data());
   }
-  // Start a new prefetch thread
-  CreatePrefetchThread();
+  stats_.copy_ms += MilliSecondsSince(copy_start);
+  // Hand the buffer back to the prefetch thread
+  prefetch_phase_[batch_id] = Caffe::phase();
+  prefetch_free_.push(batch_id);
   return Dtype(0.);
 }
 
+template <typename Dtype>
+void DataLayer<Dtype>::TransformPixels_cpu(const int batch_id,
+    Dtype* top_data) {
+  const int batch_size = this->layer_param_.data_param().batch_size();
+  const int crop_size = this->layer_param_.data_param().crop_size();
+  const Dtype scale = this->layer_param_.data_param().scale();
+  const int top_size = prefetch_data_[batch_id]->count() / batch_size;
+  const uint8_t* pixels =
+      static_cast<const uint8_t*>(prefetch_pixels_[batch_id]->cpu_data());
+  const int* crops = static_cast<const int*>(
+      prefetch_crops_[batch_id]->cpu_data());
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    TransformImage(pixels + item_id * datum_size_, datum_channels_,
+        datum_height_, datum_width_, crops[item_id * 3],
+        crops[item_id * 3 + 1], crop_size, crops[item_id * 3 + 2],
+        data_mean_.cpu_data(), scale, top_data + item_id * top_size);
+  }
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::LoadResidentData() {
+  const DataParameter& data_param = this->layer_param_.data_param();
+  const int num_shards = data_param.num_shards();
+  const int shard_id = data_param.shard_id();
+  const int batch_size = data_param.batch_size();
+  // The number of datums is only known at the end, so they are gathered in
+  // host memory first.
+  string pixels;
+  vector<Dtype> labels;
+  Datum datum;
+  string decoded;
+  int index = 0;
+  for (cursor_->SeekToFirst(); cursor_->valid(); cursor_->Next(), ++index) {
+    if (index % num_shards != shard_id) {
+      continue;
+    }
+    const char* data;
+    int data_size;
+    CHECK(ParseDatumWithoutData(cursor_->value_data(), cursor_->value_size(),
+                                &datum, &data, &data_size));
+    if (datum.encoded()) {
+      CHECK(DecodeImageToPixels(data, data_size, datum_channels_,
+                                datum_height_, datum_width_, &decoded))
+          << "Could not decode an image of shape " << datum_channels_ << "x"
+          << datum_height_ << "x" << datum_width_;
+      data = decoded.data();
+      data_size = decoded.size();
+    }
+    CHECK_EQ(data_size, datum_size_) << "gpu_resident requires uint8 data";
+    pixels.append(data, data_size);
+    labels.push_back(datum.label());
+  }
+  const int num_items = labels.size();
+  CHECK_GT(num_items, 0) << "The shard is empty";
+  resident_pixels_.reset(new SyncedMemory(pixels.size()));
+  memcpy(resident_pixels_->mutable_cpu_data(), pixels.data(), pixels.size());
+  resident_pixels_->gpu_data();
+  resident_labels_.Reshape(num_items, 1, 1, 1);
+  caffe_copy(num_items, &labels[0], resident_labels_.mutable_cpu_data());
+  resident_labels_.gpu_data();
+  LOG(INFO) << "Loaded " << num_items << " datums, " << pixels.size()
+      << " bytes, onto the device.";
+  resident_order_.resize(num_items);
+  for (int i = 0; i < num_items; ++i) {
+    resident_order_[i] = i;
+  }
+  // Start on a pass of its own, shuffled like the others.
+  resident_position_ = num_items;
+  resident_batch_.reset(new SyncedMemory(batch_size * sizeof(int)));
+  resident_rand_.reset(new SyncedMemory(batch_size * 3 * sizeof(unsigned)));
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::NextResidentBatch() {
+  const int batch_size = this->layer_param_.data_param().batch_size();
+  const int num_items = resident_order_.size();
+  int* batch = static_cast<int*>(resident_batch_->mutable_cpu_data());
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    if (resident_position_ == num_items) {
+      if (this->layer_param_.data_param().shuffle()) {
+        for (int i = num_items - 1; i > 0; --i) {
+          std::swap(resident_order_[i],
+                    resident_order_[caffe_rng_rand() % (i + 1)]);
+        }
+      }
+      resident_position_ = 0;
+    }
+    batch[item_id] = resident_order_[resident_position_++];
+  }
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::ResidentForward_cpu(vector<Blob<Dtype>*>* top) {
+  const DataParameter& data_param = this->layer_param_.data_param();
+  const int batch_size = data_param.batch_size();
+  const int crop_size = data_param.crop_size();
+  const int top_size = (*top)[0]->count() / batch_size;
+  NextResidentBatch();
+  const int* batch = static_cast<const int*>(resident_batch_->cpu_data());
+  const uint8_t* pixels =
+      static_cast<const uint8_t*>(resident_pixels_->cpu_data());
+  Dtype* top_data = (*top)[0]->mutable_cpu_data();
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    int h_off = 0;
+    int w_off = 0;
+    bool do_mirror = false;
+    if (crop_size) {
+      if (Caffe::phase() == Caffe::TRAIN) {
+        h_off = caffe_rng_rand() % (datum_height_ - crop_size);
+        w_off = caffe_rng_rand() % (datum_width_ - crop_size);
+      } else {
+        h_off = (datum_height_ - crop_size) / 2;
+        w_off = (datum_width_ - crop_size) / 2;
+      }
+      do_mirror = data_param.mirror() && caffe_rng_rand() % 2;
+    }
+    TransformImage(pixels + batch[item_id] * datum_size_, datum_channels_,
+        datum_height_, datum_width_, h_off, w_off, crop_size, do_mirror,
+        data_mean_.cpu_data(), Dtype(data_param.scale()),
+        top_data + item_id * top_size);
+    if (output_labels_) {
+      (*top)[1]->mutable_cpu_data()[item_id] =
+          resident_labels_.cpu_data()[batch[item_id]];
+    }
+  }
+}
+
 INSTANTIATE_CLASS(DataLayer);
 
 }  // namespace caffe
@@ -9,28 +9,150 @@
 
 #include "caffe/layer.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
 #include "caffe/vision_layers.hpp"
 
 using std::string;
 
 namespace caffe {
 
+// Crops, mirrors, subtracts the mean from and scales the uint8 pixels of a
+// batch, as TransformImage does, with one thread per output value. crops
+// holds the h_off, w_off and mirror of every item.
+template <typename Dtype>
+__global__ void DataTransformForward(const int n, const uint8_t* pixels,
+    const int* crops, const int channels, const int height, const int width,
+    const int crop_height, const int crop_width, const Dtype* mean,
+    const Dtype scale, Dtype* top_data) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int w = index % crop_width;
+    const int h = (index / crop_width) % crop_height;
+    const int c = (index / crop_width / crop_height) % channels;
+    const int item_id = index / crop_width / crop_height / channels;
+    const int* crop = crops + item_id * 3;
+    const int data_h = h + crop[0];
+    const int data_w = (crop[2] ? crop_width - 1 - w : w) + crop[1];
+    const int mean_index = (c * height + data_h) * width + data_w;
+    top_data[index] = (static_cast<Dtype>(
+        pixels[item_id * channels * height * width + mean_index])
+        - mean[mean_index]) * scale;
+  }
+}
+
+// The same for the batch of a gpu_resident layer: the items of the batch
+// are read out of all the pixels, and their crops and mirrors drawn from 3
+// random numbers per item, as the prefetch workers do.
+template <typename Dtype>
+__global__ void DataResidentForward(const int n, const uint8_t* pixels,
+    const int* batch, const unsigned int* rand, const bool train,
+    const bool mirror, const int channels, const int height, const int width,
+    const int crop_size, const int crop_height, const int crop_width,
+    const Dtype* mean, const Dtype scale, Dtype* top_data) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int w = index % crop_width;
+    const int h = (index / crop_width) % crop_height;
+    const int c = (index / crop_width / crop_height) % channels;
+    const int item_id = index / crop_width / crop_height / channels;
+    const unsigned int* item_rand = rand + item_id * 3;
+    int h_off = 0;
+    int w_off = 0;
+    bool do_mirror = false;
+    if (crop_size) {
+      if (train) {
+        h_off = item_rand[0] % (height - crop_size);
+        w_off = item_rand[1] % (width - crop_size);
+      } else {
+        h_off = (height - crop_size) / 2;
+        w_off = (width - crop_size) / 2;
+      }
+      do_mirror = mirror && item_rand[2] % 2;
+    }
+    const int data_h = h + h_off;
+    const int data_w = (do_mirror ? crop_width - 1 - w : w) + w_off;
+    const int mean_index = (c * height + data_h) * width + data_w;
+    const size_t item_offset =
+        static_cast<size_t>(batch[item_id]) * channels * height * width;
+    top_data[index] = (static_cast<Dtype>(pixels[item_offset + mean_index])
+        - mean[mean_index]) * scale;
+  }
+}
+
+template <typename Dtype>
+__global__ void DataResidentLabels(const int n, const Dtype* labels,
+    const int* batch, Dtype* top_label) {
+  CUDA_KERNEL_LOOP(index, n) {
+    top_label[index] = labels[batch[index]];
+  }
+}
+
+template <typename Dtype>
+void DataLayer<Dtype>::ResidentForward_gpu(vector<Blob<Dtype>*>* top) {
+  const DataParameter& data_param = this->layer_param_.data_param();
+  const int batch_size = data_param.batch_size();
+  const int crop_size = data_param.crop_size();
+  const int crop_height = crop_size ? crop_size : datum_height_;
+  const int crop_width = crop_size ? crop_size : datum_width_;
+  NextResidentBatch();
+  const int* batch = static_cast<const int*>(resident_batch_->gpu_data());
+  unsigned int* rand = static_cast<unsigned int*>(
+      resident_rand_->mutable_gpu_data());
+  if (crop_size) {
+    caffe_gpu_rng_uniform(batch_size * 3, rand);
+  }
+  const int count = (*top)[0]->count();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  DataResidentForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
+      count, static_cast<const uint8_t*>(resident_pixels_->gpu_data()),
+      batch, rand, Caffe::phase() == Caffe::TRAIN, data_param.mirror(),
+      datum_channels_, datum_height_, datum_width_, crop_size, crop_height,
+      crop_width, data_mean_.gpu_data(), Dtype(data_param.scale()),
+      (*top)[0]->mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+  if (output_labels_) {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    DataResidentLabels<Dtype><<<CAFFE_GET_BLOCKS(batch_size), CAFFE_CUDA_NUM_THREADS>>>(
+        batch_size, resident_labels_.gpu_data(), batch,
+        (*top)[1]->mutable_gpu_data());
+    CUDA_POST_KERNEL_CHECK;
+  }
+}
+
 template <typename Dtype>
 Dtype DataLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
-  // First, join the thread
-  JoinPrefetchThread();
-  // Copy the data
-  CUDA_CHECK(cudaMemcpy((*top)[0]->mutable_gpu_data(),
-      prefetch_data_->cpu_data(), sizeof(Dtype) * prefetch_data_->count(),
-      cudaMemcpyHostToDevice));
+  if (gpu_resident_) {
+    ResidentForward_gpu(top);
+    return Dtype(0.);
+  }
+  // First, wait for the next prefetched batch
+  const int batch_id = PopPrefetchedBatch();
+  // Copy the data. The prefetch thread has already pushed the batch to the
+  // device if it has a stream to do so; otherwise gpu_data() copies it here.
+  if (gpu_transform_) {
+    const int crop_size = this->layer_param_.data_param().crop_size();
+    const int crop_height = crop_size ? crop_size : datum_height_;
+    const int crop_width = crop_size ? crop_size : datum_width_;
+    const int count = (*top)[0]->count();
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    DataTransformForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
+        count,
+        static_cast<const uint8_t*>(prefetch_pixels_[batch_id]->gpu_data()),
+        static_cast<const int*>(prefetch_crops_[batch_id]->gpu_data()),
+        datum_channels_, datum_height_, datum_width_, crop_height, crop_width,
+        data_mean_.gpu_data(), Dtype(this->layer_param_.data_param().scale()),
+        (*top)[0]->mutable_gpu_data());
+    CUDA_POST_KERNEL_CHECK;
+  } else {
+    caffe_gpu_copy(prefetch_data_[batch_id]->count(),
+        prefetch_data_[batch_id]->gpu_data(), (*top)[0]->mutable_gpu_data());
+  }
   if (output_labels_) {
-    CUDA_CHECK(cudaMemcpy((*top)[1]->mutable_gpu_data(),
-        prefetch_label_->cpu_data(), sizeof(Dtype) * prefetch_label_->count(),
-        cudaMemcpyHostToDevice));
+    caffe_gpu_copy(prefetch_label_[batch_id]->count(),
+        prefetch_label_[batch_id]->gpu_data(), (*top)[1]->mutable_gpu_data());
   }
-  // Start a new prefetch thread
-  CreatePrefetchThread();
+  // Hand the buffer back to the prefetch thread
+  prefetch_phase_[batch_id] = Caffe::phase();
+  prefetch_free_.push(batch_id);
   return Dtype(0.);
 }
 
@@ -2,27 +2,58 @@
 
 // TODO (sergeyk): effect should not be dependent on phase. wasted memcpy.
 
+#include <algorithm>
 #include <vector>
 
 #include "caffe/common.hpp"
+#include "caffe/util/cpu_threads.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/philox.hpp"
 #include "caffe/layer.hpp"
-#include "caffe/syncedmem.hpp"
 #include "caffe/vision_layers.hpp"
 
 namespace caffe {
 
+// The elements drawn per Philox call, one of its words each
+const int kDropoutBlockSize = 4;
+
+// Sets out = in * mask * scale, element i of the mask keeping it if word
+// i % 4 of the Philox numbers of counter i / 4 is above threshold. The
+// forward and the backward pass alike.
+template <typename Dtype>
+static void DropoutMask(const int count, const Dtype* in,
+    const uint32_t key[2], const unsigned int threshold, const Dtype scale,
+    Dtype* out) {
+  const int num_blocks = (count + kDropoutBlockSize - 1) / kDropoutBlockSize;
+  // The numbers of a block do not depend on the others, so the blocks are
+  // split over the threads, by 1024 at least.
+  const int num_threads = CpuLayerThreads(num_blocks / 1024 + 1);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int block = 0; block < num_blocks; ++block) {
+    const uint32_t counter[4] = { static_cast<uint32_t>(block), 0, 0, 0 };
+    uint32_t random[kDropoutBlockSize];
+    philox4x32(counter, key, random);
+    const int begin = block * kDropoutBlockSize;
+    const int end = std::min(begin + kDropoutBlockSize, count);
+    for (int i = begin; i < end; ++i) {
+      out[i] = in[i] * (random[i - begin] > threshold) * scale;
+    }
+  }
+}
+
 template <typename Dtype>
 void DropoutLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
   NeuronLayer<Dtype>::SetUp(bottom, top);
-  // Set up the cache for random number generation
-  rand_vec_.reset(new SyncedMemory(bottom[0]->count() * sizeof(int)));
   threshold_ = this->layer_param_.dropout_param().dropout_ratio();
   DCHECK(threshold_ > 0.);
   DCHECK(threshold_ < 1.);
   scale_ = 1. / (1. - threshold_);
   uint_thres_ = static_cast<unsigned int>(UINT_MAX * threshold_);
+  mask_key_[0] = 0;
+  mask_key_[1] = 0;
 }
 
 template <typename Dtype>
@@ -30,15 +61,16 @@ Dtype DropoutLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     vector<Blob<Dtype>*>* top) {
   const Dtype* bottom_data = bottom[0]->cpu_data();
   Dtype* top_data = (*top)[0]->mutable_cpu_data();
-  int* mask = reinterpret_cast<int*>(rand_vec_->mutable_cpu_data());
   const int count = bottom[0]->count();
   if (Caffe::phase() == Caffe::TRAIN) {
-    // Create random numbers
-    caffe_rng_bernoulli(count, 1. - threshold_, mask);
-    for (int i = 0; i < count; ++i) {
-      top_data[i] = bottom_data[i] * mask[i] * scale_;
+    // A new mask, unless recomputing: the key comes from the Caffe RNG, so
+    // that it follows the random seed.
+    if (!this->recomputing_) {
+      mask_key_[0] = caffe_rng_rand();
+      mask_key_[1] = caffe_rng_rand();
     }
-  } else {
+    DropoutMask(count, bottom_data, mask_key_, uint_thres_, scale_, top_data);
+  } else if (bottom[0] != (*top)[0]) {
     caffe_copy(bottom[0]->count(), bottom_data, top_data);
   }
   return Dtype(0);
@@ -52,11 +84,8 @@ void DropoutLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
   if (propagate_down) {
     const Dtype* top_diff = top[0]->cpu_diff();
     Dtype* bottom_diff = (*bottom)[0]->mutable_cpu_diff();
-    const int* mask = reinterpret_cast<const int*>(rand_vec_->cpu_data());
     const int count = (*bottom)[0]->count();
-    for (int i = 0; i < count; ++i) {
-      bottom_diff[i] = top_diff[i] * mask[i] * scale_;
-    }
+    DropoutMask(count, top_diff, mask_key_, uint_thres_, scale_, bottom_diff);
   }
 }
 
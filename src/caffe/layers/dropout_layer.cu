@@ -6,21 +6,30 @@
 
 #include "caffe/common.hpp"
 #include "caffe/layer.hpp"
-#include "caffe/syncedmem.hpp"
 #include "caffe/vision_layers.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/philox.hpp"
 
 using std::max;
 
 namespace caffe {
 
 
+// The mask of DropoutMask in dropout_layer.cpp, a thread per Philox call of 4
+// elements; the same numbers on the CPU and the GPU.
 template <typename Dtype>
-__global__ void DropoutForward(const int n, const Dtype* in,
-    const unsigned int* mask, const unsigned int threshold, const float scale,
-    Dtype* out) {
-  CUDA_KERNEL_LOOP(index, n) {
-    out[index] = in[index] * (mask[index] > threshold) * scale;
+__global__ void DropoutMaskKernel(const int n, const Dtype* in,
+    const uint32_t key0, const uint32_t key1, const unsigned int threshold,
+    const float scale, Dtype* out) {
+  CUDA_KERNEL_LOOP(block, (n + 3) / 4) {
+    const uint32_t counter[4] = { static_cast<uint32_t>(block), 0, 0, 0 };
+    const uint32_t key[2] = { key0, key1 };
+    uint32_t random[4];
+    philox4x32(counter, key, random);
+    const int begin = block * 4;
+    for (int i = 0; i < 4 && begin + i < n; ++i) {
+      out[begin + i] = in[begin + i] * (random[i] > threshold) * scale;
+    }
   }
 }
 
@@ -31,29 +40,23 @@ Dtype DropoutLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
   Dtype* top_data = (*top)[0]->mutable_gpu_data();
   const int count = bottom[0]->count();
   if (Caffe::phase() == Caffe::TRAIN) {
-    unsigned int* mask =
-        static_cast<unsigned int*>(rand_vec_->mutable_gpu_data());
-    caffe_gpu_rng_uniform(count, mask);
-    // set thresholds
+    if (!this->recomputing_) {
+      mask_key_[0] = caffe_rng_rand();
+      mask_key_[1] = caffe_rng_rand();
+    }
+    const int num_blocks = (count + 3) / 4;
     // NOLINT_NEXT_LINE(whitespace/operators)
-    DropoutForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
-        count, bottom_data, mask, uint_thres_, scale_, top_data);
+    DropoutMaskKernel<Dtype><<<CAFFE_GET_BLOCKS(num_blocks),
+                               CAFFE_CUDA_NUM_THREADS>>>(
+        count, bottom_data, mask_key_[0], mask_key_[1], uint_thres_, scale_,
+        top_data);
     CUDA_POST_KERNEL_CHECK;
-  } else {
+  } else if (bottom[0] != (*top)[0]) {
     caffe_gpu_copy(count, bottom_data, top_data);
   }
   return Dtype(0);
 }
 
-template <typename Dtype>
-__global__ void DropoutBackward(const int n, const Dtype* in_diff,
-    const unsigned int* mask, const unsigned int threshold, const float scale,
-    Dtype* out_diff) {
-  CUDA_KERNEL_LOOP(index, n) {
-    out_diff[index] = in_diff[index] * scale * (mask[index] > threshold);
-  }
-}
-
 template <typename Dtype>
 void DropoutLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     const bool propagate_down,
@@ -62,12 +65,13 @@ void DropoutLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
   if (propagate_down) {
     const Dtype* top_diff = top[0]->gpu_diff();
     Dtype* bottom_diff = (*bottom)[0]->mutable_gpu_diff();
-    const unsigned int* mask =
-        static_cast<const unsigned int*>(rand_vec_->gpu_data());
     const int count = (*bottom)[0]->count();
+    const int num_blocks = (count + 3) / 4;
     // NOLINT_NEXT_LINE(whitespace/operators)
-    DropoutBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
-        count, top_diff, mask, uint_thres_, scale_, bottom_diff);
+    DropoutMaskKernel<Dtype><<<CAFFE_GET_BLOCKS(num_blocks),
+                               CAFFE_CUDA_NUM_THREADS>>>(
+        count, top_diff, mask_key_[0], mask_key_[1], uint_thres_, scale_,
+        bottom_diff);
     CUDA_POST_KERNEL_CHECK;
   }
 }
@@ -0,0 +1,179 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void EltwiseLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top) {
+  CHECK_GE(bottom.size(), 2) <<
+      "Eltwise Layer takes at least 2 blobs as input.";
+  CHECK_EQ(top->size(), 1) <<
+      "Eltwise Layer takes a single blob as output.";
+  const EltwiseParameter& eltwise_param = this->layer_param_.eltwise_param();
+  op_ = eltwise_param.operation();
+  CHECK(eltwise_param.coeff_size() == 0 ||
+      eltwise_param.coeff_size() == bottom.size())
+      << "Eltwise Layer takes one coefficient per bottom blob.";
+  CHECK(op_ == EltwiseParameter_EltwiseOp_SUM ||
+      eltwise_param.coeff_size() == 0)
+      << "Eltwise Layer only takes coefficients for SUM.";
+  // Backward of a product reads all the bottoms.
+  CHECK(op_ != EltwiseParameter_EltwiseOp_PROD || (*top)[0] != bottom[0])
+      << "Eltwise Layer cannot run in place for PROD.";
+  for (int i = 1; i < bottom.size(); ++i) {
+    CHECK((*top)[0] != bottom[i])
+        << "Eltwise Layer can only run in place on its first bottom.";
+  }
+  coeffs_.Reshape(bottom.size(), 1, 1, 1);
+  Dtype* coeffs = coeffs_.mutable_cpu_data();
+  for (int i = 0; i < bottom.size(); ++i) {
+    coeffs[i] = eltwise_param.coeff_size() ? eltwise_param.coeff(i) : 1;
+  }
+  data_pointers_.reset(new SyncedMemory(bottom.size() * sizeof(Dtype*)));
+  diff_pointers_.reset(new SyncedMemory(bottom.size() * sizeof(Dtype*)));
+  Reshape(bottom, top);
+}
+
+template <typename Dtype>
+void EltwiseLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top) {
+  for (int i = 1; i < bottom.size(); ++i) {
+    CHECK_EQ(bottom[0]->num(), bottom[i]->num());
+    CHECK_EQ(bottom[0]->channels(), bottom[i]->channels());
+    CHECK_EQ(bottom[0]->height(), bottom[i]->height());
+    CHECK_EQ(bottom[0]->width(), bottom[i]->width());
+  }
+  if ((*top)[0] != bottom[0]) {
+    (*top)[0]->ReshapeLike(*bottom[0]);
+  }
+  if (op_ == EltwiseParameter_EltwiseOp_MAX) {
+    max_idx_.ReshapeLike(*bottom[0]);
+  }
+}
+
+template <typename Dtype>
+Dtype EltwiseLayer<Dtype>::Forward_cpu(
+    const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
+  const int count = (*top)[0]->count();
+  const int num_bottoms = bottom.size();
+  vector<const Dtype*> bottom_data(num_bottoms);
+  for (int j = 0; j < num_bottoms; ++j) {
+    bottom_data[j] = bottom[j]->cpu_data();
+  }
+  // In place, each element of the first bottom is read before it is
+  // overwritten.
+  Dtype* top_data = (*top)[0]->mutable_cpu_data();
+  switch (op_) {
+  case EltwiseParameter_EltwiseOp_SUM: {
+    const Dtype* coeffs = coeffs_.cpu_data();
+    for (int i = 0; i < count; ++i) {
+      Dtype sum = coeffs[0] * bottom_data[0][i];
+      for (int j = 1; j < num_bottoms; ++j) {
+        sum += coeffs[j] * bottom_data[j][i];
+      }
+      top_data[i] = sum;
+    }
+    break;
+  }
+  case EltwiseParameter_EltwiseOp_PROD:
+    for (int i = 0; i < count; ++i) {
+      Dtype product = bottom_data[0][i];
+      for (int j = 1; j < num_bottoms; ++j) {
+        product *= bottom_data[j][i];
+      }
+      top_data[i] = product;
+    }
+    break;
+  case EltwiseParameter_EltwiseOp_MAX: {
+    Dtype* max_idx = max_idx_.mutable_cpu_data();
+    for (int i = 0; i < count; ++i) {
+      Dtype maximum = bottom_data[0][i];
+      int index = 0;
+      for (int j = 1; j < num_bottoms; ++j) {
+        if (bottom_data[j][i] > maximum) {
+          maximum = bottom_data[j][i];
+          index = j;
+        }
+      }
+      top_data[i] = maximum;
+      max_idx[i] = index;
+    }
+    break;
+  }
+  default:
+    LOG(FATAL) << "Unknown elementwise operation " << op_;
+  }
+  return Dtype(0.);
+}
+
+template <typename Dtype>
+void EltwiseLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
+    const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
+  const int count = top[0]->count();
+  const int num_bottoms = bottom->size();
+  const Dtype* top_diff = top[0]->cpu_diff();
+  // In place, the diff of the first bottom is the top diff: each element is
+  // read before it is overwritten.
+  vector<Dtype*> bottom_diff(num_bottoms);
+  for (int j = 0; j < num_bottoms; ++j) {
+    bottom_diff[j] = (*bottom)[j]->mutable_cpu_diff();
+  }
+  switch (op_) {
+  case EltwiseParameter_EltwiseOp_SUM: {
+    const Dtype* coeffs = coeffs_.cpu_data();
+    for (int i = 0; i < count; ++i) {
+      const Dtype diff = top_diff[i];
+      for (int j = 0; j < num_bottoms; ++j) {
+        bottom_diff[j][i] = coeffs[j] * diff;
+      }
+    }
+    break;
+  }
+  case EltwiseParameter_EltwiseOp_PROD: {
+    vector<const Dtype*> bottom_data(num_bottoms);
+    for (int j = 0; j < num_bottoms; ++j) {
+      bottom_data[j] = (*bottom)[j]->cpu_data();
+    }
+    // The products of the bottoms before each bottom, then after it
+    for (int i = 0; i < count; ++i) {
+      Dtype product = top_diff[i];
+      for (int j = 0; j < num_bottoms; ++j) {
+        bottom_diff[j][i] = product;
+        product *= bottom_data[j][i];
+      }
+      product = 1;
+      for (int j = num_bottoms - 1; j >= 0; --j) {
+        bottom_diff[j][i] *= product;
+        product *= bottom_data[j][i];
+      }
+    }
+    break;
+  }
+  case EltwiseParameter_EltwiseOp_MAX: {
+    const Dtype* max_idx = max_idx_.cpu_data();
+    for (int i = 0; i < count; ++i) {
+      const Dtype diff = top_diff[i];
+      const int index = static_cast<int>(max_idx[i]);
+      for (int j = 0; j < num_bottoms; ++j) {
+        bottom_diff[j][i] = j == index ? diff : Dtype(0);
+      }
+    }
+    break;
+  }
+  default:
+    LOG(FATAL) << "Unknown elementwise operation " << op_;
+  }
+}
+
+INSTANTIATE_CLASS(EltwiseLayer);
+
+
+}  // namespace caffe
@@ -0,0 +1,193 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <cstring>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+// The pointers of blobs in memory on the device: copied there only when the
+// blobs have moved since the last call.
+template <typename Dtype>
+static const void* DevicePointers(const vector<Dtype*>& pointers,
+    SyncedMemory* memory) {
+  const size_t size = pointers.size() * sizeof(pointers[0]);
+  if (memcmp(memory->cpu_data(), &pointers[0], size) != 0) {
+    memcpy(memory->mutable_cpu_data(), &pointers[0], size);
+  }
+  return memory->gpu_data();
+}
+
+template <typename Dtype>
+__global__ void EltwiseSumForward(const int n, const int num_bottoms,
+    const Dtype* const* bottom_data, const Dtype* coeffs, Dtype* top_data) {
+  CUDA_KERNEL_LOOP(index, n) {
+    Dtype sum = coeffs[0] * bottom_data[0][index];
+    for (int j = 1; j < num_bottoms; ++j) {
+      sum += coeffs[j] * bottom_data[j][index];
+    }
+    top_data[index] = sum;
+  }
+}
+
+template <typename Dtype>
+__global__ void EltwiseProdForward(const int n, const int num_bottoms,
+    const Dtype* const* bottom_data, Dtype* top_data) {
+  CUDA_KERNEL_LOOP(index, n) {
+    Dtype product = bottom_data[0][index];
+    for (int j = 1; j < num_bottoms; ++j) {
+      product *= bottom_data[j][index];
+    }
+    top_data[index] = product;
+  }
+}
+
+template <typename Dtype>
+__global__ void EltwiseMaxForward(const int n, const int num_bottoms,
+    const Dtype* const* bottom_data, Dtype* top_data, Dtype* max_idx) {
+  CUDA_KERNEL_LOOP(index, n) {
+    Dtype maximum = bottom_data[0][index];
+    int max_index = 0;
+    for (int j = 1; j < num_bottoms; ++j) {
+      if (bottom_data[j][index] > maximum) {
+        maximum = bottom_data[j][index];
+        max_index = j;
+      }
+    }
+    top_data[index] = maximum;
+    max_idx[index] = max_index;
+  }
+}
+
+template <typename Dtype>
+Dtype EltwiseLayer<Dtype>::Forward_gpu(
+    const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
+  const int count = (*top)[0]->count();
+  const int num_bottoms = bottom.size();
+  vector<const Dtype*> data(num_bottoms);
+  for (int j = 0; j < num_bottoms; ++j) {
+    data[j] = bottom[j]->gpu_data();
+  }
+  const Dtype* const* bottom_data = static_cast<const Dtype* const*>(
+      DevicePointers(data, data_pointers_.get()));
+  Dtype* top_data = (*top)[0]->mutable_gpu_data();
+  switch (op_) {
+  case EltwiseParameter_EltwiseOp_SUM:
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    EltwiseSumForward<Dtype><<<CAFFE_GET_BLOCKS(count),
+        CAFFE_CUDA_NUM_THREADS>>>(count, num_bottoms, bottom_data,
+        coeffs_.gpu_data(), top_data);
+    break;
+  case EltwiseParameter_EltwiseOp_PROD:
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    EltwiseProdForward<Dtype><<<CAFFE_GET_BLOCKS(count),
+        CAFFE_CUDA_NUM_THREADS>>>(count, num_bottoms, bottom_data, top_data);
+    break;
+  case EltwiseParameter_EltwiseOp_MAX:
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    EltwiseMaxForward<Dtype><<<CAFFE_GET_BLOCKS(count),
+        CAFFE_CUDA_NUM_THREADS>>>(count, num_bottoms, bottom_data, top_data,
+        max_idx_.mutable_gpu_data());
+    break;
+  default:
+    LOG(FATAL) << "Unknown elementwise operation " << op_;
+  }
+  CUDA_POST_KERNEL_CHECK;
+  return Dtype(0.);
+}
+
+template <typename Dtype>
+__global__ void EltwiseSumBackward(const int n, const int num_bottoms,
+    const Dtype* top_diff, const Dtype* coeffs, Dtype* const* bottom_diff) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const Dtype diff = top_diff[index];
+    for (int j = 0; j < num_bottoms; ++j) {
+      bottom_diff[j][index] = coeffs[j] * diff;
+    }
+  }
+}
+
+template <typename Dtype>
+__global__ void EltwiseProdBackward(const int n, const int num_bottoms,
+    const Dtype* top_diff, const Dtype* const* bottom_data,
+    Dtype* const* bottom_diff) {
+  CUDA_KERNEL_LOOP(index, n) {
+    // The products of the bottoms before each bottom, then after it
+    Dtype product = top_diff[index];
+    for (int j = 0; j < num_bottoms; ++j) {
+      bottom_diff[j][index] = product;
+      product *= bottom_data[j][index];
+    }
+    product = 1;
+    for (int j = num_bottoms - 1; j >= 0; --j) {
+      bottom_diff[j][index] *= product;
+      product *= bottom_data[j][index];
+    }
+  }
+}
+
+template <typename Dtype>
+__global__ void EltwiseMaxBackward(const int n, const int num_bottoms,
+    const Dtype* top_diff, const Dtype* max_idx, Dtype* const* bottom_diff) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const Dtype diff = top_diff[index];
+    const int max_index = static_cast<int>(max_idx[index]);
+    for (int j = 0; j < num_bottoms; ++j) {
+      bottom_diff[j][index] = j == max_index ? diff : Dtype(0);
+    }
+  }
+}
+
+template <typename Dtype>
+void EltwiseLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
+    const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
+  const int count = top[0]->count();
+  const int num_bottoms = bottom->size();
+  const Dtype* top_diff = top[0]->gpu_diff();
+  vector<Dtype*> diff(num_bottoms);
+  for (int j = 0; j < num_bottoms; ++j) {
+    diff[j] = (*bottom)[j]->mutable_gpu_diff();
+  }
+  Dtype* const* bottom_diff = static_cast<Dtype* const*>(
+      DevicePointers(diff, diff_pointers_.get()));
+  switch (op_) {
+  case EltwiseParameter_EltwiseOp_SUM:
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    EltwiseSumBackward<Dtype><<<CAFFE_GET_BLOCKS(count),
+        CAFFE_CUDA_NUM_THREADS>>>(count, num_bottoms, top_diff,
+        coeffs_.gpu_data(), bottom_diff);
+    break;
+  case EltwiseParameter_EltwiseOp_PROD: {
+    vector<const Dtype*> data(num_bottoms);
+    for (int j = 0; j < num_bottoms; ++j) {
+      data[j] = (*bottom)[j]->gpu_data();
+    }
+    const Dtype* const* bottom_data = static_cast<const Dtype* const*>(
+        DevicePointers(data, data_pointers_.get()));
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    EltwiseProdBackward<Dtype><<<CAFFE_GET_BLOCKS(count),
+        CAFFE_CUDA_NUM_THREADS>>>(count, num_bottoms, top_diff, bottom_data,
+        bottom_diff);
+    break;
+  }
+  case EltwiseParameter_EltwiseOp_MAX:
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    EltwiseMaxBackward<Dtype><<<CAFFE_GET_BLOCKS(count),
+        CAFFE_CUDA_NUM_THREADS>>>(count, num_bottoms, top_diff,
+        max_idx_.gpu_data(), bottom_diff);
+    break;
+  default:
+    LOG(FATAL) << "Unknown elementwise operation " << op_;
+  }
+  CUDA_POST_KERNEL_CHECK;
+}
+
+INSTANTIATE_CLASS(EltwiseLayer);
+
+
+}  // namespace caffe
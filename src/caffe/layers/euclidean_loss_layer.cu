@@ -0,0 +1,45 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/vision_layers.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+Dtype EuclideanLossLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+    vector<Blob<Dtype>*>* top) {
+  int count = bottom[0]->count();
+  caffe_gpu_copy(count, bottom[0]->gpu_data(), diff_.mutable_gpu_data());
+  caffe_gpu_axpy(count, Dtype(-1), bottom[1]->gpu_data(),
+      diff_.mutable_gpu_data());
+  if (this->device_loss_) {
+    caffe_gpu_dot_add(count, diff_.gpu_data(), diff_.gpu_data(),
+        Dtype(0.5) / bottom[0]->num(), this->device_loss_);
+    return Dtype(0);
+  }
+  Dtype dot;
+  caffe_gpu_dot(count, diff_.gpu_data(), diff_.gpu_data(), &dot);
+  Dtype loss = dot / bottom[0]->num() / Dtype(2);
+  return loss;
+}
+
+template <typename Dtype>
+void EuclideanLossLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
+    const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
+  caffe_gpu_axpby(
+      (*bottom)[0]->count(),              // count
+      Dtype(1) / (*bottom)[0]->num(),     // alpha
+      diff_.gpu_data(),                   // a
+      Dtype(0),                           // beta
+      (*bottom)[0]->mutable_gpu_diff());  // b
+}
+
+INSTANTIATE_CLASS(EuclideanLossLayer);
+
+}  // namespace caffe
@@ -0,0 +1,118 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <climits>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/util/cpu_threads.hpp"
+#include "caffe/util/fuse_neurons.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void FusedNeuronLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top) {
+  NeuronLayer<Dtype>::SetUp(bottom, top);
+  const FusedNeuronParameter& fused_param =
+      this->layer_param_.fused_neuron_param();
+  ops_.num_ops = fused_param.layer_size();
+  CHECK_GE(ops_.num_ops, 1) << "Fused layer has no neuron layers.";
+  CHECK_LE(ops_.num_ops, kMaxFusedNeurons) << "Too many neuron layers.";
+  ops_.train = false;
+  for (int k = 0; k < ops_.num_ops; ++k) {
+    const LayerParameter& layer_param = fused_param.layer(k);
+    CHECK(CanFuseNeuron(layer_param.type(), k == 0))
+        << "Cannot fuse layer " << layer_param.name();
+    switch (layer_param.type()) {
+    case LayerParameter_LayerType_RELU:
+      ops_.type[k] = FusedNeuronOps::RELU;
+      break;
+    case LayerParameter_LayerType_SIGMOID:
+      ops_.type[k] = FusedNeuronOps::SIGMOID;
+      break;
+    case LayerParameter_LayerType_TANH:
+      ops_.type[k] = FusedNeuronOps::TANH;
+      break;
+    case LayerParameter_LayerType_DROPOUT: {
+      ops_.type[k] = FusedNeuronOps::DROPOUT;
+      // As in DropoutLayer
+      const Dtype threshold = layer_param.dropout_param().dropout_ratio();
+      DCHECK(threshold > 0.);
+      DCHECK(threshold < 1.);
+      ops_.scale[k] = Dtype(1. / (1. - threshold));
+      ops_.threshold[k] = static_cast<unsigned int>(UINT_MAX * threshold);
+      ops_.key[k][0] = 0;
+      ops_.key[k][1] = 0;
+      break;
+    }
+    default:
+      LOG(FATAL) << "Unknown neuron layer type " << layer_param.type();
+    }
+  }
+}
+
+template <typename Dtype>
+void FusedNeuronLayer<Dtype>::PrepareForward() {
+  ops_.train = Caffe::phase() == Caffe::TRAIN;
+  if (ops_.train && !this->recomputing_) {
+    // Draw the keys from the Caffe RNG in the order the dropout layers would.
+    for (int k = 0; k < ops_.num_ops; ++k) {
+      if (ops_.type[k] == FusedNeuronOps::DROPOUT) {
+        ops_.key[k][0] = caffe_rng_rand();
+        ops_.key[k][1] = caffe_rng_rand();
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+Dtype FusedNeuronLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+    vector<Blob<Dtype>*>* top) {
+  PrepareForward();
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  Dtype* top_data = (*top)[0]->mutable_cpu_data();
+  const int count = bottom[0]->count();
+  const int num_blocks =
+      (count + kFusedNeuronBlockSize - 1) / kFusedNeuronBlockSize;
+  // split over the threads by 1024 blocks at least
+  const int num_threads = CpuLayerThreads(num_blocks / 1024 + 1);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int block = 0; block < num_blocks; ++block) {
+    FusedNeuronForwardBlock(ops_, block, count, bottom_data, top_data);
+  }
+  return Dtype(0);
+}
+
+template <typename Dtype>
+void FusedNeuronLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
+    const bool propagate_down,
+    vector<Blob<Dtype>*>* bottom) {
+  CHECK(Caffe::phase() == Caffe::TRAIN);
+  if (propagate_down) {
+    const Dtype* top_data = top[0]->cpu_data();
+    const Dtype* top_diff = top[0]->cpu_diff();
+    Dtype* bottom_diff = (*bottom)[0]->mutable_cpu_diff();
+    const int count = (*bottom)[0]->count();
+    const int num_blocks =
+        (count + kFusedNeuronBlockSize - 1) / kFusedNeuronBlockSize;
+    const int num_threads = CpuLayerThreads(num_blocks / 1024 + 1);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+    for (int block = 0; block < num_blocks; ++block) {
+      FusedNeuronBackwardBlock(ops_, block, count, top_data, top_diff,
+          bottom_diff);
+    }
+  }
+}
+
+
+INSTANTIATE_CLASS(FusedNeuronLayer);
+
+
+}  // namespace caffe
@@ -0,0 +1,70 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/util/fuse_neurons.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+__global__ void FusedNeuronForward(const int num_blocks, const int count,
+    const FusedNeuronOps ops, const Dtype* in, Dtype* out) {
+  CUDA_KERNEL_LOOP(block, num_blocks) {
+    FusedNeuronForwardBlock(ops, block, count, in, out);
+  }
+}
+
+template <typename Dtype>
+__global__ void FusedNeuronBackward(const int num_blocks, const int count,
+    const FusedNeuronOps ops, const Dtype* top_data, const Dtype* top_diff,
+    Dtype* bottom_diff) {
+  CUDA_KERNEL_LOOP(block, num_blocks) {
+    FusedNeuronBackwardBlock(ops, block, count, top_data, top_diff,
+        bottom_diff);
+  }
+}
+
+template <typename Dtype>
+Dtype FusedNeuronLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+    vector<Blob<Dtype>*>* top) {
+  PrepareForward();
+  const Dtype* bottom_data = bottom[0]->gpu_data();
+  Dtype* top_data = (*top)[0]->mutable_gpu_data();
+  const int count = bottom[0]->count();
+  const int num_blocks =
+      (count + kFusedNeuronBlockSize - 1) / kFusedNeuronBlockSize;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  FusedNeuronForward<Dtype><<<CAFFE_GET_BLOCKS(num_blocks),
+                              CAFFE_CUDA_NUM_THREADS>>>(
+      num_blocks, count, ops_, bottom_data, top_data);
+  CUDA_POST_KERNEL_CHECK;
+  return Dtype(0);
+}
+
+template <typename Dtype>
+void FusedNeuronLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
+    const bool propagate_down,
+    vector<Blob<Dtype>*>* bottom) {
+  CHECK(Caffe::phase() == Caffe::TRAIN);
+  if (propagate_down) {
+    const Dtype* top_data = top[0]->gpu_data();
+    const Dtype* top_diff = top[0]->gpu_diff();
+    Dtype* bottom_diff = (*bottom)[0]->mutable_gpu_diff();
+    const int count = (*bottom)[0]->count();
+    const int num_blocks =
+        (count + kFusedNeuronBlockSize - 1) / kFusedNeuronBlockSize;
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    FusedNeuronBackward<Dtype><<<CAFFE_GET_BLOCKS(num_blocks),
+                                 CAFFE_CUDA_NUM_THREADS>>>(
+        num_blocks, count, ops_, top_data, top_diff, bottom_diff);
+    CUDA_POST_KERNEL_CHECK;
+  }
+}
+
+INSTANTIATE_CLASS(FusedNeuronLayer);
+
+
+}  // namespace caffe
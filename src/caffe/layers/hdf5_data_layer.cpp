@@ -1,13 +1,8 @@
 // Copyright 2014 BVLC and contributors.
-/*
-TODO:
-- load file in a separate thread ("prefetch")
-- can be smarter about the memcpy call instead of doing it row-by-row
-  :: use util functions caffe_copy, and Blob->offset()
-  :: don't forget to update hdf5_daa_layer.cu accordingly
-- add ability to shuffle filenames if flag is set
-*/
 #include <stdint.h>
+#include <pthread.h>
+
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <fstream>  // NOLINT(readability/streams)
@@ -17,36 +12,136 @@ TODO:
 
 #include "caffe/layer.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/rng.hpp"
 #include "caffe/vision_layers.hpp"
 
 namespace caffe {
 
 template <typename Dtype>
-HDF5DataLayer<Dtype>::~HDF5DataLayer<Dtype>() { }
+void HDF5DataLayerPrefetchBatch(HDF5DataLayer<Dtype>* layer,
+    const int batch_id) {
+  CHECK(layer);
+  const int batch_size = layer->layer_param_.hdf5_data_param().batch_size();
+  Dtype* top_data = layer->prefetch_data_[batch_id]->mutable_cpu_data();
+  Dtype* top_label = layer->prefetch_label_[batch_id]->mutable_cpu_data();
+  const int data_count = layer->prefetch_data_[batch_id]->count() / batch_size;
+  const int label_data_count =
+      layer->prefetch_label_[batch_id]->count() / batch_size;
+
+  // Read the batch straight into the buffer, as few chunks of consecutive
+  // rows as the file boundaries allow.
+  for (int item_id = 0; item_id < batch_size; ) {
+    if (layer->current_row_ == layer->file_rows_) {
+      layer->NextHDF5File();
+    }
+    const hsize_t num_rows = std::min(
+        static_cast<hsize_t>(batch_size - item_id),
+        layer->file_rows_ - layer->current_row_);
+    hdf5_load_nd_dataset_rows(layer->data_dataset_id_, layer->current_row_,
+        num_rows, top_data + item_id * data_count);
+    hdf5_load_nd_dataset_rows(layer->label_dataset_id_, layer->current_row_,
+        num_rows, top_label + item_id * label_data_count);
+    item_id += num_rows;
+    layer->current_row_ += num_rows;
+  }
+}
 
-// Load data and label from HDF5 filename into the class property blobs.
 template <typename Dtype>
-void HDF5DataLayer<Dtype>::LoadHDF5FileData(const char* filename) {
-  LOG(INFO) << "Loading HDF5 file" << filename;
-  hid_t file_id = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
-  if (file_id < 0) {
-    LOG(ERROR) << "Failed opening HDF5 file" << filename;
-    return;
+void* HDF5DataLayerPrefetch(void* layer_pointer) {
+  CHECK(layer_pointer);
+  HDF5DataLayer<Dtype>* layer =
+      static_cast<HDF5DataLayer<Dtype>*>(layer_pointer);
+  // Keep filling buffers as Forward hands them back, until asked to exit.
+  while (true) {
+    const int batch_id = layer->prefetch_free_.pop();
+    if (batch_id < 0) {
+      break;
+    }
+    HDF5DataLayerPrefetchBatch(layer, batch_id);
+    layer->prefetch_full_.push(batch_id);
   }
 
+  return static_cast<void*>(NULL);
+}
+
+template <typename Dtype>
+HDF5DataLayer<Dtype>::~HDF5DataLayer<Dtype>() {
+  if (!prefetch_data_.empty()) {
+    JoinPrefetchThread();
+  }
+  CloseHDF5File();
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::OpenHDF5File(const char* filename) {
+  CloseHDF5File();
+  LOG(INFO) << "Opening HDF5 file " << filename;
+  file_id_ = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+  CHECK_GE(file_id_, 0) << "Failed opening HDF5 file " << filename;
+
+  // Only the shapes are read here; the rows are read a batch at a time.
   const int MIN_DATA_DIM = 2;
   const int MAX_DATA_DIM = 4;
-  hdf5_load_nd_dataset(
-    file_id, "data",  MIN_DATA_DIM, MAX_DATA_DIM, &data_blob_);
+  hdf5_load_nd_dataset_helper(
+    file_id_, HDF5_DATA_DATASET_NAME, MIN_DATA_DIM, MAX_DATA_DIM,
+    &data_shape_);
 
   const int MIN_LABEL_DIM = 1;
   const int MAX_LABEL_DIM = 2;
-  hdf5_load_nd_dataset(
-    file_id, "label", MIN_LABEL_DIM, MAX_LABEL_DIM, &label_blob_);
+  hdf5_load_nd_dataset_helper(
+    file_id_, HDF5_DATA_LABEL_NAME, MIN_LABEL_DIM, MAX_LABEL_DIM,
+    &label_shape_);
 
-  herr_t status = H5Fclose(file_id);
-  CHECK_EQ(data_blob_.num(), label_blob_.num());
-  LOG(INFO) << "Successully loaded " << data_blob_.num() << " rows";
+  CHECK_EQ(data_shape_.num(), label_shape_.num());
+  CHECK_GT(data_shape_.num(), 0) << "No rows in HDF5 file " << filename;
+  data_dataset_id_ = H5Dopen2(file_id_, HDF5_DATA_DATASET_NAME, H5P_DEFAULT);
+  CHECK_GE(data_dataset_id_, 0) << "Failed opening the data of " << filename;
+  label_dataset_id_ = H5Dopen2(file_id_, HDF5_DATA_LABEL_NAME, H5P_DEFAULT);
+  CHECK_GE(label_dataset_id_, 0) << "Failed opening the labels of "
+      << filename;
+  file_rows_ = data_shape_.num();
+  current_row_ = 0;
+  LOG(INFO) << "Reading " << file_rows_ << " rows";
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::CloseHDF5File() {
+  if (file_id_ < 0) {
+    return;
+  }
+  H5Dclose(data_dataset_id_);
+  H5Dclose(label_dataset_id_);
+  H5Fclose(file_id_);
+  file_id_ = data_dataset_id_ = label_dataset_id_ = -1;
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::NextHDF5File() {
+  if (num_files_ > 1) {
+    current_file_ += 1;
+    if (current_file_ == num_files_) {
+      current_file_ = 0;
+      LOG(INFO) << "looping around to first file";
+      if (this->layer_param_.hdf5_data_param().shuffle()) {
+        ShuffleFiles();
+      }
+    }
+    OpenHDF5File(hdf_filenames_[current_file_].c_str());
+    // The rows of every file must fit the top blobs.
+    CHECK_EQ(data_shape_.count() / data_shape_.num(),
+             prefetch_data_[0]->count() / prefetch_data_[0]->num());
+    CHECK_EQ(label_shape_.count() / label_shape_.num(),
+             prefetch_label_[0]->count() / prefetch_label_[0]->num());
+  }
+  current_row_ = 0;
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::ShuffleFiles() {
+  for (int i = num_files_ - 1; i > 0; --i) {
+    std::swap(hdf_filenames_[i], hdf_filenames_[PrefetchRand() % (i + 1)]);
+  }
 }
 
 template <typename Dtype>
@@ -54,6 +149,12 @@ void HDF5DataLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
   CHECK_EQ(bottom.size(), 0) << "HDF5DataLayer takes no input blobs.";
   CHECK_EQ(top->size(), 2) << "HDF5DataLayer takes two blobs as output.";
+  // Setting up again starts over from the first file.
+  if (!prefetch_data_.empty()) {
+    JoinPrefetchThread();
+    int batch_id;
+    while (prefetch_full_.try_pop(&batch_id)) {}
+  }
 
   // Read the source to parse the filenames.
   const string& source = this->layer_param_.hdf5_data_param().source();
@@ -68,50 +169,93 @@ void HDF5DataLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
   }
   source_file.close();
   num_files_ = hdf_filenames_.size();
+  CHECK_GT(num_files_, 0) << "No HDF5 files listed in " << source;
   current_file_ = 0;
   LOG(INFO) << "Number of files: " << num_files_;
 
-  // Load the first HDF5 file and initialize the line counter.
-  LoadHDF5FileData(hdf_filenames_[current_file_].c_str());
-  current_row_ = 0;
+  if (this->layer_param_.hdf5_data_param().shuffle()) {
+    const unsigned int prefetch_rng_seed = caffe_rng_rand();
+    prefetch_rng_.reset(new Caffe::RNG(prefetch_rng_seed));
+    ShuffleFiles();
+  } else {
+    prefetch_rng_.reset();
+  }
+
+  // Open the first HDF5 file, which initializes the row counter.
+  OpenHDF5File(hdf_filenames_[current_file_].c_str());
 
   // Reshape blobs.
   const int batch_size = this->layer_param_.hdf5_data_param().batch_size();
-  (*top)[0]->Reshape(batch_size, data_blob_.channels(),
-                     data_blob_.width(), data_blob_.height());
-  (*top)[1]->Reshape(batch_size, label_blob_.channels(),
-                     label_blob_.width(), label_blob_.height());
+  const int prefetch_batches =
+      this->layer_param_.hdf5_data_param().prefetch_batches();
+  CHECK_GT(prefetch_batches, 0);
+  (*top)[0]->Reshape(batch_size, data_shape_.channels(),
+                     data_shape_.width(), data_shape_.height());
+  (*top)[1]->Reshape(batch_size, label_shape_.channels(),
+                     label_shape_.width(), label_shape_.height());
   LOG(INFO) << "output data size: " << (*top)[0]->num() << ","
       << (*top)[0]->channels() << "," << (*top)[0]->height() << ","
       << (*top)[0]->width();
+  prefetch_data_.resize(prefetch_batches);
+  prefetch_label_.resize(prefetch_batches);
+  for (int batch_id = 0; batch_id < prefetch_batches; ++batch_id) {
+    prefetch_data_[batch_id].reset(new Blob<Dtype>());
+    prefetch_data_[batch_id]->ReshapeLike(*(*top)[0]);
+    prefetch_label_[batch_id].reset(new Blob<Dtype>());
+    prefetch_label_[batch_id]->ReshapeLike(*(*top)[1]);
+  }
+  // Now, start the prefetch thread. Before calling prefetch, we make two
+  // cpu_data calls so that the prefetch thread does not accidentally make
+  // simultaneous cudaMalloc calls when the main thread is running. In some
+  // GPUs this seems to cause failures if we do not so.
+  for (int batch_id = 0; batch_id < prefetch_batches; ++batch_id) {
+    prefetch_data_[batch_id]->mutable_cpu_data();
+    prefetch_label_[batch_id]->mutable_cpu_data();
+    prefetch_free_.push(batch_id);
+  }
+  DLOG(INFO) << "Initializing prefetch";
+  CreatePrefetchThread();
+  DLOG(INFO) << "Prefetch initialized.";
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::CreatePrefetchThread() {
+  CHECK(!pthread_create(&thread_, NULL, HDF5DataLayerPrefetch<Dtype>,
+        static_cast<void*>(this))) << "Pthread execution failed.";
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::JoinPrefetchThread() {
+  // Drop the buffers still waiting to be filled so that the prefetch thread
+  // exits as soon as it has finished the batch in hand.
+  int batch_id;
+  while (prefetch_free_.try_pop(&batch_id)) {}
+  prefetch_free_.push(-1);
+  CHECK(!pthread_join(thread_, NULL)) << "Pthread joining failed.";
+}
+
+template <typename Dtype>
+unsigned int HDF5DataLayer<Dtype>::PrefetchRand() {
+  CHECK(prefetch_rng_);
+  caffe::rng_t* prefetch_rng =
+      static_cast<caffe::rng_t*>(prefetch_rng_->generator());
+  return (*prefetch_rng)();
 }
 
 template <typename Dtype>
 Dtype HDF5DataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
-  const int batch_size = this->layer_param_.hdf5_data_param().batch_size();
-  const int data_count = (*top)[0]->count() / (*top)[0]->num();
-  const int label_data_count = (*top)[1]->count() / (*top)[1]->num();
-
-  for (int i = 0; i < batch_size; ++i, ++current_row_) {
-    if (current_row_ == data_blob_.num()) {
-      if (num_files_ > 1) {
-        current_file_ += 1;
-        if (current_file_ == num_files_) {
-          current_file_ = 0;
-          LOG(INFO) << "looping around to first file";
-        }
-        LoadHDF5FileData(hdf_filenames_[current_file_].c_str());
-      }
-      current_row_ = 0;
-    }
-    memcpy(&(*top)[0]->mutable_cpu_data()[i * data_count],
-           &data_blob_.cpu_data()[current_row_ * data_count],
-           sizeof(Dtype) * data_count);
-    memcpy(&(*top)[1]->mutable_cpu_data()[i * label_data_count],
-            &label_blob_.cpu_data()[current_row_ * label_data_count],
-            sizeof(Dtype) * label_data_count);
-  }
+  // First, wait for the next prefetched batch
+  const int batch_id = prefetch_full_.pop();
+  // Copy the data
+  caffe_copy(prefetch_data_[batch_id]->count(),
+             prefetch_data_[batch_id]->cpu_data(),
+             (*top)[0]->mutable_cpu_data());
+  caffe_copy(prefetch_label_[batch_id]->count(),
+             prefetch_label_[batch_id]->cpu_data(),
+             (*top)[1]->mutable_cpu_data());
+  // Hand the buffer back to the prefetch thread
+  prefetch_free_.push(batch_id);
   return Dtype(0.);
 }
 
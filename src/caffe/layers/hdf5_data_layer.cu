@@ -1,8 +1,4 @@
 // Copyright 2014 BVLC and contributors.
-/*
-TODO:
-- only load parts of the file, in accordance with a prototxt param "max_mem"
-*/
 
 #include <stdint.h>
 #include <string>
@@ -22,35 +18,19 @@ namespace caffe {
 template <typename Dtype>
 Dtype HDF5DataLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
-  const int batch_size = this->layer_param_.hdf5_data_param().batch_size();
-  const int data_count = (*top)[0]->count() / (*top)[0]->num();
-  const int label_data_count = (*top)[1]->count() / (*top)[1]->num();
-
-  for (int i = 0; i < batch_size; ++i, ++current_row_) {
-    if (current_row_ == data_blob_.num()) {
-      if (num_files_ > 1) {
-        current_file_ += 1;
-
-        if (current_file_ == num_files_) {
-          current_file_ = 0;
-          LOG(INFO) << "looping around to first file";
-        }
-
-        LoadHDF5FileData(hdf_filenames_[current_file_].c_str());
-      }
-      current_row_ = 0;
-    }
-    CUDA_CHECK(cudaMemcpy(
-            &(*top)[0]->mutable_gpu_data()[i * data_count],
-            &data_blob_.cpu_data()[current_row_ * data_count],
-            sizeof(Dtype) * data_count,
-            cudaMemcpyHostToDevice));
-    CUDA_CHECK(cudaMemcpy(
-            &(*top)[1]->mutable_gpu_data()[i * label_data_count],
-            &label_blob_.cpu_data()[current_row_ * label_data_count],
-            sizeof(Dtype) * label_data_count,
-            cudaMemcpyHostToDevice));
-  }
+  // First, wait for the next prefetched batch
+  const int batch_id = prefetch_full_.pop();
+  // Copy the data
+  CUDA_CHECK(cudaMemcpy((*top)[0]->mutable_gpu_data(),
+      prefetch_data_[batch_id]->cpu_data(),
+      sizeof(Dtype) * prefetch_data_[batch_id]->count(),
+      cudaMemcpyHostToDevice));
+  CUDA_CHECK(cudaMemcpy((*top)[1]->mutable_gpu_data(),
+      prefetch_label_[batch_id]->cpu_data(),
+      sizeof(Dtype) * prefetch_label_[batch_id]->count(),
+      cudaMemcpyHostToDevice));
+  // Hand the buffer back to the prefetch thread
+  prefetch_free_.push(batch_id);
   return Dtype(0.);
 }
 
@@ -1,5 +1,8 @@
 // Copyright 2014 BVLC and contributors.
 
+#include <pthread.h>
+
+#include <algorithm>
 #include <vector>
 
 #include "hdf5.h"
@@ -9,15 +12,42 @@
 #include "caffe/common.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
 #include "caffe/vision_layers.hpp"
 
 namespace caffe {
 using std::vector;
 
+template <typename Dtype>
+void* HDF5OutputLayerWrite(void* layer_pointer) {
+  CHECK(layer_pointer);
+  HDF5OutputLayer<Dtype>* layer =
+      static_cast<HDF5OutputLayer<Dtype>*>(layer_pointer);
+  // Append the batches in the order Forward queued them, until asked to
+  // exit.
+  while (true) {
+    const int batch_id = layer->write_full_.pop();
+    if (batch_id < 0) {
+      break;
+    }
+    const Blob<Dtype>& data = *layer->write_data_[batch_id];
+    const Blob<Dtype>& label = *layer->write_label_[batch_id];
+    hdf5_append_nd_dataset_rows(layer->data_dataset_id_, data.num(),
+        data.cpu_data());
+    hdf5_append_nd_dataset_rows(layer->label_dataset_id_, label.num(),
+        label.cpu_data());
+    layer->write_free_.push(batch_id);
+  }
+
+  return static_cast<void*>(NULL);
+}
+
 template <typename Dtype>
 HDF5OutputLayer<Dtype>::HDF5OutputLayer(const LayerParameter& param)
     : Layer<Dtype>(param),
-      file_name_(param.hdf5_output_param().file_name()) {
+      file_name_(param.hdf5_output_param().file_name()),
+      data_dataset_id_(-1), label_dataset_id_(-1), data_row_size_(0),
+      label_row_size_(0) {
   /* create a HDF5 file */
   file_id_ = H5Fcreate(file_name_.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT,
                        H5P_DEFAULT);
@@ -26,19 +56,28 @@ HDF5OutputLayer<Dtype>::HDF5OutputLayer(const LayerParameter& param)
 
 template <typename Dtype>
 HDF5OutputLayer<Dtype>::~HDF5OutputLayer<Dtype>() {
+  if (!write_data_.empty()) {
+    JoinWriteThread();
+  }
+  if (data_dataset_id_ >= 0) {
+    H5Dclose(data_dataset_id_);
+  }
+  if (label_dataset_id_ >= 0) {
+    H5Dclose(label_dataset_id_);
+  }
   herr_t status = H5Fclose(file_id_);
   CHECK_GE(status, 0) << "Failed to close HDF5 file " << file_name_;
 }
 
+// The rows of a chunk of the dataset of blob's rows
 template <typename Dtype>
-void HDF5OutputLayer<Dtype>::SaveBlobs() {
-  // TODO: no limit on the number of blobs
-  LOG(INFO) << "Saving HDF5 file" << file_name_;
-  CHECK_EQ(data_blob_.num(), label_blob_.num()) <<
-      "data blob and label blob must have the same batch size";
-  hdf5_save_nd_dataset(file_id_, HDF5_DATA_DATASET_NAME, data_blob_);
-  hdf5_save_nd_dataset(file_id_, HDF5_DATA_LABEL_NAME, label_blob_);
-  LOG(INFO) << "Successfully saved " << data_blob_.num() << " rows";
+static int ChunkRows(const HDF5OutputParameter& param,
+    const Blob<Dtype>& blob) {
+  if (param.chunk_rows()) {
+    return param.chunk_rows();
+  }
+  const int row_size = sizeof(Dtype) * blob.count() / blob.num();
+  return std::max(1, (1 << 20) / row_size);
 }
 
 template <typename Dtype>
@@ -47,29 +86,70 @@ void HDF5OutputLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
   // TODO: no limit on the number of blobs
   CHECK_EQ(bottom.size(), 2) << "HDF5OutputLayer takes two blobs as input.";
   CHECK_EQ(top->size(), 0) << "HDF5OutputLayer takes no output blobs.";
+  CHECK_EQ(bottom[0]->num(), bottom[1]->num()) <<
+      "data blob and label blob must have the same batch size";
+  const HDF5OutputParameter& param = this->layer_param_.hdf5_output_param();
+  const int write_batches = param.write_batches();
+  CHECK_GT(write_batches, 0);
+  CHECK(write_data_.empty()) << "HDF5OutputLayer is set up only once.";
+  data_dataset_id_ = hdf5_create_extendable_dataset<Dtype>(file_id_,
+      HDF5_DATA_DATASET_NAME, bottom[0]->channels(), bottom[0]->height(),
+      bottom[0]->width(), ChunkRows(param, *bottom[0]),
+      param.compression_level());
+  label_dataset_id_ = hdf5_create_extendable_dataset<Dtype>(file_id_,
+      HDF5_DATA_LABEL_NAME, bottom[1]->channels(), bottom[1]->height(),
+      bottom[1]->width(), ChunkRows(param, *bottom[1]),
+      param.compression_level());
+  data_row_size_ = bottom[0]->count() / bottom[0]->num();
+  label_row_size_ = bottom[1]->count() / bottom[1]->num();
+  write_data_.resize(write_batches);
+  write_label_.resize(write_batches);
+  for (int batch_id = 0; batch_id < write_batches; ++batch_id) {
+    write_data_[batch_id].reset(new Blob<Dtype>());
+    write_label_[batch_id].reset(new Blob<Dtype>());
+    write_free_.push(batch_id);
+  }
+  CHECK(!pthread_create(&thread_, NULL, HDF5OutputLayerWrite<Dtype>,
+        static_cast<void*>(this))) << "Pthread execution failed.";
 }
 
 template <typename Dtype>
-Dtype HDF5OutputLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
-      vector<Blob<Dtype>*>* top) {
+void HDF5OutputLayer<Dtype>::JoinWriteThread() {
+  // Every batch queued before the exit request is still written.
+  write_full_.push(-1);
+  CHECK(!pthread_join(thread_, NULL)) << "Pthread joining failed.";
+}
+
+template <typename Dtype>
+void HDF5OutputLayer<Dtype>::QueueBatch(const vector<Blob<Dtype>*>& bottom,
+    const bool gpu) {
   CHECK_GE(bottom.size(), 2);
   CHECK_EQ(bottom[0]->num(), bottom[1]->num());
-  data_blob_.Reshape(bottom[0]->num(), bottom[0]->channels(),
-                     bottom[0]->height(), bottom[0]->width());
-  label_blob_.Reshape(bottom[1]->num(), bottom[1]->channels(),
-                     bottom[1]->height(), bottom[1]->width());
-  const int data_datum_dim = bottom[0]->count() / bottom[0]->num();
-  const int label_datum_dim = bottom[1]->count() / bottom[1]->num();
-
-  for (int i = 0; i < bottom[0]->num(); ++i) {
-    memcpy(&data_blob_.mutable_cpu_data()[i * data_datum_dim],
-           &bottom[0]->cpu_data()[i * data_datum_dim],
-           sizeof(Dtype) * data_datum_dim);
-    memcpy(&label_blob_.mutable_cpu_data()[i * label_datum_dim],
-           &bottom[1]->cpu_data()[i * label_datum_dim],
-           sizeof(Dtype) * label_datum_dim);
+  CHECK_EQ(bottom[0]->count(), bottom[0]->num() * data_row_size_)
+      << "The data rows do not match those of the dataset";
+  CHECK_EQ(bottom[1]->count(), bottom[1]->num() * label_row_size_)
+      << "The label rows do not match those of the dataset";
+  const int batch_id = write_free_.pop();
+  Blob<Dtype>* buffers[] = { write_data_[batch_id].get(),
+      write_label_[batch_id].get() };
+  for (int i = 0; i < 2; ++i) {
+    buffers[i]->ReshapeLike(*bottom[i]);
+    if (gpu) {
+      CUDA_CHECK(cudaMemcpy(buffers[i]->mutable_cpu_data(),
+          bottom[i]->gpu_data(), sizeof(Dtype) * bottom[i]->count(),
+          cudaMemcpyDeviceToHost));
+    } else {
+      caffe_copy(bottom[i]->count(), bottom[i]->cpu_data(),
+          buffers[i]->mutable_cpu_data());
+    }
   }
-  SaveBlobs();
+  write_full_.push(batch_id);
+}
+
+template <typename Dtype>
+Dtype HDF5OutputLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top) {
+  QueueBatch(bottom, false);
   return Dtype(0.);
 }
 
@@ -39,6 +39,9 @@ Dtype HingeLossLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
 template <typename Dtype>
 void HingeLossLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
   Dtype* bottom_diff = (*bottom)[0]->mutable_cpu_diff();
   const Dtype* label = (*bottom)[1]->cpu_data();
   int num = (*bottom)[0]->num();
@@ -0,0 +1,79 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <algorithm>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/vision_layers.hpp"
+#include "caffe/util/math_functions.hpp"
+
+using std::max;
+
+namespace caffe {
+
+// The margins max(0, 1 -/+ x) of the outputs of the label/other classes
+template <typename Dtype>
+__global__ void HingeForward(const int n, const int dim,
+    const Dtype* bottom_data, const Dtype* label, Dtype* margin) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const Dtype sign = index % dim == static_cast<int>(label[index / dim]) ?
+        Dtype(-1) : Dtype(1);
+    margin[index] = max(Dtype(0), 1 + sign * bottom_data[index]);
+  }
+}
+
+// The gradient of the margins computed by HingeForward, scaled by 1 / num
+template <typename Dtype>
+__global__ void HingeBackward(const int n, const int dim, const Dtype scale,
+    const Dtype* label, Dtype* diff) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const Dtype sign = index % dim == static_cast<int>(label[index / dim]) ?
+        Dtype(-1) : Dtype(1);
+    diff[index] = diff[index] > 0 ? sign * scale : Dtype(0);
+  }
+}
+
+template <typename Dtype>
+Dtype HingeLossLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+    vector<Blob<Dtype>*>* top) {
+  const Dtype* bottom_data = bottom[0]->gpu_data();
+  Dtype* bottom_diff = bottom[0]->mutable_gpu_diff();
+  const Dtype* label = bottom[1]->gpu_data();
+  int num = bottom[0]->num();
+  int count = bottom[0]->count();
+  int dim = count / num;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  HingeForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
+      count, dim, bottom_data, label, bottom_diff);
+  CUDA_POST_KERNEL_CHECK;
+  if (this->device_loss_) {
+    caffe_gpu_dot_add(count, bottom_diff, static_cast<const Dtype*>(NULL),
+        Dtype(1) / num, this->device_loss_);
+    return Dtype(0);
+  }
+  // The margins are not negative: their sum is their absolute sum.
+  Dtype loss;
+  caffe_gpu_asum(count, bottom_diff, &loss);
+  return loss / num;
+}
+
+template <typename Dtype>
+void HingeLossLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
+    const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
+  Dtype* bottom_diff = (*bottom)[0]->mutable_gpu_diff();
+  const Dtype* label = (*bottom)[1]->gpu_data();
+  int num = (*bottom)[0]->num();
+  int count = (*bottom)[0]->count();
+  int dim = count / num;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  HingeBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
+      count, dim, Dtype(1. / num), label, bottom_diff);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+INSTANTIATE_CLASS(HingeLossLayer);
+
+}  // namespace caffe
@@ -4,6 +4,7 @@
 
 #include "caffe/layer.hpp"
 #include "caffe/util/im2col.hpp"
+#include "caffe/util/window_shape.hpp"
 #include "caffe/vision_layers.hpp"
 #include "caffe/common.hpp"
 
@@ -14,15 +15,20 @@ void Im2colLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
   CHECK_EQ(bottom.size(), 1) << "Im2col Layer takes a single blob as input.";
   CHECK_EQ(top->size(), 1) << "Im2col Layer takes a single blob as output.";
-  kernel_size_ = this->layer_param_.convolution_param().kernel_size();
-  stride_ = this->layer_param_.convolution_param().stride();
-  pad_ = this->layer_param_.convolution_param().pad();
+  const WindowShape shape =
+      GetWindowShape(this->layer_param_.convolution_param());
+  kernel_h_ = shape.kernel_h;
+  kernel_w_ = shape.kernel_w;
+  stride_h_ = shape.stride_h;
+  stride_w_ = shape.stride_w;
+  pad_h_ = shape.pad_h;
+  pad_w_ = shape.pad_w;
   channels_ = bottom[0]->channels();
   height_ = bottom[0]->height();
   width_ = bottom[0]->width();
-  (*top)[0]->Reshape(bottom[0]->num(), channels_ * kernel_size_ * kernel_size_,
-      (height_ + 2 * pad_ - kernel_size_) / stride_ + 1,
-      (width_ + 2 * pad_ - kernel_size_) / stride_ + 1);
+  (*top)[0]->Reshape(bottom[0]->num(), channels_ * kernel_h_ * kernel_w_,
+      (height_ + 2 * pad_h_ - kernel_h_) / stride_h_ + 1,
+      (width_ + 2 * pad_w_ - kernel_w_) / stride_w_ + 1);
 }
 
 template <typename Dtype>
@@ -32,7 +38,8 @@ Dtype Im2colLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   Dtype* top_data = (*top)[0]->mutable_cpu_data();
   for (int n = 0; n < bottom[0]->num(); ++n) {
     im2col_cpu(bottom_data + bottom[0]->offset(n), channels_, height_,
-        width_, kernel_size_, pad_, stride_, top_data + (*top)[0]->offset(n));
+        width_, kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_,
+        top_data + (*top)[0]->offset(n));
   }
   return Dtype(0.);
 }
@@ -40,11 +47,15 @@ Dtype Im2colLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
 template <typename Dtype>
 void Im2colLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
   const Dtype* top_diff = top[0]->cpu_diff();
   Dtype* bottom_diff = (*bottom)[0]->mutable_cpu_diff();
   for (int n = 0; n < top[0]->num(); ++n) {
     col2im_cpu(top_diff + top[0]->offset(n), channels_, height_, width_,
-        kernel_size_, pad_, stride_, bottom_diff + (*bottom)[0]->offset(n));
+        kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_,
+        bottom_diff + (*bottom)[0]->offset(n));
   }
 }
 
@@ -16,7 +16,8 @@ Dtype Im2colLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
   Dtype* top_data = (*top)[0]->mutable_gpu_data();
   for (int n = 0; n < bottom[0]->num(); ++n) {
     im2col_gpu(bottom_data + bottom[0]->offset(n), channels_, height_,
-        width_, kernel_size_, pad_, stride_, top_data + (*top)[0]->offset(n));
+        width_, kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_,
+        top_data + (*top)[0]->offset(n));
   }
   return Dtype(0.);
 }
@@ -24,11 +25,15 @@ Dtype Im2colLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
 template <typename Dtype>
 void Im2colLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
   const Dtype* top_diff = top[0]->gpu_diff();
   Dtype* bottom_diff = (*bottom)[0]->mutable_gpu_diff();
   for (int n = 0; n < top[0]->num(); ++n) {
     col2im_gpu(top_diff + top[0]->offset(n), channels_, height_, width_,
-        kernel_size_, pad_, stride_, bottom_diff + (*bottom)[0]->offset(n));
+        kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_,
+        bottom_diff + (*bottom)[0]->offset(n));
   }
 }
 
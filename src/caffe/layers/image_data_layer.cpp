@@ -1,132 +1,290 @@
 // Copyright 2014 BVLC and contributors.
 
+#include <limits.h>
 #include <stdint.h>
-#include <leveldb/db.h>
 #include <pthread.h>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
 #include <string>
 #include <vector>
 #include <iostream>  // NOLINT(readability/streams)
-#include <fstream>  // NOLINT(readability/streams)
 #include <utility>
 
 #include "caffe/layer.hpp"
+#include "caffe/util/data_transform.hpp"
+#include "caffe/util/image_cache.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/nvtx.hpp"
 #include "caffe/util/rng.hpp"
 #include "caffe/vision_layers.hpp"
 
+using boost::posix_time::microsec_clock;
+using boost::posix_time::ptime;
 using std::iterator;
 using std::string;
 using std::pair;
 
 namespace caffe {
 
+// The wall clock time since start, in milliseconds, as for the DataLayer.
+static double MilliSecondsSince(const ptime& start) {
+  return (microsec_clock::local_time() - start).total_microseconds() / 1000.;
+}
+
 template <typename Dtype>
-void* ImageDataLayerPrefetch(void* layer_pointer) {
-  CHECK(layer_pointer);
-  ImageDataLayer<Dtype>* layer =
-      reinterpret_cast<ImageDataLayer<Dtype>*>(layer_pointer);
+void* ImageDataLayerPrefetchWorker(void* context_pointer) {
+  CHECK(context_pointer);
+  ImageDataLayerPrefetchWorkerContext<Dtype>* context =
+      static_cast<ImageDataLayerPrefetchWorkerContext<Dtype>*>(
+          context_pointer);
+  ImageDataLayer<Dtype>* layer = context->layer;
   CHECK(layer);
-  Datum datum;
-  CHECK(layer->prefetch_data_);
-  Dtype* top_data = layer->prefetch_data_->mutable_cpu_data();
-  Dtype* top_label = layer->prefetch_label_->mutable_cpu_data();
-  ImageDataParameter image_data_param = layer->layer_param_.image_data_param();
+  const int batch_id = context->batch_id;
+  const int worker_id = context->worker_id;
+  context->read_ms = 0;
+  context->decode_ms = 0;
+  context->transform_ms = 0;
+  CHECK(layer->prefetch_data_[batch_id]);
+  Dtype* top_data = layer->prefetch_data_[batch_id]->mutable_cpu_data();
+  Dtype* top_label = layer->prefetch_label_[batch_id]->mutable_cpu_data();
+  const ImageDataParameter& image_data_param =
+      layer->layer_param_.image_data_param();
   const Dtype scale = image_data_param.scale();
-  const int batch_size = image_data_param.batch_size();
   const int crop_size = image_data_param.crop_size();
   const bool mirror = image_data_param.mirror();
   const int new_height = image_data_param.new_height();
   const int new_width = image_data_param.new_width();
-
-  if (mirror && crop_size == 0) {
-    LOG(FATAL) << "Current implementation requires mirror and crop_size to be "
-        << "set at the same time.";
-  }
-  // datum scales
+  // datum scales, with buckets those of the bucket of the batch
+  const bool bucketed = !layer->bucket_lines_.empty();
   const int channels = layer->datum_channels_;
-  const int height = layer->datum_height_;
-  const int width = layer->datum_width_;
-  const int size = layer->datum_size_;
-  const int lines_size = layer->lines_.size();
-  const Dtype* mean = layer->data_mean_.cpu_data();
-  for (int item_id = 0; item_id < batch_size; ++item_id) {
-    // get a blob
-    CHECK_GT(lines_size, layer->lines_id_);
-    if (!ReadImageToDatum(layer->lines_[layer->lines_id_].first,
-          layer->lines_[layer->lines_id_].second,
-          new_height, new_width, &datum)) {
-      continue;
+  const int height = bucketed ? layer->prefetch_data_[batch_id]->height() :
+      layer->datum_height_;
+  const int width = bucketed ? layer->prefetch_data_[batch_id]->width() :
+      layer->datum_width_;
+  const int crop_height = crop_size ? crop_size : height;
+  const int crop_width = crop_size ? crop_size : width;
+  // Either mean (the mean image) or mean_values (one per channel) is set.
+  const Dtype* mean = NULL;
+  const Dtype* mean_values = NULL;
+  if (layer->mean_values_.empty()) {
+    mean = layer->data_mean_.cpu_data();
+  } else {
+    mean_values = &layer->mean_values_[0];
+  }
+  for (int item_id = context->item_begin; item_id < context->item_end;
+       ++item_id) {
+    const string& filename = layer->prefetch_lines_[item_id].first;
+    cv::Mat cv_img;
+    if (!layer->image_cache_ || !layer->image_cache_->Get(filename, &cv_img)) {
+      const FileRead* read = layer->file_reader_ ?
+          layer->prefetch_reads_[item_id].get() : NULL;
+      if (read) {
+        const ptime read_start = microsec_clock::local_time();
+        const bool was_read = layer->file_reader_->Wait(*read);
+        context->read_ms += MilliSecondsSince(read_start);
+        if (!was_read) {
+          continue;
+        }
+        const ptime decode_start = microsec_clock::local_time();
+        const bool decoded = DecodeImageToCVMat(read->contents.data(),
+            read->contents.size(), new_height, new_width, &cv_img);
+        context->decode_ms += MilliSecondsSince(decode_start);
+        layer->prefetch_reads_[item_id].reset();
+        if (!decoded) {
+          LOG(ERROR) << "Could not decode file " << filename;
+          continue;
+        }
+      } else {
+        const ptime decode_start = microsec_clock::local_time();
+        const bool decoded = ReadImageToCVMat(filename, new_height, new_width,
+            &cv_img);
+        context->decode_ms += MilliSecondsSince(decode_start);
+        if (!decoded) {
+          continue;
+        }
+      }
+      if (bucketed && (cv_img.rows != height || cv_img.cols != width)) {
+        cv::Mat resized;
+        cv::resize(cv_img, resized, cv::Size(width, height));
+        cv_img = resized;
+      }
+      if (layer->image_cache_) {
+        layer->image_cache_->Put(filename, cv_img);
+      }
     }
-    const string& data = datum.data();
+    CHECK_EQ(cv_img.channels(), channels);
+    CHECK_EQ(cv_img.rows, height) << "All images must have the same size.";
+    CHECK_EQ(cv_img.cols, width) << "All images must have the same size.";
+    int h_off = 0;
+    int w_off = 0;
+    bool do_mirror = false;
     if (crop_size) {
-      CHECK(data.size()) << "Image cropping only support uint8 data";
-      int h_off, w_off;
       // We only do random crop when we do training.
       if (layer->phase_ == Caffe::TRAIN) {
-        h_off = layer->PrefetchRand() % (height - crop_size);
-        w_off = layer->PrefetchRand() % (width - crop_size);
+        h_off = layer->PrefetchRand(worker_id) % (height - crop_size);
+        w_off = layer->PrefetchRand(worker_id) % (width - crop_size);
       } else {
         h_off = (height - crop_size) / 2;
         w_off = (width - crop_size) / 2;
       }
-      if (mirror && layer->PrefetchRand() % 2) {
-        // Copy mirrored version
-        for (int c = 0; c < channels; ++c) {
-          for (int h = 0; h < crop_size; ++h) {
-            for (int w = 0; w < crop_size; ++w) {
-              int top_index = ((item_id * channels + c) * crop_size + h)
-                              * crop_size + (crop_size - 1 - w);
-              int data_index = (c * height + h + h_off) * width + w + w_off;
-              Dtype datum_element =
-                  static_cast<Dtype>(static_cast<uint8_t>(data[data_index]));
-              top_data[top_index] = (datum_element - mean[data_index]) * scale;
-            }
-          }
-        }
-      } else {
-        // Normal copy
-        for (int c = 0; c < channels; ++c) {
-          for (int h = 0; h < crop_size; ++h) {
-            for (int w = 0; w < crop_size; ++w) {
-              int top_index = ((item_id * channels + c) * crop_size + h)
-                              * crop_size + w;
-              int data_index = (c * height + h + h_off) * width + w + w_off;
-              Dtype datum_element =
-                  static_cast<Dtype>(static_cast<uint8_t>(data[data_index]));
-              top_data[top_index] = (datum_element - mean[data_index]) * scale;
-            }
-          }
+      do_mirror = mirror && layer->PrefetchRand(worker_id) % 2;
+    } else if (bucketed) {
+      // Without crops, only the training images are mirrored.
+      do_mirror = mirror && layer->phase_ == Caffe::TRAIN &&
+          layer->PrefetchRand(worker_id) % 2;
+    }
+    // Transform the interleaved pixels of the decoded image straight into the
+    // batch, one channel of a row at a time.
+    const ptime transform_start = microsec_clock::local_time();
+    Dtype* item_data = top_data + item_id * channels * crop_height * crop_width;
+    for (int c = 0; c < channels; ++c) {
+      for (int h = 0; h < crop_height; ++h) {
+        const uint8_t* row =
+            cv_img.ptr<uint8_t>(h + h_off) + w_off * channels + c;
+        Dtype* top_row = item_data + (c * crop_height + h) * crop_width;
+        if (mean) {
+          TransformRow(crop_width, row, channels, do_mirror,
+              mean + (c * height + h + h_off) * width + w_off, scale, top_row);
+        } else {
+          TransformRowMeanValue(crop_width, row, channels, do_mirror,
+              mean_values[c], scale, top_row);
         }
       }
-    } else {
-      // Just copy the whole data
-      if (data.size()) {
-        for (int j = 0; j < size; ++j) {
-          Dtype datum_element =
-              static_cast<Dtype>(static_cast<uint8_t>(data[j]));
-          top_data[item_id * size + j] = (datum_element - mean[j]) * scale;
-        }
+    }
+    context->transform_ms += MilliSecondsSince(transform_start);
+    top_label[item_id] = layer->prefetch_lines_[item_id].second;
+  }
+
+  return static_cast<void*>(NULL);
+}
+
+template <typename Dtype>
+void ImageDataLayerPrefetchBatch(ImageDataLayer<Dtype>* layer,
+    const int batch_id) {
+  CHECK(layer);
+  const ImageDataParameter& image_data_param =
+      layer->layer_param_.image_data_param();
+  const int batch_size = image_data_param.batch_size();
+  const int crop_size = image_data_param.crop_size();
+  const bool mirror = image_data_param.mirror();
+
+  if (mirror && crop_size == 0 && layer->bucket_lines_.empty()) {
+    LOG(FATAL) << "Current implementation requires mirror and crop_size to be "
+        << "set at the same time.";
+  }
+  // Shuffling reorders lines_order_, so the images of the batch are picked
+  // sequentially here and only the decoding and transformation are split
+  // among the workers.
+  DataLayerStats* stats = &layer->prefetch_stats_[batch_id];
+  const ptime read_start = microsec_clock::local_time();
+  if (layer->file_reader_) {
+    // Keep the reads of this batch and of the next ones going, in the order
+    // the lines are picked, so that shuffling picks the same ones.
+    const int read_ahead =
+        batch_size * (1 + image_data_param.read_ahead_batches());
+    while (layer->read_ahead_.size() < read_ahead) {
+      const int line = layer->NextLine();
+      const string& filename = layer->lines_.filename(line);
+      cv::Mat cv_img;
+      shared_ptr<FileRead> read;
+      if (!layer->image_cache_ || !layer->image_cache_->Get(filename,
+          &cv_img)) {
+        read = layer->file_reader_->Read(filename);
+      }
+      layer->read_ahead_.push_back(std::make_pair(line, read));
+    }
+  }
+  if (!layer->bucket_lines_.empty()) {
+    // Lines go to the lines waiting in their bucket until one holds a batch.
+    int bucket = -1;
+    while (bucket < 0) {
+      const int line = layer->NextLine();
+      std::deque<int>& waiting =
+          layer->bucket_lines_[layer->line_buckets_[line]];
+      waiting.push_back(line);
+      if (waiting.size() == batch_size) {
+        bucket = layer->line_buckets_[line];
+      }
+    }
+    std::deque<int>& waiting = layer->bucket_lines_[bucket];
+    for (int item_id = 0; item_id < batch_size; ++item_id) {
+      const int line = waiting.front();
+      waiting.pop_front();
+      layer->prefetch_lines_[item_id].first = layer->lines_.filename(line);
+      layer->prefetch_lines_[item_id].second = layer->lines_.label(line);
+    }
+    // Within the memory of the bucket of the most pixels
+    layer->prefetch_data_[batch_id]->Reshape(batch_size,
+        layer->datum_channels_, layer->bucket_heights_[bucket],
+        layer->bucket_widths_[bucket]);
+  } else {
+    for (int item_id = 0; item_id < batch_size; ++item_id) {
+      int line;
+      if (layer->file_reader_) {
+        line = layer->read_ahead_.front().first;
+        layer->prefetch_reads_[item_id] = layer->read_ahead_.front().second;
+        layer->read_ahead_.pop_front();
       } else {
-        for (int j = 0; j < size; ++j) {
-          top_data[item_id * size + j] =
-              (datum.float_data(j) - mean[j]) * scale;
-        }
+        line = layer->NextLine();
       }
+      layer->prefetch_lines_[item_id].first = layer->lines_.filename(line);
+      layer->prefetch_lines_[item_id].second = layer->lines_.label(line);
     }
+  }
+  stats->read_ms = MilliSecondsSince(read_start);
+  // Worker 0 runs on this thread; the others get a thread each.
+  const int num_workers = layer->prefetch_workers_.size();
+  for (int worker_id = 0; worker_id < num_workers; ++worker_id) {
+    layer->prefetch_workers_[worker_id].batch_id = batch_id;
+  }
+  vector<pthread_t> worker_threads(num_workers);
+  for (int worker_id = 1; worker_id < num_workers; ++worker_id) {
+    CHECK(!pthread_create(&worker_threads[worker_id], NULL,
+          ImageDataLayerPrefetchWorker<Dtype>,
+          static_cast<void*>(&layer->prefetch_workers_[worker_id])))
+        << "Pthread execution failed.";
+  }
+  ImageDataLayerPrefetchWorker<Dtype>(
+      static_cast<void*>(&layer->prefetch_workers_[0]));
+  for (int worker_id = 1; worker_id < num_workers; ++worker_id) {
+    CHECK(!pthread_join(worker_threads[worker_id], NULL))
+        << "Pthread joining failed.";
+  }
+  stats->decode_ms = 0;
+  stats->transform_ms = 0;
+  for (int worker_id = 0; worker_id < num_workers; ++worker_id) {
+    stats->read_ms += layer->prefetch_workers_[worker_id].read_ms;
+    stats->decode_ms += layer->prefetch_workers_[worker_id].decode_ms;
+    stats->transform_ms += layer->prefetch_workers_[worker_id].transform_ms;
+  }
+}
 
-    top_label[item_id] = datum.label();
-    // go to the next iter
-    layer->lines_id_++;
-    if (layer->lines_id_ >= lines_size) {
-      // We have reached the end. Restart from the first.
-      DLOG(INFO) << "Restarting data prefetching from start.";
-      layer->lines_id_ = 0;
-      if (layer->layer_param_.image_data_param().shuffle()) {
-        layer->ShuffleImages();
-      }
+template <typename Dtype>
+void* ImageDataLayerPrefetch(void* layer_pointer) {
+  CHECK(layer_pointer);
+  ImageDataLayer<Dtype>* layer =
+      reinterpret_cast<ImageDataLayer<Dtype>*>(layer_pointer);
+  CHECK(layer);
+  // Keep filling buffers as Forward hands them back, until asked to exit.
+  while (true) {
+    const int batch_id = layer->prefetch_free_.pop();
+    if (batch_id < 0) {
+      break;
     }
+    const ptime prefetch_start = microsec_clock::local_time();
+    NvtxRange range("Prefetch");
+    layer->phase_ = layer->prefetch_phase_[batch_id];
+    ImageDataLayerPrefetchBatch(layer, batch_id);
+    layer->prefetch_stats_[batch_id].prefetch_ms =
+        MilliSecondsSince(prefetch_start);
+    layer->prefetch_full_.push(batch_id);
   }
 
   return reinterpret_cast<void*>(NULL);
@@ -150,11 +308,34 @@ void ImageDataLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
   // Read the file with filenames and labels
   const string& source = this->layer_param_.image_data_param().source();
   LOG(INFO) << "Opening file " << source;
-  std::ifstream infile(source.c_str());
-  string filename;
-  int label;
-  while (infile >> filename >> label) {
-    lines_.push_back(std::make_pair(filename, label));
+  lines_.ReadFile(source);
+  CHECK_GT(lines_.size(), 0) << "No images in " << source;
+  CHECK_LE(lines_.size(), INT_MAX) << "Too many images in " << source;
+  const ImageDataParameter& image_data_param =
+      this->layer_param_.image_data_param();
+  CHECK_EQ(image_data_param.bucket_height_size(),
+      image_data_param.bucket_width_size())
+      << "Give a bucket_width for each bucket_height.";
+  // The largest bucket, the shape the net is set up for
+  int largest_bucket = -1;
+  if (image_data_param.bucket_height_size()) {
+    CHECK(!image_data_param.crop_size() && !image_data_param.new_height() &&
+        !image_data_param.new_width() && !image_data_param.has_mean_file() &&
+        !image_data_param.io_threads())
+        << "Buckets cannot be combined with crop_size, new_height, "
+        << "new_width, mean_file or io_threads.";
+    AssignBuckets();
+    largest_bucket = 0;
+    for (int i = 1; i < bucket_heights_.size(); ++i) {
+      if (bucket_heights_[i] * bucket_widths_[i] >
+          bucket_heights_[largest_bucket] * bucket_widths_[largest_bucket]) {
+        largest_bucket = i;
+      }
+    }
+  }
+  lines_order_.resize(lines_.size());
+  for (int i = 0; i < lines_order_.size(); ++i) {
+    lines_order_[i] = i;
   }
 
   if (this->layer_param_.image_data_param().shuffle()) {
@@ -176,38 +357,61 @@ void ImageDataLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
     lines_id_ = skip;
   }
   // Read a data point, and use it to initialize the top blob.
-  Datum datum;
-  CHECK(ReadImageToDatum(lines_[lines_id_].first, lines_[lines_id_].second,
-                         new_height, new_width, &datum));
+  cv::Mat cv_img;
+  CHECK(ReadImageToCVMat(lines_.filename(lines_order_[lines_id_]), new_height,
+                         new_width, &cv_img));
   // image
   const int crop_size = this->layer_param_.image_data_param().crop_size();
   const int batch_size = this->layer_param_.image_data_param().batch_size();
   const string& mean_file = this->layer_param_.image_data_param().mean_file();
+  const int prefetch_batches =
+      this->layer_param_.image_data_param().prefetch_batches();
+  CHECK_GT(prefetch_batches, 0);
+  prefetch_data_.resize(prefetch_batches);
+  prefetch_label_.resize(prefetch_batches);
+  prefetch_stats_.resize(prefetch_batches);
   if (crop_size > 0) {
-    (*top)[0]->Reshape(batch_size, datum.channels(), crop_size, crop_size);
-    prefetch_data_.reset(new Blob<Dtype>(batch_size, datum.channels(),
-                                         crop_size, crop_size));
+    (*top)[0]->Reshape(batch_size, cv_img.channels(), crop_size, crop_size);
+  } else if (largest_bucket >= 0) {
+    (*top)[0]->Reshape(batch_size, cv_img.channels(),
+        bucket_heights_[largest_bucket], bucket_widths_[largest_bucket]);
   } else {
-    (*top)[0]->Reshape(batch_size, datum.channels(), datum.height(),
-                       datum.width());
-    prefetch_data_.reset(new Blob<Dtype>(batch_size, datum.channels(),
-                                         datum.height(), datum.width()));
+    (*top)[0]->Reshape(batch_size, cv_img.channels(), cv_img.rows,
+                       cv_img.cols);
   }
   LOG(INFO) << "output data size: " << (*top)[0]->num() << ","
       << (*top)[0]->channels() << "," << (*top)[0]->height() << ","
       << (*top)[0]->width();
   // label
   (*top)[1]->Reshape(batch_size, 1, 1, 1);
-  prefetch_label_.reset(new Blob<Dtype>(batch_size, 1, 1, 1));
+  for (int batch_id = 0; batch_id < prefetch_batches; ++batch_id) {
+    prefetch_data_[batch_id].reset(new Blob<Dtype>());
+    prefetch_data_[batch_id]->ReshapeLike(*(*top)[0]);
+    prefetch_label_[batch_id].reset(new Blob<Dtype>(batch_size, 1, 1, 1));
+  }
   // datum size
-  datum_channels_ = datum.channels();
-  datum_height_ = datum.height();
-  datum_width_ = datum.width();
-  datum_size_ = datum.channels() * datum.height() * datum.width();
+  datum_channels_ = cv_img.channels();
+  datum_height_ = largest_bucket >= 0 ? (*top)[0]->height() : cv_img.rows;
+  datum_width_ = largest_bucket >= 0 ? (*top)[0]->width() : cv_img.cols;
+  datum_size_ = datum_channels_ * datum_height_ * datum_width_;
   CHECK_GT(datum_height_, crop_size);
   CHECK_GT(datum_width_, crop_size);
   // check if we want to have mean
-  if (this->layer_param_.image_data_param().has_mean_file()) {
+  const int num_mean_values =
+      this->layer_param_.image_data_param().mean_value_size();
+  if (num_mean_values > 0) {
+    CHECK(!this->layer_param_.image_data_param().has_mean_file())
+        << "Cannot specify both mean_file and mean_value.";
+    CHECK(num_mean_values == 1 || num_mean_values == datum_channels_)
+        << "Specify either one mean_value or one per channel.";
+    for (int c = 0; c < datum_channels_; ++c) {
+      mean_values_.push_back(this->layer_param_.image_data_param().mean_value(
+          num_mean_values == 1 ? 0 : c));
+    }
+  } else if (largest_bucket >= 0) {
+    // The buckets have no mean image of their shape.
+    mean_values_.assign(datum_channels_, Dtype(0));
+  } else if (this->layer_param_.image_data_param().has_mean_file()) {
     BlobProto blob_proto;
     LOG(INFO) << "Loading mean file from" << mean_file;
     ReadProtoFromBinaryFile(mean_file.c_str(), &blob_proto);
@@ -224,9 +428,49 @@ void ImageDataLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
   // cpu_data calls so that the prefetch thread does not accidentally make
   // simultaneous cudaMalloc calls when the main thread is running. In some
   // GPUs this seems to cause failures if we do not so.
-  prefetch_data_->mutable_cpu_data();
-  prefetch_label_->mutable_cpu_data();
-  data_mean_.cpu_data();
+  for (int batch_id = 0; batch_id < prefetch_batches; ++batch_id) {
+    prefetch_data_[batch_id]->mutable_cpu_data();
+    prefetch_label_[batch_id]->mutable_cpu_data();
+  }
+  if (mean_values_.empty()) {
+    data_mean_.cpu_data();
+  }
+  if (this->layer_param_.image_data_param().cache_size_mb()) {
+    image_cache_.reset(new ImageCache(static_cast<size_t>(
+        this->layer_param_.image_data_param().cache_size_mb()) << 20));
+    LOG(INFO) << "Caching up to "
+        << this->layer_param_.image_data_param().cache_size_mb()
+        << " MB of decoded images.";
+  }
+  const int io_threads = this->layer_param_.image_data_param().io_threads();
+  if (io_threads) {
+    file_reader_.reset(new AsyncFileReader(io_threads,
+        this->layer_param_.image_data_param().direct_io()));
+    prefetch_reads_.resize(batch_size);
+    LOG(INFO) << "Reading the images with " << io_threads << " I/O thread(s)"
+        << (this->layer_param_.image_data_param().direct_io() ?
+            ", around the page cache." : ".");
+  }
+  // Split the batch evenly among the prefetch workers.
+  const int num_workers = std::max(1, std::min(batch_size, static_cast<int>(
+      this->layer_param_.image_data_param().prefetch_threads())));
+  prefetch_lines_.resize(batch_size);
+  prefetch_workers_.resize(num_workers);
+  for (int worker_id = 0; worker_id < num_workers; ++worker_id) {
+    prefetch_workers_[worker_id].layer = this;
+    prefetch_workers_[worker_id].worker_id = worker_id;
+    prefetch_workers_[worker_id].item_begin =
+        batch_size * worker_id / num_workers;
+    prefetch_workers_[worker_id].item_end =
+        batch_size * (worker_id + 1) / num_workers;
+  }
+  LOG(INFO) << "Prefetching " << prefetch_batches << " batch(es) with "
+      << num_workers << " worker(s).";
+  // All buffers start out free to be filled in the current phase.
+  prefetch_phase_.assign(prefetch_batches, Caffe::phase());
+  for (int batch_id = 0; batch_id < prefetch_batches; ++batch_id) {
+    prefetch_free_.push(batch_id);
+  }
   DLOG(INFO) << "Initializing prefetch";
   CreatePrefetchThread();
   DLOG(INFO) << "Prefetch initialized.";
@@ -235,17 +479,28 @@ void ImageDataLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
 template <typename Dtype>
 void ImageDataLayer<Dtype>::CreatePrefetchThread() {
   phase_ = Caffe::phase();
-  const bool prefetch_needs_rand =
-      this->layer_param_.image_data_param().shuffle() ||
-          ((phase_ == Caffe::TRAIN) &&
-           (this->layer_param_.image_data_param().mirror() ||
-            this->layer_param_.image_data_param().crop_size()));
-  if (prefetch_needs_rand) {
+  if (this->layer_param_.image_data_param().shuffle()) {
     const unsigned int prefetch_rng_seed = caffe_rng_rand();
     prefetch_rng_.reset(new Caffe::RNG(prefetch_rng_seed));
   } else {
     prefetch_rng_.reset();
   }
+  // The prefetch thread lives across phase changes, so the random streams of
+  // the workers are needed whenever a training batch could be randomly
+  // cropped or mirrored. Seed them in order so that a fixed random seed gives
+  // the same streams every time.
+  const bool prefetch_needs_rand =
+      this->layer_param_.image_data_param().mirror() ||
+      this->layer_param_.image_data_param().crop_size();
+  prefetch_rngs_.resize(prefetch_workers_.size());
+  for (int worker_id = 0; worker_id < prefetch_rngs_.size(); ++worker_id) {
+    if (prefetch_needs_rand) {
+      const unsigned int prefetch_rng_seed = caffe_rng_rand();
+      prefetch_rngs_[worker_id].reset(new Caffe::RNG(prefetch_rng_seed));
+    } else {
+      prefetch_rngs_[worker_id].reset();
+    }
+  }
   // Create the thread.
   CHECK(!pthread_create(&thread_, NULL, ImageDataLayerPrefetch<Dtype>,
         static_cast<void*>(this))) << "Pthread execution failed.";
@@ -253,21 +508,97 @@ void ImageDataLayer<Dtype>::CreatePrefetchThread() {
 
 template <typename Dtype>
 void ImageDataLayer<Dtype>::ShuffleImages() {
-  const int num_images = lines_.size();
-  for (int i = 0; i < num_images; ++i) {
-    const int max_rand_index = num_images - i;
-    const int rand_index = PrefetchRand() % max_rand_index;
-    pair<string, int> item = lines_[rand_index];
-    lines_.erase(lines_.begin() + rand_index);
-    lines_.push_back(item);
+  // Fisher-Yates over the indices of the images
+  for (int i = lines_order_.size() - 1; i > 0; --i) {
+    std::swap(lines_order_[i], lines_order_[PrefetchRand() % (i + 1)]);
+  }
+}
+
+template <typename Dtype>
+int ImageDataLayer<Dtype>::NextLine() {
+  CHECK_GT(static_cast<int>(lines_order_.size()), lines_id_);
+  const int line = lines_order_[lines_id_];
+  // go to the next iter
+  lines_id_++;
+  if (lines_id_ >= lines_order_.size()) {
+    // We have reached the end. Restart from the first.
+    DLOG(INFO) << "Restarting data prefetching from start.";
+    lines_id_ = 0;
+    if (this->layer_param_.image_data_param().shuffle()) {
+      ShuffleImages();
+    }
+  }
+  return line;
+}
+
+template <typename Dtype>
+void ImageDataLayer<Dtype>::AssignBuckets() {
+  const ImageDataParameter& image_data_param =
+      this->layer_param_.image_data_param();
+  const int num_buckets = image_data_param.bucket_height_size();
+  // The log of the aspect ratio of each bucket, so that an image twice as
+  // wide as a bucket is as far from it as one twice as tall.
+  vector<double> bucket_aspects;
+  for (int i = 0; i < num_buckets; ++i) {
+    CHECK_GT(image_data_param.bucket_height(i), 0);
+    CHECK_GT(image_data_param.bucket_width(i), 0);
+    bucket_heights_.push_back(image_data_param.bucket_height(i));
+    bucket_widths_.push_back(image_data_param.bucket_width(i));
+    bucket_aspects.push_back(log(static_cast<double>(bucket_widths_[i]) /
+        bucket_heights_[i]));
+  }
+  LOG(INFO) << "Reading the size of " << lines_.size() << " images.";
+  line_buckets_.resize(lines_.size());
+  vector<int> bucket_images(num_buckets, 0);
+  for (int line = 0; line < lines_.size(); ++line) {
+    int height;
+    int width;
+    int bucket = 0;
+    if (ReadImageSize(lines_.filename(line), &height, &width)) {
+      const double aspect = log(static_cast<double>(width) / height);
+      for (int i = 1; i < num_buckets; ++i) {
+        if (fabs(aspect - bucket_aspects[i]) <
+            fabs(aspect - bucket_aspects[bucket])) {
+          bucket = i;
+        }
+      }
+    } else {
+      LOG(ERROR) << "Could not read the size of " << lines_.filename(line);
+    }
+    line_buckets_[line] = bucket;
+    ++bucket_images[bucket];
+  }
+  bucket_lines_.resize(num_buckets);
+  for (int i = 0; i < num_buckets; ++i) {
+    LOG(INFO) << "Bucket " << i << " of " << bucket_heights_[i] << "x"
+        << bucket_widths_[i] << ": " << bucket_images[i] << " images.";
   }
 }
 
 template <typename Dtype>
 void ImageDataLayer<Dtype>::JoinPrefetchThread() {
+  // Drop the buffers still waiting to be filled so that the prefetch thread
+  // exits as soon as it has finished the batch in hand.
+  int batch_id;
+  while (prefetch_free_.try_pop(&batch_id)) {}
+  prefetch_free_.push(-1);
   CHECK(!pthread_join(thread_, NULL)) << "Pthread joining failed.";
 }
 
+template <typename Dtype>
+int ImageDataLayer<Dtype>::PopPrefetchedBatch() {
+  const ptime wait_start = microsec_clock::local_time();
+  const int batch_id = prefetch_full_.pop();
+  stats_.wait_ms += MilliSecondsSince(wait_start);
+  const DataLayerStats& batch_stats = prefetch_stats_[batch_id];
+  ++stats_.batches;
+  stats_.prefetch_ms += batch_stats.prefetch_ms;
+  stats_.read_ms += batch_stats.read_ms;
+  stats_.decode_ms += batch_stats.decode_ms;
+  stats_.transform_ms += batch_stats.transform_ms;
+  return batch_id;
+}
+
 template <typename Dtype>
 unsigned int ImageDataLayer<Dtype>::PrefetchRand() {
   caffe::rng_t* prefetch_rng =
@@ -275,18 +606,32 @@ unsigned int ImageDataLayer<Dtype>::PrefetchRand() {
   return (*prefetch_rng)();
 }
 
+template <typename Dtype>
+unsigned int ImageDataLayer<Dtype>::PrefetchRand(const int worker_id) {
+  CHECK(prefetch_rngs_[worker_id]);
+  caffe::rng_t* prefetch_rng =
+      static_cast<caffe::rng_t*>(prefetch_rngs_[worker_id]->generator());
+  return (*prefetch_rng)();
+}
+
 template <typename Dtype>
 Dtype ImageDataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
-  // First, join the thread
-  JoinPrefetchThread();
-  // Copy the data
-  caffe_copy(prefetch_data_->count(), prefetch_data_->cpu_data(),
+  // First, wait for the next prefetched batch
+  const int batch_id = PopPrefetchedBatch();
+  // Copy the data, of the shape of its bucket with buckets
+  const ptime copy_start = microsec_clock::local_time();
+  (*top)[0]->ReshapeLike(*prefetch_data_[batch_id]);
+  caffe_copy(prefetch_data_[batch_id]->count(),
+             prefetch_data_[batch_id]->cpu_data(),
              (*top)[0]->mutable_cpu_data());
-  caffe_copy(prefetch_label_->count(), prefetch_label_->cpu_data(),
+  caffe_copy(prefetch_label_[batch_id]->count(),
+             prefetch_label_[batch_id]->cpu_data(),
              (*top)[1]->mutable_cpu_data());
-  // Start a new prefetch thread
-  CreatePrefetchThread();
+  stats_.copy_ms += MilliSecondsSince(copy_start);
+  // Hand the buffer back to the prefetch thread
+  prefetch_phase_[batch_id] = Caffe::phase();
+  prefetch_free_.push(batch_id);
   return Dtype(0.);
 }
 
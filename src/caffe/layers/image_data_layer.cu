@@ -24,17 +24,21 @@ namespace caffe {
 template <typename Dtype>
 Dtype ImageDataLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
-  // First, join the thread
-  JoinPrefetchThread();
-  // Copy the data
+  // First, wait for the next prefetched batch
+  const int batch_id = PopPrefetchedBatch();
+  // Copy the data, of the shape of its bucket with buckets
+  (*top)[0]->ReshapeLike(*prefetch_data_[batch_id]);
   CUDA_CHECK(cudaMemcpy((*top)[0]->mutable_gpu_data(),
-      prefetch_data_->cpu_data(), sizeof(Dtype) * prefetch_data_->count(),
+      prefetch_data_[batch_id]->cpu_data(),
+      sizeof(Dtype) * prefetch_data_[batch_id]->count(),
       cudaMemcpyHostToDevice));
   CUDA_CHECK(cudaMemcpy((*top)[1]->mutable_gpu_data(),
-      prefetch_label_->cpu_data(), sizeof(Dtype) * prefetch_label_->count(),
+      prefetch_label_[batch_id]->cpu_data(),
+      sizeof(Dtype) * prefetch_label_[batch_id]->count(),
       cudaMemcpyHostToDevice));
-  // Start a new prefetch thread
-  CreatePrefetchThread();
+  // Hand the buffer back to the prefetch thread
+  prefetch_phase_[batch_id] = Caffe::phase();
+  prefetch_free_.push(batch_id);
   return Dtype(0.);
 }
 
@@ -28,6 +28,7 @@ void InfogainLossLayer<Dtype>::FurtherSetUp(
   CHECK_EQ(infogain_.num(), 1);
   CHECK_EQ(infogain_.channels(), 1);
   CHECK_EQ(infogain_.height(), infogain_.width());
+  loss_.Reshape(1, 1, 1, 1);
 }
 
 
@@ -55,6 +56,9 @@ template <typename Dtype>
 void InfogainLossLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const bool propagate_down,
     vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
   const Dtype* bottom_data = (*bottom)[0]->cpu_data();
   const Dtype* bottom_label = (*bottom)[1]->cpu_data();
   const Dtype* infogain_mat = infogain_.cpu_data();
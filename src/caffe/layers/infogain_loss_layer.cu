@@ -0,0 +1,95 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <algorithm>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/vision_layers.hpp"
+#include "caffe/util/math_functions.hpp"
+
+using std::max;
+
+namespace caffe {
+
+// The loss is summed by one block of kInfogainLossThreads threads, a power of
+// two for the reduction in shared memory.
+const int kInfogainLossThreads = 256;
+
+// Sets loss, or adds to it if accumulate, the mean over the num items of
+// the infogain of their label times -log of their dim probabilities, each
+// thread summing the outputs a block apart.
+template <typename Dtype>
+__global__ void InfogainLossForward(const int num, const int dim,
+    const Dtype* bottom_data, const Dtype* label, const Dtype* infogain_mat,
+    const Dtype threshold, const bool accumulate, Dtype* loss) {
+  __shared__ Dtype buffer[kInfogainLossThreads];
+  Dtype sum = 0;
+  for (int index = threadIdx.x; index < num * dim;
+       index += kInfogainLossThreads) {
+    const int i = index / dim;
+    const int j = index % dim;
+    sum -= infogain_mat[static_cast<int>(label[i]) * dim + j] *
+        log(max(bottom_data[index], threshold));
+  }
+  buffer[threadIdx.x] = sum;
+  __syncthreads();
+  for (int stride = kInfogainLossThreads / 2; stride > 0; stride /= 2) {
+    if (threadIdx.x < stride) {
+      buffer[threadIdx.x] += buffer[threadIdx.x + stride];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    *loss = (accumulate ? *loss : Dtype(0)) + buffer[0] / num;
+  }
+}
+
+template <typename Dtype>
+__global__ void InfogainLossBackward(const int n, const int num,
+    const int dim, const Dtype* bottom_data, const Dtype* label,
+    const Dtype* infogain_mat, const Dtype threshold, Dtype* bottom_diff) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int i = index / dim;
+    const int j = index % dim;
+    bottom_diff[index] = -infogain_mat[static_cast<int>(label[i]) * dim + j] /
+        max(bottom_data[index], threshold) / num;
+  }
+}
+
+template <typename Dtype>
+Dtype InfogainLossLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+    vector<Blob<Dtype>*>* top) {
+  int num = bottom[0]->num();
+  int dim = bottom[0]->count() / bottom[0]->num();
+  CHECK_EQ(infogain_.height(), dim);
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  InfogainLossForward<Dtype><<<1, kInfogainLossThreads>>>(
+      num, dim, bottom[0]->gpu_data(), bottom[1]->gpu_data(),
+      infogain_.gpu_data(), Dtype(kLOG_THRESHOLD),
+      this->device_loss_ != NULL,
+      this->device_loss_ ? this->device_loss_ : loss_.mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+  return this->device_loss_ ? Dtype(0) : loss_.cpu_data()[0];
+}
+
+template <typename Dtype>
+void InfogainLossLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
+    const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
+  int count = (*bottom)[0]->count();
+  int num = (*bottom)[0]->num();
+  int dim = count / num;
+  CHECK_EQ(infogain_.height(), dim);
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  InfogainLossBackward<Dtype><<<CAFFE_GET_BLOCKS(count),
+      CAFFE_CUDA_NUM_THREADS>>>(count, num, dim, (*bottom)[0]->gpu_data(),
+      (*bottom)[1]->gpu_data(), infogain_.gpu_data(), Dtype(kLOG_THRESHOLD),
+      (*bottom)[0]->mutable_gpu_diff());
+  CUDA_POST_KERNEL_CHECK;
+}
+
+INSTANTIATE_CLASS(InfogainLossLayer);
+
+}  // namespace caffe
@@ -1,5 +1,8 @@
 // Copyright 2014 BVLC and contributors.
 
+#include <pthread.h>
+
+#include <algorithm>
 #include <vector>
 
 #include "caffe/blob.hpp"
@@ -8,9 +11,16 @@
 #include "caffe/layer.hpp"
 #include "caffe/vision_layers.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/quantize.hpp"
+#include "caffe/util/sparse.hpp"
 
 namespace caffe {
 
+template <typename Dtype>
+InnerProductLayer<Dtype>::~InnerProductLayer() {
+  StopSlices();
+}
+
 template <typename Dtype>
 void InnerProductLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
@@ -18,6 +28,27 @@ void InnerProductLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
   CHECK_EQ(top->size(), 1) << "IP Layer takes a single blob as output.";
   const int num_output = this->layer_param_.inner_product_param().num_output();
   bias_term_ = this->layer_param_.inner_product_param().bias_term();
+  fused_relu_ = this->layer_param_.inner_product_param().fused_relu();
+  int8_ = this->layer_param_.quantization_param().precision() ==
+      QuantizationParameter_Precision_INT8;
+  int8_bottom_range_ = this->layer_param_.quantization_param().bottom_range();
+  int8_weights_.reset();
+  max_sparse_density_ =
+      this->layer_param_.inner_product_param().max_sparse_density();
+  CHECK(!int8_ || max_sparse_density_ == 0)
+      << "INT8 precision and sparse weights cannot be combined.";
+  sparse_checked_ = false;
+  sparse_ = false;
+  StopSlices();
+  const int num_slices =
+      this->layer_param_.inner_product_param().device_ids_size();
+  if (num_slices) {
+    CHECK(Caffe::mode() == Caffe::GPU)
+        << "A layer split model parallel runs on GPUs.";
+    CHECK(!int8_ && max_sparse_density_ == 0) << "INT8 precision and "
+        "sparse weights cannot be split model parallel.";
+    CHECK_LE(num_slices, num_output) << "More device_ids than outputs.";
+  }
   // Figure out the dimensions
   M_ = bottom[0]->num();
   K_ = bottom[0]->count() / bottom[0]->num();
@@ -47,51 +78,308 @@ void InnerProductLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
     }
   }  // parameter initialization
   // Setting up the bias multiplier
+  bias_multiplier_.reset();
   if (bias_term_) {
-    bias_multiplier_.reset(new SyncedMemory(M_ * sizeof(Dtype)));
-    Dtype* bias_multiplier_data =
-        reinterpret_cast<Dtype*>(bias_multiplier_->mutable_cpu_data());
-    for (int i = 0; i < M_; ++i) {
-        bias_multiplier_data[i] = 1.;
+    ReserveOnes(M_, &bias_multiplier_);
+  }
+  if (num_slices) {
+    SetUpSlices();
+  }
+}
+
+// Repeats each of values for num_slices slices.
+static void RepeatPerSlice(const int num_slices,
+    google::protobuf::RepeatedField<float>* values) {
+  const vector<float> given(values->begin(), values->end());
+  values->Clear();
+  for (int j = 0; j < given.size(); ++j) {
+    for (int i = 0; i < num_slices; ++i) {
+      values->Add(given[j]);
+    }
+  }
+}
+
+template <typename Dtype>
+void InnerProductLayer<Dtype>::SetUpSlices() {
+  const InnerProductParameter& param =
+      this->layer_param_.inner_product_param();
+  const int num_slices = param.device_ids_size();
+  const int num_params = bias_term_ ? 2 : 1;
+  settings_ = Caffe::thread_settings();
+  for (int i = 0; i < num_slices; ++i) {
+    shared_ptr<Slice> slice(new Slice());
+    slice->layer = this;
+    slice->id = i;
+    slice->device = param.device_ids(i);
+    slice->begin = N_ * i / num_slices;
+    slice->count = N_ * (i + 1) / num_slices - slice->begin;
+    slices_.push_back(slice);
+  }
+  if (num_slices > 1 && this->blobs_.size() == num_params) {
+    // The parameters of all the outputs, e.g. just filled, split into those
+    // of the slices: the weights are rows, and the bias values, of outputs.
+    vector<shared_ptr<Blob<Dtype> > > blobs(num_params * num_slices);
+    for (int j = 0; j < num_params; ++j) {
+      const int width = j ? 1 : K_;
+      for (int i = 0; i < num_slices; ++i) {
+        const Slice& slice = *slices_[i];
+        shared_ptr<Blob<Dtype> >& blob = blobs[j * num_slices + i];
+        blob.reset(new Blob<Dtype>(1, 1, j ? 1 : slice.count,
+            j ? slice.count : K_));
+        caffe_copy(blob->count(),
+            this->blobs_[j]->cpu_data() + slice.begin * width,
+            blob->mutable_cpu_data());
+      }
+    }
+    this->blobs_ = blobs;
+  }
+  CHECK_EQ(this->blobs_.size(), num_params * num_slices)
+      << "The parameters are not those of the slices of device_ids.";
+  for (int i = 0; i < num_slices; ++i) {
+    CHECK_EQ(this->blobs_[i]->count(), slices_[i]->count * K_)
+        << "Incorrect weights for slice " << i;
+    if (bias_term_) {
+      CHECK_EQ(this->blobs_[num_slices + i]->count(), slices_[i]->count)
+          << "Incorrect bias for slice " << i;
+    }
+  }
+  // The multipliers given for the weights and the bias of all the slices
+  if (num_slices > 1 && this->layer_param_.blobs_lr_size() == num_params) {
+    RepeatPerSlice(num_slices, this->layer_param_.mutable_blobs_lr());
+  }
+  if (num_slices > 1 &&
+      this->layer_param_.weight_decay_size() == num_params) {
+    RepeatPerSlice(num_slices, this->layer_param_.mutable_weight_decay());
+  }
+  for (int i = 0; i < num_slices; ++i) {
+    Slice* slice = slices_[i].get();
+    if (slice->device != settings_.device) {
+      Caffe::EnablePeerAccess(settings_.device, slice->device);
+      Caffe::EnablePeerAccess(slice->device, settings_.device);
     }
+    CHECK(!pthread_create(&slice->thread, NULL, SliceThread,
+          static_cast<void*>(slice))) << "Pthread execution failed.";
+  }
+  RunSlices(SLICE_SET_UP);
+  LOG(INFO) << this->layer_param_.name() << ": " << N_ << " outputs split "
+      << "model parallel over " << num_slices << " GPUs.";
+}
+
+template <typename Dtype>
+void InnerProductLayer<Dtype>::StopSlices() {
+  for (int i = 0; i < slices_.size(); ++i) {
+    slices_[i]->commands.push(SLICE_STOP);
+  }
+  for (int i = 0; i < slices_.size(); ++i) {
+    CHECK(!pthread_join(slices_[i]->thread, NULL))
+        << "Pthread joining failed.";
+  }
+  slices_.clear();
+}
+
+template <typename Dtype>
+void* InnerProductLayer<Dtype>::SliceThread(void* slice_pointer) {
+  Slice* slice = static_cast<Slice*>(slice_pointer);
+  InnerProductLayer<Dtype>* layer = slice->layer;
+  // The settings of the layer, on the device of the slice
+  Caffe::ThreadSettings settings = layer->settings_;
+  settings.device = slice->device;
+  Caffe::set_thread_settings(settings);
+  for (int command = slice->commands.pop(); command != SLICE_STOP;
+       command = slice->commands.pop()) {
+    switch (command) {
+    case SLICE_SET_UP:
+      // The parameters of the slice are kept on its device.
+      layer->blobs_[slice->id]->gpu_data();
+      if (layer->bias_term_) {
+        layer->blobs_[layer->slices_.size() + slice->id]->gpu_data();
+      }
+      break;
+    case SLICE_FORWARD:
+      layer->ForwardSlice(slice);
+      break;
+    case SLICE_BACKWARD:
+      layer->BackwardSlice(slice);
+      break;
+    default:
+      LOG(FATAL) << "Unknown slice command " << command;
+    }
+    CUDA_CHECK(cudaDeviceSynchronize());
+    layer->slices_done_.push(slice->id);
+  }
+  return static_cast<void*>(NULL);
+}
+
+template <typename Dtype>
+void InnerProductLayer<Dtype>::RunSlices(const SliceCommand command) {
+  CUDA_CHECK(cudaDeviceSynchronize());
+  for (int i = 0; i < slices_.size(); ++i) {
+    slices_[i]->commands.push(command);
+  }
+  for (int i = 0; i < slices_.size(); ++i) {
+    slices_done_.pop();
+  }
+}
+
+template <typename Dtype>
+void InnerProductLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top) {
+  CHECK_EQ(bottom[0]->count() / bottom[0]->num(), K_)
+      << "Only the num of the input of an IP Layer can change.";
+  M_ = bottom[0]->num();
+  (*top)[0]->Reshape(M_, N_, 1, 1);
+  if (bias_term_) {
+    ReserveOnes(M_, &bias_multiplier_);
+  }
+  // The buffers of the INT8 and sparse products are made again if too small.
+  if (int8_bottom_ && int8_bottom_->size() < M_ * K_ * sizeof(int8_t)) {
+    int8_bottom_.reset(new SyncedMemory(M_ * K_ * sizeof(int8_t)));
+    int8_products_.reset(new SyncedMemory(M_ * N_ * sizeof(int32_t)));
+  }
+  if (sparse_buffer_ &&
+      sparse_buffer_->size() < (K_ + N_) * M_ * sizeof(Dtype)) {
+    sparse_buffer_.reset(new SyncedMemory((K_ + N_) * M_ * sizeof(Dtype)));
+  }
+}
+
+template <typename Dtype>
+void InnerProductLayer<Dtype>::ReserveOnes(const int count,
+    shared_ptr<SyncedMemory>* ones) {
+  if (*ones && (*ones)->size() >= count * sizeof(Dtype)) {
+    return;
+  }
+  ones->reset(new SyncedMemory(count * sizeof(Dtype)));
+  Dtype* ones_data = reinterpret_cast<Dtype*>((*ones)->mutable_cpu_data());
+  for (int i = 0; i < count; ++i) {
+      ones_data[i] = 1.;
   }
 }
 
 template <typename Dtype>
 Dtype InnerProductLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     vector<Blob<Dtype>*>* top) {
+  CHECK(slices_.empty()) << "A layer split model parallel runs on GPUs.";
   const Dtype* bottom_data = bottom[0]->cpu_data();
   Dtype* top_data = (*top)[0]->mutable_cpu_data();
-  const Dtype* weight = this->blobs_[0]->cpu_data();
-  caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, M_, N_, K_, (Dtype)1.,
-      bottom_data, weight, (Dtype)0., top_data);
-  if (bias_term_) {
-    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, N_, 1, (Dtype)1.,
-        reinterpret_cast<const Dtype*>(bias_multiplier_->cpu_data()),
-        this->blobs_[1]->cpu_data(), (Dtype)1., top_data);
+  CheckSparseWeights();
+  if (int8_) {
+    Int8Forward_cpu(bottom_data, top_data);
+  } else if (sparse_) {
+    caffe_cpu_gemm_csr(M_, N_, K_,
+        reinterpret_cast<const Dtype*>(sparse_values_->cpu_data()),
+        reinterpret_cast<const int*>(sparse_row_start_->cpu_data()),
+        reinterpret_cast<const int*>(sparse_columns_->cpu_data()),
+        bottom_data, top_data,
+        reinterpret_cast<Dtype*>(sparse_buffer_->mutable_cpu_data()));
+  } else {
+    const Dtype* weight = this->blobs_[0]->cpu_data();
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, M_, N_, K_, (Dtype)1.,
+        bottom_data, weight, (Dtype)0., top_data);
+  }
+  // The bias and the ReLU in one pass
+  if (bias_term_ || fused_relu_) {
+    caffe_cpu_add_bias(M_, N_, 1,
+        bias_term_ ? this->blobs_[1]->cpu_data() : NULL, fused_relu_,
+        top_data);
   }
   return Dtype(0);
 }
 
+template <typename Dtype>
+void InnerProductLayer<Dtype>::CheckSparseWeights() {
+  if (sparse_checked_ || max_sparse_density_ <= 0) {
+    return;
+  }
+  sparse_checked_ = true;
+  vector<Dtype> values;
+  vector<int> row_start, columns;
+  caffe_cpu_dense_to_csr(N_, K_, this->blobs_[0]->cpu_data(), Dtype(0),
+      &values, &row_start, &columns);
+  const Dtype density = static_cast<Dtype>(values.size()) / (N_ * K_);
+  if (density > max_sparse_density_) {
+    LOG(INFO) << this->layer_param_.name() << ": the weights have density "
+        << density << ", above " << max_sparse_density_ << "; kept dense.";
+    return;
+  }
+  LOG(INFO) << this->layer_param_.name() << ": storing the weights, of "
+      << "density " << density << ", in compressed sparse rows.";
+  sparse_ = true;
+  sparse_nnz_ = values.size();
+  // At least one value, for the buffers of an all zero matrix
+  sparse_values_.reset(
+      new SyncedMemory(std::max(sparse_nnz_, 1) * sizeof(Dtype)));
+  sparse_columns_.reset(
+      new SyncedMemory(std::max(sparse_nnz_, 1) * sizeof(int)));
+  sparse_row_start_.reset(new SyncedMemory((N_ + 1) * sizeof(int)));
+  std::copy(values.begin(), values.end(),
+      reinterpret_cast<Dtype*>(sparse_values_->mutable_cpu_data()));
+  std::copy(columns.begin(), columns.end(),
+      reinterpret_cast<int*>(sparse_columns_->mutable_cpu_data()));
+  std::copy(row_start.begin(), row_start.end(),
+      reinterpret_cast<int*>(sparse_row_start_->mutable_cpu_data()));
+  sparse_buffer_.reset(new SyncedMemory((K_ + N_) * M_ * sizeof(Dtype)));
+}
+
+template <typename Dtype>
+void InnerProductLayer<Dtype>::Int8Forward_cpu(const Dtype* bottom_data,
+    Dtype* top_data) {
+  if (!int8_weights_) {
+    int8_weights_.reset(new SyncedMemory(N_ * K_ * sizeof(int8_t)));
+    int8_weight_scales_.reset(new SyncedMemory(N_ * sizeof(Dtype)));
+    caffe_cpu_quantize_rows(N_, K_, this->blobs_[0]->cpu_data(),
+        reinterpret_cast<int8_t*>(int8_weights_->mutable_cpu_data()),
+        reinterpret_cast<Dtype*>(int8_weight_scales_->mutable_cpu_data()));
+    int8_bottom_.reset(new SyncedMemory(M_ * K_ * sizeof(int8_t)));
+    int8_products_.reset(new SyncedMemory(M_ * N_ * sizeof(int32_t)));
+  }
+  const Dtype bottom_scale = (int8_bottom_range_ > 0 ? int8_bottom_range_ :
+      caffe_cpu_amax(M_ * K_, bottom_data)) / 127;
+  int8_t* int8_bottom =
+      reinterpret_cast<int8_t*>(int8_bottom_->mutable_cpu_data());
+  int32_t* products =
+      reinterpret_cast<int32_t*>(int8_products_->mutable_cpu_data());
+  caffe_cpu_quantize(M_ * K_, bottom_data, bottom_scale, int8_bottom);
+  caffe_cpu_gemm_s8(M_, N_, K_, int8_bottom,
+      reinterpret_cast<const int8_t*>(int8_weights_->cpu_data()), products);
+  caffe_cpu_dequantize(M_, N_, products, bottom_scale,
+      static_cast<const Dtype*>(NULL),
+      reinterpret_cast<const Dtype*>(int8_weight_scales_->cpu_data()),
+      top_data);
+}
+
 template <typename Dtype>
 void InnerProductLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const bool propagate_down,
     vector<Blob<Dtype>*>* bottom) {
+  CHECK(!int8_) << "A layer with INT8 precision has no backward pass.";
+  CHECK(!sparse_) << "A layer with sparse weights has no backward pass.";
+  CHECK(slices_.empty()) << "A layer split model parallel runs on GPUs.";
+  if (fused_relu_) {
+    // The ReLU backward pass, in place like the ReLU layer it replaces
+    caffe_cpu_relu_mask(top[0]->count(), top[0]->cpu_data(),
+        top[0]->mutable_cpu_diff());
+  }
   const Dtype* top_diff = top[0]->cpu_diff();
   const Dtype* bottom_data = (*bottom)[0]->cpu_data();
-  // Gradient with respect to weight
-  caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, N_, K_, M_, (Dtype)1.,
-      top_diff, bottom_data, (Dtype)0., this->blobs_[0]->mutable_cpu_diff());
-  if (bias_term_) {
+  const Dtype param_diff_beta = this->accumulate_param_diffs_ ? 1 : 0;
+  // The parameters with a learning rate of 0 get no gradient.
+  if (this->param_propagate_down(0)) {
+    // Gradient with respect to weight
+    caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, N_, K_, M_, (Dtype)1.,
+        top_diff, bottom_data, param_diff_beta,
+        this->blobs_[0]->mutable_cpu_diff());
+  }
+  if (bias_term_ && this->param_propagate_down(1)) {
     // Gradient with respect to bias
     caffe_cpu_gemv<Dtype>(CblasTrans, M_, N_, (Dtype)1., top_diff,
-        reinterpret_cast<const Dtype*>(bias_multiplier_->cpu_data()), (Dtype)0.,
-        this->blobs_[1]->mutable_cpu_diff());
+        reinterpret_cast<const Dtype*>(bias_multiplier_->cpu_data()),
+        param_diff_beta, this->blobs_[1]->mutable_cpu_diff());
   }
   if (propagate_down) {
     // Gradient with respect to bottom data
     caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, K_, N_, (Dtype)1.,
-        top_diff, this->blobs_[0]->cpu_data(), (Dtype)0.,
+        top_diff, this->blobs_[0]->cpu_data(),
+        (Dtype)(this->accumulate_bottom_diffs_ ? 1 : 0),
         (*bottom)[0]->mutable_cpu_diff());
   }
 }
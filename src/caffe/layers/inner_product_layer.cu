@@ -10,21 +10,35 @@
 #include "caffe/layer.hpp"
 #include "caffe/vision_layers.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/sparse.hpp"
 
 namespace caffe {
 
 template <typename Dtype>
 Dtype InnerProductLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
     vector<Blob<Dtype>*>* top) {
+  if (slices_.size()) {
+    return ModelParallelForward_gpu(bottom, top);
+  }
   const Dtype* bottom_data = bottom[0]->gpu_data();
   Dtype* top_data = (*top)[0]->mutable_gpu_data();
-  const Dtype* weight = this->blobs_[0]->gpu_data();
-  caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasTrans, M_, N_, K_, (Dtype)1.,
-      bottom_data, weight, (Dtype)0., top_data);
-  if (bias_term_) {
-    caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, N_, 1, (Dtype)1.,
-        reinterpret_cast<const Dtype*>(bias_multiplier_->gpu_data()),
-        this->blobs_[1]->gpu_data(), (Dtype)1., top_data);
+  CheckSparseWeights();
+  if (sparse_) {
+    caffe_gpu_gemm_csr(M_, N_, K_, sparse_nnz_,
+        reinterpret_cast<const Dtype*>(sparse_values_->gpu_data()),
+        reinterpret_cast<const int*>(sparse_row_start_->gpu_data()),
+        reinterpret_cast<const int*>(sparse_columns_->gpu_data()),
+        bottom_data, top_data);
+  } else {
+    const Dtype* weight = this->blobs_[0]->gpu_data();
+    caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasTrans, M_, N_, K_, (Dtype)1.,
+        bottom_data, weight, (Dtype)0., top_data);
+  }
+  // The bias and the ReLU in one kernel
+  if (bias_term_ || fused_relu_) {
+    caffe_gpu_add_bias(M_, N_, 1,
+        bias_term_ ? this->blobs_[1]->gpu_data() : NULL, fused_relu_,
+        top_data);
   }
   return Dtype(0);
 }
@@ -33,25 +47,147 @@ template <typename Dtype>
 void InnerProductLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     const bool propagate_down,
     vector<Blob<Dtype>*>* bottom) {
+  CHECK(!int8_) << "A layer with INT8 precision has no backward pass.";
+  CHECK(!sparse_) << "A layer with sparse weights has no backward pass.";
+  if (slices_.size()) {
+    ModelParallelBackward_gpu(top, propagate_down, bottom);
+    return;
+  }
+  if (fused_relu_) {
+    // The ReLU backward pass, in place like the ReLU layer it replaces
+    caffe_gpu_relu_mask(top[0]->count(), top[0]->gpu_data(),
+        top[0]->mutable_gpu_diff());
+  }
   const Dtype* top_diff = top[0]->gpu_diff();
   const Dtype* bottom_data = (*bottom)[0]->gpu_data();
-  // Gradient with respect to weight
-  caffe_gpu_gemm<Dtype>(CblasTrans, CblasNoTrans, N_, K_, M_, (Dtype)1.,
-      top_diff, bottom_data, (Dtype)0., this->blobs_[0]->mutable_gpu_diff());
-  if (bias_term_) {
+  const Dtype param_diff_beta = this->accumulate_param_diffs_ ? 1 : 0;
+  // The parameters with a learning rate of 0 get no gradient.
+  if (this->param_propagate_down(0)) {
+    // Gradient with respect to weight
+    caffe_gpu_gemm<Dtype>(CblasTrans, CblasNoTrans, N_, K_, M_, (Dtype)1.,
+        top_diff, bottom_data, param_diff_beta,
+        this->blobs_[0]->mutable_gpu_diff());
+  }
+  if (bias_term_ && this->param_propagate_down(1)) {
     // Gradient with respect to bias
     caffe_gpu_gemv<Dtype>(CblasTrans, M_, N_, (Dtype)1., top_diff,
         reinterpret_cast<const Dtype*>(bias_multiplier_->gpu_data()),
-        (Dtype)0., this->blobs_[1]->mutable_gpu_diff());
+        param_diff_beta, this->blobs_[1]->mutable_gpu_diff());
   }
   if (propagate_down) {
     // Gradient with respect to bottom data
     caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, K_, N_, (Dtype)1.,
-        top_diff, this->blobs_[0]->gpu_data(), (Dtype)0.,
+        top_diff, this->blobs_[0]->gpu_data(),
+        (Dtype)(this->accumulate_bottom_diffs_ ? 1 : 0),
         (*bottom)[0]->mutable_gpu_diff());
   }
 }
 
+// The memory of count values on the current device, made again if memory is
+// too small.
+template <typename Dtype>
+static Dtype* ReserveGpu(const int count, shared_ptr<SyncedMemory>* memory) {
+  if (!*memory || (*memory)->size() < count * sizeof(Dtype)) {
+    memory->reset(new SyncedMemory(count * sizeof(Dtype)));
+  }
+  return static_cast<Dtype*>((*memory)->mutable_gpu_data());
+}
+
+template <typename Dtype>
+Dtype InnerProductLayer<Dtype>::ModelParallelForward_gpu(
+    const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
+  pass_bottom_data_ = bottom[0]->gpu_data();
+  pass_top_data_ = (*top)[0]->mutable_gpu_data();
+  RunSlices(SLICE_FORWARD);
+  return Dtype(0);
+}
+
+template <typename Dtype>
+void InnerProductLayer<Dtype>::ForwardSlice(Slice* slice) {
+  const int count = slice->count;
+  // Each slice computes its outputs of the whole bottom.
+  Dtype* bottom_data = ReserveGpu<Dtype>(M_ * K_, &slice->bottom);
+  CUDA_CHECK(cudaMemcpy(bottom_data, pass_bottom_data_,
+      M_ * K_ * sizeof(Dtype), cudaMemcpyDefault));
+  Dtype* top_data = ReserveGpu<Dtype>(M_ * count, &slice->top);
+  caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasTrans, M_, count, K_, (Dtype)1.,
+      bottom_data, this->blobs_[slice->id]->gpu_data(), (Dtype)0., top_data);
+  if (bias_term_ || fused_relu_) {
+    caffe_gpu_add_bias(M_, count, 1, bias_term_ ?
+        this->blobs_[slices_.size() + slice->id]->gpu_data() : NULL,
+        fused_relu_, top_data);
+  }
+  // The outputs of the slice are columns of the top.
+  CUDA_CHECK(cudaMemcpy2D(pass_top_data_ + slice->begin, N_ * sizeof(Dtype),
+      top_data, count * sizeof(Dtype), count * sizeof(Dtype), M_,
+      cudaMemcpyDefault));
+}
+
+template <typename Dtype>
+void InnerProductLayer<Dtype>::ModelParallelBackward_gpu(
+    const vector<Blob<Dtype>*>& top, const bool propagate_down,
+    vector<Blob<Dtype>*>* bottom) {
+  if (fused_relu_) {
+    caffe_gpu_relu_mask(top[0]->count(), top[0]->gpu_data(),
+        top[0]->mutable_gpu_diff());
+  }
+  pass_top_diff_ = top[0]->gpu_diff();
+  pass_propagate_down_ = propagate_down;
+  const int count = M_ * K_;
+  if (propagate_down) {
+    pass_bottom_diffs_ = ReserveGpu<Dtype>(count * slices_.size(),
+        &slice_bottom_diffs_);
+  }
+  RunSlices(SLICE_BACKWARD);
+  if (!propagate_down) {
+    return;
+  }
+  // The gradient with respect to the bottom is the sum of those of the
+  // slices.
+  Dtype* bottom_diff = (*bottom)[0]->mutable_gpu_diff();
+  if (this->accumulate_bottom_diffs_) {
+    caffe_gpu_axpy(count, Dtype(1), pass_bottom_diffs_, bottom_diff);
+  } else {
+    caffe_gpu_copy(count, pass_bottom_diffs_, bottom_diff);
+  }
+  for (int i = 1; i < slices_.size(); ++i) {
+    caffe_gpu_axpy(count, Dtype(1), pass_bottom_diffs_ + i * count,
+        bottom_diff);
+  }
+}
+
+template <typename Dtype>
+void InnerProductLayer<Dtype>::BackwardSlice(Slice* slice) {
+  const int count = slice->count;
+  Dtype* top_diff = ReserveGpu<Dtype>(M_ * count, &slice->top);
+  CUDA_CHECK(cudaMemcpy2D(top_diff, count * sizeof(Dtype),
+      pass_top_diff_ + slice->begin, N_ * sizeof(Dtype),
+      count * sizeof(Dtype), M_, cudaMemcpyDefault));
+  // The bottom the forward pass copied
+  const Dtype* bottom_data =
+      static_cast<const Dtype*>(slice->bottom->gpu_data());
+  const Dtype param_diff_beta = this->accumulate_param_diffs_ ? 1 : 0;
+  Blob<Dtype>* weight = this->blobs_[slice->id].get();
+  if (this->param_propagate_down(slice->id)) {
+    caffe_gpu_gemm<Dtype>(CblasTrans, CblasNoTrans, count, K_, M_, (Dtype)1.,
+        top_diff, bottom_data, param_diff_beta, weight->mutable_gpu_diff());
+  }
+  const int bias_id = slices_.size() + slice->id;
+  if (bias_term_ && this->param_propagate_down(bias_id)) {
+    ReserveOnes(M_, &slice->bias_multiplier);
+    caffe_gpu_gemv<Dtype>(CblasTrans, M_, count, (Dtype)1., top_diff,
+        reinterpret_cast<const Dtype*>(slice->bias_multiplier->gpu_data()),
+        param_diff_beta, this->blobs_[bias_id]->mutable_gpu_diff());
+  }
+  if (pass_propagate_down_) {
+    Dtype* bottom_diff = ReserveGpu<Dtype>(M_ * K_, &slice->bottom_diff);
+    caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M_, K_, count,
+        (Dtype)1., top_diff, weight->gpu_data(), (Dtype)0., bottom_diff);
+    CUDA_CHECK(cudaMemcpy(pass_bottom_diffs_ + slice->id * M_ * K_,
+        bottom_diff, M_ * K_ * sizeof(Dtype), cudaMemcpyDefault));
+  }
+}
+
 INSTANTIATE_CLASS(InnerProductLayer);
 
 }  // namespace caffe
@@ -1,13 +1,103 @@
 // Copyright 2014 BVLC and contributors.
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
 #include <vector>
 
 #include "caffe/layer.hpp"
 #include "caffe/vision_layers.hpp"
+#include "caffe/util/cpu_dispatch.hpp"
+#include "caffe/util/cpu_threads.hpp"
 #include "caffe/util/math_functions.hpp"
 
 namespace caffe {
 
+// The number of positions the CPU passes take through the channels at a
+// time, so that the running sums stay in the L1 cache
+const int kLRNTileSize = 256;
+
+// Returns the number of the first n elements MultiplyByPower did with SIMD.
+template <typename Dtype>
+static int MultiplyByPowerSIMD(const int n, const Dtype* in,
+    const Dtype* scale, const Dtype beta, Dtype* out) {
+  return 0;
+}
+
+#ifdef __SSE2__
+template <>
+int MultiplyByPowerSIMD<float>(const int n, const float* in,
+    const float* scale, const float beta, float* out) {
+  if (beta != 0.75f) {
+    return 0;
+  }
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m128 root = _mm_sqrt_ps(_mm_loadu_ps(scale + i));
+    _mm_storeu_ps(out + i, _mm_div_ps(_mm_loadu_ps(in + i),
+        _mm_mul_ps(root, _mm_sqrt_ps(root))));
+  }
+  return i;
+}
+#endif  // __SSE2__
+
+// Sets out[i] = in[i] * scale[i]^-beta for i in [0, n). The beta of 0.75 of
+// the ImageNet models is computed as x^-0.75 = 1 / (sqrt(x) * sqrt(sqrt(x))),
+// much faster than pow.
+template <typename Dtype>
+CAFFE_CPU_DISPATCH
+static void MultiplyByPower(const int n, const Dtype* in, const Dtype* scale,
+    const Dtype beta, Dtype* out) {
+  int i = MultiplyByPowerSIMD(n, in, scale, beta, out);
+  if (beta == Dtype(0.75)) {
+    for (; i < n; ++i) {
+      const Dtype root = sqrt(scale[i]);
+      out[i] = in[i] / (root * sqrt(root));
+    }
+  } else {
+    for (; i < n; ++i) {
+      out[i] = in[i] * pow(scale[i], -beta);
+    }
+  }
+}
+
+// Sets out to the sums of plane, height x width, over the size x size
+// windows centered on each of its positions and clipped to it: separably,
+// the sums over the rows of the windows going to row_sums, a plane too.
+template <typename Dtype>
+CAFFE_CPU_DISPATCH
+static void WindowSums(const Dtype* plane, const int height, const int width,
+    const int size, Dtype* row_sums, Dtype* out) {
+  const int pre_pad = (size - 1) / 2;
+  for (int h = 0; h < height; ++h) {
+    const Dtype* row = plane + h * width;
+    for (int w = 0; w < width; ++w) {
+      const int w_end = std::min(w - pre_pad + size, width);
+      Dtype sum = 0;
+      for (int i = std::max(w - pre_pad, 0); i < w_end; ++i) {
+        sum += row[i];
+      }
+      row_sums[h * width + w] = sum;
+    }
+  }
+  for (int h = 0; h < height; ++h) {
+    Dtype* out_row = out + h * width;
+    for (int w = 0; w < width; ++w) {
+      out_row[w] = 0;
+    }
+    const int h_end = std::min(h - pre_pad + size, height);
+    for (int i = std::max(h - pre_pad, 0); i < h_end; ++i) {
+      const Dtype* row_sum = row_sums + i * width;
+      for (int w = 0; w < width; ++w) {
+        out_row[w] += row_sum[w];
+      }
+    }
+  }
+}
+
 template <typename Dtype>
 void LRNLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
@@ -29,75 +119,27 @@ void LRNLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
     scale_.Reshape(num_, channels_, height_, width_);
     break;
   case LRNParameter_NormRegion_WITHIN_CHANNEL:
-    {
-      // Set up split_layer_ to use inputs in the numerator and denominator.
-      split_top_vec_.clear();
-      split_top_vec_.push_back(bottom[0]);
-      split_top_vec_.push_back(&square_input_);
-      LayerParameter split_param;
-      split_layer_.reset(new SplitLayer<Dtype>(split_param));
-      split_layer_->SetUp(bottom, &split_top_vec_);
-      // Set up square_layer_ to square the inputs.
-      square_input_.Reshape(num_, channels_, height_, width_);
-      square_bottom_vec_.clear();
-      square_top_vec_.clear();
-      square_bottom_vec_.push_back(&square_input_);
-      square_top_vec_.push_back(&square_output_);
-      LayerParameter square_param;
-      square_param.mutable_power_param()->set_power(Dtype(2));
-      square_layer_.reset(new PowerLayer<Dtype>(square_param));
-      square_layer_->SetUp(square_bottom_vec_, &square_top_vec_);
-      CHECK_EQ(square_output_.num(), num_);
-      CHECK_EQ(square_output_.channels(), channels_);
-      CHECK_EQ(square_output_.height(), height_);
-      CHECK_EQ(square_output_.width(), width_);
-      // Set up pool_layer_ to sum over square neighborhoods of the input.
-      pool_top_vec_.clear();
-      pool_top_vec_.push_back(&pool_output_);
-      LayerParameter pool_param;
-      pool_param.mutable_pooling_param()->set_pool(
-          PoolingParameter_PoolMethod_AVE);
-      pool_param.mutable_pooling_param()->set_pad(pre_pad_);
-      pool_param.mutable_pooling_param()->set_kernel_size(size_);
-      pool_layer_.reset(new PoolingLayer<Dtype>(pool_param));
-      pool_layer_->SetUp(square_top_vec_, &pool_top_vec_);
-      CHECK_EQ(pool_output_.num(), num_);
-      CHECK_EQ(pool_output_.channels(), channels_);
-      CHECK_EQ(pool_output_.height(), height_);
-      CHECK_EQ(pool_output_.width(), width_);
-      // Set up power_layer_ to compute (1 + alpha_/N^2 s)^-beta_, where s is
-      // the sum of a squared neighborhood (the output of pool_layer_).
-      power_top_vec_.clear();
-      power_top_vec_.push_back(&power_output_);
-      LayerParameter power_param;
-      power_param.mutable_power_param()->set_power(-beta_);
-      power_param.mutable_power_param()->set_scale(alpha_);
-      power_param.mutable_power_param()->set_shift(Dtype(1));
-      power_layer_.reset(new PowerLayer<Dtype>(power_param));
-      power_layer_->SetUp(pool_top_vec_, &power_top_vec_);
-      CHECK_EQ(power_output_.num(), num_);
-      CHECK_EQ(power_output_.channels(), channels_);
-      CHECK_EQ(power_output_.height(), height_);
-      CHECK_EQ(power_output_.width(), width_);
-      // Set up a product_layer_ to compute outputs by multiplying inputs by the
-      // inverse demoninator computed by the power layer.
-      product_bottom_vec_.clear();
-      product_bottom_vec_.push_back(bottom[0]);
-      product_bottom_vec_.push_back(&power_output_);
-      LayerParameter product_param;
-      product_layer_.reset(new EltwiseProductLayer<Dtype>(product_param));
-      product_layer_->SetUp(product_bottom_vec_, top);
-      CHECK_EQ((*top)[0]->num(), num_);
-      CHECK_EQ((*top)[0]->channels(), channels_);
-      CHECK_EQ((*top)[0]->height(), height_);
-      CHECK_EQ((*top)[0]->width(), width_);
-    }
+    CHECK_EQ(size_ % 2, 1)
+        << "LRN only supports odd values for local_size WITHIN_CHANNEL.";
+    (*top)[0]->Reshape(num_, channels_, height_, width_);
+    scale_.Reshape(num_, channels_, height_, width_);
     break;
   default:
     LOG(FATAL) << "Unknown normalization region.";
   }
 }
 
+template <typename Dtype>
+void LRNLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top) {
+  CHECK_EQ(bottom[0]->channels(), channels_);
+  num_ = bottom[0]->num();
+  height_ = bottom[0]->height();
+  width_ = bottom[0]->width();
+  (*top)[0]->Reshape(num_, channels_, height_, width_);
+  scale_.Reshape(num_, channels_, height_, width_);
+}
+
 template <typename Dtype>
 Dtype LRNLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     vector<Blob<Dtype>*>* top) {
@@ -105,7 +147,7 @@ Dtype LRNLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   case LRNParameter_NormRegion_ACROSS_CHANNELS:
     return CrossChannelForward_cpu(bottom, top);
   case LRNParameter_NormRegion_WITHIN_CHANNEL:
-    return WithinChannelForward(bottom, top);
+    return WithinChannelForward_cpu(bottom, top);
   default:
     LOG(FATAL) << "Unknown normalization region.";
     return Dtype(0);
@@ -118,57 +160,90 @@ Dtype LRNLayer<Dtype>::CrossChannelForward_cpu(
   const Dtype* bottom_data = bottom[0]->cpu_data();
   Dtype* top_data = (*top)[0]->mutable_cpu_data();
   Dtype* scale_data = scale_.mutable_cpu_data();
-  // start with the constant value
-  for (int i = 0; i < scale_.count(); ++i) {
-    scale_data[i] = 1.;
-  }
-  Blob<Dtype> padded_square(1, channels_ + size_ - 1, height_, width_);
-  Dtype* padded_square_data = padded_square.mutable_cpu_data();
-  memset(padded_square_data, 0, sizeof(Dtype) * padded_square.count());
-  Dtype alpha_over_size = alpha_ / size_;
-  // go through the images
+  const Dtype alpha_over_size = alpha_ / size_;
+  const int spatial_dim = height_ * width_;
+  // Channel c is normalized by the channels [c - pre_pad_, c + post_pad].
+  const int post_pad = size_ - 1 - pre_pad_;
+  // go through the images, split over the threads
+  const int num_threads = CpuLayerThreads(num_);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
   for (int n = 0; n < num_; ++n) {
-    // compute the padded square
-    caffe_sqr(channels_ * height_ * width_,
-        bottom_data + bottom[0]->offset(n),
-        padded_square_data + padded_square.offset(0, pre_pad_));
-    // Create the first channel scale
-    for (int c = 0; c < size_; ++c) {
-      caffe_axpy<Dtype>(height_ * width_, alpha_over_size,
-          padded_square_data + padded_square.offset(0, c),
-          scale_data + scale_.offset(n, 0));
-    }
-    for (int c = 1; c < channels_; ++c) {
-      // copy previous scale
-      caffe_copy<Dtype>(height_ * width_,
-          scale_data + scale_.offset(n, c - 1),
-          scale_data + scale_.offset(n, c));
-      // add head
-      caffe_axpy<Dtype>(height_ * width_, alpha_over_size,
-          padded_square_data + padded_square.offset(0, c + size_ - 1),
-          scale_data + scale_.offset(n, c));
-      // subtract tail
-      caffe_axpy<Dtype>(height_ * width_, -alpha_over_size,
-          padded_square_data + padded_square.offset(0, c - 1),
-          scale_data + scale_.offset(n, c));
+    const Dtype* bottom_image = bottom_data + bottom[0]->offset(n);
+    Dtype* top_image = top_data + scale_.offset(n);
+    Dtype* scale_image = scale_data + scale_.offset(n);
+    // A single pass through the channels per tile of positions, sliding the
+    // sum of the squares over the channels
+    Dtype sum_sq[kLRNTileSize];
+    for (int tile = 0; tile < spatial_dim; tile += kLRNTileSize) {
+      const int tile_size = std::min(kLRNTileSize, spatial_dim - tile);
+      for (int i = 0; i < tile_size; ++i) {
+        sum_sq[i] = 0;
+      }
+      for (int c = 0; c < std::min(post_pad, channels_); ++c) {
+        const Dtype* head = bottom_image + c * spatial_dim + tile;
+        for (int i = 0; i < tile_size; ++i) {
+          sum_sq[i] += head[i] * head[i];
+        }
+      }
+      for (int c = 0; c < channels_; ++c) {
+        if (c + post_pad < channels_) {
+          const Dtype* head = bottom_image + (c + post_pad) * spatial_dim +
+              tile;
+          for (int i = 0; i < tile_size; ++i) {
+            sum_sq[i] += head[i] * head[i];
+          }
+        }
+        if (c - pre_pad_ > 0) {
+          const Dtype* tail = bottom_image + (c - pre_pad_ - 1) * spatial_dim
+              + tile;
+          for (int i = 0; i < tile_size; ++i) {
+            sum_sq[i] -= tail[i] * tail[i];
+          }
+        }
+        const int offset = c * spatial_dim + tile;
+        for (int i = 0; i < tile_size; ++i) {
+          scale_image[offset + i] = 1. + alpha_over_size * sum_sq[i];
+        }
+        MultiplyByPower(tile_size, bottom_image + offset, scale_image + offset,
+            beta_, top_image + offset);
+      }
     }
   }
-
-  // In the end, compute output
-  caffe_powx<Dtype>(scale_.count(), scale_data, -beta_, top_data);
-  caffe_mul<Dtype>(scale_.count(), top_data, bottom_data, top_data);
-
   return Dtype(0.);
 }
 
 template <typename Dtype>
-Dtype LRNLayer<Dtype>::WithinChannelForward(
+Dtype LRNLayer<Dtype>::WithinChannelForward_cpu(
     const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
-  split_layer_->Forward(bottom, &split_top_vec_);
-  square_layer_->Forward(square_bottom_vec_, &square_top_vec_);
-  pool_layer_->Forward(square_top_vec_, &pool_top_vec_);
-  power_layer_->Forward(pool_top_vec_, &power_top_vec_);
-  product_layer_->Forward(product_bottom_vec_, top);
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  Dtype* top_data = (*top)[0]->mutable_cpu_data();
+  Dtype* scale_data = scale_.mutable_cpu_data();
+  const Dtype alpha_over_size = alpha_ / (size_ * size_);
+  const int spatial_dim = height_ * width_;
+  // go through the images, split over the threads
+  const int num_threads = CpuLayerThreads(num_);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int n = 0; n < num_; ++n) {
+    vector<Dtype> squares(spatial_dim);
+    vector<Dtype> row_sums(spatial_dim);
+    for (int c = 0; c < channels_; ++c) {
+      const int offset = scale_.offset(n, c);
+      for (int i = 0; i < spatial_dim; ++i) {
+        squares[i] = bottom_data[offset + i] * bottom_data[offset + i];
+      }
+      WindowSums(&squares[0], height_, width_, size_, &row_sums[0],
+          scale_data + offset);
+      for (int i = 0; i < spatial_dim; ++i) {
+        scale_data[offset + i] = 1. + alpha_over_size * scale_data[offset + i];
+      }
+      MultiplyByPower(spatial_dim, bottom_data + offset, scale_data + offset,
+          beta_, top_data + offset);
+    }
+  }
   return Dtype(0.);
 }
 
@@ -180,7 +255,7 @@ void LRNLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     CrossChannelBackward_cpu(top, propagate_down, bottom);
     break;
   case LRNParameter_NormRegion_WITHIN_CHANNEL:
-    WithinChannelBackward(top, propagate_down, bottom);
+    WithinChannelBackward_cpu(top, propagate_down, bottom);
     break;
   default:
     LOG(FATAL) << "Unknown normalization region.";
@@ -196,62 +271,102 @@ void LRNLayer<Dtype>::CrossChannelBackward_cpu(
   const Dtype* bottom_data = (*bottom)[0]->cpu_data();
   const Dtype* scale_data = scale_.cpu_data();
   Dtype* bottom_diff = (*bottom)[0]->mutable_cpu_diff();
-  Blob<Dtype> padded_ratio(1, channels_ + size_ - 1, height_, width_);
-  Blob<Dtype> accum_ratio(1, 1, height_, width_);
-  Dtype* padded_ratio_data = padded_ratio.mutable_cpu_data();
-  Dtype* accum_ratio_data = accum_ratio.mutable_cpu_data();
-  // We hack a little bit by using the diff() to store an additional result
-  Dtype* accum_ratio_times_bottom = accum_ratio.mutable_cpu_diff();
-  memset(padded_ratio_data, 0, sizeof(Dtype) * padded_ratio.count());
-  Dtype cache_ratio_value = 2. * alpha_ * beta_ / size_;
-
-  caffe_powx<Dtype>(scale_.count(), scale_data, -beta_, bottom_diff);
-  caffe_mul<Dtype>(scale_.count(), top_diff, bottom_diff, bottom_diff);
-
-  // go through individual data
-  int inverse_pre_pad = size_ - (size_ + 1) / 2;
+  const Dtype cache_ratio_value = 2. * alpha_ * beta_ / size_;
+  const int spatial_dim = height_ * width_;
+  // Channel c gets the ratios top_diff * top_data / scale of the channels
+  // whose window holds it, [c - post_pad, c + pre_pad_].
+  const int post_pad = size_ - 1 - pre_pad_;
+  // go through the images, split over the threads
+  const int num_threads = CpuLayerThreads(num_);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
   for (int n = 0; n < num_; ++n) {
-    int block_offset = scale_.offset(n);
-    // first, compute diff_i * y_i / s_i
-    caffe_mul<Dtype>(channels_ * height_ * width_,
-        top_diff + block_offset, top_data + block_offset,
-        padded_ratio_data + padded_ratio.offset(0, inverse_pre_pad));
-    caffe_div<Dtype>(channels_ * height_ * width_,
-        padded_ratio_data + padded_ratio.offset(0, inverse_pre_pad),
-        scale_data + block_offset,
-        padded_ratio_data + padded_ratio.offset(0, inverse_pre_pad));
-    // Now, compute the accumulated ratios and the bottom diff
-    memset(accum_ratio_data, 0, sizeof(Dtype) * accum_ratio.count());
-    for (int c = 0; c < size_ - 1; ++c) {
-      caffe_axpy<Dtype>(height_ * width_, 1.,
-          padded_ratio_data + padded_ratio.offset(0, c), accum_ratio_data);
-    }
-    for (int c = 0; c < channels_; ++c) {
-      caffe_axpy<Dtype>(height_ * width_, 1.,
-          padded_ratio_data + padded_ratio.offset(0, c + size_ - 1),
-          accum_ratio_data);
-      // compute bottom diff
-      caffe_mul<Dtype>(height_ * width_,
-          bottom_data + top[0]->offset(n, c),
-          accum_ratio_data, accum_ratio_times_bottom);
-      caffe_axpy<Dtype>(height_ * width_, -cache_ratio_value,
-          accum_ratio_times_bottom, bottom_diff + top[0]->offset(n, c));
-      caffe_axpy<Dtype>(height_ * width_, -1.,
-          padded_ratio_data + padded_ratio.offset(0, c), accum_ratio_data);
+    const int image_offset = scale_.offset(n);
+    // The ratios of channel c are kept in row c % size_ until they leave the
+    // window, size_ channels later.
+    vector<Dtype> ratios(size_ * kLRNTileSize);
+    Dtype accum_ratio[kLRNTileSize];
+    for (int tile = 0; tile < spatial_dim; tile += kLRNTileSize) {
+      const int tile_size = std::min(kLRNTileSize, spatial_dim - tile);
+      for (int i = 0; i < tile_size; ++i) {
+        accum_ratio[i] = 0;
+      }
+      for (int c = -pre_pad_; c < channels_; ++c) {
+        const int tail = c - post_pad - 1;
+        const int head = c + pre_pad_;
+        Dtype* ratio = &ratios[(head % size_) * kLRNTileSize];
+        if (tail >= 0) {
+          // The row of the tail is the one of the head.
+          for (int i = 0; i < tile_size; ++i) {
+            accum_ratio[i] -= ratio[i];
+          }
+        }
+        if (head < channels_) {
+          const int head_offset = image_offset + head * spatial_dim + tile;
+          for (int i = 0; i < tile_size; ++i) {
+            ratio[i] = top_diff[head_offset + i] * top_data[head_offset + i] /
+                scale_data[head_offset + i];
+            accum_ratio[i] += ratio[i];
+          }
+        }
+        if (c < 0) {
+          continue;
+        }
+        // compute bottom diff
+        const int offset = image_offset + c * spatial_dim + tile;
+        MultiplyByPower(tile_size, top_diff + offset, scale_data + offset,
+            beta_, bottom_diff + offset);
+        for (int i = 0; i < tile_size; ++i) {
+          bottom_diff[offset + i] -=
+              cache_ratio_value * bottom_data[offset + i] * accum_ratio[i];
+        }
+      }
     }
   }
 }
 
+// The windows are symmetric: input j is in the window of output i if and
+// only if i is in the window of j, which then gets the ratios
+// top_diff * top_data / scale of its own window.
 template <typename Dtype>
-void LRNLayer<Dtype>::WithinChannelBackward(
+void LRNLayer<Dtype>::WithinChannelBackward_cpu(
     const vector<Blob<Dtype>*>& top, const bool propagate_down,
     vector<Blob<Dtype>*>* bottom) {
-  if (propagate_down) {
-    product_layer_->Backward(top, true, &product_bottom_vec_);
-    power_layer_->Backward(power_top_vec_, true, &pool_top_vec_);
-    pool_layer_->Backward(pool_top_vec_, true, &square_top_vec_);
-    square_layer_->Backward(square_top_vec_, true, &square_bottom_vec_);
-    split_layer_->Backward(split_top_vec_, true, bottom);
+  if (!propagate_down) {
+    return;
+  }
+  const Dtype* top_diff = top[0]->cpu_diff();
+  const Dtype* top_data = top[0]->cpu_data();
+  const Dtype* bottom_data = (*bottom)[0]->cpu_data();
+  const Dtype* scale_data = scale_.cpu_data();
+  Dtype* bottom_diff = (*bottom)[0]->mutable_cpu_diff();
+  const Dtype cache_ratio_value = 2. * alpha_ * beta_ / (size_ * size_);
+  const int spatial_dim = height_ * width_;
+  // go through the images, split over the threads
+  const int num_threads = CpuLayerThreads(num_);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int n = 0; n < num_; ++n) {
+    vector<Dtype> ratios(spatial_dim);
+    vector<Dtype> row_sums(spatial_dim);
+    vector<Dtype> accum_ratios(spatial_dim);
+    for (int c = 0; c < channels_; ++c) {
+      const int offset = scale_.offset(n, c);
+      for (int i = 0; i < spatial_dim; ++i) {
+        ratios[i] = top_diff[offset + i] * top_data[offset + i] /
+            scale_data[offset + i];
+      }
+      WindowSums(&ratios[0], height_, width_, size_, &row_sums[0],
+          &accum_ratios[0]);
+      MultiplyByPower(spatial_dim, top_diff + offset, scale_data + offset,
+          beta_, bottom_diff + offset);
+      for (int i = 0; i < spatial_dim; ++i) {
+        bottom_diff[offset + i] -=
+            cache_ratio_value * bottom_data[offset + i] * accum_ratios[i];
+      }
+    }
   }
 }
 
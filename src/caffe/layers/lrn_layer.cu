@@ -62,7 +62,7 @@ Dtype LRNLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
   case LRNParameter_NormRegion_ACROSS_CHANNELS:
     return CrossChannelForward_gpu(bottom, top);
   case LRNParameter_NormRegion_WITHIN_CHANNEL:
-    return WithinChannelForward(bottom, top);
+    return WithinChannelForward_gpu(bottom, top);
   default:
     LOG(FATAL) << "Unknown normalization region.";
     return Dtype(0);
@@ -110,7 +110,7 @@ void LRNLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     CrossChannelBackward_gpu(top, propagate_down, bottom);
     break;
   case LRNParameter_NormRegion_WITHIN_CHANNEL:
-    WithinChannelBackward(top, propagate_down, bottom);
+    WithinChannelBackward_gpu(top, propagate_down, bottom);
     break;
   default:
     LOG(FATAL) << "Unknown normalization region.";
@@ -191,6 +191,93 @@ void LRNLayer<Dtype>::CrossChannelBackward_gpu(
       (*bottom)[0]->mutable_gpu_diff());
 }
 
+// A thread per position, summing the squares of its window in its channel
+// and computing its scale and its output at once
+template <typename Dtype>
+__global__ void LRNWithinChannelForward(const int nthreads, const Dtype* in,
+    const int height, const int width, const int size,
+    const Dtype alpha_over_size, const Dtype negative_beta, Dtype* scale,
+    Dtype* out) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    const int w = index % width;
+    const int h = (index / width) % height;
+    const Dtype* plane = in + index - h * width - w;
+    const int pre_pad = (size - 1) / 2;
+    const int h_start = max(h - pre_pad, 0);
+    const int h_end = min(h - pre_pad + size, height);
+    const int w_start = max(w - pre_pad, 0);
+    const int w_end = min(w - pre_pad + size, width);
+    Dtype accum_scale = 0;
+    for (int nh = h_start; nh < h_end; ++nh) {
+      for (int nw = w_start; nw < w_end; ++nw) {
+        const Dtype value = plane[nh * width + nw];
+        accum_scale += value * value;
+      }
+    }
+    const Dtype scale_value = 1. + accum_scale * alpha_over_size;
+    scale[index] = scale_value;
+    out[index] = in[index] * pow(scale_value, negative_beta);
+  }
+}
+
+template <typename Dtype>
+Dtype LRNLayer<Dtype>::WithinChannelForward_gpu(
+    const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
+  const int n_threads = bottom[0]->count();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  LRNWithinChannelForward<<<CAFFE_GET_BLOCKS(n_threads),
+      CAFFE_CUDA_NUM_THREADS>>>(n_threads, bottom[0]->gpu_data(), height_,
+      width_, size_, alpha_ / (size_ * size_), -beta_,
+      scale_.mutable_gpu_data(), (*top)[0]->mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+  return Dtype(0.);
+}
+
+// A thread per input, summing the ratios top_diff * top_data / scale of its
+// window, that of the outputs whose window holds it
+template <typename Dtype>
+__global__ void LRNWithinChannelDiff(const int nthreads,
+    const Dtype* bottom_data, const Dtype* top_data, const Dtype* scale,
+    const Dtype* top_diff, const int height, const int width, const int size,
+    const Dtype negative_beta, const Dtype cache_ratio, Dtype* bottom_diff) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    const int w = index % width;
+    const int h = (index / width) % height;
+    const int plane_offset = index - h * width - w;
+    const int pre_pad = (size - 1) / 2;
+    const int h_start = max(h - pre_pad, 0);
+    const int h_end = min(h - pre_pad + size, height);
+    const int w_start = max(w - pre_pad, 0);
+    const int w_end = min(w - pre_pad + size, width);
+    Dtype accum_ratio = 0;
+    for (int nh = h_start; nh < h_end; ++nh) {
+      for (int nw = w_start; nw < w_end; ++nw) {
+        const int offset = plane_offset + nh * width + nw;
+        accum_ratio += top_diff[offset] * top_data[offset] / scale[offset];
+      }
+    }
+    bottom_diff[index] = top_diff[index] * pow(scale[index], negative_beta)
+        - cache_ratio * bottom_data[index] * accum_ratio;
+  }
+}
+
+template <typename Dtype>
+void LRNLayer<Dtype>::WithinChannelBackward_gpu(
+    const vector<Blob<Dtype>*>& top, const bool propagate_down,
+    vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
+  const int n_threads = (*bottom)[0]->count();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  LRNWithinChannelDiff<<<CAFFE_GET_BLOCKS(n_threads),
+      CAFFE_CUDA_NUM_THREADS>>>(n_threads, (*bottom)[0]->gpu_data(),
+      top[0]->gpu_data(), scale_.gpu_data(), top[0]->gpu_diff(), height_,
+      width_, size_, -beta_, Dtype(2. * alpha_ * beta_ / (size_ * size_)),
+      (*bottom)[0]->mutable_gpu_diff());
+  CUDA_POST_KERNEL_CHECK;
+}
+
 
 INSTANTIATE_CLASS(LRNLayer);
 
@@ -1,5 +1,6 @@
 // Copyright 2014 BVLC and contributors.
 
+#include <algorithm>
 #include <vector>
 
 #include "caffe/layer.hpp"
@@ -7,6 +8,14 @@
 
 namespace caffe {
 
+template <typename Dtype>
+MemoryDataLayer<Dtype>::~MemoryDataLayer<Dtype>() {
+  if (stage_stream_) {
+    ClearStage();
+    CUDA_CHECK(cudaStreamDestroy(stage_stream_));
+  }
+}
+
 template <typename Dtype>
 void MemoryDataLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
      vector<Blob<Dtype>*>* top) {
@@ -23,6 +32,25 @@ void MemoryDataLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
   (*top)[1]->Reshape(batch_size_, 1, 1, 1);
   data_ = NULL;
   labels_ = NULL;
+  data_on_gpu_ = false;
+  next_data_ = NULL;
+  next_labels_ = NULL;
+  // Set up the stage buffers for copying host arrays to the device
+  stage_batches_ = this->layer_param_.memory_data_param().stage_batches();
+  if (stage_batches_ > 0 && Caffe::mode() == Caffe::GPU) {
+    const int rows = stage_batches_ * batch_size_;
+    for (int i = 0; i < 2; ++i) {
+      stage_data_[i].Reshape(rows, datum_channels_, datum_height_,
+          datum_width_);
+      stage_labels_[i].Reshape(rows, 1, 1, 1);
+      stage_data_[i].mutable_gpu_data();
+      stage_labels_[i].mutable_gpu_data();
+    }
+    if (!stage_stream_) {
+      CUDA_CHECK(cudaStreamCreate(&stage_stream_));
+    }
+  }
+  ClearStage();
 }
 
 template <typename Dtype>
@@ -30,19 +58,129 @@ void MemoryDataLayer<Dtype>::Reset(Dtype* data, Dtype* labels, int n) {
   CHECK(data);
   CHECK(labels);
   CHECK_EQ(n % batch_size_, 0) << "n must be a multiple of batch size";
+  ClearStage();
   data_ = data;
   labels_ = labels;
+  data_on_gpu_ = false;
+  next_data_ = NULL;
+  next_labels_ = NULL;
   n_ = n;
   pos_ = 0;
+  segment_.reset();
+}
+
+template <typename Dtype>
+void MemoryDataLayer<Dtype>::ResetShared(
+    const shared_ptr<SharedMemorySegment>& segment, const size_t offset,
+    int n) {
+  CHECK(segment);
+  CHECK_LE(offset + sizeof(Dtype) * n * (datum_size_ + 1), segment->size())
+      << "The items go beyond the end of " << segment->name();
+  Dtype* data = reinterpret_cast<Dtype*>(
+      static_cast<char*>(segment->data()) + offset);
+  Reset(data, data + n * datum_size_, n);
+  segment_ = segment;
+}
+
+template <typename Dtype>
+void MemoryDataLayer<Dtype>::set_feed(Feed* feed) {
+  ClearStage();
+  feed_ = feed;
+  batch_.reset();
+}
+
+template <typename Dtype>
+void MemoryDataLayer<Dtype>::ResetGPU(Dtype* data, Dtype* labels, int n) {
+  Reset(data, labels, n);
+  data_on_gpu_ = true;
+}
+
+template <typename Dtype>
+void MemoryDataLayer<Dtype>::ResetNext(Dtype* data, Dtype* labels, int n) {
+  CHECK(data_) << "MemoryDataLayer needs to be initalized by calling Reset";
+  CHECK(!data_on_gpu_) << "ResetNext takes host arrays, after a Reset";
+  CHECK(data);
+  CHECK(labels);
+  CHECK_EQ(n % batch_size_, 0) << "n must be a multiple of batch size";
+  next_data_ = data;
+  next_labels_ = labels;
+  next_n_ = n;
+}
+
+template <typename Dtype>
+void MemoryDataLayer<Dtype>::NextBatch() {
+  pos_ += batch_size_;
+  if (pos_ >= n_) {
+    pos_ = 0;
+    if (next_data_) {
+      data_ = next_data_;
+      labels_ = next_labels_;
+      n_ = next_n_;
+      next_data_ = NULL;
+      next_labels_ = NULL;
+    }
+  }
+}
+
+template <typename Dtype>
+void MemoryDataLayer<Dtype>::ClearStage() {
+  if (stage_stream_) {
+    CUDA_CHECK(cudaStreamSynchronize(stage_stream_));
+  }
+  for (int i = 0; i < 2; ++i) {
+    stage_source_[i] = NULL;
+    stage_start_[i] = 0;
+    stage_rows_[i] = 0;
+  }
+  stage_current_ = 0;
+}
+
+template <typename Dtype>
+bool MemoryDataLayer<Dtype>::Staged(const int buffer) const {
+  return stage_source_[buffer] == data_ && pos_ >= stage_start_[buffer] &&
+      pos_ + batch_size_ <= stage_start_[buffer] + stage_rows_[buffer];
+}
+
+template <typename Dtype>
+void MemoryDataLayer<Dtype>::StageWindow(const int buffer, const Dtype* data,
+    const Dtype* labels, const int n, const int start) {
+  const int rows = std::min(stage_batches_ * batch_size_, n - start);
+  CUDA_CHECK(cudaMemcpyAsync(stage_data_[buffer].mutable_gpu_data(),
+      data + start * datum_size_, sizeof(Dtype) * rows * datum_size_,
+      cudaMemcpyHostToDevice, stage_stream_));
+  CUDA_CHECK(cudaMemcpyAsync(stage_labels_[buffer].mutable_gpu_data(),
+      labels + start, sizeof(Dtype) * rows, cudaMemcpyHostToDevice,
+      stage_stream_));
+  stage_source_[buffer] = data;
+  stage_start_[buffer] = start;
+  stage_rows_[buffer] = rows;
 }
 
 template <typename Dtype>
 Dtype MemoryDataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
+  if (feed_) {
+    batch_ = feed_->pop();
+    CHECK_EQ(batch_->data.count(), (*top)[0]->count())
+        << "The batches fed to " << this->layer_param_.name()
+        << " must be of the shape of its tops";
+    CHECK_EQ(batch_->labels.count(), (*top)[1]->count())
+        << "The batches fed to " << this->layer_param_.name()
+        << " must be of the shape of its tops";
+    (*top)[0]->set_cpu_data(const_cast<Dtype*>(batch_->data.cpu_data()));
+    (*top)[1]->set_cpu_data(const_cast<Dtype*>(batch_->labels.cpu_data()));
+    return Dtype(0.);
+  }
   CHECK(data_) << "MemoryDataLayer needs to be initalized by calling Reset";
-  (*top)[0]->set_cpu_data(data_ + pos_ * datum_size_);
-  (*top)[1]->set_cpu_data(labels_ + pos_);
-  pos_ = (pos_ + batch_size_) % n_;
+  if (data_on_gpu_) {
+    // The tops copy the batch to the host when their cpu data is asked for
+    (*top)[0]->set_gpu_data(data_ + pos_ * datum_size_);
+    (*top)[1]->set_gpu_data(labels_ + pos_);
+  } else {
+    (*top)[0]->set_cpu_data(data_ + pos_ * datum_size_);
+    (*top)[1]->set_cpu_data(labels_ + pos_);
+  }
+  NextBatch();
   return Dtype(0.);
 }
 
@@ -0,0 +1,50 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+Dtype MemoryDataLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top) {
+  if (feed_) {
+    return Forward_cpu(bottom, top);
+  }
+  CHECK(data_) << "MemoryDataLayer needs to be initalized by calling Reset";
+  if (data_on_gpu_ || !stage_stream_) {
+    return Forward_cpu(bottom, top);
+  }
+  // Find the window holding the current batch, staging it if needed
+  if (!Staged(stage_current_)) {
+    const int other = 1 - stage_current_;
+    CUDA_CHECK(cudaStreamSynchronize(stage_stream_));
+    if (!Staged(other)) {
+      StageWindow(other, data_, labels_, n_, pos_);
+      CUDA_CHECK(cudaStreamSynchronize(stage_stream_));
+    }
+    stage_current_ = other;
+    // Start copying the window after it into the other buffer
+    const int end = stage_start_[other] + stage_rows_[other];
+    if (end < n_) {
+      StageWindow(1 - other, data_, labels_, n_, end);
+    } else if (next_data_) {
+      StageWindow(1 - other, next_data_, next_labels_, next_n_, 0);
+    } else {
+      StageWindow(1 - other, data_, labels_, n_, 0);
+    }
+  }
+  const int offset = pos_ - stage_start_[stage_current_];
+  (*top)[0]->set_gpu_data(stage_data_[stage_current_].mutable_gpu_data() +
+      offset * datum_size_);
+  (*top)[1]->set_gpu_data(stage_labels_[stage_current_].mutable_gpu_data() +
+      offset);
+  NextBatch();
+  return Dtype(0.);
+}
+
+INSTANTIATE_CLASS(MemoryDataLayer);
+
+}  // namespace caffe
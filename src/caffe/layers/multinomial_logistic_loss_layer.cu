@@ -0,0 +1,88 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <algorithm>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/vision_layers.hpp"
+#include "caffe/util/math_functions.hpp"
+
+using std::max;
+
+namespace caffe {
+
+// The loss is summed by one block of kMultinomialLossThreads threads, a power
+// of two for the reduction in shared memory.
+const int kMultinomialLossThreads = 256;
+
+// Sets loss, or adds to it if accumulate, the mean over the num items of
+// -log of the probability of their label, each thread summing the items a
+// block apart.
+template <typename Dtype>
+__global__ void MultinomialLogisticLossForward(const int num, const int dim,
+    const Dtype* bottom_data, const Dtype* label, const Dtype threshold,
+    const bool accumulate, Dtype* loss) {
+  __shared__ Dtype buffer[kMultinomialLossThreads];
+  Dtype sum = 0;
+  for (int i = threadIdx.x; i < num; i += kMultinomialLossThreads) {
+    const int index = i * dim + static_cast<int>(label[i]);
+    sum -= log(max(bottom_data[index], threshold));
+  }
+  buffer[threadIdx.x] = sum;
+  __syncthreads();
+  for (int stride = kMultinomialLossThreads / 2; stride > 0; stride /= 2) {
+    if (threadIdx.x < stride) {
+      buffer[threadIdx.x] += buffer[threadIdx.x + stride];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    *loss = (accumulate ? *loss : Dtype(0)) + buffer[0] / num;
+  }
+}
+
+template <typename Dtype>
+__global__ void MultinomialLogisticLossBackward(const int num, const int dim,
+    const Dtype* bottom_data, const Dtype* label, const Dtype threshold,
+    Dtype* bottom_diff) {
+  CUDA_KERNEL_LOOP(i, num) {
+    const int index = i * dim + static_cast<int>(label[i]);
+    bottom_diff[index] = Dtype(-1) / max(bottom_data[index], threshold) / num;
+  }
+}
+
+template <typename Dtype>
+Dtype MultinomialLogisticLossLayer<Dtype>::Forward_gpu(
+    const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
+  int num = bottom[0]->num();
+  int dim = bottom[0]->count() / bottom[0]->num();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  MultinomialLogisticLossForward<Dtype><<<1, kMultinomialLossThreads>>>(
+      num, dim, bottom[0]->gpu_data(), bottom[1]->gpu_data(),
+      Dtype(kLOG_THRESHOLD), this->device_loss_ != NULL,
+      this->device_loss_ ? this->device_loss_ : loss_.mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+  return this->device_loss_ ? Dtype(0) : loss_.cpu_data()[0];
+}
+
+template <typename Dtype>
+void MultinomialLogisticLossLayer<Dtype>::Backward_gpu(
+    const vector<Blob<Dtype>*>& top, const bool propagate_down,
+    vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
+  Dtype* bottom_diff = (*bottom)[0]->mutable_gpu_diff();
+  int num = (*bottom)[0]->num();
+  int dim = (*bottom)[0]->count() / (*bottom)[0]->num();
+  caffe_gpu_set((*bottom)[0]->count(), Dtype(0), bottom_diff);
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  MultinomialLogisticLossBackward<Dtype><<<CAFFE_GET_BLOCKS(num),
+      CAFFE_CUDA_NUM_THREADS>>>(num, dim, (*bottom)[0]->gpu_data(),
+      (*bottom)[1]->gpu_data(), Dtype(kLOG_THRESHOLD), bottom_diff);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+INSTANTIATE_CLASS(MultinomialLogisticLossLayer);
+
+}  // namespace caffe
@@ -20,6 +20,14 @@ void NeuronLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
   }
 }
 
+template <typename Dtype>
+void NeuronLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top) {
+  if ((*top)[0] != bottom[0]) {
+    (*top)[0]->ReshapeLike(*bottom[0]);
+  }
+}
+
 INSTANTIATE_CLASS(NeuronLayer);
 
 }  // namespace caffe
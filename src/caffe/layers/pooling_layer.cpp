@@ -1,12 +1,14 @@
 // Copyright 2014 BVLC and contributors.
 
 #include <algorithm>
-#include <cfloat>
 #include <vector>
 
 #include "caffe/layer.hpp"
 #include "caffe/vision_layers.hpp"
+#include "caffe/util/cpu_threads.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/pooling.hpp"
+#include "caffe/util/window_shape.hpp"
 
 using std::max;
 using std::min;
@@ -18,23 +20,49 @@ void PoolingLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
   CHECK_EQ(bottom.size(), 1) << "PoolingLayer takes a single blob as input.";
   CHECK_EQ(top->size(), 1) << "PoolingLayer takes a single blob as output.";
-  kernel_size_ = this->layer_param_.pooling_param().kernel_size();
-  stride_ = this->layer_param_.pooling_param().stride();
-  pad_ = this->layer_param_.pooling_param().pad();
-  if (pad_ != 0) {
-    CHECK_EQ(this->layer_param_.pooling_param().pool(),
-             PoolingParameter_PoolMethod_AVE)
-        << "Padding implemented only for average pooling.";
-  }
+  const PoolingParameter& pool_param = this->layer_param_.pooling_param();
   channels_ = bottom[0]->channels();
   height_ = bottom[0]->height();
   width_ = bottom[0]->width();
-  pooled_height_ = static_cast<int>(ceil(static_cast<float>(
-      height_ + 2 * pad_ - kernel_size_) / stride_)) + 1;
-  pooled_width_ = static_cast<int>(ceil(static_cast<float>(
-      width_ + 2 * pad_ - kernel_size_) / stride_)) + 1;
+  global_pooling_ = pool_param.global_pooling();
+  if (global_pooling_) {
+    // One window covers each whole channel.
+    CHECK(!pool_param.has_kernel_size() && !pool_param.has_kernel_h() &&
+        !pool_param.has_kernel_w() && !pool_param.has_stride() &&
+        !pool_param.has_stride_h() && !pool_param.has_stride_w() &&
+        !pool_param.has_pad() && !pool_param.has_pad_h() &&
+        !pool_param.has_pad_w())
+        << "Global pooling takes the kernel of the whole input.";
+    kernel_h_ = height_;
+    kernel_w_ = width_;
+    stride_h_ = stride_w_ = 1;
+    pad_h_ = pad_w_ = 0;
+  } else {
+    const WindowShape shape = GetWindowShape(pool_param);
+    kernel_h_ = shape.kernel_h;
+    kernel_w_ = shape.kernel_w;
+    stride_h_ = shape.stride_h;
+    stride_w_ = shape.stride_w;
+    pad_h_ = shape.pad_h;
+    pad_w_ = shape.pad_w;
+  }
+  CHECK_GT(kernel_h_, 0) << "The kernel must not be empty.";
+  CHECK_GT(kernel_w_, 0) << "The kernel must not be empty.";
+  if (pad_h_ != 0 || pad_w_ != 0) {
+    CHECK_EQ(pool_param.pool(), PoolingParameter_PoolMethod_AVE)
+        << "Padding implemented only for average pooling.";
+  }
+  SetInputShape(*bottom[0]);
   (*top)[0]->Reshape(bottom[0]->num(), channels_, pooled_height_,
       pooled_width_);
+  store_argmax_ = this->layer_param_.pooling_param().pool() ==
+      PoolingParameter_PoolMethod_MAX &&
+      this->layer_param_.pooling_param().store_argmax();
+  if (store_argmax_) {
+    max_idx_.Reshape(bottom[0]->num(), channels_, pooled_height_,
+        pooled_width_);
+  }
+  ReshapeRowPool(bottom[0]->num());
   // If stochastic pooling, we will initialize the random index part.
   if (this->layer_param_.pooling_param().pool() ==
       PoolingParameter_PoolMethod_STOCHASTIC) {
@@ -45,71 +73,101 @@ void PoolingLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
 
 // TODO(Yangqing): Is there a faster way to do pooling in the channel-first
 // case?
+template <typename Dtype>
+void PoolingLayer<Dtype>::SetInputShape(const Blob<Dtype>& bottom) {
+  height_ = bottom.height();
+  width_ = bottom.width();
+  if (global_pooling_) {
+    kernel_h_ = height_;
+    kernel_w_ = width_;
+  }
+  pooled_height_ = static_cast<int>(ceil(static_cast<float>(
+      height_ + 2 * pad_h_ - kernel_h_) / stride_h_)) + 1;
+  pooled_width_ = static_cast<int>(ceil(static_cast<float>(
+      width_ + 2 * pad_w_ - kernel_w_) / stride_w_)) + 1;
+}
+
+template <typename Dtype>
+void PoolingLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top) {
+  CHECK_EQ(bottom[0]->channels(), channels_);
+  // Inputs of another height and width are pooled into another shape.
+  if (bottom[0]->height() != height_ || bottom[0]->width() != width_) {
+    SetInputShape(*bottom[0]);
+  }
+  (*top)[0]->Reshape(bottom[0]->num(), channels_, pooled_height_,
+      pooled_width_);
+  ReshapeRowPool(bottom[0]->num());
+  if (store_argmax_) {
+    max_idx_.Reshape(bottom[0]->num(), channels_, pooled_height_,
+        pooled_width_);
+  }
+  if (this->layer_param_.pooling_param().pool() ==
+      PoolingParameter_PoolMethod_STOCHASTIC) {
+    rand_idx_.Reshape(bottom[0]->num(), channels_, pooled_height_,
+      pooled_width_);
+  }
+}
+
+template <typename Dtype>
+void PoolingLayer<Dtype>::ReshapeRowPool(const int num) {
+  // Blobs only get memory once used, by the GPU path.
+  const PoolingParameter_PoolMethod pool =
+      this->layer_param_.pooling_param().pool();
+  if (global_pooling_ || !UseSeparablePool(kernel_h_, kernel_w_) ||
+      pool == PoolingParameter_PoolMethod_STOCHASTIC) {
+    return;
+  }
+  row_pool_.Reshape(num, channels_, height_, pooled_width_);
+  if (pool == PoolingParameter_PoolMethod_MAX) {
+    row_argmax_.Reshape(num, channels_, height_, pooled_width_);
+  }
+}
+
 template <typename Dtype>
 Dtype PoolingLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
-  const Dtype* bottom_data = bottom[0]->cpu_data();
-  Dtype* top_data = (*top)[0]->mutable_cpu_data();
+  const Dtype* bottom_images = bottom[0]->cpu_data();
+  Dtype* top_images = (*top)[0]->mutable_cpu_data();
+  Dtype* max_idx = store_argmax_ ? max_idx_.mutable_cpu_data() : NULL;
+  const int num_threads = CpuLayerThreads(bottom[0]->num());
   // Different pooling methods. We explicitly do the switch outside the for
   // loop to save time, although this results in more codes.
-  int top_count = (*top)[0]->count();
   switch (this->layer_param_.pooling_param().pool()) {
   case PoolingParameter_PoolMethod_MAX:
-    // Initialize
-    for (int i = 0; i < top_count; ++i) {
-      top_data[i] = -FLT_MAX;
-    }
-    // The main loop
+    // The main loop, over the images split between the threads
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
     for (int n = 0; n < bottom[0]->num(); ++n) {
+      const Dtype* bottom_data = bottom_images + bottom[0]->offset(n);
+      Dtype* top_data = top_images + (*top)[0]->offset(n);
+      Dtype* mask = max_idx ? max_idx + (*top)[0]->offset(n) : NULL;
       for (int c = 0; c < channels_; ++c) {
-        for (int ph = 0; ph < pooled_height_; ++ph) {
-          for (int pw = 0; pw < pooled_width_; ++pw) {
-            int hstart = ph * stride_;
-            int wstart = pw * stride_;
-            int hend = min(hstart + kernel_size_, height_);
-            int wend = min(wstart + kernel_size_, width_);
-            for (int h = hstart; h < hend; ++h) {
-              for (int w = wstart; w < wend; ++w) {
-                top_data[ph * pooled_width_ + pw] =
-                  max(top_data[ph * pooled_width_ + pw],
-                      bottom_data[h * width_ + w]);
-              }
-            }
-          }
-        }
+        max_pool_cpu(bottom_data, height_, width_, kernel_h_, kernel_w_,
+            stride_h_, stride_w_, pooled_height_, pooled_width_, top_data,
+            mask);
         // compute offset
         bottom_data += bottom[0]->offset(0, 1);
         top_data += (*top)[0]->offset(0, 1);
+        if (mask) {
+          mask += (*top)[0]->offset(0, 1);
+        }
       }
     }
     break;
   case PoolingParameter_PoolMethod_AVE:
-    for (int i = 0; i < top_count; ++i) {
-      top_data[i] = 0;
-    }
-    // The main loop
+    // The main loop, over the images split between the threads
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
     for (int n = 0; n < bottom[0]->num(); ++n) {
+      const Dtype* bottom_data = bottom_images + bottom[0]->offset(n);
+      Dtype* top_data = top_images + (*top)[0]->offset(n);
       for (int c = 0; c < channels_; ++c) {
-        for (int ph = 0; ph < pooled_height_; ++ph) {
-          for (int pw = 0; pw < pooled_width_; ++pw) {
-            int hstart = ph * stride_ - pad_;
-            int wstart = pw * stride_ - pad_;
-            int hend = min(hstart + kernel_size_, height_ + pad_);
-            int wend = min(wstart + kernel_size_, width_ + pad_);
-            int pool_size = (hend - hstart) * (wend - wstart);
-            hstart = max(hstart, 0);
-            wstart = max(wstart, 0);
-            hend = min(hend, height_);
-            wend = min(wend, width_);
-            for (int h = hstart; h < hend; ++h) {
-              for (int w = wstart; w < wend; ++w) {
-                top_data[ph * pooled_width_ + pw] +=
-                    bottom_data[h * width_ + w];
-              }
-            }
-            top_data[ph * pooled_width_ + pw] /= pool_size;
-          }
-        }
+        ave_pool_cpu(bottom_data, height_, width_, kernel_h_, kernel_w_,
+            stride_h_, stride_w_, pad_h_, pad_w_, pooled_height_,
+            pooled_width_, top_data);
         // compute offset
         bottom_data += bottom[0]->offset(0, 1);
         top_data += (*top)[0]->offset(0, 1);
@@ -117,7 +175,47 @@ Dtype PoolingLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     }
     break;
   case PoolingParameter_PoolMethod_STOCHASTIC:
-    NOT_IMPLEMENTED;
+    if (Caffe::phase() == Caffe::TRAIN && this->recomputing_) {
+      // The elements chosen in the last pass again, rand_idx_ holding their
+      // indices.
+      const Dtype* rand_idx = rand_idx_.cpu_data();
+      for (int i = 0; i < (*top)[0]->count(); ++i) {
+        top_images[i] = bottom_images[static_cast<int>(rand_idx[i])];
+      }
+    } else if (Caffe::phase() == Caffe::TRAIN) {
+      // The draws are made in order before the threads split the images,
+      // so that the outputs do not depend on the number of threads. Each
+      // draw is then replaced by the index of the element it chose in the
+      // whole bottom, as in the GPU path.
+      Dtype* rand_idx = rand_idx_.mutable_cpu_data();
+      caffe_rng_uniform<Dtype>(rand_idx_.count(), Dtype(0), Dtype(1),
+          rand_idx);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+      for (int n = 0; n < bottom[0]->num(); ++n) {
+        for (int c = 0; c < channels_; ++c) {
+          const int top_offset = (*top)[0]->offset(n, c);
+          sto_pool_train_cpu(bottom_images + bottom[0]->offset(n, c),
+              height_, width_, kernel_h_, kernel_w_, stride_h_, stride_w_,
+              pooled_height_, pooled_width_, bottom[0]->offset(n, c),
+              rand_idx + top_offset, top_images + top_offset,
+              rand_idx + top_offset);
+        }
+      }
+    } else {
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+      for (int n = 0; n < bottom[0]->num(); ++n) {
+        for (int c = 0; c < channels_; ++c) {
+          sto_pool_test_cpu(bottom_images + bottom[0]->offset(n, c),
+              height_, width_, kernel_h_, kernel_w_, stride_h_, stride_w_,
+              pooled_height_, pooled_width_,
+              top_images + (*top)[0]->offset(n, c));
+        }
+      }
+    }
     break;
   default:
     LOG(FATAL) << "Unknown pooling method.";
@@ -140,25 +238,26 @@ void PoolingLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
   memset(bottom_diff, 0, (*bottom)[0]->count() * sizeof(Dtype));
   switch (this->layer_param_.pooling_param().pool()) {
   case PoolingParameter_PoolMethod_MAX:
+    if (store_argmax_) {
+      // Each output goes to the max of its window.
+      const Dtype* max_idx = max_idx_.cpu_data();
+      const int pooled_size = pooled_height_ * pooled_width_;
+      for (int i = 0; i < top[0]->num() * channels_; ++i) {
+        for (int j = 0; j < pooled_size; ++j) {
+          bottom_diff[static_cast<int>(max_idx[j])] += top_diff[j];
+        }
+        bottom_diff += (*bottom)[0]->offset(0, 1);
+        max_idx += pooled_size;
+        top_diff += pooled_size;
+      }
+      break;
+    }
     // The main loop
     for (int n = 0; n < top[0]->num(); ++n) {
       for (int c = 0; c < channels_; ++c) {
-        for (int ph = 0; ph < pooled_height_; ++ph) {
-          for (int pw = 0; pw < pooled_width_; ++pw) {
-            int hstart = ph * stride_;
-            int wstart = pw * stride_;
-            int hend = min(hstart + kernel_size_, height_);
-            int wend = min(wstart + kernel_size_, width_);
-            for (int h = hstart; h < hend; ++h) {
-              for (int w = wstart; w < wend; ++w) {
-                bottom_diff[h * width_ + w] +=
-                    top_diff[ph * pooled_width_ + pw] *
-                    (bottom_data[h * width_ + w] ==
-                        top_data[ph * pooled_width_ + pw]);
-              }
-            }
-          }
-        }
+        max_pool_backward_cpu(bottom_data, top_data, top_diff, height_,
+            width_, kernel_h_, kernel_w_, stride_h_, stride_w_,
+            pooled_height_, pooled_width_, bottom_diff);
         // offset
         bottom_data += (*bottom)[0]->offset(0, 1);
         top_data += top[0]->offset(0, 1);
@@ -173,10 +272,10 @@ void PoolingLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       for (int c = 0; c < channels_; ++c) {
         for (int ph = 0; ph < pooled_height_; ++ph) {
           for (int pw = 0; pw < pooled_width_; ++pw) {
-            int hstart = ph * stride_ - pad_;
-            int wstart = pw * stride_ - pad_;
-            int hend = min(hstart + kernel_size_, height_ + pad_);
-            int wend = min(wstart + kernel_size_, width_ + pad_);
+            int hstart = ph * stride_h_ - pad_h_;
+            int wstart = pw * stride_w_ - pad_w_;
+            int hend = min(hstart + kernel_h_, height_ + pad_h_);
+            int wend = min(wstart + kernel_w_, width_ + pad_w_);
             int pool_size = (hend - hstart) * (wend - wstart);
             hstart = max(hstart, 0);
             wstart = max(wstart, 0);
@@ -198,9 +297,14 @@ void PoolingLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       }
     }
     break;
-  case PoolingParameter_PoolMethod_STOCHASTIC:
-    NOT_IMPLEMENTED;
+  case PoolingParameter_PoolMethod_STOCHASTIC: {
+    // Each output goes to the element it drew, indexed in the whole bottom.
+    const Dtype* rand_idx = rand_idx_.cpu_data();
+    for (int i = 0; i < top[0]->count(); ++i) {
+      bottom_diff[static_cast<int>(rand_idx[i])] += top_diff[i];
+    }
     break;
+  }
   default:
     LOG(FATAL) << "Unknown pooling method.";
   }
@@ -7,6 +7,7 @@
 #include "caffe/layer.hpp"
 #include "caffe/vision_layers.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/pooling.hpp"
 
 using std::max;
 using std::min;
@@ -17,24 +18,32 @@ template <typename Dtype>
 __global__ void MaxPoolForward(const int nthreads, const Dtype* bottom_data,
     const int num, const int channels, const int height,
     const int width, const int pooled_height, const int pooled_width,
-    const int kernel_size, const int stride, Dtype* top_data) {
+    const int kernel_h, const int kernel_w, const int stride_h,
+    const int stride_w, Dtype* top_data, Dtype* mask) {
   CUDA_KERNEL_LOOP(index, nthreads) {
     int pw = index % pooled_width;
     int ph = (index / pooled_width) % pooled_height;
     int c = (index / pooled_width / pooled_height) % channels;
     int n = index / pooled_width / pooled_height / channels;
-    int hstart = ph * stride;
-    int hend = min(hstart + kernel_size, height);
-    int wstart = pw * stride;
-    int wend = min(wstart + kernel_size, width);
+    int hstart = ph * stride_h;
+    int hend = min(hstart + kernel_h, height);
+    int wstart = pw * stride_w;
+    int wend = min(wstart + kernel_w, width);
     Dtype maxval = -FLT_MAX;
+    int maxidx = hstart * width + wstart;
     bottom_data += (n * channels + c) * height * width;
     for (int h = hstart; h < hend; ++h) {
       for (int w = wstart; w < wend; ++w) {
-        maxval = max(maxval, bottom_data[h * width + w]);
+        if (maxval < bottom_data[h * width + w]) {
+          maxval = bottom_data[h * width + w];
+          maxidx = h * width + w;
+        }
       }
     }
     top_data[index] = maxval;
+    if (mask) {
+      mask[index] = maxidx;
+    }
   }
 }
 
@@ -42,16 +51,17 @@ template <typename Dtype>
 __global__ void AvePoolForward(const int nthreads, const Dtype* bottom_data,
     const int num, const int channels, const int height,
     const int width, const int pooled_height, const int pooled_width,
-    const int kernel_size, const int stride, const int pad, Dtype* top_data) {
+    const int kernel_h, const int kernel_w, const int stride_h,
+    const int stride_w, const int pad_h, const int pad_w, Dtype* top_data) {
   CUDA_KERNEL_LOOP(index, nthreads) {
     int pw = index % pooled_width;
     int ph = (index / pooled_width) % pooled_height;
     int c = (index / pooled_width / pooled_height) % channels;
     int n = index / pooled_width / pooled_height / channels;
-    int hstart = ph * stride - pad;
-    int wstart = pw * stride - pad;
-    int hend = min(hstart + kernel_size, height + pad);
-    int wend = min(wstart + kernel_size, width + pad);
+    int hstart = ph * stride_h - pad_h;
+    int wstart = pw * stride_w - pad_w;
+    int hend = min(hstart + kernel_h, height + pad_h);
+    int wend = min(wstart + kernel_w, width + pad_w);
     int pool_size = (hend - hstart) * (wend - wstart);
     hstart = max(hstart, 0);
     wstart = max(wstart, 0);
@@ -68,21 +78,125 @@ __global__ void AvePoolForward(const int nthreads, const Dtype* bottom_data,
   }
 }
 
+// The separable path of kernels of kSeparablePoolKernelSize and larger (see
+// util/pooling.hpp), in two passes of a kernel each, which cost twice the
+// kernel size per output rather than its square: the max, or sum, of the
+// part in each row of every window, and then that of those of its rows. The
+// max is the first in the order of the plain loops, the column of each row
+// max being kept in row_argmax.
+template <typename Dtype>
+__global__ void MaxPoolRows(const int nthreads, const Dtype* bottom_data,
+    const int height, const int width, const int pooled_width,
+    const int kernel_w, const int stride_w, Dtype* row_max,
+    Dtype* row_argmax) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    int pw = index % pooled_width;
+    int row = index / pooled_width;
+    int wstart = pw * stride_w;
+    int wend = min(wstart + kernel_w, width);
+    Dtype maxval = -FLT_MAX;
+    int maxidx = wstart;
+    bottom_data += row * width;
+    for (int w = wstart; w < wend; ++w) {
+      if (maxval < bottom_data[w]) {
+        maxval = bottom_data[w];
+        maxidx = w;
+      }
+    }
+    row_max[index] = maxval;
+    row_argmax[index] = maxidx;
+  }
+}
+
+template <typename Dtype>
+__global__ void MaxPoolColumns(const int nthreads, const Dtype* row_max,
+    const Dtype* row_argmax, const int height, const int width,
+    const int pooled_height, const int pooled_width, const int kernel_h,
+    const int stride_h, const int stride_w, Dtype* top_data, Dtype* mask) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    int pw = index % pooled_width;
+    int ph = (index / pooled_width) % pooled_height;
+    int nc = index / pooled_width / pooled_height;
+    int hstart = ph * stride_h;
+    int hend = min(hstart + kernel_h, height);
+    Dtype maxval = -FLT_MAX;
+    int maxidx = hstart * width + pw * stride_w;
+    row_max += nc * height * pooled_width;
+    row_argmax += nc * height * pooled_width;
+    for (int h = hstart; h < hend; ++h) {
+      if (maxval < row_max[h * pooled_width + pw]) {
+        maxval = row_max[h * pooled_width + pw];
+        maxidx = h * width + static_cast<int>(
+            row_argmax[h * pooled_width + pw]);
+      }
+    }
+    top_data[index] = maxval;
+    if (mask) {
+      mask[index] = maxidx;
+    }
+  }
+}
+
+template <typename Dtype>
+__global__ void AvePoolRows(const int nthreads, const Dtype* bottom_data,
+    const int height, const int width, const int pooled_width,
+    const int kernel_w, const int stride_w, const int pad_w, Dtype* row_sum) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    int pw = index % pooled_width;
+    int row = index / pooled_width;
+    int wstart = max(pw * stride_w - pad_w, 0);
+    int wend = min(pw * stride_w - pad_w + kernel_w, width);
+    Dtype sum = 0;
+    bottom_data += row * width;
+    for (int w = wstart; w < wend; ++w) {
+      sum += bottom_data[w];
+    }
+    row_sum[index] = sum;
+  }
+}
+
+template <typename Dtype>
+__global__ void AvePoolColumns(const int nthreads, const Dtype* row_sum,
+    const int height, const int width, const int pooled_height,
+    const int pooled_width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pad_h, const int pad_w,
+    Dtype* top_data) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    int pw = index % pooled_width;
+    int ph = (index / pooled_width) % pooled_height;
+    int nc = index / pooled_width / pooled_height;
+    int hstart = ph * stride_h - pad_h;
+    int wstart = pw * stride_w - pad_w;
+    int hend = min(hstart + kernel_h, height + pad_h);
+    int wend = min(wstart + kernel_w, width + pad_w);
+    int pool_size = (hend - hstart) * (wend - wstart);
+    hstart = max(hstart, 0);
+    hend = min(hend, height);
+    Dtype aveval = 0;
+    row_sum += nc * height * pooled_width;
+    for (int h = hstart; h < hend; ++h) {
+      aveval += row_sum[h * pooled_width + pw];
+    }
+    top_data[index] = aveval / pool_size;
+  }
+}
+
 template <typename Dtype>
 __global__ void StoPoolForwardTrain(const int nthreads,
     const Dtype* bottom_data,
     const int num, const int channels, const int height,
     const int width, const int pooled_height, const int pooled_width,
-    const int kernel_size, const int stride, Dtype* rand_idx, Dtype* top_data) {
+    const int kernel_h, const int kernel_w, const int stride_h,
+    const int stride_w, Dtype* rand_idx, Dtype* top_data) {
   CUDA_KERNEL_LOOP(index, nthreads) {
     int pw = index % pooled_width;
     int ph = (index / pooled_width) % pooled_height;
     int c = (index / pooled_width / pooled_height) % channels;
     int n = index / pooled_width / pooled_height / channels;
-    int hstart = ph * stride;
-    int hend = min(hstart + kernel_size, height);
-    int wstart = pw * stride;
-    int wend = min(wstart + kernel_size, width);
+    int hstart = ph * stride_h;
+    int hend = min(hstart + kernel_h, height);
+    int wstart = pw * stride_w;
+    int wend = min(wstart + kernel_w, width);
     Dtype cumsum = 0.;
     bottom_data += (n * channels + c) * height * width;
     // First pass: get sum
@@ -92,37 +206,51 @@ __global__ void StoPoolForwardTrain(const int nthreads,
       }
     }
     float thres = rand_idx[index] * cumsum;
-    // Second pass: get value, and set index.
+    // Second pass: get value, and set index. The loop goes on to the next
+    // index of the thread once the element is found.
     cumsum = 0;
-    for (int h = hstart; h < hend; ++h) {
+    bool found = false;
+    for (int h = hstart; h < hend && !found; ++h) {
       for (int w = wstart; w < wend; ++w) {
         cumsum += bottom_data[h * width + w];
         if (cumsum >= thres) {
           rand_idx[index] = ((n * channels + c) * height + h) * width + w;
           top_data[index] = bottom_data[h * width + w];
-          return;
+          found = true;
+          break;
         }
       }
     }
   }
 }
 
+// The elements chosen by StoPoolForwardTrain again, from their indices in
+// rand_idx, for a layer recomputing its top.
+template <typename Dtype>
+__global__ void StoPoolForwardAgain(const int nthreads,
+    const Dtype* bottom_data, const Dtype* rand_idx, Dtype* top_data) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    top_data[index] = bottom_data[static_cast<int>(rand_idx[index])];
+  }
+}
+
 
 template <typename Dtype>
 __global__ void StoPoolForwardTest(const int nthreads,
     const Dtype* bottom_data,
     const int num, const int channels, const int height,
     const int width, const int pooled_height, const int pooled_width,
-    const int kernel_size, const int stride, Dtype* top_data) {
+    const int kernel_h, const int kernel_w, const int stride_h,
+    const int stride_w, Dtype* top_data) {
   CUDA_KERNEL_LOOP(index, nthreads) {
     int pw = index % pooled_width;
     int ph = (index / pooled_width) % pooled_height;
     int c = (index / pooled_width / pooled_height) % channels;
     int n = index / pooled_width / pooled_height / channels;
-    int hstart = ph * stride;
-    int hend = min(hstart + kernel_size, height);
-    int wstart = pw * stride;
-    int wend = min(wstart + kernel_size, width);
+    int hstart = ph * stride_h;
+    int hend = min(hstart + kernel_h, height);
+    int wstart = pw * stride_w;
+    int wend = min(wstart + kernel_w, width);
     // We set cumsum to be 0 to avoid divide-by-zero problems
     Dtype cumsum = FLT_MIN;
     Dtype cumvalues = 0.;
@@ -139,29 +267,131 @@ __global__ void StoPoolForwardTest(const int nthreads,
 }
 
 
+// Global pooling of channels channels, a block of CAFFE_CUDA_NUM_THREADS
+// threads per channel, the blocks of the grid taking every gridDim.x-th one:
+// each thread reduces the elements a block apart, and the block the values
+// of its threads in a tree, the first max winning ties as in the plain
+// loops.
+template <typename Dtype>
+__global__ void GlobalPoolForward(const int channels,
+    const Dtype* bottom_data, const int size, const bool max_pool,
+    Dtype* top_data, Dtype* mask) {
+  __shared__ Dtype values[CAFFE_CUDA_NUM_THREADS];
+  __shared__ int indices[CAFFE_CUDA_NUM_THREADS];
+  for (int channel = blockIdx.x; channel < channels; channel += gridDim.x) {
+    const Dtype* channel_data = bottom_data + channel * size;
+    Dtype value = max_pool ? -FLT_MAX : 0;
+    // size if no element is larger than -FLT_MAX
+    int index = size;
+    for (int i = threadIdx.x; i < size; i += blockDim.x) {
+      if (!max_pool) {
+        value += channel_data[i];
+      } else if (value < channel_data[i]) {
+        value = channel_data[i];
+        index = i;
+      }
+    }
+    values[threadIdx.x] = value;
+    indices[threadIdx.x] = index;
+    __syncthreads();
+    for (int step = blockDim.x / 2; step > 0; step /= 2) {
+      if (threadIdx.x < step) {
+        const int other = threadIdx.x + step;
+        if (!max_pool) {
+          values[threadIdx.x] += values[other];
+        } else if (values[threadIdx.x] < values[other] ||
+            (values[threadIdx.x] == values[other] &&
+             indices[other] < indices[threadIdx.x])) {
+          values[threadIdx.x] = values[other];
+          indices[threadIdx.x] = indices[other];
+        }
+      }
+      __syncthreads();
+    }
+    if (threadIdx.x == 0) {
+      top_data[channel] = max_pool ? values[0] : values[0] / size;
+      if (mask) {
+        mask[channel] = indices[0] < size ? indices[0] : 0;
+      }
+    }
+    // The shared values are only overwritten once thread 0 has read them.
+    __syncthreads();
+  }
+}
+
 template <typename Dtype>
 Dtype PoolingLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
   const Dtype* bottom_data = bottom[0]->gpu_data();
   Dtype* top_data = (*top)[0]->mutable_gpu_data();
   int count = (*top)[0]->count();
-  switch (this->layer_param_.pooling_param().pool()) {
+  const PoolingParameter_PoolMethod pool =
+      this->layer_param_.pooling_param().pool();
+  if (global_pooling_ && pool != PoolingParameter_PoolMethod_STOCHASTIC) {
+    // The grid of older devices holds at most 65535 blocks.
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    GlobalPoolForward<Dtype><<<min(count, 65535), CAFFE_CUDA_NUM_THREADS>>>(
+        count, bottom_data, height_ * width_,
+        pool == PoolingParameter_PoolMethod_MAX, top_data,
+        store_argmax_ ? max_idx_.mutable_gpu_data() : NULL);
+    CUDA_POST_KERNEL_CHECK;
+    return Dtype(0.);
+  }
+  const bool separable = UseSeparablePool(kernel_h_, kernel_w_);
+  const int row_count = separable ? row_pool_.count() : 0;
+  switch (pool) {
   case PoolingParameter_PoolMethod_MAX:
+    if (separable) {
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      MaxPoolRows<Dtype><<<CAFFE_GET_BLOCKS(row_count),
+                           CAFFE_CUDA_NUM_THREADS>>>(
+          row_count, bottom_data, height_, width_, pooled_width_,
+          kernel_w_, stride_w_, row_pool_.mutable_gpu_data(),
+          row_argmax_.mutable_gpu_data());
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      MaxPoolColumns<Dtype><<<CAFFE_GET_BLOCKS(count),
+                              CAFFE_CUDA_NUM_THREADS>>>(
+          count, row_pool_.gpu_data(), row_argmax_.gpu_data(), height_,
+          width_, pooled_height_, pooled_width_, kernel_h_, stride_h_,
+          stride_w_, top_data,
+          store_argmax_ ? max_idx_.mutable_gpu_data() : NULL);
+      break;
+    }
     // NOLINT_NEXT_LINE(whitespace/operators)
     MaxPoolForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
         count, bottom_data, bottom[0]->num(), channels_,
-        height_, width_, pooled_height_, pooled_width_, kernel_size_, stride_,
-        top_data);
+        height_, width_, pooled_height_, pooled_width_, kernel_h_, kernel_w_,
+        stride_h_, stride_w_, top_data,
+        store_argmax_ ? max_idx_.mutable_gpu_data() : NULL);
     break;
   case PoolingParameter_PoolMethod_AVE:
+    if (separable) {
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      AvePoolRows<Dtype><<<CAFFE_GET_BLOCKS(row_count),
+                           CAFFE_CUDA_NUM_THREADS>>>(
+          row_count, bottom_data, height_, width_, pooled_width_,
+          kernel_w_, stride_w_, pad_w_, row_pool_.mutable_gpu_data());
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      AvePoolColumns<Dtype><<<CAFFE_GET_BLOCKS(count),
+                              CAFFE_CUDA_NUM_THREADS>>>(
+          count, row_pool_.gpu_data(), height_, width_, pooled_height_,
+          pooled_width_, kernel_h_, kernel_w_, stride_h_, stride_w_, pad_h_,
+          pad_w_, top_data);
+      break;
+    }
     // NOLINT_NEXT_LINE(whitespace/operators)
     AvePoolForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
         count, bottom_data, bottom[0]->num(), channels_,
-        height_, width_, pooled_height_, pooled_width_, kernel_size_, stride_,
-        pad_, top_data);
+        height_, width_, pooled_height_, pooled_width_, kernel_h_, kernel_w_,
+        stride_h_, stride_w_, pad_h_, pad_w_, top_data);
     break;
   case PoolingParameter_PoolMethod_STOCHASTIC:
-    if (Caffe::phase() == Caffe::TRAIN) {
+    if (Caffe::phase() == Caffe::TRAIN && this->recomputing_) {
+      // NOLINT_NEXT_LINE(whitespace/operators)
+      StoPoolForwardAgain<Dtype><<<CAFFE_GET_BLOCKS(count),
+                                   CAFFE_CUDA_NUM_THREADS>>>(
+          count, bottom_data, rand_idx_.gpu_data(), top_data);
+    } else if (Caffe::phase() == Caffe::TRAIN) {
       // We need to create the random index as well.
       caffe_gpu_rng_uniform(count, Dtype(0), Dtype(1),
                             rand_idx_.mutable_gpu_data());
@@ -169,15 +399,16 @@ Dtype PoolingLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       StoPoolForwardTrain<Dtype><<<CAFFE_GET_BLOCKS(count),
                                    CAFFE_CUDA_NUM_THREADS>>>(
           count, bottom_data, bottom[0]->num(), channels_,
-          height_, width_, pooled_height_, pooled_width_, kernel_size_, stride_,
-          rand_idx_.mutable_gpu_data(), top_data);
+          height_, width_, pooled_height_, pooled_width_, kernel_h_,
+          kernel_w_, stride_h_, stride_w_, rand_idx_.mutable_gpu_data(),
+          top_data);
     } else {
       // NOLINT_NEXT_LINE(whitespace/operators)
       StoPoolForwardTest<Dtype><<<CAFFE_GET_BLOCKS(count),
                                   CAFFE_CUDA_NUM_THREADS>>>(
           count, bottom_data, bottom[0]->num(), channels_,
-          height_, width_, pooled_height_, pooled_width_, kernel_size_, stride_,
-          top_data);
+          height_, width_, pooled_height_, pooled_width_, kernel_h_,
+          kernel_w_, stride_h_, stride_w_, top_data);
     }
     break;
   default:
@@ -189,10 +420,11 @@ Dtype PoolingLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
 
 template <typename Dtype>
 __global__ void MaxPoolBackward(const int nthreads, const Dtype* bottom_data,
-    const Dtype* top_data, const Dtype* top_diff,
+    const Dtype* top_data, const Dtype* mask, const Dtype* top_diff,
     const int num, const int channels, const int height,
     const int width, const int pooled_height, const int pooled_width,
-    const int kernel_size, const int stride, Dtype* bottom_diff) {
+    const int kernel_h, const int kernel_w, const int stride_h,
+    const int stride_w, Dtype* bottom_diff) {
   CUDA_KERNEL_LOOP(index, nthreads) {
     // find out the local index
     // find out the local offset
@@ -200,15 +432,29 @@ __global__ void MaxPoolBackward(const int nthreads, const Dtype* bottom_data,
     int h = (index / width) % height;
     int c = (index / width / height) % channels;
     int n = index / width / height / channels;
-    int phstart = (h < kernel_size) ? 0 : (h - kernel_size) / stride + 1;
-    int phend = min(h / stride + 1, pooled_height);
-    int pwstart = (w < kernel_size) ? 0 : (w - kernel_size) / stride + 1;
-    int pwend = min(w / stride + 1, pooled_width);
+    int phstart = (h < kernel_h) ? 0 : (h - kernel_h) / stride_h + 1;
+    int phend = min(h / stride_h + 1, pooled_height);
+    int pwstart = (w < kernel_w) ? 0 : (w - kernel_w) / stride_w + 1;
+    int pwend = min(w / stride_w + 1, pooled_width);
     Dtype gradient = 0;
+    top_diff += (n * channels + c) * pooled_height * pooled_width;
+    if (mask) {
+      // Only the windows whose max is this element count.
+      mask += (n * channels + c) * pooled_height * pooled_width;
+      for (int ph = phstart; ph < phend; ++ph) {
+        for (int pw = pwstart; pw < pwend; ++pw) {
+          if (static_cast<int>(mask[ph * pooled_width + pw]) ==
+              h * width + w) {
+            gradient += top_diff[ph * pooled_width + pw];
+          }
+        }
+      }
+      bottom_diff[index] = gradient;
+      continue;
+    }
     Dtype bottom_datum =
         bottom_data[((n * channels + c) * height + h) * width + w];
     top_data += (n * channels + c) * pooled_height * pooled_width;
-    top_diff += (n * channels + c) * pooled_height * pooled_width;
     for (int ph = phstart; ph < phend; ++ph) {
       for (int pw = pwstart; pw < pwend; ++pw) {
         gradient += top_diff[ph * pooled_width + pw] *
@@ -224,28 +470,29 @@ template <typename Dtype>
 __global__ void AvePoolBackward(const int nthreads, const Dtype* top_diff,
     const int num, const int channels, const int height,
     const int width, const int pooled_height, const int pooled_width,
-    const int kernel_size, const int stride, const int pad,
+    const int kernel_h, const int kernel_w, const int stride_h,
+    const int stride_w, const int pad_h, const int pad_w,
     Dtype* bottom_diff) {
   CUDA_KERNEL_LOOP(index, nthreads) {
     // find out the local index
     // find out the local offset
-    int w = index % width + pad;
-    int h = (index / width) % height + pad;
+    int w = index % width + pad_w;
+    int h = (index / width) % height + pad_h;
     int c = (index / width / height) % channels;
     int n = index / width / height / channels;
-    int phstart = (h < kernel_size) ? 0 : (h - kernel_size) / stride + 1;
-    int phend = min(h / stride + 1, pooled_height);
-    int pwstart = (w < kernel_size) ? 0 : (w - kernel_size) / stride + 1;
-    int pwend = min(w / stride + 1, pooled_width);
+    int phstart = (h < kernel_h) ? 0 : (h - kernel_h) / stride_h + 1;
+    int phend = min(h / stride_h + 1, pooled_height);
+    int pwstart = (w < kernel_w) ? 0 : (w - kernel_w) / stride_w + 1;
+    int pwend = min(w / stride_w + 1, pooled_width);
     Dtype gradient = 0;
     top_diff += (n * channels + c) * pooled_height * pooled_width;
     for (int ph = phstart; ph < phend; ++ph) {
       for (int pw = pwstart; pw < pwend; ++pw) {
         // figure out the pooling size
-        int hstart = ph * stride - pad;
-        int wstart = pw * stride - pad;
-        int hend = min(hstart + kernel_size, height + pad);
-        int wend = min(wstart + kernel_size, width + pad);
+        int hstart = ph * stride_h - pad_h;
+        int wstart = pw * stride_w - pad_w;
+        int hend = min(hstart + kernel_h, height + pad_h);
+        int wend = min(wstart + kernel_w, width + pad_w);
         int pool_size = (hend - hstart) * (wend - wstart);
         gradient += top_diff[ph * pooled_width + pw] / pool_size;
       }
@@ -260,7 +507,8 @@ __global__ void StoPoolBackward(const int nthreads,
     const Dtype* rand_idx, const Dtype* top_diff,
     const int num, const int channels, const int height,
     const int width, const int pooled_height, const int pooled_width,
-    const int kernel_size, const int stride, Dtype* bottom_diff) {
+    const int kernel_h, const int kernel_w, const int stride_h,
+    const int stride_w, Dtype* bottom_diff) {
   CUDA_KERNEL_LOOP(index, nthreads) {
     // find out the local index
     // find out the local offset
@@ -268,10 +516,10 @@ __global__ void StoPoolBackward(const int nthreads,
     int h = (index / width) % height;
     int c = (index / width / height) % channels;
     int n = index / width / height / channels;
-    int phstart = (h < kernel_size) ? 0 : (h - kernel_size) / stride + 1;
-    int phend = min(h / stride + 1, pooled_height);
-    int pwstart = (w < kernel_size) ? 0 : (w - kernel_size) / stride + 1;
-    int pwend = min(w / stride + 1, pooled_width);
+    int phstart = (h < kernel_h) ? 0 : (h - kernel_h) / stride_h + 1;
+    int phend = min(h / stride_h + 1, pooled_height);
+    int pwstart = (w < kernel_w) ? 0 : (w - kernel_w) / stride_w + 1;
+    int pwend = min(w / stride_w + 1, pooled_width);
     Dtype gradient = 0;
     rand_idx += (n * channels + c) * pooled_height * pooled_width;
     top_diff += (n * channels + c) * pooled_height * pooled_width;
@@ -299,23 +547,26 @@ void PoolingLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
   case PoolingParameter_PoolMethod_MAX:
     // NOLINT_NEXT_LINE(whitespace/operators)
     MaxPoolBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
-        count, (*bottom)[0]->gpu_data(), top[0]->gpu_data(), top_diff,
+        count, (*bottom)[0]->gpu_data(), top[0]->gpu_data(),
+        store_argmax_ ? max_idx_.gpu_data() : NULL, top_diff,
         top[0]->num(), channels_, height_, width_, pooled_height_,
-        pooled_width_, kernel_size_, stride_, bottom_diff);
+        pooled_width_, kernel_h_, kernel_w_, stride_h_, stride_w_,
+        bottom_diff);
     break;
   case PoolingParameter_PoolMethod_AVE:
     // NOLINT_NEXT_LINE(whitespace/operators)
     AvePoolBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
         count, top_diff, top[0]->num(), channels_,
-        height_, width_, pooled_height_, pooled_width_, kernel_size_, stride_,
-        pad_, bottom_diff);
+        height_, width_, pooled_height_, pooled_width_, kernel_h_, kernel_w_,
+        stride_h_, stride_w_, pad_h_, pad_w_, bottom_diff);
     break;
   case PoolingParameter_PoolMethod_STOCHASTIC:
     // NOLINT_NEXT_LINE(whitespace/operators)
     StoPoolBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
         count, rand_idx_.gpu_data(), top_diff,
         top[0]->num(), channels_, height_, width_, pooled_height_,
-        pooled_width_, kernel_size_, stride_, bottom_diff);
+        pooled_width_, kernel_h_, kernel_w_, stride_h_, stride_w_,
+        bottom_diff);
     break;
   default:
     LOG(FATAL) << "Unknown pooling method.";
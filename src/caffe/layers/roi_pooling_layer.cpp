@@ -0,0 +1,137 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/vision_layers.hpp"
+#include "caffe/util/math_functions.hpp"
+
+using std::max;
+using std::min;
+
+namespace caffe {
+
+template <typename Dtype>
+void ROIPoolingLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top) {
+  CHECK_EQ(bottom.size(), 2) << "ROIPoolingLayer takes the features and the "
+      "regions as input.";
+  CHECK_EQ(top->size(), 1) << "ROIPoolingLayer takes a single blob as output.";
+  CHECK_EQ(bottom[1]->count() / bottom[1]->num(), 5)
+      << "Each region is (item, x1, y1, x2, y2).";
+  const ROIPoolingParameter& roi_pooling_param =
+      this->layer_param_.roi_pooling_param();
+  pooled_height_ = roi_pooling_param.pooled_h();
+  pooled_width_ = roi_pooling_param.pooled_w();
+  CHECK_GT(pooled_height_, 0);
+  CHECK_GT(pooled_width_, 0);
+  spatial_scale_ = roi_pooling_param.spatial_scale();
+  channels_ = bottom[0]->channels();
+  height_ = bottom[0]->height();
+  width_ = bottom[0]->width();
+  Reshape(bottom, top);
+}
+
+template <typename Dtype>
+void ROIPoolingLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top) {
+  // One item per region, whatever the number of images
+  (*top)[0]->Reshape(bottom[1]->num(), channels_, pooled_height_,
+      pooled_width_);
+  max_idx_.Reshape(bottom[1]->num(), channels_, pooled_height_,
+      pooled_width_);
+}
+
+template <typename Dtype>
+Dtype ROIPoolingLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top) {
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  const Dtype* rois = bottom[1]->cpu_data();
+  Dtype* top_data = (*top)[0]->mutable_cpu_data();
+  Dtype* max_idx = max_idx_.mutable_cpu_data();
+  const int size = height_ * width_;
+  for (int r = 0; r < bottom[1]->num(); ++r, rois += 5) {
+    const int n = static_cast<int>(rois[0]);
+    CHECK_GE(n, 0);
+    CHECK_LT(n, bottom[0]->num());
+    // The region in features, at least one of them wide
+    const int roi_start_w =
+        static_cast<int>(floor(rois[1] * spatial_scale_ + 0.5));
+    const int roi_start_h =
+        static_cast<int>(floor(rois[2] * spatial_scale_ + 0.5));
+    const int roi_end_w =
+        static_cast<int>(floor(rois[3] * spatial_scale_ + 0.5));
+    const int roi_end_h =
+        static_cast<int>(floor(rois[4] * spatial_scale_ + 0.5));
+    const Dtype bin_height =
+        static_cast<Dtype>(max(roi_end_h - roi_start_h + 1, 1))
+        / pooled_height_;
+    const Dtype bin_width =
+        static_cast<Dtype>(max(roi_end_w - roi_start_w + 1, 1))
+        / pooled_width_;
+    for (int c = 0; c < channels_; ++c) {
+      const Dtype* features = bottom_data + (n * channels_ + c) * size;
+      for (int ph = 0; ph < pooled_height_; ++ph) {
+        const int hstart = min(max(static_cast<int>(floor(ph * bin_height))
+            + roi_start_h, 0), height_);
+        const int hend = min(max(static_cast<int>(ceil((ph + 1) * bin_height))
+            + roi_start_h, 0), height_);
+        for (int pw = 0; pw < pooled_width_; ++pw) {
+          const int wstart = min(max(static_cast<int>(floor(pw * bin_width))
+              + roi_start_w, 0), width_);
+          const int wend = min(max(static_cast<int>(ceil((pw + 1) * bin_width))
+              + roi_start_w, 0), width_);
+          // The bins out of the features pool nothing.
+          Dtype maxval = hend > hstart && wend > wstart ? -FLT_MAX : 0;
+          int maxidx = -1;
+          for (int h = hstart; h < hend; ++h) {
+            for (int w = wstart; w < wend; ++w) {
+              if (features[h * width_ + w] > maxval) {
+                maxval = features[h * width_ + w];
+                maxidx = h * width_ + w;
+              }
+            }
+          }
+          *top_data++ = maxval;
+          *max_idx++ = maxidx;
+        }
+      }
+    }
+  }
+  return Dtype(0.);
+}
+
+template <typename Dtype>
+void ROIPoolingLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
+  const Dtype* top_diff = top[0]->cpu_diff();
+  const Dtype* rois = (*bottom)[1]->cpu_data();
+  const Dtype* max_idx = max_idx_.cpu_data();
+  Dtype* bottom_diff = (*bottom)[0]->mutable_cpu_diff();
+  caffe_set((*bottom)[0]->count(), Dtype(0), bottom_diff);
+  const int size = height_ * width_;
+  const int pooled_size = pooled_height_ * pooled_width_;
+  for (int r = 0; r < top[0]->num(); ++r, rois += 5) {
+    const int n = static_cast<int>(rois[0]);
+    for (int c = 0; c < channels_; ++c) {
+      Dtype* diff = bottom_diff + (n * channels_ + c) * size;
+      for (int i = 0; i < pooled_size; ++i) {
+        if (max_idx[i] >= 0) {
+          diff[static_cast<int>(max_idx[i])] += top_diff[i];
+        }
+      }
+      top_diff += pooled_size;
+      max_idx += pooled_size;
+    }
+  }
+}
+
+INSTANTIATE_CLASS(ROIPoolingLayer);
+
+}  // namespace caffe
@@ -0,0 +1,144 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/vision_layers.hpp"
+#include "caffe/util/math_functions.hpp"
+
+using std::max;
+using std::min;
+
+namespace caffe {
+
+template <typename Dtype>
+__global__ void ROIPoolForward(const int nthreads, const Dtype* bottom_data,
+    const Dtype* rois, const Dtype spatial_scale, const int channels,
+    const int height, const int width, const int pooled_height,
+    const int pooled_width, Dtype* top_data, Dtype* max_idx) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    int pw = index % pooled_width;
+    int ph = (index / pooled_width) % pooled_height;
+    int c = (index / pooled_width / pooled_height) % channels;
+    int r = index / pooled_width / pooled_height / channels;
+    rois += r * 5;
+    int n = rois[0];
+    int roi_start_w = floor(rois[1] * spatial_scale + 0.5);
+    int roi_start_h = floor(rois[2] * spatial_scale + 0.5);
+    int roi_end_w = floor(rois[3] * spatial_scale + 0.5);
+    int roi_end_h = floor(rois[4] * spatial_scale + 0.5);
+    Dtype bin_height =
+        static_cast<Dtype>(max(roi_end_h - roi_start_h + 1, 1)) / pooled_height;
+    Dtype bin_width =
+        static_cast<Dtype>(max(roi_end_w - roi_start_w + 1, 1)) / pooled_width;
+    int hstart = min(max(static_cast<int>(floor(ph * bin_height))
+        + roi_start_h, 0), height);
+    int hend = min(max(static_cast<int>(ceil((ph + 1) * bin_height))
+        + roi_start_h, 0), height);
+    int wstart = min(max(static_cast<int>(floor(pw * bin_width))
+        + roi_start_w, 0), width);
+    int wend = min(max(static_cast<int>(ceil((pw + 1) * bin_width))
+        + roi_start_w, 0), width);
+    Dtype maxval = hend > hstart && wend > wstart ? -FLT_MAX : 0;
+    int maxidx = -1;
+    bottom_data += (n * channels + c) * height * width;
+    for (int h = hstart; h < hend; ++h) {
+      for (int w = wstart; w < wend; ++w) {
+        if (bottom_data[h * width + w] > maxval) {
+          maxval = bottom_data[h * width + w];
+          maxidx = h * width + w;
+        }
+      }
+    }
+    top_data[index] = maxval;
+    max_idx[index] = maxidx;
+  }
+}
+
+template <typename Dtype>
+Dtype ROIPoolingLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top) {
+  const int count = (*top)[0]->count();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  ROIPoolForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
+      count, bottom[0]->gpu_data(), bottom[1]->gpu_data(), spatial_scale_,
+      channels_, height_, width_, pooled_height_, pooled_width_,
+      (*top)[0]->mutable_gpu_data(), max_idx_.mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+  return Dtype(0.);
+}
+
+// Each bottom element gathers the gradients of the bins it is the max of,
+// among the bins of the regions of its item that cover it.
+template <typename Dtype>
+__global__ void ROIPoolBackward(const int nthreads, const Dtype* top_diff,
+    const Dtype* max_idx, const Dtype* rois, const int num_rois,
+    const Dtype spatial_scale, const int channels, const int height,
+    const int width, const int pooled_height, const int pooled_width,
+    Dtype* bottom_diff) {
+  CUDA_KERNEL_LOOP(index, nthreads) {
+    int w = index % width;
+    int h = (index / width) % height;
+    int c = (index / width / height) % channels;
+    int n = index / width / height / channels;
+    Dtype gradient = 0;
+    for (int r = 0; r < num_rois; ++r) {
+      const Dtype* roi = rois + r * 5;
+      if (static_cast<int>(roi[0]) != n) {
+        continue;
+      }
+      int roi_start_w = floor(roi[1] * spatial_scale + 0.5);
+      int roi_start_h = floor(roi[2] * spatial_scale + 0.5);
+      int roi_end_w = floor(roi[3] * spatial_scale + 0.5);
+      int roi_end_h = floor(roi[4] * spatial_scale + 0.5);
+      if (w < roi_start_w || w > roi_end_w || h < roi_start_h ||
+          h > roi_end_h) {
+        continue;
+      }
+      Dtype bin_height = static_cast<Dtype>(
+          max(roi_end_h - roi_start_h + 1, 1)) / pooled_height;
+      Dtype bin_width = static_cast<Dtype>(
+          max(roi_end_w - roi_start_w + 1, 1)) / pooled_width;
+      // The bins that may hold (h, w)
+      int phstart = floor(static_cast<Dtype>(h - roi_start_h) / bin_height);
+      int phend = ceil(static_cast<Dtype>(h - roi_start_h + 1) / bin_height);
+      int pwstart = floor(static_cast<Dtype>(w - roi_start_w) / bin_width);
+      int pwend = ceil(static_cast<Dtype>(w - roi_start_w + 1) / bin_width);
+      phstart = min(max(phstart, 0), pooled_height);
+      phend = min(max(phend, 0), pooled_height);
+      pwstart = min(max(pwstart, 0), pooled_width);
+      pwend = min(max(pwend, 0), pooled_width);
+      int offset = (r * channels + c) * pooled_height * pooled_width;
+      for (int ph = phstart; ph < phend; ++ph) {
+        for (int pw = pwstart; pw < pwend; ++pw) {
+          int pooled_index = offset + ph * pooled_width + pw;
+          if (static_cast<int>(max_idx[pooled_index]) == h * width + w) {
+            gradient += top_diff[pooled_index];
+          }
+        }
+      }
+    }
+    bottom_diff[index] = gradient;
+  }
+}
+
+template <typename Dtype>
+void ROIPoolingLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
+  const int count = (*bottom)[0]->count();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  ROIPoolBackward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
+      count, top[0]->gpu_diff(), max_idx_.gpu_data(), (*bottom)[1]->gpu_data(),
+      top[0]->num(), spatial_scale_, channels_, height_, width_,
+      pooled_height_, pooled_width_, (*bottom)[0]->mutable_gpu_diff());
+  CUDA_POST_KERNEL_CHECK;
+}
+
+INSTANTIATE_CLASS(ROIPoolingLayer);
+
+}  // namespace caffe
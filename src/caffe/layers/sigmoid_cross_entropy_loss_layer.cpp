@@ -24,6 +24,14 @@ void SigmoidCrossEntropyLossLayer<Dtype>::FurtherSetUp(
   sigmoid_layer_->SetUp(sigmoid_bottom_vec_, &sigmoid_top_vec_);
 }
 
+template <typename Dtype>
+void SigmoidCrossEntropyLossLayer<Dtype>::Reshape(
+    const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
+  CHECK_EQ(bottom[0]->count(), bottom[1]->count()) <<
+      "SigmoidCrossEntropyLoss Layer inputs must have same count.";
+  sigmoid_layer_->Reshape(sigmoid_bottom_vec_, &sigmoid_top_vec_);
+}
+
 template <typename Dtype>
 Dtype SigmoidCrossEntropyLossLayer<Dtype>::Forward_cpu(
     const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
@@ -48,6 +56,9 @@ template <typename Dtype>
 void SigmoidCrossEntropyLossLayer<Dtype>::Backward_cpu(
     const vector<Blob<Dtype>*>& top, const bool propagate_down,
     vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
   // First, compute the diff
   const int count = (*bottom)[0]->count();
   const int num = (*bottom)[0]->num();
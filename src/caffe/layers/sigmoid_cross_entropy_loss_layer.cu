@@ -36,6 +36,9 @@ template <typename Dtype>
 void SigmoidCrossEntropyLossLayer<Dtype>::Backward_gpu(
     const vector<Blob<Dtype>*>& top, const bool propagate_down,
     vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
   // First, compute the diff
   const int count = (*bottom)[0]->count();
   const int num = (*bottom)[0]->num();
@@ -18,13 +18,6 @@ void SoftmaxLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
   CHECK_EQ(top->size(), 1) << "Softmax Layer takes a single blob as output.";
   (*top)[0]->Reshape(bottom[0]->num(), bottom[0]->channels(),
       bottom[0]->height(), bottom[0]->width());
-  sum_multiplier_.Reshape(1, bottom[0]->channels(),
-      bottom[0]->height(), bottom[0]->width());
-  Dtype* multiplier_data = sum_multiplier_.mutable_cpu_data();
-  for (int i = 0; i < sum_multiplier_.count(); ++i) {
-    multiplier_data[i] = 1.;
-  }
-  scale_.Reshape(bottom[0]->num(), 1, 1, 1);
 }
 
 template <typename Dtype>
@@ -32,29 +25,21 @@ Dtype SoftmaxLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     vector<Blob<Dtype>*>* top) {
   const Dtype* bottom_data = bottom[0]->cpu_data();
   Dtype* top_data = (*top)[0]->mutable_cpu_data();
-  Dtype* scale_data = scale_.mutable_cpu_data();
   int num = bottom[0]->num();
   int dim = bottom[0]->count() / bottom[0]->num();
-  memcpy(top_data, bottom_data, sizeof(Dtype) * bottom[0]->count());
-  // we need to subtract the max to avoid numerical issues, compute the exp,
-  // and then normalize.
+  // One row at a time, so that all the passes but the first find the row in
+  // the cache: we need to subtract the max to avoid numerical issues, compute
+  // the exp, and then normalize.
   for (int i = 0; i < num; ++i) {
-    scale_data[i] = bottom_data[i*dim];
+    const Dtype* bottom_row = bottom_data + i * dim;
+    Dtype* top_row = top_data + i * dim;
+    const Dtype maxval = caffe_cpu_max(dim, bottom_row);
     for (int j = 0; j < dim; ++j) {
-      scale_data[i] = max(scale_data[i], bottom_data[i * dim + j]);
+      top_row[j] = bottom_row[j] - maxval;
     }
-  }
-  // subtraction
-  caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, num, dim, 1, -1.,
-    scale_data, sum_multiplier_.cpu_data(), 1., top_data);
-  // Perform exponentiation
-  caffe_exp<Dtype>(num * dim, top_data, top_data);
-  // sum after exp
-  caffe_cpu_gemv<Dtype>(CblasNoTrans, num, dim, 1., top_data,
-      sum_multiplier_.cpu_data(), 0., scale_data);
-  // Do division
-  for (int i = 0; i < num; ++i) {
-    caffe_scal<Dtype>(dim, Dtype(1.) / scale_data[i], top_data + i * dim);
+    caffe_exp<Dtype>(dim, top_row, top_row);
+    // the exps are positive, so their sum is their asum
+    caffe_scal<Dtype>(dim, Dtype(1.) / caffe_cpu_asum(dim, top_row), top_row);
   }
   return Dtype(0);
 }
@@ -63,23 +48,25 @@ template <typename Dtype>
 void SoftmaxLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const bool propagate_down,
     vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
   const Dtype* top_diff = top[0]->cpu_diff();
   const Dtype* top_data = top[0]->cpu_data();
   Dtype* bottom_diff = (*bottom)[0]->mutable_cpu_diff();
-  Dtype* scale_data = scale_.mutable_cpu_data();
   int num = top[0]->num();
   int dim = top[0]->count() / top[0]->num();
-  memcpy(bottom_diff, top_diff, sizeof(Dtype) * top[0]->count());
-  // Compute inner1d(top_diff, top_data) and subtract them from the bottom diff
   for (int i = 0; i < num; ++i) {
-    scale_data[i] = caffe_cpu_dot<Dtype>(dim, top_diff + i * dim,
-        top_data + i * dim);
+    const Dtype* top_diff_row = top_diff + i * dim;
+    const Dtype* top_data_row = top_data + i * dim;
+    Dtype* bottom_diff_row = bottom_diff + i * dim;
+    // Subtract inner1d(top_diff, top_data) from the top diff, and multiply by
+    // the top data.
+    const Dtype dot = caffe_cpu_dot<Dtype>(dim, top_diff_row, top_data_row);
+    for (int j = 0; j < dim; ++j) {
+      bottom_diff_row[j] = (top_diff_row[j] - dot) * top_data_row[j];
+    }
   }
-  // subtraction
-  caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, num, dim, 1, -1.,
-      scale_data, sum_multiplier_.cpu_data(), 1., bottom_diff);
-  // elementwise multiplication
-  caffe_mul<Dtype>(top[0]->count(), bottom_diff, top_data, bottom_diff);
 }
 
 
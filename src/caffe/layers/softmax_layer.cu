@@ -4,8 +4,6 @@
 #include <cfloat>
 #include <vector>
 
-#include "thrust/device_vector.h"
-
 #include "caffe/layer.hpp"
 #include "caffe/vision_layers.hpp"
 #include "caffe/util/math_functions.hpp"
@@ -14,31 +12,67 @@ using std::max;
 
 namespace caffe {
 
+// The softmax kernels run one block of kSoftmaxThreads threads per row, a
+// power of two for the reductions in shared memory.
+const int kSoftmaxThreads = 256;
+
+// Reduces the values of the threads of the block in buffer, with max if
+// take_max and with + otherwise, and returns the result to all the threads.
 template <typename Dtype>
-__global__ void kernel_get_max(const int num, const int dim,
-    const Dtype* data, Dtype* out) {
-  CUDA_KERNEL_LOOP(index, num) {
-    Dtype maxval = -FLT_MAX;
-    for (int i = 0; i < dim; ++i) {
-      maxval = max(data[index * dim + i], maxval);
+__device__ Dtype block_reduce(const bool take_max, Dtype value,
+    Dtype* buffer) {
+  buffer[threadIdx.x] = value;
+  __syncthreads();
+  for (int stride = kSoftmaxThreads / 2; stride > 0; stride /= 2) {
+    if (threadIdx.x < stride) {
+      buffer[threadIdx.x] = take_max ?
+          max(buffer[threadIdx.x], buffer[threadIdx.x + stride]) :
+          buffer[threadIdx.x] + buffer[threadIdx.x + stride];
     }
-    out[index] = maxval;
+    __syncthreads();
   }
+  const Dtype result = buffer[0];
+  // buffer is reused by the next reduction
+  __syncthreads();
+  return result;
 }
 
 template <typename Dtype>
-__global__ void kernel_softmax_div(const int num, const int dim,
-    const Dtype* scale, Dtype* data) {
-  CUDA_KERNEL_LOOP(index, num * dim) {
-    int n = index / dim;
-    data[index] /= scale[n];
+__global__ void kernel_softmax_forward(const int dim, const Dtype* data,
+    Dtype* out) {
+  __shared__ Dtype buffer[kSoftmaxThreads];
+  const Dtype* row = data + blockIdx.x * dim;
+  Dtype* out_row = out + blockIdx.x * dim;
+  Dtype maxval = -FLT_MAX;
+  for (int i = threadIdx.x; i < dim; i += kSoftmaxThreads) {
+    maxval = max(row[i], maxval);
+  }
+  maxval = block_reduce(true, maxval, buffer);
+  Dtype sum = 0;
+  for (int i = threadIdx.x; i < dim; i += kSoftmaxThreads) {
+    const Dtype value = exp(row[i] - maxval);
+    out_row[i] = value;
+    sum += value;
+  }
+  const Dtype scale = Dtype(1.) / block_reduce(false, sum, buffer);
+  for (int i = threadIdx.x; i < dim; i += kSoftmaxThreads) {
+    out_row[i] *= scale;
   }
 }
 
 template <typename Dtype>
-__global__ void kernel_exp(const int num, const Dtype* data, Dtype* out) {
-  CUDA_KERNEL_LOOP(index, num) {
-    out[index] = exp(data[index]);
+__global__ void kernel_softmax_backward(const int dim, const Dtype* top_diff,
+    const Dtype* top_data, Dtype* bottom_diff) {
+  __shared__ Dtype buffer[kSoftmaxThreads];
+  const int offset = blockIdx.x * dim;
+  Dtype dot = 0;
+  for (int i = threadIdx.x; i < dim; i += kSoftmaxThreads) {
+    dot += top_diff[offset + i] * top_data[offset + i];
+  }
+  dot = block_reduce(false, dot, buffer);
+  for (int i = threadIdx.x; i < dim; i += kSoftmaxThreads) {
+    bottom_diff[offset + i] =
+        (top_diff[offset + i] - dot) * top_data[offset + i];
   }
 }
 
@@ -47,63 +81,32 @@ Dtype SoftmaxLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
     vector<Blob<Dtype>*>* top) {
   const Dtype* bottom_data = bottom[0]->gpu_data();
   Dtype* top_data = (*top)[0]->mutable_gpu_data();
-  Dtype* scale_data = scale_.mutable_gpu_data();
   int num = bottom[0]->num();
   int dim = bottom[0]->count() / bottom[0]->num();
-  CUDA_CHECK(cudaMemcpy(top_data, bottom_data,
-      sizeof(Dtype) * bottom[0]->count(), cudaMemcpyDeviceToDevice));
-  // we need to subtract the max to avoid numerical issues, compute the exp,
-  // and then normalize.
-  // Compute max
+  // The max, the exps and their sum, and the normalization of a row in one
+  // kernel
   // NOLINT_NEXT_LINE(whitespace/operators)
-  kernel_get_max<Dtype><<<CAFFE_GET_BLOCKS(num), CAFFE_CUDA_NUM_THREADS>>>(
-      num, dim, bottom_data, scale_data);
-  // subtraction
-  caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, num, dim, 1, -1.,
-      scale_data, sum_multiplier_.gpu_data(), 1., top_data);
-  // Perform exponentiation
-  // NOLINT_NEXT_LINE(whitespace/operators)
-  kernel_exp<Dtype><<<CAFFE_GET_BLOCKS(num * dim), CAFFE_CUDA_NUM_THREADS>>>(
-      num * dim, top_data, top_data);
-  // sum after exp
-  caffe_gpu_gemv<Dtype>(CblasNoTrans, num, dim, 1., top_data,
-      sum_multiplier_.gpu_data(), 0., scale_data);
-  // Do division
-  // NOLINT_NEXT_LINE(whitespace/operators)
-  kernel_softmax_div<Dtype><<<CAFFE_GET_BLOCKS(num * dim),
-                              CAFFE_CUDA_NUM_THREADS>>>(
-      num, dim, scale_data, top_data);
+  kernel_softmax_forward<Dtype><<<num, kSoftmaxThreads>>>(
+      dim, bottom_data, top_data);
+  CUDA_POST_KERNEL_CHECK;
   return Dtype(0);
 }
 
-// TODO(Yangqing): implement the GPU version of softmax.
 template <typename Dtype>
 void SoftmaxLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
   const Dtype* top_diff = top[0]->gpu_diff();
   const Dtype* top_data = top[0]->gpu_data();
   Dtype* bottom_diff = (*bottom)[0]->mutable_gpu_diff();
   int num = top[0]->num();
   int dim = top[0]->count() / top[0]->num();
-  CUDA_CHECK(cudaMemcpy(bottom_diff, top_diff,
-      sizeof(Dtype) * top[0]->count(), cudaMemcpyDeviceToDevice));
-  // Compute inner1d(top_diff, top_data) and subtract them from the bottom diff
-  // cuda dot returns the result to cpu, so we temporarily change the pointer
-  // mode
-  CUBLAS_CHECK(cublasSetPointerMode(Caffe::cublas_handle(),
-      CUBLAS_POINTER_MODE_DEVICE));
-  Dtype* scale_data = scale_.mutable_gpu_data();
-  for (int i = 0; i < num; ++i) {
-    caffe_gpu_dot<Dtype>(dim, top_diff + i * dim,
-        top_data + i * dim, scale_data + i);
-  }
-  CUBLAS_CHECK(cublasSetPointerMode(Caffe::cublas_handle(),
-      CUBLAS_POINTER_MODE_HOST));
-  // subtraction
-  caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, num, dim, 1, -1.,
-      scale_.gpu_data(), sum_multiplier_.gpu_data(), 1., bottom_diff);
-  // elementwise multiplication
-  caffe_gpu_mul<Dtype>(top[0]->count(), bottom_diff, top_data, bottom_diff);
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  kernel_softmax_backward<Dtype><<<num, kSoftmaxThreads>>>(
+      dim, top_diff, top_data, bottom_diff);
+  CUDA_POST_KERNEL_CHECK;
 }
 
 INSTANTIATE_CLASS(SoftmaxLayer);
@@ -9,6 +9,7 @@
 #include "caffe/util/math_functions.hpp"
 
 using std::max;
+using std::min;
 
 namespace caffe {
 
@@ -21,11 +22,22 @@ void SoftmaxWithLossLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
   softmax_bottom_vec_.push_back(bottom[0]);
   softmax_top_vec_.push_back(&prob_);
   softmax_layer_->SetUp(softmax_bottom_vec_, &softmax_top_vec_);
+  exp_row_.Reshape(1, bottom[0]->count() / bottom[0]->num(), 1, 1);
+  loss_.Reshape(1, 1, 1, 1);
+}
+
+template <typename Dtype>
+void SoftmaxWithLossLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      vector<Blob<Dtype>*>* top) {
+  softmax_layer_->Reshape(softmax_bottom_vec_, &softmax_top_vec_);
 }
 
 template <typename Dtype>
 Dtype SoftmaxWithLossLayer<Dtype>::Forward_cpu(
     const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
+  if (Caffe::phase() == Caffe::TEST) {
+    return TestLoss(bottom);
+  }
   // The forward pass computes the softmax prob values.
   softmax_bottom_vec_[0] = bottom[0];
   softmax_layer_->Forward(softmax_bottom_vec_, &softmax_top_vec_);
@@ -33,10 +45,45 @@ Dtype SoftmaxWithLossLayer<Dtype>::Forward_cpu(
   const Dtype* label = bottom[1]->cpu_data();
   int num = prob_.num();
   int dim = prob_.count() / num;
+  Dtype* item_losses = NULL;
+  if (this->item_losses_) {
+    this->item_losses_->Reshape(num, 1, 1, 1);
+    item_losses = this->item_losses_->mutable_cpu_data();
+  }
   Dtype loss = 0;
   for (int i = 0; i < num; ++i) {
-    loss += -log(max(prob_data[i * dim + static_cast<int>(label[i])],
-                     Dtype(FLT_MIN)));
+    const Dtype item_loss = -log(max(
+        prob_data[i * dim + static_cast<int>(label[i])], Dtype(FLT_MIN)));
+    if (item_losses) {
+      item_losses[i] = item_loss;
+    }
+    loss += item_loss;
+  }
+  return loss / num;
+}
+
+template <typename Dtype>
+Dtype SoftmaxWithLossLayer<Dtype>::TestLoss(
+    const vector<Blob<Dtype>*>& bottom) {
+  // No backward pass follows, so the probabilities are not written out:
+  // -log(prob) = log(sum_j exp(x_j - max)) - (x_label - max), capped like
+  // -log(max(prob, FLT_MIN)).
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  const Dtype* label = bottom[1]->cpu_data();
+  Dtype* exp_data = exp_row_.mutable_cpu_data();
+  int num = bottom[0]->num();
+  int dim = bottom[0]->count() / num;
+  Dtype loss = 0;
+  for (int i = 0; i < num; ++i) {
+    const Dtype* row = bottom_data + i * dim;
+    const Dtype maxval = caffe_cpu_max(dim, row);
+    for (int j = 0; j < dim; ++j) {
+      exp_data[j] = row[j] - maxval;
+    }
+    caffe_exp<Dtype>(dim, exp_data, exp_data);
+    loss += min(log(caffe_cpu_asum(dim, exp_data)) -
+                (row[static_cast<int>(label[i])] - maxval),
+                -log(Dtype(FLT_MIN)));
   }
   return loss / num;
 }
@@ -45,6 +92,9 @@ template <typename Dtype>
 void SoftmaxWithLossLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const bool propagate_down,
     vector<Blob<Dtype>*>* bottom) {
+  if (!propagate_down) {
+    return;
+  }
   // Compute the diff
   Dtype* bottom_diff = (*bottom)[0]->mutable_cpu_diff();
   const Dtype* prob_data = prob_.cpu_data();
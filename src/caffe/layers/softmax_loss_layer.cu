@@ -12,18 +12,96 @@ using std::max;
 
 namespace caffe {
 
+// The loss is summed by one block of kSoftmaxLossThreads threads, a power of
+// two for the reduction in shared memory.
+const int kSoftmaxLossThreads = 256;
+
+// Sets loss, or adds to it if accumulate, the mean over the num items of
+// -log of the probability of their label, as Forward_cpu, each thread
+// summing the items a block apart.
+template <typename Dtype>
+__global__ void SoftmaxLossForward(const int num, const int dim,
+    const Dtype* prob_data, const Dtype* label, const bool accumulate,
+    Dtype* loss) {
+  __shared__ Dtype buffer[kSoftmaxLossThreads];
+  Dtype sum = 0;
+  for (int i = threadIdx.x; i < num; i += kSoftmaxLossThreads) {
+    const int index = i * dim + static_cast<int>(label[i]);
+    sum -= log(max(prob_data[index], Dtype(FLT_MIN)));
+  }
+  buffer[threadIdx.x] = sum;
+  __syncthreads();
+  for (int stride = kSoftmaxLossThreads / 2; stride > 0; stride /= 2) {
+    if (threadIdx.x < stride) {
+      buffer[threadIdx.x] += buffer[threadIdx.x + stride];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    *loss = (accumulate ? *loss : Dtype(0)) + buffer[0] / num;
+  }
+}
+
+// Sets the losses of the num items, as the terms of SoftmaxLossForward.
+template <typename Dtype>
+__global__ void SoftmaxLossItems(const int num, const int dim,
+    const Dtype* prob_data, const Dtype* label, Dtype* item_losses) {
+  CUDA_KERNEL_LOOP(i, num) {
+    const int index = i * dim + static_cast<int>(label[i]);
+    item_losses[i] = -log(max(prob_data[index], Dtype(FLT_MIN)));
+  }
+}
+
+template <typename Dtype>
+__global__ void SoftmaxLossBackward(const int num, const int dim,
+    const Dtype* label, Dtype* bottom_diff) {
+  CUDA_KERNEL_LOOP(i, num) {
+    bottom_diff[i * dim + static_cast<int>(label[i])] -= 1;
+  }
+}
+
 template <typename Dtype>
 Dtype SoftmaxWithLossLayer<Dtype>::Forward_gpu(
     const vector<Blob<Dtype>*>& bottom, vector<Blob<Dtype>*>* top) {
   // The forward pass computes the softmax prob values.
-  return Forward_cpu(bottom, top);
+  softmax_bottom_vec_[0] = bottom[0];
+  softmax_layer_->Forward(softmax_bottom_vec_, &softmax_top_vec_);
+  const int num = prob_.num();
+  const int dim = prob_.count() / num;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  SoftmaxLossForward<Dtype><<<1, kSoftmaxLossThreads>>>(
+      num, dim, prob_.gpu_data(), bottom[1]->gpu_data(),
+      this->device_loss_ != NULL,
+      this->device_loss_ ? this->device_loss_ : loss_.mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+  if (this->item_losses_) {
+    this->item_losses_->Reshape(num, 1, 1, 1);
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    SoftmaxLossItems<Dtype><<<CAFFE_GET_BLOCKS(num), CAFFE_CUDA_NUM_THREADS>>>(
+        num, dim, prob_.gpu_data(), bottom[1]->gpu_data(),
+        this->item_losses_->mutable_gpu_data());
+    CUDA_POST_KERNEL_CHECK;
+  }
+  return this->device_loss_ ? Dtype(0) : loss_.cpu_data()[0];
 }
 
 template <typename Dtype>
 void SoftmaxWithLossLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
-  // TODO(Yangqing): implement the GPU version of softmax.
-  Backward_cpu(top, propagate_down, bottom);
+  if (!propagate_down) {
+    return;
+  }
+  Dtype* bottom_diff = (*bottom)[0]->mutable_gpu_diff();
+  caffe_gpu_copy(prob_.count(), prob_.gpu_data(), bottom_diff);
+  const int num = prob_.num();
+  const int dim = prob_.count() / num;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  SoftmaxLossBackward<Dtype><<<CAFFE_GET_BLOCKS(num),
+      CAFFE_CUDA_NUM_THREADS>>>(num, dim, (*bottom)[1]->gpu_data(),
+      bottom_diff);
+  CUDA_POST_KERNEL_CHECK;
+  // Scale down gradient
+  caffe_gpu_scal(prob_.count(), Dtype(1) / num, bottom_diff);
 }
 
 INSTANTIATE_CLASS(SoftmaxWithLossLayer);
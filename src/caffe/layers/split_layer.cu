@@ -21,10 +21,22 @@ template <typename Dtype>
 void SplitLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
       const bool propagate_down, vector<Blob<Dtype>*>* bottom) {
   if (propagate_down) {
-    (*bottom)[0]->ShareDiff(*top[0]);
+    // The tops whose consumers added their gradients to the bottom diff
+    // directly share it (see NetParameter.accumulate_split_diffs); if there
+    // are none, the diff of the first top becomes the bottom diff.
+    bool shared = false;
+    for (int i = 0; i < top.size(); ++i) {
+      shared |= top[i]->diff() == (*bottom)[0]->diff();
+    }
+    if (!shared) {
+      (*bottom)[0]->ShareDiff(*top[0]);
+    }
     // Add remaining top blob diffs.
     Dtype* bottom_diff = (*bottom)[0]->mutable_gpu_diff();
-    for (int i = 1; i < top.size(); ++i) {
+    for (int i = 0; i < top.size(); ++i) {
+      if (top[i]->diff() == (*bottom)[0]->diff()) {
+        continue;
+      }
       const Dtype* top_diff = top[i]->gpu_diff();
       caffe_gpu_axpy(count_, Dtype(1.), top_diff, bottom_diff);
     }
@@ -2,6 +2,7 @@
 //
 // Based on data_layer.cpp by Yangqing Jia.
 
+#include <limits.h>
 #include <stdint.h>
 #include <pthread.h>
 
@@ -12,16 +13,22 @@
 #include <fstream>  // NOLINT(readability/streams)
 #include <utility>
 
+#include <boost/date_time/posix_time/posix_time.hpp>
+
 #include "opencv2/core/core.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 
 #include "caffe/layer.hpp"
+#include "caffe/util/data_transform.hpp"
+#include "caffe/util/image_cache.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
 #include "caffe/util/rng.hpp"
 #include "caffe/vision_layers.hpp"
 
+using boost::posix_time::microsec_clock;
+using boost::posix_time::ptime;
 using std::string;
 using std::map;
 using std::pair;
@@ -32,220 +39,388 @@ using std::pair;
 
 namespace caffe {
 
-template <typename Dtype>
-void* WindowDataLayerPrefetch(void* layer_pointer) {
-  WindowDataLayer<Dtype>* layer =
-      reinterpret_cast<WindowDataLayer<Dtype>*>(layer_pointer);
-
-  // At each iteration, sample N windows where N*p are foreground (object)
-  // windows and N*(1-p) are background (non-object) windows
+// The wall clock time since start, in milliseconds, as for the DataLayer.
+static double MilliSecondsSince(const ptime& start) {
+  return (microsec_clock::local_time() - start).total_microseconds() / 1000.;
+}
 
-  Dtype* top_data = layer->prefetch_data_->mutable_cpu_data();
-  Dtype* top_label = layer->prefetch_label_->mutable_cpu_data();
+template <typename Dtype>
+void* WindowDataLayerPrefetchWorker(void* context_pointer) {
+  CHECK(context_pointer);
+  WindowDataLayerPrefetchWorkerContext<Dtype>* context =
+      static_cast<WindowDataLayerPrefetchWorkerContext<Dtype>*>(
+          context_pointer);
+  WindowDataLayer<Dtype>* layer = context->layer;
+  CHECK(layer);
+  const int batch_id = context->batch_id;
+  context->decode_ms = 0;
+  context->transform_ms = 0;
+  context->pixel_bytes = 0;
+  const bool gpu_transform = layer->gpu_transform_;
+  Dtype* top_data = NULL;
+  uint8_t* pixels = NULL;
+  int* warps = NULL;
+  if (gpu_transform) {
+    pixels = static_cast<uint8_t*>(
+        layer->prefetch_pixels_[batch_id]->mutable_cpu_data())
+        + context->item_begin * layer->max_image_bytes_;
+    warps = static_cast<int*>(
+        layer->prefetch_warps_[batch_id]->mutable_cpu_data());
+  } else {
+    top_data = layer->prefetch_data_[batch_id]->mutable_cpu_data();
+  }
+  const int pixel_capacity =
+      (context->item_end - context->item_begin) * layer->max_image_bytes_;
   const Dtype scale = layer->layer_param_.window_data_param().scale();
-  const int batch_size = layer->layer_param_.window_data_param().batch_size();
   const int crop_size = layer->layer_param_.window_data_param().crop_size();
   const int context_pad = layer->layer_param_.window_data_param().context_pad();
-  const bool mirror = layer->layer_param_.window_data_param().mirror();
-  const float fg_fraction =
-      layer->layer_param_.window_data_param().fg_fraction();
-  const Dtype* mean = layer->data_mean_.cpu_data();
+  // Either mean (the mean image) or mean_values (one per channel) is set.
+  const Dtype* mean = NULL;
+  const Dtype* mean_values = NULL;
+  if (layer->mean_values_.empty()) {
+    mean = layer->data_mean_.cpu_data();
+  } else {
+    mean_values = &layer->mean_values_[0];
+  }
   const int mean_off = (layer->data_mean_.width() - crop_size) / 2;
   const int mean_width = layer->data_mean_.width();
   const int mean_height = layer->data_mean_.height();
-  cv::Size cv_crop_size(crop_size, crop_size);
   const string& crop_mode = layer->layer_param_.window_data_param().crop_mode();
 
   bool use_square = (crop_mode == "square") ? true : false;
 
-  // zero out batch
-  memset(top_data, 0, sizeof(Dtype)*layer->prefetch_data_->count());
+  // the image decoded last, its index in the window list, and with
+  // gpu_transform its offset in the pixels of the batch
+  cv::Mat cv_img;
+  int cv_img_index = -1;
+  int cv_img_offset = 0;
+  string image_path;
+  for (int i = context->item_begin; i < context->item_end; ++i) {
+    const int item_id = layer->prefetch_order_[i].second;
+    const WindowList::Window& window =
+        layer->windows_.window(layer->prefetch_windows_[item_id]);
+    const bool do_mirror = layer->prefetch_mirror_[item_id];
+    cv::Size cv_crop_size(crop_size, crop_size);
+    if (gpu_transform) {
+      // an empty warp, unless the image is read
+      warps[item_id * WindowDataLayer<Dtype>::kWarpParams + 8] = 0;
+    }
+
+    // load the image containing the window; the windows of an image come one
+    // after the other, so it is often the image of the previous window
+    const int image_index = window.image_index;
+    if (image_index != cv_img_index) {
+      cv_img_index = -1;
+      image_path = layer->windows_.image_path(image_index);
+      if (!layer->image_cache_ ||
+          !layer->image_cache_->Get(image_path, &cv_img)) {
+        const ptime decode_start = microsec_clock::local_time();
+        const bool decoded = ReadImageToCVMat(image_path, 0, 0, &cv_img);
+        context->decode_ms += MilliSecondsSince(decode_start);
+        if (!decoded) {
+          continue;
+        }
+        if (layer->image_cache_) {
+          layer->image_cache_->Put(image_path, cv_img);
+        }
+      }
+      cv_img_index = image_index;
+      if (gpu_transform) {
+        // the image goes to the device once for all of its windows here
+        const int row_bytes = cv_img.cols * cv_img.channels();
+        CHECK_EQ(cv_img.channels(), layer->prefetch_data_[batch_id]->channels())
+            << image_path << " has another number of channels than the batch";
+        CHECK_LE(context->pixel_bytes + cv_img.rows * row_bytes,
+            pixel_capacity) << image_path << " is larger than the window file "
+            "says";
+        cv_img_offset = context->item_begin * layer->max_image_bytes_
+            + context->pixel_bytes;
+        for (int h = 0; h < cv_img.rows; ++h) {
+          memcpy(pixels + context->pixel_bytes, cv_img.ptr<uint8_t>(h),
+              row_bytes);
+          context->pixel_bytes += row_bytes;
+        }
+      }
+    }
+    const int channels = cv_img.channels();
+    const ptime transform_start = microsec_clock::local_time();
+
+    // crop window out of image and warp it
+    int x1 = window.x1;
+    int y1 = window.y1;
+    int x2 = window.x2;
+    int y2 = window.y2;
+
+    int pad_w = 0;
+    int pad_h = 0;
+    if (context_pad > 0 || use_square) {
+      // scale factor by which to expand the original region
+      // such that after warping the expanded region to crop_size x crop_size
+      // there's exactly context_pad amount of padding on each side
+      Dtype context_scale = static_cast<Dtype>(crop_size) /
+          static_cast<Dtype>(crop_size - 2*context_pad);
+
+      // compute the expanded region
+      Dtype half_height = static_cast<Dtype>(y2-y1+1)/2.0;
+      Dtype half_width = static_cast<Dtype>(x2-x1+1)/2.0;
+      Dtype center_x = static_cast<Dtype>(x1) + half_width;
+      Dtype center_y = static_cast<Dtype>(y1) + half_height;
+      if (use_square) {
+        if (half_height > half_width) {
+          half_width = half_height;
+        } else {
+          half_height = half_width;
+        }
+      }
+      x1 = static_cast<int>(round(center_x - half_width*context_scale));
+      x2 = static_cast<int>(round(center_x + half_width*context_scale));
+      y1 = static_cast<int>(round(center_y - half_height*context_scale));
+      y2 = static_cast<int>(round(center_y + half_height*context_scale));
+
+      // the expanded region may go outside of the image
+      // so we compute the clipped (expanded) region and keep track of
+      // the extent beyond the image
+      int unclipped_height = y2-y1+1;
+      int unclipped_width = x2-x1+1;
+      int pad_x1 = std::max(0, -x1);
+      int pad_y1 = std::max(0, -y1);
+      int pad_x2 = std::max(0, x2 - cv_img.cols + 1);
+      int pad_y2 = std::max(0, y2 - cv_img.rows + 1);
+      // clip bounds
+      x1 = x1 + pad_x1;
+      x2 = x2 - pad_x2;
+      y1 = y1 + pad_y1;
+      y2 = y2 - pad_y2;
+      CHECK_GT(x1, -1);
+      CHECK_GT(y1, -1);
+      CHECK_LT(x2, cv_img.cols);
+      CHECK_LT(y2, cv_img.rows);
+
+      int clipped_height = y2-y1+1;
+      int clipped_width = x2-x1+1;
+
+      // scale factors that would be used to warp the unclipped
+      // expanded region
+      Dtype scale_x =
+          static_cast<Dtype>(crop_size)/static_cast<Dtype>(unclipped_width);
+      Dtype scale_y =
+          static_cast<Dtype>(crop_size)/static_cast<Dtype>(unclipped_height);
+
+      // size to warp the clipped expanded region to
+      cv_crop_size.width =
+          static_cast<int>(round(static_cast<Dtype>(clipped_width)*scale_x));
+      cv_crop_size.height =
+          static_cast<int>(round(static_cast<Dtype>(clipped_height)*scale_y));
+      pad_x1 = static_cast<int>(round(static_cast<Dtype>(pad_x1)*scale_x));
+      pad_x2 = static_cast<int>(round(static_cast<Dtype>(pad_x2)*scale_x));
+      pad_y1 = static_cast<int>(round(static_cast<Dtype>(pad_y1)*scale_y));
+      pad_y2 = static_cast<int>(round(static_cast<Dtype>(pad_y2)*scale_y));
+
+      pad_h = pad_y1;
+      // if we're mirroring, we mirror the padding too (to be pedantic)
+      if (do_mirror) {
+        pad_w = pad_x2;
+      } else {
+        pad_w = pad_x1;
+      }
+
+      // ensure that the warped, clipped region plus the padding fits in the
+      // crop_size x crop_size image (it might not due to rounding)
+      if (pad_h + cv_crop_size.height > crop_size) {
+        cv_crop_size.height = crop_size - pad_h;
+      }
+      if (pad_w + cv_crop_size.width > crop_size) {
+        cv_crop_size.width = crop_size - pad_w;
+      }
+    }
+
+    if (gpu_transform) {
+      // Forward_gpu warps the window on the device.
+      int* warp = warps + item_id * WindowDataLayer<Dtype>::kWarpParams;
+      warp[0] = cv_img_offset;
+      warp[1] = cv_img.cols;
+      warp[2] = x1;
+      warp[3] = y1;
+      warp[4] = x2 - x1 + 1;
+      warp[5] = y2 - y1 + 1;
+      warp[6] = pad_w;
+      warp[7] = pad_h;
+      warp[8] = cv_crop_size.width;
+      warp[9] = cv_crop_size.height;
+      warp[10] = do_mirror;
+      context->transform_ms += MilliSecondsSince(transform_start);
+      continue;
+    }
+    cv::Rect roi(x1, y1, x2-x1+1, y2-y1+1);
+    // the resize writes to a new image, leaving the (possibly cached)
+    // decoded image untouched
+    cv::Mat cv_cropped_img;
+    cv::resize(cv_img(roi), cv_cropped_img,
+        cv_crop_size, 0, 0, cv::INTER_LINEAR);
+
+    // horizontal flip at random
+    if (do_mirror) {
+      cv::flip(cv_cropped_img, cv_cropped_img, 1);
+    }
+
+    // copy the warped window into top_data, one channel of a row at a time
+    for (int c = 0; c < channels; ++c) {
+      for (int h = 0; h < cv_cropped_img.rows; ++h) {
+        const uint8_t* row = cv_cropped_img.ptr<uint8_t>(h) + c;
+        Dtype* top_row = top_data
+            + ((item_id * channels + c) * crop_size + h + pad_h) * crop_size
+            + pad_w;
+        if (mean) {
+          TransformRow(cv_cropped_img.cols, row, channels, false,
+              mean + (c * mean_height + h + mean_off + pad_h) * mean_width
+                  + mean_off + pad_w,
+              scale, top_row);
+        } else {
+          TransformRowMeanValue(cv_cropped_img.cols, row, channels, false,
+              mean_values[c], scale, top_row);
+        }
+      }
+    }
+    context->transform_ms += MilliSecondsSince(transform_start);
+
+    #if 0
+    // useful debugging code for dumping transformed windows to disk
+    string file_id;
+    std::stringstream ss;
+    ss << layer->PrefetchRand();
+    ss >> file_id;
+    std::ofstream inf((string("dump/") + file_id +
+        string("_info.txt")).c_str(), std::ofstream::out);
+    inf << image_path << std::endl
+        << window.x1+1 << std::endl
+        << window.y1+1 << std::endl
+        << window.x2+1 << std::endl
+        << window.y2+1 << std::endl
+        << do_mirror << std::endl
+        << layer->prefetch_label_[batch_id]->cpu_data()[item_id] << std::endl
+        << (layer->prefetch_label_[batch_id]->cpu_data()[item_id] > 0)
+        << std::endl;
+    inf.close();
+    std::ofstream top_data_file((string("dump/") + file_id +
+        string("_data.txt")).c_str(),
+        std::ofstream::out | std::ofstream::binary);
+    for (int c = 0; c < channels; ++c) {
+      for (int h = 0; h < crop_size; ++h) {
+        for (int w = 0; w < crop_size; ++w) {
+          top_data_file.write(reinterpret_cast<char*>(
+              &top_data[((item_id * channels + c) * crop_size + h)
+                        * crop_size + w]),
+              sizeof(Dtype));
+        }
+      }
+    }
+    top_data_file.close();
+    #endif
+
+  }
+
+  return static_cast<void*>(NULL);
+}
+
+template <typename Dtype>
+void WindowDataLayerPrefetchBatch(WindowDataLayer<Dtype>* layer,
+    const int batch_id) {
+  // At each iteration, sample N windows where N*p are foreground (object)
+  // windows and N*(1-p) are background (non-object) windows
+
+  Dtype* top_label = layer->prefetch_label_[batch_id]->mutable_cpu_data();
+  const int batch_size = layer->layer_param_.window_data_param().batch_size();
+  const bool mirror = layer->layer_param_.window_data_param().mirror();
+  const float fg_fraction =
+      layer->layer_param_.window_data_param().fg_fraction();
+
+  // zero out batch, which the warp on the device does itself
+  if (!layer->gpu_transform_) {
+    Dtype* top_data = layer->prefetch_data_[batch_id]->mutable_cpu_data();
+    memset(top_data, 0,
+        sizeof(Dtype) * layer->prefetch_data_[batch_id]->count());
+  }
 
   const int num_fg = static_cast<int>(static_cast<float>(batch_size)
       * fg_fraction);
   const int num_samples[2] = { batch_size - num_fg, num_fg };
 
+  // The windows are sampled here, on a single random number stream, so that
+  // the batch does not depend on the number of workers.
   int item_id = 0;
   // sample from bg set then fg set
   for (int is_fg = 0; is_fg < 2; ++is_fg) {
     for (int dummy = 0; dummy < num_samples[is_fg]; ++dummy) {
       // sample a window
       const unsigned int rand_index = layer->PrefetchRand();
-      vector<float> window = (is_fg) ?
+      const int window_index = (is_fg) ?
           layer->fg_windows_[rand_index % layer->fg_windows_.size()] :
           layer->bg_windows_[rand_index % layer->bg_windows_.size()];
+      const WindowList::Window& window = layer->windows_.window(window_index);
+      layer->prefetch_windows_[item_id] = window_index;
+      // background windows are labeled 0
+      top_label[item_id] = (is_fg) ? window.label : 0;
 
       bool do_mirror = false;
       if (mirror && layer->PrefetchRand() % 2) {
         do_mirror = true;
       }
-
-      // load the image containing the window
-      pair<std::string, vector<int> > image =
-          layer->image_database_[window[WindowDataLayer<Dtype>::IMAGE_INDEX]];
-
-      cv::Mat cv_img = cv::imread(image.first, CV_LOAD_IMAGE_COLOR);
-      if (!cv_img.data) {
-        LOG(ERROR) << "Could not open or find file " << image.first;
-        return reinterpret_cast<void*>(NULL);
-      }
-      const int channels = cv_img.channels();
-
-      // crop window out of image and warp it
-      int x1 = window[WindowDataLayer<Dtype>::X1];
-      int y1 = window[WindowDataLayer<Dtype>::Y1];
-      int x2 = window[WindowDataLayer<Dtype>::X2];
-      int y2 = window[WindowDataLayer<Dtype>::Y2];
-
-      int pad_w = 0;
-      int pad_h = 0;
-      if (context_pad > 0 || use_square) {
-        // scale factor by which to expand the original region
-        // such that after warping the expanded region to crop_size x crop_size
-        // there's exactly context_pad amount of padding on each side
-        Dtype context_scale = static_cast<Dtype>(crop_size) /
-            static_cast<Dtype>(crop_size - 2*context_pad);
-
-        // compute the expanded region
-        Dtype half_height = static_cast<Dtype>(y2-y1+1)/2.0;
-        Dtype half_width = static_cast<Dtype>(x2-x1+1)/2.0;
-        Dtype center_x = static_cast<Dtype>(x1) + half_width;
-        Dtype center_y = static_cast<Dtype>(y1) + half_height;
-        if (use_square) {
-          if (half_height > half_width) {
-            half_width = half_height;
-          } else {
-            half_height = half_width;
-          }
-        }
-        x1 = static_cast<int>(round(center_x - half_width*context_scale));
-        x2 = static_cast<int>(round(center_x + half_width*context_scale));
-        y1 = static_cast<int>(round(center_y - half_height*context_scale));
-        y2 = static_cast<int>(round(center_y + half_height*context_scale));
-
-        // the expanded region may go outside of the image
-        // so we compute the clipped (expanded) region and keep track of
-        // the extent beyond the image
-        int unclipped_height = y2-y1+1;
-        int unclipped_width = x2-x1+1;
-        int pad_x1 = std::max(0, -x1);
-        int pad_y1 = std::max(0, -y1);
-        int pad_x2 = std::max(0, x2 - cv_img.cols + 1);
-        int pad_y2 = std::max(0, y2 - cv_img.rows + 1);
-        // clip bounds
-        x1 = x1 + pad_x1;
-        x2 = x2 - pad_x2;
-        y1 = y1 + pad_y1;
-        y2 = y2 - pad_y2;
-        CHECK_GT(x1, -1);
-        CHECK_GT(y1, -1);
-        CHECK_LT(x2, cv_img.cols);
-        CHECK_LT(y2, cv_img.rows);
-
-        int clipped_height = y2-y1+1;
-        int clipped_width = x2-x1+1;
-
-        // scale factors that would be used to warp the unclipped
-        // expanded region
-        Dtype scale_x =
-            static_cast<Dtype>(crop_size)/static_cast<Dtype>(unclipped_width);
-        Dtype scale_y =
-            static_cast<Dtype>(crop_size)/static_cast<Dtype>(unclipped_height);
-
-        // size to warp the clipped expanded region to
-        cv_crop_size.width =
-            static_cast<int>(round(static_cast<Dtype>(clipped_width)*scale_x));
-        cv_crop_size.height =
-            static_cast<int>(round(static_cast<Dtype>(clipped_height)*scale_y));
-        pad_x1 = static_cast<int>(round(static_cast<Dtype>(pad_x1)*scale_x));
-        pad_x2 = static_cast<int>(round(static_cast<Dtype>(pad_x2)*scale_x));
-        pad_y1 = static_cast<int>(round(static_cast<Dtype>(pad_y1)*scale_y));
-        pad_y2 = static_cast<int>(round(static_cast<Dtype>(pad_y2)*scale_y));
-
-        pad_h = pad_y1;
-        // if we're mirroring, we mirror the padding too (to be pedantic)
-        if (do_mirror) {
-          pad_w = pad_x2;
-        } else {
-          pad_w = pad_x1;
-        }
-
-        // ensure that the warped, clipped region plus the padding fits in the
-        // crop_size x crop_size image (it might not due to rounding)
-        if (pad_h + cv_crop_size.height > crop_size) {
-          cv_crop_size.height = crop_size - pad_h;
-        }
-        if (pad_w + cv_crop_size.width > crop_size) {
-          cv_crop_size.width = crop_size - pad_w;
-        }
-      }
-
-      cv::Rect roi(x1, y1, x2-x1+1, y2-y1+1);
-      cv::Mat cv_cropped_img = cv_img(roi);
-      cv::resize(cv_cropped_img, cv_cropped_img,
-          cv_crop_size, 0, 0, cv::INTER_LINEAR);
-
-      // horizontal flip at random
-      if (do_mirror) {
-        cv::flip(cv_cropped_img, cv_cropped_img, 1);
-      }
-
-      // copy the warped window into top_data
-      for (int c = 0; c < channels; ++c) {
-        for (int h = 0; h < cv_cropped_img.rows; ++h) {
-          for (int w = 0; w < cv_cropped_img.cols; ++w) {
-            Dtype pixel =
-                static_cast<Dtype>(cv_cropped_img.at<cv::Vec3b>(h, w)[c]);
-
-            top_data[((item_id * channels + c) * crop_size + h + pad_h)
-                     * crop_size + w + pad_w]
-                = (pixel
-                    - mean[(c * mean_height + h + mean_off + pad_h)
-                           * mean_width + w + mean_off + pad_w])
-                  * scale;
-          }
-        }
-      }
-
-      // get window label
-      top_label[item_id] = window[WindowDataLayer<Dtype>::LABEL];
-
-      #if 0
-      // useful debugging code for dumping transformed windows to disk
-      string file_id;
-      std::stringstream ss;
-      ss << layer->PrefetchRand();
-      ss >> file_id;
-      std::ofstream inf((string("dump/") + file_id +
-          string("_info.txt")).c_str(), std::ofstream::out);
-      inf << image.first << std::endl
-          << window[WindowDataLayer<Dtype>::X1]+1 << std::endl
-          << window[WindowDataLayer<Dtype>::Y1]+1 << std::endl
-          << window[WindowDataLayer<Dtype>::X2]+1 << std::endl
-          << window[WindowDataLayer<Dtype>::Y2]+1 << std::endl
-          << do_mirror << std::endl
-          << top_label[item_id] << std::endl
-          << is_fg << std::endl;
-      inf.close();
-      std::ofstream top_data_file((string("dump/") + file_id +
-          string("_data.txt")).c_str(),
-          std::ofstream::out | std::ofstream::binary);
-      for (int c = 0; c < channels; ++c) {
-        for (int h = 0; h < crop_size; ++h) {
-          for (int w = 0; w < crop_size; ++w) {
-            top_data_file.write(reinterpret_cast<char*>(
-                &top_data[((item_id * channels + c) * crop_size + h)
-                          * crop_size + w]),
-                sizeof(Dtype));
-          }
-        }
-      }
-      top_data_file.close();
-      #endif
-
+      layer->prefetch_mirror_[item_id] = do_mirror;
+      layer->prefetch_order_[item_id] =
+          std::make_pair(window.image_index, item_id);
       item_id++;
     }
   }
+  // Process the windows grouped by image, each window still going to the
+  // place in the batch it was sampled for.
+  std::sort(layer->prefetch_order_.begin(), layer->prefetch_order_.end());
+  // Worker 0 runs on this thread; the others get a thread each.
+  const int num_workers = layer->prefetch_workers_.size();
+  for (int worker_id = 0; worker_id < num_workers; ++worker_id) {
+    layer->prefetch_workers_[worker_id].batch_id = batch_id;
+  }
+  DataLayerStats* stats = &layer->prefetch_stats_[batch_id];
+  vector<pthread_t> worker_threads(num_workers);
+  for (int worker_id = 1; worker_id < num_workers; ++worker_id) {
+    CHECK(!pthread_create(&worker_threads[worker_id], NULL,
+          WindowDataLayerPrefetchWorker<Dtype>,
+          static_cast<void*>(&layer->prefetch_workers_[worker_id])))
+        << "Pthread execution failed.";
+  }
+  WindowDataLayerPrefetchWorker<Dtype>(
+      static_cast<void*>(&layer->prefetch_workers_[0]));
+  for (int worker_id = 1; worker_id < num_workers; ++worker_id) {
+    CHECK(!pthread_join(worker_threads[worker_id], NULL))
+        << "Pthread joining failed.";
+  }
+  stats->decode_ms = 0;
+  stats->transform_ms = 0;
+  for (int worker_id = 0; worker_id < num_workers; ++worker_id) {
+    stats->decode_ms += layer->prefetch_workers_[worker_id].decode_ms;
+    stats->transform_ms += layer->prefetch_workers_[worker_id].transform_ms;
+    if (layer->gpu_transform_) {
+      layer->prefetch_pixel_bytes_[batch_id][worker_id] =
+          layer->prefetch_workers_[worker_id].pixel_bytes;
+    }
+  }
+}
+
+template <typename Dtype>
+void* WindowDataLayerPrefetch(void* layer_pointer) {
+  WindowDataLayer<Dtype>* layer =
+      reinterpret_cast<WindowDataLayer<Dtype>*>(layer_pointer);
+  // Keep filling buffers as Forward hands them back, until asked to exit.
+  while (true) {
+    const int batch_id = layer->prefetch_free_.pop();
+    if (batch_id < 0) {
+      break;
+    }
+    const ptime prefetch_start = microsec_clock::local_time();
+    WindowDataLayerPrefetchBatch(layer, batch_id);
+    layer->prefetch_stats_[batch_id].prefetch_ms =
+        MilliSecondsSince(prefetch_start);
+    layer->prefetch_full_.push(batch_id);
+  }
 
   return reinterpret_cast<void*>(NULL);
 }
@@ -266,16 +441,7 @@ void WindowDataLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
   CHECK_EQ(bottom.size(), 0) << "Window data Layer takes no input blobs.";
   CHECK_EQ(top->size(), 2) << "Window data Layer prodcues two blobs as output.";
 
-  // window_file format
-  // repeated:
-  //    # image_index
-  //    img_path (abs path)
-  //    channels
-  //    height
-  //    width
-  //    num_windows
-  //    class_index overlap x1 y1 x2 y2
-
+  // window_file format: see WindowList
   LOG(INFO) << "Window data layer:" << std::endl
       << "  foreground (object) overlap threshold: "
       << this->layer_param_.window_data_param().fg_threshold() << std::endl
@@ -284,74 +450,34 @@ void WindowDataLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
       << "  foreground sampling fraction: "
       << this->layer_param_.window_data_param().fg_fraction();
 
-  std::ifstream infile(this->layer_param_.window_data_param().source().c_str());
-  CHECK(infile.good()) << "Failed to open window file "
-      << this->layer_param_.window_data_param().source() << std::endl;
+  windows_.Read(this->layer_param_.window_data_param().source(),
+      this->layer_param_.window_data_param().cache_file());
+  CHECK_GT(windows_.num_images(), 0) << "No images in "
+      << this->layer_param_.window_data_param().source();
+  const int channels = windows_.image_channels(windows_.num_images() - 1);
 
   map<int, int> label_hist;
   label_hist.insert(std::make_pair(0, 0));
-
-  string hashtag;
-  int image_index, channels;
-  while (infile >> hashtag >> image_index) {
-    CHECK_EQ(hashtag, "#");
-    // read image path
-    string image_path;
-    infile >> image_path;
-    // read image dimensions
-    vector<int> image_size(3);
-    infile >> image_size[0] >> image_size[1] >> image_size[2];
-    channels = image_size[0];
-    image_database_.push_back(std::make_pair(image_path, image_size));
-
-    // read each box
-    int num_windows;
-    infile >> num_windows;
-    const float fg_threshold =
-        this->layer_param_.window_data_param().fg_threshold();
-    const float bg_threshold =
-        this->layer_param_.window_data_param().bg_threshold();
-    for (int i = 0; i < num_windows; ++i) {
-      int label, x1, y1, x2, y2;
-      float overlap;
-      infile >> label >> overlap >> x1 >> y1 >> x2 >> y2;
-
-      vector<float> window(WindowDataLayer::NUM);
-      window[WindowDataLayer::IMAGE_INDEX] = image_index;
-      window[WindowDataLayer::LABEL] = label;
-      window[WindowDataLayer::OVERLAP] = overlap;
-      window[WindowDataLayer::X1] = x1;
-      window[WindowDataLayer::Y1] = y1;
-      window[WindowDataLayer::X2] = x2;
-      window[WindowDataLayer::Y2] = y2;
-
-      // add window to foreground list or background list
-      if (overlap >= fg_threshold) {
-        int label = window[WindowDataLayer::LABEL];
-        CHECK_GT(label, 0);
-        fg_windows_.push_back(window);
-        label_hist.insert(std::make_pair(label, 0));
-        label_hist[label]++;
-      } else if (overlap < bg_threshold) {
-        // background window, force label and overlap to 0
-        window[WindowDataLayer::LABEL] = 0;
-        window[WindowDataLayer::OVERLAP] = 0;
-        bg_windows_.push_back(window);
-        label_hist[0]++;
-      }
-    }
-
-    if (image_index % 100 == 0) {
-      LOG(INFO) << "num: " << image_index << " "
-          << image_path << " "
-          << image_size[0] << " "
-          << image_size[1] << " "
-          << image_size[2] << " "
-          << "windows to process: " << num_windows;
+  const float fg_threshold =
+      this->layer_param_.window_data_param().fg_threshold();
+  const float bg_threshold =
+      this->layer_param_.window_data_param().bg_threshold();
+  CHECK_LE(windows_.num_windows(), INT_MAX) << "Too many windows.";
+  for (int i = 0; i < windows_.num_windows(); ++i) {
+    const WindowList::Window& window = windows_.window(i);
+    // add window to foreground list or background list
+    if (window.overlap >= fg_threshold) {
+      CHECK_GT(window.label, 0);
+      fg_windows_.push_back(i);
+      label_hist.insert(std::make_pair(window.label, 0));
+      label_hist[window.label]++;
+    } else if (window.overlap < bg_threshold) {
+      bg_windows_.push_back(i);
+      label_hist[0]++;
     }
   }
 
-  LOG(INFO) << "Number of images: " << image_index+1;
+  LOG(INFO) << "Number of images: " << windows_.num_images();
 
   for (map<int, int>::iterator it = label_hist.begin();
       it != label_hist.end(); ++it) {
@@ -369,20 +495,40 @@ void WindowDataLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
   int crop_size = this->layer_param_.window_data_param().crop_size();
   CHECK_GT(crop_size, 0);
   const int batch_size = this->layer_param_.window_data_param().batch_size();
+  const int prefetch_batches =
+      this->layer_param_.window_data_param().prefetch_batches();
+  CHECK_GT(prefetch_batches, 0);
   (*top)[0]->Reshape(batch_size, channels, crop_size, crop_size);
-  prefetch_data_.reset(
-      new Blob<Dtype>(batch_size, channels, crop_size, crop_size));
+  prefetch_data_.resize(prefetch_batches);
+  for (int batch_id = 0; batch_id < prefetch_batches; ++batch_id) {
+    prefetch_data_[batch_id].reset(
+        new Blob<Dtype>(batch_size, channels, crop_size, crop_size));
+  }
 
   LOG(INFO) << "output data size: " << (*top)[0]->num() << ","
       << (*top)[0]->channels() << "," << (*top)[0]->height() << ","
       << (*top)[0]->width();
   // label
   (*top)[1]->Reshape(batch_size, 1, 1, 1);
-  prefetch_label_.reset(
-      new Blob<Dtype>(batch_size, 1, 1, 1));
+  prefetch_label_.resize(prefetch_batches);
+  for (int batch_id = 0; batch_id < prefetch_batches; ++batch_id) {
+    prefetch_label_[batch_id].reset(new Blob<Dtype>(batch_size, 1, 1, 1));
+  }
+  prefetch_stats_.resize(prefetch_batches);
 
   // check if we want to have mean
-  if (this->layer_param_.window_data_param().has_mean_file()) {
+  const int num_mean_values =
+      this->layer_param_.window_data_param().mean_value_size();
+  if (num_mean_values > 0) {
+    CHECK(!this->layer_param_.window_data_param().has_mean_file())
+        << "Cannot specify both mean_file and mean_value.";
+    CHECK(num_mean_values == 1 || num_mean_values == channels)
+        << "Specify either one mean_value or one per channel.";
+    for (int c = 0; c < channels; ++c) {
+      mean_values_.push_back(this->layer_param_.window_data_param().mean_value(
+          num_mean_values == 1 ? 0 : c));
+    }
+  } else if (this->layer_param_.window_data_param().has_mean_file()) {
     const string& mean_file =
         this->layer_param_.window_data_param().mean_file();
     LOG(INFO) << "Loading mean file from" << mean_file;
@@ -396,13 +542,84 @@ void WindowDataLayer<Dtype>::SetUp(const vector<Blob<Dtype>*>& bottom,
     // Simply initialize an all-empty mean.
     data_mean_.Reshape(1, channels, crop_size, crop_size);
   }
+  // The warp on the device only knows about mean images, so turn the mean
+  // values into one.
+  gpu_transform_ = this->layer_param_.window_data_param().gpu_transform() &&
+      Caffe::mode() == Caffe::GPU;
+  if (gpu_transform_ && !mean_values_.empty()) {
+    data_mean_.Reshape(1, channels, crop_size, crop_size);
+    Dtype* mean = data_mean_.mutable_cpu_data();
+    for (int c = 0; c < channels; ++c) {
+      caffe_set(crop_size * crop_size, mean_values_[c],
+          mean + c * crop_size * crop_size);
+    }
+  }
+  if (this->layer_param_.window_data_param().cache_size_mb()) {
+    image_cache_.reset(new ImageCache(static_cast<size_t>(
+        this->layer_param_.window_data_param().cache_size_mb()) << 20));
+    LOG(INFO) << "Caching up to "
+        << this->layer_param_.window_data_param().cache_size_mb()
+        << " MB of decoded images.";
+  }
+  // Split the batch evenly among the prefetch workers.
+  const int num_workers = std::max(1, std::min(batch_size, static_cast<int>(
+      this->layer_param_.window_data_param().prefetch_threads())));
+  prefetch_windows_.resize(batch_size);
+  prefetch_mirror_.resize(batch_size);
+  prefetch_order_.resize(batch_size);
+  prefetch_workers_.resize(num_workers);
+  for (int worker_id = 0; worker_id < num_workers; ++worker_id) {
+    prefetch_workers_[worker_id].layer = this;
+    prefetch_workers_[worker_id].item_begin =
+        batch_size * worker_id / num_workers;
+    prefetch_workers_[worker_id].item_end =
+        batch_size * (worker_id + 1) / num_workers;
+  }
+  if (gpu_transform_) {
+    // Room for a distinct image of the largest size per item
+    max_image_bytes_ = 0;
+    for (int i = 0; i < windows_.num_images(); ++i) {
+      max_image_bytes_ = std::max(max_image_bytes_, windows_.image_channels(i)
+          * windows_.image_height(i) * windows_.image_width(i));
+    }
+    CHECK_LE(static_cast<int64_t>(max_image_bytes_) * batch_size, INT_MAX)
+        << "The images of a batch are too large to be warped on the device.";
+    LOG(INFO) << "Warping the windows on the device, from up to "
+        << (max_image_bytes_ * batch_size >> 20) << " MB of images a batch.";
+    prefetch_pixels_.resize(prefetch_batches);
+    prefetch_warps_.resize(prefetch_batches);
+    prefetch_pixel_bytes_.resize(prefetch_batches);
+    for (int batch_id = 0; batch_id < prefetch_batches; ++batch_id) {
+      prefetch_pixels_[batch_id].reset(
+          new SyncedMemory(max_image_bytes_ * batch_size));
+      prefetch_pixels_[batch_id]->set_pinned(true);
+      prefetch_warps_[batch_id].reset(
+          new SyncedMemory(batch_size * kWarpParams * sizeof(int)));
+      prefetch_pixel_bytes_[batch_id].resize(num_workers, 0);
+    }
+    gpu_pixels_.reset(new SyncedMemory(max_image_bytes_ * batch_size));
+    gpu_pixels_->mutable_gpu_data();
+    data_mean_.gpu_data();
+  }
   // Now, start the prefetch thread. Before calling prefetch, we make two
   // cpu_data calls so that the prefetch thread does not accidentally make
   // simultaneous cudaMalloc calls when the main thread is running. In some
   // GPUs this seems to cause failures if we do not so.
-  prefetch_data_->mutable_cpu_data();
-  prefetch_label_->mutable_cpu_data();
-  data_mean_.cpu_data();
+  for (int batch_id = 0; batch_id < prefetch_batches; ++batch_id) {
+    if (gpu_transform_) {
+      prefetch_pixels_[batch_id]->mutable_cpu_data();
+      prefetch_warps_[batch_id]->mutable_cpu_data();
+    } else {
+      prefetch_data_[batch_id]->mutable_cpu_data();
+    }
+    prefetch_label_[batch_id]->mutable_cpu_data();
+    prefetch_free_.push(batch_id);
+  }
+  if (mean_values_.empty()) {
+    data_mean_.cpu_data();
+  }
+  LOG(INFO) << "Prefetching " << prefetch_batches << " batch(es) with "
+      << num_workers << " worker(s).";
   DLOG(INFO) << "Initializing prefetch";
   CreatePrefetchThread();
   DLOG(INFO) << "Prefetch initialized.";
@@ -426,9 +643,27 @@ void WindowDataLayer<Dtype>::CreatePrefetchThread() {
 
 template <typename Dtype>
 void WindowDataLayer<Dtype>::JoinPrefetchThread() {
+  // Drop the buffers still waiting to be filled so that the prefetch thread
+  // exits as soon as it has finished the batch in hand.
+  int batch_id;
+  while (prefetch_free_.try_pop(&batch_id)) {}
+  prefetch_free_.push(-1);
   CHECK(!pthread_join(thread_, NULL)) << "Pthread joining failed.";
 }
 
+template <typename Dtype>
+int WindowDataLayer<Dtype>::PopPrefetchedBatch() {
+  const ptime wait_start = microsec_clock::local_time();
+  const int batch_id = prefetch_full_.pop();
+  stats_.wait_ms += MilliSecondsSince(wait_start);
+  const DataLayerStats& batch_stats = prefetch_stats_[batch_id];
+  ++stats_.batches;
+  stats_.prefetch_ms += batch_stats.prefetch_ms;
+  stats_.decode_ms += batch_stats.decode_ms;
+  stats_.transform_ms += batch_stats.transform_ms;
+  return batch_id;
+}
+
 template <typename Dtype>
 unsigned int WindowDataLayer<Dtype>::PrefetchRand() {
   CHECK(prefetch_rng_);
@@ -437,18 +672,96 @@ unsigned int WindowDataLayer<Dtype>::PrefetchRand() {
   return (*prefetch_rng)();
 }
 
+template <typename Dtype>
+void WindowDataLayer<Dtype>::TransformWindows_cpu(const int batch_id,
+    Dtype* top_data) {
+  const int channels = prefetch_data_[batch_id]->channels();
+  const int crop_size = prefetch_data_[batch_id]->height();
+  const int mean_width = data_mean_.width();
+  const int mean_height = data_mean_.height();
+  const int mean_off = (mean_width - crop_size) / 2;
+  const Dtype scale = this->layer_param_.window_data_param().scale();
+  const Dtype* mean = data_mean_.cpu_data();
+  const uint8_t* pixels =
+      static_cast<const uint8_t*>(prefetch_pixels_[batch_id]->cpu_data());
+  const int* warps =
+      static_cast<const int*>(prefetch_warps_[batch_id]->cpu_data());
+  for (int item_id = 0; item_id < prefetch_data_[batch_id]->num();
+       ++item_id) {
+    const int* warp = warps + item_id * kWarpParams;
+    for (int c = 0; c < channels; ++c) {
+      for (int h = 0; h < crop_size; ++h) {
+        for (int w = 0; w < crop_size; ++w) {
+          // the sampling of cv::resize with INTER_LINEAR
+          const int out_x = w - warp[6];
+          const int out_y = h - warp[7];
+          Dtype value = 0;
+          if (out_x >= 0 && out_x < warp[8] && out_y >= 0 &&
+              out_y < warp[9]) {
+            const int x = warp[10] ? warp[8] - 1 - out_x : out_x;
+            Dtype src_x = (x + Dtype(0.5)) * warp[4] / warp[8] - Dtype(0.5);
+            Dtype src_y = (out_y + Dtype(0.5)) * warp[5] / warp[9]
+                - Dtype(0.5);
+            int x0 = static_cast<int>(floor(src_x));
+            int y0 = static_cast<int>(floor(src_y));
+            Dtype fx = src_x - x0;
+            Dtype fy = src_y - y0;
+            if (x0 < 0) {
+              x0 = 0;
+              fx = 0;
+            } else if (x0 >= warp[4] - 1) {
+              x0 = warp[4] - 1;
+              fx = 0;
+            }
+            if (y0 < 0) {
+              y0 = 0;
+              fy = 0;
+            } else if (y0 >= warp[5] - 1) {
+              y0 = warp[5] - 1;
+              fy = 0;
+            }
+            const int x1 = std::min(x0 + 1, warp[4] - 1);
+            const int y1 = std::min(y0 + 1, warp[5] - 1);
+            const uint8_t* image = pixels + warp[0] + c;
+            const int stride = warp[1] * channels;
+            const int left0 = (warp[2] + x0) * channels;
+            const int left1 = (warp[2] + x1) * channels;
+            const uint8_t* row0 = image + (warp[3] + y0) * stride;
+            const uint8_t* row1 = image + (warp[3] + y1) * stride;
+            const Dtype pixel =
+                (1 - fy) * ((1 - fx) * row0[left0] + fx * row0[left1]) +
+                fy * ((1 - fx) * row1[left0] + fx * row1[left1]);
+            value = (pixel - mean[(c * mean_height + h + mean_off)
+                * mean_width + w + mean_off]) * scale;
+          }
+          top_data[((item_id * channels + c) * crop_size + h) * crop_size
+              + w] = value;
+        }
+      }
+    }
+  }
+}
+
 template <typename Dtype>
 Dtype WindowDataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
-  // First, join the thread
-  JoinPrefetchThread();
-  // Copy the data
-  caffe_copy(prefetch_data_->count(), prefetch_data_->cpu_data(),
-             (*top)[0]->mutable_cpu_data());
-  caffe_copy(prefetch_label_->count(), prefetch_label_->cpu_data(),
+  // First, wait for the next prefetched batch
+  const int batch_id = PopPrefetchedBatch();
+  // Copy the data, or warp it in case the mode changed since SetUp
+  const ptime copy_start = microsec_clock::local_time();
+  if (gpu_transform_) {
+    TransformWindows_cpu(batch_id, (*top)[0]->mutable_cpu_data());
+  } else {
+    caffe_copy(prefetch_data_[batch_id]->count(),
+               prefetch_data_[batch_id]->cpu_data(),
+               (*top)[0]->mutable_cpu_data());
+  }
+  caffe_copy(prefetch_label_[batch_id]->count(),
+             prefetch_label_[batch_id]->cpu_data(),
              (*top)[1]->mutable_cpu_data());
-  // Start a new prefetch thread
-  CreatePrefetchThread();
+  stats_.copy_ms += MilliSecondsSince(copy_start);
+  // Hand the buffer back to the prefetch thread
+  prefetch_free_.push(batch_id);
   return Dtype(0.);
 }
 
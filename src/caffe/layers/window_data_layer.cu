@@ -10,6 +10,7 @@
 
 #include "caffe/layer.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
 #include "caffe/vision_layers.hpp"
 
 using std::string;
@@ -22,20 +23,107 @@ using std::pair;
 
 namespace caffe {
 
+// Warps the windows of a batch out of its interleaved uint8 images, as
+// TransformWindows_cpu does, with one thread per output value. warps holds
+// the kWarpParams of every item; outside of its warped window an item is 0.
+template <typename Dtype>
+__global__ void WindowWarpForward(const int n, const uint8_t* pixels,
+    const int* warps, const int num_params, const int channels,
+    const int crop_size, const Dtype* mean, const int mean_height,
+    const int mean_width, const int mean_off, const Dtype scale,
+    Dtype* top_data) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int w = index % crop_size;
+    const int h = (index / crop_size) % crop_size;
+    const int c = (index / crop_size / crop_size) % channels;
+    const int item_id = index / crop_size / crop_size / channels;
+    const int* warp = warps + item_id * num_params;
+    const int out_x = w - warp[6];
+    const int out_y = h - warp[7];
+    Dtype value = 0;
+    if (out_x >= 0 && out_x < warp[8] && out_y >= 0 && out_y < warp[9]) {
+      const int x = warp[10] ? warp[8] - 1 - out_x : out_x;
+      const Dtype src_x = (x + Dtype(0.5)) * warp[4] / warp[8] - Dtype(0.5);
+      const Dtype src_y = (out_y + Dtype(0.5)) * warp[5] / warp[9]
+          - Dtype(0.5);
+      int x0 = static_cast<int>(floor(src_x));
+      int y0 = static_cast<int>(floor(src_y));
+      Dtype fx = src_x - x0;
+      Dtype fy = src_y - y0;
+      if (x0 < 0) {
+        x0 = 0;
+        fx = 0;
+      } else if (x0 >= warp[4] - 1) {
+        x0 = warp[4] - 1;
+        fx = 0;
+      }
+      if (y0 < 0) {
+        y0 = 0;
+        fy = 0;
+      } else if (y0 >= warp[5] - 1) {
+        y0 = warp[5] - 1;
+        fy = 0;
+      }
+      const int x1 = min(x0 + 1, warp[4] - 1);
+      const int y1 = min(y0 + 1, warp[5] - 1);
+      const uint8_t* image = pixels + warp[0] + c;
+      const int stride = warp[1] * channels;
+      const int left0 = (warp[2] + x0) * channels;
+      const int left1 = (warp[2] + x1) * channels;
+      const uint8_t* row0 = image + (warp[3] + y0) * stride;
+      const uint8_t* row1 = image + (warp[3] + y1) * stride;
+      const Dtype pixel =
+          (1 - fy) * ((1 - fx) * row0[left0] + fx * row0[left1]) +
+          fy * ((1 - fx) * row1[left0] + fx * row1[left1]);
+      value = (pixel - mean[(c * mean_height + h + mean_off) * mean_width
+          + w + mean_off]) * scale;
+    }
+    top_data[index] = value;
+  }
+}
+
 template <typename Dtype>
 Dtype WindowDataLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       vector<Blob<Dtype>*>* top) {
-  // First, join the thread
-  JoinPrefetchThread();
-  // Copy the data
-  CUDA_CHECK(cudaMemcpy((*top)[0]->mutable_gpu_data(),
-      prefetch_data_->cpu_data(), sizeof(Dtype) * prefetch_data_->count(),
-      cudaMemcpyHostToDevice));
+  // First, wait for the next prefetched batch
+  const int batch_id = PopPrefetchedBatch();
+  // Copy the data, or only the images and warp the windows here
+  if (gpu_transform_) {
+    uint8_t* gpu_pixels =
+        static_cast<uint8_t*>(gpu_pixels_->mutable_gpu_data());
+    const uint8_t* pixels =
+        static_cast<const uint8_t*>(prefetch_pixels_[batch_id]->cpu_data());
+    for (int worker_id = 0; worker_id < prefetch_workers_.size();
+         ++worker_id) {
+      const int offset =
+          prefetch_workers_[worker_id].item_begin * max_image_bytes_;
+      CUDA_CHECK(cudaMemcpy(gpu_pixels + offset, pixels + offset,
+          prefetch_pixel_bytes_[batch_id][worker_id], cudaMemcpyHostToDevice));
+    }
+    const int crop_size = (*top)[0]->height();
+    const int count = (*top)[0]->count();
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    WindowWarpForward<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
+        count, gpu_pixels,
+        static_cast<const int*>(prefetch_warps_[batch_id]->gpu_data()),
+        kWarpParams, (*top)[0]->channels(), crop_size, data_mean_.gpu_data(),
+        data_mean_.height(), data_mean_.width(),
+        (data_mean_.width() - crop_size) / 2,
+        Dtype(this->layer_param_.window_data_param().scale()),
+        (*top)[0]->mutable_gpu_data());
+    CUDA_POST_KERNEL_CHECK;
+  } else {
+    CUDA_CHECK(cudaMemcpy((*top)[0]->mutable_gpu_data(),
+        prefetch_data_[batch_id]->cpu_data(),
+        sizeof(Dtype) * prefetch_data_[batch_id]->count(),
+        cudaMemcpyHostToDevice));
+  }
   CUDA_CHECK(cudaMemcpy((*top)[1]->mutable_gpu_data(),
-      prefetch_label_->cpu_data(), sizeof(Dtype) * prefetch_label_->count(),
+      prefetch_label_[batch_id]->cpu_data(),
+      sizeof(Dtype) * prefetch_label_[batch_id]->count(),
       cudaMemcpyHostToDevice));
-  // Start a new prefetch thread
-  CreatePrefetchThread();
+  // Hand the buffer back to the prefetch thread
+  prefetch_free_.push(batch_id);
   return Dtype(0.);
 }
 
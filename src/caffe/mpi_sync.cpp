@@ -0,0 +1,284 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
+#include <cuda_runtime.h>
+
+#include <cstring>
+#include <vector>
+
+#include "caffe/mpi_sync.hpp"
+#include "caffe/util/gradient_compression.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+#ifdef USE_MPI
+template <typename Dtype> static MPI_Datatype MPIDatatype();
+template <> MPI_Datatype MPIDatatype<float>() { return MPI_FLOAT; }
+template <> MPI_Datatype MPIDatatype<double>() { return MPI_DOUBLE; }
+
+static bool MPIInitialized() {
+  int initialized, finalized;
+  CHECK_EQ(MPI_Initialized(&initialized), MPI_SUCCESS);
+  CHECK_EQ(MPI_Finalized(&finalized), MPI_SUCCESS);
+  return initialized && !finalized;
+}
+#endif
+
+void MPIInit(int* argc, char*** argv) {
+#ifdef USE_MPI
+  CHECK_EQ(MPI_Init(argc, argv), MPI_SUCCESS);
+  if (MPISize() > 1) {
+    LOG(INFO) << "Process " << MPIRank() << " of " << MPISize() << ".";
+  }
+#endif
+}
+
+void MPIFinalize() {
+#ifdef USE_MPI
+  if (MPIInitialized()) {
+    CHECK_EQ(MPI_Finalize(), MPI_SUCCESS);
+  }
+#endif
+}
+
+int MPIRank() {
+  int rank = 0;
+#ifdef USE_MPI
+  if (MPIInitialized()) {
+    CHECK_EQ(MPI_Comm_rank(MPI_COMM_WORLD, &rank), MPI_SUCCESS);
+  }
+#endif
+  return rank;
+}
+
+int MPISize() {
+  int size = 1;
+#ifdef USE_MPI
+  if (MPIInitialized()) {
+    CHECK_EQ(MPI_Comm_size(MPI_COMM_WORLD, &size), MPI_SUCCESS);
+  }
+#endif
+  return size;
+}
+
+template <typename Dtype>
+MPISync<Dtype>::MPISync(Net<Dtype>* net, const int staleness)
+    : net_(net), staleness_(staleness), param_count_(0),
+      compression_(SolverParameter_GradientCompression_NONE), top_k_(1) {
+#ifndef USE_MPI
+  LOG(FATAL) << "Training over several processes needs USE_MPI.";
+#endif
+  CHECK_GE(staleness_, 0);
+  if (net_->params_data()) {
+    // All the parameters in one copy, see Net::PackParams
+    data_parts_.push_back(net_->params_data());
+    diff_parts_.push_back(net_->params_diff());
+    part_counts_.push_back(net_->params_count());
+  } else {
+    const vector<shared_ptr<Blob<Dtype> > >& params = net_->params();
+    for (int i = 0; i < params.size(); ++i) {
+      data_parts_.push_back(params[i]->data());
+      diff_parts_.push_back(params[i]->diff());
+      part_counts_.push_back(params[i]->count());
+    }
+  }
+  for (int i = 0; i < part_counts_.size(); ++i) {
+    param_count_ += part_counts_[i];
+  }
+  const vector<shared_ptr<Blob<Dtype> > >& params = net_->params();
+  int offset = 0;
+  for (int i = 0; i < params.size(); ++i) {
+    // Packed, the blobs are views at their offsets, with padding between.
+    param_offsets_.push_back(net_->params_data() ?
+        params[i]->diff()->offset() / sizeof(Dtype) : offset);
+    param_counts_.push_back(params[i]->count());
+    offset += params[i]->count();
+  }
+  // Pinned, for the copies from and to the device.
+  buffer_.reset(new SyncedMemory((param_count_ + 1) * sizeof(Dtype)));
+  buffer_->set_pinned(true);
+  LOG(INFO) << "Training data parallel over " << MPISize()
+      << " processes, averaging the "
+      << (staleness_ ? "weights every " : "gradients every ")
+      << staleness_ + 1 << " iterations.";
+}
+
+template <typename Dtype>
+void MPISync<Dtype>::Pack(const bool diff) {
+  Dtype* buffer = static_cast<Dtype*>(buffer_->mutable_cpu_data());
+  const vector<shared_ptr<SyncedMemory> >& parts =
+      diff ? diff_parts_ : data_parts_;
+  for (int i = 0; i < parts.size(); ++i) {
+    const size_t size = part_counts_[i] * sizeof(Dtype);
+    switch (Caffe::mode()) {
+    case Caffe::CPU:
+      memcpy(buffer, parts[i]->cpu_data(), size);
+      break;
+    case Caffe::GPU:
+      CUDA_CHECK(cudaMemcpy(buffer, parts[i]->gpu_data(), size,
+          cudaMemcpyDeviceToHost));
+      break;
+    default:
+      LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
+    }
+    buffer += part_counts_[i];
+  }
+}
+
+template <typename Dtype>
+void MPISync<Dtype>::Unpack(const bool diff) {
+  const Dtype* buffer = static_cast<const Dtype*>(buffer_->cpu_data());
+  const vector<shared_ptr<SyncedMemory> >& parts =
+      diff ? diff_parts_ : data_parts_;
+  for (int i = 0; i < parts.size(); ++i) {
+    const size_t size = part_counts_[i] * sizeof(Dtype);
+    switch (Caffe::mode()) {
+    case Caffe::CPU:
+      memcpy(parts[i]->mutable_cpu_data(), buffer, size);
+      break;
+    case Caffe::GPU:
+      CUDA_CHECK(cudaMemcpy(parts[i]->mutable_gpu_data(), buffer, size,
+          cudaMemcpyHostToDevice));
+      break;
+    default:
+      LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
+    }
+    buffer += part_counts_[i];
+  }
+}
+
+template <typename Dtype>
+void MPISync<Dtype>::Allreduce(const int count) {
+#ifdef USE_MPI
+  CHECK_EQ(MPI_Allreduce(MPI_IN_PLACE, buffer_->mutable_cpu_data(), count,
+      MPIDatatype<Dtype>(), MPI_SUM, MPI_COMM_WORLD), MPI_SUCCESS);
+#endif
+}
+
+template <typename Dtype>
+void MPISync<Dtype>::BroadcastWeights() {
+  Pack(false);
+#ifdef USE_MPI
+  CHECK_EQ(MPI_Bcast(buffer_->mutable_cpu_data(), param_count_,
+      MPIDatatype<Dtype>(), 0, MPI_COMM_WORLD), MPI_SUCCESS);
+#endif
+  Unpack(false);
+}
+
+template <typename Dtype>
+void MPISync<Dtype>::set_gradient_compression(
+    const SolverParameter_GradientCompression compression,
+    const float top_k, const bool error_feedback) {
+  compression_ = compression;
+  top_k_ = top_k;
+  errors_.clear();
+  if (compression_ == SolverParameter_GradientCompression_NONE) {
+    return;
+  }
+  CHECK_EQ(staleness_, 0) << "Only gradients are compressed.";
+  if (error_feedback) {
+    errors_.resize(param_count_, Dtype(0));
+  }
+  LOG(INFO) << "Sending the gradients as "
+      << SolverParameter_GradientCompression_Name(compression_)
+      << (error_feedback ? ", with error feedback." : ".");
+}
+
+template <typename Dtype>
+Dtype MPISync<Dtype>::SyncCompressedGradients(const Dtype loss) {
+  Pack(true);
+  Dtype* buffer = static_cast<Dtype*>(buffer_->mutable_cpu_data());
+  message_.resize(sizeof(Dtype));
+  memcpy(&message_[0], &loss, sizeof(Dtype));
+  for (int i = 0; i < param_offsets_.size(); ++i) {
+    EncodeGradient(compression_, param_counts_[i],
+        buffer + param_offsets_[i], top_k_,
+        errors_.size() ? &errors_[param_offsets_[i]] : NULL, &message_);
+  }
+  const bool first = messages_.empty();
+  const int size = MPISize();
+  message_sizes_.resize(size);
+  message_offsets_.resize(size);
+  const int message_size = message_.size();
+#ifdef USE_MPI
+  CHECK_EQ(MPI_Allgather(const_cast<int*>(&message_size), 1, MPI_INT,
+      &message_sizes_[0], 1, MPI_INT, MPI_COMM_WORLD), MPI_SUCCESS);
+#else
+  message_sizes_[0] = message_size;
+#endif
+  int total_size = 0;
+  for (int i = 0; i < size; ++i) {
+    message_offsets_[i] = total_size;
+    total_size += message_sizes_[i];
+  }
+  messages_.resize(total_size);
+#ifdef USE_MPI
+  CHECK_EQ(MPI_Allgatherv(&message_[0], message_size, MPI_CHAR,
+      &messages_[0], &message_sizes_[0], &message_offsets_[0], MPI_CHAR,
+      MPI_COMM_WORLD), MPI_SUCCESS);
+#else
+  messages_ = message_;
+#endif
+  if (first) {
+    LOG(INFO) << "Sending " << message_size << " bytes of gradients per "
+        << "iteration, " << 100. * message_size / (param_count_ *
+        sizeof(Dtype)) << "% of their size.";
+  }
+  // Every process sums the decoded gradients, its own too, in the same
+  // order, so that they all update their weights alike.
+  caffe_set(param_count_, Dtype(0), buffer);
+  Dtype loss_sum = 0;
+  for (int i = 0; i < size; ++i) {
+    size_t offset = message_offsets_[i];
+    Dtype process_loss;
+    memcpy(&process_loss, &messages_[offset], sizeof(Dtype));
+    loss_sum += process_loss;
+    offset += sizeof(Dtype);
+    for (int j = 0; j < param_offsets_.size(); ++j) {
+      DecodeAddGradient(compression_, param_counts_[j], messages_, &offset,
+          buffer + param_offsets_[j]);
+    }
+    CHECK_EQ(offset, message_offsets_[i] + message_sizes_[i]);
+  }
+  caffe_scal(param_count_, Dtype(1) / size, buffer);
+  Unpack(true);
+  return loss_sum / size;
+}
+
+template <typename Dtype>
+Dtype MPISync<Dtype>::SyncGradients(const Dtype loss) {
+  if (staleness_) {
+    return loss;
+  }
+  if (compression_ != SolverParameter_GradientCompression_NONE) {
+    return SyncCompressedGradients(loss);
+  }
+  // One exchange for all the gradients, and the loss with them
+  Pack(true);
+  Dtype* buffer = static_cast<Dtype*>(buffer_->mutable_cpu_data());
+  buffer[param_count_] = loss;
+  Allreduce(param_count_ + 1);
+  caffe_scal(param_count_ + 1, Dtype(1) / MPISize(), buffer);
+  Unpack(true);
+  return buffer[param_count_];
+}
+
+template <typename Dtype>
+void MPISync<Dtype>::SyncWeights(const int iter) {
+  if (!staleness_ || iter % (staleness_ + 1)) {
+    return;
+  }
+  Pack(false);
+  Allreduce(param_count_);
+  caffe_scal(param_count_, Dtype(1) / MPISize(),
+      static_cast<Dtype*>(buffer_->mutable_cpu_data()));
+  Unpack(false);
+}
+
+INSTANTIATE_CLASS(MPISync);
+
+}  // namespace caffe
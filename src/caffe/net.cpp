@@ -1,16 +1,26 @@
 // Copyright 2014 BVLC and contributors.
 
+#include <algorithm>
+#include <cmath>
+#include <fstream>  // NOLINT(readability/streams)
 #include <map>
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "caffe/common.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/layer.hpp"
 #include "caffe/net.hpp"
+#include "caffe/util/cpu_threads.hpp"
+#include "caffe/util/fuse_neurons.hpp"
+#include "caffe/util/in_place.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/insert_splits.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/memory_pool.hpp"
+#include "caffe/util/nvtx.hpp"
 #include "caffe/util/upgrade_proto.hpp"
 
 using std::pair;
@@ -19,6 +29,17 @@ using std::set;
 
 namespace caffe {
 
+// Appends the channels, height and width of each of blobs to shapes.
+template <typename Dtype>
+static void AppendSpatialShapes(const vector<Blob<Dtype>*>& blobs,
+    vector<int>* shapes) {
+  for (int i = 0; i < blobs.size(); ++i) {
+    shapes->push_back(blobs[i]->channels());
+    shapes->push_back(blobs[i]->height());
+    shapes->push_back(blobs[i]->width());
+  }
+}
+
 template <typename Dtype>
 Net<Dtype>::Net(const NetParameter& param) {
   Init(param);
@@ -32,12 +53,63 @@ Net<Dtype>::Net(const string& param_file) {
 }
 
 template <typename Dtype>
-void Net<Dtype>::Init(const NetParameter& in_param) {
-  // Create a copy of in_param with splits added where necessary.
+Net<Dtype>::Net(const NetParameter& param, Net* weights) {
+  CHECK(weights);
+  Init(param, weights);
+}
+
+template <typename Dtype>
+Net<Dtype>::~Net() {
+  for (int i = 0; i < offloads_.size(); ++i) {
+    if (offloads_[i].done) {
+      CUDA_CHECK(cudaEventDestroy(offloads_[i].done));
+    }
+  }
+  for (int i = 0; i < 2; ++i) {
+    if (offload_streams_[i]) {
+      CUDA_CHECK(cudaStreamDestroy(offload_streams_[i]));
+    }
+  }
+  if (layers_done_) {
+    CUDA_CHECK(cudaEventDestroy(layers_done_));
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::Init(const NetParameter& in_param, Net* weights) {
+  // Create a copy of in_param with splits added where necessary, with the
+  // neuron layers run in place when possible, and the chains of in place
+  // neuron layers fused.
   NetParameter param;
-  InsertSplits(in_param, &param);
+  map<string, string> renamed_blobs;
+  if (in_param.auto_in_place()) {
+    NetParameter param_split;
+    InsertSplits(in_param, &param_split);
+    RewriteInPlace(param_split, &param, &renamed_blobs);
+  } else {
+    InsertSplits(in_param, &param);
+  }
+  if (in_param.fuse_neuron_layers()) {
+    NetParameter param_unfused(param);
+    FuseNeuronLayers(param_unfused, &param);
+  }
   // Basically, build all the layers and set up its connections.
   name_ = param.name();
+  inference_ = param.inference();
+  backward_callback_ = NULL;
+  num_hard_ = 0;
+  params_count_ = 0;
+  CHECK(!inference_ || !param.force_backward())
+      << "An inference only net cannot force backward.";
+  if (inference_) {
+    LOG(INFO) << "Initializing net " << name_ << " for inference only.";
+  }
+  CHECK(inference_ || !weights)
+      << "Only an inference net shares the parameters of another net.";
+  if (weights) {
+    // The mappings of the raw weights the parameters may be in
+    raw_weights_ = weights->raw_weights_;
+  }
   map<string, int> blob_name_to_idx;
   set<string> available_blobs;
   int num_layers = param.layers_size();
@@ -57,6 +129,9 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
     blob_need_backward_.push_back(param.force_backward());
     net_input_blob_indices_.push_back(i);
     net_input_blobs_.push_back(blob_pointer.get());
+    const int owner = MemoryPool::Get().Owner(blob_name);
+    blob_pointer->set_memory_tags(MemoryTag(owner, MEMORY_ACTIVATIONS),
+        MemoryTag(owner, MEMORY_GRADIENTS));
     blob_name_to_idx[blob_name] = i;
     available_blobs.insert(blob_name);
     memory_used += blob_pointer->count();
@@ -67,13 +142,21 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
   top_vecs_.resize(param.layers_size());
   bottom_id_vecs_.resize(param.layers_size());
   top_id_vecs_.resize(param.layers_size());
+  bottom_shapes_.resize(param.layers_size());
+  // The mode of the layer writing each blob last, to find the blobs copied
+  // between the host and the device for the layers placed on a device
+  int num_device_copies = 0;
+  vector<Caffe::Brew> blob_modes;
   for (int i = 0; i < param.layers_size(); ++i) {
     bool in_place = false;
     const LayerParameter& layer_param = param.layers(i);
     layers_.push_back(shared_ptr<Layer<Dtype> >(GetLayer<Dtype>(layer_param)));
     layer_names_.push_back(layer_param.name());
+    const int owner = MemoryPool::Get().Owner(layer_param.name());
+    layer_memory_owners_.push_back(owner);
     LOG(INFO) << "Creating Layer " << layer_param.name();
-    bool need_backward = param.force_backward();
+    // Whether the bottoms need backward, and the layer itself
+    bool propagate_down = param.force_backward();
     // Figure out this layer's input and output
     for (int j = 0; j < layer_param.bottom_size(); ++j) {
       const string& blob_name = layer_param.bottom(j);
@@ -87,8 +170,15 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
           blobs_[blob_id].get());
       bottom_id_vecs_[i].push_back(blob_id);
       // If a blob needs backward, this layer should provide it.
-      need_backward |= blob_need_backward_[blob_id];
+      propagate_down |= blob_need_backward_[blob_id];
       available_blobs.erase(blob_name);
+      blob_modes.resize(blobs_.size(), Caffe::mode());
+      if (blob_modes[blob_id] != layers_[i]->mode()) {
+        LOG(INFO) << blob_name << " is copied to the "
+            << (layers_[i]->mode() == Caffe::GPU ? "GPU" : "CPU") << " for "
+            << layer_param.name();
+        ++num_device_copies;
+      }
     }
     for (int j = 0; j < layer_param.top_size(); ++j) {
       const string& blob_name = layer_param.top(j);
@@ -110,6 +200,8 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
         // Normal output.
         LOG(INFO) << layer_param.name() << " -> " << blob_name;
         shared_ptr<Blob<Dtype> > blob_pointer(new Blob<Dtype>());
+        blob_pointer->set_memory_tags(MemoryTag(owner, MEMORY_ACTIVATIONS),
+            MemoryTag(owner, MEMORY_GRADIENTS));
         blobs_.push_back(blob_pointer);
         blob_names_.push_back(blob_name);
         blob_need_backward_.push_back(param.force_backward());
@@ -119,9 +211,28 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
         top_id_vecs_[i].push_back(blob_names_.size() - 1);
       }
     }
-    // After this layer is connected, set it up.
+    if (weights && weights->has_layer(layer_param.name())) {
+      ShareLayerParams(weights->layer_by_name(layer_param.name()).get(),
+          layers_[i].get());
+    }
+    // After this layer is connected, set it up. The memory it allocates for
+    // itself is accounted against it, as its parameters.
     // LOG(INFO) << "Setting up " << layer_names_[i];
-    layers_[i]->SetUp(bottom_vecs_[i], &top_vecs_[i]);
+    AppendSpatialShapes(bottom_vecs_[i], &bottom_shapes_[i]);
+    {
+      MemoryScope memory_scope(MemoryTag(owner, MEMORY_BUFFERS));
+      ModeScope mode_scope(layers_[i]->mode());
+      layers_[i]->SetUp(bottom_vecs_[i], &top_vecs_[i]);
+    }
+    blob_modes.resize(blobs_.size(), Caffe::mode());
+    for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
+      blob_modes[top_id_vecs_[i][j]] = layers_[i]->mode();
+    }
+    for (int j = 0; j < layers_[i]->blobs().size(); ++j) {
+      layers_[i]->blobs()[j]->set_memory_tags(
+          MemoryTag(owner, MEMORY_PARAMS),
+          MemoryTag(owner, MEMORY_PARAM_GRADIENTS));
+    }
     for (int topid = 0; topid < top_vecs_[i].size(); ++topid) {
       LOG(INFO) << "Top shape: " << top_vecs_[i][topid]->num() << " "
           << top_vecs_[i][topid]->channels() << " "
@@ -132,6 +243,7 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
         memory_used += top_vecs_[i][topid]->count();
     }
     DLOG(INFO) << "Memory  required for Data " << memory_used*sizeof(Dtype);
+    bool need_backward = propagate_down;
     int blobs_lr_size = layers_[i]->layer_param().blobs_lr_size();
     CHECK(blobs_lr_size == layers_[i]->blobs().size() || blobs_lr_size == 0)
         << "Incorrect blobs lr size: should be either 0 or the same as "
@@ -139,7 +251,11 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
     if (blobs_lr_size) {
       // Check if this layer needs backward operation itself
       for (int j = 0; j < blobs_lr_size; ++j) {
-        need_backward |= (layers_[i]->layer_param().blobs_lr(j) > 0);
+        const bool param_need_backward =
+            layers_[i]->layer_param().blobs_lr(j) > 0;
+        need_backward |= param_need_backward;
+        // A frozen parameter gets no gradient.
+        layers_[i]->set_param_propagate_down(j, param_need_backward);
       }
     } else if (layers_[i]->blobs().size()) {
       // catch: if a layer param does not specify blobs_lr, we should assume the
@@ -147,7 +263,9 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
       need_backward = true;
     }
     // Finally, set the backward flag
+    need_backward &= !inference_;
     layer_need_backward_.push_back(need_backward);
+    layer_propagate_down_.push_back(propagate_down && !inference_);
     if (need_backward) {
       LOG(INFO) << layer_names_[i] << " needs backward computation.";
       for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
@@ -167,14 +285,714 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
   for (size_t i = 0; i < blob_names_.size(); ++i) {
     blob_names_index_[blob_names_[i]] = i;
   }
+  // The blobs renamed to run a layer in place can still be found by their
+  // old name.
+  size_t in_place_memory = 0;
+  for (map<string, string>::const_iterator it = renamed_blobs.begin();
+       it != renamed_blobs.end(); ++it) {
+    const int blob_id = blob_names_index_[it->second];
+    blob_names_index_[it->first] = blob_id;
+    in_place_memory += blobs_[blob_id]->count();
+  }
+  if (renamed_blobs.size()) {
+    LOG(INFO) << "Running " << renamed_blobs.size() << " layers in place saved "
+        << in_place_memory * sizeof(Dtype) << " bytes of data.";
+  }
   for (size_t i = 0; i < layer_names_.size(); ++i) {
     layer_names_index_[layer_names_[i]] = i;
   }
   GetLearningRateAndWeightDecay();
+  BuildPlan();
+  if (num_device_copies) {
+    LOG(INFO) << num_device_copies << " blob(s) are copied between the host "
+        "and the device for the layers placed on a device of their own.";
+  }
   LOG(INFO) << "Network initialization done.";
   LOG(INFO) << "Memory required for Data " << memory_used*sizeof(Dtype);
+  if (param.zero_copy_concat()) {
+    for (int i = 0; i < layers_.size(); ++i) {
+      if (layers_[i]->layer_param().type() != LayerParameter_LayerType_CONCAT) {
+        continue;
+      }
+      bool zero_copy = true;
+      for (int j = 0; j < bottom_id_vecs_[i].size(); ++j) {
+        const int blob_id = bottom_id_vecs_[i][j];
+        // The last layer writing the blob before the concat, if any
+        int producer = -1;
+        for (int k = 0; k < i; ++k) {
+          for (int t = 0; t < top_id_vecs_[k].size(); ++t) {
+            if (top_id_vecs_[k][t] == blob_id) {
+              producer = k;
+            }
+          }
+        }
+        const LayerParameter_LayerType type = producer < 0 ?
+            LayerParameter_LayerType_NONE :
+            layers_[producer]->layer_param().type();
+        zero_copy &= producer >= 0 && bottom_id_vecs_[producer].size() &&
+            type != LayerParameter_LayerType_SPLIT &&
+            type != LayerParameter_LayerType_FLATTEN;
+      }
+      // A layer running in place over the top would also overwrite the
+      // bottoms, which their producers may need in Backward.
+      const int top_id = top_id_vecs_[i][0];
+      for (int k = i + 1; k < layers_.size() && !inference_; ++k) {
+        for (int t = 0; t < top_id_vecs_[k].size(); ++t) {
+          zero_copy &= !(top_id_vecs_[k][t] == top_id &&
+              t < bottom_id_vecs_[k].size() &&
+              bottom_id_vecs_[k][t] == top_id);
+        }
+      }
+      if (zero_copy) {
+        zero_copy_concats_.push_back(i);
+      } else {
+        LOG(INFO) << layer_names_[i] << " copies its bottoms: they cannot be "
+            "views into its top.";
+      }
+    }
+    ShareConcatMemory();
+  }
+  split_diff_shared_.assign(blobs_.size(), false);
+  if (param.accumulate_split_diffs() && !inference_) {
+    int accumulating = 0;
+    for (int i = 0; i < layers_.size(); ++i) {
+      // A top in place over the bottom already writes the bottom diff.
+      if (layers_[i]->layer_param().type() != LayerParameter_LayerType_SPLIT ||
+          !layer_propagate_down_[i] ||
+          top_id_vecs_[i][0] == bottom_id_vecs_[i][0]) {
+        continue;
+      }
+      // The consumers of the tops that can accumulate: each top of a split
+      // goes to one layer, which must write its diff in Backward.
+      vector<pair<int, int> > consumers;
+      for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
+        const int top_id = top_id_vecs_[i][j];
+        int consumer = -1;
+        int uses = 0;
+        for (int k = i + 1; k < layers_.size(); ++k) {
+          for (int b = 0; b < bottom_id_vecs_[k].size(); ++b) {
+            if (bottom_id_vecs_[k][b] == top_id) {
+              consumer = k;
+              ++uses;
+            }
+          }
+        }
+        if (uses == 1 && layers_[consumer]->can_accumulate_bottom_diffs() &&
+            bottom_id_vecs_[consumer].size() == 1 &&
+            top_id_vecs_[consumer][0] != top_id &&
+            layer_need_backward_[consumer] &&
+            layer_propagate_down_[consumer]) {
+          consumers.push_back(std::make_pair(consumer, top_id));
+        }
+      }
+      // Backward runs the last consumer first: it overwrites the diff.
+      std::sort(consumers.begin(), consumers.end());
+      for (int c = 0; c < consumers.size(); ++c) {
+        split_diff_shared_[consumers[c].second] = true;
+        layers_[consumers[c].first]->set_accumulate_bottom_diffs(
+            c + 1 < consumers.size());
+      }
+      accumulating += std::max(static_cast<int>(consumers.size()) - 1, 0);
+    }
+    LOG(INFO) << accumulating << " layer(s) add their gradient to the diff of "
+        "a split bottom.";
+    ShareSplitDiffs();
+  }
+  share_blob_memory_ = param.share_blob_memory();
+  shared_batch_size_ = net_input_blobs_.size() ? net_input_blobs_[0]->num() : 0;
+  if (share_blob_memory_) {
+    ShareBlobMemory();
+  }
+  if (param.half_precision_weights()) {
+    CHECK(inference_) << "Only an inference net has half precision weights.";
+    size_t scratch_size = 0;
+    for (int i = 0; i < layers_.size(); ++i) {
+      const LayerParameter_LayerType type = layers_[i]->layer_param().type();
+      if ((type == LayerParameter_LayerType_CONVOLUTION ||
+           type == LayerParameter_LayerType_INNER_PRODUCT) &&
+          layers_[i]->blobs().size()) {
+        Blob<Dtype>* weights = layers_[i]->blobs()[0].get();
+        half_weights_.push_back(weights);
+        scratch_size = std::max(scratch_size,
+            weights->count() * sizeof(Dtype));
+      }
+    }
+    if (half_weights_.size()) {
+      half_scratch_.reset(new SyncedMemory(scratch_size));
+      half_scratch_->set_tag(MemoryTag(MemoryPool::Get().Owner(name_),
+          MEMORY_BUFFERS));
+      LOG(INFO) << "Storing the weights of " << half_weights_.size()
+          << " layers in half precision.";
+    }
+  }
+  offload_streams_[0] = offload_streams_[1] = NULL;
+  layers_done_ = NULL;
+  if (param.offload_activations()) {
+    PlanOffloads();
+  }
+  PlanRecompute(param);
 }
 
+template <typename Dtype>
+void Net<Dtype>::AliasRoots(vector<int>* root) {
+  root->resize(blobs_.size());
+  for (int i = 0; i < blobs_.size(); ++i) {
+    (*root)[i] = i;
+  }
+  // In layer order, so that the bottoms are resolved before the tops
+  for (int i = 0; i < layers_.size(); ++i) {
+    const LayerParameter_LayerType type = layers_[i]->layer_param().type();
+    if (type != LayerParameter_LayerType_SPLIT &&
+        type != LayerParameter_LayerType_FLATTEN) {
+      continue;
+    }
+    for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
+      (*root)[top_id_vecs_[i][j]] = (*root)[bottom_id_vecs_[i][0]];
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::PlanOffloads() {
+  CHECK(!inference_) << "An inference only net has no activations to "
+      "offload: they are not kept for Backward.";
+  CHECK(!share_blob_memory_ && zero_copy_concats_.empty())
+      << "offload_activations works on blobs of their own memory, not with "
+      "share_blob_memory or zero_copy_concat.";
+  vector<int> root;
+  AliasRoots(&root);
+  // The inputs are filled, and the outputs read, outside the passes.
+  const int never = layers_.size();
+  vector<int> last_use(blobs_.size(), -1);
+  for (int i = 0; i < layers_.size(); ++i) {
+    for (int j = 0; j < bottom_id_vecs_[i].size(); ++j) {
+      last_use[root[bottom_id_vecs_[i][j]]] = i;
+    }
+    for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
+      last_use[root[top_id_vecs_[i][j]]] = i;
+    }
+  }
+  for (int i = 0; i < net_input_blob_indices_.size(); ++i) {
+    last_use[root[net_input_blob_indices_[i]]] = never;
+  }
+  for (int i = 0; i < net_output_blob_indices_.size(); ++i) {
+    last_use[root[net_output_blob_indices_[i]]] = never;
+  }
+  layer_offloads_.assign(layers_.size(), vector<int>());
+  for (int i = 0; i < blobs_.size(); ++i) {
+    if (root[i] != i || last_use[i] < 0 || last_use[i] + 2 >= never) {
+      continue;
+    }
+    Offload offload;
+    offload.blob_id = i;
+    offload.last_use = last_use[i];
+    offload.freed = offload.prefetching = false;
+    offload.done = NULL;
+    layer_offloads_[last_use[i]].push_back(offloads_.size());
+    offloads_.push_back(offload);
+    LOG(INFO) << "Offloading " << blob_names_[i] << " after "
+        << layer_names_[last_use[i]];
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::OffloadAfter(const int layer) {
+  FinishOffloads();
+  const vector<int>& offloads = layer_offloads_[layer];
+  if (offloads.empty()) {
+    return;
+  }
+  if (!offload_streams_[0]) {
+    for (int i = 0; i < 2; ++i) {
+      CUDA_CHECK(cudaStreamCreateWithFlags(&offload_streams_[i],
+          cudaStreamNonBlocking));
+    }
+    CUDA_CHECK(cudaEventCreateWithFlags(&layers_done_,
+        cudaEventDisableTiming));
+    for (int i = 0; i < offloads_.size(); ++i) {
+      CUDA_CHECK(cudaEventCreateWithFlags(&offloads_[i].done,
+          cudaEventDisableTiming));
+    }
+  }
+  // The copies read what the layers write.
+  CUDA_CHECK(cudaEventRecord(layers_done_, 0));
+  CUDA_CHECK(cudaStreamWaitEvent(offload_streams_[0], layers_done_, 0));
+  for (int i = 0; i < offloads.size(); ++i) {
+    Offload& offload = offloads_[offloads[i]];
+    const shared_ptr<SyncedMemory>& memory = blobs_[offload.blob_id]->data();
+    // Not for data the blob does not own, e.g. that of a MemoryDataLayer.
+    if (!memory->async_cpu_pull(offload_streams_[0])) {
+      continue;
+    }
+    CUDA_CHECK(cudaEventRecord(offload.done, offload_streams_[0]));
+    offload.memory = memory;
+    offload.freed = offload.prefetching = false;
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::FinishOffloads() {
+  for (int i = 0; i < offloads_.size(); ++i) {
+    Offload& offload = offloads_[i];
+    if (offload.memory && !offload.freed) {
+      CUDA_CHECK(cudaEventSynchronize(offload.done));
+      offload.memory->free_gpu_data();
+      offload.freed = true;
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::Prefetch(const int layer) {
+  const vector<int>& offloads = layer_offloads_[layer];
+  bool recorded = false;
+  for (int i = 0; i < offloads.size(); ++i) {
+    Offload& offload = offloads_[offloads[i]];
+    if (!offload.memory || offload.prefetching) {
+      continue;
+    }
+    // The device memory may be that of buffers the layers issued so far use.
+    if (!recorded) {
+      CUDA_CHECK(cudaEventRecord(layers_done_, 0));
+      CUDA_CHECK(cudaStreamWaitEvent(offload_streams_[1], layers_done_, 0));
+      recorded = true;
+    }
+    if (offload.memory->head() == SyncedMemory::HEAD_AT_CPU) {
+      offload.memory->async_gpu_push(offload_streams_[1]);
+    }
+    CUDA_CHECK(cudaEventRecord(offload.done, offload_streams_[1]));
+    offload.prefetching = true;
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::WaitForPrefetch(const int layer) {
+  Prefetch(layer);
+  const vector<int>& offloads = layer_offloads_[layer];
+  for (int i = 0; i < offloads.size(); ++i) {
+    Offload& offload = offloads_[offloads[i]];
+    if (offload.memory) {
+      CUDA_CHECK(cudaStreamWaitEvent(0, offload.done, 0));
+      offload.memory.reset();
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::PlanRecompute(const NetParameter& param) {
+  const int num_layers = layers_.size();
+  vector<bool> checkpoint(num_layers, false);
+  int interval = param.checkpoint_interval();
+  if (interval < 0) {
+    interval = std::max(1, static_cast<int>(sqrt(num_layers) + 0.5));
+  }
+  for (int i = interval - 1; interval > 0 && i < num_layers; i += interval) {
+    checkpoint[i] = true;
+  }
+  bool any_checkpoint = interval > 0;
+  for (int i = 0; i < num_layers; ++i) {
+    if (layers_[i]->layer_param().checkpoint()) {
+      checkpoint[i] = any_checkpoint = true;
+    }
+  }
+  segment_begun_by_.assign(num_layers, -1);
+  segment_ended_by_.assign(num_layers, -1);
+  if (!any_checkpoint) {
+    return;
+  }
+  CHECK(!inference_) << "An inference only net keeps no activations for "
+      "Backward to recompute.";
+  CHECK(!share_blob_memory_ && zero_copy_concats_.empty() &&
+      !param.offload_activations()) << "Activations are recomputed in blobs "
+      "of their own memory, not with share_blob_memory, zero_copy_concat or "
+      "offload_activations.";
+  vector<int> root;
+  AliasRoots(&root);
+  // The first and last layers writing each blob and its aliases, and using
+  // them. The inputs of the net are written and used before the first layer,
+  // and like the outputs used after the last one.
+  const int never = num_layers;
+  vector<int> first_write(blobs_.size(), never);
+  vector<int> last_write(blobs_.size(), -1);
+  vector<int> first_use(blobs_.size(), never);
+  vector<int> last_use(blobs_.size(), -1);
+  for (int i = 0; i < num_layers; ++i) {
+    for (int j = 0; j < bottom_id_vecs_[i].size(); ++j) {
+      const int g = root[bottom_id_vecs_[i][j]];
+      first_use[g] = std::min(first_use[g], i);
+      last_use[g] = i;
+    }
+    for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
+      const int g = root[top_id_vecs_[i][j]];
+      first_write[g] = std::min(first_write[g], i);
+      last_write[g] = i;
+      first_use[g] = std::min(first_use[g], i);
+      last_use[g] = i;
+    }
+  }
+  for (int i = 0; i < net_input_blob_indices_.size(); ++i) {
+    const int g = root[net_input_blob_indices_[i]];
+    first_write[g] = first_use[g] = -1;
+    last_use[g] = never;
+  }
+  for (int i = 0; i < net_output_blob_indices_.size(); ++i) {
+    last_use[root[net_output_blob_indices_[i]]] = never;
+  }
+  // Whether a layer after layer i writes a blob existing at i, e.g. runs in
+  // place over its top: the segment after i would run it again over the
+  // blob it wrote.
+  vector<bool> written_after(num_layers, false);
+  for (int g = 0; g < blobs_.size(); ++g) {
+    for (int i = std::max(first_write[g], 0); i < last_write[g]; ++i) {
+      written_after[i] = true;
+    }
+  }
+  checkpoint[num_layers - 1] = true;
+  int begin = 0;
+  for (int end = 0; end < num_layers; ++end) {
+    if (written_after[end]) {
+      if (checkpoint[end]) {
+        checkpoint[end + 1] = true;
+      }
+      continue;
+    }
+    if (!checkpoint[end]) {
+      continue;
+    }
+    // The blobs used only in the segment are freed, and the layers writing
+    // them run again, if they read bottoms and all their tops are freed, and
+    // if the bottoms they keep are not written after them. Keeping the tops
+    // of the others may keep more blobs and layers, until none changes.
+    vector<bool> freed(blobs_.size(), false);
+    for (int g = 0; g < blobs_.size(); ++g) {
+      freed[g] = root[g] == g && first_use[g] >= begin && last_use[g] <= end;
+    }
+    vector<bool> again(num_layers, false);
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (int i = begin; i < end; ++i) {
+        again[i] = bottom_id_vecs_[i].size() && top_id_vecs_[i].size();
+        for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
+          again[i] = again[i] && freed[root[top_id_vecs_[i][j]]];
+        }
+        for (int j = 0; j < bottom_id_vecs_[i].size(); ++j) {
+          const int g = root[bottom_id_vecs_[i][j]];
+          again[i] = again[i] && (freed[g] || last_write[g] <= i);
+        }
+        for (int j = 0; j < top_id_vecs_[i].size() && !again[i]; ++j) {
+          const int g = root[top_id_vecs_[i][j]];
+          changed = changed || freed[g];
+          freed[g] = false;
+        }
+      }
+      // Nor are the tops of the checkpoint freed.
+      for (int j = 0; j < top_id_vecs_[end].size(); ++j) {
+        const int g = root[top_id_vecs_[end][j]];
+        changed = changed || freed[g];
+        freed[g] = false;
+      }
+    }
+    RecomputeSegment segment;
+    segment.begin = begin;
+    segment.end = end;
+    segment.need_backward = false;
+    for (int i = begin; i <= end; ++i) {
+      if (again[i]) {
+        segment.layer_ids.push_back(i);
+      }
+      segment.need_backward = segment.need_backward || layer_need_backward_[i];
+    }
+    for (int i = 0; i < blobs_.size(); ++i) {
+      if (freed[root[i]]) {
+        segment.blob_ids.push_back(i);
+      }
+    }
+    if (segment.blob_ids.size()) {
+      segment_begun_by_[begin] = segment_ended_by_[end] =
+          recompute_segments_.size();
+      recompute_segments_.push_back(segment);
+      LOG(INFO) << "Recomputing " << segment.blob_ids.size() << " blobs with "
+          << segment.layer_ids.size() << " layers from "
+          << layer_names_[begin] << " to checkpoint " << layer_names_[end];
+    }
+    begin = end + 1;
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::Recompute(const RecomputeSegment& segment) {
+  for (int i = 0; i < segment.layer_ids.size(); ++i) {
+    Layer<Dtype>* layer = layers_[segment.layer_ids[i]].get();
+    layer->set_recomputing(true);
+    ForwardLayer(segment.layer_ids[i]);
+    layer->set_recomputing(false);
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::FreeRecomputed(const RecomputeSegment& segment,
+    const bool diffs) {
+  for (int i = 0; i < segment.blob_ids.size(); ++i) {
+    Blob<Dtype>* blob = blobs_[segment.blob_ids[i]].get();
+    blob->data()->free_data();
+    if (diffs) {
+      blob->diff()->free_data();
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::ReleaseActivations() {
+  vector<bool> input(blobs_.size(), false);
+  for (int i = 0; i < net_input_blob_indices_.size(); ++i) {
+    input[net_input_blob_indices_[i]] = true;
+  }
+  for (int i = 0; i < blobs_.size(); ++i) {
+    if (!input[i]) {
+      blobs_[i]->data()->free_data();
+      if (blobs_[i]->has_diff()) {
+        blobs_[i]->diff()->free_data();
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::ShareLayerParams(Layer<Dtype>* source, Layer<Dtype>* layer) {
+  vector<shared_ptr<Blob<Dtype> > >& source_blobs = source->blobs();
+  vector<shared_ptr<Blob<Dtype> > >& layer_blobs = layer->blobs();
+  // The layer then skips initializing its parameters when set up.
+  layer_blobs.clear();
+  for (int i = 0; i < source_blobs.size(); ++i) {
+    const Blob<Dtype>& source_blob = *source_blobs[i];
+    CHECK(!source_blob.half_data())
+        << "Weights stored in half precision cannot be shared.";
+    switch (Caffe::mode()) {
+    case Caffe::CPU:
+      source_blob.cpu_data();
+      break;
+    case Caffe::GPU:
+      source_blob.gpu_data();
+      source_blob.cpu_data();
+      break;
+    default:
+      LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
+    }
+    layer_blobs.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>(
+        source_blob.num(), source_blob.channels(), source_blob.height(),
+        source_blob.width())));
+    layer_blobs.back()->ShareData(source_blob);
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::StoreWeightsAsHalf() {
+  for (int i = 0; i < half_weights_.size(); ++i) {
+    half_weights_[i]->StoreDataAsHalf(half_scratch_);
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::ShareSplitDiffs() {
+  for (int i = 0; i < layers_.size(); ++i) {
+    if (layers_[i]->layer_param().type() != LayerParameter_LayerType_SPLIT) {
+      continue;
+    }
+    for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
+      if (split_diff_shared_[top_id_vecs_[i][j]]) {
+        top_vecs_[i][j]->ShareDiff(*bottom_vecs_[i][0]);
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::ShareBlobMemory() {
+  const int num_blobs = blobs_.size();
+  // Split and flatten layers make their tops alias their bottom, so these
+  // blobs go in one group, which lives as long as any of them. In Backward
+  // the diffs of the tops of a split only alias that of its bottom if they
+  // are shared (see NetParameter.accumulate_split_diffs): the others hold
+  // the gradients the split sums.
+  vector<int> group(num_blobs);
+  for (int i = 0; i < num_blobs; ++i) {
+    group[i] = i;
+  }
+  for (int i = 0; i < layers_.size(); ++i) {
+    const LayerParameter_LayerType type = layers_[i]->layer_param().type();
+    if (type != LayerParameter_LayerType_SPLIT &&
+        type != LayerParameter_LayerType_FLATTEN) {
+      continue;
+    }
+    const int bottom_group = group[bottom_id_vecs_[i][0]];
+    for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
+      if (type == LayerParameter_LayerType_SPLIT && !inference_ &&
+          !split_diff_shared_[top_id_vecs_[i][j]]) {
+        continue;
+      }
+      const int top_group = group[top_id_vecs_[i][j]];
+      for (int k = 0; k < num_blobs; ++k) {
+        if (group[k] == top_group) {
+          group[k] = bottom_group;
+        }
+      }
+    }
+  }
+  // A group lives from the first layer producing one of its blobs to the
+  // last layer using one; in Backward the diffs live over the same layers,
+  // in reverse. Groups holding inputs or outputs of the net are left out.
+  vector<int> first_layer(num_blobs, layers_.size());
+  vector<int> last_layer(num_blobs, -1);
+  vector<int64_t> group_count(num_blobs, 0);
+  vector<bool> shareable(num_blobs, true);
+  for (int i = 0; i < layers_.size(); ++i) {
+    for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
+      const int g = group[top_id_vecs_[i][j]];
+      first_layer[g] = std::min(first_layer[g], i);
+      last_layer[g] = std::max(last_layer[g], i);
+    }
+    for (int j = 0; j < bottom_id_vecs_[i].size(); ++j) {
+      const int g = group[bottom_id_vecs_[i][j]];
+      last_layer[g] = std::max(last_layer[g], i);
+    }
+  }
+  for (int i = 0; i < net_input_blob_indices_.size(); ++i) {
+    shareable[group[net_input_blob_indices_[i]]] = false;
+  }
+  for (int i = 0; i < net_output_blob_indices_.size(); ++i) {
+    shareable[group[net_output_blob_indices_[i]]] = false;
+  }
+  // The blobs of a zero copy concat are views into its top.
+  for (int i = 0; i < zero_copy_concats_.size(); ++i) {
+    const int layer_id = zero_copy_concats_[i];
+    shareable[group[top_id_vecs_[layer_id][0]]] = false;
+    for (int j = 0; j < bottom_id_vecs_[layer_id].size(); ++j) {
+      shareable[group[bottom_id_vecs_[layer_id][j]]] = false;
+    }
+  }
+  for (int i = 0; i < num_blobs; ++i) {
+    group_count[group[i]] = std::max(group_count[group[i]],
+        blobs_[i]->count());
+  }
+  // Go through the groups in the order they appear, giving each one the free
+  // buffer closest to its size, or a new buffer if none is free.
+  vector<pair<int, int> > groups;
+  for (int g = 0; g < num_blobs; ++g) {
+    if (group[g] == g && shareable[g] && group_count[g] > 0) {
+      groups.push_back(std::make_pair(first_layer[g], g));
+    }
+  }
+  std::sort(groups.begin(), groups.end());
+  vector<int64_t> buffer_count;
+  vector<int> buffer_last_layer;
+  vector<int> group_buffer(num_blobs, -1);
+  size_t unshared_count = 0;
+  for (int i = 0; i < groups.size(); ++i) {
+    const int g = groups[i].second;
+    unshared_count += group_count[g];
+    int best = -1;
+    for (int b = 0; b < buffer_count.size(); ++b) {
+      if (buffer_last_layer[b] >= first_layer[g]) {
+        continue;
+      }
+      // Prefer the smallest buffer large enough, else the largest one.
+      if (best < 0 ||
+          (buffer_count[best] < group_count[g] &&
+           buffer_count[b] > buffer_count[best]) ||
+          (buffer_count[b] >= group_count[g] &&
+           buffer_count[b] < buffer_count[best])) {
+        best = b;
+      }
+    }
+    if (best < 0) {
+      best = buffer_count.size();
+      buffer_count.push_back(0);
+      buffer_last_layer.push_back(-1);
+    }
+    buffer_count[best] = std::max(buffer_count[best], group_count[g]);
+    buffer_last_layer[best] = last_layer[g];
+    group_buffer[g] = best;
+  }
+  vector<shared_ptr<SyncedMemory> > buffers(buffer_count.size());
+  size_t shared_count = 0;
+  for (int b = 0; b < buffers.size(); ++b) {
+    buffers[b].reset(new SyncedMemory(buffer_count[b] * sizeof(Dtype)));
+    buffers[b]->set_tag(MemoryTag(MemoryPool::Get().Owner(name_),
+        inference_ ? MEMORY_ACTIVATIONS : MEMORY_GRADIENTS));
+    shared_count += buffer_count[b];
+  }
+  for (int i = 0; i < num_blobs; ++i) {
+    const int b = group_buffer[group[i]];
+    if (b < 0) {
+      continue;
+    }
+    if (inference_) {
+      blobs_[i]->ShareDataMemory(buffers[b]);
+    } else {
+      blobs_[i]->ShareDiffMemory(buffers[b]);
+    }
+  }
+  LOG(INFO) << "Sharing the " << (inference_ ? "data" : "diffs") << " of "
+      << groups.size() << " blob group(s) in " << buffers.size()
+      << " buffer(s): " << shared_count * sizeof(Dtype) << " bytes instead of "
+      << unshared_count * sizeof(Dtype);
+}
+
+template <typename Dtype>
+void Net<Dtype>::ShareConcatMemory() {
+  // The later concats go first: the top of a concat may be a bottom of a
+  // later one, whose view it must be before its own bottoms view it.
+  vector<int> zero_copy_concats;
+  for (int k = zero_copy_concats_.size() - 1; k >= 0; --k) {
+    const int i = zero_copy_concats_[k];
+    Blob<Dtype>* top = top_vecs_[i][0];
+    const bool contiguous =
+        layers_[i]->layer_param().concat_param().concat_dim() == 0 ||
+        top->num() == 1;
+    int64_t offset = 0;
+    for (int j = 0; j < bottom_vecs_[i].size(); ++j) {
+      Blob<Dtype>* bottom = bottom_vecs_[i][j];
+      if (contiguous) {
+        bottom->ShareDataView(*top, offset);
+        if (!inference_) {
+          bottom->ShareDiffView(*top, offset);
+        }
+      } else {
+        const size_t size = bottom->count() * sizeof(Dtype);
+        bottom->ShareDataMemory(shared_ptr<SyncedMemory>(
+            new SyncedMemory(size)));
+        if (!inference_) {
+          bottom->ShareDiffMemory(shared_ptr<SyncedMemory>(
+              new SyncedMemory(size)));
+        }
+        // The memory is accounted against the layer writing the bottom.
+        for (int l = 0; l < i; ++l) {
+          for (int t = 0; t < top_id_vecs_[l].size(); ++t) {
+            if (top_id_vecs_[l][t] == bottom_id_vecs_[i][j]) {
+              const int owner = layer_memory_owners_[l];
+              bottom->set_memory_tags(MemoryTag(owner, MEMORY_ACTIVATIONS),
+                  MemoryTag(owner, MEMORY_GRADIENTS));
+            }
+          }
+        }
+      }
+      offset += bottom->count();
+    }
+    if (contiguous) {
+      zero_copy_concats.push_back(i);
+    } else {
+      LOG(INFO) << layer_names_[i] << " copies its bottoms again: they are "
+          "no longer contiguous in its top.";
+    }
+  }
+  std::reverse(zero_copy_concats.begin(), zero_copy_concats.end());
+  zero_copy_concats_ = zero_copy_concats;
+  if (zero_copy_concats_.size()) {
+    LOG(INFO) << "The bottoms of " << zero_copy_concats_.size()
+        << " concat layer(s) are views into their tops.";
+  }
+}
 
 template <typename Dtype>
 void Net<Dtype>::GetLearningRateAndWeightDecay() {
@@ -183,6 +1001,8 @@ void Net<Dtype>::GetLearningRateAndWeightDecay() {
     vector<shared_ptr<Blob<Dtype> > >& layer_blobs = layers_[i]->blobs();
     for (int j = 0; j < layer_blobs.size(); ++j) {
       params_.push_back(layer_blobs[j]);
+      param_layers_.push_back(i);
+      param_layer_indices_.push_back(j);
     }
     // push the learning rate mutlipliers
     if (layers_[i]->layer_param().blobs_lr_size()) {
@@ -214,19 +1034,255 @@ void Net<Dtype>::GetLearningRateAndWeightDecay() {
   }
 }
 
+template <typename Dtype>
+void Net<Dtype>::Reshape(const int batch_size) {
+  CHECK_GT(batch_size, 0);
+  CHECK(net_input_blobs_.size()) << "Only the inputs of a net are reshaped.";
+  for (int i = 0; i < net_input_blobs_.size(); ++i) {
+    Blob<Dtype>* blob = net_input_blobs_[i];
+    blob->Reshape(batch_size, blob->channels(), blob->height(), blob->width());
+  }
+  ReshapeLayers(0);
+  // The blobs that outgrew their shared buffers got memory of their own:
+  // they are shared again in buffers as large as they now need.
+  if (share_blob_memory_ && batch_size > shared_batch_size_) {
+    ShareBlobMemory();
+    shared_batch_size_ = batch_size;
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::ReshapeLayers(const int start) {
+  for (int i = start; i < layers_.size(); ++i) {
+    MemoryScope memory_scope(
+        MemoryTag(layer_memory_owners_[i], MEMORY_BUFFERS));
+    ModeScope mode_scope(layers_[i]->mode());
+    if (!layers_[i]->can_reshape_spatially()) {
+      vector<int> shapes;
+      AppendSpatialShapes(bottom_vecs_[i], &shapes);
+      CHECK(shapes == bottom_shapes_[i]) << layer_names_[i]
+          << " only takes bottoms of the shape SetUp saw, but for their num.";
+    }
+    layers_[i]->Reshape(bottom_vecs_[i], &top_vecs_[i]);
+  }
+  // The bottoms of the zero copy concats that outgrew their views got memory
+  // of their own, and the others may now be at other offsets.
+  if (zero_copy_concats_.size()) {
+    ShareConcatMemory();
+  }
+  // The diffs of the split bottoms that grew were dropped.
+  ShareSplitDiffs();
+}
+
+template <typename Dtype>
+void Net<Dtype>::set_hard_examples(const int num_hard) {
+  CHECK_GE(num_hard, 0);
+  if (num_hard_) {
+    layers_[hard_loss_layer_]->set_item_losses(false);
+  }
+  num_hard_ = num_hard;
+  if (!num_hard_) {
+    return;
+  }
+  CHECK(!inference_) << "An inference only net runs no backward pass.";
+  CHECK(!recompute_segments_.size() && !offloads_.size())
+      << "Hard examples cannot be combined with recomputed or offloaded "
+      << "activations.";
+  batch_blobs_ = net_input_blobs_;
+  batch_start_ = 0;
+  while (batch_start_ < layers_.size() && bottom_vecs_[batch_start_].empty()) {
+    batch_blobs_.insert(batch_blobs_.end(), top_vecs_[batch_start_].begin(),
+        top_vecs_[batch_start_].end());
+    ++batch_start_;
+  }
+  CHECK(batch_blobs_.size()) << "The net has no batch to select from.";
+  for (int i = 0; i < batch_blobs_.size(); ++i) {
+    CHECK_EQ(batch_blobs_[i]->num(), batch_blobs_[0]->num())
+        << "The blobs of the batch must hold as many items.";
+  }
+  CHECK_LT(num_hard_, batch_blobs_[0]->num())
+      << "The hard examples are fewer than the items of the batch.";
+  hard_loss_layer_ = -1;
+  for (int i = batch_start_; i < layers_.size(); ++i) {
+    CHECK(bottom_vecs_[i].size())
+        << "Hard examples need the data layers before the others.";
+    if (layers_[i]->can_compute_item_losses()) {
+      CHECK_LT(hard_loss_layer_, 0) << "Both " << layer_names_[i] << " and "
+          << layer_names_[hard_loss_layer_] << " give the losses of items.";
+      hard_loss_layer_ = i;
+    }
+  }
+  CHECK_GE(hard_loss_layer_, 0)
+      << "No loss layer gives the losses of items, e.g. SOFTMAX_LOSS.";
+  layers_[hard_loss_layer_]->set_item_losses(true);
+  LOG(INFO) << "Running backward over the " << num_hard_ << " of "
+      << batch_blobs_[0]->num() << " items of the highest "
+      << layer_names_[hard_loss_layer_] << " loss.";
+}
+
+// Orders the items by decreasing loss.
+template <typename Dtype>
+static bool LossGreater(const pair<Dtype, int>& a,
+    const pair<Dtype, int>& b) {
+  return a.first > b.first;
+}
+
+template <typename Dtype>
+Dtype Net<Dtype>::ForwardBackwardHardExamples() {
+  CHECK(num_hard_) << "No hard examples are selected.";
+  const Dtype loss = ForwardFromTo(0, layers_.size() - 1);
+  const int num = batch_blobs_[0]->num();
+  const Blob<Dtype>* item_losses = layers_[hard_loss_layer_]->item_losses();
+  CHECK_EQ(item_losses->num(), num)
+      << "The loss layer must give a loss per item of the batch.";
+  const Dtype* losses = item_losses->cpu_data();
+  vector<pair<Dtype, int> > order(num);
+  for (int i = 0; i < num; ++i) {
+    order[i] = std::make_pair(losses[i], i);
+  }
+  std::partial_sort(order.begin(), order.begin() + num_hard_, order.end(),
+      LossGreater<Dtype>);
+  vector<int> hard(num_hard_);
+  for (int i = 0; i < num_hard_; ++i) {
+    hard[i] = order[i].second;
+  }
+  // In increasing order, item i comes from an item at or after it, so that
+  // the items are compacted in place.
+  std::sort(hard.begin(), hard.end());
+  for (int b = 0; b < batch_blobs_.size(); ++b) {
+    Blob<Dtype>* blob = batch_blobs_[b];
+    const int item_size = blob->count() / num;
+    if (Caffe::mode() == Caffe::GPU) {
+      Dtype* data = blob->mutable_gpu_data();
+      for (int i = 0; i < num_hard_; ++i) {
+        if (hard[i] != i) {
+          caffe_gpu_copy(item_size, data + hard[i] * item_size,
+              data + i * item_size);
+        }
+      }
+    } else {
+      Dtype* data = blob->mutable_cpu_data();
+      for (int i = 0; i < num_hard_; ++i) {
+        if (hard[i] != i) {
+          caffe_copy(item_size, data + hard[i] * item_size,
+              data + i * item_size);
+        }
+      }
+    }
+    blob->Reshape(num_hard_, blob->channels(), blob->height(), blob->width());
+  }
+  ReshapeLayers(batch_start_);
+  ForwardFromTo(batch_start_, layers_.size() - 1);
+  Backward();
+  for (int b = 0; b < batch_blobs_.size(); ++b) {
+    Blob<Dtype>* blob = batch_blobs_[b];
+    blob->Reshape(num, blob->channels(), blob->height(), blob->width());
+  }
+  ReshapeLayers(batch_start_);
+  return loss;
+}
+
 template <typename Dtype>
 const vector<Blob<Dtype>*>& Net<Dtype>::ForwardPrefilled(Dtype* loss) {
+  const Dtype net_loss = ForwardFromTo(0, layers_.size() - 1);
   if (loss != NULL) {
-    *loss = Dtype(0.);
+    *loss = net_loss;
   }
-  for (int i = 0; i < layers_.size(); ++i) {
+  return net_output_blobs_;
+}
+
+template <typename Dtype>
+Dtype Net<Dtype>::ForwardFromTo(const int start, const int end) {
+  CHECK_GE(start, 0);
+  CHECK_LT(end, static_cast<int>(layers_.size()));
+  StoreWeightsAsHalf();
+  if (Caffe::mode() != plan_mode_) {
+    BuildPlan();
+  }
+  NvtxRange range("Forward");
+  const bool offload = offloads_.size() && plan_mode_ == Caffe::GPU;
+  const bool recompute = recompute_segments_.size() &&
+      Caffe::phase() == Caffe::TRAIN;
+  Dtype loss = 0;
+  for (int i = start; i <= end; ++i) {
     // LOG(ERROR) << "Forwarding " << layer_names_[i];
-    Dtype layer_loss = layers_[i]->Forward(bottom_vecs_[i], &top_vecs_[i]);
-    if (loss != NULL) {
-      *loss += layer_loss;
+    loss += ForwardLayer(i);
+    if (offload) {
+      OffloadAfter(i);
+    }
+    if (recompute && segment_ended_by_[i] >= 0) {
+      FreeRecomputed(recompute_segments_[segment_ended_by_[i]], false);
     }
   }
-  return net_output_blobs_;
+  if (offload) {
+    FinishOffloads();
+  }
+  return loss;
+}
+
+template <typename Dtype>
+Dtype Net<Dtype>::ForwardFrom(const int start) {
+  return ForwardFromTo(start, layers_.size() - 1);
+}
+
+template <typename Dtype>
+Dtype Net<Dtype>::ForwardTo(const int end) {
+  return ForwardFromTo(0, end);
+}
+
+template <typename Dtype>
+void Net<Dtype>::LayersNeeded(const vector<int>& blob_ids,
+    vector<bool>* needed) {
+  // Going backward, a layer is needed if it writes a needed blob, and then
+  // so are its bottoms. In place layers keep their blob needed, so that the
+  // earlier layers writing it are needed too.
+  vector<bool> blob_needed(blobs_.size(), false);
+  for (int i = 0; i < blob_ids.size(); ++i) {
+    blob_needed[blob_ids[i]] = true;
+  }
+  needed->assign(layers_.size(), false);
+  for (int i = layers_.size() - 1; i >= 0; --i) {
+    for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
+      if (blob_needed[top_id_vecs_[i][j]]) {
+        (*needed)[i] = true;
+      }
+    }
+    if ((*needed)[i]) {
+      for (int j = 0; j < bottom_id_vecs_[i].size(); ++j) {
+        blob_needed[bottom_id_vecs_[i][j]] = true;
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::ForwardBlobs(const vector<string>& blob_names) {
+  vector<int> blob_ids;
+  for (int i = 0; i < blob_names.size(); ++i) {
+    CHECK(has_blob(blob_names[i])) << "Unknown blob " << blob_names[i];
+    blob_ids.push_back(blob_names_index_[blob_names[i]]);
+  }
+  vector<bool> needed;
+  LayersNeeded(blob_ids, &needed);
+  StoreWeightsAsHalf();
+  if (Caffe::mode() != plan_mode_) {
+    BuildPlan();
+  }
+  NvtxRange range("Forward");
+  for (int i = 0; i < layers_.size(); ++i) {
+    if (needed[i]) {
+      ForwardLayer(i);
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::ForwardTo(const string& name) {
+  if (has_layer(name)) {
+    ForwardTo(layer_names_index_[name]);
+  } else {
+    ForwardBlobs(vector<string>(1, name));
+  }
 }
 
 template <typename Dtype>
@@ -239,6 +1295,177 @@ const vector<Blob<Dtype>*>& Net<Dtype>::Forward(
   return ForwardPrefilled(loss);
 }
 
+template <typename Dtype>
+vector<Blob<Dtype>*> Net<Dtype>::StageBatch(const int num, const int batch,
+    const int slot, const vector<const Dtype*>& inputs,
+    const cudaStream_t stream) {
+  const int batch_size = net_input_blobs_[0]->num();
+  const int start = batch * batch_size;
+  const int items = std::min(batch_size, num - start);
+  vector<Blob<Dtype>*> staged;
+  for (int i = 0; i < net_input_blobs_.size(); ++i) {
+    const Blob<Dtype>& input = *net_input_blobs_[i];
+    const int item_size = input.count() / input.num();
+    const Dtype* src = inputs[i] + start * item_size;
+    if (Caffe::mode() == Caffe::CPU && items == batch_size) {
+      // A full batch is read where it is.
+      shared_ptr<Blob<Dtype> >& view = staging_views_[slot][i];
+      view.reset(new Blob<Dtype>(input.num(), input.channels(),
+          input.height(), input.width()));
+      view->set_cpu_data(const_cast<Dtype*>(src));
+      staged.push_back(view.get());
+      continue;
+    }
+    Blob<Dtype>* blob = staging_blobs_[slot][i].get();
+    blob->Reshape(input.num(), input.channels(), input.height(),
+        input.width());
+    blob->data()->set_pinned(stream != NULL);
+    Dtype* dst = blob->mutable_cpu_data();
+    caffe_copy(items * item_size, src, dst);
+    caffe_set((batch_size - items) * item_size, Dtype(0),
+        dst + items * item_size);
+    if (stream) {
+      blob->data()->async_gpu_push(stream);
+    }
+    staged.push_back(blob);
+  }
+  return staged;
+}
+
+template <typename Dtype>
+void Net<Dtype>::ForwardAll(const int num, const vector<const Dtype*>& inputs,
+    const vector<string>& output_names, const vector<Dtype*>& outputs) {
+  CHECK(net_input_blobs_.size()) << "ForwardAll needs the net to have inputs.";
+  CHECK_EQ(inputs.size(), net_input_blobs_.size());
+  CHECK_EQ(output_names.size(), outputs.size());
+  const int batch_size = net_input_blobs_[0]->num();
+  vector<Blob<Dtype>*> output_blobs;
+  for (int i = 0; i < output_names.size(); ++i) {
+    CHECK(has_blob(output_names[i])) << "Unknown blob " << output_names[i];
+    output_blobs.push_back(blob_by_name(output_names[i]).get());
+    CHECK_EQ(output_blobs[i]->num(), batch_size);
+  }
+  const int num_inputs = net_input_blobs_.size();
+  // The memory of the inputs, given back at the end
+  vector<shared_ptr<Blob<Dtype> > > saved(num_inputs);
+  for (int i = 0; i < num_inputs; ++i) {
+    saved[i].reset(new Blob<Dtype>());
+    saved[i]->ReshapeLike(*net_input_blobs_[i]);
+    saved[i]->ShareData(*net_input_blobs_[i]);
+  }
+  for (int slot = 0; slot < 2; ++slot) {
+    staging_views_[slot].resize(num_inputs);
+    while (staging_blobs_[slot].size() < num_inputs) {
+      staging_blobs_[slot].push_back(
+          shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    }
+  }
+  // The copies must not wait for the computation on the default stream.
+  cudaStream_t stream = NULL;
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+  }
+  const int batches = (num + batch_size - 1) / batch_size;
+  vector<Blob<Dtype>*> staged = StageBatch(num, 0, 0, inputs, stream);
+  for (int batch = 0; batch < batches; ++batch) {
+    if (stream) {
+      CUDA_CHECK(cudaStreamSynchronize(stream));
+    }
+    for (int i = 0; i < num_inputs; ++i) {
+      net_input_blobs_[i]->ShareData(*staged[i]);
+    }
+    // The other slot was read by the batch before, which is done by now.
+    if (batch + 1 < batches) {
+      staged = StageBatch(num, batch + 1, (batch + 1) % 2, inputs, stream);
+    }
+    ForwardPrefilled();
+    const int start = batch * batch_size;
+    const int items = std::min(batch_size, num - start);
+    for (int i = 0; i < output_blobs.size(); ++i) {
+      const int item_size = output_blobs[i]->count() / batch_size;
+      Dtype* dst = outputs[i] + start * item_size;
+      if (Caffe::mode() == Caffe::GPU) {
+        CUDA_CHECK(cudaMemcpy(dst, output_blobs[i]->gpu_data(),
+            sizeof(Dtype) * items * item_size, cudaMemcpyDeviceToHost));
+      } else {
+        caffe_copy(items * item_size, output_blobs[i]->cpu_data(), dst);
+      }
+    }
+  }
+  if (stream) {
+    CUDA_CHECK(cudaStreamDestroy(stream));
+  }
+  for (int i = 0; i < num_inputs; ++i) {
+    net_input_blobs_[i]->ShareData(*saved[i]);
+    staging_views_[0][i].reset();
+    staging_views_[1][i].reset();
+  }
+}
+
+template <typename Dtype>
+const vector<Blob<Dtype>*>& Net<Dtype>::ForwardBuffers(const int num,
+    const vector<const Dtype*>& inputs, const vector<Dtype*>& outputs,
+    Dtype* loss) {
+  CHECK_EQ(inputs.size(), net_input_blobs_.size()) << "Incorrect input size.";
+  CHECK(outputs.empty() || outputs.size() == net_output_blobs_.size())
+      << "Incorrect output size.";
+  const int num_inputs = net_input_blobs_.size();
+  if (num_inputs) {
+    CHECK_GT(num, 0);
+    if (net_input_blobs_[0]->num() != num) {
+      Reshape(num);
+    }
+  }
+  // The inputs a layer writes in place, which are copied
+  vector<bool> written(blobs_.size(), false);
+  for (int i = 0; i < layers_.size(); ++i) {
+    for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
+      written[top_id_vecs_[i][j]] = true;
+    }
+  }
+  // The memory of the inputs, given back at the end
+  vector<shared_ptr<Blob<Dtype> > > saved(num_inputs);
+  while (buffer_blobs_.size() < num_inputs) {
+    buffer_blobs_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+  }
+  for (int i = 0; i < num_inputs; ++i) {
+    Blob<Dtype>* input = net_input_blobs_[i];
+    saved[i].reset(new Blob<Dtype>());
+    saved[i]->ReshapeLike(*input);
+    saved[i]->ShareData(*input);
+    Blob<Dtype>* blob = buffer_blobs_[i].get();
+    if (written[net_input_blob_indices_[i]]) {
+      blob->ReshapeLike(*input);
+      caffe_copy(input->count(), inputs[i], blob->mutable_cpu_data());
+    } else {
+      // A fresh view, the memory of the last one not being the caller's any
+      // more
+      blob = new Blob<Dtype>(input->num(), input->channels(),
+          input->height(), input->width());
+      buffer_blobs_[i].reset(blob);
+      blob->set_cpu_data(const_cast<Dtype*>(inputs[i]));
+    }
+    input->ShareData(*blob);
+  }
+  ForwardPrefilled(loss);
+  for (int i = 0; i < outputs.size(); ++i) {
+    if (!outputs[i]) {
+      continue;
+    }
+    const Blob<Dtype>* output = net_output_blobs_[i];
+    if (Caffe::mode() == Caffe::GPU) {
+      CUDA_CHECK(cudaMemcpy(outputs[i], output->gpu_data(),
+          sizeof(Dtype) * output->count(), cudaMemcpyDeviceToHost));
+    } else {
+      caffe_copy(output->count(), output->cpu_data(), outputs[i]);
+    }
+  }
+  for (int i = 0; i < num_inputs; ++i) {
+    net_input_blobs_[i]->ShareData(*saved[i]);
+  }
+  return net_output_blobs_;
+}
+
 template <typename Dtype>
 string Net<Dtype>::Forward(const string& input_blob_protos, Dtype* loss) {
   BlobProtoVector blob_proto_vec;
@@ -263,11 +1490,229 @@ string Net<Dtype>::Forward(const string& input_blob_protos, Dtype* loss) {
 
 template <typename Dtype>
 void Net<Dtype>::Backward() {
-  for (int i = layers_.size() - 1; i >= 0; --i) {
+  BackwardFromTo(layers_.size() - 1, 0);
+}
+
+template <typename Dtype>
+void Net<Dtype>::BackwardFromTo(const int start, const int end) {
+  CHECK(!inference_) << "Backward called on an inference only net.";
+  CHECK_GE(end, 0);
+  CHECK_LT(start, static_cast<int>(layers_.size()));
+  if (Caffe::mode() != plan_mode_) {
+    BuildPlan();
+  }
+  NvtxRange range("Backward");
+  const bool offload = offloads_.size() && plan_mode_ == Caffe::GPU;
+  if (offload) {
+    FinishOffloads();
+  }
+  const bool recompute = recompute_segments_.size() &&
+      Caffe::phase() == Caffe::TRAIN;
+  for (int i = start; i >= end; --i) {
+    if (offload) {
+      if (i > end) {
+        Prefetch(i - 1);
+      }
+      WaitForPrefetch(i);
+    }
+    if (recompute && segment_ended_by_[i] >= 0 &&
+        recompute_segments_[segment_ended_by_[i]].need_backward) {
+      Recompute(recompute_segments_[segment_ended_by_[i]]);
+    }
     if (layer_need_backward_[i]) {
-      layers_[i]->Backward(top_vecs_[i], true, &bottom_vecs_[i]);
+      BackwardLayer(i);
+    }
+    if (recompute && segment_begun_by_[i] >= 0) {
+      FreeRecomputed(recompute_segments_[segment_begun_by_[i]], true);
+    }
+    if (backward_callback_ && layers_[i]->blobs().size() > 0) {
+      backward_callback_->GradientsReady(i);
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::BuildPlan() {
+  plan_mode_ = Caffe::mode();
+  plan_.resize(layers_.size());
+  for (int i = 0; i < layers_.size(); ++i) {
+    PlanStep& step = plan_[i];
+    step.layer = layers_[i].get();
+    step.bottom = &bottom_vecs_[i];
+    step.top = &top_vecs_[i];
+    step.mode = step.layer->mode();
+    step.own_mode = step.mode != plan_mode_;
+    step.propagate_down = layer_propagate_down_[i];
+    step.memory_owner = layer_memory_owners_[i];
+    step.name = layer_names_[i].c_str();
+  }
+}
+
+template <typename Dtype>
+inline Dtype Net<Dtype>::ForwardStep(const PlanStep& step) {
+  // Only the layers running in a mode of their own switch the mode.
+  if (step.own_mode) {
+    return step.layer->Forward(*step.bottom, step.top);
+  }
+  return step.layer->ForwardIn(step.mode, *step.bottom, step.top);
+}
+
+template <typename Dtype>
+inline void Net<Dtype>::BackwardStep(const PlanStep& step) {
+  if (step.own_mode) {
+    step.layer->Backward(*step.top, step.propagate_down, step.bottom);
+  } else {
+    step.layer->BackwardIn(step.mode, *step.top, step.propagate_down,
+        step.bottom);
+  }
+}
+
+template <typename Dtype>
+Dtype Net<Dtype>::ForwardLayer(const int i) {
+  if (!bottom_vecs_[i].empty()) {
+    return ProfileForwardLayer(i);
+  }
+  // A layer without bottoms giving a batch of another shape, e.g. an
+  // ImageDataLayer with buckets, has the layers after it reshaped to it.
+  vector<int> shapes;
+  AppendSpatialShapes(top_vecs_[i], &shapes);
+  const Dtype loss = ProfileForwardLayer(i);
+  vector<int> new_shapes;
+  AppendSpatialShapes(top_vecs_[i], &new_shapes);
+  if (new_shapes != shapes) {
+    ReshapeLayers(i + 1);
+  }
+  return loss;
+}
+
+template <typename Dtype>
+Dtype Net<Dtype>::ProfileForwardLayer(const int i) {
+  const PlanStep& step = plan_[i];
+  MemoryScope memory_scope(MemoryTag(step.memory_owner, MEMORY_BUFFERS));
+  SyncedMemory::TraceScope trace_scope(layer_names_[i]);
+  NvtxRange range(step.name);
+  if (!profile_timer_) {
+    return ForwardStep(step);
+  }
+  const size_t in_use = MemoryPool::Get().stats().in_use;
+  profile_timer_->Start();
+  const Dtype loss = ForwardStep(step);
+  LayerProfile& profile = layer_profiles_[i];
+  profile.forward_ms += profile_timer_->MilliSeconds();
+  profile.allocated_bytes += std::max(static_cast<int64_t>(0),
+      static_cast<int64_t>(MemoryPool::Get().stats().in_use - in_use));
+  ++profile.forward_passes;
+  return loss;
+}
+
+template <typename Dtype>
+void Net<Dtype>::BackwardLayer(const int i) {
+  const PlanStep& step = plan_[i];
+  MemoryScope memory_scope(MemoryTag(step.memory_owner, MEMORY_BUFFERS));
+  SyncedMemory::TraceScope trace_scope(layer_names_[i]);
+  NvtxRange range(step.name);
+  if (!profile_timer_) {
+    BackwardStep(step);
+    return;
+  }
+  const size_t in_use = MemoryPool::Get().stats().in_use;
+  profile_timer_->Start();
+  BackwardStep(step);
+  LayerProfile& profile = layer_profiles_[i];
+  profile.backward_ms += profile_timer_->MilliSeconds();
+  profile.allocated_bytes += std::max(static_cast<int64_t>(0),
+      static_cast<int64_t>(MemoryPool::Get().stats().in_use - in_use));
+  ++profile.backward_passes;
+}
+
+template <typename Dtype>
+void Net<Dtype>::set_profiling(const bool profiling) {
+  if (profiling) {
+    profile_timer_.reset(new Timer());
+    ResetProfiles();
+  } else {
+    profile_timer_.reset();
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::ResetProfiles() {
+  layer_profiles_.resize(layers_.size());
+  for (int i = 0; i < layers_.size(); ++i) {
+    LayerProfile& profile = layer_profiles_[i];
+    profile.forward_passes = 0;
+    profile.backward_passes = 0;
+    profile.forward_ms = 0;
+    profile.backward_ms = 0;
+    profile.allocated_bytes = 0;
+    // A multiply and an add for each weight and output of the layers with
+    // weights, e.g. the convolution and inner product ones, one operation
+    // per output of the others. Their backward pass computes the gradients
+    // of both the weights and the bottom.
+    const vector<Blob<Dtype>*>& top = top_vecs_[i];
+    double top_count = 0;
+    for (int j = 0; j < top.size(); ++j) {
+      top_count += top[j]->count();
+    }
+    const vector<shared_ptr<Blob<Dtype> > >& blobs = layers_[i]->blobs();
+    if (blobs.size() && top.size() && top[0]->channels()) {
+      profile.forward_flops = 2. * top_count * blobs[0]->count() /
+          top[0]->channels();
+      profile.backward_flops = 2 * profile.forward_flops;
+    } else {
+      profile.forward_flops = top_count;
+      profile.backward_flops = top_count;
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::WriteProfiles(const string& filename, const int iter) {
+  CHECK(profile_timer_) << "The net is not being profiled.";
+  const bool json = filename.size() >= 5 &&
+      filename.compare(filename.size() - 5, 5, ".json") == 0;
+  const bool new_file = !std::ifstream(filename.c_str());
+  std::ofstream output(filename.c_str(), std::ios::out | std::ios::app);
+  CHECK(output) << "Cannot write " << filename;
+  if (json) {
+    output << "{\"net\": \"" << name_ << "\", \"iter\": " << iter
+        << ", \"layers\": [";
+  } else if (new_file) {
+    output << "net,iter,layer,type,forward_passes,forward_ms,"
+        "backward_passes,backward_ms,allocated_bytes,forward_flops,"
+        "backward_flops\n";
+  }
+  for (int i = 0; i < layers_.size(); ++i) {
+    const LayerProfile& profile = layer_profiles_[i];
+    const string type = LayerParameter_LayerType_Name(
+        layers_[i]->layer_param().type());
+    // The flops of the passes run, not of one of each
+    const double forward_flops = profile.forward_flops *
+        profile.forward_passes;
+    const double backward_flops = profile.backward_flops *
+        profile.backward_passes;
+    if (json) {
+      output << (i ? ", " : "") << "{\"name\": \"" << layer_names_[i]
+          << "\", \"type\": \"" << type
+          << "\", \"forward_passes\": " << profile.forward_passes
+          << ", \"forward_ms\": " << profile.forward_ms
+          << ", \"backward_passes\": " << profile.backward_passes
+          << ", \"backward_ms\": " << profile.backward_ms
+          << ", \"allocated_bytes\": " << profile.allocated_bytes
+          << ", \"forward_flops\": " << forward_flops
+          << ", \"backward_flops\": " << backward_flops << "}";
+    } else {
+      output << name_ << "," << iter << "," << layer_names_[i] << "," << type
+          << "," << profile.forward_passes << "," << profile.forward_ms
+          << "," << profile.backward_passes << "," << profile.backward_ms
+          << "," << profile.allocated_bytes << "," << forward_flops << ","
+          << backward_flops << "\n";
     }
   }
+  if (json) {
+    output << "]}\n";
+  }
+  CHECK(output) << "Cannot write " << filename;
 }
 
 template <typename Dtype>
@@ -301,8 +1746,59 @@ void Net<Dtype>::ShareTrainedLayersWith(Net* other) {
   }
 }
 
+// Copies each source into the GPU data of its target. A source is decoded
+// into one of two pinned staging blobs and copied from it asynchronously,
+// while the next one is decoded into the other. Sources with diffs are
+// copied to the CPU as by Blob::FromProto.
+template <typename Dtype>
+static void UploadTrainedBlobs(const vector<Blob<Dtype>*>& targets,
+    const vector<const BlobProto*>& sources) {
+  int64_t max_count = 0;
+  for (int i = 0; i < targets.size(); ++i) {
+    max_count = std::max(max_count, targets[i]->count());
+  }
+  if (max_count == 0) {
+    return;
+  }
+  CHECK_LE(max_count, INT_MAX) << "Trained blob too large to stage.";
+  Blob<Dtype> staging[2];
+  cudaEvent_t copied[2];
+  for (int k = 0; k < 2; ++k) {
+    staging[k].Reshape(1, 1, 1, max_count);
+    staging[k].data()->set_pinned(true);
+    CUDA_CHECK(cudaEventCreateWithFlags(&copied[k], cudaEventDisableTiming));
+  }
+  cudaStream_t stream;
+  CUDA_CHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+  for (int i = 0; i < targets.size(); ++i) {
+    if (sources[i]->diff_size() > 0 || sources[i]->has_raw_diff()) {
+      // The diffs go to the CPU, with the data.
+      targets[i]->FromProto(*sources[i]);
+      continue;
+    }
+    // The copy out of this staging blob, two sources ago, must be done.
+    Blob<Dtype>& stage = staging[i % 2];
+    CUDA_CHECK(cudaEventSynchronize(copied[i % 2]));
+    stage.FromProto(*sources[i]);
+    CUDA_CHECK(cudaMemcpyAsync(targets[i]->mutable_gpu_data(),
+        stage.cpu_data(), sizeof(Dtype) * stage.count(),
+        cudaMemcpyHostToDevice, stream));
+    CUDA_CHECK(cudaEventRecord(copied[i % 2], stream));
+  }
+  CUDA_CHECK(cudaStreamSynchronize(stream));
+  CUDA_CHECK(cudaStreamDestroy(stream));
+  for (int k = 0; k < 2; ++k) {
+    CUDA_CHECK(cudaEventDestroy(copied[k]));
+  }
+}
+
 template <typename Dtype>
 void Net<Dtype>::CopyTrainedLayersFrom(const NetParameter& param) {
+  // The blobs copied to and from, checked before any copy, and the modes of
+  // the layers of the targets
+  vector<Blob<Dtype>*> targets;
+  vector<const BlobProto*> sources;
+  vector<Caffe::Brew> target_modes;
   int num_source_layers = param.layers_size();
   for (int i = 0; i < num_source_layers; ++i) {
     const LayerParameter& source_layer = param.layers(i);
@@ -326,20 +1822,119 @@ void Net<Dtype>::CopyTrainedLayersFrom(const NetParameter& param) {
       CHECK_EQ(target_blobs[j]->channels(), source_layer.blobs(j).channels());
       CHECK_EQ(target_blobs[j]->height(), source_layer.blobs(j).height());
       CHECK_EQ(target_blobs[j]->width(), source_layer.blobs(j).width());
-      target_blobs[j]->FromProto(source_layer.blobs(j));
+      targets.push_back(target_blobs[j].get());
+      sources.push_back(&source_layer.blobs(j));
+      target_modes.push_back(layers_[target_layer_id]->mode());
+    }
+  }
+  // Of the blobs sharing their data, only the last copied to is copied, as
+  // the copies after it would overwrite the others: the rest are independent.
+  map<const SyncedMemory*, int> last_copy;
+  for (int i = 0; i < targets.size(); ++i) {
+    last_copy[targets[i]->data().get()] = i;
+  }
+  // The blobs of the layers run on the GPU are uploaded, the others parsed
+  // on the host.
+  vector<Blob<Dtype>*> copy_targets;
+  vector<const BlobProto*> copy_sources;
+  vector<Blob<Dtype>*> upload_targets;
+  vector<const BlobProto*> upload_sources;
+  for (int i = 0; i < targets.size(); ++i) {
+    if (last_copy[targets[i]->data().get()] != i) {
+      continue;
+    }
+    if (target_modes[i] == Caffe::GPU) {
+      upload_targets.push_back(targets[i]);
+      upload_sources.push_back(sources[i]);
+    } else {
+      copy_targets.push_back(targets[i]);
+      copy_sources.push_back(sources[i]);
+    }
+  }
+  if (upload_targets.size()) {
+    UploadTrainedBlobs(upload_targets, upload_sources);
+  }
+  const int num_copies = copy_targets.size();
+  const int num_threads = CpuLayerThreads(num_copies);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int i = 0; i < num_copies; ++i) {
+    copy_targets[i]->FromProto(*copy_sources[i]);
+  }
+}
+
+// Sets blob to raw_blob, sharing its data if share.
+template <typename Dtype>
+static void SetRawBlobData(const RawWeightsFile::RawBlob& raw_blob,
+    const bool share, Blob<Dtype>* blob) {
+  Dtype* data = blob->mutable_cpu_data();
+  for (int i = 0; i < blob->count(); ++i) {
+    data[i] = raw_blob.data[i];
+  }
+}
+
+template <>
+void SetRawBlobData<float>(const RawWeightsFile::RawBlob& raw_blob,
+    const bool share, Blob<float>* blob) {
+  if (share) {
+    blob->set_cpu_data(raw_blob.data);
+  } else {
+    caffe_copy(blob->count(), raw_blob.data, blob->mutable_cpu_data());
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::CopyTrainedLayersFrom(
+    const shared_ptr<RawWeightsFile>& raw_weights) {
+  const bool share = inference_ && !params_data_;
+  for (int i = 0; i < raw_weights->num_layers(); ++i) {
+    const string& source_layer_name = raw_weights->layer_name(i);
+    int target_layer_id = 0;
+    while (target_layer_id != layer_names_.size() &&
+        layer_names_[target_layer_id] != source_layer_name) {
+      ++target_layer_id;
+    }
+    if (target_layer_id == layer_names_.size()) {
+      DLOG(INFO) << "Ignoring source layer " << source_layer_name;
+      continue;
+    }
+    DLOG(INFO) << "Copying source layer " << source_layer_name;
+    vector<shared_ptr<Blob<Dtype> > >& target_blobs =
+        layers_[target_layer_id]->blobs();
+    const vector<RawWeightsFile::RawBlob>& source_blobs =
+        raw_weights->layer_blobs(i);
+    CHECK_EQ(target_blobs.size(), source_blobs.size())
+        << "Incompatible number of blobs for layer " << source_layer_name;
+    for (int j = 0; j < target_blobs.size(); ++j) {
+      CHECK_EQ(target_blobs[j]->num(), source_blobs[j].num);
+      CHECK_EQ(target_blobs[j]->channels(), source_blobs[j].channels);
+      CHECK_EQ(target_blobs[j]->height(), source_blobs[j].height);
+      CHECK_EQ(target_blobs[j]->width(), source_blobs[j].width);
+      SetRawBlobData(source_blobs[j], share, target_blobs[j].get());
     }
   }
+  if (share) {
+    raw_weights_.push_back(raw_weights);
+  }
 }
 
 template <typename Dtype>
 void Net<Dtype>::CopyTrainedLayersFrom(const string trained_filename) {
+  if (IsRawWeightsFile(trained_filename)) {
+    CopyTrainedLayersFrom(shared_ptr<RawWeightsFile>(
+        new RawWeightsFile(trained_filename)));
+    return;
+  }
   NetParameter param;
   ReadNetParamsFromBinaryFileOrDie(trained_filename, &param);
   CopyTrainedLayersFrom(param);
 }
 
 template <typename Dtype>
-void Net<Dtype>::ToProto(NetParameter* param, bool write_diff) {
+void Net<Dtype>::ToProto(NetParameter* param, bool write_diff,
+    bool write_blobs) {
+  CHECK(!inference_ || !write_diff) << "An inference only net has no diff.";
   param->Clear();
   param->set_name(name_);
   // Add bottom and top
@@ -355,17 +1950,141 @@ void Net<Dtype>::ToProto(NetParameter* param, bool write_diff) {
     for (int j = 0; j < top_id_vecs_[i].size(); ++j) {
       layer_param->add_top(blob_names_[top_id_vecs_[i][j]]);
     }
-    layers_[i]->ToProto(layer_param, write_diff);
+    if (write_blobs) {
+      layers_[i]->ToProto(layer_param, write_diff);
+    } else {
+      layer_param->CopyFrom(layers_[i]->layer_param());
+      layer_param->clear_blobs();
+    }
   }
 }
 
 template <typename Dtype>
 void Net<Dtype>::Update() {
+  CHECK(!inference_) << "Update called on an inference only net.";
   for (int i = 0; i < params_.size(); ++i) {
+    ModeScope mode_scope(param_mode(i));
     params_[i]->Update();
   }
 }
 
+template <typename Dtype>
+void Net<Dtype>::set_accumulate_param_diffs(const bool accumulate) {
+  CHECK(!inference_ || !accumulate) << "An inference only net has no diff.";
+  for (int i = 0; i < layers_.size(); ++i) {
+    layers_[i]->set_accumulate_param_diffs(accumulate);
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::set_device_loss(const bool device_loss) {
+  Dtype* loss = NULL;
+  if (device_loss) {
+    CHECK_EQ(Caffe::mode(), Caffe::GPU)
+        << "Losses are only summed on the device in GPU mode.";
+    if (!device_loss_) {
+      device_loss_.reset(new Blob<Dtype>(1, 1, 1, 1));
+      caffe_gpu_set(1, Dtype(0), device_loss_->mutable_gpu_data());
+    }
+    loss = device_loss_->mutable_gpu_data();
+  } else {
+    device_loss_.reset();
+  }
+  for (int i = 0; i < layers_.size(); ++i) {
+    layers_[i]->set_device_loss(layers_[i]->device_id() < 0 ? loss : NULL);
+  }
+}
+
+template <typename Dtype>
+Dtype Net<Dtype>::device_loss() {
+  CHECK(device_loss_) << "The losses are not summed on the device.";
+  return device_loss_->cpu_data()[0];
+}
+
+template <typename Dtype>
+void Net<Dtype>::ResetDeviceLoss() {
+  CHECK(device_loss_) << "The losses are not summed on the device.";
+  caffe_gpu_set(1, Dtype(0), device_loss_->mutable_gpu_data());
+}
+
+template <typename Dtype>
+void Net<Dtype>::ScaleParamDiffs(const Dtype scale) {
+  CHECK(!inference_) << "An inference only net has no diff.";
+  if (params_diff_) {
+    switch (Caffe::mode()) {
+    case Caffe::CPU:
+      caffe_scal(params_count_, scale,
+          static_cast<Dtype*>(params_diff_->mutable_cpu_data()));
+      break;
+    case Caffe::GPU:
+      caffe_gpu_scal(params_count_, scale,
+          static_cast<Dtype*>(params_diff_->mutable_gpu_data()));
+      break;
+    default:
+      LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
+    }
+    return;
+  }
+  for (int i = 0; i < params_.size(); ++i) {
+    Blob<Dtype>* param = params_[i].get();
+    ModeScope mode_scope(param_mode(i));
+    switch (Caffe::mode()) {
+    case Caffe::CPU:
+      caffe_scal(param->count(), scale, param->mutable_cpu_diff());
+      break;
+    case Caffe::GPU:
+      caffe_gpu_scal(param->count(), scale, param->mutable_gpu_diff());
+      break;
+    default:
+      LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::PackParams() {
+  CHECK(!inference_) << "An inference only net has no diffs to pack.";
+  CHECK(!params_data_) << "The parameters are packed already.";
+  // The packed memory lives where all its parameters do.
+  for (int i = 0; i < params_.size(); ++i) {
+    if (param_mode(i) != Caffe::mode() || param_device(i) >= 0) {
+      LOG(INFO) << "The parameters are not packed: some of their layers are "
+          "placed on another device.";
+      return;
+    }
+  }
+  const int alignment = 256 / sizeof(Dtype);
+  vector<int> offsets(params_.size());
+  params_count_ = 0;
+  for (int i = 0; i < params_.size(); ++i) {
+    offsets[i] = params_count_;
+    params_count_ += (params_[i]->count() + alignment - 1) / alignment *
+        alignment;
+  }
+  params_data_.reset(new SyncedMemory(params_count_ * sizeof(Dtype)));
+  params_diff_.reset(new SyncedMemory(params_count_ * sizeof(Dtype)));
+  const int owner = MemoryPool::Get().Owner(name_);
+  params_data_->set_tag(MemoryTag(owner, MEMORY_PARAMS));
+  params_diff_->set_tag(MemoryTag(owner, MEMORY_PARAM_GRADIENTS));
+  Dtype* data = static_cast<Dtype*>(params_data_->mutable_cpu_data());
+  Dtype* diff = static_cast<Dtype*>(params_diff_->mutable_cpu_data());
+  for (int i = 0; i < params_.size(); ++i) {
+    Blob<Dtype>* param = params_[i].get();
+    const size_t offset = offsets[i] * sizeof(Dtype);
+    const size_t size = param->count() * sizeof(Dtype);
+    caffe_copy(param->count(), param->cpu_data(), data + offsets[i]);
+    if (param->has_diff()) {
+      caffe_copy(param->count(), param->cpu_diff(), diff + offsets[i]);
+    }
+    param->ShareDataMemory(shared_ptr<SyncedMemory>(
+        new SyncedMemory(params_data_, offset, size)));
+    param->ShareDiffMemory(shared_ptr<SyncedMemory>(
+        new SyncedMemory(params_diff_, offset, size)));
+  }
+  LOG(INFO) << "Packed " << params_.size() << " parameter blobs into "
+      << params_count_ << " values.";
+}
+
 template <typename Dtype>
 bool Net<Dtype>::has_blob(const string& blob_name) {
   return blob_names_index_.find(blob_name) != blob_names_index_.end();
@@ -0,0 +1,599 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <cuda_runtime.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/parallel.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/numa.hpp"
+
+namespace caffe {
+
+// The settings of a thread of the solver running on device: bound to the
+// NUMA node of the device, if it is known, when the solver is bound.
+static Caffe::ThreadSettings DeviceSettings(
+    const Caffe::ThreadSettings& solver_settings, const int device) {
+  Caffe::ThreadSettings settings = solver_settings;
+  settings.device = device;
+  const int node = GpuNumaNode(device);
+  if (settings.numa_node >= 0 && node >= 0) {
+    settings.numa_node = node;
+  }
+  return settings;
+}
+
+template <typename Dtype>
+P2PSync<Dtype>::P2PSync(Net<Dtype>* net, const NetParameter& net_param,
+    const vector<int>& device_ids, const int64_t random_seed)
+    : net_param_(net_param), random_seed_(random_seed),
+      settings_(Caffe::thread_settings()) {
+  CHECK_GT(device_ids.size(), 1) << "Data parallel training needs 2 devices.";
+  CHECK(Caffe::mode() == Caffe::GPU) << "Data parallel training runs on GPUs.";
+  CHECK_EQ(settings_.device, device_ids[0])
+      << "The net must be on the first device.";
+  max_param_count_ = 0;
+  for (int i = 0; i < net->params().size(); ++i) {
+    max_param_count_ = std::max(max_param_count_, net->params()[i]->count());
+  }
+  last_backward_layer_ = -1;
+  for (int i = net->layers().size() - 1; i >= 0; --i) {
+    if (net->layers()[i]->blobs().size() > 0) {
+      last_backward_layer_ = i;
+    }
+  }
+  CHECK_GE(last_backward_layer_, 0) << "The net has no parameters to train.";
+  const int num_replicas = device_ids.size();
+  for (int i = 0; i < num_replicas; ++i) {
+    shared_ptr<Replica> replica(new Replica());
+    replica->sync = this;
+    replica->id = i;
+    replica->device = device_ids[i];
+    replica->net = i ? NULL : net;
+    int highest_bit = i;
+    while (highest_bit & (highest_bit - 1)) {
+      highest_bit &= highest_bit - 1;
+    }
+    replica->parent = i ? i - highest_bit : -1;
+    replica->loss = 0;
+    replicas_.push_back(replica);
+    if (i) {
+      replicas_[replica->parent]->children.push_back(i);
+      const int parent_device = replicas_[replica->parent]->device;
+      Caffe::EnablePeerAccess(replica->device, parent_device);
+      Caffe::EnablePeerAccess(parent_device, replica->device);
+    }
+  }
+  LOG(INFO) << "Training data parallel on " << num_replicas << " GPUs.";
+  for (int i = 1; i < num_replicas; ++i) {
+    CHECK(!pthread_create(&replicas_[i]->thread, NULL, ReplicaThread,
+          static_cast<void*>(replicas_[i].get())))
+        << "Pthread execution failed.";
+  }
+  StartReducer(replicas_[0].get());
+  for (int i = 1; i < num_replicas; ++i) {
+    replicas_built_.pop();
+  }
+}
+
+template <typename Dtype>
+P2PSync<Dtype>::~P2PSync() {
+  // The stop goes down the tree like an iteration.
+  for (int i = 0; i < replicas_[0]->children.size(); ++i) {
+    replicas_[replicas_[0]->children[i]]->iterations.push(0);
+  }
+  for (int i = 1; i < replicas_.size(); ++i) {
+    CHECK(!pthread_join(replicas_[i]->thread, NULL))
+        << "Pthread joining failed.";
+  }
+  StopReducer(replicas_[0].get());
+}
+
+template <typename Dtype>
+void P2PSync<Dtype>::Replica::GradientsReady(const int layer_id) {
+  // The diffs are brought to the device here, so that the other threads only
+  // read their device pointers.
+  vector<shared_ptr<Blob<Dtype> > >& blobs = net->layers()[layer_id]->blobs();
+  for (int i = 0; i < blobs.size(); ++i) {
+    blobs[i]->mutable_gpu_diff();
+  }
+  CUDA_CHECK(cudaEventRecord(layer_ready_events[layer_id], 0));
+  ready_layers.push(layer_id);
+}
+
+template <typename Dtype>
+void* P2PSync<Dtype>::ReplicaThread(void* replica_pointer) {
+  Replica* replica = static_cast<Replica*>(replica_pointer);
+  P2PSync<Dtype>* sync = replica->sync;
+  // The settings of the solver, on the device of the replica
+  Caffe::set_thread_settings(DeviceSettings(sync->settings_,
+      replica->device));
+  if (sync->random_seed_ >= 0) {
+    Caffe::set_random_seed(sync->random_seed_ + replica->id);
+  }
+  NetParameter net_param = sync->net_param_;
+  SetShard(replica->id, sync->replicas_.size(), &net_param);
+  replica->owned_net.reset(new Net<Dtype>(net_param));
+  replica->net = replica->owned_net.get();
+  if (sync->replicas_[0]->net->params_data()) {
+    replica->net->PackParams();
+  }
+  sync->StartReducer(replica);
+  sync->replicas_built_.push(replica->id);
+  while (replica->iterations.pop()) {
+    sync->RunIteration(replica);
+  }
+  for (int i = 0; i < replica->children.size(); ++i) {
+    sync->replicas_[replica->children[i]]->iterations.push(0);
+  }
+  sync->StopReducer(replica);
+  return static_cast<void*>(NULL);
+}
+
+template <typename Dtype>
+void P2PSync<Dtype>::StartReducer(Replica* replica) {
+  if (replica->children.size() > 0) {
+    replica->child_diff.reset(
+        new SyncedMemory(max_param_count_ * sizeof(Dtype)));
+    replica->child_diff->mutable_gpu_data();
+  }
+  const int num_layers = replica->net->layers().size();
+  replica->layer_ready_events.resize(num_layers);
+  for (int i = 0; i < num_layers; ++i) {
+    CUDA_CHECK(cudaEventCreateWithFlags(&replica->layer_ready_events[i],
+        cudaEventDisableTiming));
+  }
+  CUDA_CHECK(cudaStreamCreateWithFlags(&replica->reducer_stream,
+      cudaStreamNonBlocking));
+  replica->net->set_backward_callback(replica);
+  CHECK(!pthread_create(&replica->reducer_thread, NULL, ReducerThread,
+        static_cast<void*>(replica))) << "Pthread execution failed.";
+}
+
+template <typename Dtype>
+void P2PSync<Dtype>::StopReducer(Replica* replica) {
+  replica->ready_layers.push(-1);
+  CHECK(!pthread_join(replica->reducer_thread, NULL))
+      << "Pthread joining failed.";
+  replica->net->set_backward_callback(NULL);
+  for (int i = 0; i < replica->layer_ready_events.size(); ++i) {
+    CUDA_CHECK(cudaEventDestroy(replica->layer_ready_events[i]));
+  }
+  CUDA_CHECK(cudaStreamDestroy(replica->reducer_stream));
+}
+
+template <typename Dtype>
+void* P2PSync<Dtype>::ReducerThread(void* replica_pointer) {
+  Replica* replica = static_cast<Replica*>(replica_pointer);
+  P2PSync<Dtype>* sync = replica->sync;
+  Caffe::set_thread_settings(DeviceSettings(sync->settings_,
+      replica->device));
+  // The sums of this thread go to its stream.
+  CUBLAS_CHECK(cublasSetStream(Caffe::cublas_handle(),
+      replica->reducer_stream));
+  while (true) {
+    const int layer_id = replica->ready_layers.pop();
+    if (layer_id < 0) {
+      break;
+    }
+    sync->ReduceLayer(replica, layer_id);
+    if (layer_id == sync->last_backward_layer_) {
+      replica->reducer_done.push(1);
+    }
+  }
+  return static_cast<void*>(NULL);
+}
+
+template <typename Dtype>
+void P2PSync<Dtype>::ReduceLayer(Replica* replica, const int layer_id) {
+  vector<shared_ptr<Blob<Dtype> > >& blobs =
+      replica->net->layers()[layer_id]->blobs();
+  // After the backward pass of the layer on this device
+  CUDA_CHECK(cudaStreamWaitEvent(replica->reducer_stream,
+      replica->layer_ready_events[layer_id], 0));
+  // The children are summed in order, for the same sums in every run.
+  Dtype* child_diff = reinterpret_cast<Dtype*>(
+      replica->child_diff ? replica->child_diff->mutable_gpu_data() : NULL);
+  for (int i = 0; i < replica->children.size(); ++i) {
+    Replica* child = replicas_[replica->children[i]].get();
+    CHECK_EQ(child->summed_layers.pop(), layer_id);
+    vector<shared_ptr<Blob<Dtype> > >& child_blobs =
+        child->net->layers()[layer_id]->blobs();
+    for (int j = 0; j < blobs.size(); ++j) {
+      CUDA_CHECK(cudaMemcpyPeerAsync(child_diff, replica->device,
+          child_blobs[j]->gpu_diff(), child->device,
+          blobs[j]->count() * sizeof(Dtype), replica->reducer_stream));
+      caffe_gpu_axpy(blobs[j]->count(), Dtype(1), child_diff,
+          blobs[j]->mutable_gpu_diff());
+    }
+    if (layer_id == last_backward_layer_) {
+      replica->loss += child->loss;
+    }
+  }
+  CUDA_CHECK(cudaStreamSynchronize(replica->reducer_stream));
+  if (replica->parent >= 0) {
+    replica->summed_layers.push(layer_id);
+  }
+}
+
+template <typename Dtype>
+void P2PSync<Dtype>::RunIteration(Replica* replica) {
+  vector<shared_ptr<Blob<Dtype> > >& params = replica->net->params();
+  if (replica->parent >= 0) {
+    const Replica* parent = replicas_[replica->parent].get();
+    if (replica->net->params_data()) {
+      // All of them in one copy, see Net::PackParams
+      CUDA_CHECK(cudaMemcpyPeer(
+          replica->net->params_data()->mutable_gpu_data(), replica->device,
+          parent->net->params_data()->gpu_data(), parent->device,
+          replica->net->params_count() * sizeof(Dtype)));
+    } else {
+      for (int i = 0; i < params.size(); ++i) {
+        CUDA_CHECK(cudaMemcpyPeer(params[i]->mutable_gpu_data(),
+            replica->device, parent->net->params()[i]->gpu_data(),
+            parent->device, params[i]->count() * sizeof(Dtype)));
+      }
+    }
+  }
+  // The children copy the weights while this one runs. The weights are
+  // brought to the device here, so that their threads only read the device
+  // pointers.
+  for (int i = 0; i < params.size(); ++i) {
+    params[i]->gpu_data();
+  }
+  CUDA_CHECK(cudaDeviceSynchronize());
+  for (int i = 0; i < replica->children.size(); ++i) {
+    replicas_[replica->children[i]]->iterations.push(1);
+  }
+  // The reducer sums the gradients as the backward pass goes, and adds the
+  // loss of the children to this one after the last layer.
+  Dtype loss;
+  replica->net->Forward(vector<Blob<Dtype>*>(), &loss);
+  replica->loss = loss;
+  replica->net->Backward();
+  replica->reducer_done.pop();
+}
+
+template <typename Dtype>
+Dtype P2PSync<Dtype>::ForwardBackward() {
+  Replica* root = replicas_[0].get();
+  RunIteration(root);
+  const Dtype scale = Dtype(1) / replicas_.size();
+  vector<shared_ptr<Blob<Dtype> > >& params = root->net->params();
+  for (int i = 0; i < params.size(); ++i) {
+    caffe_gpu_scal(params[i]->count(), scale, params[i]->mutable_gpu_diff());
+  }
+  return root->loss * scale;
+}
+
+template <typename Dtype>
+void P2PSync<Dtype>::SetShard(const int shard_id, const int num_shards,
+    NetParameter* net_param) {
+  for (int i = 0; i < net_param->layers_size(); ++i) {
+    LayerParameter* layer_param = net_param->mutable_layers(i);
+    switch (layer_param->type()) {
+    case LayerParameter_LayerType_DATA: {
+      // A shard of a shard of n is every n-th datum of the shard.
+      DataParameter* data_param = layer_param->mutable_data_param();
+      data_param->set_shard_id(data_param->shard_id() +
+          data_param->num_shards() * shard_id);
+      data_param->set_num_shards(data_param->num_shards() * num_shards);
+      break;
+    }
+    case LayerParameter_LayerType_HDF5_DATA:
+    case LayerParameter_LayerType_IMAGE_DATA:
+    case LayerParameter_LayerType_MEMORY_DATA:
+    case LayerParameter_LayerType_WINDOW_DATA:
+      if (shard_id == 0) {
+        LOG(ERROR) << "The layer " << layer_param->name() << " cannot be "
+            << "sharded: every replica reads the same data from it.";
+      }
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+INSTANTIATE_CLASS(P2PSync);
+
+template <typename Dtype>
+Pipeline<Dtype>::Pipeline(Net<Dtype>* net, const NetParameter& net_param,
+    const vector<int>& devices, const vector<string>& stage_layers,
+    const int num_micro_batches)
+    : settings_(Caffe::thread_settings()) {
+  CHECK_GT(devices.size(), 1) << "Pipeline parallel training needs 2 devices.";
+  CHECK(Caffe::mode() == Caffe::GPU)
+      << "Pipeline parallel training runs on GPUs.";
+  CHECK_EQ(settings_.device, devices[0])
+      << "The net must be on the first device.";
+  CHECK_GE(num_micro_batches, 1);
+  CHECK(!net->params_data())
+      << "The parameters are kept by their stages: they cannot be packed.";
+  CHECK(!net->profiling()) << "The stages cannot share the profiles.";
+  const int num_stages = devices.size();
+  const int num_layers = net->layers().size();
+  if (stage_layers.size()) {
+    CHECK_EQ(stage_layers.size(), num_stages - 1)
+        << "The first layer of each stage after the first is needed.";
+    stage_starts_.push_back(0);
+    for (int i = 0; i < stage_layers.size(); ++i) {
+      int layer_id = 0;
+      while (layer_id < num_layers &&
+          net->layer_names()[layer_id] != stage_layers[i]) {
+        ++layer_id;
+      }
+      CHECK_LT(layer_id, num_layers) << "Unknown layer " << stage_layers[i];
+      CHECK_GT(layer_id, stage_starts_.back())
+          << "The stages are not in the order of the layers.";
+      stage_starts_.push_back(layer_id);
+    }
+  } else {
+    CHECK_GE(num_layers, num_stages) << "Fewer layers than stages.";
+    BalanceStages(net, num_stages);
+  }
+  // The replicas of the other micro batches add their gradients to those
+  // of net, which overwrites them.
+  nets_.push_back(net);
+  net->set_accumulate_param_diffs(false);
+  for (int i = 1; i < num_micro_batches; ++i) {
+    NetParameter replica_param = net_param;
+    P2PSync<Dtype>::SetShard(i, num_micro_batches, &replica_param);
+    shared_ptr<Net<Dtype> > replica(new Net<Dtype>(replica_param));
+    CHECK_EQ(replica->params().size(), net->params().size());
+    for (int j = 0; j < net->params().size(); ++j) {
+      replica->params()[j]->ShareData(*net->params()[j]);
+      replica->params()[j]->ShareDiff(*net->params()[j]);
+    }
+    replica->set_accumulate_param_diffs(true);
+    owned_nets_.push_back(replica);
+    nets_.push_back(replica.get());
+  }
+  for (int i = 0; i < num_stages; ++i) {
+    shared_ptr<Stage> stage(new Stage());
+    stage->pipeline = this;
+    stage->id = i;
+    stage->device = devices[i];
+    stage->start = stage_starts_[i];
+    stage->end = i + 1 < num_stages ? stage_starts_[i + 1] - 1 :
+        num_layers - 1;
+    stage->loss = 0;
+    for (int j = 0; j < nets_.size(); ++j) {
+      for (int k = stage->start; k <= stage->end; ++k) {
+        nets_[j]->layers()[k]->set_device_id(stage->device);
+      }
+    }
+    LOG(INFO) << "Stage " << i << " on GPU " << stage->device << ": "
+        << net->layer_names()[stage->start] << " to "
+        << net->layer_names()[stage->end];
+    stages_.push_back(stage);
+  }
+  // A stage may read the blobs of any earlier one, e.g. through a split.
+  for (int i = 0; i < num_stages; ++i) {
+    for (int j = 0; j < num_stages; ++j) {
+      if (devices[i] != devices[j]) {
+        Caffe::EnablePeerAccess(devices[i], devices[j]);
+      }
+    }
+  }
+  for (int i = 0; i < num_stages; ++i) {
+    CHECK(!pthread_create(&stages_[i]->thread, NULL, StageThread,
+          static_cast<void*>(stages_[i].get())))
+        << "Pthread execution failed.";
+  }
+  for (int i = 0; i < num_stages; ++i) {
+    stages_done_.pop();
+  }
+  LOG(INFO) << "Training pipeline parallel on " << num_stages << " GPUs, "
+      << num_micro_batches << " micro batches per iteration.";
+}
+
+template <typename Dtype>
+Pipeline<Dtype>::~Pipeline() {
+  for (int i = 0; i < stages_.size(); ++i) {
+    stages_[i]->iterations.push(0);
+  }
+  for (int i = 0; i < stages_.size(); ++i) {
+    CHECK(!pthread_join(stages_[i]->thread, NULL))
+        << "Pthread joining failed.";
+  }
+}
+
+template <typename Dtype>
+void Pipeline<Dtype>::BalanceStages(Net<Dtype>* net, const int num_stages) {
+  // The estimates of the operations of the layers the profiles start with
+  net->ResetProfiles();
+  const vector<typename Net<Dtype>::LayerProfile>& profiles =
+      net->layer_profiles();
+  const int num_layers = profiles.size();
+  double total = 0;
+  for (int i = 0; i < num_layers; ++i) {
+    total += profiles[i].forward_flops + profiles[i].backward_flops;
+  }
+  // A stage starts at the layer before which the earlier ones have their
+  // share of the operations, or as late as every stage still gets a layer.
+  stage_starts_.assign(1, 0);
+  double sum = 0;
+  for (int i = 0; i < num_layers; ++i) {
+    const int num_started = stage_starts_.size();
+    if (num_started < num_stages && i > stage_starts_.back() &&
+        (sum >= total * num_started / num_stages ||
+         num_layers - i == num_stages - num_started)) {
+      stage_starts_.push_back(i);
+    }
+    sum += profiles[i].forward_flops + profiles[i].backward_flops;
+  }
+}
+
+template <typename Dtype>
+void* Pipeline<Dtype>::StageThread(void* stage_pointer) {
+  Stage* stage = static_cast<Stage*>(stage_pointer);
+  Pipeline<Dtype>* pipeline = stage->pipeline;
+  Caffe::set_thread_settings(DeviceSettings(pipeline->settings_,
+      stage->device));
+  // The parameters of the layers of the stage are kept on its device.
+  Net<Dtype>* net = pipeline->nets_[0];
+  for (int i = stage->start; i <= stage->end; ++i) {
+    vector<shared_ptr<Blob<Dtype> > >& blobs = net->layers()[i]->blobs();
+    for (int j = 0; j < blobs.size(); ++j) {
+      blobs[j]->gpu_data();
+      blobs[j]->mutable_gpu_diff();
+    }
+  }
+  CUDA_CHECK(cudaDeviceSynchronize());
+  pipeline->stages_done_.push(stage->id);
+  while (stage->iterations.pop()) {
+    pipeline->RunIteration(stage);
+    pipeline->stages_done_.push(stage->id);
+  }
+  return static_cast<void*>(NULL);
+}
+
+template <typename Dtype>
+void Pipeline<Dtype>::RunIteration(Stage* stage) {
+  const int num_micro_batches = nets_.size();
+  const int last_stage = stages_.size() - 1;
+  stage->loss = 0;
+  for (int i = 0; i < num_micro_batches; ++i) {
+    if (stage->id > 0) {
+      CHECK_EQ(stage->forward_ready.pop(), i);
+    }
+    stage->loss += nets_[i]->ForwardFromTo(stage->start, stage->end);
+    // The next stage reads the tops of this one.
+    CUDA_CHECK(cudaDeviceSynchronize());
+    if (stage->id < last_stage) {
+      stages_[stage->id + 1]->forward_ready.push(i);
+    }
+  }
+  for (int i = 0; i < num_micro_batches; ++i) {
+    if (stage->id < last_stage) {
+      CHECK_EQ(stage->backward_ready.pop(), i);
+    }
+    nets_[i]->BackwardFromTo(stage->end, stage->start);
+    CUDA_CHECK(cudaDeviceSynchronize());
+    if (stage->id > 0) {
+      stages_[stage->id - 1]->backward_ready.push(i);
+    }
+  }
+  // The mean of the gradients of the micro batches
+  const Dtype scale = Dtype(1) / num_micro_batches;
+  for (int i = stage->start; i <= stage->end; ++i) {
+    vector<shared_ptr<Blob<Dtype> > >& blobs = nets_[0]->layers()[i]->blobs();
+    for (int j = 0; j < blobs.size(); ++j) {
+      caffe_gpu_scal(blobs[j]->count(), scale, blobs[j]->mutable_gpu_diff());
+    }
+  }
+  CUDA_CHECK(cudaDeviceSynchronize());
+}
+
+template <typename Dtype>
+Dtype Pipeline<Dtype>::ForwardBackward() {
+  for (int i = 0; i < stages_.size(); ++i) {
+    stages_[i]->iterations.push(1);
+  }
+  for (int i = 0; i < stages_.size(); ++i) {
+    stages_done_.pop();
+  }
+  Dtype loss = 0;
+  for (int i = 0; i < stages_.size(); ++i) {
+    loss += stages_[i]->loss;
+  }
+  return loss / nets_.size();
+}
+
+INSTANTIATE_CLASS(Pipeline);
+
+template <typename Dtype>
+Hogwild<Dtype>::Hogwild(Net<Dtype>* net, const NetParameter& net_param,
+    const int num_threads, const int64_t random_seed,
+    UpdateFunction update, void* update_context)
+    : net_(net), net_param_(net_param), random_seed_(random_seed),
+      update_(update), update_context_(update_context),
+      settings_(Caffe::thread_settings()) {
+  CHECK_GT(num_threads, 1) << "Hogwild training needs 2 threads.";
+  CHECK(Caffe::mode() == Caffe::CPU) << "Hogwild training runs on the CPU.";
+  CHECK(update_);
+  for (int i = 1; i < num_threads; ++i) {
+    shared_ptr<Replica> replica(new Replica());
+    replica->hogwild = this;
+    replica->id = i;
+    replica->loss = 0;
+    replicas_.push_back(replica);
+  }
+  for (int i = 0; i < replicas_.size(); ++i) {
+    CHECK(!pthread_create(&replicas_[i]->thread, NULL, ReplicaThread,
+          static_cast<void*>(replicas_[i].get())))
+        << "Pthread execution failed.";
+  }
+  for (int i = 0; i < replicas_.size(); ++i) {
+    replicas_built_.pop();
+  }
+  LOG(INFO) << "Training Hogwild style on " << num_threads << " threads.";
+}
+
+template <typename Dtype>
+Hogwild<Dtype>::~Hogwild() {
+  for (int i = 0; i < replicas_.size(); ++i) {
+    replicas_[i]->iterations.push(0);
+  }
+  for (int i = 0; i < replicas_.size(); ++i) {
+    CHECK(!pthread_join(replicas_[i]->thread, NULL))
+        << "Pthread joining failed.";
+  }
+}
+
+template <typename Dtype>
+void* Hogwild<Dtype>::ReplicaThread(void* replica_pointer) {
+  Replica* replica = static_cast<Replica*>(replica_pointer);
+  Hogwild<Dtype>* hogwild = replica->hogwild;
+  // The phase, mode and random numbers of the thread are its own.
+  Caffe::set_thread_settings(hogwild->settings_);
+  if (hogwild->random_seed_ >= 0) {
+    Caffe::set_random_seed(hogwild->random_seed_ + replica->id);
+  }
+  NetParameter net_param = hogwild->net_param_;
+  P2PSync<Dtype>::SetShard(replica->id, hogwild->replicas_.size() + 1,
+      &net_param);
+  replica->net.reset(new Net<Dtype>(net_param));
+  // Only the weights are shared: the activations and the gradients of each
+  // replica are its own.
+  const vector<shared_ptr<Blob<Dtype> > >& params = hogwild->net_->params();
+  CHECK_EQ(replica->net->params().size(), params.size());
+  for (int i = 0; i < params.size(); ++i) {
+    replica->net->params()[i]->ShareData(*params[i]);
+  }
+  hogwild->replicas_built_.push(replica->id);
+  vector<Blob<Dtype>*> bottom_vec;
+  while (replica->iterations.pop()) {
+    replica->loss = replica->net->ForwardBackward(bottom_vec);
+    hogwild->update_(hogwild->update_context_, replica->net.get());
+    hogwild->replicas_done_.push(replica->id);
+  }
+  return static_cast<void*>(NULL);
+}
+
+template <typename Dtype>
+Dtype Hogwild<Dtype>::ForwardBackward() {
+  for (int i = 0; i < replicas_.size(); ++i) {
+    replicas_[i]->iterations.push(1);
+  }
+  vector<Blob<Dtype>*> bottom_vec;
+  Dtype loss = net_->ForwardBackward(bottom_vec);
+  for (int i = 0; i < replicas_.size(); ++i) {
+    replicas_done_.pop();
+  }
+  // The queue orders the losses of the replicas before they are read.
+  for (int i = 0; i < replicas_.size(); ++i) {
+    loss += replicas_[i]->loss;
+  }
+  return loss / (replicas_.size() + 1);
+}
+
+INSTANTIATE_CLASS(Hogwild);
+
+}  // namespace caffe
@@ -0,0 +1,429 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <pthread.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "caffe/serving.hpp"
+
+namespace caffe {
+
+using boost::posix_time::microsec_clock;
+using boost::posix_time::ptime;
+
+static double MilliSecondsSince(const ptime& start) {
+  return (microsec_clock::local_time() - start).total_microseconds() / 1000.;
+}
+
+// Waits on condition for wait_ms at most, or until signaled if negative.
+static void WaitFor(pthread_cond_t* condition, pthread_mutex_t* mutex,
+    const double wait_ms) {
+  if (wait_ms < 0) {
+    pthread_cond_wait(condition, mutex);
+    return;
+  }
+  timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  const int64_t nanoseconds = deadline.tv_nsec
+      + static_cast<int64_t>(wait_ms * 1000000.);
+  deadline.tv_sec += nanoseconds / 1000000000;
+  deadline.tv_nsec = nanoseconds % 1000000000;
+  pthread_cond_timedwait(condition, mutex, &deadline);
+}
+
+double ServingStats::LatencyPercentile(const double p) const {
+  int64_t served = 0;
+  for (int i = 0; i < kLatencyBuckets; ++i) {
+    served += latency_histogram[i];
+    if (served > 0 && served >= p * requests) {
+      return std::pow(2., i);
+    }
+  }
+  return 0.;
+}
+
+void ServingStats::AddBatch(const vector<ServingRequest*>& batch,
+    const int batch_size, const float max_latency_ms) {
+  requests += batch.size();
+  ++batches;
+  batch_items += batch_size;
+  for (int i = 0; i < batch.size(); ++i) {
+    const double latency_ms = MilliSecondsSince(batch[i]->queued);
+    int bucket = 0;
+    while (bucket < kLatencyBuckets - 1 &&
+           latency_ms >= std::pow(2., bucket)) {
+      ++bucket;
+    }
+    ++latency_histogram[bucket];
+    if (latency_ms > max_latency_ms) {
+      ++late_requests;
+    }
+  }
+}
+
+// Logs the throughput, the batch fill and percentiles of the latency of
+// stats, each line after prefix.
+static void LogServingStats(const ServingStats& stats,
+    const string& prefix) {
+  if (!stats.batches) {
+    LOG(INFO) << prefix << "No requests served.";
+    return;
+  }
+  LOG(INFO) << prefix << "Served " << stats.requests << " requests in "
+      << stats.batches << " batches, "
+      << stats.requests * 1000. / stats.elapsed_ms << " per second; "
+      << "batches " << 100. * stats.requests / stats.batch_items
+      << "% full on average.";
+  LOG(INFO) << prefix << "Latency: 50% under "
+      << stats.LatencyPercentile(0.5) << " ms, 90% under "
+      << stats.LatencyPercentile(0.9) << " ms, 99% under "
+      << stats.LatencyPercentile(0.99) << " ms; "
+      << stats.late_requests << " requests late.";
+}
+
+ServedNet::ServedNet(const shared_ptr<Net<float> >& net) : net_(net) {
+  CHECK(net_->layers().size());
+  data_layer_ =
+      dynamic_cast<MemoryDataLayer<float>*>(net_->layers()[0].get());
+  CHECK(data_layer_) << "A served net must start with a MemoryDataLayer.";
+  batch_size_ = data_layer_->batch_size();
+  image_size_ = data_layer_->datum_channels() * data_layer_->datum_height()
+      * data_layer_->datum_width();
+  output_size_ = 0;
+  for (int i = 0; i < net_->num_outputs(); ++i) {
+    const Blob<float>* blob = net_->output_blobs()[i];
+    CHECK_EQ(blob->num(), batch_size_)
+        << "Each output of a served net must hold one item per image.";
+    output_size_ += blob->count() / blob->num();
+  }
+  batch_data_.resize(batch_size_ * image_size_);
+  batch_labels_.resize(batch_size_);
+}
+
+void ServedNet::Run(const vector<ServingRequest*>& batch) {
+  CHECK_LE(batch.size(), batch_size_);
+  for (int i = 0; i < batch.size(); ++i) {
+    memcpy(&batch_data_[i * image_size_], batch[i]->image,
+        sizeof(float) * image_size_);
+  }
+  std::fill(batch_data_.begin() + batch.size() * image_size_,
+      batch_data_.end(), 0.f);
+  data_layer_->Reset(&batch_data_[0], &batch_labels_[0], batch_size_);
+  const vector<Blob<float>*>& output_blobs = net_->ForwardPrefilled();
+  for (int i = 0; i < batch.size(); ++i) {
+    batch[i]->outputs->resize(output_size_);
+    float* outputs = &(*batch[i]->outputs)[0];
+    for (int j = 0; j < output_blobs.size(); ++j) {
+      const int item_size = output_blobs[j]->count() / output_blobs[j]->num();
+      memcpy(outputs, output_blobs[j]->cpu_data() + i * item_size,
+          sizeof(float) * item_size);
+      outputs += item_size;
+    }
+  }
+}
+
+BatchingServer::BatchingServer(const shared_ptr<Net<float> >& net,
+    const float max_latency_ms)
+    : served_net_(net), max_latency_ms_(max_latency_ms),
+      settings_(Caffe::thread_settings()), stopping_(false) {
+  CHECK_GE(max_latency_ms_, 0);
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&condition_, NULL);
+  stats_start_ = microsec_clock::local_time();
+  CHECK(!pthread_create(&thread_, NULL, ServerThread,
+        static_cast<void*>(this))) << "Pthread execution failed.";
+}
+
+BatchingServer::~BatchingServer() {
+  // The requests still pending are served before the thread stops.
+  pthread_mutex_lock(&mutex_);
+  stopping_ = true;
+  pthread_cond_signal(&condition_);
+  pthread_mutex_unlock(&mutex_);
+  CHECK(!pthread_join(thread_, NULL)) << "Pthread joining failed.";
+  pthread_cond_destroy(&condition_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void BatchingServer::Serve(const float* image, vector<float>* outputs) {
+  CHECK(image);
+  CHECK(outputs);
+  ServingRequest request;
+  request.image = image;
+  request.outputs = outputs;
+  request.queued = microsec_clock::local_time();
+  pthread_mutex_lock(&mutex_);
+  CHECK(!stopping_) << "The server is stopping.";
+  pending_.push_back(&request);
+  pthread_cond_signal(&condition_);
+  pthread_mutex_unlock(&mutex_);
+  request.served.pop();
+}
+
+void* BatchingServer::ServerThread(void* server_pointer) {
+  BatchingServer* server = static_cast<BatchingServer*>(server_pointer);
+  Caffe::set_thread_settings(server->settings_);
+  vector<ServingRequest*> batch;
+  pthread_mutex_lock(&server->mutex_);
+  while (true) {
+    while (server->pending_.empty() && !server->stopping_) {
+      pthread_cond_wait(&server->condition_, &server->mutex_);
+    }
+    if (server->pending_.empty()) {
+      break;
+    }
+    // Wait for a full batch until max_latency_ms_ after the oldest request,
+    // unless stopping.
+    const int batch_size = server->batch_size();
+    while (static_cast<int>(server->pending_.size()) < batch_size
+           && !server->stopping_) {
+      const double wait_ms = server->max_latency_ms_
+          - MilliSecondsSince(server->pending_.front()->queued);
+      if (wait_ms <= 0) {
+        break;
+      }
+      WaitFor(&server->condition_, &server->mutex_, wait_ms);
+    }
+    batch.clear();
+    while (!server->pending_.empty() &&
+           static_cast<int>(batch.size()) < batch_size) {
+      batch.push_back(server->pending_.front());
+      server->pending_.pop_front();
+    }
+    pthread_mutex_unlock(&server->mutex_);
+    server->RunBatch(batch);
+    pthread_mutex_lock(&server->mutex_);
+  }
+  pthread_mutex_unlock(&server->mutex_);
+  return NULL;
+}
+
+void BatchingServer::RunBatch(const vector<ServingRequest*>& batch) {
+  served_net_.Run(batch);
+  pthread_mutex_lock(&mutex_);
+  stats_.AddBatch(batch, batch_size(), max_latency_ms_);
+  pthread_mutex_unlock(&mutex_);
+  for (int i = 0; i < batch.size(); ++i) {
+    batch[i]->served.push(0);
+  }
+}
+
+ServingStats BatchingServer::stats() {
+  pthread_mutex_lock(&mutex_);
+  ServingStats stats = stats_;
+  stats.elapsed_ms = MilliSecondsSince(stats_start_);
+  pthread_mutex_unlock(&mutex_);
+  return stats;
+}
+
+void BatchingServer::ResetStats() {
+  pthread_mutex_lock(&mutex_);
+  stats_ = ServingStats();
+  stats_start_ = microsec_clock::local_time();
+  pthread_mutex_unlock(&mutex_);
+}
+
+void BatchingServer::LogStats() {
+  LogServingStats(this->stats(), "");
+}
+
+ModelScheduler::ModelScheduler(const int num_workers,
+    const bool release_activations)
+    : release_activations_(release_activations),
+      settings_(Caffe::thread_settings()), num_pending_(0),
+      stopping_(false), threads_(num_workers) {
+  CHECK_GT(num_workers, 0);
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&condition_, NULL);
+  stats_start_ = microsec_clock::local_time();
+  for (int i = 0; i < num_workers; ++i) {
+    CHECK(!pthread_create(&threads_[i], NULL, WorkerThread,
+          static_cast<void*>(this))) << "Pthread execution failed.";
+  }
+}
+
+ModelScheduler::~ModelScheduler() {
+  // The requests still pending are served before the workers stop.
+  pthread_mutex_lock(&mutex_);
+  stopping_ = true;
+  pthread_cond_broadcast(&condition_);
+  pthread_mutex_unlock(&mutex_);
+  for (int i = 0; i < threads_.size(); ++i) {
+    CHECK(!pthread_join(threads_[i], NULL)) << "Pthread joining failed.";
+  }
+  pthread_cond_destroy(&condition_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+int ModelScheduler::AddModel(const string& name,
+    const vector<shared_ptr<Net<float> > >& nets,
+    const ModelOptions& options) {
+  CHECK(nets.size()) << "A model is served by one net at least.";
+  CHECK_GE(options.max_latency_ms, 0);
+  shared_ptr<Model> model(new Model());
+  model->name = name;
+  model->options = options;
+  for (int i = 0; i < nets.size(); ++i) {
+    model->nets.push_back(shared_ptr<ServedNet>(new ServedNet(nets[i])));
+    const ServedNet& net = *model->nets[i];
+    CHECK_EQ(net.batch_size(), model->nets[0]->batch_size());
+    CHECK_EQ(net.image_size(), model->nets[0]->image_size());
+    CHECK_EQ(net.output_size(), model->nets[0]->output_size());
+    model->idle_nets.push_back(model->nets[i].get());
+  }
+  model->run_ms = 0;
+  pthread_mutex_lock(&mutex_);
+  models_.push_back(model);
+  const int id = models_.size() - 1;
+  pthread_mutex_unlock(&mutex_);
+  LOG(INFO) << "Serving model " << id << ", " << name << ", with "
+      << nets.size() << " nets, priority " << options.priority
+      << " and a latency target of " << options.max_latency_ms << " ms";
+  return id;
+}
+
+void ModelScheduler::Serve(const int model, const float* image,
+    vector<float>* outputs) {
+  CHECK(image);
+  CHECK(outputs);
+  ServingRequest request;
+  request.image = image;
+  request.outputs = outputs;
+  request.queued = microsec_clock::local_time();
+  pthread_mutex_lock(&mutex_);
+  CHECK(!stopping_) << "The scheduler is stopping.";
+  CHECK_GE(model, 0);
+  CHECK_LT(model, models_.size());
+  models_[model]->pending.push_back(&request);
+  ++num_pending_;
+  pthread_cond_signal(&condition_);
+  pthread_mutex_unlock(&mutex_);
+  request.served.pop();
+}
+
+ModelScheduler::Model* ModelScheduler::NextModel(double* wait_ms) {
+  Model* next = NULL;
+  double next_due_ms = 0;
+  *wait_ms = -1;
+  for (int i = 0; i < models_.size(); ++i) {
+    Model* model = models_[i].get();
+    if (model->pending.empty() || model->idle_nets.empty()) {
+      continue;
+    }
+    const double due_ms = model->options.max_latency_ms
+        - MilliSecondsSince(model->pending.front()->queued);
+    const double ready_ms = due_ms - model->run_ms;
+    if (ready_ms > 0 && !stopping_ && static_cast<int>(
+        model->pending.size()) < model->nets[0]->batch_size()) {
+      *wait_ms = *wait_ms < 0 ? ready_ms : std::min(*wait_ms, ready_ms);
+      continue;
+    }
+    if (!next || model->options.priority > next->options.priority ||
+        (model->options.priority == next->options.priority &&
+         due_ms < next_due_ms)) {
+      next = model;
+      next_due_ms = due_ms;
+    }
+  }
+  return next;
+}
+
+void* ModelScheduler::WorkerThread(void* scheduler_pointer) {
+  ModelScheduler* scheduler =
+      static_cast<ModelScheduler*>(scheduler_pointer);
+  Caffe::set_thread_settings(scheduler->settings_);
+  vector<ServingRequest*> batch;
+  pthread_mutex_lock(&scheduler->mutex_);
+  while (true) {
+    if (scheduler->stopping_ && !scheduler->num_pending_) {
+      break;
+    }
+    double wait_ms;
+    Model* model = scheduler->NextModel(&wait_ms);
+    if (!model) {
+      WaitFor(&scheduler->condition_, &scheduler->mutex_, wait_ms);
+      continue;
+    }
+    ServedNet* net = model->idle_nets.back();
+    model->idle_nets.pop_back();
+    batch.clear();
+    while (!model->pending.empty() &&
+           static_cast<int>(batch.size()) < net->batch_size()) {
+      batch.push_back(model->pending.front());
+      model->pending.pop_front();
+    }
+    scheduler->num_pending_ -= batch.size();
+    pthread_mutex_unlock(&scheduler->mutex_);
+    const ptime start = microsec_clock::local_time();
+    net->Run(batch);
+    if (scheduler->release_activations_) {
+      net->net()->ReleaseActivations();
+    }
+    const double run_ms = MilliSecondsSince(start);
+    pthread_mutex_lock(&scheduler->mutex_);
+    model->run_ms = model->stats.batches ?
+        0.9 * model->run_ms + 0.1 * run_ms : run_ms;
+    model->stats.AddBatch(batch, net->batch_size(),
+        model->options.max_latency_ms);
+    model->idle_nets.push_back(net);
+    // The model may now have a batch to run by another worker, and the
+    // scheduler be done.
+    pthread_cond_broadcast(&scheduler->condition_);
+    pthread_mutex_unlock(&scheduler->mutex_);
+    for (int i = 0; i < batch.size(); ++i) {
+      batch[i]->served.push(0);
+    }
+    pthread_mutex_lock(&scheduler->mutex_);
+  }
+  pthread_mutex_unlock(&scheduler->mutex_);
+  return NULL;
+}
+
+int ModelScheduler::num_models() {
+  pthread_mutex_lock(&mutex_);
+  const int num_models = models_.size();
+  pthread_mutex_unlock(&mutex_);
+  return num_models;
+}
+
+const ServedNet& ModelScheduler::served_net(const int model) {
+  pthread_mutex_lock(&mutex_);
+  CHECK_LT(model, models_.size());
+  const ServedNet* net = models_[model]->nets[0].get();
+  pthread_mutex_unlock(&mutex_);
+  return *net;
+}
+
+ServingStats ModelScheduler::stats(const int model) {
+  pthread_mutex_lock(&mutex_);
+  CHECK_LT(model, models_.size());
+  ServingStats stats = models_[model]->stats;
+  stats.elapsed_ms = MilliSecondsSince(stats_start_);
+  pthread_mutex_unlock(&mutex_);
+  return stats;
+}
+
+void ModelScheduler::ResetStats() {
+  pthread_mutex_lock(&mutex_);
+  for (int i = 0; i < models_.size(); ++i) {
+    models_[i]->stats = ServingStats();
+  }
+  stats_start_ = microsec_clock::local_time();
+  pthread_mutex_unlock(&mutex_);
+}
+
+void ModelScheduler::LogStats() {
+  for (int i = 0; i < num_models(); ++i) {
+    pthread_mutex_lock(&mutex_);
+    const string name = models_[i]->name;
+    pthread_mutex_unlock(&mutex_);
+    LogServingStats(stats(i), name + ": ");
+  }
+}
+
+}  // namespace caffe
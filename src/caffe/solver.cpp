@@ -3,15 +3,25 @@
 #include <cstdio>
 
 #include <algorithm>
+#include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <vector>
 
+#include "caffe/data_layers.hpp"
+#include "caffe/mpi_sync.hpp"
 #include "caffe/net.hpp"
+#include "caffe/parallel.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/solver.hpp"
+#include "caffe/syncedmem.hpp"
+#include "caffe/util/benchmark.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/memory_pool.hpp"
+#include "caffe/util/numa.hpp"
+#include "caffe/util/upgrade_proto.hpp"
 
+using boost::posix_time::microsec_clock;
 using std::max;
 using std::min;
 
@@ -19,30 +29,100 @@ namespace caffe {
 
 template <typename Dtype>
 Solver<Dtype>::Solver(const SolverParameter& param)
-    : net_(), test_net_() {
+    : net_(), test_net_(), snapshot_thread_started_(false),
+      test_running_(false), test_thread_started_(false) {
   Init(param);
 }
 
 template <typename Dtype>
 Solver<Dtype>::Solver(const string& param_file)
-    : net_(), test_net_() {
+    : net_(), test_net_(), snapshot_thread_started_(false),
+      test_running_(false), test_thread_started_(false) {
   SolverParameter param;
   ReadProtoFromTextFile(param_file, &param);
   Init(param);
 }
 
+template <typename Dtype>
+Solver<Dtype>::~Solver() {
+  FinishTests();
+  FinishSnapshots();
+}
+
 template <typename Dtype>
 void Solver<Dtype>::Init(const SolverParameter& param) {
   param_ = param;
+  // Before the data layers start their threads, which inherit the binding
+  if (param_.numa_binding()) {
+    BindNumaNode();
+  }
+  if (param_.huge_page_threshold_mb() > 0) {
+    MemoryPool::Get().set_huge_page_threshold(
+        static_cast<size_t>(param_.huge_page_threshold_mb()) << 20);
+  }
   if (param_.random_seed() >= 0) {
-    Caffe::set_random_seed(param_.random_seed());
+    Caffe::set_random_seed(RandomSeed());
   }
   // Scaffolding code
   LOG(INFO) << "Creating training net.";
-  net_.reset(new Net<Dtype>(param_.train_net()));
+  if (param_.has_train_net_param()) {
+    train_net_param_ = param_.train_net_param();
+  } else {
+    ReadNetParamsFromTextFileOrDie(param_.train_net(), &train_net_param_);
+  }
+  if (MPISize() > 1) {
+    P2PSync<Dtype>::SetShard(MPIRank(), MPISize(), &train_net_param_);
+  }
+  NetParameter net_param = train_net_param_;
+  if (param_.device_ids_size() > 1) {
+    // The net is replica 0 of the data parallel training.
+    P2PSync<Dtype>::SetShard(0, param_.device_ids_size(), &net_param);
+  }
+  CHECK_GE(param_.hogwild_threads(), 1);
+  if (param_.hogwild_threads() > 1) {
+    CHECK(param_.device_ids_size() <= 1 && MPISize() == 1 &&
+        param_.pipeline_devices_size() <= 1)
+        << "Hogwild training cannot be combined with several devices or "
+        "processes.";
+    CHECK_EQ(param_.iter_size(), 1)
+        << "An iter_size above 1 cannot be combined with hogwild_threads.";
+    // The net is the replica of thread 0.
+    P2PSync<Dtype>::SetShard(0, param_.hogwild_threads(), &net_param);
+  }
+  const bool pipeline = param_.pipeline_devices_size() > 1;
+  if (pipeline) {
+    CHECK(param_.device_ids_size() <= 1 && MPISize() == 1)
+        << "Pipeline parallel training cannot be combined with data "
+        "parallel training.";
+    CHECK_EQ(param_.iter_size(), 1)
+        << "An iter_size above 1 cannot be combined with micro batches.";
+    CHECK(param_.profile_interval() == 0 && param_.telemetry_interval() == 0)
+        << "Pipeline parallel training cannot be profiled.";
+    // The net is the replica of micro batch 0.
+    P2PSync<Dtype>::SetShard(0, param_.num_micro_batches(), &net_param);
+  }
+  CHECK_GE(param_.iter_size(), 1);
+  CHECK(param_.iter_size() == 1 || param_.device_ids_size() <= 1)
+      << "An iter_size above 1 cannot be combined with several device_ids.";
+  net_.reset(new Net<Dtype>(net_param));
+  for (int i = 0; i < net_->params().size(); ++i) {
+    CHECK(param_.device_ids_size() <= 1 || net_->param_device(i) < 0)
+        << "Layers split model parallel cannot be trained data parallel.";
+  }
+  // For the copies of all the weights or gradients at once, unless each
+  // stage of a pipeline keeps its own
+  if (!pipeline) {
+    net_->PackParams();
+  }
   if (param_.has_test_net()) {
     LOG(INFO) << "Creating testing net.";
-    test_net_.reset(new Net<Dtype>(param_.test_net()));
+    // The test net is only run forward, so it needs no diff memory.
+    NetParameter test_net_param;
+    ReadNetParamsFromTextFileOrDie(param_.test_net(), &test_net_param);
+    if (!test_net_param.force_backward()) {
+      test_net_param.set_inference(true);
+    }
+    test_net_.reset(new Net<Dtype>(test_net_param));
     CHECK_GT(param_.test_iter(), 0);
     CHECK_GT(param_.test_interval(), 0);
   }
@@ -54,59 +134,348 @@ template <typename Dtype>
 void Solver<Dtype>::Solve(const char* resume_file) {
   Caffe::set_mode(Caffe::Brew(param_.solver_mode()));
   if (param_.solver_mode() == SolverParameter_SolverMode_GPU &&
+      param_.device_ids_size() > 0) {
+    Caffe::SetDevice(param_.device_ids(0));
+  } else if (param_.solver_mode() == SolverParameter_SolverMode_GPU &&
+      param_.pipeline_devices_size() > 0) {
+    Caffe::SetDevice(param_.pipeline_devices(0));
+  } else if (param_.solver_mode() == SolverParameter_SolverMode_GPU &&
       param_.has_device_id()) {
     Caffe::SetDevice(param_.device_id());
   }
   Caffe::set_phase(Caffe::TRAIN);
+  // The replicas of the net on the other devices, if any
+  shared_ptr<P2PSync<Dtype> > sync;
+  if (param_.device_ids_size() > 1) {
+    const vector<int> device_ids(param_.device_ids().begin(),
+        param_.device_ids().end());
+    sync.reset(new P2PSync<Dtype>(net_.get(), train_net_param_, device_ids,
+        param_.random_seed() >= 0 ? RandomSeed() : -1));
+  }
+  // The stages of the net on several devices, if any
+  shared_ptr<Pipeline<Dtype> > pipeline;
+  if (param_.pipeline_devices_size() > 1) {
+    const vector<int> devices(param_.pipeline_devices().begin(),
+        param_.pipeline_devices().end());
+    const vector<string> stage_layers(param_.pipeline_stage_layer().begin(),
+        param_.pipeline_stage_layer().end());
+    pipeline.reset(new Pipeline<Dtype>(net_.get(), train_net_param_, devices,
+        stage_layers, param_.num_micro_batches()));
+  }
+  // The other processes, if any, and whether this one tests and snapshots
+  shared_ptr<MPISync<Dtype> > mpi_sync;
+  if (MPISize() > 1) {
+    mpi_sync.reset(new MPISync<Dtype>(net_.get(), param_.staleness()));
+    mpi_sync->set_gradient_compression(param_.gradient_compression(),
+        param_.gradient_top_k(), param_.gradient_error_feedback());
+  }
+  const bool root = MPIRank() == 0;
   LOG(INFO) << "Solving " << net_->name();
-  PreSolve();
+  // The modes are in the same order.
+  SyncedMemory::set_trace_mode(
+      static_cast<SyncedMemory::TraceMode>(param_.transfer_trace()));
+  // The memory of the solver, e.g. its history, is accounted as its own.
+  {
+    MemoryScope memory_scope(MemoryTag(MemoryPool::Get().Owner("solver"),
+        MEMORY_SOLVER));
+    PreSolve();
+  }
+  if (param_.profile_interval() && root) {
+    CHECK(param_.has_profile_file()) << "Profiling needs a profile_file.";
+    net_->set_profiling(true);
+  }
+  const bool telemetry = param_.telemetry_interval() && root;
+  if (telemetry) {
+    CHECK(param_.has_telemetry_file()) << "Telemetry needs a telemetry_file.";
+    net_->set_profiling(true);
+  }
 
   iter_ = 0;
   if (resume_file) {
     LOG(INFO) << "Restoring previous solver status from " << resume_file;
     Restore(resume_file);
   }
+  if (mpi_sync) {
+    mpi_sync->BroadcastWeights();
+  }
+  const bool device_loss = param_.device_loss() &&
+      Caffe::mode() == Caffe::GPU && !sync && !pipeline && !mpi_sync &&
+      !param_.hard_examples();
+  if (param_.device_loss() && !device_loss) {
+    LOG(INFO) << "The losses are summed on the host: device_loss needs GPU "
+        "mode on a single device, without hard_examples.";
+  }
+  net_->set_device_loss(device_loss);
+  if (param_.hard_examples()) {
+    CHECK(!sync && !pipeline && param_.hogwild_threads() == 1)
+        << "Hard examples cannot be combined with several devices or "
+        "threads.";
+    net_->set_hard_examples(param_.hard_examples());
+  }
+  // The replicas of the net on the other threads, if any, started once the
+  // weights and the history they update are restored
+  shared_ptr<Hogwild<Dtype> > hogwild;
+  if (param_.hogwild_threads() > 1) {
+    hogwild.reset(new Hogwild<Dtype>(net_.get(), train_net_param_,
+        param_.hogwild_threads(),
+        param_.random_seed() >= 0 ? RandomSeed() : -1,
+        UpdateReplica, static_cast<void*>(this)));
+  }
 
   // Run a test pass before doing any training to avoid waiting a potentially
   // very long time (param_.test_interval() training iterations) to report that
   // there's not enough memory to run the test net and crash, etc.; and to gauge
   // the effect of the first training iterations.
-  if (param_.test_interval()) {
+  if (param_.test_interval() && root) {
     Test();
   }
 
   // For a network that is trained by the solver, no bottom or top vecs
   // should be given, and we will just provide dummy vecs.
   vector<Blob<Dtype>*> bottom_vec;
+  const int iter_size = param_.iter_size();
+  const int start_iter = iter_;
+  // The images of an iteration, over the replicas of the net in this
+  // process, as read by the first data layer of net_
+  int64_t iter_images = 0;
+  shared_ptr<Timer> update_timer;
+  if (telemetry) {
+    for (int i = 0; i < net_->layers().size() && !iter_images; ++i) {
+      if (net_->bottom_vecs()[i].empty() && !net_->top_vecs()[i].empty()) {
+        iter_images = net_->top_vecs()[i][0]->num();
+      }
+    }
+    iter_images *= iter_size * max(param_.device_ids_size(), 1) *
+        param_.hogwild_threads();
+    update_timer.reset(new Timer());
+    telemetry_ = Telemetry();
+    telemetry_profiled_ = PassTimes();
+  }
   while (iter_++ < param_.max_iter()) {
-    Dtype loss = net_->ForwardBackward(bottom_vec);
-    ComputeUpdateValue();
-    net_->Update();
+    Dtype loss = 0;
+    if (device_loss) {
+      net_->ResetDeviceLoss();
+    }
+    // The first batch overwrites the diffs the last update left, the next
+    // ones add to them.
+    for (int i = 0; i < iter_size; ++i) {
+      if (iter_size > 1) {
+        net_->set_accumulate_param_diffs(i > 0);
+      }
+      if (sync) {
+        loss += sync->ForwardBackward();
+      } else if (pipeline) {
+        loss += pipeline->ForwardBackward();
+      } else if (hogwild) {
+        loss += hogwild->ForwardBackward();
+      } else if (net_->hard_examples()) {
+        loss += net_->ForwardBackwardHardExamples();
+      } else {
+        loss += net_->ForwardBackward(bottom_vec);
+      }
+    }
+    if (iter_size > 1) {
+      loss /= iter_size;
+      net_->ScaleParamDiffs(Dtype(1) / iter_size);
+    }
+    if (mpi_sync) {
+      loss = mpi_sync->SyncGradients(loss);
+    }
+    {
+      NvtxRange range("ApplyUpdate");
+      if (update_timer) {
+        update_timer->Start();
+      }
+      ApplyUpdate();
+      if (update_timer) {
+        telemetry_.update_ms += update_timer->MilliSeconds();
+      }
+    }
+    if (mpi_sync) {
+      mpi_sync->SyncWeights(iter_);
+    }
+    if (iter_ == start_iter + 1) {
+      // All the memory of training is allocated by now.
+      MemoryPool::Get().LogUsage();
+    }
+    if (SyncedMemory::trace_mode() != SyncedMemory::TRACE_OFF) {
+      LOG(INFO) << "Iteration " << iter_ << ", host and device copies:";
+      SyncedMemory::LogTransfers();
+      SyncedMemory::ResetTransfers();
+    }
 
     if (param_.display() && iter_ % param_.display() == 0) {
+      // The device loss is only read here, once the update is queued.
+      if (device_loss) {
+        loss += net_->device_loss() / iter_size;
+      }
       LOG(INFO) << "Iteration " << iter_ << ", loss = " << loss;
+      LogDataStats();
     }
-    if (param_.test_interval() && iter_ % param_.test_interval() == 0) {
+    if (telemetry) {
+      ++telemetry_.iters;
+      telemetry_.images += iter_images;
+      if (iter_ % param_.telemetry_interval() == 0) {
+        WriteTelemetry();
+      }
+    }
+    if (param_.test_interval() && iter_ % param_.test_interval() == 0 &&
+        root) {
       Test();
     }
+    if (param_.profile_interval() && iter_ % param_.profile_interval() == 0 &&
+        root) {
+      if (telemetry) {
+        AccumulateTelemetry();
+      }
+      net_->WriteProfiles(param_.profile_file(), iter_);
+      net_->ResetProfiles();
+      telemetry_profiled_ = PassTimes();
+    }
     // Check if we need to do snapshot
-    if (param_.snapshot() && iter_ % param_.snapshot() == 0) {
+    if (param_.snapshot() && iter_ % param_.snapshot() == 0 && root) {
       Snapshot();
     }
   }
   // After the optimization is done, always do a snapshot.
   iter_--;
-  Snapshot();
+  if (root) {
+    Snapshot();
+  }
+  FinishTests();
+  FinishSnapshots();
   LOG(INFO) << "Optimization Done.";
 }
 
 
+template <typename Dtype>
+void Solver<Dtype>::LogDataStats() {
+  const vector<shared_ptr<Layer<Dtype> > >& layers = net_->layers();
+  for (int i = 0; i < layers.size(); ++i) {
+    DataLayer<Dtype>* data_layer =
+        dynamic_cast<DataLayer<Dtype>*>(layers[i].get());
+    if (!data_layer || !data_layer->stats().batches) {
+      continue;
+    }
+    const DataLayerStats& stats = data_layer->stats();
+    const double batches = stats.batches;
+    LOG(INFO) << "Iteration " << iter_ << ", " << net_->layer_names()[i]
+        << ": waited " << stats.wait_ms / batches << " ms per batch, "
+        << "prefetched in " << stats.prefetch_ms / batches << " ms (read "
+        << stats.read_ms / batches << " ms, decoded "
+        << stats.decode_ms / batches << " ms)";
+    data_layer->ResetStats();
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::AccumulateTelemetry() {
+  PassTimes profiled;
+  for (int i = 0; i < net_->layers().size(); ++i) {
+    const typename Net<Dtype>::LayerProfile& profile =
+        net_->layer_profiles()[i];
+    if (net_->bottom_vecs()[i].empty()) {
+      profiled.data_ms += profile.forward_ms + profile.backward_ms;
+    } else {
+      profiled.forward_ms += profile.forward_ms;
+      profiled.backward_ms += profile.backward_ms;
+    }
+  }
+  PassTimes* passes = &telemetry_.passes;
+  passes->data_ms += profiled.data_ms - telemetry_profiled_.data_ms;
+  passes->forward_ms += profiled.forward_ms - telemetry_profiled_.forward_ms;
+  passes->backward_ms +=
+      profiled.backward_ms - telemetry_profiled_.backward_ms;
+  telemetry_profiled_ = profiled;
+}
+
+template <typename Dtype>
+void Solver<Dtype>::WriteTelemetry() {
+  AccumulateTelemetry();
+  const double elapsed_ms =
+      (microsec_clock::local_time() - telemetry_.start).total_microseconds() /
+      1000.;
+  const double iters = telemetry_.iters;
+  size_t host_bytes = 0;
+  size_t device_bytes = 0;
+  for (int c = 0; c < NUM_MEMORY_CATEGORIES; ++c) {
+    const MemoryUsage usage =
+        MemoryPool::Get().category_usage(static_cast<MemoryCategory>(c));
+    host_bytes += usage.host;
+    device_bytes += usage.device;
+  }
+  // Written aside, then renamed over the last one, for a monitor never to
+  // read it half written
+  const string& filename = param_.telemetry_file();
+  const string temp_file = filename + ".tmp";
+  std::ofstream output(temp_file.c_str());
+  const PassTimes& passes = telemetry_.passes;
+  output << "{\"net\": \"" << net_->name() << "\", \"iter\": " << iter_
+      << ", \"iters\": " << telemetry_.iters
+      << ", \"elapsed_ms\": " << elapsed_ms
+      << ", \"iters_per_sec\": " << iters * 1000 / elapsed_ms
+      << ", \"images_per_sec\": " << telemetry_.images * 1000. / elapsed_ms
+      << ", \"data_ms\": " << passes.data_ms / iters
+      << ", \"forward_ms\": " << passes.forward_ms / iters
+      << ", \"backward_ms\": " << passes.backward_ms / iters
+      << ", \"update_ms\": " << telemetry_.update_ms / iters
+      << ", \"host_memory_bytes\": " << host_bytes
+      << ", \"device_memory_bytes\": " << device_bytes
+      << ", \"learning_rate\": " << CurrentLearningRate() << "}\n";
+  output.close();
+  if (!output || rename(temp_file.c_str(), filename.c_str())) {
+    LOG(ERROR) << "Cannot write the telemetry file " << filename;
+    remove(temp_file.c_str());
+  }
+  telemetry_ = Telemetry();
+}
+
+
+template <typename Dtype>
+void Solver<Dtype>::UpdateReplica(void* solver_pointer, Net<Dtype>* net) {
+  static_cast<Solver<Dtype>*>(solver_pointer)->ApplyReplicaUpdate(net);
+}
+
+template <typename Dtype>
+int64_t Solver<Dtype>::RandomSeed() {
+  // Every process, and every device of it, draws its own random numbers.
+  return param_.random_seed() +
+      MPIRank() * max(1, param_.device_ids_size());
+}
+
+template <typename Dtype>
+void Solver<Dtype>::BindNumaNode() {
+  int node = param_.numa_node();
+  if (node < 0 && param_.solver_mode() == SolverParameter_SolverMode_GPU) {
+    const int device = param_.device_ids_size() > 0 ? param_.device_ids(0) :
+        param_.pipeline_devices_size() > 0 ? param_.pipeline_devices(0) :
+        param_.device_id();
+    node = GpuNumaNode(device);
+  }
+  node = max(node, 0);
+  LOG(INFO) << "Binding to NUMA node " << node;
+  BindToNumaNode(node);
+}
+
+
 template <typename Dtype>
 void Solver<Dtype>::Test() {
-  LOG(INFO) << "Iteration " << iter_ << ", Testing net";
+  NvtxRange range("Test");
+  CHECK_NOTNULL(test_net_.get());
+  if (param_.test_async()) {
+    StartTest();
+    return;
+  }
   // We need to set phase to test before running.
   Caffe::set_phase(Caffe::TEST);
-  CHECK_NOTNULL(test_net_.get())->ShareTrainedLayersWith(net_.get());
+  test_net_->ShareTrainedLayersWith(net_.get());
+  RunTest(iter_);
+  Caffe::set_phase(Caffe::TRAIN);
+}
+
+template <typename Dtype>
+void Solver<Dtype>::RunTest(const int iter) {
+  LOG(INFO) << "Iteration " << iter << ", Testing net";
   vector<Dtype> test_score;
   vector<Blob<Dtype>*> bottom_vec;
   Dtype loss = 0;
@@ -142,31 +511,217 @@ void Solver<Dtype>::Test() {
     LOG(INFO) << "Test score #" << i << ": "
         << test_score[i] / param_.test_iter();
   }
-  Caffe::set_phase(Caffe::TRAIN);
+}
+
+template <typename Dtype>
+void Solver<Dtype>::StartTest() {
+  if (!test_thread_started_) {
+    test_sources_.clear();
+    test_targets_.clear();
+    test_target_modes_.clear();
+    for (int i = 0; i < net_->layers().size(); ++i) {
+      const string& layer_name = net_->layer_names()[i];
+      if (!test_net_->has_layer(layer_name)) {
+        continue;
+      }
+      const vector<shared_ptr<Blob<Dtype> > >& sources =
+          net_->layers()[i]->blobs();
+      const vector<shared_ptr<Blob<Dtype> > >& targets =
+          test_net_->layer_by_name(layer_name)->blobs();
+      CHECK_EQ(sources.size(), targets.size())
+          << "Incompatible number of blobs for layer " << layer_name;
+      for (int j = 0; j < sources.size(); ++j) {
+        CHECK_EQ(sources[j]->count(), targets[j]->count())
+            << "Incompatible blob " << j << " for layer " << layer_name;
+        test_sources_.push_back(sources[j]);
+        test_targets_.push_back(targets[j]);
+        test_target_modes_.push_back(
+            test_net_->layer_by_name(layer_name)->mode());
+      }
+    }
+    test_settings_ = Caffe::thread_settings();
+    test_settings_.phase = Caffe::TEST;
+    if (test_settings_.mode == Caffe::GPU && param_.test_device_id() >= 0) {
+      test_settings_.device = param_.test_device_id();
+    }
+    CHECK(!pthread_create(&test_thread_, NULL, TestThread,
+          static_cast<void*>(this))) << "Pthread execution failed.";
+    test_thread_started_ = true;
+  }
+  int tested_iter;
+  if (test_running_ && !finished_tests_.try_pop(&tested_iter)) {
+    LOG(INFO) << "Waiting for the previous test to end.";
+    finished_tests_.pop();
+  }
+  StageBlobs(test_sources_, false, &test_staged_);
+  pending_tests_.push(iter_);
+  test_running_ = true;
+}
+
+template <typename Dtype>
+void* Solver<Dtype>::TestThread(void* solver_pointer) {
+  Solver<Dtype>* solver = static_cast<Solver<Dtype>*>(solver_pointer);
+  Caffe::set_thread_settings(solver->test_settings_);
+  for (int iter = solver->pending_tests_.pop(); iter >= 0;
+       iter = solver->pending_tests_.pop()) {
+    for (int i = 0; i < solver->test_targets_.size(); ++i) {
+      const Blob<Dtype>& staged = *solver->test_staged_[i];
+      Blob<Dtype>* target = solver->test_targets_[i].get();
+      switch (solver->test_target_modes_[i]) {
+      case Caffe::CPU:
+        caffe_copy(target->count(), staged.cpu_data(),
+            target->mutable_cpu_data());
+        break;
+      case Caffe::GPU:
+        CUDA_CHECK(cudaMemcpy(target->mutable_gpu_data(), staged.cpu_data(),
+            target->count() * sizeof(Dtype), cudaMemcpyHostToDevice));
+        break;
+      default:
+        LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
+      }
+    }
+    solver->RunTest(iter);
+    solver->finished_tests_.push(iter);
+  }
+  return static_cast<void*>(NULL);
+}
+
+template <typename Dtype>
+void Solver<Dtype>::FinishTests() {
+  if (!test_thread_started_) {
+    return;
+  }
+  pending_tests_.push(-1);
+  CHECK(!pthread_join(test_thread_, NULL)) << "Pthread joining failed.";
+  int tested_iter;
+  while (finished_tests_.try_pop(&tested_iter)) {}
+  test_running_ = false;
+  test_thread_started_ = false;
 }
 
 
 template <typename Dtype>
 void Solver<Dtype>::Snapshot() {
-  NetParameter net_param;
+  NvtxRange range("Snapshot");
+  if (!snapshot_thread_started_) {
+    free_snapshots_.push(&staged_snapshots_[0]);
+    free_snapshots_.push(&staged_snapshots_[1]);
+    CHECK(!pthread_create(&snapshot_thread_, NULL, SnapshotThread,
+          static_cast<void*>(this))) << "Pthread execution failed.";
+    snapshot_thread_started_ = true;
+  }
+  StagedSnapshot* staged;
+  if (!free_snapshots_.try_pop(&staged)) {
+    LOG(INFO) << "Waiting for a snapshot to be written.";
+    staged = free_snapshots_.pop();
+  }
+  staged->iter = iter_;
+  net_->ToProto(&staged->net_param, false, false);
+  staged->num_layer_blobs.resize(net_->layers().size());
+  for (int i = 0; i < net_->layers().size(); ++i) {
+    staged->num_layer_blobs[i] = net_->layers()[i]->blobs().size();
+  }
   // For intermediate results, we will also dump the gradient values.
-  net_->ToProto(&net_param, param_.snapshot_diff());
+  StageBlobs(net_->params(), param_.snapshot_diff(), &staged->params);
+  StageBlobs(SolverStateBlobs(), false, &staged->state);
+  pending_snapshots_.push(staged);
+}
+
+template <typename Dtype>
+void Solver<Dtype>::StageBlobs(const vector<shared_ptr<Blob<Dtype> > >& blobs,
+    const bool with_diff, vector<shared_ptr<Blob<Dtype> > >* staged) {
+  staged->resize(blobs.size());
+  for (int i = 0; i < blobs.size(); ++i) {
+    const Blob<Dtype>& blob = *blobs[i];
+    shared_ptr<Blob<Dtype> >& copy = (*staged)[i];
+    if (!copy || copy->count() != blob.count()) {
+      // Pinned, for the copy from the device to be fast.
+      copy.reset(new Blob<Dtype>());
+      copy->Reshape(blob.num(), blob.channels(), blob.height(), blob.width());
+      shared_ptr<SyncedMemory> memory(
+          new SyncedMemory(blob.count() * sizeof(Dtype)));
+      memory->set_pinned(true);
+      memory->set_tag(MemoryTag(MemoryPool::Get().Owner("solver"),
+          MEMORY_SOLVER));
+      copy->ShareDataMemory(memory);
+    } else {
+      copy->ReshapeLike(blob);
+    }
+    const size_t size = blob.count() * sizeof(Dtype);
+    // From where the blob is up to date, so that the blobs of the layers
+    // placed on the CPU are never copied to the device (or the other way
+    // around).
+    if (blob.data()->head() == SyncedMemory::HEAD_AT_GPU) {
+      CUDA_CHECK(cudaMemcpy(copy->mutable_cpu_data(), blob.gpu_data(), size,
+          cudaMemcpyDeviceToHost));
+    } else {
+      caffe_copy(blob.count(), blob.cpu_data(), copy->mutable_cpu_data());
+    }
+    if (!with_diff) {
+      continue;
+    }
+    if (blob.diff()->head() == SyncedMemory::HEAD_AT_GPU) {
+      CUDA_CHECK(cudaMemcpy(copy->mutable_cpu_diff(), blob.gpu_diff(), size,
+          cudaMemcpyDeviceToHost));
+    } else {
+      caffe_copy(blob.count(), blob.cpu_diff(), copy->mutable_cpu_diff());
+    }
+  }
+}
+
+template <typename Dtype>
+void* Solver<Dtype>::SnapshotThread(void* solver_pointer) {
+  Solver<Dtype>* solver = static_cast<Solver<Dtype>*>(solver_pointer);
+  while (StagedSnapshot* staged = solver->pending_snapshots_.pop()) {
+    solver->WriteSnapshot(staged);
+    solver->free_snapshots_.push(staged);
+  }
+  return static_cast<void*>(NULL);
+}
+
+template <typename Dtype>
+void Solver<Dtype>::WriteSnapshot(StagedSnapshot* staged) {
+  NetParameter& net_param = staged->net_param;
+  int param_id = 0;
+  for (int i = 0; i < net_param.layers_size(); ++i) {
+    LayerParameter* layer_param = net_param.mutable_layers(i);
+    for (int j = 0; j < staged->num_layer_blobs[i]; ++j) {
+      staged->params[param_id++]->ToProto(layer_param->add_blobs(),
+          param_.snapshot_diff(), param_.snapshot_encoding());
+    }
+  }
+  CHECK_EQ(param_id, staged->params.size());
   string filename(param_.snapshot_prefix());
   const int kBufferSize = 20;
   char iter_str_buffer[kBufferSize];
-  snprintf(iter_str_buffer, kBufferSize, "_iter_%d", iter_);
+  snprintf(iter_str_buffer, kBufferSize, "_iter_%d", staged->iter);
   filename += iter_str_buffer;
   LOG(INFO) << "Snapshotting to " << filename;
   WriteProtoToBinaryFile(net_param, filename.c_str());
   SolverState state;
-  SnapshotSolverState(&state);
-  state.set_iter(iter_);
+  for (int i = 0; i < staged->state.size(); ++i) {
+    staged->state[i]->ToProto(state.add_history(), false,
+        param_.snapshot_encoding());
+  }
+  state.set_iter(staged->iter);
   state.set_learned_net(filename);
   filename += ".solverstate";
   LOG(INFO) << "Snapshotting solver state to " << filename;
   WriteProtoToBinaryFile(state, filename.c_str());
 }
 
+template <typename Dtype>
+void Solver<Dtype>::FinishSnapshots() {
+  if (!snapshot_thread_started_) {
+    return;
+  }
+  pending_snapshots_.push(NULL);
+  CHECK(!pthread_join(snapshot_thread_, NULL)) << "Pthread joining failed.";
+  StagedSnapshot* staged;
+  while (free_snapshots_.try_pop(&staged)) {}
+  snapshot_thread_started_ = false;
+}
+
 template <typename Dtype>
 void Solver<Dtype>::Restore(const char* state_file) {
   SolverState state;
@@ -222,6 +777,10 @@ void SGDSolver<Dtype>::PreSolve() {
     history_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>(
         net_param->num(), net_param->channels(), net_param->height(),
         net_param->width())));
+    if (this->param_.hogwild_threads() > 1) {
+      // Allocated here, rather than by the threads racing to update it
+      history_.back()->mutable_cpu_data();
+    }
   }
 }
 
@@ -287,12 +846,55 @@ void SGDSolver<Dtype>::ComputeUpdateValue() {
 }
 
 template <typename Dtype>
-void SGDSolver<Dtype>::SnapshotSolverState(SolverState* state) {
-  state->clear_history();
-  for (int i = 0; i < history_.size(); ++i) {
-    // Add history
-    BlobProto* history_blob = state->add_history();
-    history_[i]->ToProto(history_blob);
+void SGDSolver<Dtype>::ApplyUpdate() {
+  vector<float>& net_params_lr = this->net_->params_lr();
+  vector<float>& net_params_weight_decay = this->net_->params_weight_decay();
+  Dtype rate = GetLearningRate();
+  if (this->param_.display() && this->iter_ % this->param_.display() == 0) {
+    LOG(INFO) << "Iteration " << this->iter_ << ", lr = " << rate;
+  }
+  Dtype weight_decay = this->param_.weight_decay();
+  for (int param_id = 0; param_id < this->net_->params().size(); ++param_id) {
+    // Where the layer of the parameter runs, and on the device it is kept on
+    ModeScope mode_scope(this->net_->param_mode(param_id));
+    DeviceScope device_scope(this->net_->param_device(param_id));
+    UpdateParam(this->net_->params()[param_id].get(), param_id,
+        rate * net_params_lr[param_id],
+        weight_decay * net_params_weight_decay[param_id]);
+  }
+}
+
+template <typename Dtype>
+void SGDSolver<Dtype>::ApplyReplicaUpdate(Net<Dtype>* net) {
+  // iter_, and so the rate, only change while the replicas are idle.
+  const Dtype rate = GetLearningRate();
+  const Dtype weight_decay = this->param_.weight_decay();
+  vector<float>& net_params_lr = net->params_lr();
+  vector<float>& net_params_weight_decay = net->params_weight_decay();
+  for (int param_id = 0; param_id < net->params().size(); ++param_id) {
+    UpdateParam(net->params()[param_id].get(), param_id,
+        rate * net_params_lr[param_id],
+        weight_decay * net_params_weight_decay[param_id]);
+  }
+}
+
+template <typename Dtype>
+void SGDSolver<Dtype>::UpdateParam(Blob<Dtype>* net_param,
+    const int param_id, const Dtype rate, const Dtype decay) {
+  const Dtype momentum = this->param_.momentum();
+  switch (Caffe::mode()) {
+  case Caffe::CPU:
+    caffe_cpu_sgd_update(net_param->count(), rate, momentum, decay,
+        net_param->cpu_diff(), history_[param_id]->mutable_cpu_data(),
+        net_param->mutable_cpu_data());
+    break;
+  case Caffe::GPU:
+    caffe_gpu_sgd_update(net_param->count(), rate, momentum, decay,
+        net_param->gpu_diff(), history_[param_id]->mutable_gpu_data(),
+        net_param->mutable_gpu_data());
+    break;
+  default:
+    LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
   }
 }
 
@@ -306,7 +908,75 @@ void SGDSolver<Dtype>::RestoreSolverState(const SolverState& state) {
   }
 }
 
+template <typename Dtype>
+void NesterovSolver<Dtype>::UpdateParam(Blob<Dtype>* net_param,
+    const int param_id, const Dtype rate, const Dtype decay) {
+  Blob<Dtype>* history = this->history_[param_id].get();
+  const Dtype momentum = this->param_.momentum();
+  switch (Caffe::mode()) {
+  case Caffe::CPU:
+    caffe_cpu_nesterov_update(net_param->count(), rate, momentum, decay,
+        net_param->cpu_diff(), history->mutable_cpu_data(),
+        net_param->mutable_cpu_data());
+    break;
+  case Caffe::GPU:
+    caffe_gpu_nesterov_update(net_param->count(), rate, momentum, decay,
+        net_param->gpu_diff(), history->mutable_gpu_data(),
+        net_param->mutable_gpu_data());
+    break;
+  default:
+    LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
+  }
+}
+
+template <typename Dtype>
+void AdaGradSolver<Dtype>::CheckNoMomentum() {
+  CHECK_EQ(0, this->param_.momentum())
+      << "Momentum cannot be used with AdaGrad.";
+}
+
+template <typename Dtype>
+void AdaGradSolver<Dtype>::UpdateParam(Blob<Dtype>* net_param,
+    const int param_id, const Dtype rate, const Dtype decay) {
+  Blob<Dtype>* history = this->history_[param_id].get();
+  const Dtype delta = this->param_.delta();
+  switch (Caffe::mode()) {
+  case Caffe::CPU:
+    caffe_cpu_adagrad_update(net_param->count(), rate, delta, decay,
+        net_param->cpu_diff(), history->mutable_cpu_data(),
+        net_param->mutable_cpu_data());
+    break;
+  case Caffe::GPU:
+    caffe_gpu_adagrad_update(net_param->count(), rate, delta, decay,
+        net_param->gpu_diff(), history->mutable_gpu_data(),
+        net_param->mutable_gpu_data());
+    break;
+  default:
+    LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
+  }
+}
+
+template <typename Dtype>
+Solver<Dtype>* GetSolver(const SolverParameter& param) {
+  switch (param.solver_type()) {
+  case SolverParameter_SolverType_SGD:
+    return new SGDSolver<Dtype>(param);
+  case SolverParameter_SolverType_NESTEROV:
+    return new NesterovSolver<Dtype>(param);
+  case SolverParameter_SolverType_ADAGRAD:
+    return new AdaGradSolver<Dtype>(param);
+  default:
+    LOG(FATAL) << "Unknown solver type: " << param.solver_type();
+  }
+  return (Solver<Dtype>*)(NULL);
+}
+
+template Solver<float>* GetSolver(const SolverParameter& param);
+template Solver<double>* GetSolver(const SolverParameter& param);
+
 INSTANTIATE_CLASS(Solver);
 INSTANTIATE_CLASS(SGDSolver);
+INSTANTIATE_CLASS(NesterovSolver);
+INSTANTIATE_CLASS(AdaGradSolver);
 
 }  // namespace caffe
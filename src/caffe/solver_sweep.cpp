@@ -0,0 +1,211 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <pthread.h>
+
+#include <vector>
+
+#include "caffe/mpi_sync.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/solver.hpp"
+#include "caffe/solver_sweep.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+// The batches of each data layer in flight at most, given to the solvers
+// but not yet used by all of them
+static const int kBatchesInFlight = 4;
+
+template <typename Dtype>
+SolverSweep<Dtype>::SolverSweep(const vector<SolverParameter>& params)
+    : params_(params), num_done_(0) {
+  CHECK_GT(params_.size(), 0);
+  CHECK_EQ(MPISize(), 1) << "A sweep runs in one process.";
+  for (int i = 0; i < params_.size(); ++i) {
+    const SolverParameter& param = params_[i];
+    CHECK(param.device_ids_size() <= 1 &&
+        param.pipeline_devices_size() <= 1 && param.hogwild_threads() == 1)
+        << "The solvers of a sweep each train on one device and thread.";
+  }
+  if (params_[0].has_train_net_param()) {
+    train_net_param_ = params_[0].train_net_param();
+  } else {
+    ReadNetParamsFromTextFileOrDie(params_[0].train_net(),
+        &train_net_param_);
+  }
+  data_net_param_.set_name(train_net_param_.name() + "_data");
+  for (int i = 0; i < train_net_param_.layers_size(); ++i) {
+    const LayerParameter& layer_param = train_net_param_.layers(i);
+    if (layer_param.bottom_size() > 0) {
+      continue;
+    }
+    CHECK_EQ(layer_param.top_size(), 2) << "The data layer "
+        << layer_param.name() << " must give data and labels to be shared.";
+    data_layers_.push_back(i);
+    data_net_param_.add_layers()->CopyFrom(layer_param);
+  }
+  CHECK_GT(data_layers_.size(), 0) << train_net_param_.name()
+      << " has no data layers to share.";
+  CHECK(!pthread_mutex_init(&mutex_, NULL)) << "Mutex init failed.";
+}
+
+template <typename Dtype>
+SolverSweep<Dtype>::~SolverSweep() {
+  pthread_mutex_destroy(&mutex_);
+}
+
+template <typename Dtype>
+void SolverSweep<Dtype>::Solve() {
+  settings_ = Caffe::thread_settings();
+  const Caffe::Brew mode = Caffe::mode();
+  const Caffe::Phase phase = Caffe::phase();
+  Caffe::set_mode(Caffe::CPU);
+  Caffe::set_phase(Caffe::TRAIN);
+  {
+    Net<Dtype> data_net(data_net_param_);
+    // The data layers of the solvers, of the shapes of the batches
+    NetParameter net_param = train_net_param_;
+    for (int i = 0; i < data_layers_.size(); ++i) {
+      const LayerParameter& layer_param =
+          train_net_param_.layers(data_layers_[i]);
+      const shared_ptr<Blob<Dtype> > data =
+          data_net.blob_by_name(layer_param.top(0));
+      LayerParameter* memory_param = net_param.mutable_layers(data_layers_[i]);
+      memory_param->Clear();
+      memory_param->set_name(layer_param.name());
+      memory_param->set_type(LayerParameter::MEMORY_DATA);
+      memory_param->add_top(layer_param.top(0));
+      memory_param->add_top(layer_param.top(1));
+      MemoryDataParameter* memory_data_param =
+          memory_param->mutable_memory_data_param();
+      memory_data_param->set_batch_size(data->num());
+      memory_data_param->set_channels(data->channels());
+      memory_data_param->set_height(data->height());
+      memory_data_param->set_width(data->width());
+    }
+    for (int i = 0; i < kBatchesInFlight * data_layers_.size(); ++i) {
+      free_batches_.push(0);
+    }
+    num_done_ = 0;
+    sweeps_.clear();
+    for (int i = 0; i < params_.size(); ++i) {
+      shared_ptr<Sweep> sweep(new Sweep());
+      sweep->solver_sweep = this;
+      sweep->id = i;
+      sweep->param = params_[i];
+      sweep->param.clear_train_net();
+      sweep->param.mutable_train_net_param()->CopyFrom(net_param);
+      for (int j = 0; j < data_layers_.size(); ++j) {
+        sweep->feeds.push_back(shared_ptr<Feed>(new Feed()));
+      }
+      sweep->done = false;
+      sweeps_.push_back(sweep);
+    }
+    LOG(INFO) << "Training " << sweeps_.size() << " solvers of "
+        << net_param.name() << " on the batches of " << data_layers_.size()
+        << " data layers.";
+    for (int i = 0; i < sweeps_.size(); ++i) {
+      CHECK(!pthread_create(&sweeps_[i]->thread, NULL, SolverThread,
+            static_cast<void*>(sweeps_[i].get())))
+          << "Pthread execution failed.";
+    }
+    FeedSolvers(&data_net);
+    for (int i = 0; i < sweeps_.size(); ++i) {
+      CHECK(!pthread_join(sweeps_[i]->thread, NULL))
+          << "Pthread joining failed.";
+    }
+  }
+  // All the batches have been given back.
+  for (int i = 0; i < kBatchesInFlight * data_layers_.size(); ++i) {
+    free_batches_.pop();
+  }
+  Caffe::set_mode(mode);
+  Caffe::set_phase(phase);
+}
+
+template <typename Dtype>
+void* SolverSweep<Dtype>::SolverThread(void* sweep_pointer) {
+  Sweep* sweep = static_cast<Sweep*>(sweep_pointer);
+  SolverSweep<Dtype>* solver_sweep = sweep->solver_sweep;
+  // The settings of the calling thread, in the mode and on the device of
+  // the solver, for its nets to be built there
+  Caffe::ThreadSettings settings = solver_sweep->settings_;
+  settings.mode = Caffe::Brew(sweep->param.solver_mode());
+  settings.phase = Caffe::TRAIN;
+  if (sweep->param.has_device_id()) {
+    settings.device = sweep->param.device_id();
+  }
+  Caffe::set_thread_settings(settings);
+  {
+    shared_ptr<Solver<Dtype> > solver(GetSolver<Dtype>(sweep->param));
+    for (int i = 0; i < solver_sweep->data_layers_.size(); ++i) {
+      const string& name = solver_sweep->train_net_param_.layers(
+          solver_sweep->data_layers_[i]).name();
+      MemoryDataLayer<Dtype>* layer = dynamic_cast<MemoryDataLayer<Dtype>*>(
+          solver->net()->layer_by_name(name).get());
+      CHECK(layer) << "The solver " << sweep->id << " has no layer " << name;
+      layer->set_feed(sweep->feeds[i].get());
+    }
+    solver->Solve();
+    // The solver lets go of its last batches.
+  }
+  pthread_mutex_lock(&solver_sweep->mutex_);
+  sweep->done = true;
+  ++solver_sweep->num_done_;
+  for (int i = 0; i < sweep->feeds.size(); ++i) {
+    shared_ptr<MemoryBatch<Dtype> > batch;
+    while (sweep->feeds[i]->try_pop(&batch)) {
+      batch.reset();
+    }
+  }
+  pthread_mutex_unlock(&solver_sweep->mutex_);
+  LOG(INFO) << "Solver " << sweep->id << " of the sweep is done.";
+  return static_cast<void*>(NULL);
+}
+
+template <typename Dtype>
+void SolverSweep<Dtype>::FeedSolvers(Net<Dtype>* data_net) {
+  const int num_layers = data_layers_.size();
+  vector<Blob<Dtype>*> data(num_layers);
+  vector<Blob<Dtype>*> labels(num_layers);
+  for (int i = 0; i < num_layers; ++i) {
+    const LayerParameter& layer_param = data_net_param_.layers(i);
+    data[i] = data_net->blob_by_name(layer_param.top(0)).get();
+    labels[i] = data_net->blob_by_name(layer_param.top(1)).get();
+  }
+  while (true) {
+    // Waits for room for the batches, which the solvers done give back.
+    for (int i = 0; i < num_layers; ++i) {
+      free_batches_.pop();
+    }
+    pthread_mutex_lock(&mutex_);
+    const bool all_done = num_done_ == sweeps_.size();
+    pthread_mutex_unlock(&mutex_);
+    if (all_done) {
+      for (int i = 0; i < num_layers; ++i) {
+        free_batches_.push(0);
+      }
+      break;
+    }
+    data_net->ForwardPrefilled();
+    for (int i = 0; i < num_layers; ++i) {
+      shared_ptr<MemoryBatch<Dtype> > batch(new MemoryBatch<Dtype>(),
+          BatchDeleter(&free_batches_));
+      batch->data.CopyFrom(*data[i], false, true);
+      batch->labels.CopyFrom(*labels[i], false, true);
+      pthread_mutex_lock(&mutex_);
+      for (int j = 0; j < sweeps_.size(); ++j) {
+        if (!sweeps_[j]->done) {
+          sweeps_[j]->feeds[i]->push(batch);
+        }
+      }
+      pthread_mutex_unlock(&mutex_);
+    }
+  }
+}
+
+INSTANTIATE_CLASS(SolverSweep);
+
+}  // namespace caffe
@@ -1,37 +1,60 @@
 // Copyright 2014 BVLC and contributors.
 
 #include <cuda_runtime.h>
+#include <pthread.h>
+
+#include <boost/thread/tss.hpp>
 
 #include <cstring>
+#include <map>
+#include <string>
 
 #include "caffe/common.hpp"
 #include "caffe/syncedmem.hpp"
+#include "caffe/util/shared_memory.hpp"
 
 namespace caffe {
 
+// The trace mode, and the copies traced since the last reset: in all, and by
+// layer. The prefetch threads copy too, hence the mutex.
+static SyncedMemory::TraceMode current_trace_mode = SyncedMemory::TRACE_OFF;
+static TransferStats traced_transfers;
+static std::map<std::string, TransferStats> traced_layer_transfers;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The layer the calling thread is in the pass of, if any
+struct TraceContext {
+  TraceContext() : layer_name(NULL) {}
+  const std::string* layer_name;
+};
+static boost::thread_specific_ptr<TraceContext> trace_context;
+
 SyncedMemory::~SyncedMemory() {
   if (cpu_ptr_ && own_cpu_data_) {
     CaffeFreeHost(cpu_ptr_);
   }
 
-  if (gpu_ptr_) {
-    CUDA_CHECK(cudaFree(gpu_ptr_));
+  if (gpu_ptr_ && own_gpu_data_) {
+    CaffeFreeDevice(gpu_ptr_);
   }
 }
 
 inline void SyncedMemory::to_cpu() {
   switch (head_) {
   case UNINITIALIZED:
-    CaffeMallocHost(&cpu_ptr_, size_);
+    cpu_pinned_ = CaffeMallocHost(&cpu_ptr_, size_, pinned_, tag_);
     memset(cpu_ptr_, 0, size_);
     head_ = HEAD_AT_CPU;
     own_cpu_data_ = true;
     break;
   case HEAD_AT_GPU:
     if (cpu_ptr_ == NULL) {
-      CaffeMallocHost(&cpu_ptr_, size_);
+      cpu_pinned_ = CaffeMallocHost(&cpu_ptr_, size_, pinned_, tag_);
       own_cpu_data_ = true;
     }
+    if (current_trace_mode != TRACE_OFF) {
+      TraceTransfer(false, size_, Caffe::mode() == Caffe::GPU);
+    }
     CUDA_CHECK(cudaMemcpy(cpu_ptr_, gpu_ptr_, size_, cudaMemcpyDeviceToHost));
     head_ = SYNCED;
     break;
@@ -44,13 +67,19 @@ inline void SyncedMemory::to_cpu() {
 inline void SyncedMemory::to_gpu() {
   switch (head_) {
   case UNINITIALIZED:
-    CUDA_CHECK(cudaMalloc(&gpu_ptr_, size_));
+    CaffeMallocDevice(&gpu_ptr_, size_, tag_);
     CUDA_CHECK(cudaMemset(gpu_ptr_, 0, size_));
     head_ = HEAD_AT_GPU;
+    own_gpu_data_ = true;
     break;
   case HEAD_AT_CPU:
+    // Memory back on a device it was on already went there and back.
+    if (current_trace_mode != TRACE_OFF) {
+      TraceTransfer(true, size_, gpu_ptr_ != NULL);
+    }
     if (gpu_ptr_ == NULL) {
-      CUDA_CHECK(cudaMalloc(&gpu_ptr_, size_));
+      CaffeMallocDevice(&gpu_ptr_, size_, tag_);
+      own_gpu_data_ = true;
     }
     CUDA_CHECK(cudaMemcpy(gpu_ptr_, cpu_ptr_, size_, cudaMemcpyHostToDevice));
     head_ = SYNCED;
@@ -62,37 +91,258 @@ inline void SyncedMemory::to_gpu() {
 }
 
 const void* SyncedMemory::cpu_data() {
+  if (parent_) {
+    return static_cast<const char*>(parent_->cpu_data()) + offset_;
+  }
   to_cpu();
   return (const void*)cpu_ptr_;
 }
 
 void SyncedMemory::set_cpu_data(void* data) {
   CHECK(data);
+  CHECK(!parent_) << "A view cannot be set to other memory.";
   if (own_cpu_data_) {
     CaffeFreeHost(cpu_ptr_);
   }
   cpu_ptr_ = data;
+  cpu_pinned_ = false;
   head_ = HEAD_AT_CPU;
   own_cpu_data_ = false;
+  segment_.reset();
+  // Syncing to gpu data we do not own would overwrite it.
+  if (!own_gpu_data_) {
+    gpu_ptr_ = NULL;
+  }
+}
+
+void SyncedMemory::set_cpu_segment(
+    const shared_ptr<SharedMemorySegment>& segment, const size_t offset) {
+  CHECK(segment);
+  CHECK_LE(offset + size_, segment->size())
+      << "The memory goes beyond the end of " << segment->name();
+  set_cpu_data(static_cast<char*>(segment->data()) + offset);
+  segment_ = segment;
+}
+
+void SyncedMemory::set_tag(const MemoryTag& tag) {
+  tag_ = tag;
+  if (cpu_ptr_ && own_cpu_data_) {
+    MemoryPool::Get().Retag(cpu_ptr_, tag_);
+  }
+  if (gpu_ptr_ && own_gpu_data_) {
+    MemoryPool::Get().Retag(gpu_ptr_, tag_);
+  }
 }
 
 const void* SyncedMemory::gpu_data() {
+  if (parent_) {
+    return static_cast<const char*>(parent_->gpu_data()) + offset_;
+  }
   to_gpu();
   return (const void*)gpu_ptr_;
 }
 
+void SyncedMemory::set_gpu_data(void* data) {
+  CHECK(data);
+  CHECK(!parent_) << "A view cannot be set to other memory.";
+  if (own_gpu_data_) {
+    CaffeFreeDevice(gpu_ptr_);
+  }
+  gpu_ptr_ = data;
+  head_ = HEAD_AT_GPU;
+  own_gpu_data_ = false;
+  // Syncing to cpu data we do not own would overwrite it.
+  if (!own_cpu_data_) {
+    cpu_ptr_ = NULL;
+  }
+}
+
 void* SyncedMemory::mutable_cpu_data() {
+  if (parent_) {
+    return static_cast<char*>(parent_->mutable_cpu_data()) + offset_;
+  }
   to_cpu();
   head_ = HEAD_AT_CPU;
   return cpu_ptr_;
 }
 
 void* SyncedMemory::mutable_gpu_data() {
+  if (parent_) {
+    return static_cast<char*>(parent_->mutable_gpu_data()) + offset_;
+  }
   to_gpu();
   head_ = HEAD_AT_GPU;
   return gpu_ptr_;
 }
 
+void SyncedMemory::async_gpu_push(const cudaStream_t& stream) {
+  if (parent_) {
+    // All of parent goes.
+    parent_->async_gpu_push(stream);
+    return;
+  }
+  CHECK_EQ(head_, HEAD_AT_CPU);
+  if (gpu_ptr_ == NULL) {
+    CaffeMallocDevice(&gpu_ptr_, size_, tag_);
+    own_gpu_data_ = true;
+  }
+  if (current_trace_mode != TRACE_OFF) {
+    TraceTransfer(true, size_, false);
+  }
+  CUDA_CHECK(cudaMemcpyAsync(gpu_ptr_, cpu_ptr_, size_, cudaMemcpyHostToDevice,
+      stream));
+  head_ = SYNCED;
+}
+
+bool SyncedMemory::async_cpu_pull(const cudaStream_t& stream) {
+  if (parent_ || !own_gpu_data_) {
+    return false;
+  }
+  if (head_ == SYNCED && own_cpu_data_) {
+    // The cpu data is current already.
+    return true;
+  }
+  if (head_ != HEAD_AT_GPU) {
+    return false;
+  }
+  if (cpu_ptr_ == NULL) {
+    pinned_ = true;
+    cpu_pinned_ = CaffeMallocHost(&cpu_ptr_, size_, pinned_, tag_);
+    own_cpu_data_ = true;
+  }
+  if (current_trace_mode != TRACE_OFF) {
+    TraceTransfer(false, size_, false);
+  }
+  CUDA_CHECK(cudaMemcpyAsync(cpu_ptr_, gpu_ptr_, size_, cudaMemcpyDeviceToHost,
+      stream));
+  head_ = SYNCED;
+  return true;
+}
 
-}  // namespace caffe
+void SyncedMemory::free_gpu_data() {
+  if (parent_ || head_ != SYNCED || !own_gpu_data_ || !own_cpu_data_) {
+    return;
+  }
+  CaffeFreeDevice(gpu_ptr_);
+  gpu_ptr_ = NULL;
+  own_gpu_data_ = false;
+  head_ = HEAD_AT_CPU;
+}
+
+void SyncedMemory::free_data() {
+  if (parent_ || (cpu_ptr_ && !own_cpu_data_) ||
+      (gpu_ptr_ && !own_gpu_data_)) {
+    return;
+  }
+  if (cpu_ptr_) {
+    CaffeFreeHost(cpu_ptr_);
+    cpu_ptr_ = NULL;
+  }
+  if (gpu_ptr_) {
+    CaffeFreeDevice(gpu_ptr_);
+    gpu_ptr_ = NULL;
+  }
+  own_cpu_data_ = own_gpu_data_ = false;
+  head_ = UNINITIALIZED;
+}
+
+void SyncedMemory::set_trace_mode(const TraceMode mode) {
+  current_trace_mode = mode;
+}
+
+SyncedMemory::TraceMode SyncedMemory::trace_mode() {
+  return current_trace_mode;
+}
+
+TransferStats SyncedMemory::transfers() {
+  pthread_mutex_lock(&trace_mutex);
+  const TransferStats transfers = traced_transfers;
+  pthread_mutex_unlock(&trace_mutex);
+  return transfers;
+}
+
+TransferStats SyncedMemory::layer_transfers(const std::string& layer_name) {
+  TransferStats transfers;
+  pthread_mutex_lock(&trace_mutex);
+  std::map<std::string, TransferStats>::const_iterator it =
+      traced_layer_transfers.find(layer_name);
+  if (it != traced_layer_transfers.end()) {
+    transfers = it->second;
+  }
+  pthread_mutex_unlock(&trace_mutex);
+  return transfers;
+}
 
+void SyncedMemory::ResetTransfers() {
+  pthread_mutex_lock(&trace_mutex);
+  traced_transfers = TransferStats();
+  traced_layer_transfers.clear();
+  pthread_mutex_unlock(&trace_mutex);
+}
+
+void SyncedMemory::LogTransfers() {
+  pthread_mutex_lock(&trace_mutex);
+  const TransferStats transfers = traced_transfers;
+  const std::map<std::string, TransferStats> layer_transfers =
+      traced_layer_transfers;
+  pthread_mutex_unlock(&trace_mutex);
+  LOG(INFO) << "Copies: " << transfers.to_device << " to the device ("
+      << transfers.to_device_bytes << " bytes), " << transfers.to_host
+      << " to the host (" << transfers.to_host_bytes << " bytes)";
+  for (std::map<std::string, TransferStats>::const_iterator it =
+       layer_transfers.begin(); it != layer_transfers.end(); ++it) {
+    LOG(INFO) << "  " << (it->first.empty() ? "outside the layers" :
+        it->first) << ": " << it->second.to_device << " to the device ("
+        << it->second.to_device_bytes << " bytes), " << it->second.to_host
+        << " to the host (" << it->second.to_host_bytes << " bytes)";
+  }
+}
+
+void SyncedMemory::TraceTransfer(const bool to_device, const size_t size,
+    const bool round_trip) {
+  const TraceContext* context = trace_context.get();
+  const std::string* layer_name = context ? context->layer_name : NULL;
+  pthread_mutex_lock(&trace_mutex);
+  TransferStats* stats[] = { &traced_transfers,
+      &traced_layer_transfers[layer_name ? *layer_name : ""] };
+  for (int i = 0; i < 2; ++i) {
+    if (to_device) {
+      ++stats[i]->to_device;
+      stats[i]->to_device_bytes += size;
+    } else {
+      ++stats[i]->to_host;
+      stats[i]->to_host_bytes += size;
+    }
+  }
+  pthread_mutex_unlock(&trace_mutex);
+  const char* direction = to_device ? "to the device" : "to the host";
+  const char* layer = layer_name ? layer_name->c_str() : "no layer";
+  if (current_trace_mode == TRACE_STRICT && round_trip && layer_name &&
+      Caffe::mode() == Caffe::GPU) {
+    LOG(ERROR) << "Unexpected copy " << direction << " of " << size
+        << " bytes in the GPU pass of layer " << layer;
+  } else if (current_trace_mode >= TRACE_LOG) {
+    LOG(INFO) << "Copy " << direction << " of " << size << " bytes ("
+        << layer << ")";
+  }
+}
+
+SyncedMemory::TraceScope::TraceScope(const std::string& layer_name)
+    : previous_layer_name_(NULL), active_(current_trace_mode != TRACE_OFF) {
+  if (!active_) {
+    return;
+  }
+  if (!trace_context.get()) {
+    trace_context.reset(new TraceContext());
+  }
+  previous_layer_name_ = trace_context->layer_name;
+  trace_context->layer_name = &layer_name;
+}
+
+SyncedMemory::TraceScope::~TraceScope() {
+  if (active_) {
+    trace_context->layer_name = previous_layer_name_;
+  }
+}
+
+}  // namespace caffe
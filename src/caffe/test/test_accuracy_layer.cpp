@@ -0,0 +1,129 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+#include "cuda_runtime.h"
+#include "gtest/gtest.h"
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/vision_layers.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+extern cudaDeviceProp CAFFE_TEST_CUDA_PROP;
+
+// Orders the outputs of an item by decreasing value.
+template <typename Dtype>
+class GreaterOutput {
+ public:
+  explicit GreaterOutput(const Dtype* row) : row_(row) {}
+  bool operator()(const int a, const int b) const {
+    return row_[a] > row_[b];
+  }
+
+ private:
+  const Dtype* row_;
+};
+
+template <typename Dtype>
+class AccuracyLayerTest : public ::testing::Test {
+ protected:
+  AccuracyLayerTest()
+      : blob_bottom_data_(new Blob<Dtype>(100, 10, 1, 1)),
+        blob_bottom_label_(new Blob<Dtype>(100, 1, 1, 1)),
+        blob_top_(new Blob<Dtype>()) {
+    Caffe::set_random_seed(1701);
+    // Values in [0, 1) in steps of 1/4, so that the outputs of an item tie
+    FillerParameter filler_param;
+    UniformFiller<Dtype> filler(filler_param);
+    filler.Fill(blob_bottom_data_);
+    Dtype* data = blob_bottom_data_->mutable_cpu_data();
+    for (int i = 0; i < blob_bottom_data_->count(); ++i) {
+      data[i] = floor(data[i] * 4) / 4;
+    }
+    for (int i = 0; i < blob_bottom_label_->count(); ++i) {
+      blob_bottom_label_->mutable_cpu_data()[i] = caffe_rng_rand() % 10;
+    }
+    blob_bottom_vec_.push_back(blob_bottom_data_);
+    blob_bottom_vec_.push_back(blob_bottom_label_);
+    blob_top_vec_.push_back(blob_top_);
+  }
+  virtual ~AccuracyLayerTest() {
+    delete blob_bottom_data_;
+    delete blob_bottom_label_;
+    delete blob_top_;
+  }
+
+  // Checks the top of the layer of top_k against the labels found among the
+  // first outputs of each item sorted stably, the first of equal ones first.
+  void TestForward(const int top_k) {
+    LayerParameter layer_param;
+    layer_param.mutable_accuracy_param()->set_top_k(top_k);
+    AccuracyLayer<Dtype> layer(layer_param);
+    layer.SetUp(blob_bottom_vec_, &blob_top_vec_);
+    EXPECT_EQ(blob_top_->channels(), top_k > 1 ? 3 : 2);
+    layer.Forward(blob_bottom_vec_, &blob_top_vec_);
+    const int num = blob_bottom_data_->num();
+    const int dim = blob_bottom_data_->channels();
+    Dtype accuracy = 0;
+    Dtype top_k_accuracy = 0;
+    Dtype logprob = 0;
+    for (int i = 0; i < num; ++i) {
+      const Dtype* row = blob_bottom_data_->cpu_data() + i * dim;
+      const int label = static_cast<int>(blob_bottom_label_->cpu_data()[i]);
+      vector<int> order(dim);
+      for (int j = 0; j < dim; ++j) {
+        order[j] = j;
+      }
+      std::stable_sort(order.begin(), order.end(), GreaterOutput<Dtype>(row));
+      accuracy += order[0] == label;
+      top_k_accuracy +=
+          std::find(order.begin(), order.begin() + top_k, label) !=
+          order.begin() + top_k;
+      logprob -= log(std::max(row[label], Dtype(kLOG_THRESHOLD)));
+    }
+    EXPECT_NEAR(blob_top_->cpu_data()[0], accuracy / num, 1e-6);
+    EXPECT_NEAR(blob_top_->cpu_data()[1], logprob / num, 1e-4);
+    if (top_k > 1) {
+      EXPECT_NEAR(blob_top_->cpu_data()[2], top_k_accuracy / num, 1e-6);
+    }
+  }
+
+  Blob<Dtype>* const blob_bottom_data_;
+  Blob<Dtype>* const blob_bottom_label_;
+  Blob<Dtype>* const blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+typedef ::testing::Types<float, double> Dtypes;
+TYPED_TEST_CASE(AccuracyLayerTest, Dtypes);
+
+TYPED_TEST(AccuracyLayerTest, TestForwardCPU) {
+  Caffe::set_mode(Caffe::CPU);
+  this->TestForward(1);
+}
+
+TYPED_TEST(AccuracyLayerTest, TestForwardGPU) {
+  Caffe::set_mode(Caffe::GPU);
+  this->TestForward(1);
+}
+
+TYPED_TEST(AccuracyLayerTest, TestForwardTopKCPU) {
+  Caffe::set_mode(Caffe::CPU);
+  this->TestForward(3);
+}
+
+TYPED_TEST(AccuracyLayerTest, TestForwardTopKGPU) {
+  Caffe::set_mode(Caffe::GPU);
+  this->TestForward(3);
+}
+
+}  // namespace caffe
@@ -1,12 +1,15 @@
 // Copyright 2014 BVLC and contributors.
 
 #include <cstring>
+#include <string>
 
 #include "cuda_runtime.h"
 #include "gtest/gtest.h"
 #include "caffe/common.hpp"
 #include "caffe/blob.hpp"
 #include "caffe/filler.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/sparse.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
 
@@ -57,4 +60,191 @@ TYPED_TEST(BlobSimpleTest, TestReshape) {
   EXPECT_EQ(this->blob_->count(), 120);
 }
 
+// The count and the offsets of a blob beyond 2^31 elements, whose memory is
+// only allocated once accessed
+TYPED_TEST(BlobSimpleTest, TestReshapeLarge) {
+  this->blob_->Reshape(1 << 12, 1 << 10, 1 << 8, 3);
+  EXPECT_EQ(this->blob_->count(), int64_t(3) << 30);
+  EXPECT_EQ(this->blob_->capacity(), this->blob_->count());
+  EXPECT_EQ(this->blob_->offset((1 << 12) - 1, 1, 2, 1),
+      this->blob_->count() - (1 << 10) * (1 << 8) * 3 + (1 << 8) * 3 + 2 * 3 +
+      1);
+}
+
+TYPED_TEST(BlobSimpleTest, TestReshapeKeepsCapacity) {
+  this->blob_->Reshape(2, 3, 4, 5);
+  TypeParam* data = this->blob_->mutable_cpu_data();
+  data[0] = 7;
+  // Shrinking keeps the memory and its contents.
+  this->blob_->Reshape(1, 3, 4, 5);
+  EXPECT_EQ(this->blob_->count(), 60);
+  EXPECT_EQ(this->blob_->capacity(), 120);
+  EXPECT_EQ(this->blob_->cpu_data(), data);
+  EXPECT_EQ(this->blob_->cpu_data()[0], 7);
+  // So does growing back within the capacity.
+  this->blob_->Reshape(2, 3, 5, 4);
+  EXPECT_EQ(this->blob_->count(), 120);
+  EXPECT_EQ(this->blob_->cpu_data(), data);
+  // Growing beyond it reallocates.
+  this->blob_->Reshape(3, 3, 4, 5);
+  EXPECT_EQ(this->blob_->count(), 180);
+  EXPECT_EQ(this->blob_->capacity(), 180);
+  EXPECT_EQ(this->blob_->cpu_data()[0], 0);
+}
+
+TYPED_TEST(BlobSimpleTest, TestReshapeKeepsSharing) {
+  this->blob_->Reshape(2, 3, 4, 5);
+  this->blob_->ShareData(*this->blob_preshaped_);
+  this->blob_->Reshape(1, 3, 4, 5);
+  EXPECT_EQ(this->blob_->data(), this->blob_preshaped_->data());
+  // Outside memory of count elements replaces the larger memory.
+  TypeParam outside[60];
+  this->blob_->set_cpu_data(outside);
+  EXPECT_EQ(this->blob_->cpu_data(), outside);
+  EXPECT_EQ(this->blob_->capacity(), 60);
+  EXPECT_EQ(this->blob_->data()->size(), 60 * sizeof(TypeParam));
+  this->blob_->Reshape(2, 3, 4, 5);
+  EXPECT_NE(this->blob_->data(), this->blob_preshaped_->data());
+}
+
+TYPED_TEST(BlobSimpleTest, TestShareView) {
+  Blob<TypeParam>* parent = this->blob_preshaped_;
+  TypeParam* data = parent->mutable_cpu_data();
+  for (int i = 0; i < parent->count(); ++i) {
+    data[i] = i;
+  }
+  // The second image, and then channels 1 and 2 of it
+  this->blob_->Reshape(1, 3, 4, 5);
+  this->blob_->ShareDataView(*parent, parent->offset(1));
+  this->blob_->ShareDiffView(*parent, parent->offset(1));
+  EXPECT_EQ(this->blob_->cpu_data(), data + parent->offset(1));
+  EXPECT_EQ(this->blob_->cpu_diff(), parent->cpu_diff() + parent->offset(1));
+  EXPECT_EQ(this->blob_->data_at(0, 2, 3, 4), parent->data_at(1, 2, 3, 4));
+  Blob<TypeParam> channels(1, 2, 4, 5);
+  channels.ShareDataView(*this->blob_, this->blob_->offset(0, 1));
+  EXPECT_EQ(channels.data_at(0, 0, 1, 2), parent->data_at(1, 1, 1, 2));
+  // The views and the parent have one head.
+  channels.mutable_gpu_data();
+  EXPECT_EQ(parent->data()->head(), SyncedMemory::HEAD_AT_GPU);
+  caffe_gpu_set(channels.count(), TypeParam(-1), channels.mutable_gpu_data());
+  EXPECT_EQ(parent->cpu_data()[parent->offset(1, 1)], -1);
+  EXPECT_EQ(parent->cpu_data()[parent->offset(1, 3) - 1], -1);
+  EXPECT_EQ(parent->cpu_data()[parent->offset(1, 1) - 1],
+      parent->offset(1, 1) - 1);
+  EXPECT_EQ(parent->cpu_data()[parent->offset(1, 3)], parent->offset(1, 3));
+  EXPECT_EQ(this->blob_->data()->head(), SyncedMemory::SYNCED);
+  // Growing gives the view memory of its own.
+  this->blob_->Reshape(2, 3, 4, 5);
+  EXPECT_NE(this->blob_->cpu_data(), data + parent->offset(1));
+}
+
+TYPED_TEST(BlobSimpleTest, TestLazyDiff) {
+  EXPECT_FALSE(this->blob_preshaped_->has_diff());
+  this->blob_preshaped_->mutable_cpu_data();
+  EXPECT_FALSE(this->blob_preshaped_->has_diff());
+  EXPECT_TRUE(this->blob_preshaped_->cpu_diff());
+  EXPECT_TRUE(this->blob_preshaped_->has_diff());
+  EXPECT_EQ(this->blob_preshaped_->diff()->size(),
+      this->blob_preshaped_->count() * sizeof(TypeParam));
+  // Growing drops the diff until it is used again.
+  this->blob_preshaped_->Reshape(3, 3, 4, 5);
+  EXPECT_FALSE(this->blob_preshaped_->has_diff());
+}
+
+TYPED_TEST(BlobSimpleTest, TestFromSparseProto) {
+  Blob<TypeParam>* blob = this->blob_preshaped_;
+  TypeParam* data = blob->mutable_cpu_data();
+  for (int i = 0; i < blob->count(); ++i) {
+    data[i] = i % 3 ? 0 : i;
+  }
+  BlobProto proto;
+  blob->ToProto(&proto);
+  // Too dense to be kept at density 0.3
+  EXPECT_FALSE(SparsifyBlobProto(0, 0.3, &proto));
+  EXPECT_TRUE(SparsifyBlobProto(0, 0.5, &proto));
+  // Zero is dropped too.
+  EXPECT_EQ(proto.data_size(), blob->count() / 3 - 1);
+  EXPECT_EQ(proto.sparse_row_start_size(), blob->count() / 5 + 1);
+  this->blob_->FromProto(proto);
+  EXPECT_EQ(this->blob_->count(), blob->count());
+  for (int i = 0; i < blob->count(); ++i) {
+    EXPECT_EQ(this->blob_->cpu_data()[i], blob->cpu_data()[i]);
+  }
+}
+
+TYPED_TEST(BlobSimpleTest, TestToFromProtoEncodings) {
+  Blob<TypeParam>* blob = this->blob_preshaped_;
+  TypeParam* data = blob->mutable_cpu_data();
+  TypeParam* diff = blob->mutable_cpu_diff();
+  for (int i = 0; i < blob->count(); ++i) {
+    // Exact in half precision, but the last one
+    data[i] = TypeParam(i) / 4;
+    diff[i] = -TypeParam(i);
+  }
+  data[blob->count() - 1] = 1. / 3;
+  const BlobProto::Encoding encodings[] = { BlobProto::REPEATED,
+      BlobProto::RAW_FLOAT, BlobProto::RAW_HALF };
+  for (int e = 0; e < 3; ++e) {
+    BlobProto proto;
+    blob->ToProto(&proto, true, encodings[e]);
+    EXPECT_EQ(proto.encoding(), encodings[e]);
+    EXPECT_EQ(proto.data_size(), e == 0 ? blob->count() : 0);
+    // Through the bytes, as read from a file
+    std::string bytes;
+    ASSERT_TRUE(proto.SerializeToString(&bytes));
+    BlobProto read_proto;
+    ASSERT_TRUE(read_proto.ParseFromString(bytes));
+    Blob<TypeParam> read_blob;
+    read_blob.FromProto(read_proto);
+    ASSERT_EQ(read_blob.count(), blob->count());
+    EXPECT_EQ(read_blob.width(), blob->width());
+    for (int i = 0; i < blob->count() - 1; ++i) {
+      EXPECT_EQ(read_blob.cpu_data()[i], data[i]);
+      EXPECT_EQ(read_blob.cpu_diff()[i], diff[i]);
+    }
+    EXPECT_NEAR(read_blob.cpu_data()[blob->count() - 1], 1. / 3,
+        e == 2 ? 1e-3 : 1e-7);
+  }
+}
+
+TYPED_TEST(BlobSimpleTest, TestStoreDataAsHalf) {
+  Blob<TypeParam>* blob = this->blob_preshaped_;
+  const int count = blob->count();
+  TypeParam* data = blob->mutable_cpu_data();
+  for (int i = 0; i < count; ++i) {
+    // Exact in half precision, but one
+    data[i] = i % 2 ? TypeParam(i) / 8 : -TypeParam(i) * 256;
+  }
+  data[1] = 1. / 3;
+  shared_ptr<SyncedMemory> scratch(
+      new SyncedMemory(count * sizeof(TypeParam)));
+  for (int mode = 0; mode < 2; ++mode) {
+    Caffe::set_mode(mode ? Caffe::GPU : Caffe::CPU);
+    blob->StoreDataAsHalf(scratch);
+    EXPECT_TRUE(blob->half_data());
+    const TypeParam* half_data = mode ? NULL : blob->cpu_data();
+    if (mode) {
+      blob->gpu_data();
+      half_data = reinterpret_cast<const TypeParam*>(scratch->cpu_data());
+    }
+    EXPECT_EQ(half_data, scratch->cpu_data());
+    for (int i = 0; i < count; ++i) {
+      if (i == 1) {
+        EXPECT_NEAR(half_data[i], 1. / 3, 1e-3);
+      } else {
+        EXPECT_EQ(half_data[i], i % 2 ? TypeParam(i) / 8 :
+            -TypeParam(i) * 256);
+      }
+    }
+    // A mutable access brings the data back.
+    if (mode) {
+      blob->mutable_gpu_data();
+    } else {
+      blob->mutable_cpu_data();
+    }
+    EXPECT_FALSE(blob->half_data());
+    EXPECT_EQ(blob->cpu_data()[count - 1], -TypeParam(count - 1) * 256);
+  }
+}
+
 }  // namespace caffe
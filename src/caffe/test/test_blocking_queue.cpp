@@ -0,0 +1,52 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <pthread.h>
+
+#include "gtest/gtest.h"
+#include "caffe/common.hpp"
+#include "caffe/util/blocking_queue.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class BlockingQueueTest : public ::testing::Test {};
+
+TEST_F(BlockingQueueTest, TestFIFO) {
+  BlockingQueue<int> queue;
+  int value;
+  EXPECT_FALSE(queue.try_pop(&value));
+  for (int i = 0; i < 5; ++i) {
+    queue.push(i);
+  }
+  EXPECT_EQ(queue.size(), 5);
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(queue.pop(), i);
+  }
+  EXPECT_EQ(queue.size(), 0);
+  EXPECT_FALSE(queue.try_pop(&value));
+}
+
+static const int kNumItems = 1000;
+
+static void* BlockingQueueTestProducer(void* queue_pointer) {
+  BlockingQueue<int>* queue = static_cast<BlockingQueue<int>*>(queue_pointer);
+  for (int i = 0; i < kNumItems; ++i) {
+    queue->push(i);
+  }
+  return static_cast<void*>(NULL);
+}
+
+TEST_F(BlockingQueueTest, TestProducerConsumer) {
+  BlockingQueue<int> queue;
+  pthread_t thread;
+  CHECK(!pthread_create(&thread, NULL, BlockingQueueTestProducer,
+        static_cast<void*>(&queue))) << "Pthread execution failed.";
+  for (int i = 0; i < kNumItems; ++i) {
+    EXPECT_EQ(queue.pop(), i);
+  }
+  CHECK(!pthread_join(thread, NULL)) << "Pthread joining failed.";
+  EXPECT_EQ(queue.size(), 0);
+}
+
+}  // namespace caffe
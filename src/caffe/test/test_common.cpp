@@ -1,5 +1,7 @@
 // Copyright 2014 BVLC and contributors.
 
+#include <pthread.h>
+
 #include <cstring>
 
 #include "cuda_runtime.h"
@@ -33,6 +35,54 @@ TEST_F(CommonTest, TestPhase) {
   EXPECT_EQ(Caffe::phase(), Caffe::TEST);
 }
 
+static void* ReadModeAndPhase(void* modes) {
+  static_cast<int*>(modes)[0] = Caffe::mode();
+  static_cast<int*>(modes)[1] = Caffe::phase();
+  Caffe::set_mode(Caffe::GPU);
+  return NULL;
+}
+
+TEST_F(CommonTest, TestPerThread) {
+  Caffe::set_mode(Caffe::GPU);
+  Caffe::set_phase(Caffe::TEST);
+  // Another thread starts with the defaults, and its settings stay its own.
+  int modes[2];
+  pthread_t thread;
+  ASSERT_FALSE(pthread_create(&thread, NULL, ReadModeAndPhase, modes));
+  ASSERT_FALSE(pthread_join(thread, NULL));
+  EXPECT_EQ(modes[0], Caffe::CPU);
+  EXPECT_EQ(modes[1], Caffe::TRAIN);
+  Caffe::set_mode(Caffe::CPU);
+  EXPECT_EQ(Caffe::mode(), Caffe::CPU);
+  EXPECT_EQ(Caffe::phase(), Caffe::TEST);
+  Caffe::set_phase(Caffe::TRAIN);
+}
+
+static void* ApplySettings(void* settings) {
+  Caffe::set_thread_settings(*static_cast<Caffe::ThreadSettings*>(settings));
+  *static_cast<Caffe::ThreadSettings*>(settings) = Caffe::thread_settings();
+  return NULL;
+}
+
+TEST_F(CommonTest, TestThreadSettings) {
+  Caffe::set_mode(Caffe::GPU);
+  Caffe::set_phase(Caffe::TEST);
+  Caffe::set_cpu_threads(3);
+  Caffe::ThreadSettings settings = Caffe::thread_settings();
+  const int device = settings.device;
+  pthread_t thread;
+  ASSERT_FALSE(pthread_create(&thread, NULL, ApplySettings, &settings));
+  ASSERT_FALSE(pthread_join(thread, NULL));
+  // As read back in the other thread
+  EXPECT_EQ(settings.mode, Caffe::GPU);
+  EXPECT_EQ(settings.phase, Caffe::TEST);
+  EXPECT_EQ(settings.device, device);
+  EXPECT_EQ(settings.cpu_threads, 3);
+  Caffe::set_mode(Caffe::CPU);
+  Caffe::set_phase(Caffe::TRAIN);
+  Caffe::set_cpu_threads(1);
+}
+
 TEST_F(CommonTest, TestRandSeedCPU) {
   SyncedMemory data_a(10 * sizeof(int));
   SyncedMemory data_b(10 * sizeof(int));
@@ -63,4 +113,19 @@ TEST_F(CommonTest, TestRandSeedGPU) {
   }
 }
 
+TEST_F(CommonTest, TestCappedGrid) {
+  const int max_blocks = Caffe::max_blocks();
+  EXPECT_GT(max_blocks, 0);
+  EXPECT_EQ(1, CAFFE_GET_BLOCKS(1));
+  // A grid of max_blocks blocks, whose threads take three elements or more
+  const int count = 2 * max_blocks * CAFFE_CUDA_NUM_THREADS + 3;
+  EXPECT_EQ(max_blocks, CAFFE_GET_BLOCKS(count));
+  SyncedMemory data(count * sizeof(float));
+  caffe_gpu_set(count, 3.f, static_cast<float*>(data.mutable_gpu_data()));
+  const float* cpu_data = static_cast<const float*>(data.cpu_data());
+  for (int i = 0; i < count; ++i) {
+    ASSERT_EQ(3.f, cpu_data[i]) << i;
+  }
+}
+
 }  // namespace caffe
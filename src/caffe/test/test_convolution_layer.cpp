@@ -1,6 +1,11 @@
 // Copyright 2014 BVLC and contributors.
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
 #include <cstring>
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
 #include <vector>
 
 #include "cuda_runtime.h"
@@ -9,6 +14,7 @@
 #include "caffe/common.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/vision_layers.hpp"
+#include "caffe/util/math_functions.hpp"
 #include "caffe/test/test_gradient_check_util.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
@@ -125,6 +131,68 @@ TYPED_TEST(ConvolutionLayerTest, TestGPUSimpleConvolution) {
   }
 }
 
+TYPED_TEST(ConvolutionLayerTest, TestCPURectangularConvolution) {
+  FillerParameter filler_param;
+  filler_param.set_value(1.);
+  ConstantFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_h(3);
+  convolution_param->set_kernel_w(2);
+  convolution_param->set_stride_h(1);
+  convolution_param->set_stride_w(2);
+  convolution_param->set_num_output(4);
+  convolution_param->mutable_weight_filler()->set_type("constant");
+  convolution_param->mutable_weight_filler()->set_value(1);
+  convolution_param->mutable_bias_filler()->set_type("constant");
+  convolution_param->mutable_bias_filler()->set_value(0.1);
+  shared_ptr<Layer<TypeParam> > layer(
+      new ConvolutionLayer<TypeParam>(layer_param));
+  layer->SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  EXPECT_EQ(this->blob_top_->height(), 4);
+  EXPECT_EQ(this->blob_top_->width(), 2);
+  Caffe::set_mode(Caffe::CPU);
+  layer->Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  // Each output sums 3 channels of 3 x 2 ones.
+  const TypeParam* top_data = this->blob_top_->cpu_data();
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_NEAR(top_data[i], 18.1, 1e-4);
+  }
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestGPURectangularConvolution) {
+  FillerParameter filler_param;
+  filler_param.set_value(1.);
+  ConstantFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_h(3);
+  convolution_param->set_kernel_w(2);
+  convolution_param->set_stride_h(1);
+  convolution_param->set_stride_w(2);
+  convolution_param->set_num_output(4);
+  convolution_param->mutable_weight_filler()->set_type("constant");
+  convolution_param->mutable_weight_filler()->set_value(1);
+  convolution_param->mutable_bias_filler()->set_type("constant");
+  convolution_param->mutable_bias_filler()->set_value(0.1);
+  shared_ptr<Layer<TypeParam> > layer(
+      new ConvolutionLayer<TypeParam>(layer_param));
+  layer->SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  EXPECT_EQ(this->blob_top_->height(), 4);
+  EXPECT_EQ(this->blob_top_->width(), 2);
+  Caffe::set_mode(Caffe::GPU);
+  layer->Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  // Each output sums 3 channels of 3 x 2 ones.
+  const TypeParam* top_data = this->blob_top_->cpu_data();
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_NEAR(top_data[i], 18.1, 1e-4);
+  }
+}
+
 TYPED_TEST(ConvolutionLayerTest, TestCPUSimpleConvolutionGroup) {
   // We will simply see if the convolution layer carries out averaging well.
   FillerParameter filler_param;
@@ -219,6 +287,116 @@ TYPED_TEST(ConvolutionLayerTest, TestGPUSimpleConvolutionGroup) {
 }
 
 
+TYPED_TEST(ConvolutionLayerTest, TestCPUBatchedConvolution) {
+  // Three images, so that the last group of two images is not full, of more
+  // channels than groups, which would be convolved depthwise.
+  this->blob_bottom_->Reshape(3, 6, 6, 4);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_pad(1);
+  convolution_param->set_num_output(6);
+  convolution_param->set_group(3);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  Caffe::set_mode(Caffe::CPU);
+  Caffe::set_random_seed(1701);
+  ConvolutionLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  Blob<TypeParam> expected_top;
+  expected_top.CopyFrom(*this->blob_top_, false, true);
+  for (int batch_size = 2; batch_size <= 4; ++batch_size) {
+    convolution_param->set_cpu_batch_size(batch_size);
+    Caffe::set_random_seed(1701);
+    ConvolutionLayer<TypeParam> batched_layer(layer_param);
+    batched_layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    batched_layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    for (int i = 0; i < this->blob_top_->count(); ++i) {
+      EXPECT_NEAR(this->blob_top_->cpu_data()[i], expected_top.cpu_data()[i],
+          1e-4) << "batch size " << batch_size;
+    }
+  }
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestCPUThreadedConvolution) {
+  this->blob_bottom_->Reshape(5, 3, 6, 4);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_num_output(4);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  Caffe::set_mode(Caffe::CPU);
+  for (int batch_size = 1; batch_size <= 2; ++batch_size) {
+    convolution_param->set_cpu_batch_size(batch_size);
+    ConvolutionLayer<TypeParam> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    Blob<TypeParam> expected_top;
+    expected_top.CopyFrom(*this->blob_top_, false, true);
+    Caffe::set_cpu_threads(3);
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    Caffe::set_cpu_threads(1);
+    for (int i = 0; i < this->blob_top_->count(); ++i) {
+      EXPECT_NEAR(this->blob_top_->cpu_data()[i], expected_top.cpu_data()[i],
+          1e-4) << "batch size " << batch_size;
+    }
+  }
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestCPUInt8Convolution) {
+  this->blob_bottom_->Reshape(3, 6, 6, 5);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  Caffe::set_mode(Caffe::CPU);
+  Caffe::set_cpu_threads(2);
+  const int kernel_sizes[] = { 3, 1 };
+  for (int i = 0; i < 4; ++i) {
+    LayerParameter layer_param;
+    ConvolutionParameter* convolution_param =
+        layer_param.mutable_convolution_param();
+    convolution_param->set_kernel_size(kernel_sizes[i % 2]);
+    convolution_param->set_stride(i % 2 ? 1 : 2);
+    convolution_param->set_group(i / 2 ? 3 : 1);
+    convolution_param->set_num_output(6);
+    convolution_param->mutable_weight_filler()->set_type("gaussian");
+    convolution_param->mutable_bias_filler()->set_type("gaussian");
+    ConvolutionLayer<TypeParam> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    Blob<TypeParam> expected_top;
+    expected_top.CopyFrom(*this->blob_top_, false, true);
+    layer_param.mutable_quantization_param()->set_precision(
+        QuantizationParameter::INT8);
+    ConvolutionLayer<TypeParam> int8_layer(layer_param);
+    int8_layer.blobs() = layer.blobs();
+    int8_layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    int8_layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    // Within a few percent of the largest output
+    TypeParam range = 0;
+    for (int j = 0; j < expected_top.count(); ++j) {
+      range = std::max(range, std::fabs(expected_top.cpu_data()[j]));
+    }
+    for (int j = 0; j < expected_top.count(); ++j) {
+      EXPECT_NEAR(this->blob_top_->cpu_data()[j], expected_top.cpu_data()[j],
+          0.03 * range) << "case " << i;
+    }
+  }
+  Caffe::set_cpu_threads(1);
+}
+
 TYPED_TEST(ConvolutionLayerTest, TestCPUGradient) {
   LayerParameter layer_param;
   ConvolutionParameter* convolution_param =
@@ -235,6 +413,25 @@ TYPED_TEST(ConvolutionLayerTest, TestCPUGradient) {
       &(this->blob_top_vec_));
 }
 
+TYPED_TEST(ConvolutionLayerTest, TestCPUGradientRectangular) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_h(3);
+  convolution_param->set_kernel_w(2);
+  convolution_param->set_stride_h(2);
+  convolution_param->set_stride_w(1);
+  convolution_param->set_pad_h(1);
+  convolution_param->set_num_output(2);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  Caffe::set_mode(Caffe::CPU);
+  ConvolutionLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
 TYPED_TEST(ConvolutionLayerTest, TestCPUGradientGroup) {
   LayerParameter layer_param;
   ConvolutionParameter* convolution_param =
@@ -268,6 +465,25 @@ TYPED_TEST(ConvolutionLayerTest, TestGPUGradient) {
       &(this->blob_top_vec_));
 }
 
+TYPED_TEST(ConvolutionLayerTest, TestGPUGradientRectangular) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_h(3);
+  convolution_param->set_kernel_w(2);
+  convolution_param->set_stride_h(2);
+  convolution_param->set_stride_w(1);
+  convolution_param->set_pad_h(1);
+  convolution_param->set_num_output(2);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  Caffe::set_mode(Caffe::GPU);
+  ConvolutionLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
 TYPED_TEST(ConvolutionLayerTest, TestGPUGradientGroup) {
   LayerParameter layer_param;
   ConvolutionParameter* convolution_param =
@@ -285,4 +501,371 @@ TYPED_TEST(ConvolutionLayerTest, TestGPUGradientGroup) {
       &(this->blob_top_vec_));
 }
 
+TYPED_TEST(ConvolutionLayerTest, TestCPUGradientKeepColumns) {
+  // More channels than groups, which would be convolved depthwise
+  this->blob_bottom_->Reshape(2, 6, 6, 4);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_group(3);
+  convolution_param->set_num_output(3);
+  convolution_param->set_keep_columns(true);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  Caffe::set_mode(Caffe::CPU);
+  ConvolutionLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestGPUGradientKeepColumns) {
+  // More channels than groups, which would be convolved depthwise
+  this->blob_bottom_->Reshape(2, 6, 6, 4);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_group(3);
+  convolution_param->set_num_output(3);
+  convolution_param->set_keep_columns(true);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  Caffe::set_mode(Caffe::GPU);
+  ConvolutionLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
+TYPED_TEST(ConvolutionLayerTest, Test1x1Convolution) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(1);
+  convolution_param->set_num_output(4);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  ConvolutionLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  EXPECT_EQ(this->blob_top_->height(), 6);
+  EXPECT_EQ(this->blob_top_->width(), 4);
+  const Blob<TypeParam>& weight = *layer.blobs()[0];
+  const Blob<TypeParam>& bias = *layer.blobs()[1];
+  Caffe::Brew modes[] = { Caffe::CPU, Caffe::GPU };
+  for (int i = 0; i < 2; ++i) {
+    Caffe::set_mode(modes[i]);
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    // Each output is a combination of the channels at the same place.
+    for (int n = 0; n < 2; ++n) {
+      for (int o = 0; o < 4; ++o) {
+        for (int h = 0; h < 6; ++h) {
+          for (int w = 0; w < 4; ++w) {
+            TypeParam expected = bias.cpu_data()[o];
+            for (int c = 0; c < 3; ++c) {
+              expected += weight.data_at(o, c, 0, 0) *
+                  this->blob_bottom_->data_at(n, c, h, w);
+            }
+            EXPECT_NEAR(this->blob_top_->data_at(n, o, h, w), expected, 1e-4);
+          }
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestCPUGradient1x1) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(1);
+  convolution_param->set_num_output(2);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  Caffe::set_mode(Caffe::CPU);
+  ConvolutionLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestGPUGradient1x1) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(1);
+  convolution_param->set_num_output(2);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  Caffe::set_mode(Caffe::GPU);
+  ConvolutionLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
+
+TYPED_TEST(ConvolutionLayerTest, TestGPUStreamedConvolution) {
+  // More images and groups than streams, with and without im2col
+  this->blob_bottom_->Reshape(5, 6, 6, 4);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  for (int kernel_size = 1; kernel_size <= 3; kernel_size += 2) {
+    LayerParameter layer_param;
+    ConvolutionParameter* convolution_param =
+        layer_param.mutable_convolution_param();
+    convolution_param->set_kernel_size(kernel_size);
+    convolution_param->set_group(3);
+    convolution_param->set_num_output(6);
+    convolution_param->mutable_weight_filler()->set_type("gaussian");
+    convolution_param->mutable_bias_filler()->set_type("gaussian");
+    ConvolutionLayer<TypeParam> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    Caffe::set_mode(Caffe::CPU);
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    Blob<TypeParam> expected;
+    expected.CopyFrom(*this->blob_top_, false, true);
+    Caffe::set_mode(Caffe::GPU);
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    for (int i = 0; i < expected.count(); ++i) {
+      EXPECT_NEAR(this->blob_top_->cpu_data()[i], expected.cpu_data()[i],
+          1e-4);
+    }
+  }
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestWinogradConvolution) {
+  // Odd sizes leave partial tiles at the bottom and right edges.
+  this->blob_bottom_->Reshape(2, 6, 5, 7);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  Caffe::Brew modes[] = { Caffe::CPU, Caffe::GPU };
+  for (int pad = 0; pad < 2; ++pad) {
+    for (int group = 1; group <= 3; group += 2) {
+      LayerParameter layer_param;
+      ConvolutionParameter* convolution_param =
+          layer_param.mutable_convolution_param();
+      convolution_param->set_kernel_size(3);
+      convolution_param->set_pad(pad);
+      convolution_param->set_group(group);
+      convolution_param->set_num_output(6);
+      convolution_param->mutable_weight_filler()->set_type("gaussian");
+      convolution_param->mutable_bias_filler()->set_type("gaussian");
+      ConvolutionLayer<TypeParam> layer(layer_param);
+      layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+      Caffe::set_mode(Caffe::CPU);
+      layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+      Blob<TypeParam> expected;
+      expected.CopyFrom(*this->blob_top_, false, true);
+      // The WINOGRAD layer gets the same weights.
+      convolution_param->set_engine(ConvolutionParameter::WINOGRAD);
+      ConvolutionLayer<TypeParam> winograd_layer(layer_param);
+      winograd_layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+      for (int i = 0; i < 2; ++i) {
+        winograd_layer.blobs()[i]->CopyFrom(*layer.blobs()[i]);
+      }
+      for (int i = 0; i < 2; ++i) {
+        Caffe::set_mode(modes[i]);
+        caffe_set(this->blob_top_->count(), TypeParam(0.),
+            this->blob_top_->mutable_cpu_data());
+        winograd_layer.Forward(this->blob_bottom_vec_,
+            &(this->blob_top_vec_));
+        for (int j = 0; j < expected.count(); ++j) {
+          EXPECT_NEAR(this->blob_top_->cpu_data()[j], expected.cpu_data()[j],
+              1e-4);
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestCPUGradientWinograd) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_pad(1);
+  convolution_param->set_num_output(2);
+  convolution_param->set_engine(ConvolutionParameter::WINOGRAD);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  Caffe::set_mode(Caffe::CPU);
+  ConvolutionLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestGPUGradientWinograd) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_pad(1);
+  convolution_param->set_num_output(2);
+  convolution_param->set_engine(ConvolutionParameter::WINOGRAD);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  Caffe::set_mode(Caffe::GPU);
+  ConvolutionLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestDepthwiseConvolution) {
+  // Two outputs per channel, with padding and stride, and a fused ReLU
+  this->blob_bottom_->Reshape(2, 4, 5, 7);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  for (int relu = 0; relu <= 1; ++relu) {
+    LayerParameter layer_param;
+    ConvolutionParameter* convolution_param =
+        layer_param.mutable_convolution_param();
+    convolution_param->set_kernel_h(3);
+    convolution_param->set_kernel_w(2);
+    convolution_param->set_stride(2);
+    convolution_param->set_pad(1);
+    convolution_param->set_group(4);
+    convolution_param->set_num_output(8);
+    convolution_param->set_fused_relu(relu);
+    convolution_param->mutable_weight_filler()->set_type("gaussian");
+    convolution_param->mutable_bias_filler()->set_type("gaussian");
+    ConvolutionLayer<TypeParam> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    EXPECT_EQ(this->blob_top_->height(), 3);
+    EXPECT_EQ(this->blob_top_->width(), 5);
+    const Blob<TypeParam>& weight = *layer.blobs()[0];
+    const Blob<TypeParam>& bias = *layer.blobs()[1];
+    Caffe::Brew modes[] = { Caffe::CPU, Caffe::GPU };
+    for (int i = 0; i < 2; ++i) {
+      Caffe::set_mode(modes[i]);
+      layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+      // Each output only reads the channel of its group.
+      for (int n = 0; n < 2; ++n) {
+        for (int o = 0; o < 8; ++o) {
+          for (int h = 0; h < 3; ++h) {
+            for (int w = 0; w < 5; ++w) {
+              TypeParam expected = bias.cpu_data()[o];
+              for (int kh = 0; kh < 3; ++kh) {
+                for (int kw = 0; kw < 2; ++kw) {
+                  const int h_in = h * 2 - 1 + kh;
+                  const int w_in = w * 2 - 1 + kw;
+                  if (h_in >= 0 && h_in < 5 && w_in >= 0 && w_in < 7) {
+                    expected += weight.data_at(o, 0, kh, kw) *
+                        this->blob_bottom_->data_at(n, o / 2, h_in, w_in);
+                  }
+                }
+              }
+              if (relu) {
+                expected = std::max(expected, TypeParam(0));
+              }
+              EXPECT_NEAR(this->blob_top_->data_at(n, o, h, w), expected,
+                  1e-4);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestCPUGradientDepthwise) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_pad(1);
+  convolution_param->set_group(3);
+  convolution_param->set_num_output(6);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  Caffe::set_mode(Caffe::CPU);
+  ConvolutionLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestGPUGradientDepthwise) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_pad(1);
+  convolution_param->set_group(3);
+  convolution_param->set_num_output(6);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  Caffe::set_mode(Caffe::GPU);
+  ConvolutionLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
+TYPED_TEST(ConvolutionLayerTest, TestAutoEngine) {
+  const string cache_file(tmpnam(NULL));
+  Caffe::set_engine_cache_file(cache_file);
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_pad(1);
+  convolution_param->set_num_output(4);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  Caffe::Brew modes[] = { Caffe::CPU, Caffe::GPU };
+  for (int i = 0; i < 2; ++i) {
+    Caffe::set_mode(modes[i]);
+    convolution_param->set_engine(ConvolutionParameter::IM2COL);
+    ConvolutionLayer<TypeParam> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    Blob<TypeParam> expected;
+    expected.CopyFrom(*this->blob_top_, false, true);
+    // The first AUTO layer times the engines and stores its choice, which the
+    // second one reads.
+    convolution_param->set_engine(ConvolutionParameter::AUTO);
+    for (int j = 0; j < 2; ++j) {
+      layer_param.clear_blobs();
+      for (int k = 0; k < 2; ++k) {
+        layer.blobs()[k]->ToProto(layer_param.add_blobs());
+      }
+      ConvolutionLayer<TypeParam> auto_layer(layer_param);
+      auto_layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+      auto_layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+      for (int k = 0; k < expected.count(); ++k) {
+        EXPECT_NEAR(this->blob_top_->cpu_data()[k], expected.cpu_data()[k],
+            1e-4);
+      }
+      std::ifstream file(cache_file.c_str());
+      int num_lines = 0;
+      string line;
+      while (std::getline(file, line)) {
+        EXPECT_NE(line.find("convolution"), string::npos);
+        ++num_lines;
+      }
+      EXPECT_EQ(num_lines, i + 1);
+    }
+    layer_param.clear_blobs();
+  }
+  Caffe::set_engine_cache_file("");
+  remove(cache_file.c_str());
+}
+
 }  // namespace caffe
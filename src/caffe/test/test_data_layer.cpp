@@ -9,8 +9,10 @@
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
 #include "caffe/filler.hpp"
+#include "caffe/parallel.hpp"
 #include "caffe/vision_layers.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/db.hpp"
 #include "caffe/test/test_caffe_main.hpp"
 
 using std::string;
@@ -63,6 +65,30 @@ class DataLayerTest : public ::testing::Test {
     delete db;
   }
 
+  // Fill an LMDB with the same data as FillLevelDB(false), going through the
+  // DB interface.
+  void FillLMDB() {
+    LOG(INFO) << "Using temporary lmdb " << *filename_;
+    shared_ptr<DB> db(GetDB(DataParameter_DB_LMDB));
+    db->Open(*filename_, DB::NEW);
+    shared_ptr<DBTransaction> txn(db->NewTransaction());
+    for (int i = 0; i < 5; ++i) {
+      Datum datum;
+      datum.set_label(i);
+      datum.set_channels(2);
+      datum.set_height(3);
+      datum.set_width(4);
+      std::string* data = datum.mutable_data();
+      for (int j = 0; j < 24; ++j) {
+        data->push_back(static_cast<uint8_t>(i));
+      }
+      stringstream ss;
+      ss << i;
+      txn->Put(ss.str(), datum.SerializeAsString());
+    }
+    txn->Commit();
+  }
+
   virtual ~DataLayerTest() { delete blob_top_data_; delete blob_top_label_; }
 
   shared_ptr<string> filename_;
@@ -111,6 +137,112 @@ TYPED_TEST(DataLayerTest, TestReadCPU) {
   }
 }
 
+TYPED_TEST(DataLayerTest, TestStatsCPU) {
+  Caffe::set_mode(Caffe::CPU);
+  this->FillLevelDB(false);
+  LayerParameter param;
+  DataParameter* data_param = param.mutable_data_param();
+  data_param->set_batch_size(5);
+  data_param->set_source(this->filename_->c_str());
+  DataLayer<TypeParam> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+  EXPECT_EQ(layer.stats().batches, 0);
+  for (int iter = 0; iter < 3; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+  }
+  const DataLayerStats& stats = layer.stats();
+  EXPECT_EQ(stats.batches, 3);
+  EXPECT_GE(stats.wait_ms, 0);
+  EXPECT_GE(stats.read_ms, 0);
+  EXPECT_GE(stats.prefetch_ms, stats.read_ms);
+  EXPECT_GE(stats.parse_ms, 0);
+  EXPECT_GE(stats.transform_ms, 0);
+  EXPECT_GE(stats.copy_ms, 0);
+  EXPECT_GE(stats.prefetch_ms,
+      stats.read_ms + stats.parse_ms + stats.transform_ms);
+  // The images are not encoded.
+  EXPECT_EQ(stats.decode_ms, 0);
+  layer.ResetStats();
+  EXPECT_EQ(layer.stats().batches, 0);
+  EXPECT_EQ(layer.stats().prefetch_ms, 0);
+}
+
+TYPED_TEST(DataLayerTest, TestReadShardCPU) {
+  Caffe::set_mode(Caffe::CPU);
+  this->FillLevelDB(false);
+  LayerParameter param;
+  DataParameter* data_param = param.mutable_data_param();
+  data_param->set_batch_size(2);
+  data_param->set_source(this->filename_->c_str());
+  data_param->set_num_shards(3);
+  data_param->set_shard_id(1);
+  DataLayer<TypeParam> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+  // Every third of the 5 images, from the second one on, around the end
+  for (int iter = 0; iter < 10; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+    for (int i = 0; i < 2; ++i) {
+      EXPECT_EQ((1 + 3 * (iter * 2 + i)) % 5,
+          this->blob_top_label_->cpu_data()[i]);
+    }
+  }
+}
+
+TYPED_TEST(DataLayerTest, TestShareDB) {
+  // Two layers read the same leveldb at once, as train and test nets do.
+  Caffe::set_mode(Caffe::CPU);
+  this->FillLevelDB(false);
+  LayerParameter param;
+  DataParameter* data_param = param.mutable_data_param();
+  data_param->set_batch_size(2);
+  data_param->set_source(this->filename_->c_str());
+  DataLayer<TypeParam> layer1(param);
+  layer1.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+  Blob<TypeParam> data2;
+  Blob<TypeParam> label2;
+  vector<Blob<TypeParam>*> top2;
+  top2.push_back(&data2);
+  top2.push_back(&label2);
+  data_param->set_batch_size(3);
+  DataLayer<TypeParam> layer2(param);
+  layer2.SetUp(this->blob_bottom_vec_, &top2);
+  for (int iter = 0; iter < 4; ++iter) {
+    layer1.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+    layer2.Forward(this->blob_bottom_vec_, &top2);
+    for (int i = 0; i < 2; ++i) {
+      EXPECT_EQ((iter * 2 + i) % 5, this->blob_top_label_->cpu_data()[i]);
+    }
+    for (int i = 0; i < 3; ++i) {
+      EXPECT_EQ((iter * 3 + i) % 5, label2.cpu_data()[i]);
+    }
+  }
+}
+
+TYPED_TEST(DataLayerTest, TestReadShardOfShardCPU) {
+  Caffe::set_mode(Caffe::CPU);
+  this->FillLevelDB(false);
+  NetParameter net_param;
+  LayerParameter* param = net_param.add_layers();
+  param->set_type(LayerParameter_LayerType_DATA);
+  DataParameter* data_param = param->mutable_data_param();
+  data_param->set_batch_size(2);
+  data_param->set_source(this->filename_->c_str());
+  // Replica 1 of 3 of process 1 of 2
+  P2PSync<TypeParam>::SetShard(1, 2, &net_param);
+  P2PSync<TypeParam>::SetShard(1, 3, &net_param);
+  EXPECT_EQ(6, data_param->num_shards());
+  EXPECT_EQ(3, data_param->shard_id());
+  DataLayer<TypeParam> layer(*param);
+  layer.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+  for (int iter = 0; iter < 10; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+    for (int i = 0; i < 2; ++i) {
+      EXPECT_EQ((3 + 6 * (iter * 2 + i)) % 5,
+          this->blob_top_label_->cpu_data()[i]);
+    }
+  }
+}
+
 TYPED_TEST(DataLayerTest, TestReadGPU) {
   Caffe::set_mode(Caffe::GPU);
   const bool unique_pixels = false;  // all pixels the same; images different
@@ -146,6 +278,37 @@ TYPED_TEST(DataLayerTest, TestReadGPU) {
   }
 }
 
+TYPED_TEST(DataLayerTest, TestReadLMDBCPU) {
+  Caffe::set_mode(Caffe::CPU);
+  this->FillLMDB();
+  const TypeParam scale = 3;
+  LayerParameter param;
+  DataParameter* data_param = param.mutable_data_param();
+  data_param->set_batch_size(5);
+  data_param->set_scale(scale);
+  data_param->set_source(this->filename_->c_str());
+  data_param->set_backend(DataParameter_DB_LMDB);
+  DataLayer<TypeParam> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+  EXPECT_EQ(this->blob_top_data_->num(), 5);
+  EXPECT_EQ(this->blob_top_data_->channels(), 2);
+  EXPECT_EQ(this->blob_top_data_->height(), 3);
+  EXPECT_EQ(this->blob_top_data_->width(), 4);
+
+  for (int iter = 0; iter < 100; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+    for (int i = 0; i < 5; ++i) {
+      EXPECT_EQ(i, this->blob_top_label_->cpu_data()[i]);
+    }
+    for (int i = 0; i < 5; ++i) {
+      for (int j = 0; j < 24; ++j) {
+        EXPECT_EQ(scale * i, this->blob_top_data_->cpu_data()[i * 24 + j])
+            << "debug: iter " << iter << " i " << i << " j " << j;
+      }
+    }
+  }
+}
+
 TYPED_TEST(DataLayerTest, TestReadCropTrainCPU) {
   Caffe::set_phase(Caffe::TRAIN);
   Caffe::set_mode(Caffe::CPU);
@@ -342,6 +505,214 @@ TYPED_TEST(DataLayerTest, TestReadCropTrainSequenceSeededGPU) {
   }
 }
 
+// Test that transforming the data on the device gives the same batches as
+// transforming it on the host.
+TYPED_TEST(DataLayerTest, TestReadCropTrainGPUTransform) {
+  Caffe::set_phase(Caffe::TRAIN);
+  Caffe::set_mode(Caffe::GPU);
+  const bool unique_pixels = true;  // all images the same; pixels different
+  this->FillLevelDB(unique_pixels);
+  LayerParameter param;
+  DataParameter* data_param = param.mutable_data_param();
+  data_param->set_batch_size(5);
+  data_param->set_scale(3);
+  data_param->add_mean_value(1);
+  data_param->add_mean_value(2);
+  data_param->set_crop_size(2);
+  data_param->set_mirror(true);
+  data_param->set_source(this->filename_->c_str());
+
+  Caffe::set_random_seed(this->seed_);
+  vector<vector<TypeParam> > batches;
+  {
+    DataLayer<TypeParam> layer1(param);
+    layer1.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+    for (int iter = 0; iter < 2; ++iter) {
+      layer1.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+      const TypeParam* data = this->blob_top_data_->cpu_data();
+      batches.push_back(
+          vector<TypeParam>(data, data + this->blob_top_data_->count()));
+    }
+  }  // destroy 1st data layer and unlock the leveldb
+
+  data_param->set_gpu_transform(true);
+  Caffe::set_random_seed(this->seed_);
+  DataLayer<TypeParam> layer2(param);
+  layer2.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+  EXPECT_EQ(this->blob_top_data_->num(), 5);
+  EXPECT_EQ(this->blob_top_data_->channels(), 2);
+  EXPECT_EQ(this->blob_top_data_->height(), 2);
+  EXPECT_EQ(this->blob_top_data_->width(), 2);
+  for (int iter = 0; iter < 2; ++iter) {
+    layer2.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+    for (int i = 0; i < 5; ++i) {
+      EXPECT_EQ(i, this->blob_top_label_->cpu_data()[i]);
+    }
+    for (int i = 0; i < this->blob_top_data_->count(); ++i) {
+      EXPECT_EQ(batches[iter][i], this->blob_top_data_->cpu_data()[i])
+          << "debug: iter " << iter << " i " << i;
+    }
+  }
+}
+
+TYPED_TEST(DataLayerTest, TestReadShuffleCPU) {
+  Caffe::set_mode(Caffe::CPU);
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->FillLevelDB(unique_pixels);
+  LayerParameter param;
+  DataParameter* data_param = param.mutable_data_param();
+  data_param->set_batch_size(5);
+  data_param->set_source(this->filename_->c_str());
+  data_param->set_shuffle(true);
+  // Blocks of 2, 2 and 1 datums
+  data_param->set_shuffle_block_size(2);
+  data_param->set_readahead_blocks(1);
+  DataLayer<TypeParam> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+  // Every batch is a pass over the data, with each datum once and those of
+  // a block next to each other.
+  for (int iter = 0; iter < 10; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+    vector<int> seen(5, 0);
+    for (int i = 0; i < 5; ++i) {
+      const int item = this->blob_top_label_->cpu_data()[i];
+      ASSERT_GE(item, 0);
+      ASSERT_LT(item, 5);
+      ++seen[item];
+      for (int j = 0; j < 24; ++j) {
+        EXPECT_EQ(item, this->blob_top_data_->cpu_data()[i * 24 + j]);
+      }
+      if (item < 4) {
+        const int other = item ^ 1;
+        const bool next_to_other =
+            (i > 0 && this->blob_top_label_->cpu_data()[i - 1] == other) ||
+            (i < 4 && this->blob_top_label_->cpu_data()[i + 1] == other);
+        EXPECT_TRUE(next_to_other) << "debug: iter " << iter << " i " << i;
+      }
+    }
+    for (int i = 0; i < 5; ++i) {
+      EXPECT_EQ(1, seen[i]);
+    }
+  }
+}
+
+TYPED_TEST(DataLayerTest, TestReadGPUResident) {
+  Caffe::set_mode(Caffe::GPU);
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->FillLevelDB(unique_pixels);
+  const TypeParam scale = 3;
+  LayerParameter param;
+  DataParameter* data_param = param.mutable_data_param();
+  // Batches of 3 of the 5 datums cross the end of the data.
+  data_param->set_batch_size(3);
+  data_param->set_scale(scale);
+  data_param->set_source(this->filename_->c_str());
+  data_param->set_gpu_resident(true);
+  DataLayer<TypeParam> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+  EXPECT_EQ(this->blob_top_data_->num(), 3);
+  EXPECT_EQ(this->blob_top_data_->channels(), 2);
+  for (int iter = 0; iter < 7; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+    for (int i = 0; i < 3; ++i) {
+      const int item = (iter * 3 + i) % 5;
+      EXPECT_EQ(item, this->blob_top_label_->cpu_data()[i]);
+      for (int j = 0; j < 24; ++j) {
+        EXPECT_EQ(scale * item, this->blob_top_data_->cpu_data()[i * 24 + j])
+            << "debug: iter " << iter << " i " << i << " j " << j;
+      }
+    }
+  }
+}
+
+TYPED_TEST(DataLayerTest, TestReadGPUResidentShuffle) {
+  Caffe::set_mode(Caffe::GPU);
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->FillLevelDB(unique_pixels);
+  LayerParameter param;
+  DataParameter* data_param = param.mutable_data_param();
+  data_param->set_batch_size(5);
+  data_param->set_source(this->filename_->c_str());
+  data_param->set_gpu_resident(true);
+  data_param->set_shuffle(true);
+  DataLayer<TypeParam> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+  // Every batch is a pass over the data, with each datum once.
+  for (int iter = 0; iter < 10; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+    vector<int> seen(5, 0);
+    for (int i = 0; i < 5; ++i) {
+      const int item = this->blob_top_label_->cpu_data()[i];
+      ASSERT_GE(item, 0);
+      ASSERT_LT(item, 5);
+      ++seen[item];
+      for (int j = 0; j < 24; ++j) {
+        EXPECT_EQ(item, this->blob_top_data_->cpu_data()[i * 24 + j]);
+      }
+    }
+    for (int i = 0; i < 5; ++i) {
+      EXPECT_EQ(1, seen[i]);
+    }
+  }
+}
+
+// Test that the sequence of random crops is consistent when using
+// Caffe::set_random_seed with the batch split among several prefetch threads.
+TYPED_TEST(DataLayerTest, TestReadCropTrainSequenceSeededMultiThreadCPU) {
+  Caffe::set_phase(Caffe::TRAIN);
+  Caffe::set_mode(Caffe::CPU);
+  const bool unique_pixels = true;  // all images the same; pixels different
+  this->FillLevelDB(unique_pixels);
+  LayerParameter param;
+  DataParameter* data_param = param.mutable_data_param();
+  data_param->set_batch_size(5);
+  data_param->set_crop_size(1);
+  data_param->set_mirror(true);
+  data_param->set_prefetch_threads(3);
+  data_param->set_source(this->filename_->c_str());
+
+  // Get crop sequence with Caffe seed 1701.
+  Caffe::set_random_seed(this->seed_);
+  vector<vector<TypeParam> > crop_sequence;
+  {
+    DataLayer<TypeParam> layer1(param);
+    layer1.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+    for (int iter = 0; iter < 2; ++iter) {
+      layer1.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+      for (int i = 0; i < 5; ++i) {
+        EXPECT_EQ(i, this->blob_top_label_->cpu_data()[i]);
+      }
+      vector<TypeParam> iter_crop_sequence;
+      for (int i = 0; i < 5; ++i) {
+        for (int j = 0; j < 2; ++j) {
+          iter_crop_sequence.push_back(
+              this->blob_top_data_->cpu_data()[i * 2 + j]);
+        }
+      }
+      crop_sequence.push_back(iter_crop_sequence);
+    }
+  }  // destroy 1st data layer and unlock the leveldb
+
+  // Get crop sequence after reseeding Caffe with 1701.
+  // Check that the sequence is the same as the original.
+  Caffe::set_random_seed(this->seed_);
+  DataLayer<TypeParam> layer2(param);
+  layer2.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+  for (int iter = 0; iter < 2; ++iter) {
+    layer2.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+    for (int i = 0; i < 5; ++i) {
+      EXPECT_EQ(i, this->blob_top_label_->cpu_data()[i]);
+    }
+    for (int i = 0; i < 5; ++i) {
+      for (int j = 0; j < 2; ++j) {
+        EXPECT_EQ(crop_sequence[iter][i * 2 + j],
+                  this->blob_top_data_->cpu_data()[i * 2 + j])
+            << "debug: iter " << iter << " i " << i << " j " << j;
+      }
+    }
+  }
+}
+
 // Test that the sequence of random crops differs across iterations when
 // Caffe::set_random_seed isn't called (and seeds from srand are ignored).
 TYPED_TEST(DataLayerTest, TestReadCropTrainSequenceUnseededCPU) {
@@ -0,0 +1,193 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "caffe/common.hpp"
+#include "caffe/util/data_transform.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+using std::vector;
+
+namespace caffe {
+
+template <typename Dtype>
+class DataTransformTest : public ::testing::Test {
+ protected:
+  DataTransformTest()
+      : channels_(3), height_(23), width_(37),
+        data_(channels_ * height_ * width_),
+        mean_(channels_ * height_ * width_) {
+    for (int i = 0; i < data_.size(); ++i) {
+      data_[i] = static_cast<uint8_t>((i * 7) % 256);
+      mean_[i] = static_cast<Dtype>(i % 101) / 3;
+    }
+  }
+
+  // Checks TransformImage against a straightforward per pixel version.
+  void CheckTransformImage(const int h_off, const int w_off,
+      const int crop_size, const bool mirror) {
+    const Dtype scale = 0.25;
+    const int crop_height = crop_size ? crop_size : height_;
+    const int crop_width = crop_size ? crop_size : width_;
+    vector<Dtype> top(channels_ * crop_height * crop_width);
+    TransformImage(&data_[0], channels_, height_, width_, h_off, w_off,
+        crop_size, mirror, &mean_[0], scale, &top[0]);
+    for (int c = 0; c < channels_; ++c) {
+      for (int h = 0; h < crop_height; ++h) {
+        for (int w = 0; w < crop_width; ++w) {
+          const int top_w = mirror ? crop_width - 1 - w : w;
+          const int top_index = (c * crop_height + h) * crop_width + top_w;
+          const int data_index = (c * height_ + h + h_off) * width_ + w + w_off;
+          const Dtype expected =
+              (static_cast<Dtype>(data_[data_index]) - mean_[data_index])
+              * scale;
+          EXPECT_EQ(expected, top[top_index])
+              << "c " << c << " h " << h << " w " << w;
+        }
+      }
+    }
+  }
+
+  // Same as above with one mean value per channel.
+  void CheckTransformImageMeanValues(const int h_off, const int w_off,
+      const int crop_size, const bool mirror) {
+    const Dtype scale = 0.25;
+    const Dtype mean_values[] = {3.5, 100, 255};
+    const int crop_height = crop_size ? crop_size : height_;
+    const int crop_width = crop_size ? crop_size : width_;
+    vector<Dtype> top(channels_ * crop_height * crop_width);
+    TransformImageMeanValues(&data_[0], channels_, height_, width_, h_off,
+        w_off, crop_size, mirror, mean_values, scale, &top[0]);
+    for (int c = 0; c < channels_; ++c) {
+      for (int h = 0; h < crop_height; ++h) {
+        for (int w = 0; w < crop_width; ++w) {
+          const int top_w = mirror ? crop_width - 1 - w : w;
+          const int top_index = (c * crop_height + h) * crop_width + top_w;
+          const int data_index = (c * height_ + h + h_off) * width_ + w + w_off;
+          const Dtype expected =
+              (static_cast<Dtype>(data_[data_index]) - mean_values[c]) * scale;
+          EXPECT_EQ(expected, top[top_index])
+              << "c " << c << " h " << h << " w " << w;
+        }
+      }
+    }
+  }
+
+  const int channels_;
+  const int height_;
+  const int width_;
+  vector<uint8_t> data_;
+  vector<Dtype> mean_;
+};
+
+typedef ::testing::Types<float, double> Dtypes;
+TYPED_TEST_CASE(DataTransformTest, Dtypes);
+
+TYPED_TEST(DataTransformTest, TestWholeImage) {
+  this->CheckTransformImage(0, 0, 0, false);
+}
+
+TYPED_TEST(DataTransformTest, TestCrop) {
+  // 21 pixel rows cover both the 16 pixel blocks and the remainder.
+  this->CheckTransformImage(1, 5, 21, false);
+}
+
+TYPED_TEST(DataTransformTest, TestCropMirror) {
+  this->CheckTransformImage(2, 3, 21, true);
+  this->CheckTransformImage(0, 0, 16, true);
+}
+
+TYPED_TEST(DataTransformTest, TestStridedRow) {
+  // Read the second channel of interleaved pixels.
+  const int length = 19;
+  const int stride = 3;
+  const TypeParam scale = 2;
+  vector<TypeParam> top(length);
+  TransformRow(length, &this->data_[1], stride, false, &this->mean_[0], scale,
+      &top[0]);
+  for (int i = 0; i < length; ++i) {
+    EXPECT_EQ((static_cast<TypeParam>(this->data_[1 + i * stride])
+        - this->mean_[i]) * scale, top[i]);
+  }
+}
+
+TYPED_TEST(DataTransformTest, TestMeanValues) {
+  this->CheckTransformImageMeanValues(0, 0, 0, false);
+  this->CheckTransformImageMeanValues(1, 5, 21, false);
+  this->CheckTransformImageMeanValues(2, 3, 21, true);
+}
+
+TYPED_TEST(DataTransformTest, TestFloats) {
+  // 19 values cover both the 4 value blocks and the remainder.
+  const int length = 19;
+  const TypeParam scale = 0.5;
+  vector<float> floats(length);
+  for (int i = 0; i < length; ++i) {
+    floats[i] = i * 1.25f - 7;
+  }
+  vector<TypeParam> top(length);
+  TransformFloats(length, &floats[0], &this->mean_[0], scale, &top[0]);
+  for (int i = 0; i < length; ++i) {
+    EXPECT_EQ((static_cast<TypeParam>(floats[i]) - this->mean_[i]) * scale,
+        top[i]);
+  }
+  TransformFloatsMeanValue(length, &floats[0], TypeParam(3.5), scale,
+      &top[0]);
+  for (int i = 0; i < length; ++i) {
+    EXPECT_EQ((static_cast<TypeParam>(floats[i]) - 3.5) * scale, top[i]);
+  }
+}
+
+TYPED_TEST(DataTransformTest, TestPreprocessImage) {
+  // The pixels of pycaffe are interleaved height x width x channels Dtypes.
+  vector<TypeParam> image(this->data_.size());
+  for (int i = 0; i < image.size(); ++i) {
+    image[i] = static_cast<TypeParam>(this->data_[i]) / 255;
+  }
+  const int h_off = 2;
+  const int w_off = 3;
+  const int crop_height = 11;
+  const int crop_width = 17;
+  const int channel_order[] = {2, 0, 1};
+  const TypeParam scale = 255;
+  for (int mirror = 0; mirror < 2; ++mirror) {
+    vector<TypeParam> top(this->channels_ * crop_height * crop_width);
+    PreprocessImage(&image[0], this->height_, this->width_, this->channels_,
+        h_off, w_off, crop_height, crop_width, mirror, channel_order, scale,
+        &this->mean_[0], &top[0]);
+    for (int c = 0; c < this->channels_; ++c) {
+      for (int h = 0; h < crop_height; ++h) {
+        for (int w = 0; w < crop_width; ++w) {
+          const int top_w = mirror ? crop_width - 1 - w : w;
+          const int top_index = (c * crop_height + h) * crop_width + top_w;
+          const int image_index = ((h + h_off) * this->width_ + w + w_off)
+              * this->channels_ + channel_order[c];
+          EXPECT_EQ(image[image_index] * scale - this->mean_[top_index],
+              top[top_index]) << "c " << c << " h " << h << " w " << w;
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(DataTransformTest, TestResizeImage) {
+  // A 1 x 2 image of 2 channels, upsampled to 2 x 4
+  const TypeParam image[] = {1, 10, 3, 30};
+  vector<TypeParam> top(2 * 4 * 2);
+  ResizeImage(image, 1, 2, 2, 2, 4, &top[0]);
+  const TypeParam expected_row[] = {1, 10, 1.5, 15, 2.5, 25, 3, 30};
+  for (int i = 0; i < top.size(); ++i) {
+    EXPECT_NEAR(expected_row[i % 8], top[i], 1e-5) << "i " << i;
+  }
+  // Resizing to the same size is the identity.
+  ResizeImage(image, 1, 2, 2, 1, 2, &top[0]);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(image[i], top[i]);
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,214 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <algorithm>
+#include <vector>
+
+#include "cuda_runtime.h"
+#include "gtest/gtest.h"
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/vision_layers.hpp"
+#include "caffe/test/test_gradient_check_util.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+extern cudaDeviceProp CAFFE_TEST_CUDA_PROP;
+
+template <typename Dtype>
+class EltwiseLayerTest : public ::testing::Test {
+ protected:
+  EltwiseLayerTest()
+      : blob_bottom_a_(new Blob<Dtype>(2, 3, 4, 5)),
+        blob_bottom_b_(new Blob<Dtype>(2, 3, 4, 5)),
+        blob_bottom_c_(new Blob<Dtype>(2, 3, 4, 5)),
+        blob_top_(new Blob<Dtype>()) {
+    // fill the values
+    FillerParameter filler_param;
+    UniformFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_a_);
+    filler.Fill(this->blob_bottom_b_);
+    filler.Fill(this->blob_bottom_c_);
+    blob_bottom_vec_.push_back(blob_bottom_a_);
+    blob_bottom_vec_.push_back(blob_bottom_b_);
+    blob_bottom_vec_.push_back(blob_bottom_c_);
+    blob_top_vec_.push_back(blob_top_);
+  }
+  virtual ~EltwiseLayerTest() {
+    delete blob_bottom_a_;
+    delete blob_bottom_b_;
+    delete blob_bottom_c_;
+    delete blob_top_;
+  }
+
+  // A SUM of coefficients 1, -0.5 and 2
+  LayerParameter SumParam() {
+    LayerParameter layer_param;
+    EltwiseParameter* eltwise_param = layer_param.mutable_eltwise_param();
+    eltwise_param->set_operation(EltwiseParameter_EltwiseOp_SUM);
+    eltwise_param->add_coeff(1);
+    eltwise_param->add_coeff(-0.5);
+    eltwise_param->add_coeff(2);
+    return layer_param;
+  }
+
+  // Checks the forward pass of op in the current mode.
+  void TestForward(const EltwiseParameter_EltwiseOp op) {
+    LayerParameter layer_param = op == EltwiseParameter_EltwiseOp_SUM ?
+        SumParam() : LayerParameter();
+    layer_param.mutable_eltwise_param()->set_operation(op);
+    EltwiseLayer<Dtype> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    const Dtype* data = this->blob_top_->cpu_data();
+    const Dtype* a = this->blob_bottom_a_->cpu_data();
+    const Dtype* b = this->blob_bottom_b_->cpu_data();
+    const Dtype* c = this->blob_bottom_c_->cpu_data();
+    for (int i = 0; i < this->blob_top_->count(); ++i) {
+      if (op == EltwiseParameter_EltwiseOp_SUM) {
+        EXPECT_NEAR(data[i], a[i] - 0.5 * b[i] + 2 * c[i], 1e-5);
+      } else if (op == EltwiseParameter_EltwiseOp_PROD) {
+        EXPECT_NEAR(data[i], a[i] * b[i] * c[i], 1e-5);
+      } else {
+        EXPECT_EQ(data[i], std::max(a[i], std::max(b[i], c[i])));
+      }
+    }
+  }
+
+  Blob<Dtype>* const blob_bottom_a_;
+  Blob<Dtype>* const blob_bottom_b_;
+  Blob<Dtype>* const blob_bottom_c_;
+  Blob<Dtype>* const blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+typedef ::testing::Types<float, double> Dtypes;
+TYPED_TEST_CASE(EltwiseLayerTest, Dtypes);
+
+TYPED_TEST(EltwiseLayerTest, TestSetUp) {
+  LayerParameter layer_param;
+  shared_ptr<EltwiseLayer<TypeParam> > layer(
+      new EltwiseLayer<TypeParam>(layer_param));
+  layer->SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  EXPECT_EQ(this->blob_top_->num(), 2);
+  EXPECT_EQ(this->blob_top_->channels(), 3);
+  EXPECT_EQ(this->blob_top_->height(), 4);
+  EXPECT_EQ(this->blob_top_->width(), 5);
+}
+
+TYPED_TEST(EltwiseLayerTest, TestCPU) {
+  Caffe::set_mode(Caffe::CPU);
+  this->TestForward(EltwiseParameter_EltwiseOp_SUM);
+  this->TestForward(EltwiseParameter_EltwiseOp_PROD);
+  this->TestForward(EltwiseParameter_EltwiseOp_MAX);
+}
+
+TYPED_TEST(EltwiseLayerTest, TestGPU) {
+  Caffe::set_mode(Caffe::GPU);
+  this->TestForward(EltwiseParameter_EltwiseOp_SUM);
+  this->TestForward(EltwiseParameter_EltwiseOp_PROD);
+  this->TestForward(EltwiseParameter_EltwiseOp_MAX);
+}
+
+// The gradient of a bottom of a product is that of the other bottoms, even
+// where the bottom is 0.
+TYPED_TEST(EltwiseLayerTest, TestProdZero) {
+  LayerParameter layer_param;
+  layer_param.mutable_eltwise_param()->set_operation(
+      EltwiseParameter_EltwiseOp_PROD);
+  this->blob_bottom_a_->mutable_cpu_data()[3] = 0;
+  for (int mode = 0; mode < 2; ++mode) {
+    Caffe::set_mode(mode ? Caffe::GPU : Caffe::CPU);
+    EltwiseLayer<TypeParam> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    caffe_set(this->blob_top_->count(), TypeParam(1),
+        this->blob_top_->mutable_cpu_diff());
+    layer.Backward(this->blob_top_vec_, true, &(this->blob_bottom_vec_));
+    EXPECT_NEAR(this->blob_bottom_a_->cpu_diff()[3],
+        this->blob_bottom_b_->cpu_data()[3] *
+        this->blob_bottom_c_->cpu_data()[3], 1e-5) << "mode " << mode;
+    EXPECT_EQ(0, this->blob_bottom_b_->cpu_diff()[3]) << "mode " << mode;
+  }
+}
+
+// In place on its first bottom, a SUM gives the same top and gradients.
+TYPED_TEST(EltwiseLayerTest, TestSumInPlace) {
+  Blob<TypeParam> top_diff(2, 3, 4, 5);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(&top_diff);
+  const int count = top_diff.count();
+  for (int mode = 0; mode < 2; ++mode) {
+    Caffe::set_mode(mode ? Caffe::GPU : Caffe::CPU);
+    EltwiseLayer<TypeParam> layer(this->SumParam());
+    layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    caffe_copy(count, top_diff.cpu_data(), this->blob_top_->mutable_cpu_diff());
+    layer.Backward(this->blob_top_vec_, true, &(this->blob_bottom_vec_));
+    Blob<TypeParam> expected_top;
+    expected_top.CopyFrom(*this->blob_top_, false, true);
+    Blob<TypeParam> expected_b_diff;
+    expected_b_diff.CopyFrom(*this->blob_bottom_b_, true, true);
+
+    vector<Blob<TypeParam>*> top_vec(1, this->blob_bottom_a_);
+    EltwiseLayer<TypeParam> in_place_layer(this->SumParam());
+    in_place_layer.SetUp(this->blob_bottom_vec_, &top_vec);
+    in_place_layer.Forward(this->blob_bottom_vec_, &top_vec);
+    caffe_copy(count, top_diff.cpu_data(),
+        this->blob_bottom_a_->mutable_cpu_diff());
+    in_place_layer.Backward(top_vec, true, &(this->blob_bottom_vec_));
+    for (int i = 0; i < count; ++i) {
+      EXPECT_NEAR(expected_top.cpu_data()[i],
+          this->blob_bottom_a_->cpu_data()[i], 1e-5) << "mode " << mode;
+      // The coefficient of the first bottom is 1.
+      EXPECT_NEAR(top_diff.cpu_data()[i], this->blob_bottom_a_->cpu_diff()[i],
+          1e-5) << "mode " << mode;
+      EXPECT_NEAR(expected_b_diff.cpu_diff()[i],
+          this->blob_bottom_b_->cpu_diff()[i], 1e-5) << "mode " << mode;
+    }
+  }
+}
+
+TYPED_TEST(EltwiseLayerTest, TestSumCPUGradient) {
+  Caffe::set_mode(Caffe::CPU);
+  EltwiseLayer<TypeParam> layer(this->SumParam());
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientEltwise(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
+TYPED_TEST(EltwiseLayerTest, TestSumGPUGradient) {
+  Caffe::set_mode(Caffe::GPU);
+  EltwiseLayer<TypeParam> layer(this->SumParam());
+  GradientChecker<TypeParam> checker(1e-2, 1e-2);
+  checker.CheckGradientEltwise(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
+TYPED_TEST(EltwiseLayerTest, TestMaxCPUGradient) {
+  Caffe::set_mode(Caffe::CPU);
+  LayerParameter layer_param;
+  layer_param.mutable_eltwise_param()->set_operation(
+      EltwiseParameter_EltwiseOp_MAX);
+  EltwiseLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-4, 1e-2);
+  checker.CheckGradientEltwise(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
+TYPED_TEST(EltwiseLayerTest, TestMaxGPUGradient) {
+  Caffe::set_mode(Caffe::GPU);
+  LayerParameter layer_param;
+  layer_param.mutable_eltwise_param()->set_operation(
+      EltwiseParameter_EltwiseOp_MAX);
+  EltwiseLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-4, 1e-2);
+  checker.CheckGradientEltwise(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
+}  // namespace caffe
@@ -56,4 +56,14 @@ TYPED_TEST(EuclideanLossLayerTest, TestGradientCPU) {
       &(this->blob_top_vec_), 0, -1, -1);
 }
 
+TYPED_TEST(EuclideanLossLayerTest, TestGradientGPU) {
+  LayerParameter layer_param;
+  Caffe::set_mode(Caffe::GPU);
+  EuclideanLossLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+  GradientChecker<TypeParam> checker(1e-2, 1e-2, 1701);
+  checker.CheckGradientSingle(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_), 0, -1, -1);
+}
+
 }  // namespace caffe
@@ -0,0 +1,81 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <google/protobuf/text_format.h>
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "caffe/common.hpp"
+#include "caffe/util/feature_cache.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class FeatureCacheTest : public ::testing::Test {
+ protected:
+  // conv1 and relu1 in place are frozen under ip1; pool1 is not cached.
+  NetParameter NetParam() {
+    const string proto =
+        "name: 'TestNetwork' "
+        "layers: { "
+        "  name: 'data' type: DATA "
+        "  data_param { source: 'images' batch_size: 8 shuffle: true "
+        "    crop_size: 3 } "
+        "  top: 'data' top: 'label' "
+        "} "
+        "layers: { "
+        "  name: 'conv1' type: CONVOLUTION blobs_lr: 0 blobs_lr: 0 "
+        "  convolution_param { num_output: 4 kernel_size: 3 } "
+        "  bottom: 'data' top: 'conv1' "
+        "} "
+        "layers: { "
+        "  name: 'pool1' type: POOLING "
+        "  pooling_param { pool: MAX kernel_size: 2 } "
+        "  bottom: 'data' top: 'pool1' "
+        "} "
+        "layers: { "
+        "  name: 'relu1' type: RELU bottom: 'conv1' top: 'conv1' "
+        "} "
+        "layers: { "
+        "  name: 'ip1' type: INNER_PRODUCT "
+        "  inner_product_param { num_output: 2 } "
+        "  bottom: 'conv1' top: 'ip1' "
+        "} "
+        "layers: { "
+        "  name: 'loss' type: SOFTMAX_LOSS "
+        "  bottom: 'ip1' bottom: 'label' "
+        "} ";
+    NetParameter param;
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+    return param;
+  }
+};
+
+TEST_F(FeatureCacheTest, TestSplit) {
+  NetParameter prefix;
+  NetParameter suffix;
+  EXPECT_EQ("label", SplitNetAtBlob(NetParam(), "conv1", "cache",
+      DataParameter::LMDB, &prefix, &suffix));
+  // Up to relu1, reading the data in order
+  ASSERT_EQ(4, prefix.layers_size());
+  EXPECT_EQ("relu1", prefix.layers(3).name());
+  EXPECT_FALSE(prefix.layers(0).data_param().shuffle());
+  EXPECT_EQ(3, prefix.layers(0).data_param().crop_size());
+  ASSERT_EQ(3, suffix.layers_size());
+  const LayerParameter& cache = suffix.layers(0);
+  EXPECT_EQ("data", cache.name());
+  EXPECT_EQ(LayerParameter::DATA, cache.type());
+  ASSERT_EQ(2, cache.top_size());
+  EXPECT_EQ("conv1", cache.top(0));
+  EXPECT_EQ("label", cache.top(1));
+  EXPECT_EQ("cache", cache.data_param().source());
+  EXPECT_EQ(DataParameter::LMDB, cache.data_param().backend());
+  EXPECT_EQ(8, cache.data_param().batch_size());
+  EXPECT_TRUE(cache.data_param().shuffle());
+  EXPECT_EQ(0, cache.data_param().crop_size());
+  EXPECT_EQ("ip1", suffix.layers(1).name());
+  EXPECT_EQ("loss", suffix.layers(2).name());
+}
+
+}  // namespace caffe
@@ -0,0 +1,53 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <cstdio>
+#include <fstream>  // NOLINT(readability/streams)
+#include <sstream>
+#include <string>
+
+#include "gtest/gtest.h"
+#include "caffe/common.hpp"
+#include "caffe/util/file_list.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class FileListTest : public ::testing::Test {};
+
+TEST_F(FileListTest, TestAdd) {
+  FileList list;
+  EXPECT_EQ(list.size(), 0);
+  list.Add("a.jpg", 3);
+  list.Add("", 4);
+  list.Add("dir/b.png", -1);
+  list.Trim();
+  ASSERT_EQ(list.size(), 3);
+  EXPECT_STREQ(list.filename(0), "a.jpg");
+  EXPECT_STREQ(list.filename(1), "");
+  EXPECT_STREQ(list.filename(2), "dir/b.png");
+  EXPECT_EQ(list.label(0), 3);
+  EXPECT_EQ(list.label(1), 4);
+  EXPECT_EQ(list.label(2), -1);
+}
+
+TEST_F(FileListTest, TestReadFile) {
+  const string source = tmpnam(NULL);
+  std::ofstream outfile(source.c_str(), std::ofstream::out);
+  for (int i = 0; i < 100; ++i) {
+    outfile << "images/" << i << ".jpg " << i * 7 << "\n";
+  }
+  outfile.close();
+  FileList list;
+  EXPECT_EQ(list.ReadFile(source), 100);
+  ASSERT_EQ(list.size(), 100);
+  for (int i = 0; i < 100; ++i) {
+    std::ostringstream filename;
+    filename << "images/" << i << ".jpg";
+    EXPECT_EQ(filename.str(), list.filename(i));
+    EXPECT_EQ(i * 7, list.label(i));
+  }
+  remove(source.c_str());
+}
+
+}  // namespace caffe
@@ -146,4 +146,21 @@ TYPED_TEST(GaussianFillerTest, TestFill) {
   EXPECT_LE(var, target_var * 5.);
 }
 
+TYPED_TEST(GaussianFillerTest, TestFillCPUMatchesGPU) {
+  // The same seed gives the same numbers on the CPU and on the GPU.
+  Blob<TypeParam> cpu_blob(2, 3, 4, 5);
+  Blob<TypeParam> gpu_blob(2, 3, 4, 5);
+  Caffe::set_mode(Caffe::CPU);
+  Caffe::set_random_seed(1701);
+  this->filler_->Fill(&cpu_blob);
+  Caffe::set_mode(Caffe::GPU);
+  Caffe::set_random_seed(1701);
+  this->filler_->Fill(&gpu_blob);
+  const TypeParam* cpu_data = cpu_blob.cpu_data();
+  const TypeParam* gpu_data = gpu_blob.cpu_data();
+  for (int i = 0; i < cpu_blob.count(); ++i) {
+    EXPECT_NEAR(cpu_data[i], gpu_data[i], 1e-4);
+  }
+}
+
 }  // namespace caffe
@@ -0,0 +1,114 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "caffe/common.hpp"
+#include "caffe/util/gradient_compression.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+using std::vector;
+
+namespace caffe {
+
+class GradientCompressionTest : public ::testing::Test {
+ protected:
+  GradientCompressionTest() : x_(kCount) {
+    for (int i = 0; i < kCount; ++i) {
+      x_[i] = std::sin(i * 0.7f) * (i + 1) / kCount;
+    }
+  }
+
+  // Encodes x_, with error feedback if error, decodes it into y and checks
+  // that the whole message was read.
+  void RoundTrip(const SolverParameter_GradientCompression compression,
+      const float top_k, float* error, vector<float>* y) {
+    vector<char> message;
+    EncodeGradient(compression, kCount, &x_[0], top_k, error, &message);
+    y->assign(kCount, 0.f);
+    size_t offset = 0;
+    DecodeAddGradient(compression, kCount, message, &offset, &(*y)[0]);
+    EXPECT_EQ(offset, message.size());
+  }
+
+  static const int kCount = 100;
+  vector<float> x_;
+};
+
+TEST_F(GradientCompressionTest, TestNone) {
+  vector<float> y;
+  RoundTrip(SolverParameter_GradientCompression_NONE, 1, NULL, &y);
+  for (int i = 0; i < kCount; ++i) {
+    EXPECT_EQ(y[i], x_[i]);
+  }
+}
+
+TEST_F(GradientCompressionTest, TestHalf) {
+  vector<float> y;
+  RoundTrip(SolverParameter_GradientCompression_HALF, 1, NULL, &y);
+  for (int i = 0; i < kCount; ++i) {
+    EXPECT_NEAR(y[i], x_[i], std::fabs(x_[i]) / 1024);
+  }
+}
+
+TEST_F(GradientCompressionTest, TestInt8) {
+  vector<float> y;
+  RoundTrip(SolverParameter_GradientCompression_INT8, 1, NULL, &y);
+  float amax = 0;
+  for (int i = 0; i < kCount; ++i) {
+    amax = std::max(amax, std::fabs(x_[i]));
+  }
+  for (int i = 0; i < kCount; ++i) {
+    EXPECT_NEAR(y[i], x_[i], amax / 127 / 2 * 1.001);
+  }
+}
+
+TEST_F(GradientCompressionTest, TestTopK) {
+  vector<float> y;
+  RoundTrip(SolverParameter_GradientCompression_TOP_K, 0.1, NULL, &y);
+  // The 10 values sent are the largest, the others are 0.
+  float smallest_sent = 1e9;
+  float largest_unsent = 0;
+  int sent = 0;
+  for (int i = 0; i < kCount; ++i) {
+    if (y[i] != 0) {
+      EXPECT_EQ(y[i], x_[i]);
+      smallest_sent = std::min(smallest_sent, std::fabs(x_[i]));
+      ++sent;
+    } else {
+      largest_unsent = std::max(largest_unsent, std::fabs(x_[i]));
+    }
+  }
+  EXPECT_EQ(sent, 10);
+  EXPECT_GE(smallest_sent, largest_unsent);
+}
+
+TEST_F(GradientCompressionTest, TestErrorFeedback) {
+  // Over the iterations, what is sent adds up to the gradients but for the
+  // error left.
+  const SolverParameter_GradientCompression compressions[] = {
+    SolverParameter_GradientCompression_HALF,
+    SolverParameter_GradientCompression_INT8,
+    SolverParameter_GradientCompression_TOP_K
+  };
+  for (int c = 0; c < 3; ++c) {
+    vector<float> error(kCount, 0.f);
+    vector<float> sum(kCount, 0.f);
+    vector<float> y;
+    const int iterations = 20;
+    for (int n = 0; n < iterations; ++n) {
+      RoundTrip(compressions[c], 0.1, &error[0], &y);
+      for (int i = 0; i < kCount; ++i) {
+        sum[i] += y[i];
+      }
+    }
+    for (int i = 0; i < kCount; ++i) {
+      EXPECT_NEAR(sum[i] + error[i], iterations * x_[i], 1e-4);
+    }
+  }
+}
+
+}  // namespace caffe
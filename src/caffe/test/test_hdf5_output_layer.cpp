@@ -122,4 +122,57 @@ TYPED_TEST(HDF5OutputLayerTest, TestForward) {
   }
 }
 
+TYPED_TEST(HDF5OutputLayerTest, TestAppendBatches) {
+  // Three batches of 5 rows, in chunks of 2 compressed rows, are appended
+  // in order, behind a single write buffer.
+  Caffe::set_mode(Caffe::CPU);
+  this->blob_data_->Reshape(this->num_, this->channels_, this->height_,
+      this->width_);
+  this->blob_label_->Reshape(this->num_, 1, 1, 1);
+  this->blob_bottom_vec_.push_back(this->blob_data_);
+  this->blob_bottom_vec_.push_back(this->blob_label_);
+  LayerParameter param;
+  HDF5OutputParameter* hdf5_output_param =
+      param.mutable_hdf5_output_param();
+  hdf5_output_param->set_file_name(this->output_file_name_);
+  hdf5_output_param->set_chunk_rows(2);
+  hdf5_output_param->set_compression_level(1);
+  hdf5_output_param->set_write_batches(1);
+  const int num_batches = 3;
+  {
+    HDF5OutputLayer<TypeParam> layer(param);
+    layer.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+    for (int batch = 0; batch < num_batches; ++batch) {
+      for (int i = 0; i < this->blob_data_->count(); ++i) {
+        this->blob_data_->mutable_cpu_data()[i] =
+            batch * this->blob_data_->count() + i;
+      }
+      for (int i = 0; i < this->num_; ++i) {
+        this->blob_label_->mutable_cpu_data()[i] = batch * this->num_ + i;
+      }
+      layer.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+    }
+  }
+  hid_t file_id = H5Fopen(this->output_file_name_.c_str(), H5F_ACC_RDONLY,
+                          H5P_DEFAULT);
+  ASSERT_GE(file_id, 0) << "Failed to open HDF5 file" <<
+      this->output_file_name_;
+  Blob<TypeParam> blob_data;
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_DATASET_NAME, 0, 4, &blob_data);
+  EXPECT_EQ(blob_data.num(), num_batches * this->num_);
+  EXPECT_EQ(blob_data.channels(), this->channels_);
+  for (int i = 0; i < blob_data.count(); ++i) {
+    EXPECT_EQ(blob_data.cpu_data()[i], i);
+  }
+  Blob<TypeParam> blob_label;
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_LABEL_NAME, 0, 4, &blob_label);
+  ASSERT_EQ(blob_label.num(), num_batches * this->num_);
+  for (int i = 0; i < blob_label.count(); ++i) {
+    EXPECT_EQ(blob_label.cpu_data()[i], i);
+  }
+  herr_t status = H5Fclose(file_id);
+  EXPECT_GE(status, 0) << "Failed to close HDF5 file " <<
+      this->output_file_name_;
+}
+
 }  // namespace caffe
@@ -129,4 +129,42 @@ TYPED_TEST(HDF5DataLayerTest, TestRead) {
   }
 }
 
+TYPED_TEST(HDF5DataLayerTest, TestReadShuffle) {
+  LayerParameter param;
+  HDF5DataParameter* hdf5_data_param = param.mutable_hdf5_data_param();
+  int batch_size = 5;
+  hdf5_data_param->set_batch_size(batch_size);
+  hdf5_data_param->set_source(*(this->filename));
+  hdf5_data_param->set_shuffle(true);
+  int num_cols = 8;
+  int height = 5;
+  int width = 5;
+  const int data_size = num_cols * height * width;
+
+  Caffe::set_mode(Caffe::CPU);
+  HDF5DataLayer<TypeParam> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+  // Each pass of 4 iterations reads the two files, in some order, and the
+  // rows of each file in order.
+  for (int pass = 0; pass < 3; ++pass) {
+    int file_offsets[2];
+    for (int iter = 0; iter < 4; ++iter) {
+      layer.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+      int label_offset = (iter % 2 == 0) ? 0 : batch_size;
+      int data_offset = (iter % 2 == 0) ? 0 : batch_size * data_size;
+      const TypeParam* data = this->blob_top_data_->cpu_data();
+      int file_offset = data[0] - data_offset;
+      EXPECT_TRUE(file_offset == 0 || file_offset == 2000);
+      file_offsets[iter / 2] = file_offset;
+      for (int i = 0; i < batch_size; ++i) {
+        EXPECT_EQ(label_offset + i, this->blob_top_label_->cpu_data()[i]);
+      }
+      for (int idx = 0; idx < batch_size * data_size; ++idx) {
+        EXPECT_EQ(file_offset + data_offset + idx, data[idx]);
+      }
+    }
+    EXPECT_NE(file_offsets[0], file_offsets[1]);
+  }
+}
+
 }  // namespace caffe
@@ -9,6 +9,7 @@
 #include "caffe/common.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/vision_layers.hpp"
+#include "caffe/util/im2col.hpp"
 #include "caffe/test/test_gradient_check_util.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
@@ -114,5 +115,51 @@ TYPED_TEST(Im2colLayerTest, TestGPUGradient) {
       &(this->blob_top_vec_));
 }
 
+TYPED_TEST(Im2colLayerTest, TestGPUKernels) {
+  // The plain and tiled kernels against the CPU, for the kernel sizes the
+  // tiled ones are compiled for and one they are not
+  const int kernel_sizes[] = { 3, 5, 11, 3, 4 };
+  const int pads[] = { 1, 2, 0, 0, 1 };
+  const int strides[] = { 1, 1, 4, 2, 2 };
+  const int sizes[] = { 13, 27, 47, 9, 10 };
+  const Im2colGpuKernel variants[] = {
+      IM2COL_GPU_PLAIN, IM2COL_GPU_TILED, IM2COL_GPU_AUTO };
+  Caffe::set_mode(Caffe::GPU);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  for (int i = 0; i < 5; ++i) {
+    const int k = kernel_sizes[i];
+    const int size = sizes[i];
+    const int size_col = (size + 2 * pads[i] - k) / strides[i] + 1;
+    Blob<TypeParam> image(1, 3, size, size);
+    Blob<TypeParam> columns(1, 3 * k * k, size_col, size_col);
+    Blob<TypeParam> expected_image(1, 3, size, size);
+    Blob<TypeParam> expected_columns(1, 3 * k * k, size_col, size_col);
+    filler.Fill(&image);
+    filler.Fill(&columns);
+    im2col_cpu(image.cpu_data(), 3, size, size, k, k, pads[i], pads[i],
+        strides[i], strides[i], expected_columns.mutable_cpu_data());
+    col2im_cpu(columns.cpu_data(), 3, size, size, k, k, pads[i], pads[i],
+        strides[i], strides[i], expected_image.mutable_cpu_data());
+    for (int j = 0; j < 3; ++j) {
+      Blob<TypeParam> gpu_image(1, 3, size, size);
+      Blob<TypeParam> gpu_columns(1, 3 * k * k, size_col, size_col);
+      im2col_gpu(image.gpu_data(), 3, size, size, k, k, pads[i], pads[i],
+          strides[i], strides[i], gpu_columns.mutable_gpu_data(),
+          variants[j]);
+      col2im_gpu(columns.gpu_data(), 3, size, size, k, k, pads[i], pads[i],
+          strides[i], strides[i], gpu_image.mutable_gpu_data(), variants[j]);
+      for (int n = 0; n < columns.count(); ++n) {
+        EXPECT_EQ(gpu_columns.cpu_data()[n], expected_columns.cpu_data()[n]);
+      }
+      // The sums are added in another order.
+      for (int n = 0; n < image.count(); ++n) {
+        EXPECT_NEAR(gpu_image.cpu_data()[n], expected_image.cpu_data()[n],
+            1e-4);
+      }
+    }
+  }
+}
+
 
 }  // namespace caffe
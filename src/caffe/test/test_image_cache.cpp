@@ -0,0 +1,66 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <opencv2/core/core.hpp>
+
+#include "gtest/gtest.h"
+#include "caffe/common.hpp"
+#include "caffe/util/image_cache.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class ImageCacheTest : public ::testing::Test {
+ protected:
+  // A 10 x 10 x 3 image, i.e. 300 bytes, filled with value.
+  static cv::Mat MakeImage(const int value) {
+    return cv::Mat(10, 10, CV_8UC3, cv::Scalar(value, value, value));
+  }
+};
+
+TEST_F(ImageCacheTest, TestGetPut) {
+  ImageCache cache(1000);
+  cv::Mat cv_img;
+  EXPECT_FALSE(cache.Get("a", &cv_img));
+  cache.Put("a", MakeImage(1));
+  EXPECT_EQ(cache.count(), 1);
+  EXPECT_EQ(cache.size(), 300);
+  EXPECT_TRUE(cache.Get("a", &cv_img));
+  EXPECT_EQ(cv_img.rows, 10);
+  EXPECT_EQ(cv_img.cols, 10);
+  EXPECT_EQ(cv_img.at<cv::Vec3b>(4, 5)[2], 1);
+  // Putting an image again keeps the first one.
+  cache.Put("a", MakeImage(2));
+  EXPECT_EQ(cache.count(), 1);
+  EXPECT_TRUE(cache.Get("a", &cv_img));
+  EXPECT_EQ(cv_img.at<cv::Vec3b>(0, 0)[0], 1);
+}
+
+TEST_F(ImageCacheTest, TestEvictLeastRecentlyUsed) {
+  ImageCache cache(1000);
+  cache.Put("a", MakeImage(1));
+  cache.Put("b", MakeImage(2));
+  cache.Put("c", MakeImage(3));
+  cv::Mat cv_img;
+  // Use a, so that b is the least recently used.
+  EXPECT_TRUE(cache.Get("a", &cv_img));
+  cache.Put("d", MakeImage(4));
+  EXPECT_EQ(cache.count(), 3);
+  EXPECT_EQ(cache.size(), 900);
+  EXPECT_FALSE(cache.Get("b", &cv_img));
+  EXPECT_TRUE(cache.Get("a", &cv_img));
+  EXPECT_TRUE(cache.Get("c", &cv_img));
+  EXPECT_TRUE(cache.Get("d", &cv_img));
+  EXPECT_EQ(cv_img.at<cv::Vec3b>(0, 0)[1], 4);
+}
+
+TEST_F(ImageCacheTest, TestTooLarge) {
+  ImageCache cache(200);
+  cache.Put("a", MakeImage(1));
+  cv::Mat cv_img;
+  EXPECT_FALSE(cache.Get("a", &cv_img));
+  EXPECT_EQ(cache.count(), 0);
+  EXPECT_EQ(cache.size(), 0);
+}
+
+}  // namespace caffe
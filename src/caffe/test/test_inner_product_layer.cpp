@@ -1,5 +1,7 @@
 // Copyright 2014 BVLC and contributors.
 
+#include <algorithm>
+#include <cmath>
 #include <cstring>
 #include <vector>
 
@@ -9,6 +11,7 @@
 #include "caffe/common.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/vision_layers.hpp"
+#include "caffe/util/math_functions.hpp"
 #include "caffe/test/test_gradient_check_util.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
@@ -100,6 +103,105 @@ TYPED_TEST(InnerProductLayerTest, TestGPU) {
   }
 }
 
+TYPED_TEST(InnerProductLayerTest, TestFusedReLU) {
+  LayerParameter layer_param;
+  InnerProductParameter* inner_product_param =
+      layer_param.mutable_inner_product_param();
+  Caffe::set_mode(Caffe::CPU);
+  inner_product_param->set_num_output(10);
+  inner_product_param->mutable_weight_filler()->set_type("gaussian");
+  inner_product_param->mutable_bias_filler()->set_type("gaussian");
+  InnerProductLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  Blob<TypeParam> unfused_top;
+  unfused_top.CopyFrom(*this->blob_top_, false, true);
+  inner_product_param->set_fused_relu(true);
+  for (int mode = 0; mode < 2; ++mode) {
+    Caffe::set_mode(mode ? Caffe::GPU : Caffe::CPU);
+    InnerProductLayer<TypeParam> fused_layer(layer_param);
+    fused_layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    fused_layer.blobs()[0]->CopyFrom(*layer.blobs()[0]);
+    fused_layer.blobs()[1]->CopyFrom(*layer.blobs()[1]);
+    fused_layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    // The top is that of the layer followed by a ReLU.
+    const TypeParam* data = this->blob_top_->cpu_data();
+    for (int i = 0; i < unfused_top.count(); ++i) {
+      EXPECT_NEAR(data[i], std::max(unfused_top.cpu_data()[i],
+          TypeParam(0)), 1e-5);
+    }
+  }
+}
+
+TYPED_TEST(InnerProductLayerTest, TestCPUInt8) {
+  LayerParameter layer_param;
+  InnerProductParameter* inner_product_param =
+      layer_param.mutable_inner_product_param();
+  Caffe::set_mode(Caffe::CPU);
+  inner_product_param->set_num_output(10);
+  inner_product_param->mutable_weight_filler()->set_type("gaussian");
+  inner_product_param->mutable_bias_filler()->set_type("gaussian");
+  InnerProductLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  Blob<TypeParam> expected_top;
+  expected_top.CopyFrom(*this->blob_top_, false, true);
+  TypeParam range = 0;
+  for (int i = 0; i < expected_top.count(); ++i) {
+    range = std::max(range, std::fabs(expected_top.cpu_data()[i]));
+  }
+  // With the bottom range measured, and calibrated to the largest bottom
+  // value, 1 for the uniform filler
+  QuantizationParameter* quantization_param =
+      layer_param.mutable_quantization_param();
+  quantization_param->set_precision(QuantizationParameter::INT8);
+  for (int calibrated = 0; calibrated < 2; ++calibrated) {
+    quantization_param->set_bottom_range(calibrated);
+    InnerProductLayer<TypeParam> int8_layer(layer_param);
+    int8_layer.blobs() = layer.blobs();
+    int8_layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    int8_layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    for (int i = 0; i < expected_top.count(); ++i) {
+      EXPECT_NEAR(this->blob_top_->cpu_data()[i], expected_top.cpu_data()[i],
+          0.03 * range);
+    }
+  }
+}
+
+TYPED_TEST(InnerProductLayerTest, TestSparse) {
+  LayerParameter layer_param;
+  InnerProductParameter* inner_product_param =
+      layer_param.mutable_inner_product_param();
+  Caffe::set_mode(Caffe::CPU);
+  inner_product_param->set_num_output(10);
+  inner_product_param->mutable_weight_filler()->set_type("gaussian");
+  inner_product_param->mutable_bias_filler()->set_type("gaussian");
+  InnerProductLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  // Prune 3 weights in 4.
+  TypeParam* weights = layer.blobs()[0]->mutable_cpu_data();
+  for (int i = 0; i < layer.blobs()[0]->count(); ++i) {
+    if (i % 4) {
+      weights[i] = 0;
+    }
+  }
+  layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  Blob<TypeParam> expected_top;
+  expected_top.CopyFrom(*this->blob_top_, false, true);
+  inner_product_param->set_max_sparse_density(0.3);
+  for (int mode = 0; mode < 2; ++mode) {
+    Caffe::set_mode(mode ? Caffe::GPU : Caffe::CPU);
+    InnerProductLayer<TypeParam> sparse_layer(layer_param);
+    sparse_layer.blobs() = layer.blobs();
+    sparse_layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    sparse_layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    const TypeParam* data = this->blob_top_->cpu_data();
+    for (int i = 0; i < expected_top.count(); ++i) {
+      EXPECT_NEAR(data[i], expected_top.cpu_data()[i], 1e-5);
+    }
+  }
+}
+
 TYPED_TEST(InnerProductLayerTest, TestCPUGradient) {
   LayerParameter layer_param;
   InnerProductParameter* inner_product_param =
@@ -134,4 +236,107 @@ TYPED_TEST(InnerProductLayerTest, TestGPUGradient) {
   }
 }
 
+TYPED_TEST(InnerProductLayerTest, TestAccumulateParamDiffsCPU) {
+  LayerParameter layer_param;
+  InnerProductParameter* inner_product_param =
+      layer_param.mutable_inner_product_param();
+  Caffe::set_mode(Caffe::CPU);
+  inner_product_param->set_num_output(10);
+  inner_product_param->mutable_weight_filler()->set_type("gaussian");
+  inner_product_param->mutable_bias_filler()->set_type("gaussian");
+  InnerProductLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_top_);
+  caffe_copy(this->blob_top_->count(), this->blob_top_->cpu_data(),
+      this->blob_top_->mutable_cpu_diff());
+  layer.Backward(this->blob_top_vec_, true, &(this->blob_bottom_vec_));
+  vector<vector<TypeParam> > diffs(layer.blobs().size());
+  for (int i = 0; i < layer.blobs().size(); ++i) {
+    const Blob<TypeParam>& blob = *layer.blobs()[i];
+    diffs[i].assign(blob.cpu_diff(), blob.cpu_diff() + blob.count());
+  }
+  // A second backward pass adds the same gradients again.
+  layer.set_accumulate_param_diffs(true);
+  layer.Backward(this->blob_top_vec_, true, &(this->blob_bottom_vec_));
+  for (int i = 0; i < layer.blobs().size(); ++i) {
+    const Blob<TypeParam>& blob = *layer.blobs()[i];
+    for (int j = 0; j < blob.count(); ++j) {
+      EXPECT_NEAR(blob.cpu_diff()[j], 2 * diffs[i][j], 1e-4);
+    }
+  }
+}
+
+TYPED_TEST(InnerProductLayerTest, TestModelParallel) {
+  LayerParameter layer_param;
+  InnerProductParameter* inner_product_param =
+      layer_param.mutable_inner_product_param();
+  Caffe::set_mode(Caffe::GPU);
+  inner_product_param->set_num_output(10);
+  inner_product_param->mutable_weight_filler()->set_type("gaussian");
+  inner_product_param->mutable_bias_filler()->set_type("gaussian");
+  inner_product_param->set_fused_relu(true);
+  layer_param.add_blobs_lr(1);
+  layer_param.add_blobs_lr(2);
+  Caffe::set_random_seed(1701);
+  InnerProductLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  Blob<TypeParam> expected_top;
+  expected_top.CopyFrom(*this->blob_top_, false, true);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  Blob<TypeParam> top_diff;
+  top_diff.ReshapeLike(*this->blob_top_);
+  filler.Fill(&top_diff);
+  this->blob_top_->CopyFrom(top_diff, true);
+  layer.Backward(this->blob_top_vec_, true, &(this->blob_bottom_vec_));
+  Blob<TypeParam> expected_bottom_diff;
+  expected_bottom_diff.CopyFrom(*this->blob_bottom_, true, true);
+  // 3 slices of 3, 3 and 4 outputs, on the current device for the test to
+  // run on one GPU, with the parameters filled the same
+  int device;
+  CUDA_CHECK(cudaGetDevice(&device));
+  for (int i = 0; i < 3; ++i) {
+    inner_product_param->add_device_ids(device);
+  }
+  Caffe::set_random_seed(1701);
+  InnerProductLayer<TypeParam> split_layer(layer_param);
+  split_layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  ASSERT_EQ(split_layer.blobs().size(), 6);
+  ASSERT_EQ(split_layer.layer_param().blobs_lr_size(), 6);
+  EXPECT_EQ(split_layer.layer_param().blobs_lr(2), 1);
+  EXPECT_EQ(split_layer.layer_param().blobs_lr(3), 2);
+  EXPECT_EQ(split_layer.param_device(4), device);
+  split_layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  for (int i = 0; i < expected_top.count(); ++i) {
+    EXPECT_NEAR(this->blob_top_->cpu_data()[i], expected_top.cpu_data()[i],
+        1e-4);
+  }
+  this->blob_top_->CopyFrom(top_diff, true);
+  split_layer.Backward(this->blob_top_vec_, true, &(this->blob_bottom_vec_));
+  for (int i = 0; i < expected_bottom_diff.count(); ++i) {
+    EXPECT_NEAR(this->blob_bottom_->cpu_diff()[i],
+        expected_bottom_diff.cpu_diff()[i], 1e-4);
+  }
+  // The gradients of the slices are their rows of those of the layer.
+  const int num_inputs = this->blob_bottom_->count() /
+      this->blob_bottom_->num();
+  const int begins[] = { 0, 3, 6 };
+  for (int i = 0; i < 3; ++i) {
+    const Blob<TypeParam>& weights = *split_layer.blobs()[i];
+    for (int j = 0; j < weights.count(); ++j) {
+      EXPECT_NEAR(weights.cpu_diff()[j],
+          layer.blobs()[0]->cpu_diff()[begins[i] * num_inputs + j], 1e-4);
+    }
+    const Blob<TypeParam>& bias = *split_layer.blobs()[3 + i];
+    for (int j = 0; j < bias.count(); ++j) {
+      EXPECT_NEAR(bias.cpu_diff()[j],
+          layer.blobs()[1]->cpu_diff()[begins[i] + j], 1e-4);
+    }
+  }
+}
+
 }  // namespace caffe
@@ -0,0 +1,124 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/io.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class IOTest : public ::testing::Test {};
+
+TEST_F(IOTest, TestParseDatumWithoutData) {
+  Datum datum;
+  datum.set_channels(2);
+  datum.set_height(3);
+  datum.set_width(4);
+  datum.set_label(-1);
+  string* pixels = datum.mutable_data();
+  for (int i = 0; i < 24; ++i) {
+    pixels->push_back(static_cast<char>(i * 10));
+  }
+  const string value = datum.SerializeAsString();
+  Datum parsed;
+  const char* data;
+  int data_size;
+  EXPECT_TRUE(ParseDatumWithoutData(value.data(), value.size(), &parsed,
+                                    &data, &data_size));
+  EXPECT_EQ(parsed.channels(), 2);
+  EXPECT_EQ(parsed.height(), 3);
+  EXPECT_EQ(parsed.width(), 4);
+  EXPECT_EQ(parsed.label(), -1);
+  EXPECT_FALSE(parsed.has_data());
+  EXPECT_EQ(data_size, 24);
+  // The data points into the serialized value rather than into a copy.
+  EXPECT_GE(data, value.data());
+  EXPECT_LE(data + data_size, value.data() + value.size());
+  for (int i = 0; i < 24; ++i) {
+    EXPECT_EQ(data[i], static_cast<char>(i * 10));
+  }
+}
+
+TEST_F(IOTest, TestParseDatumWithoutDataFloat) {
+  Datum datum;
+  datum.set_channels(1);
+  datum.set_height(1);
+  datum.set_width(3);
+  datum.set_label(7);
+  for (int i = 0; i < 3; ++i) {
+    datum.add_float_data(i * 0.5);
+  }
+  const string value = datum.SerializeAsString();
+  Datum parsed;
+  const char* data;
+  int data_size;
+  EXPECT_TRUE(ParseDatumWithoutData(value.data(), value.size(), &parsed,
+                                    &data, &data_size));
+  EXPECT_EQ(parsed.label(), 7);
+  EXPECT_EQ(data_size, 0);
+  EXPECT_EQ(parsed.float_data_size(), 3);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(parsed.float_data(i), i * 0.5);
+  }
+}
+
+TEST_F(IOTest, TestParseUnpackedFloatData) {
+  // Databases written before float_data was packed have one tag per value.
+  Datum datum;
+  datum.set_channels(1);
+  datum.set_height(1);
+  datum.set_width(3);
+  string value = datum.SerializeAsString();
+  for (int i = 0; i < 3; ++i) {
+    const float float_value = i * 0.5;
+    value.push_back(static_cast<char>((Datum::kFloatDataFieldNumber << 3) | 5));
+    value.append(reinterpret_cast<const char*>(&float_value), sizeof(float));
+  }
+  Datum parsed;
+  const char* data;
+  int data_size;
+  EXPECT_TRUE(ParseDatumWithoutData(value.data(), value.size(), &parsed,
+                                    &data, &data_size));
+  EXPECT_EQ(data_size, 0);
+  EXPECT_EQ(parsed.float_data_size(), 3);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(parsed.float_data(i), i * 0.5);
+  }
+  // They are written back packed, all the values after a single tag.
+  EXPECT_LT(parsed.SerializeAsString().size(), value.size());
+}
+
+TEST_F(IOTest, TestReadImageToEncodedDatum) {
+  const string filename = "examples/images/cat.jpg";
+  Datum datum;
+  EXPECT_TRUE(ReadImageToDatum(filename, 5, &datum));
+  Datum encoded;
+  EXPECT_TRUE(ReadImageToEncodedDatum(filename, 5, &encoded));
+  EXPECT_TRUE(encoded.encoded());
+  EXPECT_EQ(encoded.label(), 5);
+  EXPECT_EQ(encoded.channels(), datum.channels());
+  EXPECT_EQ(encoded.height(), datum.height());
+  EXPECT_EQ(encoded.width(), datum.width());
+  EXPECT_LT(encoded.data().size(), datum.data().size());
+  // The encoded flag survives the parse that leaves the data in the buffer.
+  const string value = encoded.SerializeAsString();
+  Datum parsed;
+  const char* data;
+  int data_size;
+  EXPECT_TRUE(ParseDatumWithoutData(value.data(), value.size(), &parsed,
+                                    &data, &data_size));
+  EXPECT_TRUE(parsed.encoded());
+  // Decoding gives back the pixels of the unencoded datum.
+  string pixels;
+  EXPECT_TRUE(DecodeImageToPixels(data, data_size, datum.channels(),
+                                  datum.height(), datum.width(), &pixels));
+  EXPECT_EQ(pixels, datum.data());
+  // A shape that does not match is an error.
+  EXPECT_FALSE(DecodeImageToPixels(data, data_size, datum.channels(),
+                                   datum.height() + 1, datum.width(), &pixels));
+}
+
+}  // namespace caffe
@@ -140,6 +140,47 @@ TYPED_TEST(LRNLayerTest, TestCPUForwardAcrossChannels) {
   }
 }
 
+TYPED_TEST(LRNLayerTest, TestCPUThreadedForwardAcrossChannels) {
+  LayerParameter layer_param;
+  LRNLayer<TypeParam> layer(layer_param);
+  Caffe::set_mode(Caffe::CPU);
+  Caffe::set_cpu_threads(2);
+  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  Caffe::set_cpu_threads(1);
+  Blob<TypeParam> top_reference;
+  this->ReferenceLRNForward(*(this->blob_bottom_), layer_param,
+      &top_reference);
+  for (int i = 0; i < this->blob_bottom_->count(); ++i) {
+    EXPECT_NEAR(this->blob_top_->cpu_data()[i], top_reference.cpu_data()[i],
+                this->epsilon_);
+  }
+}
+
+TYPED_TEST(LRNLayerTest, TestCPUForwardAcrossChannelsTiled) {
+  // More positions than the CPU passes take at a time, and a beta other than
+  // the 0.75 computed with square roots
+  this->blob_bottom_->Reshape(2, 13, 20, 20);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  for (int beta = 0; beta < 2; ++beta) {
+    LayerParameter layer_param;
+    layer_param.mutable_lrn_param()->set_beta(beta ? 0.6 : 0.75);
+    LRNLayer<TypeParam> layer(layer_param);
+    Caffe::set_mode(Caffe::CPU);
+    layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    Blob<TypeParam> top_reference;
+    this->ReferenceLRNForward(*(this->blob_bottom_), layer_param,
+        &top_reference);
+    for (int i = 0; i < this->blob_bottom_->count(); ++i) {
+      EXPECT_NEAR(this->blob_top_->cpu_data()[i], top_reference.cpu_data()[i],
+                  this->epsilon_);
+    }
+  }
+}
+
 TYPED_TEST(LRNLayerTest, TestGPUForwardAcrossChannels) {
   LayerParameter layer_param;
   LRNLayer<TypeParam> layer(layer_param);
@@ -224,6 +265,32 @@ TYPED_TEST(LRNLayerTest, TestCPUForwardWithinChannel) {
   }
 }
 
+TYPED_TEST(LRNLayerTest, TestCPUGPUForwardWithinChannelSize5) {
+  // Windows clipped on some sides only, and larger than the channels
+  this->blob_bottom_->Reshape(2, 3, 4, 7);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  layer_param.mutable_lrn_param()->set_norm_region(
+      LRNParameter_NormRegion_WITHIN_CHANNEL);
+  layer_param.mutable_lrn_param()->set_local_size(5);
+  layer_param.mutable_lrn_param()->set_alpha(2.);
+  Blob<TypeParam> top_reference;
+  this->ReferenceLRNForward(*(this->blob_bottom_), layer_param,
+      &top_reference);
+  for (int mode = 0; mode < 2; ++mode) {
+    Caffe::set_mode(mode == 0 ? Caffe::CPU : Caffe::GPU);
+    LRNLayer<TypeParam> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    for (int i = 0; i < this->blob_bottom_->count(); ++i) {
+      EXPECT_NEAR(this->blob_top_->cpu_data()[i],
+          top_reference.cpu_data()[i], this->epsilon_);
+    }
+  }
+}
+
 TYPED_TEST(LRNLayerTest, TestGPUForwardWithinChannel) {
   LayerParameter layer_param;
   layer_param.mutable_lrn_param()->set_norm_region(
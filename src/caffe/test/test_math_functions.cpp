@@ -5,6 +5,7 @@
 #include <climits>
 #include <cmath>  // for std::fabs
 #include <cstdlib>  // for rand_r
+#include <vector>
 
 #include "gtest/gtest.h"
 #include "caffe/blob.hpp"
@@ -14,6 +15,8 @@
 
 #include "caffe/test/test_caffe_main.hpp"
 
+using std::vector;
+
 namespace caffe {
 
 template<typename Dtype>
@@ -227,4 +230,211 @@ TYPED_TEST(MathFunctionsTest, TestCopyGPU) {
   }
 }
 
+TYPED_TEST(MathFunctionsTest, TestExpLogCPU) {
+  const int n = this->blob_bottom_->count();
+  TypeParam* x = this->blob_bottom_->mutable_cpu_data();
+  // Over the range where exp is a normal float, and a few outside it
+  caffe_scal<TypeParam>(n, TypeParam(30), x);
+  x[0] = -100;
+  x[1] = 100;
+  TypeParam* y = this->blob_top_->mutable_cpu_data();
+  caffe_exp<TypeParam>(n, x, y);
+  for (int i = 0; i < n; ++i) {
+    const TypeParam expected = std::exp(x[i]);
+    EXPECT_NEAR(y[i], expected, expected * 1e-6);
+  }
+  caffe_log<TypeParam>(n, y, this->blob_top_->mutable_cpu_diff());
+  const TypeParam* log_y = this->blob_top_->cpu_diff();
+  for (int i = 2; i < n; ++i) {
+    const TypeParam expected = std::log(y[i]);
+    EXPECT_NEAR(log_y[i], expected, std::fabs(expected) * 1e-6);
+  }
+}
+
+TYPED_TEST(MathFunctionsTest, TestTanhSigmoidPowxCPU) {
+  const int n = this->blob_bottom_->count();
+  TypeParam* x = this->blob_bottom_->mutable_cpu_data();
+  caffe_scal<TypeParam>(n, TypeParam(5), x);
+  TypeParam* y = this->blob_top_->mutable_cpu_data();
+  caffe_tanh<TypeParam>(n, x, y);
+  for (int i = 0; i < n; ++i) {
+    const TypeParam expected = std::tanh(x[i]);
+    EXPECT_NEAR(y[i], expected, std::fabs(expected) * 1e-6);
+  }
+  caffe_sigmoid<TypeParam>(n, x, y);
+  for (int i = 0; i < n; ++i) {
+    const TypeParam expected = 1 / (1 + std::exp(-x[i]));
+    EXPECT_NEAR(y[i], expected, expected * 1e-6);
+  }
+  // The powers of positive numbers of LRN, e.g. scale^-beta
+  caffe_powx<TypeParam>(n, y, TypeParam(-0.75), this->blob_top_->
+      mutable_cpu_diff());
+  const TypeParam* pow_y = this->blob_top_->cpu_diff();
+  for (int i = 0; i < n; ++i) {
+    const TypeParam expected = std::pow(y[i], TypeParam(-0.75));
+    EXPECT_NEAR(pow_y[i], expected, expected * 2e-6);
+  }
+}
+
+TYPED_TEST(MathFunctionsTest, TestElementwiseThreadsCPU) {
+  // The blobs are large enough to be split over 2 threads: split or not,
+  // the elementwise functions give the same results.
+  const int n = this->blob_bottom_->count();
+  ASSERT_GT(n, 2 * kCpuElementwiseGrain);
+  const TypeParam* a = this->blob_bottom_->cpu_data();
+  const TypeParam* b = this->blob_top_->cpu_data();
+  vector<TypeParam> serial(n);
+  vector<TypeParam> parallel(n);
+  for (int threads = 1; threads <= 2; ++threads) {
+    Caffe::set_cpu_threads(threads);
+    TypeParam* y = threads == 1 ? &serial[0] : &parallel[0];
+    caffe_mul<TypeParam>(n, a, b, y);
+    caffe_add<TypeParam>(n, a, y, y);
+    caffe_exp<TypeParam>(n, y, y);
+    caffe_cpu_scale<TypeParam>(n, TypeParam(0.5), y, y);
+    caffe_add_scalar<TypeParam>(n, TypeParam(1), y);
+  }
+  Caffe::set_cpu_threads(1);
+  for (int i = 0; i < n; ++i) {
+    EXPECT_EQ(serial[i], parallel[i]);
+  }
+}
+
+TYPED_TEST(MathFunctionsTest, TestSgdUpdateCPU) {
+  const int n = this->blob_bottom_->count();
+  const TypeParam rate = 0.01, momentum = 0.9, decay = 0.0005;
+  // The weights, their gradients and a history
+  Blob<TypeParam>& weights = *this->blob_bottom_;
+  const TypeParam* diff = this->blob_top_->cpu_data();
+  caffe_copy(n, diff, weights.mutable_cpu_diff());
+  caffe_scal(n, TypeParam(-0.5), weights.mutable_cpu_diff());
+  vector<TypeParam> expected_history(n), expected_data(n);
+  for (int i = 0; i < n; ++i) {
+    expected_history[i] = momentum * weights.cpu_diff()[i] +
+        rate * (diff[i] + decay * weights.cpu_data()[i]);
+    expected_data[i] = weights.cpu_data()[i] - expected_history[i];
+  }
+  caffe_cpu_sgd_update(n, rate, momentum, decay, diff,
+      weights.mutable_cpu_diff(), weights.mutable_cpu_data());
+  for (int i = 0; i < n; ++i) {
+    EXPECT_NEAR(expected_history[i], weights.cpu_diff()[i], 1e-6);
+    EXPECT_NEAR(expected_data[i], weights.cpu_data()[i], 1e-6);
+  }
+}
+
+TYPED_TEST(MathFunctionsTest, TestSgdUpdateGPU) {
+  const int n = this->blob_bottom_->count();
+  const TypeParam rate = 0.01, momentum = 0.9, decay = 0.0005;
+  Blob<TypeParam>& weights = *this->blob_bottom_;
+  const TypeParam* diff = this->blob_top_->cpu_data();
+  caffe_copy(n, diff, weights.mutable_cpu_diff());
+  caffe_scal(n, TypeParam(-0.5), weights.mutable_cpu_diff());
+  vector<TypeParam> expected_history(n), expected_data(n);
+  for (int i = 0; i < n; ++i) {
+    expected_history[i] = momentum * weights.cpu_diff()[i] +
+        rate * (diff[i] + decay * weights.cpu_data()[i]);
+    expected_data[i] = weights.cpu_data()[i] - expected_history[i];
+  }
+  caffe_gpu_sgd_update(n, rate, momentum, decay, this->blob_top_->gpu_data(),
+      weights.mutable_gpu_diff(), weights.mutable_gpu_data());
+  for (int i = 0; i < n; ++i) {
+    EXPECT_NEAR(expected_history[i], weights.cpu_diff()[i], 1e-6);
+    EXPECT_NEAR(expected_data[i], weights.cpu_data()[i], 1e-6);
+  }
+}
+
+TYPED_TEST(MathFunctionsTest, TestNesterovUpdateCPU) {
+  const int n = this->blob_bottom_->count();
+  const TypeParam rate = 0.01, momentum = 0.9, decay = 0.0005;
+  Blob<TypeParam>& weights = *this->blob_bottom_;
+  const TypeParam* diff = this->blob_top_->cpu_data();
+  caffe_copy(n, diff, weights.mutable_cpu_diff());
+  caffe_scal(n, TypeParam(-0.5), weights.mutable_cpu_diff());
+  vector<TypeParam> expected_history(n), expected_data(n);
+  for (int i = 0; i < n; ++i) {
+    const TypeParam h = weights.cpu_diff()[i];
+    const TypeParam w = weights.cpu_data()[i];
+    expected_history[i] = momentum * h + rate * (diff[i] + decay * w);
+    expected_data[i] = w - (1 + momentum) * expected_history[i] +
+        momentum * h;
+  }
+  caffe_cpu_nesterov_update(n, rate, momentum, decay,
+      this->blob_top_->cpu_data(), weights.mutable_cpu_diff(),
+      weights.mutable_cpu_data());
+  for (int i = 0; i < n; ++i) {
+    EXPECT_NEAR(expected_history[i], weights.cpu_diff()[i], 1e-5);
+    EXPECT_NEAR(expected_data[i], weights.cpu_data()[i], 1e-5);
+  }
+}
+
+TYPED_TEST(MathFunctionsTest, TestNesterovUpdateGPU) {
+  const int n = this->blob_bottom_->count();
+  const TypeParam rate = 0.01, momentum = 0.9, decay = 0.0005;
+  Blob<TypeParam>& weights = *this->blob_bottom_;
+  const TypeParam* diff = this->blob_top_->cpu_data();
+  caffe_copy(n, diff, weights.mutable_cpu_diff());
+  caffe_scal(n, TypeParam(-0.5), weights.mutable_cpu_diff());
+  vector<TypeParam> expected_history(n), expected_data(n);
+  for (int i = 0; i < n; ++i) {
+    const TypeParam h = weights.cpu_diff()[i];
+    const TypeParam w = weights.cpu_data()[i];
+    expected_history[i] = momentum * h + rate * (diff[i] + decay * w);
+    expected_data[i] = w - (1 + momentum) * expected_history[i] +
+        momentum * h;
+  }
+  caffe_gpu_nesterov_update(n, rate, momentum, decay,
+      this->blob_top_->gpu_data(), weights.mutable_gpu_diff(),
+      weights.mutable_gpu_data());
+  for (int i = 0; i < n; ++i) {
+    EXPECT_NEAR(expected_history[i], weights.cpu_diff()[i], 1e-5);
+    EXPECT_NEAR(expected_data[i], weights.cpu_data()[i], 1e-5);
+  }
+}
+
+TYPED_TEST(MathFunctionsTest, TestAdaGradUpdateCPU) {
+  const int n = this->blob_bottom_->count();
+  const TypeParam rate = 0.01, delta = 1e-8, decay = 0.0005;
+  Blob<TypeParam>& weights = *this->blob_bottom_;
+  const TypeParam* diff = this->blob_top_->cpu_data();
+  caffe_copy(n, diff, weights.mutable_cpu_diff());
+  caffe_powx(n, weights.cpu_diff(), TypeParam(2), weights.mutable_cpu_diff());
+  vector<TypeParam> expected_history(n), expected_data(n);
+  for (int i = 0; i < n; ++i) {
+    const TypeParam h = weights.cpu_diff()[i];
+    const TypeParam w = weights.cpu_data()[i];
+    const TypeParam g = diff[i] + decay * w;
+    expected_history[i] = h + g * g;
+    expected_data[i] = w - rate * g / (sqrt(expected_history[i]) + delta);
+  }
+  caffe_cpu_adagrad_update(n, rate, delta, decay, this->blob_top_->cpu_data(),
+      weights.mutable_cpu_diff(), weights.mutable_cpu_data());
+  for (int i = 0; i < n; ++i) {
+    EXPECT_NEAR(expected_history[i], weights.cpu_diff()[i], 1e-5);
+    EXPECT_NEAR(expected_data[i], weights.cpu_data()[i], 1e-5);
+  }
+}
+
+TYPED_TEST(MathFunctionsTest, TestAdaGradUpdateGPU) {
+  const int n = this->blob_bottom_->count();
+  const TypeParam rate = 0.01, delta = 1e-8, decay = 0.0005;
+  Blob<TypeParam>& weights = *this->blob_bottom_;
+  const TypeParam* diff = this->blob_top_->cpu_data();
+  caffe_copy(n, diff, weights.mutable_cpu_diff());
+  caffe_powx(n, weights.cpu_diff(), TypeParam(2), weights.mutable_cpu_diff());
+  vector<TypeParam> expected_history(n), expected_data(n);
+  for (int i = 0; i < n; ++i) {
+    const TypeParam h = weights.cpu_diff()[i];
+    const TypeParam w = weights.cpu_data()[i];
+    const TypeParam g = diff[i] + decay * w;
+    expected_history[i] = h + g * g;
+    expected_data[i] = w - rate * g / (sqrt(expected_history[i]) + delta);
+  }
+  caffe_gpu_adagrad_update(n, rate, delta, decay, this->blob_top_->gpu_data(),
+      weights.mutable_gpu_diff(), weights.mutable_gpu_data());
+  for (int i = 0; i < n; ++i) {
+    EXPECT_NEAR(expected_history[i], weights.cpu_diff()[i], 1e-5);
+    EXPECT_NEAR(expected_data[i], weights.cpu_data()[i], 1e-5);
+  }
+}
+
 }  // namespace caffe
@@ -1,5 +1,8 @@
 // Copyright 2014 BVLC and contributors.
 
+#include <unistd.h>
+
+#include <sstream>
 #include <vector>
 
 #include "caffe/filler.hpp"
@@ -105,4 +108,170 @@ TYPED_TEST(MemoryDataLayerTest, TestForward) {
   }
 }
 
+// stage the host arrays on the device a few batches at a time, over a number
+// of batches that is not a multiple of the window
+TYPED_TEST(MemoryDataLayerTest, TestForwardGPUStaged) {
+  Caffe::set_mode(Caffe::GPU);
+  LayerParameter layer_param;
+  MemoryDataParameter* md_param = layer_param.mutable_memory_data_param();
+  md_param->set_batch_size(this->batch_size_);
+  md_param->set_channels(this->channels_);
+  md_param->set_height(this->height_);
+  md_param->set_width(this->width_);
+  md_param->set_stage_batches(5);
+  shared_ptr<MemoryDataLayer<TypeParam> > layer(
+      new MemoryDataLayer<TypeParam>(layer_param));
+  layer->SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  layer->Reset(this->data_->mutable_cpu_data(),
+      this->labels_->mutable_cpu_data(), this->data_->num());
+  for (int i = 0; i < this->batches_ * 3; ++i) {
+    int batch_num = i % this->batches_;
+    layer->Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    for (int j = 0; j < this->data_blob_->count(); ++j) {
+      EXPECT_EQ(this->data_blob_->cpu_data()[j],
+          this->data_->cpu_data()[
+              this->data_->offset(1) * this->batch_size_ * batch_num + j]);
+    }
+    for (int j = 0; j < this->label_blob_->count(); ++j) {
+      EXPECT_EQ(this->label_blob_->cpu_data()[j],
+          this->labels_->cpu_data()[this->batch_size_ * batch_num + j]);
+    }
+  }
+}
+
+// queue a second pair of arrays and check that it follows the first one
+TYPED_TEST(MemoryDataLayerTest, TestResetNext) {
+  Caffe::Brew modes[] = { Caffe::CPU, Caffe::GPU };
+  for (int m = 0; m < 2; ++m) {
+    Caffe::set_mode(modes[m]);
+    LayerParameter layer_param;
+    MemoryDataParameter* md_param = layer_param.mutable_memory_data_param();
+    md_param->set_batch_size(this->batch_size_);
+    md_param->set_channels(this->channels_);
+    md_param->set_height(this->height_);
+    md_param->set_width(this->width_);
+    md_param->set_stage_batches(5);
+    const int next_batches = 3;
+    Blob<TypeParam> next_data(next_batches * this->batch_size_,
+        this->channels_, this->height_, this->width_);
+    Blob<TypeParam> next_labels(next_batches * this->batch_size_, 1, 1, 1);
+    FillerParameter filler_param;
+    GaussianFiller<TypeParam> filler(filler_param);
+    filler.Fill(&next_data);
+    filler.Fill(&next_labels);
+    shared_ptr<MemoryDataLayer<TypeParam> > layer(
+        new MemoryDataLayer<TypeParam>(layer_param));
+    layer->SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    layer->Reset(this->data_->mutable_cpu_data(),
+        this->labels_->mutable_cpu_data(), this->data_->num());
+    layer->ResetNext(next_data.mutable_cpu_data(),
+        next_labels.mutable_cpu_data(), next_data.num());
+    EXPECT_TRUE(layer->has_next());
+    for (int i = 0; i < this->batches_ + next_batches * 2; ++i) {
+      const bool first = i < this->batches_;
+      const int batch_num = first ? i : (i - this->batches_) % next_batches;
+      const Blob<TypeParam>* data = first ? this->data_ : &next_data;
+      const Blob<TypeParam>* labels = first ? this->labels_ : &next_labels;
+      layer->Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+      EXPECT_EQ(layer->has_next(), i < this->batches_ - 1);
+      for (int j = 0; j < this->data_blob_->count(); ++j) {
+        EXPECT_EQ(this->data_blob_->cpu_data()[j], data->cpu_data()[
+            data->offset(1) * this->batch_size_ * batch_num + j]);
+      }
+      for (int j = 0; j < this->label_blob_->count(); ++j) {
+        EXPECT_EQ(this->label_blob_->cpu_data()[j],
+            labels->cpu_data()[this->batch_size_ * batch_num + j]);
+      }
+    }
+  }
+}
+
+// Each batch is read in place from the segment, and outputs written to
+// another one are seen by all of its mappings.
+TYPED_TEST(MemoryDataLayerTest, TestResetShared) {
+  Caffe::set_mode(Caffe::CPU);
+  LayerParameter layer_param;
+  MemoryDataParameter* md_param = layer_param.mutable_memory_data_param();
+  md_param->set_batch_size(this->batch_size_);
+  md_param->set_channels(this->channels_);
+  md_param->set_height(this->height_);
+  md_param->set_width(this->width_);
+  std::ostringstream name;
+  name << "/caffe_test_memory_data_" << getpid();
+  const int n = this->data_->num();
+  const size_t offset = 64;
+  shared_ptr<SharedMemorySegment> segment(new SharedMemorySegment(
+      name.str(), SharedMemorySegment::CREATE,
+      offset + sizeof(TypeParam) * (this->data_->count() + n)));
+  TypeParam* data = reinterpret_cast<TypeParam*>(
+      static_cast<char*>(segment->data()) + offset);
+  caffe_copy(this->data_->count(), this->data_->cpu_data(), data);
+  caffe_copy(n, this->labels_->cpu_data(), data + this->data_->count());
+  MemoryDataLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  layer.ResetShared(segment, offset, n);
+  layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  EXPECT_EQ(data, this->data_blob_->cpu_data());
+  EXPECT_EQ(data + this->data_->count(), this->label_blob_->cpu_data());
+  layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  EXPECT_EQ(data + this->data_->offset(this->batch_size_),
+      this->data_blob_->cpu_data());
+  // An output in a segment the frontend opened
+  SharedMemorySegment frontend(name.str(), SharedMemorySegment::OPEN);
+  EXPECT_EQ(segment->size(), frontend.size());
+  Blob<TypeParam> output(2, 3, 1, 1);
+  output.set_cpu_segment(segment, 0);
+  output.mutable_cpu_data()[5] = 7;
+  EXPECT_EQ(7, static_cast<const TypeParam*>(frontend.data())[5]);
+  EXPECT_EQ(this->data_->cpu_data()[0],
+      reinterpret_cast<const TypeParam*>(
+          static_cast<const char*>(frontend.data()) + offset)[0]);
+}
+
+// Each batch popped from the feed is read in place, and held by the layer
+// until the next one.
+TYPED_TEST(MemoryDataLayerTest, TestFeed) {
+  Caffe::set_mode(Caffe::CPU);
+  LayerParameter layer_param;
+  MemoryDataParameter* md_param = layer_param.mutable_memory_data_param();
+  md_param->set_batch_size(this->batch_size_);
+  md_param->set_channels(this->channels_);
+  md_param->set_height(this->height_);
+  md_param->set_width(this->width_);
+  MemoryDataLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  typename MemoryDataLayer<TypeParam>::Feed feed;
+  layer.set_feed(&feed);
+  vector<shared_ptr<MemoryBatch<TypeParam> > > batches;
+  for (int i = 0; i < 2; ++i) {
+    shared_ptr<MemoryBatch<TypeParam> > batch(new MemoryBatch<TypeParam>());
+    batch->data.Reshape(this->batch_size_, this->channels_, this->height_,
+        this->width_);
+    batch->labels.Reshape(this->batch_size_, 1, 1, 1);
+    caffe_copy(batch->data.count(),
+        this->data_->cpu_data() + i * batch->data.count(),
+        batch->data.mutable_cpu_data());
+    caffe_copy(batch->labels.count(),
+        this->labels_->cpu_data() + i * batch->labels.count(),
+        batch->labels.mutable_cpu_data());
+    feed.push(batch);
+    batches.push_back(batch);
+  }
+  for (int i = 0; i < 2; ++i) {
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    EXPECT_EQ(batches[i]->data.cpu_data(), this->data_blob_->cpu_data());
+    EXPECT_EQ(batches[i]->labels.cpu_data(), this->label_blob_->cpu_data());
+    EXPECT_EQ(2, batches[i].use_count());
+    if (i > 0) {
+      EXPECT_EQ(1, batches[i - 1].use_count());
+    }
+  }
+  EXPECT_EQ(this->data_->cpu_data()[batches[0]->data.count()],
+      this->data_blob_->cpu_data()[0]);
+  EXPECT_EQ(this->labels_->cpu_data()[this->batch_size_],
+      this->label_blob_->cpu_data()[0]);
+  layer.set_feed(NULL);
+  EXPECT_EQ(1, batches[1].use_count());
+}
+
 }  // namespace caffe
@@ -0,0 +1,141 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <cstring>
+
+#include "gtest/gtest.h"
+#include "caffe/common.hpp"
+#include "caffe/util/memory_pool.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class MemoryPoolTest : public ::testing::Test {
+ protected:
+  virtual void TearDown() {
+    MemoryPool::Get().set_caching(true);
+    MemoryPool::Get().set_huge_page_threshold(0);
+  }
+};
+
+TEST_F(MemoryPoolTest, TestSizeClass) {
+  EXPECT_EQ(MemoryPool::SizeClass(1), 256);
+  EXPECT_EQ(MemoryPool::SizeClass(256), 256);
+  EXPECT_EQ(MemoryPool::SizeClass(257), 320);
+  EXPECT_EQ(MemoryPool::SizeClass(1000), 1024);
+  EXPECT_EQ(MemoryPool::SizeClass(1025), 1280);
+  for (size_t size = 1; size < (1 << 20); size = size * 3 + 1) {
+    const size_t size_class = MemoryPool::SizeClass(size);
+    EXPECT_GE(size_class, size);
+    if (size > 256) {
+      EXPECT_LE(size_class, size + size / 4);
+    }
+    EXPECT_EQ(MemoryPool::SizeClass(size_class), size_class);
+  }
+}
+
+TEST_F(MemoryPoolTest, TestHostReuse) {
+  MemoryPool& pool = MemoryPool::Get();
+  const MemoryPoolStats before = pool.stats();
+  MemoryPool::Kind kind = MemoryPool::HOST;
+  void* ptr = pool.Allocate(1000, &kind);
+  EXPECT_TRUE(ptr);
+  EXPECT_EQ(kind, MemoryPool::HOST);
+  MemoryPoolStats stats = pool.stats();
+  EXPECT_EQ(stats.in_use, before.in_use + 1024);
+  EXPECT_EQ(stats.requested, before.requested + 1000);
+  EXPECT_GE(stats.peak_in_use, stats.in_use);
+  pool.Free(ptr);
+  stats = pool.stats();
+  EXPECT_EQ(stats.in_use, before.in_use);
+  EXPECT_EQ(stats.cached, before.cached + 1024);
+  // A request of the same size class gets the cached block back.
+  void* reused = pool.Allocate(900, &kind);
+  EXPECT_EQ(reused, ptr);
+  stats = pool.stats();
+  EXPECT_EQ(stats.cache_hits, before.cache_hits + 1);
+  EXPECT_EQ(stats.allocations, before.allocations + 2);
+  EXPECT_EQ(stats.cached, before.cached);
+  pool.Free(reused);
+}
+
+TEST_F(MemoryPoolTest, TestNoCaching) {
+  MemoryPool& pool = MemoryPool::Get();
+  pool.set_caching(false);
+  EXPECT_EQ(pool.stats().cached, 0);
+  MemoryPool::Kind kind = MemoryPool::HOST;
+  void* ptr = pool.Allocate(5000, &kind);
+  EXPECT_TRUE(ptr);
+  pool.Free(ptr);
+  EXPECT_EQ(pool.stats().cached, 0);
+}
+
+TEST_F(MemoryPoolTest, TestHugePages) {
+  MemoryPool& pool = MemoryPool::Get();
+  pool.set_huge_page_threshold(4 << 20);
+  const MemoryPoolStats before = pool.stats();
+  MemoryPool::Kind kind = MemoryPool::HOST;
+  // Below the threshold, the blocks are those of malloc.
+  void* small = pool.Allocate(1000, &kind);
+  EXPECT_EQ(pool.stats().in_use, before.in_use + 1024);
+  void* large = pool.Allocate(5 << 20, &kind);
+  const MemoryPoolStats stats = pool.stats();
+  if (stats.huge_pages > before.huge_pages) {
+    // Whole huge pages, aligned to them
+    EXPECT_EQ(stats.huge_pages, before.huge_pages + (6 << 20));
+    EXPECT_EQ(stats.in_use, before.in_use + 1024 + (6 << 20));
+    EXPECT_EQ(reinterpret_cast<size_t>(large) % (2 << 20), 0);
+  }
+  memset(large, 0, 5 << 20);
+  pool.Free(small);
+  pool.Free(large);
+  pool.ReleaseCached(MemoryPool::HOST);
+  EXPECT_EQ(pool.stats().huge_pages, before.huge_pages);
+}
+
+TEST_F(MemoryPoolTest, TestDeviceReuse) {
+  MemoryPool& pool = MemoryPool::Get();
+  const MemoryPoolStats before = pool.stats();
+  MemoryPool::Kind kind = MemoryPool::DEVICE;
+  void* ptr = pool.Allocate(1 << 20, &kind);
+  EXPECT_TRUE(ptr);
+  EXPECT_EQ(kind, MemoryPool::DEVICE);
+  pool.Free(ptr);
+  void* reused = pool.Allocate((1 << 20) - 100, &kind);
+  EXPECT_EQ(reused, ptr);
+  EXPECT_EQ(pool.stats().cache_hits, before.cache_hits + 1);
+  pool.Free(reused);
+  pool.ReleaseCached(MemoryPool::DEVICE);
+  EXPECT_LE(pool.stats().cached, before.cached);
+}
+
+TEST_F(MemoryPoolTest, TestUsage) {
+  MemoryPool& pool = MemoryPool::Get();
+  const int owner = pool.Owner("TestUsage");
+  EXPECT_EQ(pool.Owner("TestUsage"), owner);
+  const MemoryUsage before = pool.category_usage(MEMORY_BUFFERS);
+  MemoryPool::Kind kind = MemoryPool::HOST;
+  void* ptr = pool.Allocate(1000, &kind, MemoryTag(owner, MEMORY_BUFFERS));
+  MemoryUsage usage = pool.owner_usage("TestUsage");
+  EXPECT_EQ(usage.host, 1024);
+  EXPECT_EQ(usage.device, 0);
+  EXPECT_EQ(pool.category_usage(MEMORY_BUFFERS).host, before.host + 1024);
+  // Retagging moves the block to the other category.
+  pool.Retag(ptr, MemoryTag(owner, MEMORY_SOLVER));
+  EXPECT_EQ(pool.category_usage(MEMORY_BUFFERS).host, before.host);
+  pool.Free(ptr);
+  usage = pool.owner_usage("TestUsage");
+  EXPECT_EQ(usage.host, 0);
+  EXPECT_EQ(usage.peak_host, 1024);
+  // Without an owner of its own, a block goes to that of the scope.
+  {
+    MemoryScope scope(MemoryTag(owner, MEMORY_BUFFERS));
+    ptr = pool.Allocate(3000, &kind);
+    EXPECT_EQ(pool.owner_usage("TestUsage").host, 3072);
+  }
+  pool.Free(ptr);
+  EXPECT_EQ(pool.owner_usage("TestUsage").peak_host, 3072);
+  pool.LogUsage();
+}
+
+}  // namespace caffe
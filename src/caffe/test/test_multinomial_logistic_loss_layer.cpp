@@ -60,4 +60,14 @@ TYPED_TEST(MultinomialLogisticLossLayerTest, TestGradientCPU) {
       &(this->blob_top_vec_), 0, -1, -1);
 }
 
+TYPED_TEST(MultinomialLogisticLossLayerTest, TestGradientGPU) {
+  LayerParameter layer_param;
+  Caffe::set_mode(Caffe::GPU);
+  MultinomialLogisticLossLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+  GradientChecker<TypeParam> checker(1e-2, 2*1e-2, 1701, 0, 0.05);
+  checker.CheckGradientSingle(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_), 0, -1, -1);
+}
+
 }  // namespace caffe
@@ -2,12 +2,22 @@
 
 #include <google/protobuf/text_format.h>
 #include <leveldb/db.h>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>  // NOLINT(readability/streams)
 #include <sstream>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "gtest/gtest.h"
 #include "caffe/common.hpp"
+#include "caffe/filler.hpp"
 #include "caffe/net.hpp"
+#include "caffe/parallel.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/raw_weights.hpp"
 #include "caffe/test/test_gradient_check_util.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
@@ -86,6 +96,125 @@ class NetTest : public ::testing::Test {
         "' " + proto_suffix;
   }
 
+  // A deeper net, whose blobs data and ip2 do not live at the same time,
+  // ending with a softmax output or with a loss.
+  string DeepProto(const bool loss) {
+    const string& inner_product =
+        "  weight_filler { "
+        "    type: 'gaussian' "
+        "    std: 0.01 "
+        "  } ";
+    return
+        "name: 'TestNetwork' "
+        "layers: { "
+        "  name: 'data' "
+        "  type: DATA "
+        "  data_param { "
+        "    source: '" + string(this->filename_) + "' "
+        "    batch_size: 2 "
+        "  } "
+        "  top: 'data' "
+        "  top: 'label' "
+        "} "
+        "layers: { "
+        "  name: 'ip1' "
+        "  type: INNER_PRODUCT "
+        "  inner_product_param { "
+        "    num_output: 10 " + inner_product +
+        "  } "
+        "  bottom: 'data' "
+        "  top: 'ip1' "
+        "} "
+        "layers: { "
+        "  name: 'relu1' "
+        "  type: RELU "
+        "  bottom: 'ip1' "
+        "  top: 'ip1' "
+        "} "
+        "layers: { "
+        "  name: 'ip2' "
+        "  type: INNER_PRODUCT "
+        "  inner_product_param { "
+        "    num_output: 5 " + inner_product +
+        "  } "
+        "  bottom: 'ip1' "
+        "  top: 'ip2' "
+        "} " + (loss ?
+        "layers: { "
+        "  name: 'loss' "
+        "  type: SOFTMAX_LOSS "
+        "  bottom: 'ip2' "
+        "  bottom: 'label' "
+        "} " :
+        "layers: { "
+        "  name: 'prob' "
+        "  type: SOFTMAX "
+        "  bottom: 'ip2' "
+        "  top: 'prob' "
+        "} ");
+  }
+
+  // A net with two neuron layers n1 and n2, computing the blobs of the same
+  // names, not in place, between two inner product layers.
+  string NeuronProto(const string& neuron1, const string& neuron2) {
+    return
+        "name: 'TestNetwork' "
+        "layers: { "
+        "  name: 'data' "
+        "  type: DATA "
+        "  data_param { "
+        "    source: '" + string(this->filename_) + "' "
+        "    batch_size: 2 "
+        "  } "
+        "  top: 'data' "
+        "  top: 'label' "
+        "} "
+        "layers: { "
+        "  name: 'ip1' "
+        "  type: INNER_PRODUCT "
+        "  inner_product_param { "
+        "    num_output: 10 "
+        "    weight_filler { "
+        "      type: 'gaussian' "
+        "      std: 0.1 "
+        "    } "
+        "  } "
+        "  bottom: 'data' "
+        "  top: 'ip1' "
+        "} "
+        "layers: { "
+        "  name: 'n1' "
+        "  type: " + neuron1 + " "
+        "  bottom: 'ip1' "
+        "  top: 'n1' "
+        "} "
+        "layers: { "
+        "  name: 'n2' "
+        "  type: " + neuron2 + " "
+        "  bottom: 'n1' "
+        "  top: 'n2' "
+        "} "
+        "layers: { "
+        "  name: 'ip2' "
+        "  type: INNER_PRODUCT "
+        "  inner_product_param { "
+        "    num_output: 5 "
+        "    weight_filler { "
+        "      type: 'gaussian' "
+        "      std: 0.1 "
+        "    } "
+        "  } "
+        "  bottom: 'n2' "
+        "  top: 'ip2' "
+        "} "
+        "layers: { "
+        "  name: 'loss' "
+        "  type: SOFTMAX_LOSS "
+        "  bottom: 'ip2' "
+        "  bottom: 'label' "
+        "} ";
+  }
+
   char* filename_;
   string proto_;
 };
@@ -133,4 +262,1300 @@ TYPED_TEST(NetTest, TestGetLayerByName) {
   EXPECT_FALSE(net.layer_by_name("label"));
 }
 
+TYPED_TEST(NetTest, TestInferenceHasNoDiff) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->proto_, &param));
+  param.set_inference(true);
+  Net<TypeParam> net(param);
+  EXPECT_TRUE(net.inference());
+  net.ForwardPrefilled();
+  for (int i = 0; i < net.blobs().size(); ++i) {
+    EXPECT_FALSE(net.blobs()[i]->has_diff()) << net.blob_names()[i];
+  }
+  for (int i = 0; i < net.params().size(); ++i) {
+    EXPECT_FALSE(net.params()[i]->has_diff());
+  }
+}
+
+TYPED_TEST(NetTest, TestShareBlobMemoryInference) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->DeepProto(false),
+      &param));
+  param.set_inference(true);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(param);
+  param.set_share_blob_memory(true);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> shared_net(param);
+  EXPECT_EQ(shared_net.blob_by_name("data")->data(),
+      shared_net.blob_by_name("ip2")->data());
+  EXPECT_NE(shared_net.blob_by_name("ip1")->data(),
+      shared_net.blob_by_name("ip2")->data());
+  EXPECT_NE(net.blob_by_name("data")->data(),
+      net.blob_by_name("ip2")->data());
+  for (int iter = 0; iter < 3; ++iter) {
+    const Blob<TypeParam>* prob = net.ForwardPrefilled()[1];
+    const Blob<TypeParam>* shared_prob = shared_net.ForwardPrefilled()[1];
+    ASSERT_EQ(prob->count(), 10);
+    for (int i = 0; i < prob->count(); ++i) {
+      EXPECT_EQ(prob->cpu_data()[i], shared_prob->cpu_data()[i]);
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestHalfPrecisionWeights) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->DeepProto(false),
+      &param));
+  param.set_inference(true);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(param);
+  param.set_half_precision_weights(true);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> half_net(param);
+  for (int iter = 0; iter < 3; ++iter) {
+    const Blob<TypeParam>* prob = net.ForwardPrefilled()[1];
+    const Blob<TypeParam>* half_prob = half_net.ForwardPrefilled()[1];
+    ASSERT_EQ(prob->count(), 10);
+    for (int i = 0; i < prob->count(); ++i) {
+      EXPECT_NEAR(prob->cpu_data()[i], half_prob->cpu_data()[i], 1e-3);
+    }
+  }
+  // The weights of both inner product layers, but not their biases
+  EXPECT_TRUE(half_net.layer_by_name("ip1")->blobs()[0]->half_data());
+  EXPECT_TRUE(half_net.layer_by_name("ip2")->blobs()[0]->half_data());
+  EXPECT_FALSE(half_net.layer_by_name("ip1")->blobs()[1]->half_data());
+}
+
+TYPED_TEST(NetTest, TestRawWeights) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->DeepProto(false),
+      &param));
+  param.set_inference(true);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(param);
+  NetParameter trained_param;
+  net.ToProto(&trained_param);
+  const string raw_file(tmpnam(NULL));
+  WriteRawWeights(trained_param, raw_file);
+  EXPECT_TRUE(IsRawWeightsFile(raw_file));
+  Caffe::set_random_seed(1702);
+  Net<TypeParam> raw_net(param);
+  raw_net.CopyTrainedLayersFrom(raw_file);
+  remove(raw_file.c_str());
+  for (int i = 0; i < net.params().size(); ++i) {
+    const Blob<TypeParam>* blob = net.params()[i].get();
+    const Blob<TypeParam>* raw_blob = raw_net.params()[i].get();
+    ASSERT_EQ(blob->count(), raw_blob->count());
+    for (int j = 0; j < blob->count(); ++j) {
+      EXPECT_EQ(blob->cpu_data()[j], raw_blob->cpu_data()[j]);
+    }
+  }
+  const Blob<TypeParam>* prob = net.ForwardPrefilled()[1];
+  const Blob<TypeParam>* raw_prob = raw_net.ForwardPrefilled()[1];
+  ASSERT_EQ(prob->count(), 10);
+  for (int i = 0; i < prob->count(); ++i) {
+    EXPECT_EQ(prob->cpu_data()[i], raw_prob->cpu_data()[i]);
+  }
+}
+
+TYPED_TEST(NetTest, TestCopyTrainedLayersCPUGPU) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->DeepProto(false),
+      &param));
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(param);
+  NetParameter trained_param;
+  net.ToProto(&trained_param);
+  Caffe::set_random_seed(1702);
+  Net<TypeParam> cpu_net(param);
+  Net<TypeParam> gpu_net(param);
+  const int cpu_threads = Caffe::cpu_threads();
+  Caffe::set_mode(Caffe::CPU);
+  Caffe::set_cpu_threads(4);
+  cpu_net.CopyTrainedLayersFrom(trained_param);
+  Caffe::set_cpu_threads(cpu_threads);
+  Caffe::set_mode(Caffe::GPU);
+  gpu_net.CopyTrainedLayersFrom(trained_param);
+  Caffe::set_mode(Caffe::CPU);
+  ASSERT_EQ(net.params().size(), gpu_net.params().size());
+  for (int i = 0; i < net.params().size(); ++i) {
+    const Blob<TypeParam>* blob = net.params()[i].get();
+    const Blob<TypeParam>* cpu_blob = cpu_net.params()[i].get();
+    const Blob<TypeParam>* gpu_blob = gpu_net.params()[i].get();
+    ASSERT_EQ(blob->count(), gpu_blob->count());
+    for (int j = 0; j < blob->count(); ++j) {
+      EXPECT_EQ(blob->cpu_data()[j], cpu_blob->cpu_data()[j]);
+      EXPECT_EQ(blob->cpu_data()[j], gpu_blob->cpu_data()[j]);
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestShareWeights) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->DeepProto(false),
+      &param));
+  param.set_inference(true);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(param);
+  Caffe::set_random_seed(1702);
+  Net<TypeParam> shared_net(param, &net);
+  ASSERT_EQ(net.params().size(), shared_net.params().size());
+  for (int i = 0; i < net.params().size(); ++i) {
+    EXPECT_EQ(net.params()[i]->data(), shared_net.params()[i]->data());
+  }
+  EXPECT_NE(net.blob_by_name("ip1")->data(),
+      shared_net.blob_by_name("ip1")->data());
+  const Blob<TypeParam>* prob = net.ForwardPrefilled()[1];
+  const Blob<TypeParam>* shared_prob = shared_net.ForwardPrefilled()[1];
+  ASSERT_EQ(prob->count(), 10);
+  for (int i = 0; i < prob->count(); ++i) {
+    EXPECT_EQ(prob->cpu_data()[i], shared_prob->cpu_data()[i]);
+  }
+}
+
+TYPED_TEST(NetTest, TestSelectiveBackward) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->DeepProto(true),
+      &param));
+  // Freeze ip2, whose bottom still needs backward for ip1.
+  for (int i = 0; i < param.layers_size(); ++i) {
+    if (param.layers(i).name() == "ip2") {
+      param.mutable_layers(i)->add_blobs_lr(0);
+      param.mutable_layers(i)->add_blobs_lr(0);
+    }
+  }
+  Net<TypeParam> net(param);
+  vector<Blob<TypeParam>*> bottom;
+  net.ForwardBackward(bottom);
+  const vector<shared_ptr<Blob<TypeParam> > >& ip1_blobs =
+      net.layer_by_name("ip1")->blobs();
+  const vector<shared_ptr<Blob<TypeParam> > >& ip2_blobs =
+      net.layer_by_name("ip2")->blobs();
+  EXPECT_GT(caffe_cpu_asum(ip1_blobs[0]->count(), ip1_blobs[0]->cpu_diff()),
+      0);
+  for (int i = 0; i < ip2_blobs.size(); ++i) {
+    EXPECT_EQ(caffe_cpu_asum(ip2_blobs[i]->count(), ip2_blobs[i]->cpu_diff()),
+        0);
+  }
+  // Nothing needs the gradient of the data.
+  const Blob<TypeParam>& data = *net.blob_by_name("data");
+  EXPECT_EQ(caffe_cpu_asum(data.count(), data.cpu_diff()), 0);
+}
+
+TYPED_TEST(NetTest, TestProfiling) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->DeepProto(true),
+      &param));
+  Caffe::set_mode(Caffe::CPU);
+  Net<TypeParam> net(param);
+  net.set_profiling(true);
+  vector<Blob<TypeParam>*> bottom;
+  net.ForwardBackward(bottom);
+  net.ForwardBackward(bottom);
+  const vector<typename Net<TypeParam>::LayerProfile>& profiles =
+      net.layer_profiles();
+  ASSERT_EQ(profiles.size(), net.layers().size());
+  for (int i = 0; i < profiles.size(); ++i) {
+    EXPECT_EQ(profiles[i].forward_passes, 2) << net.layer_names()[i];
+    EXPECT_GE(profiles[i].forward_ms, 0);
+  }
+  // ip1 takes the 24 values of each of the 2 images to 10 outputs.
+  const int ip1 = 1;
+  ASSERT_EQ(net.layer_names()[ip1], "ip1");
+  EXPECT_EQ(profiles[ip1].backward_passes, 2);
+  EXPECT_EQ(profiles[ip1].forward_flops, 2 * 2 * 10 * 24);
+  const string csv_file(tmpnam(NULL));
+  net.WriteProfiles(csv_file, 2);
+  std::ifstream csv(csv_file.c_str());
+  string line;
+  int lines = 0;
+  while (std::getline(csv, line)) {
+    ++lines;
+  }
+  // The header and a row per layer
+  EXPECT_EQ(lines, 1 + net.layers().size());
+  remove(csv_file.c_str());
+  net.ResetProfiles();
+  EXPECT_EQ(net.layer_profiles()[ip1].forward_passes, 0);
+}
+
+TYPED_TEST(NetTest, TestForwardBlobs) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->DeepProto(true),
+      &param));
+  Caffe::set_mode(Caffe::CPU);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(param);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> pruned_net(param);
+  net.ForwardPrefilled();
+  pruned_net.set_profiling(true);
+  pruned_net.ForwardBlobs(vector<string>(1, "ip1"));
+  // Only data, ip1 and relu1, in place on ip1, run.
+  for (int i = 0; i < pruned_net.layers().size(); ++i) {
+    const string& name = pruned_net.layer_names()[i];
+    const bool needed = name == "data" || name == "ip1" || name == "relu1";
+    EXPECT_EQ(pruned_net.layer_profiles()[i].forward_passes, needed ? 1 : 0)
+        << name;
+  }
+  const Blob<TypeParam>* ip1 = net.blob_by_name("ip1").get();
+  const Blob<TypeParam>* pruned_ip1 = pruned_net.blob_by_name("ip1").get();
+  ASSERT_EQ(ip1->count(), pruned_ip1->count());
+  for (int i = 0; i < ip1->count(); ++i) {
+    EXPECT_EQ(ip1->cpu_data()[i], pruned_ip1->cpu_data()[i]);
+  }
+  // Up to a layer, all the layers before it run.
+  pruned_net.ResetProfiles();
+  pruned_net.ForwardTo("ip2");
+  for (int i = 0; i < pruned_net.layers().size(); ++i) {
+    const string& name = pruned_net.layer_names()[i];
+    EXPECT_EQ(pruned_net.layer_profiles()[i].forward_passes,
+        name == "loss" ? 0 : 1) << name;
+  }
+}
+
+TYPED_TEST(NetTest, TestShareBlobMemoryTrain) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->DeepProto(true),
+      &param));
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(param);
+  param.set_share_blob_memory(true);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> shared_net(param);
+  EXPECT_EQ(shared_net.blob_by_name("data")->diff(),
+      shared_net.blob_by_name("ip2")->diff());
+  // The data is kept for Backward.
+  EXPECT_NE(shared_net.blob_by_name("data")->data(),
+      shared_net.blob_by_name("ip2")->data());
+  for (int iter = 0; iter < 3; ++iter) {
+    TypeParam loss, shared_loss;
+    net.ForwardPrefilled(&loss);
+    shared_net.ForwardPrefilled(&shared_loss);
+    EXPECT_EQ(loss, shared_loss);
+    net.Backward();
+    shared_net.Backward();
+    ASSERT_EQ(net.params().size(), shared_net.params().size());
+    for (int j = 0; j < net.params().size(); ++j) {
+      const Blob<TypeParam>* diff = net.params()[j].get();
+      const Blob<TypeParam>* shared_diff = shared_net.params()[j].get();
+      for (int i = 0; i < diff->count(); ++i) {
+        EXPECT_EQ(diff->cpu_diff()[i], shared_diff->cpu_diff()[i]);
+      }
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestZeroCopyConcat) {
+  const string& inner_product =
+      "  weight_filler { "
+      "    type: 'gaussian' "
+      "    std: 0.1 "
+      "  } ";
+  const string proto =
+      "name: 'TestNetwork' "
+      "input: 'data' "
+      "input_dim: 1 input_dim: 2 input_dim: 3 input_dim: 4 "
+      "input: 'target' "
+      "input_dim: 1 input_dim: 5 input_dim: 1 input_dim: 1 "
+      "layers: { "
+      "  name: 'ip1' "
+      "  type: INNER_PRODUCT "
+      "  inner_product_param { num_output: 4 " + inner_product + "} "
+      "  bottom: 'data' "
+      "  top: 'ip1' "
+      "} "
+      "layers: { "
+      "  name: 'ip2' "
+      "  type: INNER_PRODUCT "
+      "  inner_product_param { num_output: 6 " + inner_product + "} "
+      "  bottom: 'data' "
+      "  top: 'ip2' "
+      "} "
+      "layers: { "
+      "  name: 'concat' "
+      "  type: CONCAT "
+      "  concat_param { concat_dim: 1 } "
+      "  bottom: 'ip1' "
+      "  bottom: 'ip2' "
+      "  top: 'concat' "
+      "} "
+      "layers: { "
+      "  name: 'ip3' "
+      "  type: INNER_PRODUCT "
+      "  inner_product_param { num_output: 5 " + inner_product + "} "
+      "  bottom: 'concat' "
+      "  top: 'ip3' "
+      "} "
+      "layers: { "
+      "  name: 'loss' "
+      "  type: EUCLIDEAN_LOSS "
+      "  bottom: 'ip3' "
+      "  bottom: 'target' "
+      "} ";
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(param);
+  param.set_zero_copy_concat(true);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> zero_copy_net(param);
+  const TypeParam* concat = zero_copy_net.blob_by_name("concat")->cpu_data();
+  EXPECT_EQ(concat, zero_copy_net.blob_by_name("ip1")->cpu_data());
+  EXPECT_EQ(concat + 4, zero_copy_net.blob_by_name("ip2")->cpu_data());
+  // With a batch of 2, the parts of the top are no longer contiguous.
+  for (int batch_size = 1; batch_size <= 2; ++batch_size) {
+    if (batch_size > 1) {
+      net.Reshape(batch_size);
+      zero_copy_net.Reshape(batch_size);
+      EXPECT_NE(zero_copy_net.blob_by_name("concat")->cpu_data(),
+          zero_copy_net.blob_by_name("ip1")->cpu_data());
+    }
+    FillerParameter filler_param;
+    GaussianFiller<TypeParam> filler(filler_param);
+    for (int i = 0; i < net.input_blobs().size(); ++i) {
+      filler.Fill(net.input_blobs()[i]);
+      zero_copy_net.input_blobs()[i]->CopyFrom(*net.input_blobs()[i]);
+    }
+    TypeParam loss, zero_copy_loss;
+    net.ForwardPrefilled(&loss);
+    zero_copy_net.ForwardPrefilled(&zero_copy_loss);
+    EXPECT_EQ(loss, zero_copy_loss);
+    net.Backward();
+    zero_copy_net.Backward();
+    ASSERT_EQ(net.params().size(), zero_copy_net.params().size());
+    for (int j = 0; j < net.params().size(); ++j) {
+      const Blob<TypeParam>* diff = net.params()[j].get();
+      const Blob<TypeParam>* zero_copy_diff = zero_copy_net.params()[j].get();
+      for (int i = 0; i < diff->count(); ++i) {
+        EXPECT_EQ(diff->cpu_diff()[i], zero_copy_diff->cpu_diff()[i]);
+      }
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestAccumulateSplitDiffs) {
+  const string& inner_product =
+      "  weight_filler { "
+      "    type: 'gaussian' "
+      "    std: 0.1 "
+      "  } "
+      "  bias_filler { "
+      "    type: 'gaussian' "
+      "    std: 0.1 "
+      "  } ";
+  // ip1 goes to ip2 and ip3, which add their gradients to its diff, and to
+  // concat, whose gradient the split adds.
+  const string proto =
+      "name: 'TestNetwork' "
+      "input: 'data' "
+      "input_dim: 2 input_dim: 4 input_dim: 1 input_dim: 1 "
+      "input: 'target' "
+      "input_dim: 2 input_dim: 5 input_dim: 1 input_dim: 1 "
+      "layers: { "
+      "  name: 'ip1' "
+      "  type: INNER_PRODUCT "
+      "  inner_product_param { num_output: 3 " + inner_product + "} "
+      "  bottom: 'data' "
+      "  top: 'ip1' "
+      "} "
+      "layers: { "
+      "  name: 'ip2' "
+      "  type: INNER_PRODUCT "
+      "  inner_product_param { num_output: 3 " + inner_product + "} "
+      "  bottom: 'ip1' "
+      "  top: 'ip2' "
+      "} "
+      "layers: { "
+      "  name: 'ip3' "
+      "  type: INNER_PRODUCT "
+      "  inner_product_param { num_output: 3 " + inner_product + "} "
+      "  bottom: 'ip1' "
+      "  top: 'ip3' "
+      "} "
+      "layers: { "
+      "  name: 'concat' "
+      "  type: CONCAT "
+      "  bottom: 'ip2' "
+      "  bottom: 'ip3' "
+      "  bottom: 'ip1' "
+      "  top: 'concat' "
+      "} "
+      "layers: { "
+      "  name: 'ip4' "
+      "  type: INNER_PRODUCT "
+      "  inner_product_param { num_output: 5 " + inner_product + "} "
+      "  bottom: 'concat' "
+      "  top: 'ip4' "
+      "} "
+      "layers: { "
+      "  name: 'loss' "
+      "  type: EUCLIDEAN_LOSS "
+      "  bottom: 'ip4' "
+      "  bottom: 'target' "
+      "} ";
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(param);
+  param.set_accumulate_split_diffs(true);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> accumulating_net(param);
+  // ip3 runs Backward first and overwrites the diff.
+  EXPECT_TRUE(accumulating_net.layer_by_name("ip2")->accumulate_bottom_diffs());
+  EXPECT_FALSE(
+      accumulating_net.layer_by_name("ip3")->accumulate_bottom_diffs());
+  EXPECT_FALSE(
+      accumulating_net.layer_by_name("concat")->accumulate_bottom_diffs());
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  for (int i = 0; i < net.input_blobs().size(); ++i) {
+    filler.Fill(net.input_blobs()[i]);
+    accumulating_net.input_blobs()[i]->CopyFrom(*net.input_blobs()[i]);
+  }
+  for (int iter = 0; iter < 2; ++iter) {
+    TypeParam loss, accumulating_loss;
+    net.ForwardPrefilled(&loss);
+    accumulating_net.ForwardPrefilled(&accumulating_loss);
+    EXPECT_EQ(loss, accumulating_loss);
+    net.Backward();
+    accumulating_net.Backward();
+    const Blob<TypeParam>* diff = net.blob_by_name("ip1").get();
+    const Blob<TypeParam>* accumulated_diff =
+        accumulating_net.blob_by_name("ip1").get();
+    for (int i = 0; i < diff->count(); ++i) {
+      EXPECT_NEAR(diff->cpu_diff()[i], accumulated_diff->cpu_diff()[i], 1e-5);
+    }
+    const Blob<TypeParam>* weights = net.params()[0].get();
+    const Blob<TypeParam>* accumulated_weights =
+        accumulating_net.params()[0].get();
+    for (int i = 0; i < weights->count(); ++i) {
+      EXPECT_NEAR(weights->cpu_diff()[i], accumulated_weights->cpu_diff()[i],
+          1e-5);
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestPackParams) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->DeepProto(true),
+      &param));
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(param);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> packed_net(param);
+  packed_net.PackParams();
+  // Each blob is an aligned part of the packed memory.
+  const TypeParam* data =
+      static_cast<const TypeParam*>(packed_net.params_data()->cpu_data());
+  const TypeParam* diff =
+      static_cast<const TypeParam*>(packed_net.params_diff()->cpu_data());
+  for (int j = 0; j < packed_net.params().size(); ++j) {
+    const Blob<TypeParam>* blob = packed_net.params()[j].get();
+    const int offset = blob->cpu_data() - data;
+    EXPECT_GE(offset, 0);
+    EXPECT_LE(offset + blob->count(), packed_net.params_count());
+    EXPECT_EQ(0, offset * sizeof(TypeParam) % 256);
+    EXPECT_EQ(diff + offset, blob->cpu_diff());
+  }
+  // The results do not change.
+  for (int iter = 0; iter < 3; ++iter) {
+    TypeParam loss, packed_loss;
+    net.ForwardPrefilled(&loss);
+    packed_net.ForwardPrefilled(&packed_loss);
+    EXPECT_EQ(loss, packed_loss);
+    net.Backward();
+    packed_net.Backward();
+    net.Update();
+    packed_net.Update();
+    for (int j = 0; j < net.params().size(); ++j) {
+      const Blob<TypeParam>* blob = net.params()[j].get();
+      const Blob<TypeParam>* packed_blob = packed_net.params()[j].get();
+      for (int i = 0; i < blob->count(); ++i) {
+        EXPECT_EQ(blob->cpu_data()[i], packed_blob->cpu_data()[i]);
+      }
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestLayerDevice) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->DeepProto(true),
+      &param));
+  Caffe::set_mode(Caffe::CPU);
+  Net<TypeParam> cpu_net(param);
+  NetParameter trained_param;
+  cpu_net.ToProto(&trained_param);
+  // ip1 stays on the CPU, the other layers run on the GPU.
+  for (int i = 0; i < param.layers_size(); ++i) {
+    if (param.layers(i).name() == "ip1") {
+      param.mutable_layers(i)->set_device(LayerParameter::CPU);
+    }
+  }
+  Caffe::set_mode(Caffe::GPU);
+  Net<TypeParam> net(param);
+  net.CopyTrainedLayersFrom(trained_param);
+  // The parameters of ip1 are not packed with those of the GPU layers.
+  net.PackParams();
+  EXPECT_FALSE(net.params_data());
+  Layer<TypeParam>& ip1 = *net.layer_by_name("ip1");
+  EXPECT_EQ(Caffe::CPU, ip1.mode());
+  EXPECT_EQ(Caffe::GPU, net.layer_by_name("ip2")->mode());
+  for (int iter = 0; iter < 2; ++iter) {
+    TypeParam loss, cpu_loss;
+    Caffe::set_mode(Caffe::CPU);
+    cpu_net.ForwardPrefilled(&cpu_loss);
+    cpu_net.Backward();
+    cpu_net.Update();
+    Caffe::set_mode(Caffe::GPU);
+    net.ForwardPrefilled(&loss);
+    net.Backward();
+    net.Update();
+    EXPECT_NEAR(cpu_loss, loss, 1e-4);
+    for (int j = 0; j < ip1.blobs().size(); ++j) {
+      EXPECT_EQ(SyncedMemory::HEAD_AT_CPU, ip1.blobs()[j]->data()->head());
+    }
+  }
+  for (int j = 0; j < net.params().size(); ++j) {
+    const Blob<TypeParam>& blob = *net.params()[j];
+    const Blob<TypeParam>& cpu_blob = *cpu_net.params()[j];
+    for (int i = 0; i < blob.count(); ++i) {
+      EXPECT_NEAR(cpu_blob.cpu_data()[i], blob.cpu_data()[i], 1e-4);
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestPlanFollowsMode) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->DeepProto(true),
+      &param));
+  for (int i = 0; i < param.layers_size(); ++i) {
+    if (param.layers(i).name() == "ip1") {
+      param.mutable_layers(i)->set_device(LayerParameter::CPU);
+    }
+  }
+  // Both nets are built for the CPU; the passes of net on the GPU rebuild
+  // its plan, where ip1 then runs in a mode of its own.
+  Caffe::set_mode(Caffe::CPU);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> cpu_net(param);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(param);
+  TypeParam cpu_loss, loss;
+  cpu_net.ForwardPrefilled(&cpu_loss);
+  cpu_net.Backward();
+  Caffe::set_mode(Caffe::GPU);
+  net.ForwardPrefilled(&loss);
+  net.Backward();
+  Caffe::set_mode(Caffe::CPU);
+  EXPECT_NEAR(cpu_loss, loss, 1e-4);
+  Layer<TypeParam>& ip1 = *net.layer_by_name("ip1");
+  for (int j = 0; j < ip1.blobs().size(); ++j) {
+    EXPECT_EQ(SyncedMemory::HEAD_AT_CPU, ip1.blobs()[j]->data()->head());
+  }
+  for (int j = 0; j < net.params().size(); ++j) {
+    const Blob<TypeParam>& blob = *net.params()[j];
+    const Blob<TypeParam>& cpu_blob = *cpu_net.params()[j];
+    for (int i = 0; i < blob.count(); ++i) {
+      EXPECT_NEAR(cpu_blob.cpu_diff()[i], blob.cpu_diff()[i], 1e-4);
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestOffloadActivations) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->DeepProto(true),
+      &param));
+  Caffe::set_mode(Caffe::GPU);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(param);
+  param.set_offload_activations(true);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> offload_net(param);
+  // data is last read by ip1, two layers before the last one.
+  const shared_ptr<Blob<TypeParam> > data = offload_net.blob_by_name("data");
+  for (int iter = 0; iter < 2; ++iter) {
+    TypeParam loss, offload_loss;
+    net.ForwardPrefilled(&loss);
+    offload_net.ForwardPrefilled(&offload_loss);
+    EXPECT_EQ(loss, offload_loss);
+    EXPECT_EQ(SyncedMemory::HEAD_AT_CPU, data->data()->head());
+    net.Backward();
+    offload_net.Backward();
+    EXPECT_EQ(SyncedMemory::SYNCED, data->data()->head());
+    for (int j = 0; j < net.params().size(); ++j) {
+      const Blob<TypeParam>& blob = *net.params()[j];
+      const Blob<TypeParam>& offload_blob = *offload_net.params()[j];
+      for (int i = 0; i < blob.count(); ++i) {
+        EXPECT_EQ(blob.cpu_diff()[i], offload_blob.cpu_diff()[i]);
+      }
+    }
+    net.Update();
+    offload_net.Update();
+  }
+  Caffe::set_mode(Caffe::CPU);
+}
+
+TYPED_TEST(NetTest, TestRecomputeActivations) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(
+      this->NeuronProto("DROPOUT", "TANH"), &param));
+  param.set_auto_in_place(false);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(param);
+  param.mutable_layers(4)->set_checkpoint(true);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> recompute_net(param);
+  // ip1, n1 and n2 are freed after ip2, and computed again for Backward.
+  const shared_ptr<Blob<TypeParam> > n1 = recompute_net.blob_by_name("n1");
+  for (int iter = 0; iter < 2; ++iter) {
+    TypeParam loss, recompute_loss;
+    // The same dropout masks in both nets
+    Caffe::set_random_seed(iter);
+    net.ForwardPrefilled(&loss);
+    Caffe::set_random_seed(iter);
+    recompute_net.ForwardPrefilled(&recompute_loss);
+    EXPECT_EQ(loss, recompute_loss);
+    EXPECT_EQ(SyncedMemory::UNINITIALIZED, n1->data()->head());
+    net.Backward();
+    recompute_net.Backward();
+    EXPECT_EQ(SyncedMemory::UNINITIALIZED, n1->data()->head());
+    for (int j = 0; j < net.params().size(); ++j) {
+      const Blob<TypeParam>& blob = *net.params()[j];
+      const Blob<TypeParam>& recompute_blob = *recompute_net.params()[j];
+      for (int i = 0; i < blob.count(); ++i) {
+        EXPECT_EQ(blob.cpu_diff()[i], recompute_blob.cpu_diff()[i]);
+      }
+    }
+    net.Update();
+    recompute_net.Update();
+  }
+}
+
+TYPED_TEST(NetTest, TestAutoInPlace) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(
+      this->NeuronProto("DROPOUT", "TANH"), &param));
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(param);
+  param.set_auto_in_place(false);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> separate_net(param);
+  // Both neuron layers run in place, and their tops keep their names.
+  EXPECT_EQ(net.blob_names().size(), separate_net.blob_names().size() - 2);
+  EXPECT_TRUE(net.has_blob("n1"));
+  EXPECT_TRUE(net.has_blob("n2"));
+  EXPECT_EQ(net.blob_by_name("ip1"), net.blob_by_name("n1"));
+  EXPECT_EQ(net.blob_by_name("ip1"), net.blob_by_name("n2"));
+  EXPECT_NE(separate_net.blob_by_name("ip1"), separate_net.blob_by_name("n2"));
+  // The results do not change.
+  for (int iter = 0; iter < 3; ++iter) {
+    TypeParam loss, separate_loss;
+    net.ForwardPrefilled(&loss);
+    separate_net.ForwardPrefilled(&separate_loss);
+    EXPECT_EQ(loss, separate_loss);
+    net.Backward();
+    separate_net.Backward();
+    for (int j = 0; j < net.params().size(); ++j) {
+      const Blob<TypeParam>* diff = net.params()[j].get();
+      const Blob<TypeParam>* separate_diff = separate_net.params()[j].get();
+      for (int i = 0; i < diff->count(); ++i) {
+        EXPECT_NEAR(diff->cpu_diff()[i], separate_diff->cpu_diff()[i], 1e-6);
+      }
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestAutoInPlaceEltwise) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(
+      this->NeuronProto("DROPOUT", "ELTWISE"), &param));
+  // The sum of the dropout and of its bottom runs in place on the former.
+  param.mutable_layers(3)->add_bottom("ip1");
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(param);
+  param.set_auto_in_place(false);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> separate_net(param);
+  EXPECT_EQ(net.blob_by_name("n1"), net.blob_by_name("n2"));
+  EXPECT_NE(separate_net.blob_by_name("n1"), separate_net.blob_by_name("n2"));
+  for (int iter = 0; iter < 3; ++iter) {
+    TypeParam loss, separate_loss;
+    net.ForwardPrefilled(&loss);
+    separate_net.ForwardPrefilled(&separate_loss);
+    EXPECT_EQ(loss, separate_loss);
+    net.Backward();
+    separate_net.Backward();
+    for (int j = 0; j < net.params().size(); ++j) {
+      const Blob<TypeParam>* diff = net.params()[j].get();
+      const Blob<TypeParam>* separate_diff = separate_net.params()[j].get();
+      for (int i = 0; i < diff->count(); ++i) {
+        EXPECT_NEAR(diff->cpu_diff()[i], separate_diff->cpu_diff()[i], 1e-6);
+      }
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestAutoInPlaceOnlyWhenSafe) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(
+      this->NeuronProto("TANH", "RELU"), &param));
+  {
+    // Backward of the TanH layer reads its top, which the ReLU layer may not
+    // overwrite.
+    Net<TypeParam> net(param);
+    EXPECT_EQ(net.blob_by_name("ip1"), net.blob_by_name("n1"));
+    EXPECT_NE(net.blob_by_name("n1"), net.blob_by_name("n2"));
+  }
+  param.set_inference(true);
+  {
+    Net<TypeParam> net(param);
+    EXPECT_EQ(net.blob_by_name("ip1"), net.blob_by_name("n2"));
+  }
+  CHECK(google::protobuf::TextFormat::ParseFromString(
+      this->NeuronProto("POWER", "SIGMOID"), &param));
+  {
+    // Backward of the power layer reads its bottom, and may read its top.
+    Net<TypeParam> net(param);
+    EXPECT_NE(net.blob_by_name("ip1"), net.blob_by_name("n1"));
+    EXPECT_NE(net.blob_by_name("n1"), net.blob_by_name("n2"));
+  }
+}
+
+TYPED_TEST(NetTest, TestFuseNeuronLayers) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(
+      this->NeuronProto("DROPOUT", "RELU"), &param));
+  // Both neuron layers in place on ip1
+  param.mutable_layers(2)->set_top(0, "ip1");
+  param.mutable_layers(3)->set_bottom(0, "ip1");
+  param.mutable_layers(3)->set_top(0, "ip1");
+  param.mutable_layers(4)->set_bottom(0, "ip1");
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(param);
+  param.set_fuse_neuron_layers(false);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> separate_net(param);
+  EXPECT_TRUE(net.has_layer("n1+n2"));
+  EXPECT_FALSE(net.has_layer("n1"));
+  EXPECT_EQ(net.layer_names().size(), separate_net.layer_names().size() - 1);
+  // The results do not change.
+  for (int iter = 0; iter < 3; ++iter) {
+    TypeParam loss, separate_loss;
+    net.ForwardPrefilled(&loss);
+    separate_net.ForwardPrefilled(&separate_loss);
+    EXPECT_EQ(loss, separate_loss);
+    net.Backward();
+    separate_net.Backward();
+    for (int j = 0; j < net.params().size(); ++j) {
+      const Blob<TypeParam>* diff = net.params()[j].get();
+      const Blob<TypeParam>* separate_diff = separate_net.params()[j].get();
+      for (int i = 0; i < diff->count(); ++i) {
+        EXPECT_NEAR(diff->cpu_diff()[i], separate_diff->cpu_diff()[i], 1e-6);
+      }
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestFuseReLU) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(
+      this->NeuronProto("RELU", "SIGMOID"), &param));
+  Net<TypeParam> net(param);
+  param.set_fuse_neuron_layers(false);
+  Net<TypeParam> separate_net(param);
+  // ip1 runs the ReLU, and keeps its name.
+  EXPECT_FALSE(net.has_layer("n1"));
+  EXPECT_TRUE(net.has_layer("ip1"));
+  EXPECT_TRUE(net.has_blob("n1"));
+  EXPECT_EQ(net.layer_names().size(), separate_net.layer_names().size() - 1);
+  // The results do not change.
+  for (int j = 0; j < net.params().size(); ++j) {
+    net.params()[j]->CopyFrom(*separate_net.params()[j]);
+  }
+  for (int iter = 0; iter < 3; ++iter) {
+    TypeParam loss, separate_loss;
+    net.ForwardPrefilled(&loss);
+    separate_net.ForwardPrefilled(&separate_loss);
+    EXPECT_NEAR(loss, separate_loss, 1e-5);
+    net.Backward();
+    separate_net.Backward();
+    for (int j = 0; j < net.params().size(); ++j) {
+      const Blob<TypeParam>* diff = net.params()[j].get();
+      const Blob<TypeParam>* separate_diff = separate_net.params()[j].get();
+      for (int i = 0; i < diff->count(); ++i) {
+        EXPECT_NEAR(diff->cpu_diff()[i], separate_diff->cpu_diff()[i], 1e-6);
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+class RecordingBackwardCallback : public Net<Dtype>::BackwardCallback {
+ public:
+  virtual void GradientsReady(const int layer_id) {
+    layer_ids_.push_back(layer_id);
+  }
+  vector<int> layer_ids_;
+};
+
+TYPED_TEST(NetTest, TestBackwardCallback) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->DeepProto(true),
+      &param));
+  Net<TypeParam> net(param);
+  RecordingBackwardCallback<TypeParam> callback;
+  net.set_backward_callback(&callback);
+  TypeParam loss;
+  net.ForwardPrefilled(&loss);
+  net.Backward();
+  // The layers with parameters, as the backward pass goes
+  vector<int> expected_layer_ids;
+  for (int i = net.layers().size() - 1; i >= 0; --i) {
+    if (net.layers()[i]->blobs().size() > 0) {
+      expected_layer_ids.push_back(i);
+    }
+  }
+  EXPECT_GT(expected_layer_ids.size(), 1);
+  EXPECT_TRUE(callback.layer_ids_ == expected_layer_ids);
+}
+
+TYPED_TEST(NetTest, TestPipeline) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->DeepProto(true),
+      &param));
+  Caffe::set_mode(Caffe::GPU);
+  // Both micro batches of 2 in one batch of 4
+  NetParameter batch_param = param;
+  batch_param.mutable_layers(0)->mutable_data_param()->set_batch_size(4);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> batch_net(batch_param);
+  TypeParam batch_loss;
+  batch_net.ForwardPrefilled(&batch_loss);
+  batch_net.Backward();
+  // Two stages on the current device, for the test to run on one GPU
+  int device;
+  CUDA_CHECK(cudaGetDevice(&device));
+  const vector<int> devices(2, device);
+  NetParameter shard_param = param;
+  P2PSync<TypeParam>::SetShard(0, 2, &shard_param);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(shard_param);
+  Pipeline<TypeParam> pipeline(&net, param, devices,
+      vector<string>(1, "ip2"), 2);
+  ASSERT_EQ(2, pipeline.stage_starts().size());
+  EXPECT_EQ("ip2", net.layer_names()[pipeline.stage_starts()[1]]);
+  EXPECT_EQ(device, net.layer_by_name("ip2")->device_id());
+  EXPECT_NEAR(batch_loss, pipeline.ForwardBackward(), 1e-5);
+  for (int j = 0; j < net.params().size(); ++j) {
+    const Blob<TypeParam>& blob = *net.params()[j];
+    const Blob<TypeParam>& batch_blob = *batch_net.params()[j];
+    for (int i = 0; i < blob.count(); ++i) {
+      EXPECT_NEAR(batch_blob.cpu_diff()[i], blob.cpu_diff()[i], 1e-5);
+    }
+  }
+  // Without stage layers, ip1 has most of the operations of the net.
+  Net<TypeParam> balanced_net(shard_param);
+  Pipeline<TypeParam> balanced_pipeline(&balanced_net, param, devices,
+      vector<string>(), 2);
+  EXPECT_EQ("relu1",
+      balanced_net.layer_names()[balanced_pipeline.stage_starts()[1]]);
+}
+
+// Keeps the gradients of the replica, then applies them.
+template <typename Dtype>
+static void HogwildUpdate(void* diffs_pointer, Net<Dtype>* net) {
+  vector<vector<Dtype> >* diffs =
+      static_cast<vector<vector<Dtype> >*>(diffs_pointer);
+  for (int j = 0; j < net->params().size(); ++j) {
+    const Blob<Dtype>& blob = *net->params()[j];
+    diffs->push_back(vector<Dtype>(blob.cpu_diff(),
+        blob.cpu_diff() + blob.count()));
+  }
+  net->Update();
+}
+
+TYPED_TEST(NetTest, TestHogwild) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(this->DeepProto(true),
+      &param));
+  Caffe::set_mode(Caffe::CPU);
+  NetParameter shard_param = param;
+  P2PSync<TypeParam>::SetShard(0, 2, &shard_param);
+  Caffe::set_random_seed(1701);
+  Net<TypeParam> net(shard_param);
+  vector<vector<TypeParam> > weights;
+  for (int j = 0; j < net.params().size(); ++j) {
+    const Blob<TypeParam>& blob = *net.params()[j];
+    weights.push_back(vector<TypeParam>(blob.cpu_data(),
+        blob.cpu_data() + blob.count()));
+  }
+  vector<vector<TypeParam> > diffs;
+  {
+    Hogwild<TypeParam> hogwild(&net, param, 2, 1701,
+        HogwildUpdate<TypeParam>, static_cast<void*>(&diffs));
+    EXPECT_GT(hogwild.ForwardBackward(), 0);
+  }
+  // The replica updated the weights of the net with its own gradients,
+  // the net keeping those of its batch.
+  ASSERT_EQ(net.params().size(), diffs.size());
+  bool same_diffs = true;
+  for (int j = 0; j < net.params().size(); ++j) {
+    const Blob<TypeParam>& blob = *net.params()[j];
+    for (int i = 0; i < blob.count(); ++i) {
+      EXPECT_NEAR(weights[j][i] - diffs[j][i], blob.cpu_data()[i], 1e-6);
+      same_diffs = same_diffs && diffs[j][i] == blob.cpu_diff()[i];
+    }
+  }
+  EXPECT_FALSE(same_diffs);
+}
+
+TYPED_TEST(NetTest, TestReshape) {
+  const string proto =
+      "name: 'TestNetwork' "
+      "input: 'data' "
+      "input_dim: 4 "
+      "input_dim: 2 "
+      "input_dim: 6 "
+      "input_dim: 6 "
+      "layers: { "
+      "  name: 'conv' "
+      "  type: CONVOLUTION "
+      "  convolution_param { "
+      "    num_output: 3 "
+      "    kernel_size: 3 "
+      "    weight_filler { "
+      "      type: 'gaussian' "
+      "      std: 0.1 "
+      "    } "
+      "  } "
+      "  bottom: 'data' "
+      "  top: 'conv' "
+      "} "
+      "layers: { "
+      "  name: 'pool' "
+      "  type: POOLING "
+      "  pooling_param { "
+      "    pool: MAX "
+      "    kernel_size: 2 "
+      "    stride: 2 "
+      "  } "
+      "  bottom: 'conv' "
+      "  top: 'pool' "
+      "} "
+      "layers: { "
+      "  name: 'norm' "
+      "  type: LRN "
+      "  lrn_param { "
+      "    local_size: 3 "
+      "  } "
+      "  bottom: 'pool' "
+      "  top: 'norm' "
+      "} "
+      "layers: { "
+      "  name: 'ip' "
+      "  type: INNER_PRODUCT "
+      "  inner_product_param { "
+      "    num_output: 5 "
+      "    weight_filler { "
+      "      type: 'gaussian' "
+      "      std: 0.1 "
+      "    } "
+      "  } "
+      "  bottom: 'norm' "
+      "  top: 'ip' "
+      "} "
+      "layers: { "
+      "  name: 'prob' "
+      "  type: SOFTMAX "
+      "  bottom: 'ip' "
+      "  top: 'prob' "
+      "} "
+      "inference: true "
+      "share_blob_memory: true ";
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+  Net<TypeParam> net(param);
+  Blob<TypeParam>* data = net.input_blobs()[0];
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(data);
+  Blob<TypeParam> images;
+  images.CopyFrom(*data, false, true);
+  Blob<TypeParam> probs;
+  probs.CopyFrom(*net.ForwardPrefilled()[0], false, true);
+  ASSERT_EQ(probs.num(), 4);
+  ASSERT_EQ(probs.channels(), 5);
+  const TypeParam* weights = net.params()[0]->cpu_data();
+  // Each image alone, then twice each in a larger batch
+  const int image_size = images.count() / images.num();
+  const int prob_size = probs.count() / probs.num();
+  const int batch_sizes[] = { 1, 8 };
+  for (int b = 0; b < 2; ++b) {
+    const int batch_size = batch_sizes[b];
+    net.Reshape(batch_size);
+    EXPECT_EQ(data->num(), batch_size);
+    EXPECT_EQ(weights, net.params()[0]->cpu_data());
+    for (int n = 0; n < images.num(); n += batch_size) {
+      for (int i = 0; i < batch_size; ++i) {
+        caffe_copy(image_size, images.cpu_data() + ((n + i) % 4) * image_size,
+            data->mutable_cpu_data() + i * image_size);
+      }
+      const Blob<TypeParam>* prob = net.ForwardPrefilled()[0];
+      ASSERT_EQ(prob->num(), batch_size);
+      ASSERT_EQ(prob->channels(), 5);
+      for (int i = 0; i < batch_size; ++i) {
+        for (int j = 0; j < prob_size; ++j) {
+          EXPECT_NEAR(prob->cpu_data()[i * prob_size + j],
+              probs.cpu_data()[((n + i) % 4) * prob_size + j], 1e-6);
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(NetTest, TestForwardAll) {
+  const string proto =
+      "name: 'TestNetwork' "
+      "input: 'data' "
+      "input_dim: 4 "
+      "input_dim: 3 "
+      "input_dim: 2 "
+      "input_dim: 2 "
+      "layers: { "
+      "  name: 'ip' "
+      "  type: INNER_PRODUCT "
+      "  inner_product_param { "
+      "    num_output: 5 "
+      "    weight_filler { "
+      "      type: 'gaussian' "
+      "      std: 0.1 "
+      "    } "
+      "  } "
+      "  bottom: 'data' "
+      "  top: 'ip' "
+      "} "
+      "layers: { "
+      "  name: 'prob' "
+      "  type: SOFTMAX "
+      "  bottom: 'ip' "
+      "  top: 'prob' "
+      "} "
+      "inference: true ";
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+  Net<TypeParam> net(param);
+  // 10 images, the last batch of 4 padded
+  const int num = 10;
+  const int image_size = 12;
+  Blob<TypeParam> images(num, 3, 2, 2);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(&images);
+  // The outputs of each image through the usual forward pass
+  Blob<TypeParam>* data = net.input_blobs()[0];
+  vector<TypeParam> expected_ip(num * 5);
+  vector<TypeParam> expected_prob(num * 5);
+  for (int n = 0; n < num; ++n) {
+    caffe_set(data->count(), TypeParam(0), data->mutable_cpu_data());
+    caffe_copy(image_size, images.cpu_data() + n * image_size,
+        data->mutable_cpu_data());
+    net.ForwardPrefilled();
+    caffe_copy(5, net.blob_by_name("ip")->cpu_data(), &expected_ip[n * 5]);
+    caffe_copy(5, net.blob_by_name("prob")->cpu_data(),
+        &expected_prob[n * 5]);
+  }
+  const TypeParam data_value = data->cpu_data()[0];
+  vector<string> output_names;
+  output_names.push_back("prob");
+  output_names.push_back("ip");
+  for (int mode = 0; mode < 2; ++mode) {
+    Caffe::set_mode(mode ? Caffe::GPU : Caffe::CPU);
+    vector<TypeParam> ip(num * 5, -1);
+    vector<TypeParam> prob(num * 5, -1);
+    vector<TypeParam*> outputs;
+    outputs.push_back(&prob[0]);
+    outputs.push_back(&ip[0]);
+    net.ForwardAll(num, vector<const TypeParam*>(1, images.cpu_data()),
+        output_names, outputs);
+    for (int i = 0; i < num * 5; ++i) {
+      EXPECT_NEAR(expected_ip[i], ip[i], 1e-5) << "mode " << mode;
+      EXPECT_NEAR(expected_prob[i], prob[i], 1e-5) << "mode " << mode;
+    }
+    // The input blob holds its data again.
+    EXPECT_EQ(data_value, data->cpu_data()[0]);
+  }
+  Caffe::set_mode(Caffe::CPU);
+}
+
+TYPED_TEST(NetTest, TestForwardBuffers) {
+  // The second input is written in place, so copied.
+  const string proto =
+      "name: 'TestNetwork' "
+      "input: 'data' "
+      "input_dim: 2 input_dim: 3 input_dim: 2 input_dim: 2 "
+      "input: 'bias' "
+      "input_dim: 2 input_dim: 5 input_dim: 1 input_dim: 1 "
+      "layers: { "
+      "  name: 'relu' "
+      "  type: RELU "
+      "  bottom: 'bias' "
+      "  top: 'bias' "
+      "} "
+      "layers: { "
+      "  name: 'ip' "
+      "  type: INNER_PRODUCT "
+      "  inner_product_param { "
+      "    num_output: 5 "
+      "    weight_filler { "
+      "      type: 'gaussian' "
+      "      std: 0.1 "
+      "    } "
+      "  } "
+      "  bottom: 'data' "
+      "  top: 'ip' "
+      "} "
+      "layers: { "
+      "  name: 'sum' "
+      "  type: ELTWISE "
+      "  bottom: 'ip' "
+      "  bottom: 'bias' "
+      "  top: 'sum' "
+      "} "
+      "inference: true ";
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+  Net<TypeParam> net(param);
+  // A batch of 4, the net being reshaped to it
+  const int num = 4;
+  Blob<TypeParam> images(num, 3, 2, 2);
+  Blob<TypeParam> biases(num, 5, 1, 1);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(&images);
+  filler.Fill(&biases);
+  vector<const TypeParam*> inputs;
+  inputs.push_back(images.cpu_data());
+  inputs.push_back(biases.cpu_data());
+  vector<TypeParam> expected(biases.count());
+  for (int n = 0; n < num; ++n) {
+    const TypeParam* image = images.cpu_data() + n * 12;
+    for (int j = 0; j < 5; ++j) {
+      expected[n * 5 + j] = std::max(biases.cpu_data()[n * 5 + j],
+          TypeParam(0));
+      for (int k = 0; k < 12; ++k) {
+        expected[n * 5 + j] += image[k] *
+            net.layer_by_name("ip")->blobs()[0]->cpu_data()[j * 12 + k];
+      }
+    }
+  }
+  const TypeParam bias_value = biases.cpu_data()[0];
+  for (int mode = 0; mode < 2; ++mode) {
+    Caffe::set_mode(mode ? Caffe::GPU : Caffe::CPU);
+    vector<TypeParam> sum(num * 5, -1);
+    const vector<Blob<TypeParam>*>& output_blobs =
+        net.ForwardBuffers(num, inputs, vector<TypeParam*>(1, &sum[0]));
+    ASSERT_EQ(output_blobs.size(), 1);
+    EXPECT_EQ(output_blobs[0]->num(), num);
+    for (int i = 0; i < num * 5; ++i) {
+      EXPECT_NEAR(expected[i], sum[i], 1e-5) << "mode " << mode;
+      EXPECT_NEAR(expected[i], output_blobs[0]->cpu_data()[i], 1e-5)
+          << "mode " << mode;
+    }
+    // The ReLU wrote a copy of the second input.
+    EXPECT_EQ(bias_value, biases.cpu_data()[0]);
+    EXPECT_EQ(net.input_blobs()[0]->num(), num);
+  }
+  Caffe::set_mode(Caffe::CPU);
+}
+
+TYPED_TEST(NetTest, TestHardExamples) {
+  const string proto =
+      "name: 'TestNetwork' "
+      "input: 'data' "
+      "input_dim: 6 input_dim: 4 input_dim: 1 input_dim: 1 "
+      "input: 'label' "
+      "input_dim: 6 input_dim: 1 input_dim: 1 input_dim: 1 "
+      "layers: { "
+      "  name: 'ip' "
+      "  type: INNER_PRODUCT "
+      "  inner_product_param { "
+      "    num_output: 3 "
+      "    weight_filler { "
+      "      type: 'gaussian' "
+      "      std: 1 "
+      "    } "
+      "  } "
+      "  bottom: 'data' "
+      "  top: 'ip' "
+      "} "
+      "layers: { "
+      "  name: 'loss' "
+      "  type: SOFTMAX_LOSS "
+      "  bottom: 'ip' "
+      "  bottom: 'label' "
+      "} ";
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+  Net<TypeParam> net(param);
+  NetParameter trained;
+  net.ToProto(&trained);
+  // The reference net runs forward over the batch, then forward and
+  // backward over the hard examples alone.
+  Net<TypeParam> reference_net(param);
+  reference_net.CopyTrainedLayersFrom(trained);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(net.input_blobs()[0]);
+  for (int i = 0; i < 6; ++i) {
+    net.input_blobs()[1]->mutable_cpu_data()[i] = i % 3;
+  }
+  Blob<TypeParam> images, labels;
+  images.CopyFrom(*net.input_blobs()[0], false, true);
+  labels.CopyFrom(*net.input_blobs()[1], false, true);
+  reference_net.input_blobs()[0]->CopyFrom(images);
+  reference_net.input_blobs()[1]->CopyFrom(labels);
+  TypeParam loss;
+  reference_net.ForwardPrefilled(&loss);
+  vector<std::pair<TypeParam, int> > item_losses;
+  const Blob<TypeParam>* ip = reference_net.blob_by_name("ip").get();
+  for (int i = 0; i < 6; ++i) {
+    const TypeParam* scores = ip->cpu_data() + i * 3;
+    TypeParam sum = 0;
+    for (int j = 0; j < 3; ++j) {
+      sum += exp(scores[j]);
+    }
+    item_losses.push_back(std::make_pair(
+        log(sum) - scores[i % 3], -i));
+  }
+  std::sort(item_losses.begin(), item_losses.end());
+  vector<int> hard;
+  hard.push_back(-item_losses[5].second);
+  hard.push_back(-item_losses[4].second);
+  std::sort(hard.begin(), hard.end());
+  reference_net.Reshape(2);
+  for (int i = 0; i < 2; ++i) {
+    caffe_copy(4, images.cpu_data() + hard[i] * 4,
+        reference_net.input_blobs()[0]->mutable_cpu_data() + i * 4);
+    reference_net.input_blobs()[1]->mutable_cpu_data()[i] = hard[i] % 3;
+  }
+  reference_net.ForwardPrefilled();
+  reference_net.Backward();
+
+  net.set_hard_examples(2);
+  EXPECT_EQ(net.hard_examples(), 2);
+  EXPECT_NEAR(net.ForwardBackwardHardExamples(), loss, 1e-5);
+  EXPECT_EQ(net.input_blobs()[0]->num(), 6);
+  EXPECT_EQ(net.blob_by_name("ip")->num(), 6);
+  for (int i = 0; i < net.params().size(); ++i) {
+    const Blob<TypeParam>* diff = net.params()[i].get();
+    const Blob<TypeParam>* reference = reference_net.params()[i].get();
+    ASSERT_EQ(diff->count(), reference->count());
+    for (int j = 0; j < diff->count(); ++j) {
+      EXPECT_NEAR(diff->cpu_diff()[j], reference->cpu_diff()[j], 1e-5);
+    }
+  }
+}
+
 }  // namespace caffe
@@ -253,6 +253,92 @@ TYPED_TEST(NeuronLayerTest, TestDropoutGPUTestPhase) {
 }
 
 
+TYPED_TEST(NeuronLayerTest, TestDropoutMaskCPUGPU) {
+  // The mask follows the random seed, and is the same on the CPU and the GPU.
+  LayerParameter layer_param;
+  Caffe::set_phase(Caffe::TRAIN);
+  DropoutLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  Caffe::set_mode(Caffe::CPU);
+  Caffe::set_random_seed(1701);
+  layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  Blob<TypeParam> top_cpu;
+  top_cpu.CopyFrom(*this->blob_top_, false, true);
+  Caffe::set_mode(Caffe::GPU);
+  Caffe::set_random_seed(1701);
+  layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  const TypeParam* top_data = this->blob_top_->cpu_data();
+  int num_dropped = 0;
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_EQ(top_data[i] == 0, top_cpu.cpu_data()[i] == 0);
+    num_dropped += top_data[i] == 0;
+  }
+  // About dropout_ratio of the 120 elements are dropped.
+  const int count = this->blob_top_->count();
+  EXPECT_GT(num_dropped, count / 4);
+  EXPECT_LT(num_dropped, count * 3 / 4);
+}
+
+
+TYPED_TEST(NeuronLayerTest, TestFusedNeuronCPU) {
+  // The same as the tanh, ReLU and dropout layers one after the other
+  LayerParameter layer_param;
+  FusedNeuronParameter* fused_param = layer_param.mutable_fused_neuron_param();
+  fused_param->add_layer()->set_type(LayerParameter_LayerType_TANH);
+  fused_param->add_layer()->set_type(LayerParameter_LayerType_RELU);
+  fused_param->add_layer()->set_type(LayerParameter_LayerType_DROPOUT);
+  Caffe::set_mode(Caffe::CPU);
+  Caffe::set_phase(Caffe::TRAIN);
+  FusedNeuronLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  Caffe::set_random_seed(1701);
+  layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  TanHLayer<TypeParam> tanh_layer(fused_param->layer(0));
+  ReLULayer<TypeParam> relu_layer(fused_param->layer(1));
+  DropoutLayer<TypeParam> dropout_layer(fused_param->layer(2));
+  Blob<TypeParam> separate_top;
+  vector<Blob<TypeParam>*> separate_top_vec(1, &separate_top);
+  tanh_layer.SetUp(this->blob_bottom_vec_, &separate_top_vec);
+  relu_layer.SetUp(separate_top_vec, &separate_top_vec);
+  dropout_layer.SetUp(separate_top_vec, &separate_top_vec);
+  Caffe::set_random_seed(1701);
+  tanh_layer.Forward(this->blob_bottom_vec_, &separate_top_vec);
+  relu_layer.Forward(separate_top_vec, &separate_top_vec);
+  dropout_layer.Forward(separate_top_vec, &separate_top_vec);
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_EQ(this->blob_top_->cpu_data()[i], separate_top.cpu_data()[i]);
+  }
+}
+
+TYPED_TEST(NeuronLayerTest, TestFusedNeuronGradientCPU) {
+  LayerParameter layer_param;
+  FusedNeuronParameter* fused_param = layer_param.mutable_fused_neuron_param();
+  fused_param->add_layer()->set_type(LayerParameter_LayerType_TANH);
+  fused_param->add_layer()->set_type(LayerParameter_LayerType_RELU);
+  fused_param->add_layer()->set_type(LayerParameter_LayerType_DROPOUT);
+  Caffe::set_mode(Caffe::CPU);
+  Caffe::set_phase(Caffe::TRAIN);
+  FusedNeuronLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3, 1701, 0., 0.01);
+  checker.CheckGradientEltwise(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
+TYPED_TEST(NeuronLayerTest, TestFusedNeuronGradientGPU) {
+  LayerParameter layer_param;
+  FusedNeuronParameter* fused_param = layer_param.mutable_fused_neuron_param();
+  fused_param->add_layer()->set_type(LayerParameter_LayerType_SIGMOID);
+  fused_param->add_layer()->set_type(LayerParameter_LayerType_DROPOUT);
+  fused_param->add_layer()->set_type(LayerParameter_LayerType_RELU);
+  Caffe::set_mode(Caffe::GPU);
+  Caffe::set_phase(Caffe::TRAIN);
+  FusedNeuronLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientEltwise(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
+
 TYPED_TEST(NeuronLayerTest, TestBNLLCPU) {
   LayerParameter layer_param;
   Caffe::set_mode(Caffe::CPU);
@@ -0,0 +1,115 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <google/protobuf/text_format.h>
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+#include "gtest/gtest.h"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/net.hpp"
+#include "caffe/util/optimize_net.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class OptimizeNetTest : public ::testing::Test {
+ protected:
+  OptimizeNetTest() {
+    Caffe::set_phase(Caffe::TEST);
+    Caffe::set_mode(Caffe::CPU);
+  }
+  virtual ~OptimizeNetTest() { Caffe::set_phase(Caffe::TRAIN); }
+
+  // A power layer before conv1, folded into it, then a dropout layer in
+  // place and another power layer after it, also folded into it, and a
+  // dropout layer before ip1, removed.
+  string NetProto() {
+    return
+        "name: 'TestNetwork' "
+        "input: 'data' "
+        "input_dim: 2 input_dim: 3 input_dim: 5 input_dim: 5 "
+        "layers: { "
+        "  name: 'pre' type: POWER "
+        "  power_param { scale: 0.5 shift: -1 } "
+        "  bottom: 'data' top: 'pre' "
+        "} "
+        "layers: { "
+        "  name: 'conv1' type: CONVOLUTION "
+        "  convolution_param { "
+        "    num_output: 4 kernel_size: 3 group: 1 "
+        "    weight_filler { type: 'gaussian' std: 1 } "
+        "    bias_filler { type: 'gaussian' std: 1 } "
+        "  } "
+        "  bottom: 'pre' top: 'conv1' "
+        "} "
+        "layers: { "
+        "  name: 'drop1' type: DROPOUT "
+        "  bottom: 'conv1' top: 'conv1' "
+        "} "
+        "layers: { "
+        "  name: 'post' type: POWER "
+        "  power_param { scale: 2 shift: 0.5 } "
+        "  bottom: 'conv1' top: 'post' "
+        "} "
+        "layers: { "
+        "  name: 'relu1' type: RELU "
+        "  bottom: 'post' top: 'post' "
+        "} "
+        "layers: { "
+        "  name: 'drop2' type: DROPOUT "
+        "  bottom: 'post' top: 'drop2' "
+        "} "
+        "layers: { "
+        "  name: 'ip1' type: INNER_PRODUCT "
+        "  inner_product_param { "
+        "    num_output: 3 "
+        "    weight_filler { type: 'gaussian' std: 1 } "
+        "    bias_filler { type: 'gaussian' std: 1 } "
+        "  } "
+        "  bottom: 'drop2' top: 'ip1' "
+        "} ";
+  }
+};
+
+typedef ::testing::Types<float, double> Dtypes;
+TYPED_TEST_CASE(OptimizeNetTest, Dtypes);
+
+TYPED_TEST(OptimizeNetTest, TestOptimize) {
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(
+      this->NetProto(), &param));
+  Net<TypeParam> net(param);
+  NetParameter trained;
+  net.ToProto(&trained);
+  NetParameter optimized_param;
+  OptimizeNetForInference(param, trained, &optimized_param);
+  ASSERT_EQ(optimized_param.layers_size(), 3);
+  EXPECT_EQ(optimized_param.layers(0).name(), "conv1");
+  EXPECT_EQ(optimized_param.layers(0).bottom(0), "data");
+  EXPECT_EQ(optimized_param.layers(0).top(0), "post");
+  EXPECT_EQ(optimized_param.layers(1).name(), "relu1");
+  EXPECT_EQ(optimized_param.layers(2).name(), "ip1");
+  EXPECT_EQ(optimized_param.layers(2).bottom(0), "post");
+  Net<TypeParam> optimized_net(optimized_param);
+  // The outputs do not change.
+  FillerParameter filler_param;
+  filler_param.set_std(2);
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(net.input_blobs()[0]);
+  optimized_net.input_blobs()[0]->CopyFrom(*net.input_blobs()[0]);
+  const Blob<TypeParam>* output = net.ForwardPrefilled()[0];
+  const Blob<TypeParam>* optimized_output =
+      optimized_net.ForwardPrefilled()[0];
+  ASSERT_EQ(output->count(), optimized_output->count());
+  for (int i = 0; i < output->count(); ++i) {
+    EXPECT_NEAR(output->cpu_data()[i], optimized_output->cpu_data()[i],
+        1e-4 * std::max(TypeParam(1), std::abs(output->cpu_data()[i])));
+  }
+}
+
+}  // namespace caffe
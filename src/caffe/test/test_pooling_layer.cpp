@@ -1,5 +1,8 @@
 // Copyright 2014 BVLC and contributors.
 
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
 #include <cstring>
 #include <vector>
 
@@ -9,10 +12,14 @@
 #include "caffe/common.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/vision_layers.hpp"
+#include "caffe/util/math_functions.hpp"
 #include "caffe/test/test_gradient_check_util.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
 
+using std::max;
+using std::min;
+
 namespace caffe {
 
 extern cudaDeviceProp CAFFE_TEST_CUDA_PROP;
@@ -34,6 +41,136 @@ class PoolingLayerTest : public ::testing::Test {
     blob_top_vec_.push_back(blob_top_);
   }
   virtual ~PoolingLayerTest() { delete blob_bottom_; delete blob_top_; }
+
+  // Fills the 2 x 3 x 16 x 19 bottom with values in [-2, 2], every third one
+  // rounded down, so that the elements of a window tie.
+  void FillWithTies() {
+    blob_bottom_->Reshape(2, 3, 16, 19);
+    FillerParameter filler_param;
+    filler_param.set_min(-2);
+    filler_param.set_max(2);
+    UniformFiller<Dtype> filler(filler_param);
+    filler.Fill(blob_bottom_);
+    Dtype* bottom_data = blob_bottom_->mutable_cpu_data();
+    for (int i = 0; i < blob_bottom_->count(); i += 3) {
+      bottom_data[i] = floor(bottom_data[i]);
+    }
+  }
+
+  // Checks the layer of pooling_param against the plain loops over the
+  // windows: max pooling must pick the first max of each window, to which
+  // its diff goes, average pooling may round differently.
+  void CheckPooling(const PoolingParameter& pooling_param) {
+    LayerParameter layer_param;
+    layer_param.mutable_pooling_param()->CopyFrom(pooling_param);
+    const bool ave =
+        pooling_param.pool() == PoolingParameter_PoolMethod_AVE;
+    PoolingLayer<Dtype> layer(layer_param);
+    layer.SetUp(blob_bottom_vec_, &blob_top_vec_);
+    layer.Forward(blob_bottom_vec_, &blob_top_vec_);
+    // The diffs of the tops, to check that the max went to the first max
+    if (!ave) {
+      caffe_set(blob_top_->count(), Dtype(1), blob_top_->mutable_cpu_diff());
+      layer.Backward(blob_top_vec_, true, &blob_bottom_vec_);
+    }
+    const int height = blob_bottom_->height();
+    const int width = blob_bottom_->width();
+    int kernel_h = pooling_param.has_kernel_h() ?
+        pooling_param.kernel_h() : pooling_param.kernel_size();
+    int kernel_w = pooling_param.has_kernel_w() ?
+        pooling_param.kernel_w() : pooling_param.kernel_size();
+    const int stride_h = pooling_param.has_stride_h() ?
+        pooling_param.stride_h() : pooling_param.stride();
+    const int stride_w = pooling_param.has_stride_w() ?
+        pooling_param.stride_w() : pooling_param.stride();
+    const int pad_h = pooling_param.has_pad_h() ?
+        pooling_param.pad_h() : pooling_param.pad();
+    const int pad_w = pooling_param.has_pad_w() ?
+        pooling_param.pad_w() : pooling_param.pad();
+    if (pooling_param.global_pooling()) {
+      kernel_h = height;
+      kernel_w = width;
+    }
+    vector<Dtype> expected_diff(blob_bottom_->count(), 0);
+    for (int n = 0; n < blob_top_->num(); ++n) {
+      for (int c = 0; c < blob_top_->channels(); ++c) {
+        for (int ph = 0; ph < blob_top_->height(); ++ph) {
+          for (int pw = 0; pw < blob_top_->width(); ++pw) {
+            const int hstart = ph * stride_h - pad_h;
+            const int wstart = pw * stride_w - pad_w;
+            const int hend = min(hstart + kernel_h, height + pad_h);
+            const int wend = min(wstart + kernel_w, width + pad_w);
+            const int pool_size = (hend - hstart) * (wend - wstart);
+            Dtype expected = ave ? 0 : -FLT_MAX;
+            int expected_index = -1;
+            for (int h = max(hstart, 0); h < min(hend, height); ++h) {
+              for (int w = max(wstart, 0); w < min(wend, width); ++w) {
+                const Dtype value = blob_bottom_->data_at(n, c, h, w);
+                if (ave) {
+                  expected += value;
+                } else if (expected < value) {
+                  expected = value;
+                  expected_index = blob_bottom_->offset(n, c, h, w);
+                }
+              }
+            }
+            if (ave) {
+              EXPECT_NEAR(blob_top_->data_at(n, c, ph, pw),
+                  expected / pool_size, 1e-5);
+            } else {
+              EXPECT_EQ(blob_top_->data_at(n, c, ph, pw), expected);
+              expected_diff[expected_index] += 1;
+            }
+          }
+        }
+      }
+    }
+    for (int j = 0; !ave && j < blob_bottom_->count(); ++j) {
+      EXPECT_EQ(blob_bottom_->cpu_diff()[j], expected_diff[j]);
+    }
+  }
+
+  // The separable paths of large kernels, with a 7 x 7 kernel of stride 2
+  // and a 16 x 16 one of stride 1.
+  void TestLargeKernel() {
+    FillWithTies();
+    for (int i = 0; i < 4; ++i) {
+      const bool ave = i % 2;
+      PoolingParameter pooling_param;
+      pooling_param.set_kernel_size(i < 2 ? 7 : 16);
+      pooling_param.set_stride(i < 2 ? 2 : 1);
+      pooling_param.set_pad(ave && i < 2 ? 1 : 0);
+      pooling_param.set_pool(ave ? PoolingParameter_PoolMethod_AVE :
+          PoolingParameter_PoolMethod_MAX);
+      CheckPooling(pooling_param);
+    }
+  }
+
+  // Rectangular kernels, strides and padding, of the plain and SIMD paths
+  // (stride_w 2) and of the separable one (kernel_w 8), and global pooling.
+  void TestRectangular() {
+    FillWithTies();
+    for (int i = 0; i < 8; ++i) {
+      const bool ave = i % 2;
+      PoolingParameter pooling_param;
+      pooling_param.set_pool(ave ? PoolingParameter_PoolMethod_AVE :
+          PoolingParameter_PoolMethod_MAX);
+      if (i < 6) {
+        pooling_param.set_kernel_h(i < 2 ? 3 : (i < 4 ? 2 : 5));
+        pooling_param.set_kernel_w(i < 2 ? 2 : (i < 4 ? 3 : 8));
+        pooling_param.set_stride_h(i < 2 ? 2 : 1);
+        pooling_param.set_stride_w(i < 4 ? 2 : 3);
+        if (ave) {
+          pooling_param.set_pad_h(1);
+          pooling_param.set_pad_w(i < 4 ? 0 : 2);
+        }
+      } else {
+        pooling_param.set_global_pooling(true);
+      }
+      CheckPooling(pooling_param);
+    }
+  }
+
   Blob<Dtype>* const blob_bottom_;
   Blob<Dtype>* const blob_top_;
   vector<Blob<Dtype>*> blob_bottom_vec_;
@@ -71,6 +208,33 @@ TYPED_TEST(PoolingLayerTest, TestSetupPadded) {
   EXPECT_EQ(this->blob_top_->width(), 3);
 }
 
+TYPED_TEST(PoolingLayerTest, TestSetupRectangular) {
+  LayerParameter layer_param;
+  PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+  pooling_param->set_kernel_h(3);
+  pooling_param->set_kernel_w(2);
+  pooling_param->set_stride_h(2);
+  pooling_param->set_stride_w(1);
+  PoolingLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  EXPECT_EQ(this->blob_top_->num(), this->blob_bottom_->num());
+  EXPECT_EQ(this->blob_top_->channels(), this->blob_bottom_->channels());
+  EXPECT_EQ(this->blob_top_->height(), 3);
+  EXPECT_EQ(this->blob_top_->width(), 4);
+}
+
+TYPED_TEST(PoolingLayerTest, TestSetupGlobal) {
+  LayerParameter layer_param;
+  PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+  pooling_param->set_global_pooling(true);
+  PoolingLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  EXPECT_EQ(this->blob_top_->num(), this->blob_bottom_->num());
+  EXPECT_EQ(this->blob_top_->channels(), this->blob_bottom_->channels());
+  EXPECT_EQ(this->blob_top_->height(), 1);
+  EXPECT_EQ(this->blob_top_->width(), 1);
+}
+
 /*
 TYPED_TEST(PoolingLayerTest, PrintGPUBackward) {
   LayerParameter layer_param;
@@ -99,6 +263,158 @@ TYPED_TEST(PoolingLayerTest, PrintGPUBackward) {
 }
 */
 
+TYPED_TEST(PoolingLayerTest, TestCPUThreadedForward) {
+  LayerParameter layer_param;
+  PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+  pooling_param->set_kernel_size(3);
+  pooling_param->set_stride(2);
+  Caffe::set_mode(Caffe::CPU);
+  for (int pool = PoolingParameter_PoolMethod_MAX;
+       pool <= PoolingParameter_PoolMethod_AVE; ++pool) {
+    pooling_param->set_pool(static_cast<PoolingParameter_PoolMethod>(pool));
+    PoolingLayer<TypeParam> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    Blob<TypeParam> expected_top;
+    expected_top.CopyFrom(*this->blob_top_, false, true);
+    Caffe::set_cpu_threads(2);
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    Caffe::set_cpu_threads(1);
+    for (int i = 0; i < this->blob_top_->count(); ++i) {
+      EXPECT_EQ(this->blob_top_->cpu_data()[i], expected_top.cpu_data()[i]);
+    }
+  }
+}
+
+TYPED_TEST(PoolingLayerTest, TestCPUWideMax) {
+  // Wide enough rows for the SIMD path of the stride 2 windows, which must
+  // give the same results as the plain loops, with and without argmax.
+  this->blob_bottom_->Reshape(2, 3, 9, 21);
+  FillerParameter filler_param;
+  filler_param.set_min(-2);
+  filler_param.set_max(2);
+  UniformFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  TypeParam* bottom_data = this->blob_bottom_->mutable_cpu_data();
+  // Ties between the elements of a window
+  for (int i = 0; i < this->blob_bottom_->count(); i += 3) {
+    bottom_data[i] = floor(bottom_data[i]);
+  }
+  Caffe::set_mode(Caffe::CPU);
+  for (int i = 0; i < 4; ++i) {
+    const int kernel_size = 2 + i % 2;
+    const bool store_argmax = i >= 2;
+    LayerParameter layer_param;
+    PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+    pooling_param->set_kernel_size(kernel_size);
+    pooling_param->set_stride(2);
+    pooling_param->set_pool(PoolingParameter_PoolMethod_MAX);
+    pooling_param->set_store_argmax(store_argmax);
+    PoolingLayer<TypeParam> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    filler.Fill(this->blob_top_);
+    caffe_copy(this->blob_top_->count(), this->blob_top_->cpu_data(),
+        this->blob_top_->mutable_cpu_diff());
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    layer.Backward(this->blob_top_vec_, true, &(this->blob_bottom_vec_));
+    vector<TypeParam> expected_diff(this->blob_bottom_->count(), 0);
+    for (int n = 0; n < this->blob_top_->num(); ++n) {
+      for (int c = 0; c < this->blob_top_->channels(); ++c) {
+        for (int ph = 0; ph < this->blob_top_->height(); ++ph) {
+          for (int pw = 0; pw < this->blob_top_->width(); ++pw) {
+            const int hend = min(ph * 2 + kernel_size, 9);
+            const int wend = min(pw * 2 + kernel_size, 21);
+            TypeParam expected = -FLT_MAX;
+            for (int h = ph * 2; h < hend; ++h) {
+              for (int w = pw * 2; w < wend; ++w) {
+                expected = max(expected,
+                    this->blob_bottom_->data_at(n, c, h, w));
+              }
+            }
+            EXPECT_EQ(this->blob_top_->data_at(n, c, ph, pw), expected);
+            // With argmax, only the first max of the window gets the diff.
+            bool found = false;
+            for (int h = ph * 2; h < hend; ++h) {
+              for (int w = pw * 2; w < wend; ++w) {
+                const bool is_max =
+                    this->blob_bottom_->data_at(n, c, h, w) == expected &&
+                    !(store_argmax && found);
+                expected_diff[this->blob_bottom_->offset(n, c, h, w)] +=
+                    this->blob_top_->diff_at(n, c, ph, pw) * is_max;
+                found = found || is_max;
+              }
+            }
+          }
+        }
+      }
+    }
+    for (int j = 0; j < this->blob_bottom_->count(); ++j) {
+      EXPECT_EQ(this->blob_bottom_->cpu_diff()[j], expected_diff[j]);
+    }
+  }
+}
+
+TYPED_TEST(PoolingLayerTest, TestCPUWideAve) {
+  this->blob_bottom_->Reshape(2, 3, 9, 21);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  Caffe::set_mode(Caffe::CPU);
+  for (int kernel_size = 2; kernel_size <= 3; ++kernel_size) {
+    LayerParameter layer_param;
+    PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+    pooling_param->set_kernel_size(kernel_size);
+    pooling_param->set_stride(2);
+    pooling_param->set_pad(1);
+    pooling_param->set_pool(PoolingParameter_PoolMethod_AVE);
+    PoolingLayer<TypeParam> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    for (int n = 0; n < this->blob_top_->num(); ++n) {
+      for (int c = 0; c < this->blob_top_->channels(); ++c) {
+        for (int ph = 0; ph < this->blob_top_->height(); ++ph) {
+          for (int pw = 0; pw < this->blob_top_->width(); ++pw) {
+            const int hstart = ph * 2 - 1;
+            const int wstart = pw * 2 - 1;
+            const int hend = min(hstart + kernel_size, 9 + 1);
+            const int wend = min(wstart + kernel_size, 21 + 1);
+            const int pool_size = (hend - hstart) * (wend - wstart);
+            TypeParam expected = 0;
+            for (int h = max(hstart, 0); h < min(hend, 9); ++h) {
+              for (int w = max(wstart, 0); w < min(wend, 21); ++w) {
+                expected += this->blob_bottom_->data_at(n, c, h, w);
+              }
+            }
+            expected /= pool_size;
+            EXPECT_EQ(this->blob_top_->data_at(n, c, ph, pw), expected);
+          }
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(PoolingLayerTest, TestCPULargeKernel) {
+  Caffe::set_mode(Caffe::CPU);
+  this->TestLargeKernel();
+}
+
+TYPED_TEST(PoolingLayerTest, TestGPULargeKernel) {
+  Caffe::set_mode(Caffe::GPU);
+  this->TestLargeKernel();
+}
+
+TYPED_TEST(PoolingLayerTest, TestCPURectangular) {
+  Caffe::set_mode(Caffe::CPU);
+  this->TestRectangular();
+}
+
+TYPED_TEST(PoolingLayerTest, TestGPURectangular) {
+  Caffe::set_mode(Caffe::GPU);
+  this->TestRectangular();
+}
+
 TYPED_TEST(PoolingLayerTest, TestCPUGradientMax) {
   LayerParameter layer_param;
   PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
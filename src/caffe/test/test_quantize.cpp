@@ -0,0 +1,63 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "caffe/common.hpp"
+#include "caffe/util/quantize.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class QuantizeTest : public ::testing::Test {};
+
+TEST_F(QuantizeTest, TestQuantize) {
+  const float x[] = { 0.5, -1, 0.26, 3, -3, 1. / 127 };
+  const int8_t expected[] = { 64, -127, 33, 127, -127, 1 };
+  int8_t q[6];
+  caffe_cpu_quantize(6, x, 1.f / 127, q);
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_EQ(q[i], expected[i]);
+  }
+  // The transpose of a 2 x 3 matrix
+  const float y[] = { 1, 2, 3, 4, 5, 6 };
+  const int8_t expected_transpose[] = { 1, 4, 2, 5, 3, 6 };
+  caffe_cpu_quantize_transpose(2, 3, y, 1.f, q);
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_EQ(q[i], expected_transpose[i]);
+  }
+  float scales[2];
+  caffe_cpu_quantize_rows(2, 3, y, q, scales);
+  EXPECT_FLOAT_EQ(scales[0], 3.f / 127);
+  EXPECT_FLOAT_EQ(scales[1], 6.f / 127);
+  EXPECT_EQ(q[2], 127);
+  EXPECT_EQ(q[3], 85);
+}
+
+TEST_F(QuantizeTest, TestGemmS8) {
+  // Sizes around the 16 values of a SIMD step and the blocks of 4 columns
+  const int M = 5, N = 7, K = 37;
+  std::vector<int8_t> A(M * K), B(N * K);
+  for (int i = 0; i < M * K; ++i) {
+    A[i] = (i * 37) % 255 - 127;
+  }
+  for (int i = 0; i < N * K; ++i) {
+    B[i] = (i * 91 + 5) % 255 - 127;
+  }
+  std::vector<int32_t> C(M * N);
+  caffe_cpu_gemm_s8(M, N, K, &A[0], &B[0], &C[0]);
+  for (int m = 0; m < M; ++m) {
+    for (int n = 0; n < N; ++n) {
+      int32_t expected = 0;
+      for (int k = 0; k < K; ++k) {
+        expected += A[m * K + k] * B[n * K + k];
+      }
+      EXPECT_EQ(C[m * N + n], expected);
+    }
+  }
+}
+
+}  // namespace caffe
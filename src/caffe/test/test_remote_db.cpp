@@ -0,0 +1,122 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <cstdio>
+#include <string>
+
+#include "gtest/gtest.h"
+#include "caffe/common.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/block_cache.hpp"
+#include "caffe/util/db.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class RemoteDBTest : public ::testing::Test {
+ protected:
+  RemoteDBTest() : source_(tmpnam(NULL)), cache_dir_(tmpnam(NULL)) {}
+
+  static string Key(const int i) {
+    char key[16];
+    snprintf(key, sizeof(key), "%05d", i);
+    return key;
+  }
+  static string Value(const int i) {
+    return string(i % 50, 'a' + i % 26);
+  }
+
+  // Writes num records, committed 100 at a time.
+  void Write(const int num) {
+    shared_ptr<DB> db(GetDB("remote"));
+    db->Open(source_, DB::NEW);
+    shared_ptr<DBTransaction> transaction(db->NewTransaction());
+    for (int i = 0; i < num; ++i) {
+      transaction->Put(Key(i), Value(i));
+      if (i % 100 == 99) {
+        transaction->Commit();
+      }
+    }
+    transaction->Commit();
+  }
+
+  // Blocks of 1 KB, several per shard and records across them
+  DataParameter ReadParam() {
+    DataParameter param;
+    param.set_backend(DataParameter_DB_REMOTE);
+    param.set_fetch_block_kb(1);
+    param.set_fetch_threads(3);
+    param.set_fetch_ahead_blocks(2);
+    param.set_cache_dir(cache_dir_);
+    return param;
+  }
+
+  string source_;
+  string cache_dir_;
+};
+
+TEST_F(RemoteDBTest, TestReadInOrder) {
+  Write(1000);
+  for (int pass = 0; pass < 2; ++pass) {
+    // The second pass reads the blocks from the cache.
+    shared_ptr<DB> db(GetDB(ReadParam()));
+    db->Open(source_, DB::READ);
+    shared_ptr<DBCursor> cursor(db->NewCursor());
+    for (int i = 0; i < 1000; ++i) {
+      ASSERT_TRUE(cursor->valid());
+      EXPECT_EQ(Key(i), cursor->key());
+      EXPECT_EQ(Value(i), cursor->value());
+      cursor->Next();
+    }
+    EXPECT_FALSE(cursor->valid());
+    cursor->SeekToFirst();
+    EXPECT_EQ(Key(0), cursor->key());
+  }
+}
+
+TEST_F(RemoteDBTest, TestSeek) {
+  Write(1000);
+  shared_ptr<DB> db(GetDB(ReadParam()));
+  db->Open(source_, DB::READ);
+  shared_ptr<DBCursor> cursor(db->NewCursor());
+  cursor->SeekToKey(Key(700));
+  EXPECT_EQ(Key(700), cursor->key());
+  EXPECT_EQ(Value(700), cursor->value());
+  // The first key after it
+  cursor->SeekToKey(Key(300) + "x");
+  EXPECT_EQ(Key(301), cursor->key());
+  cursor->SeekToKey("");
+  EXPECT_EQ(Key(0), cursor->key());
+  cursor->SeekToKey("x");
+  EXPECT_FALSE(cursor->valid());
+  cursor->SeekToLast();
+  EXPECT_EQ(Key(999), cursor->key());
+  cursor->Next();
+  EXPECT_FALSE(cursor->valid());
+}
+
+TEST_F(RemoteDBTest, TestBlockCache) {
+  {
+    DiskBlockCache cache(cache_dir_, 1000);
+    string data;
+    EXPECT_FALSE(cache.Get("a", &data));
+    // Each block takes its key and a newline besides its data.
+    cache.Put("a", string(398, '1'));
+    cache.Put("b", string(398, '2'));
+    EXPECT_TRUE(cache.Get("a", &data));
+    EXPECT_EQ(string(398, '1'), data);
+    // b is the least recently used.
+    cache.Put("c", string(398, '3'));
+    EXPECT_EQ(2, cache.count());
+    EXPECT_EQ(800, cache.size());
+    EXPECT_FALSE(cache.Get("b", &data));
+  }
+  // The blocks stay in the directory for the next cache.
+  DiskBlockCache cache(cache_dir_, 1000);
+  EXPECT_EQ(2, cache.count());
+  string data;
+  EXPECT_TRUE(cache.Get("c", &data));
+  EXPECT_EQ(string(398, '3'), data);
+}
+
+}  // namespace caffe
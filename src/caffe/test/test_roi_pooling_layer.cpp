@@ -0,0 +1,131 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
+#include "cuda_runtime.h"
+#include "gtest/gtest.h"
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/vision_layers.hpp"
+#include "caffe/test/test_gradient_check_util.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+using std::max;
+
+namespace caffe {
+
+template <typename Dtype>
+class ROIPoolingLayerTest : public ::testing::Test {
+ protected:
+  ROIPoolingLayerTest()
+      : blob_bottom_data_(new Blob<Dtype>(2, 3, 8, 10)),
+        blob_bottom_rois_(new Blob<Dtype>(3, 5, 1, 1)),
+        blob_top_(new Blob<Dtype>()) {}
+  virtual void SetUp() {
+    Caffe::set_random_seed(1701);
+    FillerParameter filler_param;
+    GaussianFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_data_);
+    // The whole of item 0, a square of item 1 and a pixel of item 0
+    const Dtype rois[] = {
+      0, 0, 0, 9, 7,
+      1, 2, 2, 5, 5,
+      0, 4, 1, 4, 1 };
+    std::copy(rois, rois + 15, blob_bottom_rois_->mutable_cpu_data());
+    blob_bottom_vec_.push_back(blob_bottom_data_);
+    blob_bottom_vec_.push_back(blob_bottom_rois_);
+    blob_top_vec_.push_back(blob_top_);
+    layer_param_.mutable_roi_pooling_param()->set_pooled_h(2);
+    layer_param_.mutable_roi_pooling_param()->set_pooled_w(2);
+  }
+  virtual ~ROIPoolingLayerTest() {
+    delete blob_bottom_data_;
+    delete blob_bottom_rois_;
+    delete blob_top_;
+  }
+
+  // The max of channel c of item n over [h0, h1) x [w0, w1)
+  Dtype Max(const int n, const int c, const int h0, const int h1,
+      const int w0, const int w1) {
+    Dtype maxval = -FLT_MAX;
+    for (int h = h0; h < h1; ++h) {
+      for (int w = w0; w < w1; ++w) {
+        maxval = max(maxval, blob_bottom_data_->data_at(n, c, h, w));
+      }
+    }
+    return maxval;
+  }
+
+  void TestForward() {
+    ROIPoolingLayer<Dtype> layer(layer_param_);
+    layer.SetUp(blob_bottom_vec_, &blob_top_vec_);
+    layer.Forward(blob_bottom_vec_, &blob_top_vec_);
+    for (int c = 0; c < 3; ++c) {
+      // The whole item in quadrants of 4 x 5
+      EXPECT_EQ(Max(0, c, 0, 4, 0, 5), blob_top_->data_at(0, c, 0, 0));
+      EXPECT_EQ(Max(0, c, 0, 4, 5, 10), blob_top_->data_at(0, c, 0, 1));
+      EXPECT_EQ(Max(0, c, 4, 8, 0, 5), blob_top_->data_at(0, c, 1, 0));
+      EXPECT_EQ(Max(0, c, 4, 8, 5, 10), blob_top_->data_at(0, c, 1, 1));
+      // The 4 x 4 square in quadrants of 2 x 2
+      EXPECT_EQ(Max(1, c, 2, 4, 2, 4), blob_top_->data_at(1, c, 0, 0));
+      EXPECT_EQ(Max(1, c, 4, 6, 4, 6), blob_top_->data_at(1, c, 1, 1));
+      // Every bin of the pixel is the pixel.
+      for (int i = 0; i < 4; ++i) {
+        EXPECT_EQ(blob_bottom_data_->data_at(0, c, 1, 4),
+            blob_top_->data_at(2, c, i / 2, i % 2));
+      }
+    }
+  }
+
+  Blob<Dtype>* const blob_bottom_data_;
+  Blob<Dtype>* const blob_bottom_rois_;
+  Blob<Dtype>* const blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+  LayerParameter layer_param_;
+};
+
+typedef ::testing::Types<float, double> Dtypes;
+TYPED_TEST_CASE(ROIPoolingLayerTest, Dtypes);
+
+TYPED_TEST(ROIPoolingLayerTest, TestSetup) {
+  ROIPoolingLayer<TypeParam> layer(this->layer_param_);
+  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  EXPECT_EQ(this->blob_top_->num(), 3);
+  EXPECT_EQ(this->blob_top_->channels(), 3);
+  EXPECT_EQ(this->blob_top_->height(), 2);
+  EXPECT_EQ(this->blob_top_->width(), 2);
+}
+
+TYPED_TEST(ROIPoolingLayerTest, TestCPUForward) {
+  Caffe::set_mode(Caffe::CPU);
+  this->TestForward();
+}
+
+TYPED_TEST(ROIPoolingLayerTest, TestGPUForward) {
+  Caffe::set_mode(Caffe::GPU);
+  this->TestForward();
+}
+
+TYPED_TEST(ROIPoolingLayerTest, TestCPUGradient) {
+  Caffe::set_mode(Caffe::CPU);
+  ROIPoolingLayer<TypeParam> layer(this->layer_param_);
+  GradientChecker<TypeParam> checker(1e-4, 1e-2);
+  // The regions get no gradient.
+  checker.CheckGradientExhaustive(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_), 0);
+}
+
+TYPED_TEST(ROIPoolingLayerTest, TestGPUGradient) {
+  Caffe::set_mode(Caffe::GPU);
+  ROIPoolingLayer<TypeParam> layer(this->layer_param_);
+  GradientChecker<TypeParam> checker(1e-4, 1e-2);
+  checker.CheckGradientExhaustive(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_), 0);
+}
+
+}  // namespace caffe
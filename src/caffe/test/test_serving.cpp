@@ -0,0 +1,215 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <google/protobuf/text_format.h>
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/serving.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class ServingTest : public ::testing::Test {
+ protected:
+  ServingTest() : num_clients_(2), requests_per_client_(9) {}
+
+  virtual void SetUp() {
+    // The net sums the 3 values of each image twice.
+    const string proto =
+        "name: 'TestNetwork' "
+        "layers: { "
+        "  name: 'data' "
+        "  type: MEMORY_DATA "
+        "  memory_data_param { "
+        "    batch_size: 4 "
+        "    channels: 3 "
+        "    height: 1 "
+        "    width: 1 "
+        "  } "
+        "  top: 'data' "
+        "  top: 'label' "
+        "} "
+        "layers: { "
+        "  name: 'ip' "
+        "  type: INNER_PRODUCT "
+        "  inner_product_param { "
+        "    num_output: 2 "
+        "    weight_filler { "
+        "      type: 'constant' "
+        "      value: 1 "
+        "    } "
+        "  } "
+        "  bottom: 'data' "
+        "  top: 'ip' "
+        "} ";
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param_));
+  }
+
+  struct Client {
+    BatchingServer* server;
+    int id;
+    int requests;
+    // The outputs that were wrong
+    int errors;
+  };
+
+  static void* ClientThread(void* client_pointer) {
+    Client* client = static_cast<Client*>(client_pointer);
+    vector<float> image(3);
+    vector<float> outputs;
+    for (int i = 0; i < client->requests; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        image[j] = client->id * 100 + i + j;
+      }
+      client->server->Serve(&image[0], &outputs);
+      // The outputs of 'ip', and then the label of 'label'
+      const float sum = image[0] + image[1] + image[2];
+      if (outputs.size() != 3 || outputs[0] != sum || outputs[1] != sum ||
+          outputs[2] != 0) {
+        ++client->errors;
+      }
+    }
+    return NULL;
+  }
+
+  void TestServe() {
+    shared_ptr<Net<float> > net(new Net<float>(param_));
+    BatchingServer server(net, 5);
+    EXPECT_EQ(server.batch_size(), 4);
+    EXPECT_EQ(server.image_size(), 3);
+    EXPECT_EQ(server.output_size(), 3);
+    vector<Client> clients(num_clients_);
+    vector<pthread_t> threads(num_clients_);
+    for (int i = 0; i < num_clients_; ++i) {
+      clients[i].server = &server;
+      clients[i].id = i;
+      clients[i].requests = requests_per_client_;
+      clients[i].errors = 0;
+      CHECK(!pthread_create(&threads[i], NULL, ClientThread, &clients[i]));
+    }
+    for (int i = 0; i < num_clients_; ++i) {
+      CHECK(!pthread_join(threads[i], NULL));
+      EXPECT_EQ(clients[i].errors, 0);
+    }
+    const ServingStats stats = server.stats();
+    EXPECT_EQ(stats.requests, num_clients_ * requests_per_client_);
+    EXPECT_GE(stats.batches, (stats.requests + 3) / 4);
+    EXPECT_EQ(stats.batch_items, stats.batches * 4);
+    int64_t latencies = 0;
+    for (int i = 0; i < ServingStats::kLatencyBuckets; ++i) {
+      latencies += stats.latency_histogram[i];
+    }
+    EXPECT_EQ(latencies, stats.requests);
+    EXPECT_GT(stats.LatencyPercentile(0.99), 0);
+    server.ResetStats();
+    EXPECT_EQ(server.stats().requests, 0);
+  }
+
+  struct SchedulerClient {
+    ModelScheduler* scheduler;
+    int model;
+    // The factor of the sums of the model
+    float scale;
+    int requests;
+    int errors;
+  };
+
+  static void* SchedulerClientThread(void* client_pointer) {
+    SchedulerClient* client = static_cast<SchedulerClient*>(client_pointer);
+    vector<float> image(3);
+    vector<float> outputs;
+    for (int i = 0; i < client->requests; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        image[j] = client->model * 100 + i + j;
+      }
+      client->scheduler->Serve(client->model, &image[0], &outputs);
+      const float sum = client->scale * (image[0] + image[1] + image[2]);
+      if (outputs.size() != 3 || outputs[0] != sum || outputs[1] != sum ||
+          outputs[2] != 0) {
+        ++client->errors;
+      }
+    }
+    return NULL;
+  }
+
+  void TestSchedule() {
+    // Model 0 is served by two nets sharing their weights, model 1, whose
+    // sums are tripled, by one.
+    ModelScheduler scheduler(2, true);
+    NetParameter inference_param = param_;
+    inference_param.set_inference(true);
+    shared_ptr<Net<float> > net(new Net<float>(inference_param));
+    vector<shared_ptr<Net<float> > > nets(1, net);
+    nets.push_back(shared_ptr<Net<float> >(
+        new Net<float>(inference_param, net.get())));
+    EXPECT_EQ(scheduler.AddModel("sum", nets, ModelOptions()), 0);
+    NetParameter tripled_param = inference_param;
+    tripled_param.mutable_layers(1)->mutable_inner_product_param()->
+        mutable_weight_filler()->set_value(3);
+    ModelOptions options;
+    options.priority = 1;
+    options.max_latency_ms = 1;
+    EXPECT_EQ(scheduler.AddModel("tripled", vector<shared_ptr<Net<float> > >(
+        1, shared_ptr<Net<float> >(new Net<float>(tripled_param))),
+        options), 1);
+    EXPECT_EQ(scheduler.num_models(), 2);
+    EXPECT_EQ(scheduler.served_net(1).output_size(), 3);
+    // Two clients per model
+    vector<SchedulerClient> clients(4);
+    vector<pthread_t> threads(clients.size());
+    for (int i = 0; i < clients.size(); ++i) {
+      clients[i].scheduler = &scheduler;
+      clients[i].model = i % 2;
+      clients[i].scale = i % 2 ? 3 : 1;
+      clients[i].requests = requests_per_client_;
+      clients[i].errors = 0;
+      CHECK(!pthread_create(&threads[i], NULL, SchedulerClientThread,
+            &clients[i]));
+    }
+    for (int i = 0; i < clients.size(); ++i) {
+      CHECK(!pthread_join(threads[i], NULL));
+      EXPECT_EQ(clients[i].errors, 0);
+    }
+    for (int i = 0; i < 2; ++i) {
+      const ServingStats stats = scheduler.stats(i);
+      EXPECT_EQ(stats.requests, 2 * requests_per_client_);
+      EXPECT_GE(stats.batches, (stats.requests + 3) / 4);
+      EXPECT_EQ(stats.batch_items, stats.batches * 4);
+      EXPECT_LE(stats.late_requests, stats.requests);
+    }
+    scheduler.ResetStats();
+    EXPECT_EQ(scheduler.stats(0).requests, 0);
+  }
+
+  const int num_clients_;
+  const int requests_per_client_;
+  NetParameter param_;
+};
+
+TEST_F(ServingTest, TestServeCPU) {
+  Caffe::set_mode(Caffe::CPU);
+  TestServe();
+}
+
+TEST_F(ServingTest, TestServeGPU) {
+  Caffe::set_mode(Caffe::GPU);
+  TestServe();
+}
+
+TEST_F(ServingTest, TestScheduleCPU) {
+  Caffe::set_mode(Caffe::CPU);
+  TestSchedule();
+}
+
+TEST_F(ServingTest, TestScheduleGPU) {
+  Caffe::set_mode(Caffe::GPU);
+  TestSchedule();
+}
+
+}  // namespace caffe
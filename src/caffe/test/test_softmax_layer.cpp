@@ -82,4 +82,34 @@ TYPED_TEST(SoftmaxLayerTest, TestGradientCPU) {
       &(this->blob_top_vec_));
 }
 
+TYPED_TEST(SoftmaxLayerTest, TestForwardGPUWide) {
+  // Rows longer than the threads of a block, and of unrelated length
+  this->blob_bottom_->Reshape(3, 1000, 1, 1);
+  FillerParameter filler_param;
+  filler_param.set_std(5);
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  SoftmaxLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  Caffe::set_mode(Caffe::CPU);
+  layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  Blob<TypeParam> top_cpu;
+  top_cpu.CopyFrom(*this->blob_top_, false, true);
+  Caffe::set_mode(Caffe::GPU);
+  layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_NEAR(this->blob_top_->cpu_data()[i], top_cpu.cpu_data()[i], 1e-6);
+  }
+}
+
+TYPED_TEST(SoftmaxLayerTest, TestGradientGPU) {
+  LayerParameter layer_param;
+  Caffe::set_mode(Caffe::GPU);
+  SoftmaxLayer<TypeParam> layer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, &(this->blob_bottom_vec_),
+      &(this->blob_top_vec_));
+}
+
 }  // namespace caffe
@@ -70,4 +70,39 @@ TYPED_TEST(SoftmaxWithLossLayerTest, TestGradientGPU) {
       &(this->blob_top_vec_), 0, -1, -1);
 }
 
+TYPED_TEST(SoftmaxWithLossLayerTest, TestForwardTestPhase) {
+  LayerParameter layer_param;
+  Caffe::set_mode(Caffe::CPU);
+  SoftmaxWithLossLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+  const TypeParam train_loss =
+      layer.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+  Caffe::set_phase(Caffe::TEST);
+  const TypeParam test_loss =
+      layer.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+  Caffe::set_phase(Caffe::TRAIN);
+  EXPECT_NEAR(test_loss, train_loss, 1e-4 * train_loss);
+}
+
+TYPED_TEST(SoftmaxWithLossLayerTest, TestDeviceLoss) {
+  LayerParameter layer_param;
+  Caffe::set_mode(Caffe::CPU);
+  SoftmaxWithLossLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, &this->blob_top_vec_);
+  const TypeParam loss =
+      layer.Forward(this->blob_bottom_vec_, &this->blob_top_vec_);
+  Caffe::set_mode(Caffe::GPU);
+  EXPECT_NEAR(layer.Forward(this->blob_bottom_vec_, &this->blob_top_vec_),
+      loss, 1e-4 * loss);
+  // The losses are added to the device scalar instead.
+  Blob<TypeParam> device_loss(1, 1, 1, 1);
+  device_loss.mutable_cpu_data()[0] = 1;
+  layer.set_device_loss(device_loss.mutable_gpu_data());
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_EQ(layer.Forward(this->blob_bottom_vec_, &this->blob_top_vec_),
+        0);
+  }
+  EXPECT_NEAR(device_loss.cpu_data()[0], 1 + 2 * loss, 1e-4 * loss);
+}
+
 }  // namespace caffe
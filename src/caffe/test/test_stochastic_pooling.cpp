@@ -43,6 +43,101 @@ class StochasticPoolingLayerTest : public ::testing::Test {
     delete blob_bottom_; delete blob_top_;
   }
 
+  void TestStochastic() {
+    Caffe::set_phase(Caffe::TRAIN);
+    LayerParameter layer_param;
+    PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+    pooling_param->set_kernel_size(3);
+    pooling_param->set_stride(2);
+    pooling_param->set_pool(PoolingParameter_PoolMethod_STOCHASTIC);
+    PoolingLayer<Dtype> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+
+    // Check if the output is correct - it should do random sampling
+    const Dtype* bottom_data = this->blob_bottom_->cpu_data();
+    const Dtype* top_data = this->blob_top_->cpu_data();
+    Dtype total = 0;
+    for (int n = 0; n < this->blob_top_->num(); ++n) {
+      for (int c = 0; c < this->blob_top_->channels(); ++c) {
+        for (int ph = 0; ph < this->blob_top_->height(); ++ph) {
+          for (int pw = 0; pw < this->blob_top_->width(); ++pw) {
+            Dtype pooled = top_data[this->blob_top_->offset(n, c, ph, pw)];
+            total += pooled;
+            int hstart = ph * 2;
+            int hend = min(hstart + 3, this->blob_bottom_->height());
+            int wstart = pw * 2;
+            int wend = min(wstart + 3, this->blob_bottom_->width());
+            bool has_equal = false;
+            for (int h = hstart; h < hend; ++h) {
+              for (int w = wstart; w < wend; ++w) {
+                has_equal |= (pooled == bottom_data[this->blob_bottom_->
+                    offset(n, c, h, w)]);
+              }
+            }
+            EXPECT_TRUE(has_equal);
+          }
+        }
+      }
+    }
+    // When we are doing stochastic pooling, the average we get should be
+    // higher than the simple data average since we are weighting more on
+    // higher-valued ones.
+    EXPECT_GE(total / this->blob_top_->count(), 0.55);
+  }
+
+  void TestStochasticTestPhase() {
+    Caffe::set_phase(Caffe::TEST);
+    LayerParameter layer_param;
+    PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+    pooling_param->set_kernel_size(3);
+    pooling_param->set_stride(2);
+    pooling_param->set_pool(PoolingParameter_PoolMethod_STOCHASTIC);
+    PoolingLayer<Dtype> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
+    layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
+
+    // Check if the output is correct - it should do random sampling
+    const Dtype* bottom_data = this->blob_bottom_->cpu_data();
+    const Dtype* top_data = this->blob_top_->cpu_data();
+    for (int n = 0; n < this->blob_top_->num(); ++n) {
+      for (int c = 0; c < this->blob_top_->channels(); ++c) {
+        for (int ph = 0; ph < this->blob_top_->height(); ++ph) {
+          for (int pw = 0; pw < this->blob_top_->width(); ++pw) {
+            Dtype pooled = top_data[this->blob_top_->offset(n, c, ph, pw)];
+            int hstart = ph * 2;
+            int hend = min(hstart + 3, this->blob_bottom_->height());
+            int wstart = pw * 2;
+            int wend = min(wstart + 3, this->blob_bottom_->width());
+            bool smaller_than_max = false;
+            for (int h = hstart; h < hend; ++h) {
+              for (int w = wstart; w < wend; ++w) {
+                smaller_than_max |= (pooled <=
+                    bottom_data[this->blob_bottom_->offset(n, c, h, w)]);
+              }
+            }
+            EXPECT_TRUE(smaller_than_max);
+          }
+        }
+      }
+    }
+  }
+
+  void TestGradient() {
+    Caffe::set_phase(Caffe::TRAIN);
+    LayerParameter layer_param;
+    PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+    pooling_param->set_kernel_size(3);
+    pooling_param->set_stride(2);
+    pooling_param->set_pool(PoolingParameter_PoolMethod_STOCHASTIC);
+    PoolingLayer<Dtype> layer(layer_param);
+    GradientChecker<Dtype> checker(1e-4, 1e-2);
+    // it is too expensive to call curand multiple times, so we don't do an
+    // exhaustive gradient check.
+    checker.CheckGradient(&layer, &(this->blob_bottom_vec_),
+        &(this->blob_top_vec_));
+  }
+
   Blob<Dtype>* const blob_bottom_;
   Blob<Dtype>* const blob_top_;
   vector<Blob<Dtype>*> blob_bottom_vec_;
@@ -65,104 +160,34 @@ TYPED_TEST(StochasticPoolingLayerTest, TestSetup) {
   EXPECT_EQ(this->blob_top_->width(), 2);
 }
 
+TYPED_TEST(StochasticPoolingLayerTest, TestStochasticCPU) {
+  Caffe::set_mode(Caffe::CPU);
+  this->TestStochastic();
+}
+
 TYPED_TEST(StochasticPoolingLayerTest, TestStochasticGPU) {
   Caffe::set_mode(Caffe::GPU);
-  Caffe::set_phase(Caffe::TRAIN);
-  LayerParameter layer_param;
-  PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
-  pooling_param->set_kernel_size(3);
-  pooling_param->set_stride(2);
-  pooling_param->set_pool(PoolingParameter_PoolMethod_STOCHASTIC);
-  PoolingLayer<TypeParam> layer(layer_param);
-  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
-  layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
-
-  // Check if the output is correct - it should do random sampling
-  const TypeParam* bottom_data = this->blob_bottom_->cpu_data();
-  const TypeParam* top_data = this->blob_top_->cpu_data();
-  TypeParam total = 0;
-  for (int n = 0; n < this->blob_top_->num(); ++n) {
-    for (int c = 0; c < this->blob_top_->channels(); ++c) {
-      for (int ph = 0; ph < this->blob_top_->height(); ++ph) {
-        for (int pw = 0; pw < this->blob_top_->width(); ++pw) {
-          TypeParam pooled = top_data[this->blob_top_->offset(n, c, ph, pw)];
-          total += pooled;
-          int hstart = ph * 2;
-          int hend = min(hstart + 3, this->blob_bottom_->height());
-          int wstart = pw * 2;
-          int wend = min(wstart + 3, this->blob_bottom_->width());
-          bool has_equal = false;
-          for (int h = hstart; h < hend; ++h) {
-            for (int w = wstart; w < wend; ++w) {
-              has_equal |= (pooled == bottom_data[this->blob_bottom_->
-                  offset(n, c, h, w)]);
-            }
-          }
-          EXPECT_TRUE(has_equal);
-        }
-      }
-    }
-  }
-  // When we are doing stochastic pooling, the average we get should be higher
-  // than the simple data average since we are weighting more on higher-valued
-  // ones.
-  EXPECT_GE(total / this->blob_top_->count(), 0.55);
+  this->TestStochastic();
+}
+
+TYPED_TEST(StochasticPoolingLayerTest, TestStochasticCPUTestPhase) {
+  Caffe::set_mode(Caffe::CPU);
+  this->TestStochasticTestPhase();
 }
 
 TYPED_TEST(StochasticPoolingLayerTest, TestStochasticGPUTestPhase) {
   Caffe::set_mode(Caffe::GPU);
-  Caffe::set_phase(Caffe::TEST);
-  LayerParameter layer_param;
-  PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
-  pooling_param->set_kernel_size(3);
-  pooling_param->set_stride(2);
-  pooling_param->set_pool(PoolingParameter_PoolMethod_STOCHASTIC);
-  PoolingLayer<TypeParam> layer(layer_param);
-  layer.SetUp(this->blob_bottom_vec_, &(this->blob_top_vec_));
-  layer.Forward(this->blob_bottom_vec_, &(this->blob_top_vec_));
-
-  // Check if the output is correct - it should do random sampling
-  const TypeParam* bottom_data = this->blob_bottom_->cpu_data();
-  const TypeParam* top_data = this->blob_top_->cpu_data();
-  for (int n = 0; n < this->blob_top_->num(); ++n) {
-    for (int c = 0; c < this->blob_top_->channels(); ++c) {
-      for (int ph = 0; ph < this->blob_top_->height(); ++ph) {
-        for (int pw = 0; pw < this->blob_top_->width(); ++pw) {
-          TypeParam pooled = top_data[this->blob_top_->offset(n, c, ph, pw)];
-          int hstart = ph * 2;
-          int hend = min(hstart + 3, this->blob_bottom_->height());
-          int wstart = pw * 2;
-          int wend = min(wstart + 3, this->blob_bottom_->width());
-          bool smaller_than_max = false;
-          for (int h = hstart; h < hend; ++h) {
-            for (int w = wstart; w < wend; ++w) {
-              smaller_than_max |= (pooled <= bottom_data[this->blob_bottom_->
-                  offset(n, c, h, w)]);
-            }
-          }
-          EXPECT_TRUE(smaller_than_max);
-        }
-      }
-    }
-  }
+  this->TestStochasticTestPhase();
+}
+
+TYPED_TEST(StochasticPoolingLayerTest, TestGradientCPU) {
+  Caffe::set_mode(Caffe::CPU);
+  this->TestGradient();
 }
 
 TYPED_TEST(StochasticPoolingLayerTest, TestGradientGPU) {
   Caffe::set_mode(Caffe::GPU);
-  Caffe::set_phase(Caffe::TRAIN);
-  LayerParameter layer_param;
-  PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
-  pooling_param->set_kernel_size(3);
-  pooling_param->set_stride(2);
-  pooling_param->set_pool(PoolingParameter_PoolMethod_STOCHASTIC);
-  PoolingLayer<TypeParam> layer(layer_param);
-  GradientChecker<TypeParam> checker(1e-4, 1e-2);
-  // it is too expensive to call curand multiple times, so we don't do an
-  // exhaustive gradient check.
-  checker.CheckGradient(&layer, &(this->blob_bottom_vec_),
-      &(this->blob_top_vec_));
+  this->TestGradient();
 }
 
-
-
 }  // namespace caffe
@@ -1,6 +1,7 @@
 // Copyright 2014 BVLC and contributors.
 
 #include <cstring>
+#include <string>
 #include <vector>
 
 #include "cuda_runtime.h"
@@ -87,4 +88,74 @@ TEST_F(SyncedMemoryTest, TestGPUWrite) {
   EXPECT_EQ(mem.head(), SyncedMemory::SYNCED);
 }
 
+TEST_F(SyncedMemoryTest, TestPinnedAsyncPush) {
+  SyncedMemory mem(10);
+  mem.set_pinned(true);
+  void* cpu_data = mem.mutable_cpu_data();
+  EXPECT_TRUE(mem.pinned());
+  memset(cpu_data, 3, mem.size());
+  cudaStream_t stream;
+  CUDA_CHECK(cudaStreamCreate(&stream));
+  mem.async_gpu_push(stream);
+  EXPECT_EQ(mem.head(), SyncedMemory::SYNCED);
+  CUDA_CHECK(cudaStreamSynchronize(stream));
+  CUDA_CHECK(cudaStreamDestroy(stream));
+  // check if values are the same
+  char* recovered_value = new char[10];
+  cudaMemcpy(reinterpret_cast<void*>(recovered_value), mem.gpu_data(), 10,
+             cudaMemcpyDeviceToHost);
+  for (int i = 0; i < mem.size(); ++i) {
+    EXPECT_EQ((reinterpret_cast<char*>(recovered_value))[i], 3);
+  }
+  delete[] recovered_value;
+}
+
+TEST_F(SyncedMemoryTest, TestView) {
+  shared_ptr<SyncedMemory> mem(new SyncedMemory(10));
+  SyncedMemory view(mem, 4, 3);
+  EXPECT_EQ(view.size(), 3);
+  memset(view.mutable_cpu_data(), 1, view.size());
+  EXPECT_EQ(mem->head(), SyncedMemory::HEAD_AT_CPU);
+  EXPECT_EQ(view.head(), SyncedMemory::HEAD_AT_CPU);
+  EXPECT_EQ(static_cast<const char*>(mem->cpu_data()) + 4, view.cpu_data());
+  // The view and its parent sync as one.
+  cudaMemset(view.mutable_gpu_data(), 2, view.size());
+  EXPECT_EQ(mem->head(), SyncedMemory::HEAD_AT_GPU);
+  const char* data = static_cast<const char*>(mem->cpu_data());
+  for (int i = 0; i < mem->size(); ++i) {
+    EXPECT_EQ(i >= 4 && i < 7 ? 2 : 0, data[i]);
+  }
+}
+
+TEST_F(SyncedMemoryTest, TestTransferTrace) {
+  SyncedMemory::set_trace_mode(SyncedMemory::TRACE_COUNT);
+  SyncedMemory::ResetTransfers();
+  SyncedMemory mem(10);
+  memset(mem.mutable_cpu_data(), 1, mem.size());
+  mem.gpu_data();
+  TransferStats transfers = SyncedMemory::transfers();
+  EXPECT_EQ(transfers.to_device, 1);
+  EXPECT_EQ(transfers.to_device_bytes, 10);
+  EXPECT_EQ(transfers.to_host, 0);
+  EXPECT_EQ(SyncedMemory::layer_transfers("").to_device, 1);
+  // The copies in a scope are the layer's.
+  {
+    const std::string layer_name("layer");
+    SyncedMemory::TraceScope scope(layer_name);
+    mem.mutable_gpu_data();
+    mem.cpu_data();
+  }
+  transfers = SyncedMemory::layer_transfers("layer");
+  EXPECT_EQ(transfers.to_device, 0);
+  EXPECT_EQ(transfers.to_host, 1);
+  EXPECT_EQ(transfers.to_host_bytes, 10);
+  EXPECT_EQ(SyncedMemory::transfers().to_host, 1);
+  SyncedMemory::ResetTransfers();
+  EXPECT_EQ(SyncedMemory::transfers().to_device, 0);
+  SyncedMemory::set_trace_mode(SyncedMemory::TRACE_OFF);
+  mem.mutable_gpu_data();
+  mem.cpu_data();
+  EXPECT_EQ(SyncedMemory::transfers().to_host, 0);
+}
+
 }  // namespace caffe
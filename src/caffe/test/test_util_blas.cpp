@@ -1,6 +1,7 @@
 // Copyright 2014 BVLC and contributors.
 
 #include <cstring>
+#include <vector>
 
 #include "cuda_runtime.h"
 #include "cublas_v2.h"
@@ -132,4 +133,57 @@ TYPED_TEST(GemmTest, TestGemv) {
   }
 }
 
+// The products of one row or one column, which gemm computes with gemv, for
+// all the transpositions and with a beta.
+TYPED_TEST(GemmTest, TestGemmOfOneRowOrColumn) {
+  if (sizeof(TypeParam) == 8 && CAFFE_TEST_CUDA_PROP.major < 2) {
+    LOG(ERROR) << "Skipping test due to old architecture.";
+    return;
+  }
+  const int shapes[2][3] = {{1, 4, 3}, {5, 1, 3}};
+  for (int s = 0; s < 2; ++s) {
+    const int M = shapes[s][0], N = shapes[s][1], K = shapes[s][2];
+    Blob<TypeParam> A(1, 1, M, K);
+    Blob<TypeParam> B(1, 1, K, N);
+    Blob<TypeParam> C(1, 1, M, N);
+    for (int i = 0; i < A.count(); ++i) {
+      A.mutable_cpu_data()[i] = i + 1;
+    }
+    for (int i = 0; i < B.count(); ++i) {
+      B.mutable_cpu_data()[i] = 2 * i - 3;
+    }
+    for (int t = 0; t < 4; ++t) {
+      const CBLAS_TRANSPOSE TransA = t & 1 ? CblasTrans : CblasNoTrans;
+      const CBLAS_TRANSPOSE TransB = t & 2 ? CblasTrans : CblasNoTrans;
+      std::vector<TypeParam> expected(M * N);
+      for (int m = 0; m < M; ++m) {
+        for (int n = 0; n < N; ++n) {
+          TypeParam sum = 0;
+          for (int k = 0; k < K; ++k) {
+            sum += A.cpu_data()[TransA == CblasNoTrans ? m * K + k : k * M + m]
+                * B.cpu_data()[TransB == CblasNoTrans ? k * N + n : n * K + k];
+          }
+          expected[m * N + n] = 2 * sum + 0.5 * (m * N + n);
+        }
+      }
+      for (int gpu = 0; gpu < 2; ++gpu) {
+        for (int i = 0; i < C.count(); ++i) {
+          C.mutable_cpu_data()[i] = i;
+        }
+        if (gpu) {
+          caffe_gpu_gemm<TypeParam>(TransA, TransB, M, N, K, 2., A.gpu_data(),
+              B.gpu_data(), 0.5, C.mutable_gpu_data());
+        } else {
+          caffe_cpu_gemm<TypeParam>(TransA, TransB, M, N, K, 2., A.cpu_data(),
+              B.cpu_data(), 0.5, C.mutable_cpu_data());
+        }
+        for (int i = 0; i < C.count(); ++i) {
+          EXPECT_EQ(expected[i], C.cpu_data()[i]) << M << " x " << N
+              << ", transposition " << t << ", gpu " << gpu;
+        }
+      }
+    }
+  }
+}
+
 }  // namespace caffe
@@ -0,0 +1,98 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <cstdio>
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/data_layers.hpp"
+#include "caffe/proto/caffe.pb.h"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+using std::string;
+
+namespace caffe {
+
+template <typename Dtype>
+class WindowDataLayerTest : public ::testing::Test {
+ protected:
+  WindowDataLayerTest() : window_file_(tmpnam(NULL)) {}
+  virtual void SetUp() {
+    // The cat twice, its windows inside it and at its borders, so that the
+    // context padding goes out of it.
+    std::ofstream outfile(window_file_.c_str(), std::ofstream::out);
+    for (int i = 0; i < 2; ++i) {
+      outfile << "# " << i << "\nexamples/images/cat.jpg\n3\n1200\n1600\n4\n"
+          << "1 0.9 100 200 700 900\n2 0.8 0 0 399 299\n"
+          << "1 1 1500 1100 1599 1199\n0 0.1 800 300 1200 1000\n";
+    }
+    outfile.close();
+  }
+  virtual ~WindowDataLayerTest() { remove(window_file_.c_str()); }
+
+  LayerParameter LayerParam(const bool gpu_transform) {
+    LayerParameter param;
+    WindowDataParameter* window_data_param =
+        param.mutable_window_data_param();
+    window_data_param->set_source(window_file_);
+    window_data_param->set_batch_size(8);
+    window_data_param->set_crop_size(24);
+    window_data_param->set_mirror(true);
+    window_data_param->set_context_pad(4);
+    window_data_param->set_fg_fraction(0.5);
+    window_data_param->set_scale(0.5);
+    window_data_param->add_mean_value(100);
+    window_data_param->add_mean_value(110);
+    window_data_param->add_mean_value(120);
+    window_data_param->set_prefetch_batches(1);
+    window_data_param->set_prefetch_threads(2);
+    window_data_param->set_gpu_transform(gpu_transform);
+    return param;
+  }
+
+  // The first batch of a layer of param set up in mode and run in
+  // forward_mode, the windows sampled from the same seed
+  void Forward(const LayerParameter& param, const Caffe::Brew mode,
+      const Caffe::Brew forward_mode, Blob<Dtype>* data) {
+    Caffe::set_mode(mode);
+    Caffe::set_random_seed(1701);
+    Blob<Dtype> label;
+    vector<Blob<Dtype>*> bottom_vec;
+    vector<Blob<Dtype>*> top_vec;
+    top_vec.push_back(data);
+    top_vec.push_back(&label);
+    WindowDataLayer<Dtype> layer(param);
+    layer.SetUp(bottom_vec, &top_vec);
+    Caffe::set_mode(forward_mode);
+    layer.Forward(bottom_vec, &top_vec);
+    data->cpu_data();
+  }
+
+  const string window_file_;
+};
+
+typedef ::testing::Types<float, double> Dtypes;
+TYPED_TEST_CASE(WindowDataLayerTest, Dtypes);
+
+TYPED_TEST(WindowDataLayerTest, TestGPUTransform) {
+  Blob<TypeParam> data;
+  this->Forward(this->LayerParam(false), Caffe::CPU, Caffe::CPU, &data);
+  Blob<TypeParam> gpu_data;
+  this->Forward(this->LayerParam(true), Caffe::GPU, Caffe::GPU, &gpu_data);
+  // The batch warped on the device, then on the host after a mode change
+  Blob<TypeParam> cpu_data;
+  this->Forward(this->LayerParam(true), Caffe::GPU, Caffe::CPU, &cpu_data);
+  ASSERT_EQ(data.count(), gpu_data.count());
+  ASSERT_EQ(data.count(), cpu_data.count());
+  for (int i = 0; i < data.count(); ++i) {
+    // The host rounds the warped pixels, which the scale halves.
+    EXPECT_NEAR(data.cpu_data()[i], gpu_data.cpu_data()[i], 0.51);
+    EXPECT_NEAR(gpu_data.cpu_data()[i], cpu_data.cpu_data()[i], 1e-3);
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,93 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <cstdio>
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
+
+#include "gtest/gtest.h"
+#include "caffe/common.hpp"
+#include "caffe/util/window_list.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class WindowListTest : public ::testing::Test {
+ protected:
+  WindowListTest()
+      : window_file_(tmpnam(NULL)),
+        cache_file_(tmpnam(NULL)) {}
+  virtual void SetUp() {
+    // 3 images, the second of which has no windows.
+    std::ofstream outfile(window_file_.c_str(), std::ofstream::out);
+    outfile << "# 0\n/images/a.jpg\n3\n100\n200\n2\n"
+        << "1 0.75 10 20 30 40\n0 0.125 1 2 3 4\n";
+    outfile << "# 1\n/images/b.jpg\n1\n50\n60\n0\n";
+    outfile << "# 2\n/images/c.jpg\n3\n70\n80\n1\n"
+        << "5 1 0 0 69 79\n";
+    outfile.close();
+  }
+  virtual ~WindowListTest() {
+    remove(window_file_.c_str());
+    remove(cache_file_.c_str());
+  }
+
+  void CheckWindows(const WindowList& list) {
+    ASSERT_EQ(list.num_images(), 3);
+    EXPECT_STREQ(list.image_path(0), "/images/a.jpg");
+    EXPECT_STREQ(list.image_path(1), "/images/b.jpg");
+    EXPECT_STREQ(list.image_path(2), "/images/c.jpg");
+    EXPECT_EQ(list.image_channels(1), 1);
+    EXPECT_EQ(list.image_height(1), 50);
+    EXPECT_EQ(list.image_width(1), 60);
+    EXPECT_EQ(list.image_height(2), 70);
+    ASSERT_EQ(list.num_windows(), 3);
+    const WindowList::Window& window = list.window(0);
+    EXPECT_EQ(window.image_index, 0);
+    EXPECT_EQ(window.label, 1);
+    EXPECT_EQ(window.overlap, 0.75);
+    EXPECT_EQ(window.x1, 10);
+    EXPECT_EQ(window.y1, 20);
+    EXPECT_EQ(window.x2, 30);
+    EXPECT_EQ(window.y2, 40);
+    EXPECT_EQ(list.window(1).overlap, 0.125);
+    EXPECT_EQ(list.window(2).image_index, 2);
+    EXPECT_EQ(list.window(2).label, 5);
+    EXPECT_EQ(list.window(2).y2, 79);
+  }
+
+  const string window_file_;
+  const string cache_file_;
+};
+
+TEST_F(WindowListTest, TestReadText) {
+  WindowList list;
+  list.Read(window_file_, "");
+  CheckWindows(list);
+}
+
+TEST_F(WindowListTest, TestReadCache) {
+  {
+    WindowList list;
+    list.Read(window_file_, cache_file_);
+    CheckWindows(list);
+  }
+  EXPECT_TRUE(std::ifstream(cache_file_.c_str()).good());
+  {
+    WindowList list;
+    list.Read(window_file_, cache_file_);
+    CheckWindows(list);
+  }
+  // A changed window file is read again.
+  std::ofstream(window_file_.c_str(), std::ofstream::app)
+      << "# 3\n/images/d.jpg\n3\n10\n10\n1\n2 0.5 0 0 9 9\n";
+  WindowList list;
+  list.Read(window_file_, cache_file_);
+  ASSERT_EQ(list.num_images(), 4);
+  EXPECT_STREQ(list.image_path(3), "/images/d.jpg");
+  ASSERT_EQ(list.num_windows(), 4);
+  EXPECT_EQ(list.window(3).image_index, 3);
+  EXPECT_EQ(list.window(3).label, 2);
+}
+
+}  // namespace caffe
@@ -58,7 +58,8 @@ float Timer::MilliSeconds() {
     CUDA_CHECK(cudaEventElapsedTime(&elapsed_milliseconds_, start_gpu_,
                                     stop_gpu_));
   } else {
-    elapsed_milliseconds_ = (stop_cpu_ - start_cpu_).total_milliseconds();
+    elapsed_milliseconds_ =
+        (stop_cpu_ - start_cpu_).total_microseconds() / 1000.;
   }
   return elapsed_milliseconds_;
 }
@@ -0,0 +1,165 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>  // NOLINT(readability/streams)
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/block_cache.hpp"
+
+namespace caffe {
+
+// The files being written, renamed into place once complete
+static const char kTempSuffix[] = ".tmp";
+
+DiskBlockCache::DiskBlockCache(const string& dir, const size_t capacity)
+    : dir_(dir), capacity_(capacity), size_(0) {
+  CHECK(!pthread_mutex_init(&mutex_, NULL)) << "Mutex init failed.";
+  mkdir(dir_.c_str(), 0755);
+  DIR* dir_handle = opendir(dir_.c_str());
+  CHECK(dir_handle) << "Cannot open the cache directory " << dir_;
+  // The blocks left by an earlier run, by time of last use
+  std::vector<std::pair<time_t, std::pair<string, size_t> > > found;
+  while (struct dirent* entry = readdir(dir_handle)) {
+    const string name = entry->d_name;
+    const string path = dir_ + "/" + name;
+    struct stat file_stat;
+    if (stat(path.c_str(), &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+      continue;
+    }
+    if (name.find(kTempSuffix) != string::npos) {
+      unlink(path.c_str());
+      continue;
+    }
+    found.push_back(std::make_pair(file_stat.st_mtime,
+        std::make_pair(name, static_cast<size_t>(file_stat.st_size))));
+  }
+  closedir(dir_handle);
+  std::sort(found.begin(), found.end());
+  for (int i = found.size() - 1; i >= 0; --i) {
+    blocks_.push_back(found[i].second);
+    index_[found[i].second.first] = --blocks_.end();
+    size_ += found[i].second.second;
+  }
+  Evict();
+  LOG(INFO) << "Block cache " << dir_ << ": " << blocks_.size()
+      << " blocks, " << size_ << " of " << capacity_ << " bytes.";
+}
+
+DiskBlockCache::~DiskBlockCache() {
+  pthread_mutex_destroy(&mutex_);
+}
+
+string DiskBlockCache::FileName(const string& key) const {
+  // 64 bit FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = 0; i < key.size(); ++i) {
+    hash = (hash ^ static_cast<unsigned char>(key[i])) * 1099511628211ULL;
+  }
+  char name[17];
+  snprintf(name, sizeof(name), "%016llx",
+      static_cast<unsigned long long>(hash));  // NOLINT(runtime/int)
+  return name;
+}
+
+bool DiskBlockCache::Get(const string& key, string* data) {
+  const string name = FileName(key);
+  pthread_mutex_lock(&mutex_);
+  std::map<string, BlockList::iterator>::iterator it = index_.find(name);
+  const bool found = (it != index_.end());
+  if (found) {
+    blocks_.splice(blocks_.begin(), blocks_, it->second);
+  }
+  pthread_mutex_unlock(&mutex_);
+  if (!found) {
+    return false;
+  }
+  // Read without the lock; a block deleted meanwhile is just a miss.
+  const string path = dir_ + "/" + name;
+  std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+  string file_key;
+  if (!std::getline(file, file_key) || file_key != key) {
+    return false;
+  }
+  std::ostringstream contents;
+  contents << file.rdbuf();
+  if (!file) {
+    return false;
+  }
+  *data = contents.str();
+  // For the order of use of the next run
+  utimes(path.c_str(), NULL);
+  return true;
+}
+
+void DiskBlockCache::Put(const string& key, const string& data) {
+  const size_t bytes = key.size() + 1 + data.size();
+  if (bytes > capacity_) {
+    return;
+  }
+  const string name = FileName(key);
+  const string path = dir_ + "/" + name;
+  std::ostringstream temp_path;
+  temp_path << path << kTempSuffix << pthread_self();
+  {
+    std::ofstream file(temp_path.str().c_str(),
+        std::ios::out | std::ios::binary | std::ios::trunc);
+    file << key << '\n';
+    file.write(data.data(), data.size());
+    if (!file) {
+      LOG(WARNING) << "Cannot write the block cache file " << temp_path.str();
+      file.close();
+      unlink(temp_path.str().c_str());
+      return;
+    }
+  }
+  pthread_mutex_lock(&mutex_);
+  CHECK_EQ(rename(temp_path.str().c_str(), path.c_str()), 0);
+  std::map<string, BlockList::iterator>::iterator it = index_.find(name);
+  if (it != index_.end()) {
+    size_ -= it->second->second;
+    blocks_.erase(it->second);
+  }
+  blocks_.push_front(std::make_pair(name, bytes));
+  index_[name] = blocks_.begin();
+  size_ += bytes;
+  Evict();
+  pthread_mutex_unlock(&mutex_);
+}
+
+void DiskBlockCache::Evict() {
+  while (size_ > capacity_) {
+    const std::pair<string, size_t>& last = blocks_.back();
+    unlink((dir_ + "/" + last.first).c_str());
+    size_ -= last.second;
+    index_.erase(last.first);
+    blocks_.pop_back();
+  }
+}
+
+size_t DiskBlockCache::size() {
+  pthread_mutex_lock(&mutex_);
+  const size_t size = size_;
+  pthread_mutex_unlock(&mutex_);
+  return size;
+}
+
+size_t DiskBlockCache::count() {
+  pthread_mutex_lock(&mutex_);
+  const size_t count = blocks_.size();
+  pthread_mutex_unlock(&mutex_);
+  return count;
+}
+
+}  // namespace caffe
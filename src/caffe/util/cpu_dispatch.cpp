@@ -0,0 +1,21 @@
+// Copyright 2014 BVLC and contributors.
+
+#include "caffe/util/cpu_dispatch.hpp"
+
+namespace caffe {
+
+const char* CpuDispatchTarget() {
+#ifdef CAFFE_CPU_DISPATCH_CLONES
+  // The choice of the resolvers of the clones, best first
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return "avx2";
+  }
+  if (__builtin_cpu_supports("sse4.2")) {
+    return "sse4.2";
+  }
+#endif
+  return "default";
+}
+
+}  // namespace caffe
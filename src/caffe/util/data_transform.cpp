@@ -0,0 +1,368 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "caffe/util/cpu_dispatch.hpp"
+#include "caffe/util/data_transform.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+CAFFE_CPU_DISPATCH
+void TransformRow(const int length, const uint8_t* src, const int src_stride,
+    const bool mirror, const Dtype* mean, const Dtype scale, Dtype* dst) {
+  if (mirror) {
+    for (int i = 0; i < length; ++i) {
+      const int j = length - 1 - i;
+      dst[i] = (static_cast<Dtype>(src[j * src_stride]) - mean[j]) * scale;
+    }
+  } else {
+    for (int i = 0; i < length; ++i) {
+      dst[i] = (static_cast<Dtype>(src[i * src_stride]) - mean[i]) * scale;
+    }
+  }
+}
+
+template <typename Dtype>
+CAFFE_CPU_DISPATCH
+void TransformRowMeanValue(const int length, const uint8_t* src,
+    const int src_stride, const bool mirror, const Dtype mean_value,
+    const Dtype scale, Dtype* dst) {
+  if (mirror) {
+    for (int i = 0; i < length; ++i) {
+      const int j = length - 1 - i;
+      dst[i] = (static_cast<Dtype>(src[j * src_stride]) - mean_value) * scale;
+    }
+  } else {
+    for (int i = 0; i < length; ++i) {
+      dst[i] = (static_cast<Dtype>(src[i * src_stride]) - mean_value) * scale;
+    }
+  }
+}
+
+template <typename Dtype>
+CAFFE_CPU_DISPATCH
+void TransformFloats(const int length, const float* src, const Dtype* mean,
+    const Dtype scale, Dtype* dst) {
+  for (int i = 0; i < length; ++i) {
+    dst[i] = (static_cast<Dtype>(src[i]) - mean[i]) * scale;
+  }
+}
+
+template <typename Dtype>
+CAFFE_CPU_DISPATCH
+void TransformFloatsMeanValue(const int length, const float* src,
+    const Dtype mean_value, const Dtype scale, Dtype* dst) {
+  for (int i = 0; i < length; ++i) {
+    dst[i] = (static_cast<Dtype>(src[i]) - mean_value) * scale;
+  }
+}
+
+#ifdef __SSE2__
+// Reverses the order of the 16 bytes in x.
+static inline __m128i ReverseBytes(__m128i x) {
+  x = _mm_shuffle_epi32(x, _MM_SHUFFLE(0, 1, 2, 3));
+  x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+  x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+  return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+// Loads mean[0..3], reversed if mirror is set.
+static inline __m128 LoadMean4(const float* mean, const bool mirror) {
+  const __m128 m = _mm_loadu_ps(mean);
+  return mirror ? _mm_shuffle_ps(m, m, _MM_SHUFFLE(0, 1, 2, 3)) : m;
+}
+
+// Converts the 16 pixels of bytes and stores their transformed values at
+// dst. mean[k] holds the mean values of pixels [4k, 4k + 4).
+static inline void TransformStore16(const __m128i bytes, const __m128* mean,
+    const __m128 scale, float* dst) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i low = _mm_unpacklo_epi8(bytes, zero);
+  const __m128i high = _mm_unpackhi_epi8(bytes, zero);
+  const __m128i pixels[4] = {
+    _mm_unpacklo_epi16(low, zero), _mm_unpackhi_epi16(low, zero),
+    _mm_unpacklo_epi16(high, zero), _mm_unpackhi_epi16(high, zero) };
+  for (int k = 0; k < 4; ++k) {
+    const __m128 value = _mm_cvtepi32_ps(pixels[k]);
+    _mm_storeu_ps(dst + 4 * k,
+        _mm_mul_ps(_mm_sub_ps(value, mean[k]), scale));
+  }
+}
+
+// Loads the 16 source pixels of dst[i, i + 16), which start at offset and
+// are read backwards when mirroring.
+static inline __m128i LoadPixels16(const uint8_t* src, const int offset,
+    const bool mirror) {
+  const __m128i bytes =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + offset));
+  return mirror ? ReverseBytes(bytes) : bytes;
+}
+
+// Contiguous float rows are converted 16 pixels at a time. The results are
+// the same as the scalar version's since no operation is fused.
+template <>
+CAFFE_CPU_DISPATCH
+void TransformRow<float>(const int length, const uint8_t* src,
+    const int src_stride, const bool mirror, const float* mean,
+    const float scale, float* dst) {
+  int i = 0;
+  if (src_stride == 1) {
+    const __m128 scale4 = _mm_set1_ps(scale);
+    for (; i + 16 <= length; i += 16) {
+      const int offset = mirror ? length - 16 - i : i;
+      const float* m = mean + offset;
+      __m128 mean4[4];
+      for (int k = 0; k < 4; ++k) {
+        mean4[k] = LoadMean4(mirror ? m + 12 - 4 * k : m + 4 * k, mirror);
+      }
+      TransformStore16(LoadPixels16(src, offset, mirror), mean4, scale4,
+          dst + i);
+    }
+  }
+  // The strided rows and what is left of the contiguous ones.
+  for (; i < length; ++i) {
+    const int j = mirror ? length - 1 - i : i;
+    dst[i] = (static_cast<float>(src[j * src_stride]) - mean[j]) * scale;
+  }
+}
+
+// With a single mean value, the mean stays in a register for the whole row.
+template <>
+CAFFE_CPU_DISPATCH
+void TransformRowMeanValue<float>(const int length, const uint8_t* src,
+    const int src_stride, const bool mirror, const float mean_value,
+    const float scale, float* dst) {
+  int i = 0;
+  if (src_stride == 1) {
+    const __m128 scale4 = _mm_set1_ps(scale);
+    const __m128 mean4[4] = { _mm_set1_ps(mean_value),
+        _mm_set1_ps(mean_value), _mm_set1_ps(mean_value),
+        _mm_set1_ps(mean_value) };
+    for (; i + 16 <= length; i += 16) {
+      const int offset = mirror ? length - 16 - i : i;
+      TransformStore16(LoadPixels16(src, offset, mirror), mean4, scale4,
+          dst + i);
+    }
+  }
+  for (; i < length; ++i) {
+    const int j = mirror ? length - 1 - i : i;
+    dst[i] = (static_cast<float>(src[j * src_stride]) - mean_value) * scale;
+  }
+}
+
+// Float data is transformed 4 values at a time, with the same results as
+// the scalar version.
+template <>
+CAFFE_CPU_DISPATCH
+void TransformFloats<float>(const int length, const float* src,
+    const float* mean, const float scale, float* dst) {
+  const __m128 scale4 = _mm_set1_ps(scale);
+  int i = 0;
+  for (; i + 4 <= length; i += 4) {
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(src + i),
+        _mm_loadu_ps(mean + i)), scale4));
+  }
+  for (; i < length; ++i) {
+    dst[i] = (src[i] - mean[i]) * scale;
+  }
+}
+
+template <>
+CAFFE_CPU_DISPATCH
+void TransformFloatsMeanValue<float>(const int length, const float* src,
+    const float mean_value, const float scale, float* dst) {
+  const __m128 scale4 = _mm_set1_ps(scale);
+  const __m128 mean4 = _mm_set1_ps(mean_value);
+  int i = 0;
+  for (; i + 4 <= length; i += 4) {
+    _mm_storeu_ps(dst + i,
+        _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(src + i), mean4), scale4));
+  }
+  for (; i < length; ++i) {
+    dst[i] = (src[i] - mean_value) * scale;
+  }
+}
+#endif  // __SSE2__
+
+template <typename Dtype>
+void TransformImage(const uint8_t* data, const int channels,
+    const int height, const int width, const int h_off, const int w_off,
+    const int crop_size, const bool mirror, const Dtype* mean,
+    const Dtype scale, Dtype* dst) {
+  if (crop_size == 0 && !mirror) {
+    // The whole image is then a single row.
+    TransformRow(channels * height * width, data, 1, false, mean, scale, dst);
+    return;
+  }
+  const int crop_height = crop_size ? crop_size : height;
+  const int crop_width = crop_size ? crop_size : width;
+  for (int c = 0; c < channels; ++c) {
+    for (int h = 0; h < crop_height; ++h) {
+      const int data_index = (c * height + h + h_off) * width + w_off;
+      TransformRow(crop_width, data + data_index, 1, mirror,
+          mean + data_index, scale,
+          dst + (c * crop_height + h) * crop_width);
+    }
+  }
+}
+
+template <typename Dtype>
+void TransformImageMeanValues(const uint8_t* data, const int channels,
+    const int height, const int width, const int h_off, const int w_off,
+    const int crop_size, const bool mirror, const Dtype* mean_values,
+    const Dtype scale, Dtype* dst) {
+  if (crop_size == 0 && !mirror) {
+    // Each channel is then a single row.
+    const int size = height * width;
+    for (int c = 0; c < channels; ++c) {
+      TransformRowMeanValue(size, data + c * size, 1, false, mean_values[c],
+          scale, dst + c * size);
+    }
+    return;
+  }
+  const int crop_height = crop_size ? crop_size : height;
+  const int crop_width = crop_size ? crop_size : width;
+  for (int c = 0; c < channels; ++c) {
+    for (int h = 0; h < crop_height; ++h) {
+      const int data_index = (c * height + h + h_off) * width + w_off;
+      TransformRowMeanValue(crop_width, data + data_index, 1, mirror,
+          mean_values[c], scale, dst + (c * crop_height + h) * crop_width);
+    }
+  }
+}
+
+template <typename Dtype>
+CAFFE_CPU_DISPATCH
+void ResizeImage(const Dtype* src, const int height, const int width,
+    const int channels, const int new_height, const int new_width,
+    Dtype* dst) {
+  // The source columns and weights of each destination column, shared by
+  // all the rows.
+  std::vector<int> x0(new_width), x1(new_width);
+  std::vector<Dtype> fx(new_width);
+  for (int x = 0; x < new_width; ++x) {
+    const Dtype sx = std::min<Dtype>(width - 1, std::max<Dtype>(0,
+        (x + Dtype(0.5)) * width / new_width - Dtype(0.5)));
+    x0[x] = static_cast<int>(sx);
+    x1[x] = std::min(x0[x] + 1, width - 1);
+    fx[x] = sx - x0[x];
+  }
+  for (int y = 0; y < new_height; ++y) {
+    const Dtype sy = std::min<Dtype>(height - 1, std::max<Dtype>(0,
+        (y + Dtype(0.5)) * height / new_height - Dtype(0.5)));
+    const int y0 = static_cast<int>(sy);
+    const int y1 = std::min(y0 + 1, height - 1);
+    const Dtype fy = sy - y0;
+    const Dtype* row0 = src + y0 * width * channels;
+    const Dtype* row1 = src + y1 * width * channels;
+    Dtype* dst_row = dst + y * new_width * channels;
+    for (int x = 0; x < new_width; ++x) {
+      for (int c = 0; c < channels; ++c) {
+        const Dtype top = row0[x0[x] * channels + c] * (1 - fx[x])
+            + row0[x1[x] * channels + c] * fx[x];
+        const Dtype bottom = row1[x0[x] * channels + c] * (1 - fx[x])
+            + row1[x1[x] * channels + c] * fx[x];
+        dst_row[x * channels + c] = top * (1 - fy) + bottom * fy;
+      }
+    }
+  }
+}
+
+// Same as TransformRow for the Dtype pixels of pycaffe, which are scaled
+// before the mean is subtracted. mean may be NULL.
+template <typename Dtype>
+CAFFE_CPU_DISPATCH
+static void PreprocessRow(const int length, const Dtype* src,
+    const int src_stride, const bool mirror, const Dtype scale,
+    const Dtype* mean, Dtype* dst) {
+  for (int i = 0; i < length; ++i) {
+    const int j = mirror ? length - 1 - i : i;
+    dst[i] = src[j * src_stride] * scale - (mean ? mean[i] : 0);
+  }
+}
+
+template <typename Dtype>
+void PreprocessImage(const Dtype* src, const int height, const int width,
+    const int channels, const int h_off, const int w_off,
+    const int crop_height, const int crop_width, const bool mirror,
+    const int* channel_order, const Dtype scale, const Dtype* mean,
+    Dtype* dst) {
+  const int crop_size = crop_height * crop_width;
+  for (int c = 0; c < channels; ++c) {
+    const int src_c = channel_order ? channel_order[c] : c;
+    for (int h = 0; h < crop_height; ++h) {
+      const int dst_index = c * crop_size + h * crop_width;
+      PreprocessRow(crop_width,
+          src + ((h + h_off) * width + w_off) * channels + src_c, channels,
+          mirror, scale, mean ? mean + dst_index : NULL, dst + dst_index);
+    }
+  }
+}
+
+template void TransformRow<double>(const int length, const uint8_t* src,
+    const int src_stride, const bool mirror, const double* mean,
+    const double scale, double* dst);
+template void TransformRowMeanValue<double>(const int length,
+    const uint8_t* src, const int src_stride, const bool mirror,
+    const double mean_value, const double scale, double* dst);
+template void TransformFloats<double>(const int length, const float* src,
+    const double* mean, const double scale, double* dst);
+template void TransformFloatsMeanValue<double>(const int length,
+    const float* src, const double mean_value, const double scale,
+    double* dst);
+#ifndef __SSE2__
+template void TransformRow<float>(const int length, const uint8_t* src,
+    const int src_stride, const bool mirror, const float* mean,
+    const float scale, float* dst);
+template void TransformRowMeanValue<float>(const int length,
+    const uint8_t* src, const int src_stride, const bool mirror,
+    const float mean_value, const float scale, float* dst);
+template void TransformFloats<float>(const int length, const float* src,
+    const float* mean, const float scale, float* dst);
+template void TransformFloatsMeanValue<float>(const int length,
+    const float* src, const float mean_value, const float scale,
+    float* dst);
+#endif
+
+template void TransformImage<float>(const uint8_t* data, const int channels,
+    const int height, const int width, const int h_off, const int w_off,
+    const int crop_size, const bool mirror, const float* mean,
+    const float scale, float* dst);
+template void TransformImage<double>(const uint8_t* data, const int channels,
+    const int height, const int width, const int h_off, const int w_off,
+    const int crop_size, const bool mirror, const double* mean,
+    const double scale, double* dst);
+template void TransformImageMeanValues<float>(const uint8_t* data,
+    const int channels, const int height, const int width, const int h_off,
+    const int w_off, const int crop_size, const bool mirror,
+    const float* mean_values, const float scale, float* dst);
+template void TransformImageMeanValues<double>(const uint8_t* data,
+    const int channels, const int height, const int width, const int h_off,
+    const int w_off, const int crop_size, const bool mirror,
+    const double* mean_values, const double scale, double* dst);
+template void ResizeImage<float>(const float* src, const int height,
+    const int width, const int channels, const int new_height,
+    const int new_width, float* dst);
+template void ResizeImage<double>(const double* src, const int height,
+    const int width, const int channels, const int new_height,
+    const int new_width, double* dst);
+template void PreprocessImage<float>(const float* src, const int height,
+    const int width, const int channels, const int h_off, const int w_off,
+    const int crop_height, const int crop_width, const bool mirror,
+    const int* channel_order, const float scale, const float* mean,
+    float* dst);
+template void PreprocessImage<double>(const double* src, const int height,
+    const int width, const int channels, const int h_off, const int w_off,
+    const int crop_height, const int crop_width, const bool mirror,
+    const int* channel_order, const double scale, const double* mean,
+    double* dst);
+
+}  // namespace caffe
@@ -0,0 +1,187 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <errno.h>
+#include <lmdb.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <string>
+#include <utility>
+
+#include <boost/weak_ptr.hpp>
+
+#include "caffe/common.hpp"
+#include "caffe/util/db.hpp"
+#include "caffe/util/remote_db.hpp"
+
+namespace caffe {
+
+// The largest size an lmdb may grow to. The memory map is reserved but not
+// committed, so this only costs address space.
+const size_t LMDB_MAP_SIZE = 1099511627776;  // 1 TB
+
+inline void MDB_CHECK(int mdb_status) {
+  CHECK_EQ(mdb_status, MDB_SUCCESS) << mdb_strerror(mdb_status);
+}
+
+void LevelDBTransaction::Commit() {
+  leveldb::Status status = db_->Write(leveldb::WriteOptions(), &batch_);
+  CHECK(status.ok()) << "Failed to write to leveldb: " << status.ToString();
+  batch_.Clear();
+}
+
+void LevelDB::Open(const string& source, Mode mode) {
+  leveldb::Options options;
+  options.max_open_files = 100;
+  options.create_if_missing = mode != READ;
+  options.error_if_exists = mode == NEW;
+  options.write_buffer_size = 268435456;
+  LOG(INFO) << "Opening leveldb " << source;
+  leveldb::Status status = leveldb::DB::Open(options, source, &db_);
+  CHECK(status.ok()) << "Failed to open leveldb " << source
+      << std::endl << status.ToString() << std::endl
+      << "A leveldb is only opened by one process at a time; convert it to "
+      << "an lmdb to read it from several.";
+}
+
+DBCursor* LevelDB::NewCursor() {
+  leveldb::ReadOptions read_options;
+  // Records are read once per epoch, so there is no point caching them.
+  read_options.fill_cache = false;
+  return new LevelDBCursor(db_->NewIterator(read_options));
+}
+
+void LMDBCursor::Seek(MDB_cursor_op op) {
+  const int mdb_status = mdb_cursor_get(cursor_, &mdb_key_, &mdb_value_, op);
+  if (mdb_status == MDB_NOTFOUND) {
+    valid_ = false;
+  } else {
+    MDB_CHECK(mdb_status);
+    valid_ = true;
+  }
+}
+
+void LMDBCursor::SeekToKey(const string& key) {
+  mdb_key_.mv_size = key.size();
+  mdb_key_.mv_data = const_cast<char*>(key.data());
+  Seek(MDB_SET_RANGE);
+}
+
+LMDBTransaction::LMDBTransaction(MDB_env* env, MDB_dbi dbi)
+    : env_(env), dbi_(dbi) {
+  MDB_CHECK(mdb_txn_begin(env_, NULL, 0, &txn_));
+}
+
+void LMDBTransaction::Put(const string& key, const string& value) {
+  MDB_val mdb_key, mdb_value;
+  mdb_key.mv_data = const_cast<char*>(key.data());
+  mdb_key.mv_size = key.size();
+  mdb_value.mv_data = const_cast<char*>(value.data());
+  mdb_value.mv_size = value.size();
+  MDB_CHECK(mdb_put(txn_, dbi_, &mdb_key, &mdb_value, 0));
+}
+
+void LMDBTransaction::Commit() {
+  MDB_CHECK(mdb_txn_commit(txn_));
+  MDB_CHECK(mdb_txn_begin(env_, NULL, 0, &txn_));
+}
+
+void LMDB::Open(const string& source, Mode mode) {
+  MDB_CHECK(mdb_env_create(&env_));
+  MDB_CHECK(mdb_env_set_mapsize(env_, LMDB_MAP_SIZE));
+  // An lmdb is a directory holding the data and lock files.
+  if (mode != READ) {
+    const bool created = mkdir(source.c_str(), 0744) == 0;
+    CHECK(created || (mode == WRITE && errno == EEXIST)) << "mkdir " << source
+        << " failed";
+  }
+  // Cursors are created by the main thread but used by the prefetch thread,
+  // so read transactions must not be tied to thread local storage.
+  unsigned int flags = MDB_NOTLS;
+  if (mode == READ) {
+    flags |= MDB_RDONLY;
+  }
+  LOG(INFO) << "Opening lmdb " << source;
+  MDB_CHECK(mdb_env_open(env_, source.c_str(), flags, 0664));
+  MDB_txn* txn;
+  MDB_CHECK(mdb_txn_begin(env_, NULL, mode == READ ? MDB_RDONLY : 0, &txn));
+  MDB_CHECK(mdb_dbi_open(txn, NULL, 0, &dbi_));
+  MDB_CHECK(mdb_txn_commit(txn));
+}
+
+DBCursor* LMDB::NewCursor() {
+  MDB_txn* txn;
+  MDB_cursor* cursor;
+  MDB_CHECK(mdb_txn_begin(env_, NULL, MDB_RDONLY, &txn));
+  MDB_CHECK(mdb_cursor_open(txn, dbi_, &cursor));
+  return new LMDBCursor(txn, cursor);
+}
+
+DBTransaction* LMDB::NewTransaction() {
+  return new LMDBTransaction(env_, dbi_);
+}
+
+DB* GetDB(DataParameter::DB backend) {
+  switch (backend) {
+  case DataParameter_DB_LEVELDB:
+    return new LevelDB();
+  case DataParameter_DB_LMDB:
+    return new LMDB();
+  case DataParameter_DB_REMOTE:
+    return new RemoteDB(DataParameter());
+  default:
+    LOG(FATAL) << "Unknown database backend " << backend;
+  }
+  return NULL;
+}
+
+DB* GetDB(const string& backend) {
+  if (backend == "leveldb") {
+    return new LevelDB();
+  } else if (backend == "lmdb") {
+    return new LMDB();
+  } else if (backend == "remote") {
+    return new RemoteDB(DataParameter());
+  }
+  LOG(FATAL) << "Unknown database backend " << backend;
+  return NULL;
+}
+
+// The DBs GetSharedDB opened and still held by someone
+typedef std::map<std::pair<int, string>, boost::weak_ptr<DB> > SharedDBMap;
+static SharedDBMap shared_dbs;
+static pthread_mutex_t shared_dbs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+DB* GetDB(const DataParameter& param) {
+  if (param.backend() == DataParameter_DB_REMOTE) {
+    return new RemoteDB(param);
+  }
+  return GetDB(param.backend());
+}
+
+shared_ptr<DB> GetSharedDB(DataParameter::DB backend, const string& source) {
+  DataParameter param;
+  param.set_backend(backend);
+  param.set_source(source);
+  return GetSharedDB(param);
+}
+
+shared_ptr<DB> GetSharedDB(const DataParameter& param) {
+  const string& source = param.source();
+  pthread_mutex_lock(&shared_dbs_mutex);
+  boost::weak_ptr<DB>& shared =
+      shared_dbs[std::make_pair(param.backend(), source)];
+  shared_ptr<DB> db = shared.lock();
+  if (db) {
+    LOG(INFO) << "Sharing the open database " << source;
+  } else {
+    db.reset(GetDB(param));
+    db->Open(source, DB::READ);
+    shared = db;
+  }
+  pthread_mutex_unlock(&shared_dbs_mutex);
+  return db;
+}
+
+}  // namespace caffe
@@ -0,0 +1,173 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <algorithm>
+
+#include "caffe/util/depthwise_conv.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void depthwise_conv_forward_cpu(const Dtype* bottom, const int num,
+    const int channels, const int height, const int width,
+    const int multiplier, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_out, const int width_out, const Dtype* weight,
+    const Dtype* bias, const bool relu, Dtype* top) {
+  const int kernel_size = kernel_h * kernel_w;
+  for (int n = 0; n < num; ++n) {
+    for (int c = 0; c < channels; ++c) {
+      const Dtype* image = bottom + (n * channels + c) * height * width;
+      for (int m = 0; m < multiplier; ++m) {
+        const int o = c * multiplier + m;
+        const Dtype* kernel = weight + o * kernel_size;
+        Dtype* output = top + (n * channels * multiplier + o) * height_out *
+            width_out;
+        for (int h = 0; h < height_out; ++h) {
+          // The rows of the kernel inside the image
+          const int h_start = h * stride_h - pad_h;
+          const int kh_begin = std::max(0, -h_start);
+          const int kh_end = std::min(kernel_h, height - h_start);
+          for (int w = 0; w < width_out; ++w) {
+            const int w_start = w * stride_w - pad_w;
+            const int kw_begin = std::max(0, -w_start);
+            const int kw_end = std::min(kernel_w, width - w_start);
+            Dtype sum = bias ? bias[o] : Dtype(0);
+            for (int kh = kh_begin; kh < kh_end; ++kh) {
+              const Dtype* row = image + (h_start + kh) * width + w_start;
+              const Dtype* kernel_row = kernel + kh * kernel_w;
+              for (int kw = kw_begin; kw < kw_end; ++kw) {
+                sum += kernel_row[kw] * row[kw];
+              }
+            }
+            output[h * width_out + w] = relu ? std::max(sum, Dtype(0)) : sum;
+          }
+        }
+      }
+    }
+  }
+}
+
+template void depthwise_conv_forward_cpu<float>(const float* bottom,
+    const int num, const int channels, const int height, const int width,
+    const int multiplier, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_out, const int width_out, const float* weight,
+    const float* bias, const bool relu, float* top);
+template void depthwise_conv_forward_cpu<double>(const double* bottom,
+    const int num, const int channels, const int height, const int width,
+    const int multiplier, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_out, const int width_out, const double* weight,
+    const double* bias, const bool relu, double* top);
+
+template <typename Dtype>
+void depthwise_conv_backward_bottom_cpu(const Dtype* top_diff,
+    const int num, const int channels, const int height, const int width,
+    const int multiplier, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_out, const int width_out, const Dtype* weight,
+    const bool accumulate, Dtype* bottom_diff) {
+  const int kernel_size = kernel_h * kernel_w;
+  for (int n = 0; n < num; ++n) {
+    for (int c = 0; c < channels; ++c) {
+      Dtype* image_diff = bottom_diff + (n * channels + c) * height * width;
+      if (!accumulate) {
+        std::fill(image_diff, image_diff + height * width, Dtype(0));
+      }
+      // Each output scatters its diff over the window it read.
+      for (int m = 0; m < multiplier; ++m) {
+        const int o = c * multiplier + m;
+        const Dtype* kernel = weight + o * kernel_size;
+        const Dtype* output_diff = top_diff + (n * channels * multiplier + o)
+            * height_out * width_out;
+        for (int h = 0; h < height_out; ++h) {
+          const int h_start = h * stride_h - pad_h;
+          const int kh_begin = std::max(0, -h_start);
+          const int kh_end = std::min(kernel_h, height - h_start);
+          for (int w = 0; w < width_out; ++w) {
+            const int w_start = w * stride_w - pad_w;
+            const int kw_begin = std::max(0, -w_start);
+            const int kw_end = std::min(kernel_w, width - w_start);
+            const Dtype diff = output_diff[h * width_out + w];
+            for (int kh = kh_begin; kh < kh_end; ++kh) {
+              Dtype* row = image_diff + (h_start + kh) * width + w_start;
+              const Dtype* kernel_row = kernel + kh * kernel_w;
+              for (int kw = kw_begin; kw < kw_end; ++kw) {
+                row[kw] += kernel_row[kw] * diff;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+template void depthwise_conv_backward_bottom_cpu<float>(
+    const float* top_diff, const int num, const int channels,
+    const int height, const int width, const int multiplier,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int height_out,
+    const int width_out, const float* weight, const bool accumulate,
+    float* bottom_diff);
+template void depthwise_conv_backward_bottom_cpu<double>(
+    const double* top_diff, const int num, const int channels,
+    const int height, const int width, const int multiplier,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int height_out,
+    const int width_out, const double* weight, const bool accumulate,
+    double* bottom_diff);
+
+template <typename Dtype>
+void depthwise_conv_backward_weight_cpu(const Dtype* bottom,
+    const Dtype* top_diff, const int num, const int channels,
+    const int height, const int width, const int multiplier,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int height_out,
+    const int width_out, Dtype* weight_diff) {
+  const int kernel_size = kernel_h * kernel_w;
+  for (int n = 0; n < num; ++n) {
+    for (int c = 0; c < channels; ++c) {
+      const Dtype* image = bottom + (n * channels + c) * height * width;
+      for (int m = 0; m < multiplier; ++m) {
+        const int o = c * multiplier + m;
+        Dtype* kernel_diff = weight_diff + o * kernel_size;
+        const Dtype* output_diff = top_diff + (n * channels * multiplier + o)
+            * height_out * width_out;
+        for (int h = 0; h < height_out; ++h) {
+          const int h_start = h * stride_h - pad_h;
+          const int kh_begin = std::max(0, -h_start);
+          const int kh_end = std::min(kernel_h, height - h_start);
+          for (int w = 0; w < width_out; ++w) {
+            const int w_start = w * stride_w - pad_w;
+            const int kw_begin = std::max(0, -w_start);
+            const int kw_end = std::min(kernel_w, width - w_start);
+            const Dtype diff = output_diff[h * width_out + w];
+            for (int kh = kh_begin; kh < kh_end; ++kh) {
+              const Dtype* row = image + (h_start + kh) * width + w_start;
+              Dtype* kernel_row = kernel_diff + kh * kernel_w;
+              for (int kw = kw_begin; kw < kw_end; ++kw) {
+                kernel_row[kw] += row[kw] * diff;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+template void depthwise_conv_backward_weight_cpu<float>(const float* bottom,
+    const float* top_diff, const int num, const int channels,
+    const int height, const int width, const int multiplier,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int height_out,
+    const int width_out, float* weight_diff);
+template void depthwise_conv_backward_weight_cpu<double>(
+    const double* bottom, const double* top_diff, const int num,
+    const int channels, const int height, const int width,
+    const int multiplier, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_out, const int width_out, double* weight_diff);
+
+}  // namespace caffe
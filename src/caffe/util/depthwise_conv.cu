@@ -0,0 +1,222 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <algorithm>
+
+#include "caffe/common.hpp"
+#include "caffe/util/depthwise_conv.hpp"
+
+namespace caffe {
+
+// The threads of a block of DepthwiseConvBackwardWeight, a power of two for
+// the reduction in shared memory
+const int kDepthwiseWeightThreads = 256;
+
+// One thread per output
+template <typename Dtype>
+__global__ void DepthwiseConvForward(const int count, const Dtype* bottom,
+    const int channels, const int height, const int width,
+    const int multiplier, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_out, const int width_out, const Dtype* weight,
+    const Dtype* bias, const bool relu, Dtype* top) {
+  CUDA_KERNEL_LOOP(index, count) {
+    const int w = index % width_out;
+    const int h = (index / width_out) % height_out;
+    const int o = (index / width_out / height_out) % (channels * multiplier);
+    const int n = index / width_out / height_out / (channels * multiplier);
+    const int c = o / multiplier;
+    const Dtype* image = bottom + (n * channels + c) * height * width;
+    const Dtype* kernel = weight + o * kernel_h * kernel_w;
+    const int h_start = h * stride_h - pad_h;
+    const int w_start = w * stride_w - pad_w;
+    Dtype sum = bias ? bias[o] : Dtype(0);
+    for (int kh = max(0, -h_start); kh < min(kernel_h, height - h_start);
+         ++kh) {
+      for (int kw = max(0, -w_start); kw < min(kernel_w, width - w_start);
+           ++kw) {
+        sum += kernel[kh * kernel_w + kw] *
+            image[(h_start + kh) * width + w_start + kw];
+      }
+    }
+    top[index] = relu ? max(sum, Dtype(0)) : sum;
+  }
+}
+
+template <typename Dtype>
+void depthwise_conv_forward_gpu(const Dtype* bottom, const int num,
+    const int channels, const int height, const int width,
+    const int multiplier, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_out, const int width_out, const Dtype* weight,
+    const Dtype* bias, const bool relu, Dtype* top) {
+  const int count = num * channels * multiplier * height_out * width_out;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  DepthwiseConvForward<Dtype><<<CAFFE_GET_BLOCKS(count),
+                                CAFFE_CUDA_NUM_THREADS>>>(
+      count, bottom, channels, height, width, multiplier, kernel_h, kernel_w,
+      pad_h, pad_w, stride_h, stride_w, height_out, width_out, weight, bias,
+      relu, top);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void depthwise_conv_forward_gpu<float>(const float* bottom,
+    const int num, const int channels, const int height, const int width,
+    const int multiplier, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_out, const int width_out, const float* weight,
+    const float* bias, const bool relu, float* top);
+template void depthwise_conv_forward_gpu<double>(const double* bottom,
+    const int num, const int channels, const int height, const int width,
+    const int multiplier, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_out, const int width_out, const double* weight,
+    const double* bias, const bool relu, double* top);
+
+// One thread per bottom value, gathering the diffs of the outputs whose
+// window covers it, so that no two threads write the same value.
+template <typename Dtype>
+__global__ void DepthwiseConvBackwardBottom(const int count,
+    const Dtype* top_diff, const int channels, const int height,
+    const int width, const int multiplier, const int kernel_h,
+    const int kernel_w, const int pad_h, const int pad_w, const int stride_h,
+    const int stride_w, const int height_out, const int width_out,
+    const Dtype* weight, const bool accumulate, Dtype* bottom_diff) {
+  CUDA_KERNEL_LOOP(index, count) {
+    const int w = index % width + pad_w;
+    const int h = (index / width) % height + pad_h;
+    const int c = (index / width / height) % channels;
+    const int n = index / width / height / channels;
+    Dtype sum = 0;
+    for (int m = 0; m < multiplier; ++m) {
+      const int o = c * multiplier + m;
+      const Dtype* kernel = weight + o * kernel_h * kernel_w;
+      const Dtype* output_diff = top_diff + (n * channels * multiplier + o) *
+          height_out * width_out;
+      for (int kh = 0; kh < kernel_h; ++kh) {
+        const int h_out = h - kh;
+        if (h_out < 0 || h_out % stride_h || h_out / stride_h >= height_out) {
+          continue;
+        }
+        for (int kw = 0; kw < kernel_w; ++kw) {
+          const int w_out = w - kw;
+          if (w_out < 0 || w_out % stride_w ||
+              w_out / stride_w >= width_out) {
+            continue;
+          }
+          sum += kernel[kh * kernel_w + kw] * output_diff[
+              (h_out / stride_h) * width_out + w_out / stride_w];
+        }
+      }
+    }
+    bottom_diff[index] = accumulate ? bottom_diff[index] + sum : sum;
+  }
+}
+
+template <typename Dtype>
+void depthwise_conv_backward_bottom_gpu(const Dtype* top_diff,
+    const int num, const int channels, const int height, const int width,
+    const int multiplier, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_out, const int width_out, const Dtype* weight,
+    const bool accumulate, Dtype* bottom_diff) {
+  const int count = num * channels * height * width;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  DepthwiseConvBackwardBottom<Dtype><<<CAFFE_GET_BLOCKS(count),
+                                       CAFFE_CUDA_NUM_THREADS>>>(
+      count, top_diff, channels, height, width, multiplier, kernel_h,
+      kernel_w, pad_h, pad_w, stride_h, stride_w, height_out, width_out,
+      weight, accumulate, bottom_diff);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void depthwise_conv_backward_bottom_gpu<float>(
+    const float* top_diff, const int num, const int channels,
+    const int height, const int width, const int multiplier,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int height_out,
+    const int width_out, const float* weight, const bool accumulate,
+    float* bottom_diff);
+template void depthwise_conv_backward_bottom_gpu<double>(
+    const double* top_diff, const int num, const int channels,
+    const int height, const int width, const int multiplier,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int height_out,
+    const int width_out, const double* weight, const bool accumulate,
+    double* bottom_diff);
+
+// One block per weight, its threads summing the products over the outputs
+// of the batch a block apart, then reduced in shared memory.
+template <typename Dtype>
+__global__ void DepthwiseConvBackwardWeight(const int num_weights,
+    const Dtype* bottom, const Dtype* top_diff, const int num,
+    const int channels, const int height, const int width,
+    const int multiplier, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_out, const int width_out, Dtype* weight_diff) {
+  __shared__ Dtype buffer[kDepthwiseWeightThreads];
+  const int outputs = num * height_out * width_out;
+  for (int index = blockIdx.x; index < num_weights; index += gridDim.x) {
+    const int kw = index % kernel_w;
+    const int kh = (index / kernel_w) % kernel_h;
+    const int o = index / kernel_w / kernel_h;
+    const int c = o / multiplier;
+    Dtype sum = 0;
+    for (int i = threadIdx.x; i < outputs; i += kDepthwiseWeightThreads) {
+      const int w = i % width_out;
+      const int h = (i / width_out) % height_out;
+      const int n = i / width_out / height_out;
+      const int h_in = h * stride_h - pad_h + kh;
+      const int w_in = w * stride_w - pad_w + kw;
+      if (h_in >= 0 && h_in < height && w_in >= 0 && w_in < width) {
+        sum += bottom[((n * channels + c) * height + h_in) * width + w_in] *
+            top_diff[((n * channels * multiplier + o) * height_out + h) *
+            width_out + w];
+      }
+    }
+    buffer[threadIdx.x] = sum;
+    __syncthreads();
+    for (int stride = kDepthwiseWeightThreads / 2; stride > 0; stride /= 2) {
+      if (threadIdx.x < stride) {
+        buffer[threadIdx.x] += buffer[threadIdx.x + stride];
+      }
+      __syncthreads();
+    }
+    if (threadIdx.x == 0) {
+      weight_diff[index] += buffer[0];
+    }
+    __syncthreads();
+  }
+}
+
+template <typename Dtype>
+void depthwise_conv_backward_weight_gpu(const Dtype* bottom,
+    const Dtype* top_diff, const int num, const int channels,
+    const int height, const int width, const int multiplier,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int height_out,
+    const int width_out, Dtype* weight_diff) {
+  const int num_weights = channels * multiplier * kernel_h * kernel_w;
+  const int num_blocks = std::min(num_weights, Caffe::max_blocks());
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  DepthwiseConvBackwardWeight<Dtype><<<num_blocks,
+                                       kDepthwiseWeightThreads>>>(
+      num_weights, bottom, top_diff, num, channels, height, width,
+      multiplier, kernel_h, kernel_w, pad_h, pad_w, stride_h, stride_w,
+      height_out, width_out, weight_diff);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void depthwise_conv_backward_weight_gpu<float>(const float* bottom,
+    const float* top_diff, const int num, const int channels,
+    const int height, const int width, const int multiplier,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int height_out,
+    const int width_out, float* weight_diff);
+template void depthwise_conv_backward_weight_gpu<double>(
+    const double* bottom, const double* top_diff, const int num,
+    const int channels, const int height, const int width,
+    const int multiplier, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_out, const int width_out, double* weight_diff);
+
+}  // namespace caffe
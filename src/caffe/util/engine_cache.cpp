@@ -0,0 +1,98 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <cuda_runtime.h>
+#include <pthread.h>
+
+#include <fstream>  // NOLINT(readability/streams)
+#include <map>
+#include <sstream>
+#include <string>
+
+#include "caffe/common.hpp"
+#include "caffe/util/engine_cache.hpp"
+
+namespace caffe {
+
+// The choices known, and the file they were last read from
+static std::map<string, int> engines_;
+static string loaded_file_;
+static pthread_mutex_t engines_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+
+// Replaces the choices known by those of the cache file if it changed, with
+// the lock held.
+static void LoadEngineCacheFile() {
+  const string& filename = Caffe::engine_cache_file();
+  if (filename == loaded_file_) {
+    return;
+  }
+  engines_.clear();
+  loaded_file_ = filename;
+  if (filename.empty()) {
+    return;
+  }
+  std::ifstream file(filename.c_str());
+  string line;
+  int num_entries = 0;
+  while (std::getline(file, line)) {
+    // The key has spaces, the engine is the last field.
+    const size_t space = line.rfind(' ');
+    if (space == string::npos) {
+      continue;
+    }
+    std::istringstream engine_stream(line.substr(space + 1));
+    int engine;
+    if (engine_stream >> engine) {
+      engines_[line.substr(0, space)] = engine;
+      ++num_entries;
+    }
+  }
+  if (num_entries > 0) {
+    LOG(INFO) << "Read " << num_entries << " engine choices from "
+        << filename;
+  }
+}
+
+string EngineCacheKey(const string& layer_description) {
+  std::ostringstream key;
+  if (Caffe::mode() == Caffe::GPU) {
+    int device;
+    CUDA_CHECK(cudaGetDevice(&device));
+    cudaDeviceProp prop;
+    CUDA_CHECK(cudaGetDeviceProperties(&prop, device));
+    key << "GPU " << prop.name << " " << prop.major << "." << prop.minor;
+  } else {
+    key << "CPU " << Caffe::cpu_threads() << " threads";
+  }
+  key << " " << layer_description;
+  return key.str();
+}
+
+bool LookupEngine(const string& key, int* engine) {
+  pthread_mutex_lock(&engines_mutex_);
+  LoadEngineCacheFile();
+  std::map<string, int>::const_iterator it = engines_.find(key);
+  const bool found = it != engines_.end();
+  if (found) {
+    *engine = it->second;
+  }
+  pthread_mutex_unlock(&engines_mutex_);
+  return found;
+}
+
+void StoreEngine(const string& key, const int engine) {
+  pthread_mutex_lock(&engines_mutex_);
+  LoadEngineCacheFile();
+  engines_[key] = engine;
+  const string& filename = Caffe::engine_cache_file();
+  if (!filename.empty()) {
+    std::ofstream file(filename.c_str(), std::ios::app);
+    if (file.good()) {
+      file << key << " " << engine << "\n";
+    } else {
+      LOG(WARNING) << "Cannot write the engine cache file " << filename;
+    }
+  }
+  pthread_mutex_unlock(&engines_mutex_);
+}
+
+}  // namespace caffe
@@ -0,0 +1,101 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <set>
+#include <string>
+
+#include "caffe/common.hpp"
+#include "caffe/util/feature_cache.hpp"
+
+using std::set;
+using std::string;
+
+namespace caffe {
+
+// The batch size of a data layer
+static int BatchSize(const LayerParameter& layer_param) {
+  switch (layer_param.type()) {
+  case LayerParameter::DATA:
+    return layer_param.data_param().batch_size();
+  case LayerParameter::IMAGE_DATA:
+    return layer_param.image_data_param().batch_size();
+  case LayerParameter::WINDOW_DATA:
+    return layer_param.window_data_param().batch_size();
+  default:
+    LOG(FATAL) << "The first layer " << layer_param.name()
+        << " of a net to cache the features of must be a DATA, IMAGE_DATA "
+        "or WINDOW_DATA layer.";
+  }
+  return 0;
+}
+
+string SplitNetAtBlob(const NetParameter& param, const string& boundary,
+    const string& cache_source, const DataParameter::DB cache_backend,
+    NetParameter* prefix, NetParameter* suffix) {
+  CHECK_EQ(param.input_size(), 0)
+      << "The features of a net of inputs cannot be cached.";
+  CHECK_GT(param.layers_size(), 0);
+  const LayerParameter& data_param = param.layers(0);
+  const int batch_size = BatchSize(data_param);
+  CHECK_GT(data_param.top_size(), 0);
+  const string label = data_param.top_size() > 1 ? data_param.top(1) : "";
+  CHECK_NE(boundary, label) << "The label cannot be cached.";
+  int last = -1;
+  for (int i = 0; i < param.layers_size(); ++i) {
+    for (int j = 0; j < param.layers(i).top_size(); ++j) {
+      if (param.layers(i).top(j) == boundary) {
+        last = i;
+      }
+    }
+  }
+  CHECK_GE(last, 0) << "No layer writes " << boundary;
+  prefix->CopyFrom(param);
+  prefix->clear_layers();
+  suffix->CopyFrom(param);
+  suffix->clear_layers();
+  for (int i = 0; i <= last; ++i) {
+    prefix->add_layers()->CopyFrom(param.layers(i));
+  }
+  // Each item is cached once, in order.
+  LayerParameter* prefix_data = prefix->mutable_layers(0);
+  if (prefix_data->type() == LayerParameter::DATA) {
+    prefix_data->mutable_data_param()->set_shuffle(false);
+    prefix_data->mutable_data_param()->set_rand_skip(0);
+  } else if (prefix_data->type() == LayerParameter::IMAGE_DATA) {
+    prefix_data->mutable_image_data_param()->set_shuffle(false);
+    prefix_data->mutable_image_data_param()->set_rand_skip(0);
+  }
+  LayerParameter* cache_layer = suffix->add_layers();
+  cache_layer->set_name(data_param.name());
+  cache_layer->set_type(LayerParameter::DATA);
+  cache_layer->add_top(boundary);
+  if (!label.empty()) {
+    cache_layer->add_top(label);
+  }
+  DataParameter* cache_data_param = cache_layer->mutable_data_param();
+  cache_data_param->set_source(cache_source);
+  cache_data_param->set_backend(cache_backend);
+  cache_data_param->set_batch_size(batch_size);
+  if (data_param.type() == LayerParameter::DATA &&
+      data_param.data_param().shuffle()) {
+    cache_data_param->set_shuffle(true);
+  } else if (data_param.type() == LayerParameter::IMAGE_DATA &&
+      data_param.image_data_param().shuffle()) {
+    cache_data_param->set_shuffle(true);
+  }
+  // The blobs the cache gives, then those the suffix writes
+  set<string> available(cache_layer->top().begin(),
+      cache_layer->top().end());
+  for (int i = last + 1; i < param.layers_size(); ++i) {
+    const LayerParameter& layer_param = param.layers(i);
+    for (int j = 0; j < layer_param.bottom_size(); ++j) {
+      CHECK(available.count(layer_param.bottom(j)))
+          << "The layer " << layer_param.name() << " above " << boundary
+          << " reads " << layer_param.bottom(j) << ", which is not cached.";
+    }
+    available.insert(layer_param.top().begin(), layer_param.top().end());
+    suffix->add_layers()->CopyFrom(layer_param);
+  }
+  return label;
+}
+
+}  // namespace caffe
@@ -0,0 +1,37 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
+#include <vector>
+
+#include "caffe/util/file_list.hpp"
+
+namespace caffe {
+
+size_t FileList::ReadFile(const string& source) {
+  std::ifstream infile(source.c_str());
+  CHECK(infile.good()) << "Failed to open file list " << source;
+  const size_t start_size = size();
+  string filename;
+  int label;
+  while (infile >> filename >> label) {
+    Add(filename, label);
+  }
+  Trim();
+  return size() - start_size;
+}
+
+void FileList::Add(const string& filename, const int label) {
+  offsets_.push_back(names_.size());
+  names_.insert(names_.end(), filename.begin(), filename.end());
+  names_.push_back('\0');
+  labels_.push_back(label);
+}
+
+void FileList::Trim() {
+  vector<char>(names_).swap(names_);
+  vector<size_t>(offsets_).swap(offsets_);
+  vector<int>(labels_).swap(labels_);
+}
+
+}  // namespace caffe
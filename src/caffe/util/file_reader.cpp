@@ -0,0 +1,157 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/file_reader.hpp"
+
+namespace caffe {
+
+// The alignment of the buffers, offsets and sizes of O_DIRECT reads, that of
+// the logical blocks of most devices
+const size_t kDirectAlignment = 4096;
+
+AsyncFileReader::AsyncFileReader(const int num_threads, const bool direct)
+    : direct_(direct), stopping_(false) {
+  CHECK_GT(num_threads, 0);
+  CHECK(!pthread_mutex_init(&mutex_, NULL)) << "Mutex init failed.";
+  CHECK(!pthread_cond_init(&done_, NULL)) << "Condition init failed.";
+  threads_.resize(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    CHECK(!pthread_create(&threads_[i], NULL, ReaderThread,
+          static_cast<void*>(this))) << "Pthread execution failed.";
+  }
+}
+
+AsyncFileReader::~AsyncFileReader() {
+  pthread_mutex_lock(&mutex_);
+  stopping_ = true;
+  pthread_mutex_unlock(&mutex_);
+  for (int i = 0; i < threads_.size(); ++i) {
+    pending_.push(shared_ptr<FileRead>());
+  }
+  for (int i = 0; i < threads_.size(); ++i) {
+    CHECK(!pthread_join(threads_[i], NULL)) << "Pthread joining failed.";
+  }
+  pthread_cond_destroy(&done_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+shared_ptr<FileRead> AsyncFileReader::Read(const string& filename) {
+  shared_ptr<FileRead> read(new FileRead());
+  read->filename = filename;
+  read->done = false;
+  read->ok = false;
+  pending_.push(read);
+  return read;
+}
+
+bool AsyncFileReader::Wait(const FileRead& read) {
+  pthread_mutex_lock(&mutex_);
+  while (!read.done) {
+    pthread_cond_wait(&done_, &mutex_);
+  }
+  pthread_mutex_unlock(&mutex_);
+  return read.ok;
+}
+
+void AsyncFileReader::Finish(FileRead* read, const bool ok) {
+  pthread_mutex_lock(&mutex_);
+  read->ok = ok;
+  read->done = true;
+  pthread_mutex_unlock(&mutex_);
+  pthread_cond_broadcast(&done_);
+}
+
+void* AsyncFileReader::ReaderThread(void* reader_pointer) {
+  AsyncFileReader* reader = static_cast<AsyncFileReader*>(reader_pointer);
+  std::vector<char> buffer;
+  while (true) {
+    shared_ptr<FileRead> read = reader->pending_.pop();
+    if (!read) {
+      break;
+    }
+    pthread_mutex_lock(&reader->mutex_);
+    const bool stopping = reader->stopping_;
+    pthread_mutex_unlock(&reader->mutex_);
+    reader->Finish(read.get(), !stopping && reader->ReadFile(read.get(),
+        &buffer));
+  }
+  return static_cast<void*>(NULL);
+}
+
+bool AsyncFileReader::ReadFile(FileRead* read, std::vector<char>* buffer) {
+  const char* filename = read->filename.c_str();
+  bool direct = direct_;
+  int fd = -1;
+#ifdef O_DIRECT
+  if (direct) {
+    fd = open(filename, O_RDONLY | O_DIRECT);
+  }
+#endif
+  if (fd < 0) {
+    // Without O_DIRECT on this filesystem, or not asked for
+    direct = false;
+    fd = open(filename, O_RDONLY);
+  }
+  struct stat file_stat;
+  if (fd < 0 || fstat(fd, &file_stat) != 0) {
+    LOG(ERROR) << "Could not open or find file " << filename;
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  const size_t size = file_stat.st_size;
+  // Whole aligned blocks, from an aligned address in the buffer
+  const size_t aligned_size =
+      (size + kDirectAlignment - 1) / kDirectAlignment * kDirectAlignment;
+  if (buffer->size() < aligned_size + kDirectAlignment) {
+    buffer->resize(aligned_size + kDirectAlignment);
+  }
+  char* data = &(*buffer)[0];
+  data += (kDirectAlignment - reinterpret_cast<size_t>(data) %
+      kDirectAlignment) % kDirectAlignment;
+  size_t offset = 0;
+  while (offset < size) {
+    const ssize_t count = pread(fd, data + offset,
+        (direct ? aligned_size : size) - offset, offset);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count < 0 && direct && errno == EINVAL) {
+      // E.g. a short read left the offset unaligned: go on without O_DIRECT.
+      close(fd);
+      direct = false;
+      fd = open(filename, O_RDONLY);
+      if (fd < 0) {
+        break;
+      }
+      continue;
+    }
+    if (count <= 0) {
+      break;
+    }
+    offset += count;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (offset < size) {
+    LOG(ERROR) << "Could not read file " << filename << ": "
+        << strerror(errno);
+    return false;
+  }
+  read->contents.assign(data, size);
+  return true;
+}
+
+}  // namespace caffe
@@ -0,0 +1,107 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <string>
+
+#include "caffe/common.hpp"
+#include "caffe/util/fuse_neurons.hpp"
+
+using std::string;
+
+namespace caffe {
+
+bool CanFuseNeuron(const LayerParameter_LayerType type, const bool first) {
+  switch (type) {
+  // The bottom of ReLU and dropout layers follows from their top.
+  case LayerParameter_LayerType_RELU:
+  case LayerParameter_LayerType_DROPOUT:
+    return true;
+  // Backward reads the top; the bottom cannot be recovered from it safely.
+  case LayerParameter_LayerType_SIGMOID:
+  case LayerParameter_LayerType_TANH:
+    return first;
+  default:
+    return false;
+  }
+}
+
+// Whether the layer has a single bottom and a single top.
+static bool IsNeuron(const LayerParameter& layer_param) {
+  return layer_param.bottom_size() == 1 && layer_param.top_size() == 1;
+}
+
+// Whether the layer is a convolution or inner product layer, with a single
+// top, followed by a ReLU layer in place on it.
+static bool CanFuseReLU(const LayerParameter& layer_param,
+    const LayerParameter& next_param) {
+  return (layer_param.type() == LayerParameter_LayerType_CONVOLUTION ||
+      layer_param.type() == LayerParameter_LayerType_INNER_PRODUCT) &&
+      layer_param.top_size() == 1 && IsNeuron(next_param) &&
+      next_param.type() == LayerParameter_LayerType_RELU &&
+      next_param.device() == layer_param.device() &&
+      next_param.bottom(0) == layer_param.top(0) &&
+      next_param.top(0) == layer_param.top(0);
+}
+
+void FuseNeuronLayers(const NetParameter& in_param,
+    NetParameter* param_fused) {
+  // First fold the ReLU layers into the layers before them.
+  NetParameter param(in_param);
+  param.clear_layers();
+  for (int i = 0; i < in_param.layers_size(); ++i) {
+    LayerParameter* layer_param = param.add_layers();
+    layer_param->CopyFrom(in_param.layers(i));
+    if (i + 1 < in_param.layers_size() &&
+        CanFuseReLU(*layer_param, in_param.layers(i + 1))) {
+      if (layer_param->type() == LayerParameter_LayerType_CONVOLUTION) {
+        layer_param->mutable_convolution_param()->set_fused_relu(true);
+      } else {
+        layer_param->mutable_inner_product_param()->set_fused_relu(true);
+      }
+      LOG(INFO) << "Fusing the ReLU layer " << in_param.layers(i + 1).name()
+          << " into " << layer_param->name();
+      ++i;
+    }
+  }
+  param_fused->CopyFrom(param);
+  param_fused->clear_layers();
+  for (int i = 0; i < param.layers_size(); ) {
+    const LayerParameter& first = param.layers(i);
+    int end = i + 1;
+    if (IsNeuron(first) && CanFuseNeuron(first.type(), true)) {
+      const string& top_name = first.top(0);
+      for (; end < param.layers_size() && end - i < kMaxFusedNeurons; ++end) {
+        const LayerParameter& layer_param = param.layers(end);
+        if (!IsNeuron(layer_param) ||
+            !CanFuseNeuron(layer_param.type(), false) ||
+            layer_param.device() != first.device() ||
+            layer_param.bottom(0) != top_name ||
+            layer_param.top(0) != top_name) {
+          break;
+        }
+      }
+    }
+    if (end == i + 1) {
+      param_fused->add_layers()->CopyFrom(first);
+      ++i;
+      continue;
+    }
+    LayerParameter* fused_param = param_fused->add_layers();
+    string name = first.name();
+    for (int j = i + 1; j < end; ++j) {
+      name += "+" + param.layers(j).name();
+    }
+    fused_param->set_name(name);
+    fused_param->set_type(LayerParameter_LayerType_FUSED_NEURON);
+    fused_param->set_device(first.device());
+    fused_param->add_bottom(first.bottom(0));
+    fused_param->add_top(first.top(0));
+    for (int j = i; j < end; ++j) {
+      fused_param->mutable_fused_neuron_param()->add_layer()->CopyFrom(
+          param.layers(j));
+    }
+    LOG(INFO) << "Fusing the neuron layers " << name;
+    i = end;
+  }
+}
+
+}  // namespace caffe
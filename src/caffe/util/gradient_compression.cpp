@@ -0,0 +1,170 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/gradient_compression.hpp"
+#include "caffe/util/half.hpp"
+#include "caffe/util/quantize.hpp"
+
+using std::vector;
+
+namespace caffe {
+
+template <typename T>
+static void Append(const T& value, vector<char>* message) {
+  const size_t size = message->size();
+  message->resize(size + sizeof(T));
+  memcpy(&(*message)[size], &value, sizeof(T));
+}
+
+template <typename T>
+static T Read(const vector<char>& message, size_t* offset) {
+  CHECK_LE(*offset + sizeof(T), message.size()) << "Truncated gradients.";
+  T value;
+  memcpy(&value, &message[*offset], sizeof(T));
+  *offset += sizeof(T);
+  return value;
+}
+
+// Orders the indices of values by decreasing absolute value.
+template <typename Dtype>
+class AbsGreater {
+ public:
+  explicit AbsGreater(const Dtype* values) : values_(values) {}
+  bool operator()(const int a, const int b) const {
+    return std::fabs(values_[a]) > std::fabs(values_[b]);
+  }
+
+ private:
+  const Dtype* values_;
+};
+
+template <typename Dtype>
+void EncodeGradient(const SolverParameter_GradientCompression compression,
+    const int n, const Dtype* x, const float top_k, Dtype* error,
+    vector<char>* message) {
+  vector<Dtype> values(x, x + n);
+  if (error) {
+    for (int i = 0; i < n; ++i) {
+      values[i] += error[i];
+    }
+  }
+  // The values as decoded
+  vector<Dtype> sent(n);
+  switch (compression) {
+  case SolverParameter_GradientCompression_NONE:
+    for (int i = 0; i < n; ++i) {
+      Append(values[i], message);
+      sent[i] = values[i];
+    }
+    break;
+  case SolverParameter_GradientCompression_HALF:
+    for (int i = 0; i < n; ++i) {
+      const float16 h = float_to_half(values[i]);
+      Append(h, message);
+      sent[i] = half_to_float(h);
+    }
+    break;
+  case SolverParameter_GradientCompression_INT8: {
+    const float scale = caffe_cpu_amax(n, &values[0]) / 127;
+    Append(scale, message);
+    const size_t size = message->size();
+    message->resize(size + n);
+    int8_t* q = reinterpret_cast<int8_t*>(&(*message)[size]);
+    caffe_cpu_quantize(n, &values[0], Dtype(scale), q);
+    for (int i = 0; i < n; ++i) {
+      sent[i] = q[i] * scale;
+    }
+    break;
+  }
+  case SolverParameter_GradientCompression_TOP_K: {
+    CHECK_GT(top_k, 0);
+    CHECK_LE(top_k, 1);
+    const int k = std::max(1, std::min(n,
+        static_cast<int>(std::ceil(top_k * n))));
+    vector<int> indices(n);
+    for (int i = 0; i < n; ++i) {
+      indices[i] = i;
+    }
+    std::nth_element(indices.begin(), indices.begin() + k - 1,
+        indices.end(), AbsGreater<Dtype>(&values[0]));
+    Append(static_cast<int32_t>(k), message);
+    for (int i = 0; i < k; ++i) {
+      const float value = values[indices[i]];
+      Append(static_cast<int32_t>(indices[i]), message);
+      Append(value, message);
+      sent[indices[i]] = value;
+    }
+    break;
+  }
+  default:
+    LOG(FATAL) << "Unknown gradient compression: " << compression;
+  }
+  if (error) {
+    for (int i = 0; i < n; ++i) {
+      error[i] = values[i] - sent[i];
+    }
+  }
+}
+
+template void EncodeGradient<float>(
+    const SolverParameter_GradientCompression compression, const int n,
+    const float* x, const float top_k, float* error, vector<char>* message);
+template void EncodeGradient<double>(
+    const SolverParameter_GradientCompression compression, const int n,
+    const double* x, const float top_k, double* error, vector<char>* message);
+
+template <typename Dtype>
+void DecodeAddGradient(const SolverParameter_GradientCompression compression,
+    const int n, const vector<char>& message, size_t* offset, Dtype* y) {
+  switch (compression) {
+  case SolverParameter_GradientCompression_NONE:
+    for (int i = 0; i < n; ++i) {
+      y[i] += Read<Dtype>(message, offset);
+    }
+    break;
+  case SolverParameter_GradientCompression_HALF:
+    for (int i = 0; i < n; ++i) {
+      y[i] += half_to_float(Read<float16>(message, offset));
+    }
+    break;
+  case SolverParameter_GradientCompression_INT8: {
+    const float scale = Read<float>(message, offset);
+    CHECK_LE(*offset + n, message.size()) << "Truncated gradients.";
+    const int8_t* q = reinterpret_cast<const int8_t*>(&message[*offset]);
+    for (int i = 0; i < n; ++i) {
+      y[i] += q[i] * scale;
+    }
+    *offset += n;
+    break;
+  }
+  case SolverParameter_GradientCompression_TOP_K: {
+    const int k = Read<int32_t>(message, offset);
+    CHECK_LE(k, n);
+    for (int i = 0; i < k; ++i) {
+      const int index = Read<int32_t>(message, offset);
+      CHECK_GE(index, 0);
+      CHECK_LT(index, n);
+      y[index] += Read<float>(message, offset);
+    }
+    break;
+  }
+  default:
+    LOG(FATAL) << "Unknown gradient compression: " << compression;
+  }
+}
+
+template void DecodeAddGradient<float>(
+    const SolverParameter_GradientCompression compression, const int n,
+    const vector<char>& message, size_t* offset, float* y);
+template void DecodeAddGradient<double>(
+    const SolverParameter_GradientCompression compression, const int n,
+    const vector<char>& message, size_t* offset, double* y);
+
+}  // namespace caffe
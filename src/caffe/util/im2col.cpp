@@ -1,62 +1,219 @@
 // Copyright 2014 BVLC and contributors.
 
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
 
+#include "caffe/util/cpu_dispatch.hpp"
 #include "caffe/util/im2col.hpp"
 
 namespace caffe {
 
+// Sets row_col, the width_col columns of a row of data_col, to the elements
+// w * stride + offset of row_im, an image row of width elements, and to 0
+// where these are in the padding. The range of the columns inside the row is
+// found first, so that the elements are copied without a branch each, and
+// with memcpy for a stride of 1. STRIDE is the stride if it is known at
+// compile time, 0 for runtime_stride.
+template <typename Dtype, int STRIDE>
+static inline void im2col_row_cpu(const Dtype* row_im, const int width,
+    const int offset, const int runtime_stride, const int width_col,
+    Dtype* row_col) {
+  const int stride = STRIDE ? STRIDE : runtime_stride;
+  // The columns [begin, end) read inside the row
+  int begin = offset >= 0 ? 0 : (stride - 1 - offset) / stride;
+  int end = width - offset <= 0 ? 0 : (width - offset - 1) / stride + 1;
+  begin = std::min(begin, width_col);
+  end = std::max(std::min(end, width_col), begin);
+  for (int w = 0; w < begin; ++w) {
+    row_col[w] = 0;
+  }
+  if (stride == 1) {
+    memcpy(row_col + begin, row_im + begin + offset,
+        sizeof(Dtype) * (end - begin));
+  } else {
+    for (int w = begin; w < end; ++w) {
+      row_col[w] = row_im[w * stride + offset];
+    }
+  }
+  for (int w = end; w < width_col; ++w) {
+    row_col[w] = 0;
+  }
+}
+
+// Unrolls an image into the columns of data_col, whose rows are row_size
+// apart, a row of it, one kernel element of a channel over the outputs, at a
+// time: the rows of the outputs whose kernel element is in the padding are
+// zeroed whole.
 template <typename Dtype>
-void im2col_cpu(const Dtype* data_im, const int channels,
-    const int height, const int width, const int ksize, const int pad,
-    const int stride, Dtype* data_col) {
-  int height_col = (height + 2 * pad - ksize) / stride + 1;
-  int width_col = (width + 2 * pad - ksize) / stride + 1;
-  int channels_col = channels * ksize * ksize;
-  for (int c = 0; c < channels_col; ++c) {
-    int w_offset = c % ksize;
-    int h_offset = (c / ksize) % ksize;
-    int c_im = c / ksize / ksize;
+CAFFE_CPU_DISPATCH
+static void im2col_rows_cpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int row_size, Dtype* data_col) {
+  int height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1;
+  int width_col = (width + 2 * pad_w - kernel_w) / stride_w + 1;
+  for (int c_im = 0; c_im < channels; ++c_im) {
+    const Dtype* channel_im = data_im + c_im * height * width;
+    for (int h_offset = 0; h_offset < kernel_h; ++h_offset) {
+      for (int w_offset = 0; w_offset < kernel_w; ++w_offset) {
+        Dtype* row_col = data_col +
+            ((c_im * kernel_h + h_offset) * kernel_w + w_offset) * row_size;
+        for (int h = 0; h < height_col; ++h) {
+          const int h_pad = h * stride_h - pad_h + h_offset;
+          if (h_pad < 0 || h_pad >= height) {
+            memset(row_col + h * width_col, 0, sizeof(Dtype) * width_col);
+            continue;
+          }
+          im2col_row_cpu<Dtype, 0>(channel_im + h_pad * width, width,
+              w_offset - pad_w, stride_w, width_col, row_col + h * width_col);
+        }
+      }
+    }
+  }
+}
+
+// im2col_rows_cpu for a square KERNEL x KERNEL kernel of STRIDE both ways,
+// known at compile time, so that the loops over the kernel are unrolled and
+// the copies of the rows specialized for the stride.
+template <typename Dtype, int KERNEL, int STRIDE>
+CAFFE_CPU_DISPATCH
+static void im2col_fixed_rows_cpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int pad_h, const int pad_w,
+    const int row_size, Dtype* data_col) {
+  const int height_col = (height + 2 * pad_h - KERNEL) / STRIDE + 1;
+  const int width_col = (width + 2 * pad_w - KERNEL) / STRIDE + 1;
+  for (int c_im = 0; c_im < channels; ++c_im) {
+    const Dtype* channel_im = data_im + c_im * height * width;
+    Dtype* channel_col = data_col + c_im * KERNEL * KERNEL * row_size;
     for (int h = 0; h < height_col; ++h) {
-      for (int w = 0; w < width_col; ++w) {
-        int h_pad = h * stride - pad + h_offset;
-        int w_pad = w * stride - pad + w_offset;
-        if (h_pad >= 0 && h_pad < height && w_pad >= 0 && w_pad < width)
-          data_col[(c * height_col + h) * width_col + w] =
-            data_im[(c_im * height + h_pad) * width + w_pad];
-        else
-          data_col[(c * height_col + h) * width_col + w] = 0;
+      for (int h_offset = 0; h_offset < KERNEL; ++h_offset) {
+        const int h_pad = h * STRIDE - pad_h + h_offset;
+        Dtype* row_col = channel_col + h_offset * KERNEL * row_size +
+            h * width_col;
+        if (h_pad < 0 || h_pad >= height) {
+          for (int w_offset = 0; w_offset < KERNEL; ++w_offset) {
+            memset(row_col + w_offset * row_size, 0,
+                sizeof(Dtype) * width_col);
+          }
+          continue;
+        }
+        const Dtype* row_im = channel_im + h_pad * width;
+        for (int w_offset = 0; w_offset < KERNEL; ++w_offset) {
+          im2col_row_cpu<Dtype, STRIDE>(row_im, width, w_offset - pad_w,
+              STRIDE, width_col, row_col + w_offset * row_size);
+        }
       }
     }
   }
 }
 
+// The kernel sizes and strides of im2col_fixed_rows_cpu, those of the
+// reference nets and of most others
+template <typename Dtype>
+struct Im2colFixedRows {
+  int kernel_size;
+  int stride;
+  void (*function)(const Dtype* data_im, const int channels,
+      const int height, const int width, const int pad_h, const int pad_w,
+      const int row_size, Dtype* data_col);
+};
+
+// Unrolls an image with im2col_fixed_rows_cpu if it is compiled for the
+// kernel and stride, with im2col_rows_cpu if not.
+template <typename Dtype>
+static void im2col_dispatch_cpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int row_size, Dtype* data_col) {
+  static const Im2colFixedRows<Dtype> fixed_rows[] = {
+    { 3, 1, im2col_fixed_rows_cpu<Dtype, 3, 1> },
+    { 3, 2, im2col_fixed_rows_cpu<Dtype, 3, 2> },
+    { 5, 1, im2col_fixed_rows_cpu<Dtype, 5, 1> },
+    { 5, 2, im2col_fixed_rows_cpu<Dtype, 5, 2> },
+    { 7, 2, im2col_fixed_rows_cpu<Dtype, 7, 2> },
+    { 11, 4, im2col_fixed_rows_cpu<Dtype, 11, 4> },
+  };
+  const int num_fixed_rows = sizeof(fixed_rows) / sizeof(fixed_rows[0]);
+  if (kernel_h == kernel_w && stride_h == stride_w) {
+    for (int i = 0; i < num_fixed_rows; ++i) {
+      if (fixed_rows[i].kernel_size == kernel_h &&
+          fixed_rows[i].stride == stride_h) {
+        fixed_rows[i].function(data_im, channels, height, width, pad_h,
+            pad_w, row_size, data_col);
+        return;
+      }
+    }
+  }
+  im2col_rows_cpu(data_im, channels, height, width, kernel_h, kernel_w,
+      pad_h, pad_w, stride_h, stride_w, row_size, data_col);
+}
+
+template <typename Dtype>
+void im2col_cpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* data_col) {
+  int height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1;
+  int width_col = (width + 2 * pad_w - kernel_w) / stride_w + 1;
+  im2col_dispatch_cpu(data_im, channels, height, width, kernel_h, kernel_w,
+      pad_h, pad_w, stride_h, stride_w, height_col * width_col, data_col);
+}
+
 // Explicit instantiation
 template void im2col_cpu<float>(const float* data_im, const int channels,
-    const int height, const int width, const int ksize, const int pad,
-    const int stride, float* data_col);
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    float* data_col);
 template void im2col_cpu<double>(const double* data_im, const int channels,
-    const int height, const int width, const int ksize, const int pad,
-    const int stride, double* data_col);
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    double* data_col);
+
+template <typename Dtype>
+void im2col_batch_cpu(const Dtype* data_im, const int num, const int channels,
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* data_col) {
+  int height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1;
+  int width_col = (width + 2 * pad_w - kernel_w) / stride_w + 1;
+  const int image_col_size = height_col * width_col;
+  for (int n = 0; n < num; ++n) {
+    im2col_dispatch_cpu(data_im + n * channels * height * width, channels,
+        height, width, kernel_h, kernel_w, pad_h, pad_w, stride_h, stride_w,
+        num * image_col_size, data_col + n * image_col_size);
+  }
+}
+
+// Explicit instantiation
+template void im2col_batch_cpu<float>(const float* data_im, const int num,
+    const int channels, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, float* data_col);
+template void im2col_batch_cpu<double>(const double* data_im, const int num,
+    const int channels, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, double* data_col);
 
 template <typename Dtype>
+CAFFE_CPU_DISPATCH
 void col2im_cpu(const Dtype* data_col, const int channels,
-    const int height, const int width, const int ksize, const int pad,
-    const int stride, Dtype* data_im) {
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* data_im) {
   memset(data_im, 0, sizeof(Dtype) * height * width * channels);
-  int height_col = (height + 2 * pad - ksize) / stride + 1;
-  int width_col = (width + 2 * pad - ksize) / stride + 1;
-  int channels_col = channels * ksize * ksize;
+  int height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1;
+  int width_col = (width + 2 * pad_w - kernel_w) / stride_w + 1;
+  int channels_col = channels * kernel_h * kernel_w;
   for (int c = 0; c < channels_col; ++c) {
-    int w_offset = c % ksize;
-    int h_offset = (c / ksize) % ksize;
-    int c_im = c / ksize / ksize;
+    int w_offset = c % kernel_w;
+    int h_offset = (c / kernel_w) % kernel_h;
+    int c_im = c / kernel_h / kernel_w;
     for (int h = 0; h < height_col; ++h) {
       for (int w = 0; w < width_col; ++w) {
-        int h_pad = h * stride - pad + h_offset;
-        int w_pad = w * stride - pad + w_offset;
+        int h_pad = h * stride_h - pad_h + h_offset;
+        int w_pad = w * stride_w - pad_w + w_offset;
         if (h_pad >= 0 && h_pad < height && w_pad >= 0 && w_pad < width)
           data_im[(c_im * height + h_pad) * width + w_pad] +=
               data_col[(c * height_col + h) * width_col + w];
@@ -67,10 +224,12 @@ void col2im_cpu(const Dtype* data_col, const int channels,
 
 // Explicit instantiation
 template void col2im_cpu<float>(const float* data_col, const int channels,
-    const int height, const int width, const int psize, const int pad,
-    const int stride, float* data_im);
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    float* data_im);
 template void col2im_cpu<double>(const double* data_col, const int channels,
-    const int height, const int width, const int psize, const int pad,
-    const int stride, double* data_im);
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    double* data_im);
 
 }  // namespace caffe
@@ -5,28 +5,43 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <sstream>
+#include <string>
+
 #include "caffe/common.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/engine_cache.hpp"
 #include "caffe/util/im2col.hpp"
 
+using std::max;
+using std::min;
+
 namespace caffe {
 
+// The tiled kernels run blocks of kIm2colTileThreads threads, each staging
+// a band of rows of a channel in kIm2colTileBytes of shared memory.
+const int kIm2colTileThreads = 256;
+const int kIm2colTileBytes = 16384;
+// The grid of older devices holds at most 65535 blocks.
+const int kIm2colMaxBlocks = 65535;
+
 template <typename Dtype>
 __global__ void im2col_gpu_kernel(const int n, const Dtype* data_im,
-    const int height, const int width, const int ksize, const int pad,
-    const int stride, const int height_col, const int width_col,
-    Dtype* data_col) {
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    const int height_col, const int width_col, Dtype* data_col) {
   CUDA_KERNEL_LOOP(index, n) {
     int w_out = index % width_col;
     index /= width_col;
     int h_out = index % height_col;
     int channel_in = index / height_col;
-    int channel_out = channel_in * ksize * ksize;
-    int h_in = h_out * stride - pad;
-    int w_in = w_out * stride - pad;
+    int channel_out = channel_in * kernel_h * kernel_w;
+    int h_in = h_out * stride_h - pad_h;
+    int w_in = w_out * stride_w - pad_w;
     data_col += (channel_out * height_col + h_out) * width_col + w_out;
     data_im += (channel_in * height + h_in) * width + w_in;
-    for (int i = 0; i < ksize; ++i) {
-      for (int j = 0; j < ksize; ++j) {
+    for (int i = 0; i < kernel_h; ++i) {
+      for (int j = 0; j < kernel_w; ++j) {
         int h = h_in + i;
         int w = w_in + j;
         *data_col = (h >= 0 && w >= 0 && h < height && w < width) ?
@@ -37,60 +52,255 @@ __global__ void im2col_gpu_kernel(const int n, const Dtype* data_im,
   }
 }
 
+// The tiled im2col of a KERNEL x KERNEL kernel: block b of the grid takes
+// the tile_rows output rows of tile b % tiles_per_channel of channel
+// b / tiles_per_channel, and every gridDim.x-th tile after them. The input
+// rows of the tile, padded, are read into shared memory a row at a time by
+// consecutive threads, and each thread then writes the KERNEL x KERNEL
+// values of an output column: consecutive threads write consecutive
+// columns of each row of data_col.
+template <typename Dtype, int KERNEL>
+__global__ void im2col_tiled_gpu_kernel(const int num_tiles,
+    const Dtype* data_im, const int height, const int width, const int pad,
+    const int stride, const int height_col, const int width_col,
+    const int tile_rows, const int tiles_per_channel, Dtype* data_col) {
+  __shared__ Dtype patch[kIm2colTileBytes / sizeof(Dtype)];
+  // The columns of the windows of a row
+  const int patch_width = (width_col - 1) * stride + KERNEL;
+  for (int tile = blockIdx.x; tile < num_tiles; tile += gridDim.x) {
+    const int c = tile / tiles_per_channel;
+    const int h_col_start = (tile % tiles_per_channel) * tile_rows;
+    const int rows = min(tile_rows, height_col - h_col_start);
+    const int h_start = h_col_start * stride - pad;
+    const int patch_size = ((rows - 1) * stride + KERNEL) * patch_width;
+    const Dtype* channel_im = data_im + c * height * width;
+    for (int i = threadIdx.x; i < patch_size; i += blockDim.x) {
+      const int h = h_start + i / patch_width;
+      const int w = i % patch_width - pad;
+      patch[i] = (h >= 0 && w >= 0 && h < height && w < width) ?
+          channel_im[h * width + w] : 0;
+    }
+    __syncthreads();
+    const int outputs = rows * width_col;
+    Dtype* tile_col = data_col +
+        (c * KERNEL * KERNEL * height_col + h_col_start) * width_col;
+    for (int i = threadIdx.x; i < outputs; i += blockDim.x) {
+      const Dtype* window = patch + (i / width_col) * stride * patch_width +
+          (i % width_col) * stride;
+      Dtype* column = tile_col + i;
+#pragma unroll
+      for (int kh = 0; kh < KERNEL; ++kh) {
+#pragma unroll
+        for (int kw = 0; kw < KERNEL; ++kw) {
+          column[(kh * KERNEL + kw) * height_col * width_col] =
+              window[kh * patch_width + kw];
+        }
+      }
+    }
+    // The patch is only overwritten once all the threads have read it.
+    __syncthreads();
+  }
+}
+
+// Returns the output rows of the tiles of im2col_tiled_gpu_kernel that fit
+// in shared memory, 0 if a single row does not.
 template <typename Dtype>
-void im2col_gpu(const Dtype* data_im, const int channels,
-    const int height, const int width, const int ksize, const int pad,
-    const int stride, Dtype* data_col) {
+static int im2col_tile_rows(const int kernel_size, const int stride,
+    const int height_col, const int width_col) {
+  const int patch_width = (width_col - 1) * stride + kernel_size;
+  const int patch_rows = kIm2colTileBytes / sizeof(Dtype) / patch_width;
+  if (patch_rows < kernel_size) {
+    return 0;
+  }
+  return min((patch_rows - kernel_size) / stride + 1, height_col);
+}
+
+template <typename Dtype, int KERNEL>
+static void im2col_tiled_gpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int pad, const int stride,
+    const int height_col, const int width_col, const int tile_rows,
+    Dtype* data_col) {
+  const int tiles_per_channel = (height_col + tile_rows - 1) / tile_rows;
+  const int num_tiles = channels * tiles_per_channel;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  im2col_tiled_gpu_kernel<Dtype, KERNEL><<<min(num_tiles, kIm2colMaxBlocks),
+                                           kIm2colTileThreads>>>(
+      num_tiles, data_im, height, width, pad, stride, height_col, width_col,
+      tile_rows, tiles_per_channel, data_col);
+}
+
+// Whether the tiled kernels are compiled for the kernel, square and of 3, 5
+// or 11, the sizes of most nets
+static bool has_tiled_kernel(const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h,
+    const int stride_w) {
+  return kernel_h == kernel_w && pad_h == pad_w && stride_h == stride_w &&
+      (kernel_h == 3 || kernel_h == 5 || kernel_h == 11);
+}
+
+// Runs the im2col kernel of variant, which must not be AUTO, and returns
+// false if it does not compute the shape.
+template <typename Dtype>
+static bool launch_im2col_gpu(const Im2colGpuKernel variant,
+    const Dtype* data_im, const int channels, const int height,
+    const int width, const int kernel_h, const int kernel_w, const int pad_h,
+    const int pad_w, const int stride_h, const int stride_w,
+    Dtype* data_col) {
+  int height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1;
+  int width_col = (width + 2 * pad_w - kernel_w) / stride_w + 1;
+  if (variant == IM2COL_GPU_TILED) {
+    if (!has_tiled_kernel(kernel_h, kernel_w, pad_h, pad_w, stride_h,
+        stride_w)) {
+      return false;
+    }
+    const int tile_rows = im2col_tile_rows<Dtype>(kernel_h, stride_h,
+        height_col, width_col);
+    if (tile_rows == 0) {
+      return false;
+    }
+    switch (kernel_h) {
+    case 3:
+      im2col_tiled_gpu<Dtype, 3>(data_im, channels, height, width, pad_h,
+          stride_h, height_col, width_col, tile_rows, data_col);
+      break;
+    case 5:
+      im2col_tiled_gpu<Dtype, 5>(data_im, channels, height, width, pad_h,
+          stride_h, height_col, width_col, tile_rows, data_col);
+      break;
+    case 11:
+      im2col_tiled_gpu<Dtype, 11>(data_im, channels, height, width, pad_h,
+          stride_h, height_col, width_col, tile_rows, data_col);
+      break;
+    }
+    CUDA_POST_KERNEL_CHECK;
+    return true;
+  }
   // We are going to launch channels * height_col * width_col kernels, each
   // kernel responsible for copying a single-channel grid.
-  int height_col = (height + 2 * pad - ksize) / stride + 1;
-  int width_col = (width + 2 * pad - ksize) / stride + 1;
   int num_kernels = channels * height_col * width_col;
   // NOLINT_NEXT_LINE(whitespace/operators)
   im2col_gpu_kernel<Dtype><<<CAFFE_GET_BLOCKS(num_kernels),
                              CAFFE_CUDA_NUM_THREADS>>>(
-      num_kernels, data_im, height, width, ksize, pad, stride, height_col,
-      width_col, data_col);
+      num_kernels, data_im, height, width, kernel_h, kernel_w, pad_h, pad_w,
+      stride_h, stride_w, height_col, width_col, data_col);
   CUDA_POST_KERNEL_CHECK;
+  return true;
+}
+
+// Returns the faster of the plain and the tiled kernels of launch, i.e.
+// launch_im2col_gpu or launch_col2im_gpu, for the shape, timed on the
+// buffers themselves, which both overwrite, the first time the shape is
+// seen and then kept by the engine cache.
+template <typename Dtype>
+static Im2colGpuKernel tune_im2col_gpu(const char* name,
+    bool (*launch)(const Im2colGpuKernel, const Dtype*, const int,
+        const int, const int, const int, const int, const int, const int,
+        const int, const int, Dtype*),
+    const Dtype* input, const int channels, const int height,
+    const int width, const int kernel_h, const int kernel_w, const int pad_h,
+    const int pad_w, const int stride_h, const int stride_w, Dtype* output) {
+  if (!has_tiled_kernel(kernel_h, kernel_w, pad_h, pad_w, stride_h,
+      stride_w)) {
+    return IM2COL_GPU_PLAIN;
+  }
+  std::ostringstream description;
+  description << name << " " << sizeof(Dtype) << " " << channels << " "
+      << height << " " << width << " " << kernel_h << " " << kernel_w << " "
+      << pad_h << " " << pad_w << " " << stride_h << " " << stride_w;
+  const string key = EngineCacheKey(description.str());
+  int cached_kernel;
+  if (LookupEngine(key, &cached_kernel) &&
+      (cached_kernel == IM2COL_GPU_PLAIN ||
+       cached_kernel == IM2COL_GPU_TILED)) {
+    return static_cast<Im2colGpuKernel>(cached_kernel);
+  }
+  const Im2colGpuKernel candidates[] = { IM2COL_GPU_PLAIN, IM2COL_GPU_TILED };
+  const int kTimedCalls = 5;
+  Im2colGpuKernel best_kernel = IM2COL_GPU_PLAIN;
+  float best_time = 0;
+  for (int i = 0; i < 2; ++i) {
+    // The first call is not timed.
+    if (!launch(candidates[i], input, channels, height, width, kernel_h,
+        kernel_w, pad_h, pad_w, stride_h, stride_w, output)) {
+      continue;
+    }
+    Timer timer;
+    timer.Start();
+    for (int call = 0; call < kTimedCalls; ++call) {
+      launch(candidates[i], input, channels, height, width, kernel_h,
+          kernel_w, pad_h, pad_w, stride_h, stride_w, output);
+    }
+    timer.Stop();
+    const float time = timer.MilliSeconds();
+    if (i == 0 || time < best_time) {
+      best_kernel = candidates[i];
+      best_time = time;
+    }
+  }
+  StoreEngine(key, best_kernel);
+  return best_kernel;
+}
+
+template <typename Dtype>
+void im2col_gpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* data_col, const Im2colGpuKernel kernel) {
+  Im2colGpuKernel variant = kernel;
+  if (variant == IM2COL_GPU_AUTO) {
+    variant = tune_im2col_gpu<Dtype>("im2col", launch_im2col_gpu<Dtype>,
+        data_im, channels, height, width, kernel_h, kernel_w, pad_h, pad_w,
+        stride_h, stride_w, data_col);
+  }
+  if (!launch_im2col_gpu(variant, data_im, channels, height, width,
+      kernel_h, kernel_w, pad_h, pad_w, stride_h, stride_w, data_col)) {
+    launch_im2col_gpu(IM2COL_GPU_PLAIN, data_im, channels, height, width,
+        kernel_h, kernel_w, pad_h, pad_w, stride_h, stride_w, data_col);
+  }
 }
 
 
 // Explicit instantiation
 template void im2col_gpu<float>(const float* data_im, const int channels,
-    const int height, const int width, const int ksize, const int pad,
-    const int stride, float* data_col);
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    float* data_col, const Im2colGpuKernel kernel);
 template void im2col_gpu<double>(const double* data_im, const int channels,
-    const int height, const int width, const int ksize, const int pad,
-    const int stride, double* data_col);
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    double* data_col, const Im2colGpuKernel kernel);
 
 template <typename Dtype>
 __global__ void col2im_gpu_kernel(const int n, const Dtype* data_col,
-    const int height, const int width, const int channels, const int ksize,
-    const int pad, const int stride, const int height_col, const int width_col,
-    Dtype* data_im) {
+    const int height, const int width, const int channels,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int height_col,
+    const int width_col, Dtype* data_im) {
   CUDA_KERNEL_LOOP(index, n) {
     Dtype val = 0;
-    int w = index % width + pad;
-    int h = (index / width) % height + pad;
+    int w = index % width + pad_w;
+    int h = (index / width) % height + pad_h;
     int c = index / (width * height);
     // compute the start and end of the output
-    int w_col_start = (w < ksize) ? 0 : (w - ksize) / stride + 1;
-    int w_col_end = min(w / stride + 1, width_col);
-    int h_col_start = (h < ksize) ? 0 : (h - ksize) / stride + 1;
-    int h_col_end = min(h / stride + 1, height_col);
+    int w_col_start = (w < kernel_w) ? 0 : (w - kernel_w) / stride_w + 1;
+    int w_col_end = min(w / stride_w + 1, width_col);
+    int h_col_start = (h < kernel_h) ? 0 : (h - kernel_h) / stride_h + 1;
+    int h_col_end = min(h / stride_h + 1, height_col);
     /*
     for (int h_col = h_col_start; h_col < h_col_end; ++h_col) {
       for (int w_col = w_col_start; w_col < w_col_end; ++w_col) {
         // the col location: [c * width * height + h_out, w_out]
-        int c_col = c * ksize * ksize + (h - h_col * stride) * ksize + (w - w_col * stride);
+        int c_col = (c * kernel_h + h - h_col * stride_h) * kernel_w
+            + (w - w_col * stride_w);
         val += data_col[(c_col * height_col + h_col) * width_col + w_col];
       }
     }
     */
     // equivalent implementation
-    int offset = (c * ksize * ksize + h * ksize + w) * height_col * width_col;
-    int coeff_h_col = (1 - stride * ksize * height_col) * width_col;
-    int coeff_w_col = (1 - stride * height_col * width_col);
+    int offset = (c * kernel_h * kernel_w + h * kernel_w + w) * height_col
+        * width_col;
+    int coeff_h_col = (1 - stride_h * kernel_w * height_col) * width_col;
+    int coeff_w_col = (1 - stride_w * height_col * width_col);
     for (int h_col = h_col_start; h_col < h_col_end; ++h_col) {
       for (int w_col = w_col_start; w_col < w_col_end; ++w_col) {
         val += data_col[offset + h_col * coeff_h_col + w_col * coeff_w_col];
@@ -100,33 +310,191 @@ __global__ void col2im_gpu_kernel(const int n, const Dtype* data_col,
   }
 }
 
+// The tiled col2im of a KERNEL x KERNEL kernel: block b of the grid takes
+// the tile_rows image rows of tile b % tiles_per_channel of channel
+// b / tiles_per_channel, and every gridDim.x-th tile after them, summing
+// them in shared memory. For each row kh of the kernel, the rows of
+// data_col whose windows put that row in the tile are read into shared
+// memory, each by consecutive threads, and each image element of the tile
+// adds the KERNEL values of them it falls in, so that no element is written
+// by two threads.
+template <typename Dtype, int KERNEL>
+__global__ void col2im_tiled_gpu_kernel(const int num_tiles,
+    const Dtype* data_col, const int height, const int width, const int pad,
+    const int stride, const int height_col, const int width_col,
+    const int tile_rows, const int tiles_per_channel, Dtype* data_im) {
+  __shared__ Dtype shared[kIm2colTileBytes / sizeof(Dtype)];
+  // The sums of the tile, and the rows of data_col staged for a kernel row,
+  // those of its KERNEL kernel columns one after the other
+  Dtype* sums = shared;
+  Dtype* stage = shared + tile_rows * width;
+  for (int tile = blockIdx.x; tile < num_tiles; tile += gridDim.x) {
+    const int c = tile / tiles_per_channel;
+    const int h_start = (tile % tiles_per_channel) * tile_rows;
+    const int rows = min(tile_rows, height - h_start);
+    const int size = rows * width;
+    for (int i = threadIdx.x; i < size; i += blockDim.x) {
+      sums[i] = 0;
+    }
+    for (int kh = 0; kh < KERNEL; ++kh) {
+      // The outputs h_col whose row kh, h_col * stride - pad + kh, is in
+      // [h_start, h_start + rows)
+      const int first = h_start + pad - kh;
+      const int last = first + rows - 1;
+      const int h_col_start = first <= 0 ? 0 : (first + stride - 1) / stride;
+      const int h_col_end = last < 0 ? 0 : min(last / stride + 1, height_col);
+      const int staged_rows = h_col_end - h_col_start;
+      if (staged_rows <= 0) {
+        continue;
+      }
+      const int staged = staged_rows * width_col;
+      // The sums and the previous stage are read by now.
+      __syncthreads();
+      for (int i = threadIdx.x; i < KERNEL * staged; i += blockDim.x) {
+        const int kw = i / staged;
+        stage[i] = data_col[(((c * KERNEL + kh) * KERNEL + kw) * height_col +
+            h_col_start) * width_col + i % staged];
+      }
+      __syncthreads();
+      for (int i = threadIdx.x; i < size; i += blockDim.x) {
+        const int h_pad = h_start + i / width + pad - kh;
+        if (h_pad % stride != 0) {
+          continue;
+        }
+        const int h_col = h_pad / stride;
+        if (h_col < h_col_start || h_col >= h_col_end) {
+          continue;
+        }
+        const Dtype* staged_row = stage + (h_col - h_col_start) * width_col;
+        const int w_pad = i % width + pad;
+        Dtype sum = 0;
+#pragma unroll
+        for (int kw = 0; kw < KERNEL; ++kw) {
+          const int w_offset = w_pad - kw;
+          const int w_col = w_offset / stride;
+          if (w_offset >= 0 && w_offset % stride == 0 && w_col < width_col) {
+            sum += staged_row[kw * staged + w_col];
+          }
+        }
+        sums[i] += sum;
+      }
+    }
+    __syncthreads();
+    Dtype* tile_im = data_im + (c * height + h_start) * width;
+    for (int i = threadIdx.x; i < size; i += blockDim.x) {
+      tile_im[i] = sums[i];
+    }
+    // The sums are only reset once all the threads have written them.
+    __syncthreads();
+  }
+}
+
+// Returns the image rows of the tiles of col2im_tiled_gpu_kernel that fit in
+// shared memory with the rows of data_col they need, 0 if a single row does
+// not.
 template <typename Dtype>
-void col2im_gpu(const Dtype* data_col, const int channels,
-    const int height, const int width, const int ksize, const int pad,
-    const int stride, Dtype* data_im) {
-  // CUDA_CHECK(cudaMemset(data_im, 0,
-  //            sizeof(Dtype) * height * width * channels));
-  int height_col = (height + 2 * pad - ksize) / stride + 1;
-  int width_col = (width + 2 * pad - ksize) / stride + 1;
+static int col2im_tile_rows(const int kernel_size, const int stride,
+    const int height, const int width, const int width_col) {
+  const int size = kIm2colTileBytes / sizeof(Dtype);
+  int tile_rows = height;
+  while (tile_rows > 0 && tile_rows * width + kernel_size *
+      ((tile_rows - 1) / stride + 1) * width_col > size) {
+    --tile_rows;
+  }
+  return tile_rows;
+}
+
+template <typename Dtype, int KERNEL>
+static void col2im_tiled_gpu(const Dtype* data_col, const int channels,
+    const int height, const int width, const int pad, const int stride,
+    const int height_col, const int width_col, const int tile_rows,
+    Dtype* data_im) {
+  const int tiles_per_channel = (height + tile_rows - 1) / tile_rows;
+  const int num_tiles = channels * tiles_per_channel;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  col2im_tiled_gpu_kernel<Dtype, KERNEL><<<min(num_tiles, kIm2colMaxBlocks),
+                                           kIm2colTileThreads>>>(
+      num_tiles, data_col, height, width, pad, stride, height_col, width_col,
+      tile_rows, tiles_per_channel, data_im);
+}
+
+// Runs the col2im kernel of variant, which must not be AUTO, and returns
+// false if it does not compute the shape.
+template <typename Dtype>
+static bool launch_col2im_gpu(const Im2colGpuKernel variant,
+    const Dtype* data_col, const int channels, const int height,
+    const int width, const int kernel_h, const int kernel_w, const int pad_h,
+    const int pad_w, const int stride_h, const int stride_w,
+    Dtype* data_im) {
+  int height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1;
+  int width_col = (width + 2 * pad_w - kernel_w) / stride_w + 1;
+  if (variant == IM2COL_GPU_TILED) {
+    if (!has_tiled_kernel(kernel_h, kernel_w, pad_h, pad_w, stride_h,
+        stride_w)) {
+      return false;
+    }
+    const int tile_rows = col2im_tile_rows<Dtype>(kernel_h, stride_h, height,
+        width, width_col);
+    if (tile_rows == 0) {
+      return false;
+    }
+    switch (kernel_h) {
+    case 3:
+      col2im_tiled_gpu<Dtype, 3>(data_col, channels, height, width, pad_h,
+          stride_h, height_col, width_col, tile_rows, data_im);
+      break;
+    case 5:
+      col2im_tiled_gpu<Dtype, 5>(data_col, channels, height, width, pad_h,
+          stride_h, height_col, width_col, tile_rows, data_im);
+      break;
+    case 11:
+      col2im_tiled_gpu<Dtype, 11>(data_col, channels, height, width, pad_h,
+          stride_h, height_col, width_col, tile_rows, data_im);
+      break;
+    }
+    CUDA_POST_KERNEL_CHECK;
+    return true;
+  }
   int num_kernels = channels * height * width;
   // To avoid involving atomic operations, we will launch one kernel per
   // bottom dimension, and then in the kernel add up the top dimensions.
   // NOLINT_NEXT_LINE(whitespace/operators)
   col2im_gpu_kernel<Dtype><<<CAFFE_GET_BLOCKS(num_kernels),
                              CAFFE_CUDA_NUM_THREADS>>>(
-      num_kernels, data_col, height, width, channels, ksize, pad, stride,
-      height_col, width_col, data_im);
+      num_kernels, data_col, height, width, channels, kernel_h, kernel_w,
+      pad_h, pad_w, stride_h, stride_w, height_col, width_col, data_im);
   CUDA_POST_KERNEL_CHECK;
+  return true;
+}
+
+template <typename Dtype>
+void col2im_gpu(const Dtype* data_col, const int channels,
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    Dtype* data_im, const Im2colGpuKernel kernel) {
+  Im2colGpuKernel variant = kernel;
+  if (variant == IM2COL_GPU_AUTO) {
+    variant = tune_im2col_gpu<Dtype>("col2im", launch_col2im_gpu<Dtype>,
+        data_col, channels, height, width, kernel_h, kernel_w, pad_h, pad_w,
+        stride_h, stride_w, data_im);
+  }
+  if (!launch_col2im_gpu(variant, data_col, channels, height, width,
+      kernel_h, kernel_w, pad_h, pad_w, stride_h, stride_w, data_im)) {
+    launch_col2im_gpu(IM2COL_GPU_PLAIN, data_col, channels, height, width,
+        kernel_h, kernel_w, pad_h, pad_w, stride_h, stride_w, data_im);
+  }
 }
 
 
 // Explicit instantiation
 template void col2im_gpu<float>(const float* data_col, const int channels,
-    const int height, const int width, const int psize, const int pad,
-    const int stride, float* data_im);
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    float* data_im, const Im2colGpuKernel kernel);
 template void col2im_gpu<double>(const double* data_col, const int channels,
-    const int height, const int width, const int psize, const int pad,
-    const int stride, double* data_im);
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h, const int stride_w,
+    double* data_im, const Im2colGpuKernel kernel);
 
 
 }  // namespace caffe
@@ -0,0 +1,72 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <pthread.h>
+
+#include <string>
+
+#include "caffe/common.hpp"
+#include "caffe/util/image_cache.hpp"
+
+namespace caffe {
+
+static size_t ImageBytes(const cv::Mat& cv_img) {
+  return cv_img.total() * cv_img.elemSize();
+}
+
+ImageCache::ImageCache(const size_t capacity)
+    : capacity_(capacity), size_(0) {
+  CHECK(!pthread_mutex_init(&mutex_, NULL)) << "Mutex init failed.";
+}
+
+ImageCache::~ImageCache() {
+  pthread_mutex_destroy(&mutex_);
+}
+
+bool ImageCache::Get(const string& filename, cv::Mat* cv_img) {
+  pthread_mutex_lock(&mutex_);
+  std::map<string, ImageList::iterator>::iterator it = index_.find(filename);
+  const bool found = (it != index_.end());
+  if (found) {
+    // Move the image to the front of the list.
+    images_.splice(images_.begin(), images_, it->second);
+    *cv_img = it->second->second;
+  }
+  pthread_mutex_unlock(&mutex_);
+  return found;
+}
+
+void ImageCache::Put(const string& filename, const cv::Mat& cv_img) {
+  const size_t bytes = ImageBytes(cv_img);
+  if (bytes > capacity_) {
+    return;
+  }
+  pthread_mutex_lock(&mutex_);
+  // Another thread may have decoded the same image meanwhile.
+  if (index_.find(filename) == index_.end()) {
+    while (size_ + bytes > capacity_) {
+      size_ -= ImageBytes(images_.back().second);
+      index_.erase(images_.back().first);
+      images_.pop_back();
+    }
+    images_.push_front(std::make_pair(filename, cv_img));
+    index_[filename] = images_.begin();
+    size_ += bytes;
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+size_t ImageCache::size() {
+  pthread_mutex_lock(&mutex_);
+  const size_t size = size_;
+  pthread_mutex_unlock(&mutex_);
+  return size;
+}
+
+size_t ImageCache::count() {
+  pthread_mutex_lock(&mutex_);
+  const size_t count = images_.size();
+  pthread_mutex_unlock(&mutex_);
+  return count;
+}
+
+}  // namespace caffe
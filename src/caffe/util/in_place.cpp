@@ -0,0 +1,148 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <map>
+#include <string>
+
+#include "caffe/common.hpp"
+#include "caffe/util/in_place.hpp"
+
+using std::map;
+
+namespace caffe {
+
+bool CanRunInPlace(const LayerParameter_LayerType type, const bool inference) {
+  switch (type) {
+  // Backward only reads the top (or, for ReLU, the sign of the bottom, which
+  // the top keeps) or a mask.
+  case LayerParameter_LayerType_RELU:
+  case LayerParameter_LayerType_DROPOUT:
+  case LayerParameter_LayerType_SIGMOID:
+  case LayerParameter_LayerType_TANH:
+    return true;
+  // Backward reads the bottom.
+  case LayerParameter_LayerType_BNLL:
+  case LayerParameter_LayerType_POWER:
+    return inference;
+  default:
+    return false;
+  }
+}
+
+bool CanOverwriteTop(const LayerParameter_LayerType type,
+    const bool inference) {
+  switch (type) {
+  // Split and flatten tops share their data with other blobs.
+  case LayerParameter_LayerType_SPLIT:
+  case LayerParameter_LayerType_FLATTEN:
+    return false;
+  // Backward does not read the top data, or there is no Backward. (ReLU is
+  // left out: when it runs in place its bottom, which Backward reads, is its
+  // top.)
+  case LayerParameter_LayerType_CONVOLUTION:
+  case LayerParameter_LayerType_INNER_PRODUCT:
+  case LayerParameter_LayerType_CONCAT:
+  case LayerParameter_LayerType_ELTWISE:
+  case LayerParameter_LayerType_ELTWISE_PRODUCT:
+  case LayerParameter_LayerType_IM2COL:
+  case LayerParameter_LayerType_DROPOUT:
+  case LayerParameter_LayerType_BNLL:
+  case LayerParameter_LayerType_DATA:
+  case LayerParameter_LayerType_IMAGE_DATA:
+  case LayerParameter_LayerType_WINDOW_DATA:
+  case LayerParameter_LayerType_HDF5_DATA:
+  case LayerParameter_LayerType_MEMORY_DATA:
+    return true;
+  default:
+    return inference;
+  }
+}
+
+// Whether the layer, an eltwise one, can run in place on its first bottom:
+// Backward of a SUM or a MAX reads no bottom, and each bottom is another
+// blob.
+static bool CanRunEltwiseInPlace(const LayerParameter& layer_param) {
+  if (layer_param.eltwise_param().operation() ==
+      EltwiseParameter_EltwiseOp_PROD) {
+    return false;
+  }
+  for (int j = 1; j < layer_param.bottom_size(); ++j) {
+    if (layer_param.bottom(j) == layer_param.bottom(0)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Whether the blob top_name produced by layer layer_id is used by a later
+// layer, i.e. is not an output of the net.
+static bool IsUsedLater(const NetParameter& param, const int layer_id,
+    const string& top_name) {
+  for (int i = layer_id + 1; i < param.layers_size(); ++i) {
+    for (int j = 0; j < param.layers(i).bottom_size(); ++j) {
+      if (param.layers(i).bottom(j) == top_name) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void RewriteInPlace(const NetParameter& param, NetParameter* param_in_place,
+    map<string, string>* renamed_blobs) {
+  param_in_place->CopyFrom(param);
+  renamed_blobs->clear();
+  const bool inference = param.inference();
+  // The type of the layer producing each blob; the inputs of the net have
+  // none.
+  map<string, LayerParameter_LayerType> producer_types;
+  // The new names of the blobs renamed so far, under their old names
+  map<string, string> new_names;
+  for (int i = 0; i < param_in_place->layers_size(); ++i) {
+    LayerParameter* layer_param = param_in_place->mutable_layers(i);
+    const LayerParameter& original_param = param.layers(i);
+    for (int j = 0; j < layer_param->bottom_size(); ++j) {
+      map<string, string>::const_iterator it =
+          new_names.find(layer_param->bottom(j));
+      if (it != new_names.end()) {
+        layer_param->set_bottom(j, it->second);
+      }
+    }
+    const bool can_run_in_place = layer_param->bottom_size() == 1 ?
+        CanRunInPlace(layer_param->type(), inference) :
+        layer_param->type() == LayerParameter_LayerType_ELTWISE &&
+        CanRunEltwiseInPlace(*layer_param);
+    bool rewrite = layer_param->bottom_size() >= 1 &&
+        layer_param->top_size() == 1 &&
+        original_param.top(0) != original_param.bottom(0) &&
+        can_run_in_place && IsUsedLater(param, i, original_param.top(0));
+    if (rewrite) {
+      map<string, LayerParameter_LayerType>::const_iterator it =
+          producer_types.find(layer_param->bottom(0));
+      rewrite = it != producer_types.end() &&
+          CanOverwriteTop(it->second, inference);
+    }
+    if (rewrite) {
+      const string& top_name = original_param.top(0);
+      LOG(INFO) << "Running " << layer_param->name() << " in place: "
+          << top_name << " -> " << layer_param->bottom(0);
+      new_names[top_name] = layer_param->bottom(0);
+      (*renamed_blobs)[top_name] = layer_param->bottom(0);
+      layer_param->set_top(0, layer_param->bottom(0));
+    } else {
+      for (int j = 0; j < layer_param->top_size(); ++j) {
+        if (j < original_param.bottom_size() &&
+            original_param.top(j) == original_param.bottom(j)) {
+          // Already in place: keep following the renamed bottom.
+          layer_param->set_top(j, layer_param->bottom(j));
+        } else {
+          new_names.erase(layer_param->top(j));
+        }
+      }
+    }
+    for (int j = 0; j < layer_param->top_size(); ++j) {
+      producer_types[layer_param->top(j)] = layer_param->type();
+    }
+  }
+}
+
+}  // namespace caffe
@@ -5,6 +5,7 @@
 #include <google/protobuf/text_format.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/highgui/highgui_c.h>
@@ -30,6 +31,7 @@ using google::protobuf::io::CodedInputStream;
 using google::protobuf::io::ZeroCopyOutputStream;
 using google::protobuf::io::CodedOutputStream;
 using google::protobuf::Message;
+using google::protobuf::internal::WireFormatLite;
 
 namespace caffe {
 
@@ -71,19 +73,125 @@ void WriteProtoToBinaryFile(const Message& proto, const char* filename) {
   CHECK(proto.SerializeToOstream(&output));
 }
 
-bool ReadImageToDatum(const string& filename, const int label,
-    const int height, const int width, Datum* datum) {
-  cv::Mat cv_img;
+bool ReadImageToCVMat(const string& filename, const int height,
+    const int width, cv::Mat* cv_img) {
   if (height > 0 && width > 0) {
     cv::Mat cv_img_origin = cv::imread(filename, CV_LOAD_IMAGE_COLOR);
-    cv::resize(cv_img_origin, cv_img, cv::Size(height, width));
+    if (cv_img_origin.data) {
+      cv::resize(cv_img_origin, *cv_img, cv::Size(height, width));
+    } else {
+      cv_img->release();
+    }
   } else {
-    cv_img = cv::imread(filename, CV_LOAD_IMAGE_COLOR);
+    *cv_img = cv::imread(filename, CV_LOAD_IMAGE_COLOR);
   }
-  if (!cv_img.data) {
+  if (!cv_img->data) {
     LOG(ERROR) << "Could not open or find file " << filename;
     return false;
   }
+  return true;
+}
+
+// The big endian integer of the bytes bytes at data
+static int BigEndian(const unsigned char* data, const int bytes) {
+  int value = 0;
+  for (int i = 0; i < bytes; ++i) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+// Reads the shape from the frame header of a JPEG file, going through the
+// segments before it.
+static bool ReadJPEGSize(std::ifstream* file, int* height, int* width) {
+  unsigned char header[7];
+  while (true) {
+    int marker = file->get();
+    if (marker != 0xFF) {
+      return false;
+    }
+    // Markers may be padded with fill bytes.
+    while (marker == 0xFF) {
+      marker = file->get();
+    }
+    if (!file->good()) {
+      return false;
+    }
+    // The start of image, and the restarts, have no segment.
+    if (marker == 0xD8 || marker == 0x01 || (marker >= 0xD0 &&
+        marker <= 0xD7)) {
+      continue;
+    }
+    if (!file->read(reinterpret_cast<char*>(header), 2)) {
+      return false;
+    }
+    const int length = BigEndian(header, 2);
+    // The frame headers are the markers 0xC0 to 0xCF, but for the Huffman
+    // and arithmetic coding tables and JPG extensions.
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+        marker != 0xC8 && marker != 0xCC) {
+      if (!file->read(reinterpret_cast<char*>(header), 5)) {
+        return false;
+      }
+      *height = BigEndian(header + 1, 2);
+      *width = BigEndian(header + 3, 2);
+      return *height > 0 && *width > 0;
+    }
+    if (length < 2 || !file->seekg(length - 2, ios::cur)) {
+      return false;
+    }
+  }
+}
+
+bool ReadImageSize(const string& filename, int* height, int* width) {
+  std::ifstream file(filename.c_str(), ios::in | ios::binary);
+  unsigned char header[24];
+  if (file.read(reinterpret_cast<char*>(header), 2) && header[0] == 0xFF &&
+      header[1] == 0xD8 && ReadJPEGSize(&file, height, width)) {
+    return true;
+  }
+  // The first chunk of a PNG file is IHDR, the width then the height.
+  const unsigned char kPNGSignature[] = {0x89, 'P', 'N', 'G', '\r', '\n',
+      0x1A, '\n'};
+  file.clear();
+  if (file.seekg(0, ios::beg) &&
+      file.read(reinterpret_cast<char*>(header), 24) &&
+      std::equal(kPNGSignature, kPNGSignature + 8, header) &&
+      std::equal(header + 12, header + 16, "IHDR")) {
+    *width = BigEndian(header + 16, 4);
+    *height = BigEndian(header + 20, 4);
+    return *height > 0 && *width > 0;
+  }
+  cv::Mat cv_img;
+  if (!ReadImageToCVMat(filename, 0, 0, &cv_img)) {
+    return false;
+  }
+  *height = cv_img.rows;
+  *width = cv_img.cols;
+  return true;
+}
+
+bool DecodeImageToCVMat(const char* data, const int size, const int height,
+    const int width, cv::Mat* cv_img) {
+  cv::Mat cv_img_origin = cv::imdecode(cv::Mat(1, size, CV_8UC1,
+      const_cast<char*>(data)), CV_LOAD_IMAGE_COLOR);
+  if (!cv_img_origin.data) {
+    return false;
+  }
+  if (height > 0 && width > 0) {
+    cv::resize(cv_img_origin, *cv_img, cv::Size(height, width));
+  } else {
+    *cv_img = cv_img_origin;
+  }
+  return true;
+}
+
+bool ReadImageToDatum(const string& filename, const int label,
+    const int height, const int width, Datum* datum) {
+  cv::Mat cv_img;
+  if (!ReadImageToCVMat(filename, height, width, &cv_img)) {
+    return false;
+  }
   datum->set_channels(3);
   datum->set_height(cv_img.rows);
   datum->set_width(cv_img.cols);
@@ -102,6 +210,124 @@ bool ReadImageToDatum(const string& filename, const int label,
   return true;
 }
 
+bool ReadImageToEncodedDatum(const string& filename, const int label,
+    Datum* datum) {
+  std::ifstream file(filename.c_str(),
+      std::ios::in | std::ios::binary | std::ios::ate);
+  if (!file.is_open()) {
+    LOG(ERROR) << "Could not open or find file " << filename;
+    return false;
+  }
+  const std::streampos size = file.tellg();
+  string* datum_string = datum->mutable_data();
+  datum_string->resize(size);
+  file.seekg(0, std::ios::beg);
+  file.read(&(*datum_string)[0], size);
+  if (!file) {
+    LOG(ERROR) << "Could not read file " << filename;
+    return false;
+  }
+  cv::Mat cv_img = cv::imdecode(cv::Mat(1, datum_string->size(), CV_8UC1,
+      &(*datum_string)[0]), CV_LOAD_IMAGE_COLOR);
+  if (!cv_img.data) {
+    LOG(ERROR) << "Could not decode file " << filename;
+    return false;
+  }
+  datum->set_channels(3);
+  datum->set_height(cv_img.rows);
+  datum->set_width(cv_img.cols);
+  datum->set_label(label);
+  datum->set_encoded(true);
+  datum->clear_float_data();
+  return true;
+}
+
+bool DecodeImageToPixels(const char* data, const int size, const int channels,
+    const int height, const int width, string* pixels) {
+  cv::Mat cv_img = cv::imdecode(cv::Mat(1, size, CV_8UC1,
+      const_cast<char*>(data)),
+      channels == 1 ? CV_LOAD_IMAGE_GRAYSCALE : CV_LOAD_IMAGE_COLOR);
+  if (!cv_img.data || cv_img.channels() != channels ||
+      cv_img.rows != height || cv_img.cols != width) {
+    return false;
+  }
+  pixels->resize(channels * height * width);
+  for (int c = 0; c < channels; ++c) {
+    char* dst = &(*pixels)[c * height * width];
+    for (int h = 0; h < height; ++h) {
+      const uchar* row = cv_img.ptr<uchar>(h) + c;
+      for (int w = 0; w < width; ++w) {
+        *(dst++) = static_cast<char>(row[w * channels]);
+      }
+    }
+  }
+  return true;
+}
+
+bool ParseDatumWithoutData(const void* buffer, const int size, Datum* datum,
+    const char** data, int* data_size) {
+  datum->Clear();
+  *data = NULL;
+  *data_size = 0;
+  CodedInputStream input(reinterpret_cast<const uint8_t*>(buffer), size);
+  uint32_t tag;
+  while ((tag = input.ReadTag()) != 0) {
+    const int field = WireFormatLite::GetTagFieldNumber(tag);
+    const WireFormatLite::WireType wire_type =
+        WireFormatLite::GetTagWireType(tag);
+    if (field == Datum::kDataFieldNumber &&
+        wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+      uint32_t length;
+      if (!input.ReadVarint32(&length)) {
+        return false;
+      }
+      *data = static_cast<const char*>(buffer) + input.CurrentPosition();
+      *data_size = length;
+      if (!input.Skip(length)) {
+        return false;
+      }
+    } else if (wire_type == WireFormatLite::WIRETYPE_VARINT &&
+        (field == Datum::kChannelsFieldNumber ||
+         field == Datum::kHeightFieldNumber ||
+         field == Datum::kWidthFieldNumber ||
+         field == Datum::kLabelFieldNumber ||
+         field == Datum::kEncodedFieldNumber)) {
+      uint32_t value;
+      if (!input.ReadVarint32(&value)) {
+        return false;
+      }
+      const int32_t int_value = static_cast<int32_t>(value);
+      switch (field) {
+      case Datum::kChannelsFieldNumber:
+        datum->set_channels(int_value);
+        break;
+      case Datum::kHeightFieldNumber:
+        datum->set_height(int_value);
+        break;
+      case Datum::kWidthFieldNumber:
+        datum->set_width(int_value);
+        break;
+      case Datum::kEncodedFieldNumber:
+        datum->set_encoded(value != 0);
+        break;
+      default:
+        datum->set_label(int_value);
+        break;
+      }
+    } else {
+      // Anything else, e.g. float_data, gets a regular parse; the data (if
+      // any) is then copied into datum and *data points there.
+      if (!datum->ParseFromArray(buffer, size)) {
+        return false;
+      }
+      *data = datum->has_data() ? datum->data().data() : NULL;
+      *data_size = datum->data().size();
+      return true;
+    }
+  }
+  return true;
+}
+
 // Verifies format of data stored in HDF5 file and reshapes blob accordingly.
 template <typename Dtype>
 void hdf5_load_nd_dataset_helper(
@@ -144,6 +370,48 @@ void hdf5_load_nd_dataset<double>(hid_t file_id, const char* dataset_name_,
     file_id, dataset_name_, blob->mutable_cpu_data());
 }
 
+static void hdf5_load_nd_dataset_rows_helper(
+    hid_t dataset_id, const hsize_t first_row, const hsize_t num_rows,
+    hid_t mem_type_id, void* data) {
+  hid_t file_space_id = H5Dget_space(dataset_id);
+  CHECK_GE(file_space_id, 0) << "Failed to get the dataset space";
+  const int ndims = H5Sget_simple_extent_ndims(file_space_id);
+  CHECK_GT(ndims, 0);
+  std::vector<hsize_t> dims(ndims);
+  H5Sget_simple_extent_dims(file_space_id, dims.data(), NULL);
+  CHECK_LE(first_row + num_rows, dims[0]) << "Reading past the last row";
+  // Select the rows in the file, and an array of the same shape in memory.
+  std::vector<hsize_t> start(ndims, 0);
+  start[0] = first_row;
+  dims[0] = num_rows;
+  herr_t status = H5Sselect_hyperslab(file_space_id, H5S_SELECT_SET,
+      start.data(), NULL, dims.data(), NULL);
+  CHECK_GE(status, 0) << "Failed to select rows " << first_row << " to "
+      << first_row + num_rows;
+  hid_t mem_space_id = H5Screate_simple(ndims, dims.data(), NULL);
+  CHECK_GE(mem_space_id, 0) << "Failed to create the memory space";
+  status = H5Dread(dataset_id, mem_type_id, mem_space_id, file_space_id,
+      H5P_DEFAULT, data);
+  CHECK_GE(status, 0) << "Failed to read rows " << first_row << " to "
+      << first_row + num_rows;
+  H5Sclose(mem_space_id);
+  H5Sclose(file_space_id);
+}
+
+template <>
+void hdf5_load_nd_dataset_rows<float>(hid_t dataset_id,
+    const hsize_t first_row, const hsize_t num_rows, float* data) {
+  hdf5_load_nd_dataset_rows_helper(dataset_id, first_row, num_rows,
+      H5T_NATIVE_FLOAT, data);
+}
+
+template <>
+void hdf5_load_nd_dataset_rows<double>(hid_t dataset_id,
+    const hsize_t first_row, const hsize_t num_rows, double* data) {
+  hdf5_load_nd_dataset_rows_helper(dataset_id, first_row, num_rows,
+      H5T_NATIVE_DOUBLE, data);
+}
+
 template <>
 void hdf5_save_nd_dataset<float>(
     const hid_t file_id, const string dataset_name, const Blob<float>& blob) {
@@ -170,4 +438,110 @@ void hdf5_save_nd_dataset<double>(
   CHECK_GE(status, 0) << "Failed to make double dataset " << dataset_name;
 }
 
+static hid_t hdf5_create_extendable_dataset_helper(
+    const hid_t file_id, const string& dataset_name, const hid_t type_id,
+    const int channels, const int height, const int width,
+    const int chunk_rows, const int compression_level) {
+  CHECK_GT(channels * height * width, 0) << "Empty rows for " << dataset_name;
+  CHECK_GT(chunk_rows, 0);
+  CHECK_LE(compression_level, 9) << "Deflate levels go from 0 to 9";
+  hsize_t dims[HDF5_NUM_DIMS];
+  dims[0] = 0;
+  dims[1] = channels;
+  dims[2] = height;
+  dims[3] = width;
+  hsize_t max_dims[HDF5_NUM_DIMS];
+  std::copy(dims, dims + HDF5_NUM_DIMS, max_dims);
+  max_dims[0] = H5S_UNLIMITED;
+  hid_t space_id = H5Screate_simple(HDF5_NUM_DIMS, dims, max_dims);
+  CHECK_GE(space_id, 0) << "Failed to create the space of " << dataset_name;
+  hid_t plist_id = H5Pcreate(H5P_DATASET_CREATE);
+  CHECK_GE(plist_id, 0) << "Failed to create the properties of "
+      << dataset_name;
+  dims[0] = chunk_rows;
+  herr_t status = H5Pset_chunk(plist_id, HDF5_NUM_DIMS, dims);
+  CHECK_GE(status, 0) << "Failed to set the chunks of " << dataset_name;
+  if (compression_level > 0) {
+    status = H5Pset_deflate(plist_id, compression_level);
+    CHECK_GE(status, 0) << "Failed to set the compression of "
+        << dataset_name;
+  }
+  hid_t dataset_id = H5Dcreate2(file_id, dataset_name.c_str(), type_id,
+      space_id, H5P_DEFAULT, plist_id, H5P_DEFAULT);
+  CHECK_GE(dataset_id, 0) << "Failed to create dataset " << dataset_name;
+  H5Pclose(plist_id);
+  H5Sclose(space_id);
+  return dataset_id;
+}
+
+template <>
+hid_t hdf5_create_extendable_dataset<float>(
+    const hid_t file_id, const string& dataset_name, const int channels,
+    const int height, const int width, const int chunk_rows,
+    const int compression_level) {
+  return hdf5_create_extendable_dataset_helper(file_id, dataset_name,
+      H5T_NATIVE_FLOAT, channels, height, width, chunk_rows,
+      compression_level);
+}
+
+template <>
+hid_t hdf5_create_extendable_dataset<double>(
+    const hid_t file_id, const string& dataset_name, const int channels,
+    const int height, const int width, const int chunk_rows,
+    const int compression_level) {
+  return hdf5_create_extendable_dataset_helper(file_id, dataset_name,
+      H5T_NATIVE_DOUBLE, channels, height, width, chunk_rows,
+      compression_level);
+}
+
+static void hdf5_append_nd_dataset_rows_helper(
+    const hid_t dataset_id, const hsize_t num_rows, const hid_t mem_type_id,
+    const void* data) {
+  hid_t file_space_id = H5Dget_space(dataset_id);
+  CHECK_GE(file_space_id, 0) << "Failed to get the dataset space";
+  const int ndims = H5Sget_simple_extent_ndims(file_space_id);
+  CHECK_GT(ndims, 0);
+  std::vector<hsize_t> dims(ndims);
+  H5Sget_simple_extent_dims(file_space_id, dims.data(), NULL);
+  H5Sclose(file_space_id);
+  const hsize_t first_row = dims[0];
+  dims[0] += num_rows;
+  herr_t status = H5Dset_extent(dataset_id, dims.data());
+  CHECK_GE(status, 0) << "Failed to extend the dataset to " << dims[0]
+      << " rows";
+  // Select the new rows in the file, and an array of the same shape in
+  // memory.
+  file_space_id = H5Dget_space(dataset_id);
+  CHECK_GE(file_space_id, 0) << "Failed to get the dataset space";
+  std::vector<hsize_t> start(ndims, 0);
+  start[0] = first_row;
+  dims[0] = num_rows;
+  status = H5Sselect_hyperslab(file_space_id, H5S_SELECT_SET, start.data(),
+      NULL, dims.data(), NULL);
+  CHECK_GE(status, 0) << "Failed to select rows " << first_row << " to "
+      << first_row + num_rows;
+  hid_t mem_space_id = H5Screate_simple(ndims, dims.data(), NULL);
+  CHECK_GE(mem_space_id, 0) << "Failed to create the memory space";
+  status = H5Dwrite(dataset_id, mem_type_id, mem_space_id, file_space_id,
+      H5P_DEFAULT, data);
+  CHECK_GE(status, 0) << "Failed to write rows " << first_row << " to "
+      << first_row + num_rows;
+  H5Sclose(mem_space_id);
+  H5Sclose(file_space_id);
+}
+
+template <>
+void hdf5_append_nd_dataset_rows<float>(const hid_t dataset_id,
+    const hsize_t num_rows, const float* data) {
+  hdf5_append_nd_dataset_rows_helper(dataset_id, num_rows, H5T_NATIVE_FLOAT,
+      data);
+}
+
+template <>
+void hdf5_append_nd_dataset_rows<double>(const hid_t dataset_id,
+    const hsize_t num_rows, const double* data) {
+  hdf5_append_nd_dataset_rows_helper(dataset_id, num_rows, H5T_NATIVE_DOUBLE,
+      data);
+}
+
 }  // namespace caffe
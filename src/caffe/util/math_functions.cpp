@@ -3,20 +3,98 @@
 #include <boost/math/special_functions/next.hpp>
 #include <boost/random.hpp>
 #include <cublas_v2.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
+#include <algorithm>
+#include <cmath>
 #include <limits>
 
 #include "caffe/common.hpp"
+#include "caffe/util/cpu_threads.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/philox.hpp"
 #include "caffe/util/rng.hpp"
+#include "caffe/util/simd_math.hpp"
 
 namespace caffe {
 
+template <>
+void caffe_cpu_gemv<float>(const CBLAS_TRANSPOSE TransA, const int M,
+    const int N, const float alpha, const float* A, const float* x,
+    const float beta, float* y) {
+  cblas_sgemv(CblasRowMajor, TransA, M, N, alpha, A, N, x, 1, beta, y, 1);
+}
+
+template <>
+void caffe_cpu_gemv<double>(const CBLAS_TRANSPOSE TransA, const int M,
+    const int N, const double alpha, const double* A, const double* x,
+    const double beta, double* y) {
+  cblas_dgemv(CblasRowMajor, TransA, M, N, alpha, A, N, x, 1, beta, y, 1);
+}
+
+template <>
+void caffe_gpu_gemv<float>(const CBLAS_TRANSPOSE TransA, const int M,
+    const int N, const float alpha, const float* A, const float* x,
+    const float beta, float* y) {
+  cublasOperation_t cuTransA =
+      (TransA == CblasNoTrans) ? CUBLAS_OP_T : CUBLAS_OP_N;
+  CUBLAS_CHECK(cublasSgemv(Caffe::cublas_handle(), cuTransA, N, M, &alpha,
+      A, N, x, 1, &beta, y, 1));
+}
+
+template <>
+void caffe_gpu_gemv<double>(const CBLAS_TRANSPOSE TransA, const int M,
+    const int N, const double alpha, const double* A, const double* x,
+    const double beta, double* y) {
+  cublasOperation_t cuTransA =
+      (TransA == CblasNoTrans) ? CUBLAS_OP_T : CUBLAS_OP_N;
+  CUBLAS_CHECK(cublasDgemv(Caffe::cublas_handle(), cuTransA, N, M, &alpha,
+      A, N, x, 1, &beta, y, 1));
+}
+
+// A product of one row or of one column, as a batch of a single image makes
+// them in the inner product and convolution layers, is a matrix-vector
+// product, which gemv computes faster than gemm. Computes it with gemv and
+// returns true for those, returns false for the others.
+template <typename Dtype>
+static bool GemmAsGemv(void (*gemv)(const CBLAS_TRANSPOSE, const int,
+    const int, const Dtype, const Dtype*, const Dtype*, const Dtype, Dtype*),
+    const CBLAS_TRANSPOSE TransA, const CBLAS_TRANSPOSE TransB, const int M,
+    const int N, const int K, const Dtype alpha, const Dtype* A,
+    const Dtype* B, const Dtype beta, Dtype* C) {
+  // The single row of op(A) and column of op(B) are contiguous either way.
+  if (M == 1) {
+    // C = op(B)' A
+    if (TransB == CblasNoTrans) {
+      gemv(CblasTrans, K, N, alpha, B, A, beta, C);
+    } else {
+      gemv(CblasNoTrans, N, K, alpha, B, A, beta, C);
+    }
+    return true;
+  }
+  if (N == 1) {
+    // C = op(A) B
+    if (TransA == CblasNoTrans) {
+      gemv(CblasNoTrans, M, K, alpha, A, B, beta, C);
+    } else {
+      gemv(CblasTrans, K, M, alpha, A, B, beta, C);
+    }
+    return true;
+  }
+  return false;
+}
+
 template<>
 void caffe_cpu_gemm<float>(const CBLAS_TRANSPOSE TransA,
     const CBLAS_TRANSPOSE TransB, const int M, const int N, const int K,
     const float alpha, const float* A, const float* B, const float beta,
     float* C) {
+  if (GemmAsGemv(caffe_cpu_gemv<float>, TransA, TransB, M, N, K, alpha,
+      A, B, beta, C)) {
+    return;
+  }
   int lda = (TransA == CblasNoTrans) ? K : M;
   int ldb = (TransB == CblasNoTrans) ? N : K;
   cblas_sgemm(CblasRowMajor, TransA, TransB, M, N, K, alpha, A, lda, B,
@@ -28,6 +106,10 @@ void caffe_cpu_gemm<double>(const CBLAS_TRANSPOSE TransA,
     const CBLAS_TRANSPOSE TransB, const int M, const int N, const int K,
     const double alpha, const double* A, const double* B, const double beta,
     double* C) {
+  if (GemmAsGemv(caffe_cpu_gemv<double>, TransA, TransB, M, N, K, alpha,
+      A, B, beta, C)) {
+    return;
+  }
   int lda = (TransA == CblasNoTrans) ? K : M;
   int ldb = (TransB == CblasNoTrans) ? N : K;
   cblas_dgemm(CblasRowMajor, TransA, TransB, M, N, K, alpha, A, lda, B,
@@ -39,6 +121,10 @@ void caffe_gpu_gemm<float>(const CBLAS_TRANSPOSE TransA,
     const CBLAS_TRANSPOSE TransB, const int M, const int N, const int K,
     const float alpha, const float* A, const float* B, const float beta,
     float* C) {
+  if (GemmAsGemv(caffe_gpu_gemv<float>, TransA, TransB, M, N, K, alpha,
+      A, B, beta, C)) {
+    return;
+  }
   // Note that cublas follows fortran order.
   int lda = (TransA == CblasNoTrans) ? K : M;
   int ldb = (TransB == CblasNoTrans) ? N : K;
@@ -55,6 +141,10 @@ void caffe_gpu_gemm<double>(const CBLAS_TRANSPOSE TransA,
     const CBLAS_TRANSPOSE TransB, const int M, const int N, const int K,
     const double alpha, const double* A, const double* B, const double beta,
     double* C) {
+  if (GemmAsGemv(caffe_gpu_gemv<double>, TransA, TransB, M, N, K, alpha,
+      A, B, beta, C)) {
+    return;
+  }
   // Note that cublas follows fortran order.
   int lda = (TransA == CblasNoTrans) ? K : M;
   int ldb = (TransB == CblasNoTrans) ? N : K;
@@ -66,240 +156,542 @@ void caffe_gpu_gemm<double>(const CBLAS_TRANSPOSE TransA,
       N, M, K, &alpha, B, ldb, A, lda, &beta, C, N));
 }
 
-template <>
-void caffe_cpu_gemv<float>(const CBLAS_TRANSPOSE TransA, const int M,
-    const int N, const float alpha, const float* A, const float* x,
-    const float beta, float* y) {
-  cblas_sgemv(CblasRowMajor, TransA, M, N, alpha, A, N, x, 1, beta, y, 1);
-}
+// The BLAS functions take int lengths: longer vectors go in chunks of
+// kBlasChunk elements.
+static const int64_t kBlasChunk = 1 << 30;
 
-template <>
-void caffe_cpu_gemv<double>(const CBLAS_TRANSPOSE TransA, const int M,
-    const int N, const double alpha, const double* A, const double* x,
-    const double beta, double* y) {
-  cblas_dgemv(CblasRowMajor, TransA, M, N, alpha, A, N, x, 1, beta, y, 1);
+// The length of the chunk of a vector of n elements from i on
+static inline int BlasChunk(const int64_t n, const int64_t i) {
+  return static_cast<int>(std::min(n - i, kBlasChunk));
 }
 
 template <>
-void caffe_gpu_gemv<float>(const CBLAS_TRANSPOSE TransA, const int M,
-    const int N, const float alpha, const float* A, const float* x,
-    const float beta, float* y) {
-  cublasOperation_t cuTransA =
-      (TransA == CblasNoTrans) ? CUBLAS_OP_T : CUBLAS_OP_N;
-  CUBLAS_CHECK(cublasSgemv(Caffe::cublas_handle(), cuTransA, N, M, &alpha,
-      A, N, x, 1, &beta, y, 1));
+void caffe_axpy<float>(const int64_t N, const float alpha, const float* X,
+    float* Y) {
+  for (int64_t i = 0; i < N; i += kBlasChunk) {
+    cblas_saxpy(BlasChunk(N, i), alpha, X + i, 1, Y + i, 1);
+  }
 }
 
 template <>
-void caffe_gpu_gemv<double>(const CBLAS_TRANSPOSE TransA, const int M,
-    const int N, const double alpha, const double* A, const double* x,
-    const double beta, double* y) {
-  cublasOperation_t cuTransA =
-      (TransA == CblasNoTrans) ? CUBLAS_OP_T : CUBLAS_OP_N;
-  CUBLAS_CHECK(cublasDgemv(Caffe::cublas_handle(), cuTransA, N, M, &alpha,
-      A, N, x, 1, &beta, y, 1));
+void caffe_axpy<double>(const int64_t N, const double alpha, const double* X,
+    double* Y) {
+  for (int64_t i = 0; i < N; i += kBlasChunk) {
+    cblas_daxpy(BlasChunk(N, i), alpha, X + i, 1, Y + i, 1);
+  }
 }
 
 template <>
-void caffe_axpy<float>(const int N, const float alpha, const float* X,
-    float* Y) { cblas_saxpy(N, alpha, X, 1, Y, 1); }
-
-template <>
-void caffe_axpy<double>(const int N, const double alpha, const double* X,
-    double* Y) { cblas_daxpy(N, alpha, X, 1, Y, 1); }
-
-template <>
-void caffe_gpu_axpy<float>(const int N, const float alpha, const float* X,
-    float* Y) {
-  CUBLAS_CHECK(cublasSaxpy(Caffe::cublas_handle(), N, &alpha, X, 1, Y, 1));
+void caffe_gpu_axpy<float>(const int64_t N, const float alpha,
+    const float* X, float* Y) {
+  for (int64_t i = 0; i < N; i += kBlasChunk) {
+    CUBLAS_CHECK(cublasSaxpy(Caffe::cublas_handle(), BlasChunk(N, i), &alpha,
+        X + i, 1, Y + i, 1));
+  }
 }
 
 template <>
-void caffe_gpu_axpy<double>(const int N, const double alpha, const double* X,
-    double* Y) {
-  CUBLAS_CHECK(cublasDaxpy(Caffe::cublas_handle(), N, &alpha, X, 1, Y, 1));
+void caffe_gpu_axpy<double>(const int64_t N, const double alpha,
+    const double* X, double* Y) {
+  for (int64_t i = 0; i < N; i += kBlasChunk) {
+    CUBLAS_CHECK(cublasDaxpy(Caffe::cublas_handle(), BlasChunk(N, i), &alpha,
+        X + i, 1, Y + i, 1));
+  }
 }
 
 template <>
-void caffe_set(const int N, const float alpha, float* Y) {
+void caffe_set(const int64_t N, const float alpha, float* Y) {
   if (alpha == 0) {
     memset(Y, 0, sizeof(float) * N);
     return;
   }
-  for (int i = 0; i < N; ++i) {
+  const int num_threads = CpuElementwiseThreads(N);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int64_t i = 0; i < N; ++i) {
     Y[i] = alpha;
   }
 }
 
 template <>
-void caffe_set(const int N, const double alpha, double* Y) {
+void caffe_set(const int64_t N, const double alpha, double* Y) {
   if (alpha == 0) {
     memset(Y, 0, sizeof(double) * N);
     return;
   }
-  for (int i = 0; i < N; ++i) {
+  const int num_threads = CpuElementwiseThreads(N);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int64_t i = 0; i < N; ++i) {
     Y[i] = alpha;
   }
 }
 
 template <>
-void caffe_add_scalar(const int N, const float alpha, float* Y) {
-  for (int i = 0; i < N; ++i) {
+void caffe_add_scalar(const int64_t N, const float alpha, float* Y) {
+  const int num_threads = CpuElementwiseThreads(N);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int64_t i = 0; i < N; ++i) {
     Y[i] += alpha;
   }
 }
 
 template <>
-void caffe_add_scalar(const int N, const double alpha, double* Y) {
-  for (int i = 0; i < N; ++i) {
+void caffe_add_scalar(const int64_t N, const double alpha, double* Y) {
+  const int num_threads = CpuElementwiseThreads(N);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int64_t i = 0; i < N; ++i) {
     Y[i] += alpha;
   }
 }
 
+template <typename Dtype>
+void caffe_cpu_add_bias(const int num, const int channels, const int inner,
+    const Dtype* bias, const bool relu, Dtype* y) {
+  if (inner == 1) {
+    // An inner product top: a bias per element of the rows
+    for (int n = 0; n < num; ++n) {
+      Dtype* row = y + n * channels;
+      if (bias) {
+        for (int c = 0; c < channels; ++c) {
+          row[c] += bias[c];
+        }
+      }
+      if (relu) {
+        for (int c = 0; c < channels; ++c) {
+          row[c] = std::max(row[c], Dtype(0));
+        }
+      }
+    }
+    return;
+  }
+  for (int n = 0; n < num; ++n) {
+    for (int c = 0; c < channels; ++c) {
+      Dtype* channel = y + (n * channels + c) * inner;
+      const Dtype b = bias ? bias[c] : Dtype(0);
+      if (relu) {
+        for (int i = 0; i < inner; ++i) {
+          channel[i] = std::max(channel[i] + b, Dtype(0));
+        }
+      } else {
+        for (int i = 0; i < inner; ++i) {
+          channel[i] += b;
+        }
+      }
+    }
+  }
+}
+
+template void caffe_cpu_add_bias<float>(const int num, const int channels,
+    const int inner, const float* bias, const bool relu, float* y);
+template void caffe_cpu_add_bias<double>(const int num, const int channels,
+    const int inner, const double* bias, const bool relu, double* y);
+
+template <typename Dtype>
+void caffe_cpu_relu_mask(const int n, const Dtype* y, Dtype* diff) {
+  const int num_threads = CpuElementwiseThreads(n);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int i = 0; i < n; ++i) {
+    diff[i] *= (y[i] > 0);
+  }
+}
+
+template void caffe_cpu_relu_mask<float>(const int n, const float* y,
+    float* diff);
+template void caffe_cpu_relu_mask<double>(const int n, const double* y,
+    double* diff);
+
+template <typename Dtype>
+void caffe_cpu_sgd_update(const int64_t n, const Dtype rate,
+    const Dtype momentum, const Dtype decay, const Dtype* diff,
+    Dtype* history, Dtype* data) {
+  const int num_threads = CpuLayerThreads(n >> 16);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int64_t i = 0; i < n; ++i) {
+    const Dtype h = momentum * history[i] + rate * (diff[i] + decay * data[i]);
+    history[i] = h;
+    data[i] -= h;
+  }
+}
+
+template void caffe_cpu_sgd_update<float>(const int64_t n, const float rate,
+    const float momentum, const float decay, const float* diff,
+    float* history, float* data);
+template void caffe_cpu_sgd_update<double>(const int64_t n, const double rate,
+    const double momentum, const double decay, const double* diff,
+    double* history, double* data);
+
+template <typename Dtype>
+void caffe_cpu_nesterov_update(const int64_t n, const Dtype rate,
+    const Dtype momentum, const Dtype decay, const Dtype* diff,
+    Dtype* history, Dtype* data) {
+  const int num_threads = CpuLayerThreads(n >> 16);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int64_t i = 0; i < n; ++i) {
+    const Dtype h = history[i];
+    const Dtype h_new = momentum * h + rate * (diff[i] + decay * data[i]);
+    history[i] = h_new;
+    data[i] -= (1 + momentum) * h_new - momentum * h;
+  }
+}
+
+template void caffe_cpu_nesterov_update<float>(const int64_t n,
+    const float rate, const float momentum, const float decay,
+    const float* diff, float* history, float* data);
+template void caffe_cpu_nesterov_update<double>(const int64_t n,
+    const double rate, const double momentum, const double decay,
+    const double* diff, double* history, double* data);
+
+template <typename Dtype>
+void caffe_cpu_adagrad_update(const int64_t n, const Dtype rate,
+    const Dtype delta, const Dtype decay, const Dtype* diff, Dtype* history,
+    Dtype* data) {
+  const int num_threads = CpuLayerThreads(n >> 16);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int64_t i = 0; i < n; ++i) {
+    const Dtype g = diff[i] + decay * data[i];
+    const Dtype h = history[i] + g * g;
+    history[i] = h;
+    data[i] -= rate * g / (std::sqrt(h) + delta);
+  }
+}
+
+template void caffe_cpu_adagrad_update<float>(const int64_t n, const float rate,
+    const float delta, const float decay, const float* diff, float* history,
+    float* data);
+template void caffe_cpu_adagrad_update<double>(const int64_t n,
+    const double rate, const double delta, const double decay,
+    const double* diff, double* history, double* data);
+
+template <typename Dtype>
+void caffe_cpu_to_half(const int64_t n, const Dtype* x, float16* y) {
+  for (int64_t i = 0; i < n; ++i) {
+    y[i] = float_to_half(x[i]);
+  }
+}
+
+template void caffe_cpu_to_half<float>(const int64_t n, const float* x,
+    float16* y);
+template void caffe_cpu_to_half<double>(const int64_t n, const double* x,
+    float16* y);
+
+template <typename Dtype>
+void caffe_cpu_from_half(const int64_t n, const float16* x, Dtype* y) {
+  for (int64_t i = 0; i < n; ++i) {
+    y[i] = half_to_float(x[i]);
+  }
+}
+
+template void caffe_cpu_from_half<float>(const int64_t n, const float16* x,
+    float* y);
+template void caffe_cpu_from_half<double>(const int64_t n, const float16* x,
+    double* y);
+
 template <>
-void caffe_copy<float>(const int N, const float* X, float* Y) {
-  cblas_scopy(N, X, 1, Y, 1);
+void caffe_copy<float>(const int64_t N, const float* X, float* Y) {
+  for (int64_t i = 0; i < N; i += kBlasChunk) {
+    cblas_scopy(BlasChunk(N, i), X + i, 1, Y + i, 1);
+  }
 }
 
 template <>
-void caffe_copy<double>(const int N, const double* X, double* Y) {
-  cblas_dcopy(N, X, 1, Y, 1);
+void caffe_copy<double>(const int64_t N, const double* X, double* Y) {
+  for (int64_t i = 0; i < N; i += kBlasChunk) {
+    cblas_dcopy(BlasChunk(N, i), X + i, 1, Y + i, 1);
+  }
 }
 
 template <>
-void caffe_gpu_copy<float>(const int N, const float* X, float* Y) {
-  CUBLAS_CHECK(cublasScopy(Caffe::cublas_handle(), N, X, 1, Y, 1));
+void caffe_gpu_copy<float>(const int64_t N, const float* X, float* Y) {
+  for (int64_t i = 0; i < N; i += kBlasChunk) {
+    CUBLAS_CHECK(cublasScopy(Caffe::cublas_handle(), BlasChunk(N, i), X + i,
+        1, Y + i, 1));
+  }
 }
 
 template <>
-void caffe_gpu_copy<double>(const int N, const double* X, double* Y) {
-  CUBLAS_CHECK(cublasDcopy(Caffe::cublas_handle(), N, X, 1, Y, 1));
+void caffe_gpu_copy<double>(const int64_t N, const double* X, double* Y) {
+  for (int64_t i = 0; i < N; i += kBlasChunk) {
+    CUBLAS_CHECK(cublasDcopy(Caffe::cublas_handle(), BlasChunk(N, i), X + i,
+        1, Y + i, 1));
+  }
 }
 
 template <>
-void caffe_scal<float>(const int N, const float alpha, float *X) {
-  cblas_sscal(N, alpha, X, 1);
+void caffe_scal<float>(const int64_t N, const float alpha, float *X) {
+  for (int64_t i = 0; i < N; i += kBlasChunk) {
+    cblas_sscal(BlasChunk(N, i), alpha, X + i, 1);
+  }
 }
 
 template <>
-void caffe_scal<double>(const int N, const double alpha, double *X) {
-  cblas_dscal(N, alpha, X, 1);
+void caffe_scal<double>(const int64_t N, const double alpha, double *X) {
+  for (int64_t i = 0; i < N; i += kBlasChunk) {
+    cblas_dscal(BlasChunk(N, i), alpha, X + i, 1);
+  }
 }
 
 template <>
-void caffe_gpu_scal<float>(const int N, const float alpha, float *X) {
-  CUBLAS_CHECK(cublasSscal(Caffe::cublas_handle(), N, &alpha, X, 1));
+void caffe_gpu_scal<float>(const int64_t N, const float alpha, float *X) {
+  for (int64_t i = 0; i < N; i += kBlasChunk) {
+    CUBLAS_CHECK(cublasSscal(Caffe::cublas_handle(), BlasChunk(N, i), &alpha,
+        X + i, 1));
+  }
 }
 
 template <>
-void caffe_gpu_scal<double>(const int N, const double alpha, double *X) {
-  CUBLAS_CHECK(cublasDscal(Caffe::cublas_handle(), N, &alpha, X, 1));
+void caffe_gpu_scal<double>(const int64_t N, const double alpha,
+    double *X) {
+  for (int64_t i = 0; i < N; i += kBlasChunk) {
+    CUBLAS_CHECK(cublasDscal(Caffe::cublas_handle(), BlasChunk(N, i), &alpha,
+        X + i, 1));
+  }
 }
 
 template <>
-void caffe_gpu_axpby<float>(const int N, const float alpha, const float* X,
+void caffe_gpu_axpby<float>(const int64_t N, const float alpha, const float* X,
     const float beta, float* Y) {
   caffe_gpu_scal<float>(N, beta, Y);
   caffe_gpu_axpy<float>(N, alpha, X, Y);
 }
 
 template <>
-void caffe_gpu_axpby<double>(const int N, const double alpha, const double* X,
-    const double beta, double* Y) {
+void caffe_gpu_axpby<double>(const int64_t N, const double alpha,
+    const double* X, const double beta, double* Y) {
   caffe_gpu_scal<double>(N, beta, Y);
   caffe_gpu_axpy<double>(N, alpha, X, Y);
 }
 
 template <>
-void caffe_cpu_axpby<float>(const int N, const float alpha, const float* X,
+void caffe_cpu_axpby<float>(const int64_t N, const float alpha, const float* X,
                             const float beta, float* Y) {
-  cblas_saxpby(N, alpha, X, 1, beta, Y, 1);
+  for (int64_t i = 0; i < N; i += kBlasChunk) {
+    cblas_saxpby(BlasChunk(N, i), alpha, X + i, 1, beta, Y + i, 1);
+  }
 }
 
 template <>
-void caffe_cpu_axpby<double>(const int N, const double alpha, const double* X,
-                             const double beta, double* Y) {
-  cblas_daxpby(N, alpha, X, 1, beta, Y, 1);
+void caffe_cpu_axpby<double>(const int64_t N, const double alpha,
+    const double* X, const double beta, double* Y) {
+  for (int64_t i = 0; i < N; i += kBlasChunk) {
+    cblas_daxpby(BlasChunk(N, i), alpha, X + i, 1, beta, Y + i, 1);
+  }
+}
+
+// The vector math of mkl_alternate.hpp over the CPU threads, each running
+// it over a contiguous chunk of the elements. MKL threads its own.
+static int VectorMathChunk(const int n, const int num_threads) {
+  // A multiple of the 4 floats of the SIMD functions
+  return ((n + num_threads - 1) / num_threads + 3) / 4 * 4;
+}
+
+template <typename Dtype>
+static void ParallelVectorMath(void (*f)(const int, const Dtype*, Dtype*),
+    const int n, const Dtype* a, Dtype* y) {
+#ifdef USE_MKL
+  const int num_threads = 1;
+#else
+  const int num_threads = CpuElementwiseThreads(n);
+#endif
+  if (num_threads == 1) {
+    f(n, a, y);
+    return;
+  }
+  const int chunk = VectorMathChunk(n, num_threads);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads)
+#endif
+  for (int begin = 0; begin < n; begin += chunk) {
+    f(std::min(chunk, n - begin), a + begin, y + begin);
+  }
+}
+
+template <typename Dtype>
+static void ParallelVectorMath(
+    void (*f)(const int, const Dtype*, const Dtype*, Dtype*), const int n,
+    const Dtype* a, const Dtype* b, Dtype* y) {
+#ifdef USE_MKL
+  const int num_threads = 1;
+#else
+  const int num_threads = CpuElementwiseThreads(n);
+#endif
+  if (num_threads == 1) {
+    f(n, a, b, y);
+    return;
+  }
+  const int chunk = VectorMathChunk(n, num_threads);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads)
+#endif
+  for (int begin = 0; begin < n; begin += chunk) {
+    f(std::min(chunk, n - begin), a + begin, b + begin, y + begin);
+  }
+}
+
+// For the powers, whose exponent is a float in mkl_alternate.hpp and of the
+// type of the data in MKL
+template <typename Dtype, typename Param>
+static void ParallelVectorMath(
+    void (*f)(const int, const Dtype*, const Param, Dtype*), const int n,
+    const Dtype* a, const Dtype b, Dtype* y) {
+#ifdef USE_MKL
+  const int num_threads = 1;
+#else
+  const int num_threads = CpuElementwiseThreads(n);
+#endif
+  if (num_threads == 1) {
+    f(n, a, b, y);
+    return;
+  }
+  const int chunk = VectorMathChunk(n, num_threads);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads)
+#endif
+  for (int begin = 0; begin < n; begin += chunk) {
+    f(std::min(chunk, n - begin), a + begin, b, y + begin);
+  }
 }
 
 template <>
 void caffe_add<float>(const int n, const float* a, const float* b,
     float* y) {
-  vsAdd(n, a, b, y);
+  ParallelVectorMath(vsAdd, n, a, b, y);
 }
 
 template <>
 void caffe_add<double>(const int n, const double* a, const double* b,
     double* y) {
-  vdAdd(n, a, b, y);
+  ParallelVectorMath(vdAdd, n, a, b, y);
 }
 
 template <>
 void caffe_sub<float>(const int n, const float* a, const float* b,
     float* y) {
-  vsSub(n, a, b, y);
+  ParallelVectorMath(vsSub, n, a, b, y);
 }
 
 template <>
 void caffe_sub<double>(const int n, const double* a, const double* b,
     double* y) {
-  vdSub(n, a, b, y);
+  ParallelVectorMath(vdSub, n, a, b, y);
 }
 
 template <>
 void caffe_mul<float>(const int n, const float* a, const float* b,
     float* y) {
-  vsMul(n, a, b, y);
+  ParallelVectorMath(vsMul, n, a, b, y);
 }
 
 template <>
 void caffe_mul<double>(const int n, const double* a, const double* b,
     double* y) {
-  vdMul(n, a, b, y);
+  ParallelVectorMath(vdMul, n, a, b, y);
 }
 
 template <>
 void caffe_div<float>(const int n, const float* a, const float* b,
     float* y) {
-  vsDiv(n, a, b, y);
+  ParallelVectorMath(vsDiv, n, a, b, y);
 }
 
 template <>
 void caffe_div<double>(const int n, const double* a, const double* b,
     double* y) {
-  vdDiv(n, a, b, y);
+  ParallelVectorMath(vdDiv, n, a, b, y);
 }
 
 template <>
 void caffe_powx<float>(const int n, const float* a, const float b,
     float* y) {
-  vsPowx(n, a, b, y);
+  ParallelVectorMath(vsPowx, n, a, b, y);
 }
 
 template <>
 void caffe_powx<double>(const int n, const double* a, const double b,
     double* y) {
-  vdPowx(n, a, b, y);
+  ParallelVectorMath(vdPowx, n, a, b, y);
 }
 
 template <>
 void caffe_sqr<float>(const int n, const float* a, float* y) {
-  vsSqr(n, a, y);
+  ParallelVectorMath(vsSqr, n, a, y);
 }
 
 template <>
 void caffe_sqr<double>(const int n, const double* a, double* y) {
-  vdSqr(n, a, y);
+  ParallelVectorMath(vdSqr, n, a, y);
 }
 
 template <>
 void caffe_exp<float>(const int n, const float* a, float* y) {
-  vsExp(n, a, y);
+  ParallelVectorMath(vsExp, n, a, y);
 }
 
 template <>
 void caffe_exp<double>(const int n, const double* a, double* y) {
-  vdExp(n, a, y);
+  ParallelVectorMath(vdExp, n, a, y);
+}
+
+template <>
+void caffe_log<float>(const int n, const float* a, float* y) {
+  ParallelVectorMath(vsLn, n, a, y);
+}
+
+template <>
+void caffe_log<double>(const int n, const double* a, double* y) {
+  ParallelVectorMath(vdLn, n, a, y);
+}
+
+template <>
+void caffe_tanh<float>(const int n, const float* a, float* y) {
+  ParallelVectorMath(vsTanh, n, a, y);
+}
+
+template <>
+void caffe_tanh<double>(const int n, const double* a, double* y) {
+  ParallelVectorMath(vdTanh, n, a, y);
+}
+
+// MKL has no sigmoid: the SIMD one is used with it too.
+template <>
+void caffe_sigmoid<float>(const int n, const float* a, float* y) {
+  const int num_threads = CpuElementwiseThreads(n);
+  if (num_threads == 1) {
+    simd_sigmoid(n, a, y);
+    return;
+  }
+  const int chunk = VectorMathChunk(n, num_threads);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads)
+#endif
+  for (int begin = 0; begin < n; begin += chunk) {
+    simd_sigmoid(std::min(chunk, n - begin), a + begin, y + begin);
+  }
+}
+
+template <>
+void caffe_sigmoid<double>(const int n, const double* a, double* y) {
+  const int num_threads = CpuElementwiseThreads(n);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int i = 0; i < n; ++i) {
+    y[i] = 1. / (1. + exp(-a[i]));
+  }
 }
 
 unsigned int caffe_rng_rand() {
@@ -381,26 +773,133 @@ void caffe_rng_bernoulli<double>(const int n, const double p, int* r);
 template
 void caffe_rng_bernoulli<float>(const int n, const float p, int* r);
 
+// The Philox blocks of 4 elements do not depend on each other, so they are
+// split over the threads, by 1024 at least.
+template <typename Dtype>
+void caffe_philox_uniform(const int n, const Dtype a, const Dtype b,
+    const uint32_t key[2], Dtype* r) {
+  CHECK_GE(n, 0);
+  CHECK_LE(a, b);
+  const int num_blocks = (n + 3) / 4;
+  const int num_threads = CpuLayerThreads(num_blocks / 1024 + 1);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int block = 0; block < num_blocks; ++block) {
+    Dtype random[4];
+    philox_uniform_block<Dtype>(block, 0, key, a, b, random);
+    for (int i = block * 4; i < std::min(block * 4 + 4, n); ++i) {
+      r[i] = random[i - block * 4];
+    }
+  }
+}
+
+template
+void caffe_philox_uniform<float>(const int n, const float a, const float b,
+    const uint32_t key[2], float* r);
+
+template
+void caffe_philox_uniform<double>(const int n, const double a,
+    const double b, const uint32_t key[2], double* r);
+
+template <typename Dtype>
+void caffe_philox_gaussian(const int n, const Dtype mu, const Dtype sigma,
+    const uint32_t key[2], Dtype* r) {
+  CHECK_GE(n, 0);
+  CHECK_GT(sigma, 0);
+  const int num_blocks = (n + 3) / 4;
+  const int num_threads = CpuLayerThreads(num_blocks / 1024 + 1);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int block = 0; block < num_blocks; ++block) {
+    Dtype random[4];
+    philox_gaussian_block<Dtype>(block, 0, key, mu, sigma, random);
+    for (int i = block * 4; i < std::min(block * 4 + 4, n); ++i) {
+      r[i] = random[i - block * 4];
+    }
+  }
+}
+
+template
+void caffe_philox_gaussian<float>(const int n, const float mu,
+    const float sigma, const uint32_t key[2], float* r);
+
+template
+void caffe_philox_gaussian<double>(const int n, const double mu,
+    const double sigma, const uint32_t key[2], double* r);
+
+template <typename Dtype>
+void caffe_philox_bernoulli_mask(const int n, const Dtype p,
+    const uint32_t key[2], Dtype* r) {
+  CHECK_GE(n, 0);
+  CHECK_GE(p, 0);
+  CHECK_LE(p, 1);
+  const int num_blocks = (n + 3) / 4;
+  const int num_threads = CpuLayerThreads(num_blocks / 1024 + 1);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int block = 0; block < num_blocks; ++block) {
+    Dtype random[4];
+    philox_uniform_block<Dtype>(block, 1, key, Dtype(0), Dtype(1), random);
+    for (int i = block * 4; i < std::min(block * 4 + 4, n); ++i) {
+      r[i] *= random[i - block * 4] <= p;
+    }
+  }
+}
+
+template
+void caffe_philox_bernoulli_mask<float>(const int n, const float p,
+    const uint32_t key[2], float* r);
+
+template
+void caffe_philox_bernoulli_mask<double>(const int n, const double p,
+    const uint32_t key[2], double* r);
+
 template <>
-float caffe_cpu_dot<float>(const int n, const float* x, const float* y) {
-  return cblas_sdot(n, x, 1, y, 1);
+float caffe_cpu_dot<float>(const int64_t n, const float* x, const float* y) {
+  float dot = 0;
+  for (int64_t i = 0; i < n; i += kBlasChunk) {
+    dot += cblas_sdot(BlasChunk(n, i), x + i, 1, y + i, 1);
+  }
+  return dot;
 }
 
 template <>
-double caffe_cpu_dot<double>(const int n, const double* x, const double* y) {
-  return cblas_ddot(n, x, 1, y, 1);
+double caffe_cpu_dot<double>(const int64_t n, const double* x,
+    const double* y) {
+  double dot = 0;
+  for (int64_t i = 0; i < n; i += kBlasChunk) {
+    dot += cblas_ddot(BlasChunk(n, i), x + i, 1, y + i, 1);
+  }
+  return dot;
 }
 
+// The results of cuBLAS, in its default host pointer mode, are on the host:
+// those of the chunks are summed there.
 template <>
-void caffe_gpu_dot<float>(const int n, const float* x, const float* y,
+void caffe_gpu_dot<float>(const int64_t n, const float* x, const float* y,
     float* out) {
-  CUBLAS_CHECK(cublasSdot(Caffe::cublas_handle(), n, x, 1, y, 1, out));
+  *out = 0;
+  for (int64_t i = 0; i < n; i += kBlasChunk) {
+    float dot;
+    CUBLAS_CHECK(cublasSdot(Caffe::cublas_handle(), BlasChunk(n, i), x + i, 1,
+        y + i, 1, &dot));
+    *out += dot;
+  }
 }
 
 template <>
-void caffe_gpu_dot<double>(const int n, const double* x, const double* y,
+void caffe_gpu_dot<double>(const int64_t n, const double* x, const double* y,
     double * out) {
-  CUBLAS_CHECK(cublasDdot(Caffe::cublas_handle(), n, x, 1, y, 1, out));
+  *out = 0;
+  for (int64_t i = 0; i < n; i += kBlasChunk) {
+    double dot;
+    CUBLAS_CHECK(cublasDdot(Caffe::cublas_handle(), BlasChunk(n, i), x + i, 1,
+        y + i, 1, &dot));
+    *out += dot;
+  }
 }
 
 template <>
@@ -426,23 +925,74 @@ int caffe_cpu_hamming_distance<double>(const int n, const double* x,
 }
 
 template <>
-float caffe_cpu_asum<float>(const int n, const float* x) {
-  return cblas_sasum(n, x, 1);
+float caffe_cpu_asum<float>(const int64_t n, const float* x) {
+  float asum = 0;
+  for (int64_t i = 0; i < n; i += kBlasChunk) {
+    asum += cblas_sasum(BlasChunk(n, i), x + i, 1);
+  }
+  return asum;
+}
+
+template <>
+double caffe_cpu_asum<double>(const int64_t n, const double* x) {
+  double asum = 0;
+  for (int64_t i = 0; i < n; i += kBlasChunk) {
+    asum += cblas_dasum(BlasChunk(n, i), x + i, 1);
+  }
+  return asum;
+}
+
+template <>
+float caffe_cpu_max<float>(const int n, const float* x) {
+  float maxval = x[0];
+  int i = 1;
+#ifdef __SSE2__
+  if (n >= 4) {
+    __m128 acc = _mm_loadu_ps(x);
+    for (i = 4; i + 4 <= n; i += 4) {
+      acc = _mm_max_ps(_mm_loadu_ps(x + i), acc);
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    maxval = std::max(std::max(lanes[0], lanes[1]),
+                      std::max(lanes[2], lanes[3]));
+  }
+#endif
+  for (; i < n; ++i) {
+    maxval = std::max(maxval, x[i]);
+  }
+  return maxval;
 }
 
 template <>
-double caffe_cpu_asum<double>(const int n, const double* x) {
-  return cblas_dasum(n, x, 1);
+double caffe_cpu_max<double>(const int n, const double* x) {
+  double maxval = x[0];
+  for (int i = 1; i < n; ++i) {
+    maxval = std::max(maxval, x[i]);
+  }
+  return maxval;
 }
 
 template <>
-void caffe_gpu_asum<float>(const int n, const float* x, float* y) {
-  CUBLAS_CHECK(cublasSasum(Caffe::cublas_handle(), n, x, 1, y));
+void caffe_gpu_asum<float>(const int64_t n, const float* x, float* y) {
+  *y = 0;
+  for (int64_t i = 0; i < n; i += kBlasChunk) {
+    float asum;
+    CUBLAS_CHECK(cublasSasum(Caffe::cublas_handle(), BlasChunk(n, i), x + i, 1,
+        &asum));
+    *y += asum;
+  }
 }
 
 template <>
-void caffe_gpu_asum<double>(const int n, const double* x, double* y) {
-  CUBLAS_CHECK(cublasDasum(Caffe::cublas_handle(), n, x, 1, y));
+void caffe_gpu_asum<double>(const int64_t n, const double* x, double* y) {
+  *y = 0;
+  for (int64_t i = 0; i < n; i += kBlasChunk) {
+    double asum;
+    CUBLAS_CHECK(cublasDasum(Caffe::cublas_handle(), BlasChunk(n, i), x + i, 1,
+        &asum));
+    *y += asum;
+  }
 }
 
 INSTANTIATE_CAFFE_CPU_UNARY_FUNC(sign);
@@ -452,15 +1002,25 @@ INSTANTIATE_CAFFE_CPU_UNARY_FUNC(fabs);
 template <>
 void caffe_cpu_scale<float>(const int n, const float alpha, const float *x,
                             float* y) {
-  cblas_scopy(n, x, 1, y, 1);
-  cblas_sscal(n, alpha, y, 1);
+  const int num_threads = CpuElementwiseThreads(n);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int i = 0; i < n; ++i) {
+    y[i] = alpha * x[i];
+  }
 }
 
 template <>
 void caffe_cpu_scale<double>(const int n, const double alpha, const double *x,
                              double* y) {
-  cblas_dcopy(n, x, 1, y, 1);
-  cblas_dscal(n, alpha, y, 1);
+  const int num_threads = CpuElementwiseThreads(n);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int i = 0; i < n; ++i) {
+    y[i] = alpha * x[i];
+  }
 }
 
 template <>
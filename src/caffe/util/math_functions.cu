@@ -10,59 +10,330 @@
 
 #include "caffe/common.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/philox.hpp"
 
 namespace caffe {
 
-template <typename Dtype>
-__global__ void set_kernel(const int n, const Dtype alpha, Dtype* y) {
-  CUDA_KERNEL_LOOP(index, n) {
+// The kernels over whole blobs index their elements with an Index of int
+// when the count allows it, of int64_t otherwise (see CAFFE_INT32_INDEX).
+template <typename Dtype, typename Index>
+__global__ void set_kernel(const Index n, const Dtype alpha, Dtype* y) {
+  CUDA_KERNEL_LOOP_T(Index, index, n) {
     y[index] = alpha;
   }
 }
 
 template <>
-void caffe_gpu_set(const int N, const float alpha, float* Y) {
+void caffe_gpu_set(const int64_t N, const float alpha, float* Y) {
   if (alpha == 0) {
     CUDA_CHECK(cudaMemset(Y, 0, sizeof(float) * N));
     return;
   }
-  // NOLINT_NEXT_LINE(whitespace/operators)
-  set_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, alpha, Y);
+  if (CAFFE_INT32_INDEX(N)) {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    set_kernel<float, int><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
+        N, alpha, Y);
+  } else {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    set_kernel<float, int64_t><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
+        N, alpha, Y);
+  }
 }
 
 template <>
-void caffe_gpu_set(const int N, const double alpha, double* Y) {
+void caffe_gpu_set(const int64_t N, const double alpha, double* Y) {
   if (alpha == 0) {
     CUDA_CHECK(cudaMemset(Y, 0, sizeof(double) * N));
     return;
   }
-  // NOLINT_NEXT_LINE(whitespace/operators)
-  set_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, alpha, Y);
+  if (CAFFE_INT32_INDEX(N)) {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    set_kernel<double, int><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
+        N, alpha, Y);
+  } else {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    set_kernel<double, int64_t><<<CAFFE_GET_BLOCKS(N),
+        CAFFE_CUDA_NUM_THREADS>>>(N, alpha, Y);
+  }
 }
 
-template <typename Dtype>
-__global__ void add_scalar_kernel(const int n, const Dtype alpha, Dtype* y) {
-  CUDA_KERNEL_LOOP(index, n) {
+template <typename Dtype, typename Index>
+__global__ void add_scalar_kernel(const Index n, const Dtype alpha,
+    Dtype* y) {
+  CUDA_KERNEL_LOOP_T(Index, index, n) {
     y[index] += alpha;
   }
 }
 
 template <>
-void caffe_gpu_add_scalar(const int N, const float alpha, float* Y) {
-  // NOLINT_NEXT_LINE(whitespace/operators)
-  add_scalar_kernel<float><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, alpha, Y);
+void caffe_gpu_add_scalar(const int64_t N, const float alpha, float* Y) {
+  if (CAFFE_INT32_INDEX(N)) {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    add_scalar_kernel<float, int><<<CAFFE_GET_BLOCKS(N),
+        CAFFE_CUDA_NUM_THREADS>>>(N, alpha, Y);
+  } else {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    add_scalar_kernel<float, int64_t><<<CAFFE_GET_BLOCKS(N),
+        CAFFE_CUDA_NUM_THREADS>>>(N, alpha, Y);
+  }
 }
 
 template <>
-void caffe_gpu_add_scalar(const int N, const double alpha, double* Y) {
+void caffe_gpu_add_scalar(const int64_t N, const double alpha, double* Y) {
+  if (CAFFE_INT32_INDEX(N)) {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    add_scalar_kernel<double, int><<<CAFFE_GET_BLOCKS(N),
+        CAFFE_CUDA_NUM_THREADS>>>(N, alpha, Y);
+  } else {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    add_scalar_kernel<double, int64_t><<<CAFFE_GET_BLOCKS(N),
+        CAFFE_CUDA_NUM_THREADS>>>(N, alpha, Y);
+  }
+}
+
+template <typename Dtype>
+__global__ void add_bias_kernel(const int n, const int channels,
+    const int inner, const Dtype* bias, const bool relu, Dtype* y) {
+  CUDA_KERNEL_LOOP(index, n) {
+    Dtype value = y[index];
+    if (bias) {
+      value += bias[(index / inner) % channels];
+    }
+    y[index] = relu && value < 0 ? Dtype(0) : value;
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_add_bias(const int num, const int channels, const int inner,
+    const Dtype* bias, const bool relu, Dtype* y) {
+  const int n = num * channels * inner;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  add_bias_kernel<Dtype><<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS>>>(
+      n, channels, inner, bias, relu, y);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void caffe_gpu_add_bias<float>(const int num, const int channels,
+    const int inner, const float* bias, const bool relu, float* y);
+template void caffe_gpu_add_bias<double>(const int num, const int channels,
+    const int inner, const double* bias, const bool relu, double* y);
+
+template <typename Dtype>
+__global__ void dot_add_kernel(const int n, const Dtype* x, const Dtype* y,
+    const Dtype alpha, Dtype* out) {
+  __shared__ Dtype buffer[CAFFE_CUDA_NUM_THREADS];
+  Dtype sum = 0;
+  for (int i = threadIdx.x; i < n; i += CAFFE_CUDA_NUM_THREADS) {
+    sum += y ? x[i] * y[i] : x[i];
+  }
+  buffer[threadIdx.x] = sum;
+  __syncthreads();
+  for (int stride = CAFFE_CUDA_NUM_THREADS / 2; stride > 0; stride /= 2) {
+    if (threadIdx.x < stride) {
+      buffer[threadIdx.x] += buffer[threadIdx.x + stride];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    *out += alpha * buffer[0];
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_dot_add(const int n, const Dtype* x, const Dtype* y,
+    const Dtype alpha, Dtype* out) {
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  dot_add_kernel<Dtype><<<1, CAFFE_CUDA_NUM_THREADS>>>(n, x, y, alpha, out);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void caffe_gpu_dot_add<float>(const int n, const float* x,
+    const float* y, const float alpha, float* out);
+template void caffe_gpu_dot_add<double>(const int n, const double* x,
+    const double* y, const double alpha, double* out);
+
+template <typename Dtype>
+__global__ void relu_mask_kernel(const int n, const Dtype* y, Dtype* diff) {
+  CUDA_KERNEL_LOOP(index, n) {
+    diff[index] *= (y[index] > 0);
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_relu_mask(const int n, const Dtype* y, Dtype* diff) {
   // NOLINT_NEXT_LINE(whitespace/operators)
-  add_scalar_kernel<double><<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS>>>(
-      N, alpha, Y);
+  relu_mask_kernel<Dtype><<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS>>>(
+      n, y, diff);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void caffe_gpu_relu_mask<float>(const int n, const float* y,
+    float* diff);
+template void caffe_gpu_relu_mask<double>(const int n, const double* y,
+    double* diff);
+
+template <typename Dtype, typename Index>
+__global__ void sgd_update_kernel(const Index n, const Dtype rate,
+    const Dtype momentum, const Dtype decay, const Dtype* diff,
+    Dtype* history, Dtype* data) {
+  CUDA_KERNEL_LOOP_T(Index, index, n) {
+    const Dtype h = momentum * history[index] +
+        rate * (diff[index] + decay * data[index]);
+    history[index] = h;
+    data[index] -= h;
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_sgd_update(const int64_t n, const Dtype rate,
+    const Dtype momentum, const Dtype decay, const Dtype* diff,
+    Dtype* history, Dtype* data) {
+  if (CAFFE_INT32_INDEX(n)) {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    sgd_update_kernel<Dtype, int><<<CAFFE_GET_BLOCKS(n),
+        CAFFE_CUDA_NUM_THREADS>>>(n, rate, momentum, decay, diff, history,
+        data);
+  } else {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    sgd_update_kernel<Dtype, int64_t><<<CAFFE_GET_BLOCKS(n),
+        CAFFE_CUDA_NUM_THREADS>>>(n, rate, momentum, decay, diff, history,
+        data);
+  }
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void caffe_gpu_sgd_update<float>(const int64_t n, const float rate,
+    const float momentum, const float decay, const float* diff,
+    float* history, float* data);
+template void caffe_gpu_sgd_update<double>(const int64_t n, const double rate,
+    const double momentum, const double decay, const double* diff,
+    double* history, double* data);
+
+template <typename Dtype, typename Index>
+__global__ void nesterov_update_kernel(const Index n, const Dtype rate,
+    const Dtype momentum, const Dtype decay, const Dtype* diff,
+    Dtype* history, Dtype* data) {
+  CUDA_KERNEL_LOOP_T(Index, index, n) {
+    const Dtype h = history[index];
+    const Dtype h_new = momentum * h +
+        rate * (diff[index] + decay * data[index]);
+    history[index] = h_new;
+    data[index] -= (1 + momentum) * h_new - momentum * h;
+  }
 }
 
+template <typename Dtype>
+void caffe_gpu_nesterov_update(const int64_t n, const Dtype rate,
+    const Dtype momentum, const Dtype decay, const Dtype* diff,
+    Dtype* history, Dtype* data) {
+  if (CAFFE_INT32_INDEX(n)) {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    nesterov_update_kernel<Dtype, int><<<CAFFE_GET_BLOCKS(n),
+        CAFFE_CUDA_NUM_THREADS>>>(n, rate, momentum, decay, diff, history,
+        data);
+  } else {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    nesterov_update_kernel<Dtype, int64_t><<<CAFFE_GET_BLOCKS(n),
+        CAFFE_CUDA_NUM_THREADS>>>(n, rate, momentum, decay, diff, history,
+        data);
+  }
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void caffe_gpu_nesterov_update<float>(const int64_t n,
+    const float rate, const float momentum, const float decay,
+    const float* diff, float* history, float* data);
+template void caffe_gpu_nesterov_update<double>(const int64_t n,
+    const double rate, const double momentum, const double decay,
+    const double* diff, double* history, double* data);
+
+template <typename Dtype, typename Index>
+__global__ void adagrad_update_kernel(const Index n, const Dtype rate,
+    const Dtype delta, const Dtype decay, const Dtype* diff, Dtype* history,
+    Dtype* data) {
+  CUDA_KERNEL_LOOP_T(Index, index, n) {
+    const Dtype g = diff[index] + decay * data[index];
+    const Dtype h = history[index] + g * g;
+    history[index] = h;
+    data[index] -= rate * g / (sqrt(h) + delta);
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_adagrad_update(const int64_t n, const Dtype rate,
+    const Dtype delta, const Dtype decay, const Dtype* diff, Dtype* history,
+    Dtype* data) {
+  if (CAFFE_INT32_INDEX(n)) {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    adagrad_update_kernel<Dtype, int><<<CAFFE_GET_BLOCKS(n),
+        CAFFE_CUDA_NUM_THREADS>>>(n, rate, delta, decay, diff, history, data);
+  } else {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    adagrad_update_kernel<Dtype, int64_t><<<CAFFE_GET_BLOCKS(n),
+        CAFFE_CUDA_NUM_THREADS>>>(n, rate, delta, decay, diff, history, data);
+  }
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void caffe_gpu_adagrad_update<float>(const int64_t n, const float rate,
+    const float delta, const float decay, const float* diff, float* history,
+    float* data);
+template void caffe_gpu_adagrad_update<double>(const int64_t n,
+    const double rate, const double delta, const double decay,
+    const double* diff, double* history, double* data);
+
+template <typename Dtype, typename Index>
+__global__ void to_half_kernel(const Index n, const Dtype* x, float16* y) {
+  CUDA_KERNEL_LOOP_T(Index, index, n) {
+    y[index] = float_to_half(x[index]);
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_to_half(const int64_t n, const Dtype* x, float16* y) {
+  if (CAFFE_INT32_INDEX(n)) {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    to_half_kernel<Dtype, int><<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS>>>(
+        n, x, y);
+  } else {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    to_half_kernel<Dtype, int64_t><<<CAFFE_GET_BLOCKS(n),
+        CAFFE_CUDA_NUM_THREADS>>>(n, x, y);
+  }
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void caffe_gpu_to_half<float>(const int64_t n, const float* x,
+    float16* y);
+template void caffe_gpu_to_half<double>(const int64_t n, const double* x,
+    float16* y);
+
+template <typename Dtype, typename Index>
+__global__ void from_half_kernel(const Index n, const float16* x, Dtype* y) {
+  CUDA_KERNEL_LOOP_T(Index, index, n) {
+    y[index] = half_to_float(x[index]);
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_from_half(const int64_t n, const float16* x, Dtype* y) {
+  if (CAFFE_INT32_INDEX(n)) {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    from_half_kernel<Dtype, int><<<CAFFE_GET_BLOCKS(n),
+        CAFFE_CUDA_NUM_THREADS>>>(n, x, y);
+  } else {
+    // NOLINT_NEXT_LINE(whitespace/operators)
+    from_half_kernel<Dtype, int64_t><<<CAFFE_GET_BLOCKS(n),
+        CAFFE_CUDA_NUM_THREADS>>>(n, x, y);
+  }
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void caffe_gpu_from_half<float>(const int64_t n, const float16* x,
+    float* y);
+template void caffe_gpu_from_half<double>(const int64_t n, const float16* x,
+    double* y);
+
 template <typename Dtype>
 __global__ void mul_kernel(const int n, const Dtype* a,
     const Dtype* b, Dtype* y) {
@@ -229,4 +500,103 @@ void caffe_gpu_rng_gaussian(const int n, const double mu, const double sigma,
       curandGenerateNormalDouble(Caffe::curand_generator(), r, n, mu, sigma));
 }
 
+// A thread per Philox block of 4 elements, as in caffe_philox_uniform and
+// the others in math_functions.cpp
+template <typename Dtype>
+__global__ void philox_uniform_kernel(const int n, const Dtype a,
+    const Dtype b, const uint32_t key0, const uint32_t key1, Dtype* r) {
+  CUDA_KERNEL_LOOP(block, (n + 3) / 4) {
+    const uint32_t key[2] = { key0, key1 };
+    Dtype random[4];
+    philox_uniform_block<Dtype>(block, 0, key, a, b, random);
+    for (int i = 0; i < 4 && block * 4 + i < n; ++i) {
+      r[block * 4 + i] = random[i];
+    }
+  }
+}
+
+template <typename Dtype>
+__global__ void philox_gaussian_kernel(const int n, const Dtype mu,
+    const Dtype sigma, const uint32_t key0, const uint32_t key1, Dtype* r) {
+  CUDA_KERNEL_LOOP(block, (n + 3) / 4) {
+    const uint32_t key[2] = { key0, key1 };
+    Dtype random[4];
+    philox_gaussian_block<Dtype>(block, 0, key, mu, sigma, random);
+    for (int i = 0; i < 4 && block * 4 + i < n; ++i) {
+      r[block * 4 + i] = random[i];
+    }
+  }
+}
+
+template <typename Dtype>
+__global__ void philox_bernoulli_mask_kernel(const int n, const Dtype p,
+    const uint32_t key0, const uint32_t key1, Dtype* r) {
+  CUDA_KERNEL_LOOP(block, (n + 3) / 4) {
+    const uint32_t key[2] = { key0, key1 };
+    Dtype random[4];
+    philox_uniform_block<Dtype>(block, 1, key, Dtype(0), Dtype(1), random);
+    for (int i = 0; i < 4 && block * 4 + i < n; ++i) {
+      r[block * 4 + i] *= random[i] <= p;
+    }
+  }
+}
+
+template <typename Dtype>
+void caffe_gpu_philox_uniform(const int n, const Dtype a, const Dtype b,
+    const uint32_t key[2], Dtype* r) {
+  CHECK_LE(a, b);
+  const int num_blocks = (n + 3) / 4;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  philox_uniform_kernel<Dtype><<<CAFFE_GET_BLOCKS(num_blocks),
+      CAFFE_CUDA_NUM_THREADS>>>(n, a, b, key[0], key[1], r);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template
+void caffe_gpu_philox_uniform<float>(const int n, const float a,
+    const float b, const uint32_t key[2], float* r);
+
+template
+void caffe_gpu_philox_uniform<double>(const int n, const double a,
+    const double b, const uint32_t key[2], double* r);
+
+template <typename Dtype>
+void caffe_gpu_philox_gaussian(const int n, const Dtype mu, const Dtype sigma,
+    const uint32_t key[2], Dtype* r) {
+  CHECK_GT(sigma, 0);
+  const int num_blocks = (n + 3) / 4;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  philox_gaussian_kernel<Dtype><<<CAFFE_GET_BLOCKS(num_blocks),
+      CAFFE_CUDA_NUM_THREADS>>>(n, mu, sigma, key[0], key[1], r);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template
+void caffe_gpu_philox_gaussian<float>(const int n, const float mu,
+    const float sigma, const uint32_t key[2], float* r);
+
+template
+void caffe_gpu_philox_gaussian<double>(const int n, const double mu,
+    const double sigma, const uint32_t key[2], double* r);
+
+template <typename Dtype>
+void caffe_gpu_philox_bernoulli_mask(const int n, const Dtype p,
+    const uint32_t key[2], Dtype* r) {
+  CHECK_GE(p, 0);
+  CHECK_LE(p, 1);
+  const int num_blocks = (n + 3) / 4;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  philox_bernoulli_mask_kernel<Dtype><<<CAFFE_GET_BLOCKS(num_blocks),
+      CAFFE_CUDA_NUM_THREADS>>>(n, p, key[0], key[1], r);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template
+void caffe_gpu_philox_bernoulli_mask<float>(const int n, const float p,
+    const uint32_t key[2], float* r);
+
+template
+void caffe_gpu_philox_bernoulli_mask<double>(const int n, const double p,
+    const uint32_t key[2], double* r);
+
 }  // namespace caffe
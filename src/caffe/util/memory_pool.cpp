@@ -0,0 +1,448 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <cuda_runtime.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/memory_pool.hpp"
+#include "caffe/util/numa.hpp"
+
+namespace caffe {
+
+// The smallest block handed out
+const size_t kMinBlockSize = 256;
+// The size of the transparent huge pages of x86 and of most of ARM
+const size_t kHugePageSize = 2 << 20;
+
+MemoryPool& MemoryPool::Get() {
+  // Never deleted, so that memory freed while static objects are destroyed
+  // still has a pool to go back to.
+  static MemoryPool* pool = new MemoryPool();
+  return *pool;
+}
+
+MemoryPool::MemoryPool()
+    : caching_(true), huge_page_threshold_(0), huge_pages_available_(false) {
+  stats_.in_use = 0;
+  stats_.requested = 0;
+  stats_.peak_in_use = 0;
+  stats_.cached = 0;
+  stats_.allocations = 0;
+  stats_.cache_hits = 0;
+  stats_.huge_pages = 0;
+  CHECK(!pthread_mutex_init(&mutex_, NULL)) << "Mutex init failed.";
+  Owner("unknown");
+}
+
+bool MemoryPool::BlockKey::operator<(const BlockKey& other) const {
+  if (kind != other.kind) {
+    return kind < other.kind;
+  }
+  if (device != other.device) {
+    return device < other.device;
+  }
+  if (huge_pages != other.huge_pages) {
+    return huge_pages < other.huge_pages;
+  }
+  return size < other.size;
+}
+
+size_t MemoryPool::SizeClass(const size_t size) {
+  if (size <= kMinBlockSize) {
+    return kMinBlockSize;
+  }
+  // Round up to a multiple of a quarter of the power of two below size, which
+  // wastes at most a fifth of the block.
+  size_t power = kMinBlockSize;
+  while (power * 2 < size) {
+    power *= 2;
+  }
+  const size_t step = power / 4;
+  return (size + step - 1) / step * step;
+}
+
+void* MemoryPool::DoAllocate(const BlockKey& key) {
+  void* ptr = NULL;
+  switch (key.kind) {
+  case HOST:
+    if (!key.huge_pages) {
+      ptr = malloc(key.size);
+    } else if (posix_memalign(&ptr, kHugePageSize, key.size) == 0) {
+#ifdef MADV_HUGEPAGE
+      // A failure only leaves the block on normal pages.
+      madvise(ptr, key.size, MADV_HUGEPAGE);
+#endif
+    } else {
+      ptr = NULL;
+    }
+    break;
+  case PINNED:
+    if (cudaMallocHost(&ptr, key.size) != cudaSuccess) {
+      // Clear the error so that it is not picked up by a later CUDA_CHECK.
+      cudaGetLastError();
+      ptr = NULL;
+    }
+    break;
+  case DEVICE:
+    if (cudaMalloc(&ptr, key.size) != cudaSuccess) {
+      cudaGetLastError();
+      ptr = NULL;
+    }
+    break;
+  }
+  return ptr;
+}
+
+void MemoryPool::DoFree(void* ptr, const BlockKey& key) {
+  switch (key.kind) {
+  case HOST:
+    free(ptr);
+    break;
+  case PINNED:
+    CUDA_CHECK(cudaFreeHost(ptr));
+    break;
+  case DEVICE:
+    int device;
+    CUDA_CHECK(cudaGetDevice(&device));
+    if (device != key.device) {
+      CUDA_CHECK(cudaSetDevice(key.device));
+    }
+    CUDA_CHECK(cudaFree(ptr));
+    if (device != key.device) {
+      CUDA_CHECK(cudaSetDevice(device));
+    }
+    break;
+  }
+}
+
+void* MemoryPool::Allocate(const size_t size, Kind* kind,
+    const MemoryTag& tag) {
+  BlockKey key;
+  key.kind = *kind;
+  key.size = SizeClass(size);
+  if (key.kind == DEVICE) {
+    CUDA_CHECK(cudaGetDevice(&key.device));
+  } else {
+    key.device = ThreadNumaNode();
+  }
+  key.huge_pages = key.kind == HOST && huge_pages_available_ &&
+      huge_page_threshold_ > 0 && key.size >= huge_page_threshold_;
+  if (key.huge_pages) {
+    // Whole pages, none shared with other blocks
+    key.size = (key.size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+  }
+  void* ptr = NULL;
+  pthread_mutex_lock(&mutex_);
+  std::map<BlockKey, std::vector<void*> >::iterator it = free_lists_.find(key);
+  if (it != free_lists_.end() && !it->second.empty()) {
+    ptr = it->second.back();
+    it->second.pop_back();
+    stats_.cached -= key.size;
+    ++stats_.cache_hits;
+  }
+  pthread_mutex_unlock(&mutex_);
+  const bool allocated = !ptr;
+  if (!ptr) {
+    ptr = DoAllocate(key);
+    if (!ptr && key.kind != HOST) {
+      // Give the cached blocks back and try again.
+      ReleaseCached(key.kind);
+      ptr = DoAllocate(key);
+    }
+    if (!ptr && key.kind == PINNED) {
+      LOG(WARNING) << "Cannot allocate pinned memory; using pageable memory.";
+      *kind = HOST;
+      return Allocate(size, kind, tag);
+    }
+    CHECK(ptr) << "Failed to allocate " << key.size << " bytes of "
+        << (key.kind == DEVICE ? "device" : "host") << " memory.";
+  }
+  Block block;
+  block.key = key;
+  block.requested = size;
+  block.tag = ResolveTag(tag);
+  pthread_mutex_lock(&mutex_);
+  blocks_[ptr] = block;
+  Account(block, true);
+  stats_.in_use += key.size;
+  stats_.requested += size;
+  stats_.peak_in_use = std::max(stats_.peak_in_use, stats_.in_use);
+  ++stats_.allocations;
+  if (key.huge_pages && allocated) {
+    stats_.huge_pages += key.size;
+  }
+  pthread_mutex_unlock(&mutex_);
+  return ptr;
+}
+
+void MemoryPool::Free(void* ptr) {
+  if (!ptr) {
+    return;
+  }
+  pthread_mutex_lock(&mutex_);
+  std::map<void*, Block>::iterator it = blocks_.find(ptr);
+  CHECK(it != blocks_.end()) << "Freeing memory not allocated by the pool.";
+  const Block block = it->second;
+  blocks_.erase(it);
+  Account(block, false);
+  stats_.in_use -= block.key.size;
+  stats_.requested -= block.requested;
+  if (caching_) {
+    free_lists_[block.key].push_back(ptr);
+    stats_.cached += block.key.size;
+  } else if (block.key.huge_pages) {
+    stats_.huge_pages -= block.key.size;
+  }
+  pthread_mutex_unlock(&mutex_);
+  if (!caching_) {
+    DoFree(ptr, block.key);
+  }
+}
+
+void MemoryPool::Retag(void* ptr, const MemoryTag& tag) {
+  const MemoryTag resolved = ResolveTag(tag);
+  pthread_mutex_lock(&mutex_);
+  std::map<void*, Block>::iterator it = blocks_.find(ptr);
+  CHECK(it != blocks_.end()) << "Retagging memory not allocated by the pool.";
+  Account(it->second, false);
+  it->second.tag = resolved;
+  Account(it->second, true);
+  pthread_mutex_unlock(&mutex_);
+}
+
+MemoryTag MemoryPool::ResolveTag(const MemoryTag& tag) {
+  if (tag.owner >= 0) {
+    return tag;
+  }
+  const MemoryTag* scope_tag = scope_tag_.get();
+  if (scope_tag && scope_tag->owner >= 0) {
+    return *scope_tag;
+  }
+  return MemoryTag(0, tag.category);
+}
+
+void MemoryPool::Account(const Block& block, const bool add) {
+  CHECK_LT(block.tag.owner, owner_usage_.size()) << "Unknown memory owner.";
+  MemoryUsage* usages[] = { &category_usage_[block.tag.category],
+      &owner_usage_[block.tag.owner], &total_usage_ };
+  for (int i = 0; i < sizeof(usages) / sizeof(usages[0]); ++i) {
+    const bool device = block.key.kind == DEVICE;
+    size_t* bytes = device ? &usages[i]->device : &usages[i]->host;
+    size_t* peak = device ? &usages[i]->peak_device : &usages[i]->peak_host;
+    if (add) {
+      *bytes += block.key.size;
+      *peak = std::max(*peak, *bytes);
+    } else {
+      *bytes -= block.key.size;
+    }
+  }
+}
+
+void MemoryPool::ReleaseCached(const Kind kind) {
+  // Take the blocks out of the free lists, and free them without the lock.
+  std::vector<std::pair<void*, BlockKey> > released;
+  pthread_mutex_lock(&mutex_);
+  for (std::map<BlockKey, std::vector<void*> >::iterator it =
+       free_lists_.begin(); it != free_lists_.end(); ++it) {
+    if (it->first.kind != kind) {
+      continue;
+    }
+    for (int i = 0; i < it->second.size(); ++i) {
+      released.push_back(std::make_pair(it->second[i], it->first));
+      stats_.cached -= it->first.size;
+      if (it->first.huge_pages) {
+        stats_.huge_pages -= it->first.size;
+      }
+    }
+    it->second.clear();
+  }
+  pthread_mutex_unlock(&mutex_);
+  for (int i = 0; i < released.size(); ++i) {
+    DoFree(released[i].first, released[i].second);
+  }
+}
+
+void MemoryPool::ReleaseCached() {
+  ReleaseCached(HOST);
+  ReleaseCached(PINNED);
+  ReleaseCached(DEVICE);
+}
+
+void MemoryPool::set_huge_page_threshold(const size_t threshold) {
+  huge_page_threshold_ = threshold;
+  if (!threshold) {
+    return;
+  }
+  // E.g. "always [madvise] never"
+  std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+  std::string modes;
+  std::getline(file, modes);
+#ifdef MADV_HUGEPAGE
+  huge_pages_available_ = !modes.empty() &&
+      modes.find("[never]") == std::string::npos;
+#endif
+  if (huge_pages_available_) {
+    LOG(INFO) << "Memory pool: host blocks of " << threshold
+        << " bytes and more are backed by transparent huge pages.";
+  } else {
+    LOG(WARNING) << "Memory pool: transparent huge pages are not available"
+        << (modes.empty() ? "" : " (" + modes + ")")
+        << "; using normal pages.";
+  }
+}
+
+void MemoryPool::set_caching(const bool caching) {
+  caching_ = caching;
+  if (!caching_) {
+    ReleaseCached();
+  }
+}
+
+MemoryPoolStats MemoryPool::stats() {
+  pthread_mutex_lock(&mutex_);
+  const MemoryPoolStats stats = stats_;
+  pthread_mutex_unlock(&mutex_);
+  return stats;
+}
+
+void MemoryPool::LogStats() {
+  const MemoryPoolStats stats = this->stats();
+  const size_t held = stats.in_use + stats.cached;
+  LOG(INFO) << "Memory pool: " << stats.in_use << " bytes in use (peak "
+      << stats.peak_in_use << "), " << stats.cached << " bytes cached, "
+      << stats.cache_hits << " of " << stats.allocations
+      << " allocations served from the cache.";
+  if (stats.huge_pages > 0) {
+    LOG(INFO) << "Memory pool: " << stats.huge_pages
+        << " bytes of host memory backed by huge pages.";
+  }
+  if (held > 0) {
+    LOG(INFO) << "Memory pool: " << 100. * (stats.in_use - stats.requested) /
+        held << "% of the held memory lost to rounding, "
+        << 100. * stats.cached / held << "% cached.";
+  }
+}
+
+int MemoryPool::Owner(const std::string& name) {
+  pthread_mutex_lock(&mutex_);
+  std::map<std::string, int>::iterator it = owner_ids_.find(name);
+  int owner;
+  if (it != owner_ids_.end()) {
+    owner = it->second;
+  } else {
+    owner = owner_names_.size();
+    owner_ids_[name] = owner;
+    owner_names_.push_back(name);
+    owner_usage_.push_back(MemoryUsage());
+  }
+  pthread_mutex_unlock(&mutex_);
+  return owner;
+}
+
+MemoryUsage MemoryPool::category_usage(const MemoryCategory category) {
+  CHECK_GE(category, 0);
+  CHECK_LT(category, NUM_MEMORY_CATEGORIES);
+  pthread_mutex_lock(&mutex_);
+  const MemoryUsage usage = category_usage_[category];
+  pthread_mutex_unlock(&mutex_);
+  return usage;
+}
+
+MemoryUsage MemoryPool::owner_usage(const std::string& name) {
+  MemoryUsage usage;
+  pthread_mutex_lock(&mutex_);
+  std::map<std::string, int>::iterator it = owner_ids_.find(name);
+  if (it != owner_ids_.end()) {
+    usage = owner_usage_[it->second];
+  }
+  pthread_mutex_unlock(&mutex_);
+  return usage;
+}
+
+const char* MemoryPool::CategoryName(const MemoryCategory category) {
+  switch (category) {
+  case MEMORY_OTHER:
+    return "other";
+  case MEMORY_ACTIVATIONS:
+    return "activations";
+  case MEMORY_GRADIENTS:
+    return "gradients";
+  case MEMORY_PARAMS:
+    return "params";
+  case MEMORY_PARAM_GRADIENTS:
+    return "param_gradients";
+  case MEMORY_BUFFERS:
+    return "buffers";
+  case MEMORY_SOLVER:
+    return "solver";
+  default:
+    LOG(FATAL) << "Unknown memory category: " << category;
+  }
+  return "";
+}
+
+static void LogMemoryUsage(const std::string& name, const MemoryUsage& usage) {
+  LOG(INFO) << "  " << name << ": host " << usage.host << " (peak "
+      << usage.peak_host << "), device " << usage.device << " (peak "
+      << usage.peak_device << ")";
+}
+
+// Orders the owners by decreasing peak.
+static bool LargerPeak(const std::pair<size_t, int>& a,
+    const std::pair<size_t, int>& b) {
+  return a.first > b.first;
+}
+
+void MemoryPool::LogUsage() {
+  pthread_mutex_lock(&mutex_);
+  const std::vector<std::string> owner_names = owner_names_;
+  const std::vector<MemoryUsage> owner_usage = owner_usage_;
+  std::vector<MemoryUsage> category_usage(category_usage_,
+      category_usage_ + NUM_MEMORY_CATEGORIES);
+  const MemoryUsage total_usage = total_usage_;
+  pthread_mutex_unlock(&mutex_);
+  LOG(INFO) << "Memory in use, in bytes, by category:";
+  for (int i = 0; i < NUM_MEMORY_CATEGORIES; ++i) {
+    LogMemoryUsage(CategoryName(static_cast<MemoryCategory>(i)),
+        category_usage[i]);
+  }
+  LogMemoryUsage("total", total_usage);
+  std::vector<std::pair<size_t, int> > owners;
+  for (int i = 0; i < owner_usage.size(); ++i) {
+    const size_t peak = owner_usage[i].peak_host + owner_usage[i].peak_device;
+    if (peak > 0) {
+      owners.push_back(std::make_pair(peak, i));
+    }
+  }
+  std::stable_sort(owners.begin(), owners.end(), LargerPeak);
+  LOG(INFO) << "Memory in use, in bytes, by owner:";
+  for (int i = 0; i < owners.size(); ++i) {
+    LogMemoryUsage(owner_names[owners[i].second],
+        owner_usage[owners[i].second]);
+  }
+}
+
+MemoryScope::MemoryScope(const MemoryTag& tag) {
+  boost::thread_specific_ptr<MemoryTag>& scope_tag =
+      MemoryPool::Get().scope_tag_;
+  if (!scope_tag.get()) {
+    scope_tag.reset(new MemoryTag());
+  }
+  previous_tag_ = *scope_tag;
+  *scope_tag = tag;
+}
+
+MemoryScope::~MemoryScope() {
+  *MemoryPool::Get().scope_tag_ = previous_tag_;
+}
+
+}  // namespace caffe
@@ -0,0 +1,101 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifdef USE_NUMA
+#include <numa.h>
+#include <numaif.h>
+#endif
+
+#include <boost/thread/tss.hpp>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <string>
+
+#include "caffe/common.hpp"
+#include "caffe/util/numa.hpp"
+
+namespace caffe {
+
+#ifdef USE_NUMA
+
+// The node of the thread, read from its memory policy at the first use so
+// that threads inherit the binding of the thread that started them.
+static boost::thread_specific_ptr<int> thread_numa_node_;
+
+static int PolicyNode() {
+  int mode;
+  unsigned long mask[16] = { 0 };  // NOLINT(runtime/int)
+  if (get_mempolicy(&mode, mask, sizeof(mask) * 8, NULL, 0) != 0 ||
+      mode != MPOL_PREFERRED) {
+    return -1;
+  }
+  const int bits = sizeof(mask[0]) * 8;
+  for (int i = 0; i < sizeof(mask) * 8; ++i) {
+    if (mask[i / bits] & (1UL << (i % bits))) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void BindToNumaNode(const int node) {
+  CHECK_GE(numa_available(), 0) << "NUMA is not available.";
+  if (node >= 0) {
+    CHECK_LE(node, numa_max_node()) << "No NUMA node " << node;
+    CHECK_EQ(numa_run_on_node(node), 0) << "Binding to node " << node
+        << " failed.";
+    numa_set_preferred(node);
+  } else {
+    CHECK_EQ(numa_run_on_node(-1), 0);
+    numa_set_localalloc();
+  }
+  thread_numa_node_.reset(new int(node));
+}
+
+int ThreadNumaNode() {
+  if (!thread_numa_node_.get()) {
+    thread_numa_node_.reset(new int(numa_available() >= 0 ?
+        PolicyNode() : -1));
+  }
+  return *thread_numa_node_;
+}
+
+int GpuNumaNode(const int device) {
+  char bus_id[32];
+  if (cudaDeviceGetPCIBusId(bus_id, sizeof(bus_id), device) != cudaSuccess) {
+    cudaGetLastError();
+    return -1;
+  }
+  // sysfs names the devices in lower case.
+  std::string name(bus_id);
+  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+  std::ifstream file(("/sys/bus/pci/devices/" + name + "/numa_node").c_str());
+  int node = -1;
+  if (!(file >> node) || node > numa_max_node()) {
+    return -1;
+  }
+  return node;
+}
+
+#else  // USE_NUMA
+
+void BindToNumaNode(const int node) {
+  if (node >= 0) {
+    LOG(WARNING) << "Not binding to NUMA node " << node
+        << ": Caffe is built without USE_NUMA.";
+  }
+}
+
+int ThreadNumaNode() {
+  return -1;
+}
+
+int GpuNumaNode(const int device) {
+  return -1;
+}
+
+#endif  // USE_NUMA
+
+}  // namespace caffe
@@ -0,0 +1,461 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/optimize_net.hpp"
+#include "caffe/util/window_shape.hpp"
+
+using std::map;
+using std::string;
+using std::vector;
+
+namespace caffe {
+
+static bool Reads(const LayerParameter& layer_param, const string& blob) {
+  for (int i = 0; i < layer_param.bottom_size(); ++i) {
+    if (layer_param.bottom(i) == blob) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool Writes(const LayerParameter& layer_param, const string& blob) {
+  for (int i = 0; i < layer_param.top_size(); ++i) {
+    if (layer_param.top(i) == blob) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The layers after layer i that read the blob as it is after layer i: up to
+// the next layer writing it, included if it reads it too, in place.
+static vector<int> Readers(const NetParameter& param, const int i,
+    const string& blob) {
+  vector<int> readers;
+  for (int j = i + 1; j < param.layers_size(); ++j) {
+    if (Reads(param.layers(j), blob)) {
+      readers.push_back(j);
+    }
+    if (Writes(param.layers(j), blob)) {
+      break;
+    }
+  }
+  return readers;
+}
+
+// Whether a layer strictly between begin and end writes the blob, or, for
+// ReferencedBetween, reads or writes it.
+static bool WrittenBetween(const NetParameter& param, const int begin,
+    const int end, const string& blob) {
+  for (int j = begin + 1; j < end; ++j) {
+    if (Writes(param.layers(j), blob)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool ReferencedBetween(const NetParameter& param, const int begin,
+    const int end, const string& blob) {
+  for (int j = begin + 1; j < end; ++j) {
+    if (Reads(param.layers(j), blob) || Writes(param.layers(j), blob)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void RenameBottom(const string& from, const string& to,
+    LayerParameter* layer_param) {
+  for (int i = 0; i < layer_param->bottom_size(); ++i) {
+    if (layer_param->bottom(i) == from) {
+      layer_param->set_bottom(i, to);
+    }
+  }
+}
+
+static void RemoveLayer(const int i, NetParameter* param) {
+  for (int j = i; j + 1 < param->layers_size(); ++j) {
+    param->mutable_layers()->SwapElements(j, j + 1);
+  }
+  param->mutable_layers()->RemoveLast();
+}
+
+// Whether the layer is a power layer of power 1, y = shift + scale x
+static bool IsAffinePower(const LayerParameter& layer_param) {
+  return layer_param.type() == LayerParameter_LayerType_POWER &&
+      layer_param.bottom_size() == 1 && layer_param.top_size() == 1 &&
+      layer_param.power_param().power() == 1;
+}
+
+// Whether the layer copies its bottom at test time
+static bool IsIdentity(const LayerParameter& layer_param) {
+  if (layer_param.type() == LayerParameter_LayerType_DROPOUT) {
+    return layer_param.bottom_size() == 1 && layer_param.top_size() == 1;
+  }
+  return IsAffinePower(layer_param) &&
+      layer_param.power_param().scale() == 1 &&
+      layer_param.power_param().shift() == 0;
+}
+
+// Whether the layer is a convolution or inner product layer with one bottom,
+// one top and its weights, which an affine map can be folded into.
+static bool HasFoldableWeights(const LayerParameter& layer_param) {
+  if (layer_param.bottom_size() != 1 || layer_param.top_size() != 1 ||
+      layer_param.blobs_size() == 0) {
+    return false;
+  }
+  switch (layer_param.type()) {
+  case LayerParameter_LayerType_CONVOLUTION:
+    return true;
+  // The parameters of a model parallel layer are those of its slices.
+  case LayerParameter_LayerType_INNER_PRODUCT:
+    return layer_param.inner_product_param().device_ids_size() == 0;
+  default:
+    return false;
+  }
+}
+
+// Whether a map of the top of the layer can be folded into it: its ReLU, if
+// fused, would come before the map.
+static bool CanFoldIntoOutputs(const LayerParameter& layer_param) {
+  if (!HasFoldableWeights(layer_param)) {
+    return false;
+  }
+  return layer_param.type() == LayerParameter_LayerType_CONVOLUTION ?
+      !layer_param.convolution_param().fused_relu() :
+      !layer_param.inner_product_param().fused_relu();
+}
+
+// Whether a map of the bottom of the layer can be folded into it: the zeros
+// a convolution pads its bottom with are not mapped, and the range of an int8
+// bottom is calibrated beforehand.
+static bool CanFoldIntoInputs(const LayerParameter& layer_param) {
+  if (!HasFoldableWeights(layer_param) ||
+      layer_param.quantization_param().precision() ==
+      QuantizationParameter_Precision_INT8) {
+    return false;
+  }
+  if (layer_param.type() == LayerParameter_LayerType_CONVOLUTION) {
+    const WindowShape shape = GetWindowShape(layer_param.convolution_param());
+    return shape.pad_h == 0 && shape.pad_w == 0;
+  }
+  return true;
+}
+
+// Whether the readers of the blob are layers a map of it can be folded into,
+// which do not write it.
+static bool CanFoldIntoReaders(const NetParameter& param,
+    const vector<int>& readers, const string& blob) {
+  if (readers.empty()) {
+    return false;
+  }
+  for (int k = 0; k < readers.size(); ++k) {
+    const LayerParameter& layer_param = param.layers(readers[k]);
+    if (!CanFoldIntoInputs(layer_param) || Writes(layer_param, blob)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int NumOutput(const LayerParameter& layer_param) {
+  return layer_param.type() == LayerParameter_LayerType_CONVOLUTION ?
+      layer_param.convolution_param().num_output() :
+      layer_param.inner_product_param().num_output();
+}
+
+// The weights and the bias of a foldable layer, 0 if it has none. Both are
+// dense, with one row of weights per output.
+static void GetWeights(const LayerParameter& layer_param,
+    Blob<float>* weights, Blob<float>* bias) {
+  const int num_output = NumOutput(layer_param);
+  weights->FromProto(layer_param.blobs(0));
+  CHECK_EQ(weights->count() % num_output, 0)
+      << "The weights of " << layer_param.name() << " do not match its "
+      "outputs.";
+  if (layer_param.blobs_size() > 1) {
+    bias->FromProto(layer_param.blobs(1));
+    CHECK_EQ(bias->count(), num_output)
+        << "The bias of " << layer_param.name() << " does not match its "
+        "outputs.";
+  } else {
+    bias->Reshape(1, 1, 1, num_output);
+    caffe_set(num_output, 0.f, bias->mutable_cpu_data());
+  }
+}
+
+// Gives the layer the weights and the bias, in the encoding of the weights,
+// adding the bias if it had none and it is not 0.
+static void SetWeights(const Blob<float>& weights, const Blob<float>& bias,
+    LayerParameter* layer_param) {
+  const BlobProto::Encoding encoding = layer_param->blobs(0).encoding();
+  layer_param->mutable_blobs(0)->Clear();
+  weights.ToProto(layer_param->mutable_blobs(0), false, encoding);
+  if (layer_param->blobs_size() == 1) {
+    if (caffe_cpu_asum(bias.count(), bias.cpu_data()) == 0) {
+      return;
+    }
+    layer_param->add_blobs();
+    if (layer_param->type() == LayerParameter_LayerType_CONVOLUTION) {
+      layer_param->mutable_convolution_param()->set_bias_term(true);
+    } else {
+      layer_param->mutable_inner_product_param()->set_bias_term(true);
+    }
+    if (layer_param->blobs_lr_size() == 1) {
+      layer_param->add_blobs_lr(layer_param->blobs_lr(0));
+    }
+    if (layer_param->weight_decay_size() == 1) {
+      layer_param->add_weight_decay(layer_param->weight_decay(0));
+    }
+  }
+  layer_param->mutable_blobs(1)->Clear();
+  bias.ToProto(layer_param->mutable_blobs(1), false, encoding);
+}
+
+// Folds y = shift + scale x, x the top of the layer, into it.
+static void FoldAffineIntoOutputs(const float scale, const float shift,
+    LayerParameter* layer_param) {
+  Blob<float> weights;
+  Blob<float> bias;
+  GetWeights(*layer_param, &weights, &bias);
+  caffe_scal(weights.count(), scale, weights.mutable_cpu_data());
+  float* bias_data = bias.mutable_cpu_data();
+  for (int o = 0; o < bias.count(); ++o) {
+    bias_data[o] = scale * bias_data[o] + shift;
+  }
+  SetWeights(weights, bias, layer_param);
+}
+
+// Folds x = shift[c] + scale z, x the bottom of the layer and c the channel
+// of z, into it, so that it reads z. shift holds one value per channel or a
+// single value for all the channels.
+static void FoldAffineIntoInputs(const float scale, const vector<float>& shift,
+    LayerParameter* layer_param) {
+  Blob<float> weights;
+  Blob<float> bias;
+  GetWeights(*layer_param, &weights, &bias);
+  const int num_output = bias.count();
+  const int row_size = weights.count() / num_output;
+  // Weight j of output o multiplies channel
+  // (o / group_outputs) * group_channels + j / channel_size.
+  int channel_size = row_size;
+  int group_outputs = num_output;
+  int group_channels = 0;
+  if (shift.size() > 1) {
+    if (layer_param->type() == LayerParameter_LayerType_CONVOLUTION) {
+      const int group = layer_param->convolution_param().group();
+      channel_size = weights.height() * weights.width();
+      group_outputs = num_output / group;
+      group_channels = weights.channels();
+      CHECK_EQ(group_channels * group, shift.size())
+          << "The channels of " << layer_param->name() << " do not match "
+          "the transform folded into it.";
+    } else {
+      CHECK_EQ(row_size % shift.size(), 0)
+          << "The inputs of " << layer_param->name() << " do not match "
+          "the transform folded into it.";
+      channel_size = row_size / shift.size();
+    }
+  }
+  float* weights_data = weights.mutable_cpu_data();
+  float* bias_data = bias.mutable_cpu_data();
+  for (int o = 0; o < num_output; ++o) {
+    float* row = weights_data + o * row_size;
+    const int channel_offset = (o / group_outputs) * group_channels;
+    double sum = 0;
+    for (int j = 0; j < row_size; ++j) {
+      const int c = shift.size() == 1 ? 0 : channel_offset + j / channel_size;
+      sum += row[j] * shift[c];
+      row[j] *= scale;
+    }
+    bias_data[o] += sum;
+  }
+  SetWeights(weights, bias, layer_param);
+}
+
+// Removes layer i if it copies its bottom at test time and can be removed.
+static bool RemoveIdentity(const int i, NetParameter* param) {
+  const LayerParameter& layer_param = param->layers(i);
+  if (!IsIdentity(layer_param)) {
+    return false;
+  }
+  const string name = layer_param.name();
+  const string bottom = layer_param.bottom(0);
+  const string top = layer_param.top(0);
+  if (top != bottom) {
+    // The readers of the top are given the bottom, unchanged until the last
+    // of them, and only read it.
+    const vector<int> readers = Readers(*param, i, top);
+    if (readers.empty() ||
+        WrittenBetween(*param, i, readers.back() + 1, bottom)) {
+      return false;
+    }
+    for (int k = 0; k < readers.size(); ++k) {
+      if (Writes(param->layers(readers[k]), top)) {
+        return false;
+      }
+    }
+    for (int k = 0; k < readers.size(); ++k) {
+      RenameBottom(top, bottom, param->mutable_layers(readers[k]));
+    }
+  }
+  LOG(INFO) << "Removing the layer " << name << ", which copies its bottom "
+      "at test time";
+  RemoveLayer(i, param);
+  return true;
+}
+
+// Whether the data layer has a transform that can be folded
+template <typename Param>
+static bool HasAffineTransform(const Param& data_param) {
+  return !data_param.has_mean_file() &&
+      (data_param.scale() != 1 || data_param.mean_value_size() > 0);
+}
+
+// Clears the transform of the data layer, x = scale (z - mean[c]), giving it
+// as x = shift[c] + scale z.
+template <typename Param>
+static void TakeAffineTransform(Param* data_param, float* scale,
+    vector<float>* shift) {
+  *scale = data_param->scale();
+  shift->clear();
+  for (int c = 0; c < data_param->mean_value_size(); ++c) {
+    shift->push_back(-*scale * data_param->mean_value(c));
+  }
+  if (shift->empty()) {
+    shift->push_back(0);
+  }
+  data_param->clear_scale();
+  data_param->clear_mean_value();
+}
+
+// Folds the transform of layer i, if it is a data layer, into the layers
+// reading its data.
+static bool FoldDataTransform(const int i, NetParameter* param) {
+  LayerParameter* layer_param = param->mutable_layers(i);
+  if (layer_param->top_size() == 0) {
+    return false;
+  }
+  if (layer_param->type() == LayerParameter_LayerType_DATA) {
+    if (!HasAffineTransform(layer_param->data_param())) {
+      return false;
+    }
+  } else if (layer_param->type() == LayerParameter_LayerType_IMAGE_DATA) {
+    if (!HasAffineTransform(layer_param->image_data_param())) {
+      return false;
+    }
+  } else {
+    return false;
+  }
+  const string top = layer_param->top(0);
+  const vector<int> readers = Readers(*param, i, top);
+  if (!CanFoldIntoReaders(*param, readers, top)) {
+    return false;
+  }
+  float scale;
+  vector<float> shift;
+  if (layer_param->type() == LayerParameter_LayerType_DATA) {
+    TakeAffineTransform(layer_param->mutable_data_param(), &scale, &shift);
+  } else {
+    TakeAffineTransform(layer_param->mutable_image_data_param(), &scale,
+        &shift);
+  }
+  for (int k = 0; k < readers.size(); ++k) {
+    LOG(INFO) << "Folding the transform of " << layer_param->name()
+        << " into " << param->layers(readers[k]).name();
+    FoldAffineIntoInputs(scale, shift, param->mutable_layers(readers[k]));
+  }
+  return true;
+}
+
+// Folds layer i, if it is an affine power layer, into the layer writing its
+// bottom or else into the layers reading its top, and removes it.
+static bool FoldPower(const int i, NetParameter* param) {
+  const LayerParameter& layer_param = param->layers(i);
+  if (!IsAffinePower(layer_param)) {
+    return false;
+  }
+  const string name = layer_param.name();
+  const string bottom = layer_param.bottom(0);
+  const string top = layer_param.top(0);
+  const float scale = layer_param.power_param().scale();
+  const float shift = layer_param.power_param().shift();
+  int writer = i - 1;
+  while (writer >= 0 && !Writes(param->layers(writer), bottom)) {
+    --writer;
+  }
+  if (writer >= 0 && CanFoldIntoOutputs(param->layers(writer))) {
+    // The writer then writes the top instead, which the layers up to this
+    // one must not use.
+    const vector<int> readers = Readers(*param, writer, bottom);
+    if (readers.size() == 1 && readers[0] == i &&
+        (top == bottom || !ReferencedBetween(*param, writer, i, top))) {
+      LayerParameter* writer_param = param->mutable_layers(writer);
+      LOG(INFO) << "Folding the layer " << name << " into "
+          << writer_param->name();
+      FoldAffineIntoOutputs(scale, shift, writer_param);
+      writer_param->set_top(0, top);
+      RemoveLayer(i, param);
+      return true;
+    }
+  }
+  const vector<int> readers = Readers(*param, i, top);
+  if (!CanFoldIntoReaders(*param, readers, top) || (top != bottom &&
+      WrittenBetween(*param, i, readers.back() + 1, bottom))) {
+    return false;
+  }
+  const vector<float> shifts(1, shift);
+  for (int k = 0; k < readers.size(); ++k) {
+    LayerParameter* reader_param = param->mutable_layers(readers[k]);
+    LOG(INFO) << "Folding the layer " << name << " into "
+        << reader_param->name();
+    RenameBottom(top, bottom, reader_param);
+    FoldAffineIntoInputs(scale, shifts, reader_param);
+  }
+  RemoveLayer(i, param);
+  return true;
+}
+
+void OptimizeNetForInference(const NetParameter& in_param,
+    const NetParameter& trained, NetParameter* param_optimized) {
+  NetParameter param(in_param);
+  map<string, const LayerParameter*> trained_layers;
+  for (int i = 0; i < trained.layers_size(); ++i) {
+    trained_layers[trained.layers(i).name()] = &trained.layers(i);
+  }
+  for (int i = 0; i < param.layers_size(); ++i) {
+    LayerParameter* layer_param = param.mutable_layers(i);
+    map<string, const LayerParameter*>::const_iterator it =
+        trained_layers.find(layer_param->name());
+    if (it != trained_layers.end() && it->second->blobs_size() > 0) {
+      layer_param->mutable_blobs()->CopyFrom(it->second->blobs());
+    }
+  }
+  for (int i = 0; i < param.layers_size(); ) {
+    if (!RemoveIdentity(i, &param)) {
+      ++i;
+    }
+  }
+  for (int i = 0; i < param.layers_size(); ++i) {
+    FoldDataTransform(i, &param);
+  }
+  for (int i = 0; i < param.layers_size(); ) {
+    if (!FoldPower(i, &param)) {
+      ++i;
+    }
+  }
+  LOG(INFO) << "Optimized " << in_param.name() << " from "
+      << in_param.layers_size() << " to " << param.layers_size()
+      << " layers";
+  param_optimized->CopyFrom(param);
+}
+
+}  // namespace caffe
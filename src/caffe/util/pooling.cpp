@@ -0,0 +1,583 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
+#include "caffe/util/cpu_dispatch.hpp"
+#include "caffe/util/pooling.hpp"
+
+using std::max;
+using std::min;
+
+namespace caffe {
+
+// Sets [*begin, *end) to the outputs of a row (or column) whose windows lie
+// inside [0, size).
+static void InsideRange(const int size, const int kernel_size,
+    const int stride, const int pad, const int pooled_size, int* begin,
+    int* end) {
+  *end = size + pad >= kernel_size ?
+      min((size + pad - kernel_size) / stride + 1, pooled_size) : 0;
+  *begin = min((pad + stride - 1) / stride, *end);
+}
+
+// The SIMD paths take the outputs [begin, end) of a row whose windows lie
+// inside the image, with the window of output pw starting column
+// pw * stride_w - pad_w of the kernel_h rows at bottom, and return the first
+// output they did not compute.
+template <typename Dtype>
+static int MaxPoolRow(const Dtype* bottom, const int width,
+    const int kernel_h, const int kernel_w, const int stride_w,
+    const int begin, const int end, Dtype* top, Dtype* mask,
+    const int mask_offset) {
+  return begin;
+}
+
+template <typename Dtype>
+static int AvePoolRow(const Dtype* bottom, const int width,
+    const int kernel_h, const int kernel_w, const int stride_w,
+    const int pad_w, const int begin, const int end, Dtype* top) {
+  return begin;
+}
+
+template <typename Dtype>
+static int MaxPoolBackwardRow(const Dtype* bottom, const Dtype* top,
+    const Dtype* top_diff, const int width, const int kernel_h,
+    const int kernel_w, const int stride_w, const int begin, const int end,
+    Dtype* bottom_diff) {
+  return begin;
+}
+
+// Whether the single window of a channel covers all of it
+static bool IsGlobalWindow(const int height, const int width,
+    const int kernel_h, const int kernel_w, const int pooled_height,
+    const int pooled_width) {
+  return pooled_height == 1 && pooled_width == 1 && kernel_h >= height &&
+      kernel_w >= width;
+}
+
+// Sets max[i] and argmax[i] to the max of the elements [i * stride,
+// i * stride + kernel_size) of the size values at x, a step apart, and to the
+// index of the first of them holding it, for the pooled_size windows, the
+// last ones cut to the values. A queue of the indices of the elements that
+// are larger than all those after them in the window, kept in queue, of size
+// values, gives each max as its front, so that each element is pushed and
+// popped once whatever the kernel size. Windows past the values, of strides
+// larger than the kernel, get -FLT_MAX and their start, as in the plain
+// loops.
+template <typename Dtype>
+static void SlidingMax(const Dtype* x, const int size, const int step,
+    const int kernel_size, const int stride, const int pooled_size,
+    Dtype* max, int* argmax, int* queue) {
+  int front = 0;
+  int back = 0;
+  int next = 0;
+  for (int i = 0; i < pooled_size; ++i) {
+    const int start = i * stride;
+    const int end = min(start + kernel_size, size);
+    for (; next < end; ++next) {
+      // Equal elements stay ahead of the new one: the first max wins.
+      while (back > front && x[queue[back - 1] * step] < x[next * step]) {
+        --back;
+      }
+      queue[back++] = next;
+    }
+    while (front < back && queue[front] < start) {
+      ++front;
+    }
+    if (front == back) {
+      max[i] = -FLT_MAX;
+      argmax[i] = start;
+      continue;
+    }
+    max[i] = x[queue[front] * step];
+    argmax[i] = queue[front];
+  }
+}
+
+// The separable path of max_pool_cpu: the first max of the rows of a window
+// in that of their maxes is its first max in the order of the plain loops.
+template <typename Dtype>
+static void MaxPoolSeparable(const Dtype* bottom, const int height,
+    const int width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pooled_height,
+    const int pooled_width, Dtype* top, Dtype* mask) {
+  // The max of the width windows of each row, and the column of each
+  std::vector<Dtype> row_max(height * pooled_width);
+  std::vector<int> row_argmax(height * pooled_width);
+  std::vector<int> queue(max(height, width));
+  for (int h = 0; h < height; ++h) {
+    SlidingMax(bottom + h * width, width, 1, kernel_w, stride_w,
+        pooled_width, &row_max[h * pooled_width],
+        &row_argmax[h * pooled_width], &queue[0]);
+  }
+  std::vector<Dtype> column_max(pooled_height);
+  std::vector<int> column_argmax(pooled_height);
+  for (int pw = 0; pw < pooled_width; ++pw) {
+    SlidingMax(&row_max[pw], height, pooled_width, kernel_h, stride_h,
+        pooled_height, &column_max[0], &column_argmax[0], &queue[0]);
+    for (int ph = 0; ph < pooled_height; ++ph) {
+      const int h = column_argmax[ph];
+      top[ph * pooled_width + pw] = column_max[ph];
+      if (mask) {
+        mask[ph * pooled_width + pw] = h * width + (h < height ?
+            row_argmax[h * pooled_width + pw] : pw * stride_w);
+      }
+    }
+  }
+}
+
+// The summed-area table path of ave_pool_cpu: the table, in double, holds
+// the sum of the elements above and left of each of its (height + 1) x
+// (width + 1) corners.
+template <typename Dtype>
+static void AvePoolIntegral(const Dtype* bottom, const int height,
+    const int width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pad_h, const int pad_w,
+    const int pooled_height, const int pooled_width, Dtype* top) {
+  const int table_width = width + 1;
+  std::vector<double> table((height + 1) * table_width, 0.);
+  for (int h = 0; h < height; ++h) {
+    double row_sum = 0;
+    for (int w = 0; w < width; ++w) {
+      row_sum += bottom[h * width + w];
+      table[(h + 1) * table_width + w + 1] =
+          table[h * table_width + w + 1] + row_sum;
+    }
+  }
+  for (int ph = 0; ph < pooled_height; ++ph) {
+    int hstart = ph * stride_h - pad_h;
+    int hend = min(hstart + kernel_h, height + pad_h);
+    const int pool_height = hend - hstart;
+    // Windows past the image, of strides larger than the kernel, are empty.
+    hend = min(hend, height);
+    hstart = min(max(hstart, 0), hend);
+    for (int pw = 0; pw < pooled_width; ++pw) {
+      int wstart = pw * stride_w - pad_w;
+      int wend = min(wstart + kernel_w, width + pad_w);
+      const int pool_size = pool_height * (wend - wstart);
+      wend = min(wend, width);
+      wstart = min(max(wstart, 0), wend);
+      const double sum = table[hend * table_width + wend]
+          - table[hstart * table_width + wend]
+          - table[hend * table_width + wstart]
+          + table[hstart * table_width + wstart];
+      top[ph * pooled_width + pw] = sum / pool_size;
+    }
+  }
+}
+
+#ifdef __SSE2__
+// Returns row[0], row[2], row[4] and row[6].
+static inline __m128 LoadEven4(const float* row) {
+  return _mm_shuffle_ps(_mm_loadu_ps(row), _mm_loadu_ps(row + 4),
+      _MM_SHUFFLE(2, 0, 2, 0));
+}
+
+// The outputs pw, ..., pw + 3 read up to column 2 * pw + kernel_w + 6.
+static inline int SIMDEnd(const int end, const int width,
+    const int kernel_w, const int pad_w) {
+  return min(end - 3, (width + pad_w - kernel_w - 5) / 2);
+}
+
+// The mask of the row is the index of its elements plus mask_offset.
+template <>
+int MaxPoolRow<float>(const float* bottom, const int width,
+    const int kernel_h, const int kernel_w, const int stride_w,
+    const int begin, const int end, float* top, float* mask,
+    const int mask_offset) {
+  if (stride_w != 2) {
+    return begin;
+  }
+  const int simd_end = SIMDEnd(end, width, kernel_w, 0);
+  const __m128 lanes = _mm_set_ps(6, 4, 2, 0);
+  int pw = begin;
+  for (; pw < simd_end; pw += 4) {
+    // _mm_max_ps returns its second operand on ties, as max does its first.
+    __m128 value = _mm_set1_ps(-FLT_MAX);
+    // The first element, if none is larger than -FLT_MAX
+    __m128 index = _mm_add_ps(lanes, _mm_set1_ps(mask_offset + 2 * pw));
+    for (int h = 0; h < kernel_h; ++h) {
+      const float* row = bottom + h * width + 2 * pw;
+      for (int w = 0; w < kernel_w; ++w) {
+        const __m128 x = LoadEven4(row + w);
+        if (mask) {
+          // The index moves to the element only if it is larger, like the
+          // value.
+          const __m128 larger = _mm_cmplt_ps(value, x);
+          const __m128 x_index = _mm_add_ps(lanes,
+              _mm_set1_ps(mask_offset + h * width + 2 * pw + w));
+          index = _mm_or_ps(_mm_and_ps(larger, x_index),
+              _mm_andnot_ps(larger, index));
+        }
+        value = _mm_max_ps(x, value);
+      }
+    }
+    _mm_storeu_ps(top + pw, value);
+    if (mask) {
+      _mm_storeu_ps(mask + pw, index);
+    }
+  }
+  return pw;
+}
+
+template <>
+int AvePoolRow<float>(const float* bottom, const int width,
+    const int kernel_h, const int kernel_w, const int stride_w,
+    const int pad_w, const int begin, const int end, float* top) {
+  if (stride_w != 2) {
+    return begin;
+  }
+  const __m128 pool_size = _mm_set1_ps(kernel_h * kernel_w);
+  const int simd_end = SIMDEnd(end, width, kernel_w, pad_w);
+  int pw = begin;
+  for (; pw < simd_end; pw += 4) {
+    __m128 value = _mm_setzero_ps();
+    for (int h = 0; h < kernel_h; ++h) {
+      const float* row = bottom + h * width + 2 * pw - pad_w;
+      for (int w = 0; w < kernel_w; ++w) {
+        value = _mm_add_ps(value, LoadEven4(row + w));
+      }
+    }
+    _mm_storeu_ps(top + pw, _mm_div_ps(value, pool_size));
+  }
+  return pw;
+}
+
+template <>
+int MaxPoolBackwardRow<float>(const float* bottom, const float* top,
+    const float* top_diff, const int width, const int kernel_h,
+    const int kernel_w, const int stride_w, const int begin, const int end,
+    float* bottom_diff) {
+  const int kMaxKernelSize = 3;
+  if (stride_w != 2 || kernel_w > kMaxKernelSize) {
+    return begin;
+  }
+  const __m128 one = _mm_set1_ps(1.);
+  const int simd_end = SIMDEnd(end, width, kernel_w, 0);
+  int pw = begin;
+  for (; pw < simd_end; pw += 4) {
+    const __m128 value = _mm_loadu_ps(top + pw);
+    const __m128 diff = _mm_loadu_ps(top_diff + pw);
+    for (int h = 0; h < kernel_h; ++h) {
+      const int offset = h * width + 2 * pw;
+      // The diff times the mask of the elements equal to the max, for each
+      // column of the windows
+      float masked_diff[kMaxKernelSize][4];
+      for (int w = 0; w < kernel_w; ++w) {
+        const __m128 mask = _mm_and_ps(
+            _mm_cmpeq_ps(LoadEven4(bottom + offset + w), value), one);
+        _mm_storeu_ps(masked_diff[w], _mm_mul_ps(diff, mask));
+      }
+      // Overlapping windows add to the same elements, which still get the
+      // outputs in order.
+      for (int i = 0; i < 4; ++i) {
+        for (int w = 0; w < kernel_w; ++w) {
+          bottom_diff[offset + 2 * i + w] += masked_diff[w][i];
+        }
+      }
+    }
+  }
+  return pw;
+}
+#endif  // __SSE2__
+
+template <typename Dtype>
+CAFFE_CPU_DISPATCH
+void max_pool_cpu(const Dtype* bottom, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int stride_h,
+    const int stride_w, const int pooled_height, const int pooled_width,
+    Dtype* top, Dtype* mask) {
+  if (IsGlobalWindow(height, width, kernel_h, kernel_w, pooled_height,
+      pooled_width)) {
+    int index = 0;
+    for (int i = 1; i < height * width; ++i) {
+      if (bottom[index] < bottom[i]) {
+        index = i;
+      }
+    }
+    top[0] = max<Dtype>(bottom[index], -FLT_MAX);
+    if (mask) {
+      mask[0] = index;
+    }
+    return;
+  }
+  if (UseSeparablePool(kernel_h, kernel_w)) {
+    MaxPoolSeparable(bottom, height, width, kernel_h, kernel_w, stride_h,
+        stride_w, pooled_height, pooled_width, top, mask);
+    return;
+  }
+  int inside_begin, inside_end;
+  InsideRange(width, kernel_w, stride_w, 0, pooled_width, &inside_begin,
+      &inside_end);
+  for (int ph = 0; ph < pooled_height; ++ph) {
+    int hstart = ph * stride_h;
+    int hend = min(hstart + kernel_h, height);
+    Dtype* top_row = top + ph * pooled_width;
+    Dtype* mask_row = mask ? mask + ph * pooled_width : NULL;
+    // The outputs [simd_begin, simd_end) are left to the SIMD path.
+    int simd_begin = 0;
+    int simd_end = 0;
+    if (hend - hstart == kernel_h) {
+      simd_begin = inside_begin;
+      simd_end = MaxPoolRow(bottom + hstart * width, width, kernel_h,
+          kernel_w, stride_w, inside_begin, inside_end, top_row, mask_row,
+          hstart * width);
+    }
+    for (int pw = 0; pw < pooled_width; ++pw) {
+      if (pw == simd_begin) {
+        pw = simd_end;
+        if (pw == pooled_width) {
+          break;
+        }
+      }
+      int wstart = pw * stride_w;
+      int wend = min(wstart + kernel_w, width);
+      Dtype value = -FLT_MAX;
+      int index = hstart * width + wstart;
+      for (int h = hstart; h < hend; ++h) {
+        for (int w = wstart; w < wend; ++w) {
+          if (value < bottom[h * width + w]) {
+            value = bottom[h * width + w];
+            index = h * width + w;
+          }
+        }
+      }
+      top_row[pw] = value;
+      if (mask_row) {
+        mask_row[pw] = index;
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+CAFFE_CPU_DISPATCH
+void ave_pool_cpu(const Dtype* bottom, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int stride_h,
+    const int stride_w, const int pad_h, const int pad_w,
+    const int pooled_height, const int pooled_width, Dtype* top) {
+  if (pad_h == 0 && pad_w == 0 && IsGlobalWindow(height, width, kernel_h,
+      kernel_w, pooled_height, pooled_width)) {
+    Dtype sum = 0;
+    for (int i = 0; i < height * width; ++i) {
+      sum += bottom[i];
+    }
+    top[0] = sum / (height * width);
+    return;
+  }
+  if (UseSeparablePool(kernel_h, kernel_w)) {
+    AvePoolIntegral(bottom, height, width, kernel_h, kernel_w, stride_h,
+        stride_w, pad_h, pad_w, pooled_height, pooled_width, top);
+    return;
+  }
+  int inside_begin, inside_end;
+  InsideRange(width, kernel_w, stride_w, pad_w, pooled_width, &inside_begin,
+      &inside_end);
+  for (int ph = 0; ph < pooled_height; ++ph) {
+    int hstart = ph * stride_h - pad_h;
+    int hend = min(hstart + kernel_h, height + pad_h);
+    Dtype* top_row = top + ph * pooled_width;
+    int simd_begin = 0;
+    int simd_end = 0;
+    if (hstart >= 0 && hstart + kernel_h <= height) {
+      simd_begin = inside_begin;
+      simd_end = AvePoolRow(bottom + hstart * width, width, kernel_h,
+          kernel_w, stride_w, pad_w, inside_begin, inside_end, top_row);
+    }
+    for (int pw = 0; pw < pooled_width; ++pw) {
+      if (pw == simd_begin) {
+        pw = simd_end;
+        if (pw == pooled_width) {
+          break;
+        }
+      }
+      int wstart = pw * stride_w - pad_w;
+      int wend = min(wstart + kernel_w, width + pad_w);
+      int pool_size = (hend - hstart) * (wend - wstart);
+      wstart = max(wstart, 0);
+      wend = min(wend, width);
+      Dtype value = 0;
+      for (int h = max(hstart, 0); h < min(hend, height); ++h) {
+        for (int w = wstart; w < wend; ++w) {
+          value += bottom[h * width + w];
+        }
+      }
+      top_row[pw] = value / pool_size;
+    }
+  }
+}
+
+template <typename Dtype>
+CAFFE_CPU_DISPATCH
+void max_pool_backward_cpu(const Dtype* bottom, const Dtype* top,
+    const Dtype* top_diff, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int stride_h,
+    const int stride_w, const int pooled_height, const int pooled_width,
+    Dtype* bottom_diff) {
+  int inside_begin, inside_end;
+  InsideRange(width, kernel_w, stride_w, 0, pooled_width, &inside_begin,
+      &inside_end);
+  for (int ph = 0; ph < pooled_height; ++ph) {
+    int hstart = ph * stride_h;
+    int hend = min(hstart + kernel_h, height);
+    const Dtype* top_row = top + ph * pooled_width;
+    const Dtype* top_diff_row = top_diff + ph * pooled_width;
+    // The SIMD path handles the outputs from simd_begin, after those before
+    // it, whose windows may overlap theirs.
+    int simd_begin = pooled_width;
+    if (hend - hstart == kernel_h) {
+      simd_begin = inside_begin;
+    }
+    for (int pw = 0; pw < pooled_width; ++pw) {
+      if (pw == simd_begin) {
+        pw = MaxPoolBackwardRow(bottom + hstart * width, top_row,
+            top_diff_row, width, kernel_h, kernel_w, stride_w, inside_begin,
+            inside_end, bottom_diff + hstart * width);
+        if (pw == pooled_width) {
+          break;
+        }
+      }
+      int wstart = pw * stride_w;
+      int wend = min(wstart + kernel_w, width);
+      for (int h = hstart; h < hend; ++h) {
+        for (int w = wstart; w < wend; ++w) {
+          bottom_diff[h * width + w] += top_diff_row[pw] *
+              (bottom[h * width + w] == top_row[pw]);
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+static inline Dtype RowSum(const Dtype* row, const int size) {
+  Dtype sum = 0;
+  for (int i = 0; i < size; ++i) {
+    sum += row[i];
+  }
+  return sum;
+}
+
+template <typename Dtype>
+CAFFE_CPU_DISPATCH
+void sto_pool_train_cpu(const Dtype* bottom, const int height,
+    const int width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pooled_height,
+    const int pooled_width, const int index_offset, const Dtype* rand,
+    Dtype* top, Dtype* index) {
+  for (int ph = 0; ph < pooled_height; ++ph) {
+    const int hstart = ph * stride_h;
+    const int hend = min(hstart + kernel_h, height);
+    for (int pw = 0; pw < pooled_width; ++pw) {
+      const int wstart = pw * stride_w;
+      const int wend = min(wstart + kernel_w, width);
+      const int pooled_index = ph * pooled_width + pw;
+      // The cumulative sum goes a row at a time, the sums of the rows, of
+      // contiguous elements, being vectorized by the compiler, up to the row
+      // the threshold falls in; only that row is summed element by element.
+      Dtype sum = 0;
+      for (int h = hstart; h < hend; ++h) {
+        sum += RowSum(bottom + h * width + wstart, wend - wstart);
+      }
+      const Dtype threshold = rand[pooled_index] * sum;
+      Dtype cumsum = 0;
+      int h = hstart;
+      for (; h < hend - 1; ++h) {
+        const Dtype row_sum = RowSum(bottom + h * width + wstart,
+            wend - wstart);
+        if (cumsum + row_sum >= threshold) {
+          break;
+        }
+        cumsum += row_sum;
+      }
+      const Dtype* row = bottom + h * width;
+      int w = wstart;
+      // The last element of the row takes the rounding of the sums.
+      while (w < wend - 1 && (cumsum += row[w]) < threshold) {
+        ++w;
+      }
+      top[pooled_index] = row[w];
+      index[pooled_index] = h * width + w + index_offset;
+    }
+  }
+}
+
+template <typename Dtype>
+CAFFE_CPU_DISPATCH
+void sto_pool_test_cpu(const Dtype* bottom, const int height,
+    const int width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pooled_height,
+    const int pooled_width, Dtype* top) {
+  for (int ph = 0; ph < pooled_height; ++ph) {
+    const int hstart = ph * stride_h;
+    const int hend = min(hstart + kernel_h, height);
+    for (int pw = 0; pw < pooled_width; ++pw) {
+      const int wstart = pw * stride_w;
+      const int wend = min(wstart + kernel_w, width);
+      // FLT_MIN avoids dividing by zero, as in the GPU path.
+      Dtype sum = FLT_MIN;
+      Dtype squares = 0;
+      for (int h = hstart; h < hend; ++h) {
+        const Dtype* row = bottom + h * width;
+        for (int w = wstart; w < wend; ++w) {
+          sum += row[w];
+          squares += row[w] * row[w];
+        }
+      }
+      top[ph * pooled_width + pw] = squares / sum;
+    }
+  }
+}
+
+template void max_pool_cpu<float>(const float* bottom, const int height,
+    const int width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pooled_height,
+    const int pooled_width, float* top, float* mask);
+template void max_pool_cpu<double>(const double* bottom, const int height,
+    const int width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pooled_height,
+    const int pooled_width, double* top, double* mask);
+template void ave_pool_cpu<float>(const float* bottom, const int height,
+    const int width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pad_h, const int pad_w,
+    const int pooled_height, const int pooled_width, float* top);
+template void ave_pool_cpu<double>(const double* bottom, const int height,
+    const int width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pad_h, const int pad_w,
+    const int pooled_height, const int pooled_width, double* top);
+template void max_pool_backward_cpu<float>(const float* bottom,
+    const float* top, const float* top_diff, const int height,
+    const int width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pooled_height,
+    const int pooled_width, float* bottom_diff);
+template void max_pool_backward_cpu<double>(const double* bottom,
+    const double* top, const double* top_diff, const int height,
+    const int width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pooled_height,
+    const int pooled_width, double* bottom_diff);
+template void sto_pool_train_cpu<float>(const float* bottom,
+    const int height, const int width, const int kernel_h,
+    const int kernel_w, const int stride_h, const int stride_w,
+    const int pooled_height, const int pooled_width, const int index_offset,
+    const float* rand, float* top, float* index);
+template void sto_pool_train_cpu<double>(const double* bottom,
+    const int height, const int width, const int kernel_h,
+    const int kernel_w, const int stride_h, const int stride_w,
+    const int pooled_height, const int pooled_width, const int index_offset,
+    const double* rand, double* top, double* index);
+template void sto_pool_test_cpu<float>(const float* bottom,
+    const int height, const int width, const int kernel_h,
+    const int kernel_w, const int stride_h, const int stride_w,
+    const int pooled_height, const int pooled_width, float* top);
+template void sto_pool_test_cpu<double>(const double* bottom,
+    const int height, const int width, const int kernel_h,
+    const int kernel_w, const int stride_h, const int stride_w,
+    const int pooled_height, const int pooled_width, double* top);
+
+}  // namespace caffe
@@ -0,0 +1,190 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+
+#include "caffe/common.hpp"
+#include "caffe/util/cpu_threads.hpp"
+#include "caffe/util/quantize.hpp"
+
+namespace caffe {
+
+// The columns of C computed together, each row of A being read once for them
+const int kInt8GemmBlock = 4;
+
+template <typename Dtype>
+Dtype caffe_cpu_amax(const int n, const Dtype* x) {
+  Dtype amax = 0;
+  for (int i = 0; i < n; ++i) {
+    amax = std::max(amax, std::fabs(x[i]));
+  }
+  return amax;
+}
+
+template float caffe_cpu_amax<float>(const int n, const float* x);
+template double caffe_cpu_amax<double>(const int n, const double* x);
+
+template <typename Dtype>
+inline int8_t QuantizeValue(const Dtype x, const Dtype inv_scale) {
+  const Dtype q = x * inv_scale;
+  if (q >= Dtype(127)) {
+    return 127;
+  }
+  if (q <= Dtype(-127)) {
+    return -127;
+  }
+  return static_cast<int8_t>(q < 0 ? q - Dtype(0.5) : q + Dtype(0.5));
+}
+
+template <typename Dtype>
+void caffe_cpu_quantize(const int n, const Dtype* x, const Dtype scale,
+    int8_t* q) {
+  const Dtype inv_scale = scale > 0 ? 1 / scale : 0;
+  for (int i = 0; i < n; ++i) {
+    q[i] = QuantizeValue(x[i], inv_scale);
+  }
+}
+
+template void caffe_cpu_quantize<float>(const int n, const float* x,
+    const float scale, int8_t* q);
+template void caffe_cpu_quantize<double>(const int n, const double* x,
+    const double scale, int8_t* q);
+
+template <typename Dtype>
+void caffe_cpu_quantize_rows(const int rows, const int cols, const Dtype* x,
+    int8_t* q, Dtype* scales) {
+  for (int i = 0; i < rows; ++i) {
+    scales[i] = caffe_cpu_amax(cols, x + i * cols) / 127;
+    caffe_cpu_quantize(cols, x + i * cols, scales[i], q + i * cols);
+  }
+}
+
+template void caffe_cpu_quantize_rows<float>(const int rows, const int cols,
+    const float* x, int8_t* q, float* scales);
+template void caffe_cpu_quantize_rows<double>(const int rows, const int cols,
+    const double* x, int8_t* q, double* scales);
+
+template <typename Dtype>
+void caffe_cpu_quantize_transpose(const int rows, const int cols,
+    const Dtype* x, const Dtype scale, int8_t* q) {
+  const Dtype inv_scale = scale > 0 ? 1 / scale : 0;
+  // Tiles of the rows, so that the rows of q being written stay in cache
+  const int kTile = 64;
+  for (int i0 = 0; i0 < rows; i0 += kTile) {
+    const int i1 = std::min(rows, i0 + kTile);
+    for (int j = 0; j < cols; ++j) {
+      for (int i = i0; i < i1; ++i) {
+        q[j * rows + i] = QuantizeValue(x[i * cols + j], inv_scale);
+      }
+    }
+  }
+}
+
+template void caffe_cpu_quantize_transpose<float>(const int rows,
+    const int cols, const float* x, const float scale, int8_t* q);
+template void caffe_cpu_quantize_transpose<double>(const int rows,
+    const int cols, const double* x, const double scale, int8_t* q);
+
+// Computes the dot products of a with the num rows b[j] over the first k
+// elements that SSE2 computes 16 at a time, and returns that k.
+static int DotS8SIMD(const int K, const int8_t* a, const int8_t* const* b,
+    const int num, int32_t* dots) {
+#ifdef __SSE2__
+  const int k_simd = K / 16 * 16;
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sums[kInt8GemmBlock];
+  for (int j = 0; j < num; ++j) {
+    sums[j] = zero;
+  }
+  for (int k = 0; k < k_simd; k += 16) {
+    // Sign extend to 16 bits, and multiply and add pairs into 32 bits.
+    const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + k));
+    const __m128i va_sign = _mm_cmpgt_epi8(zero, va);
+    const __m128i va_lo = _mm_unpacklo_epi8(va, va_sign);
+    const __m128i va_hi = _mm_unpackhi_epi8(va, va_sign);
+    for (int j = 0; j < num; ++j) {
+      const __m128i vb =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(b[j] + k));
+      const __m128i vb_sign = _mm_cmpgt_epi8(zero, vb);
+      sums[j] = _mm_add_epi32(sums[j], _mm_add_epi32(
+          _mm_madd_epi16(va_lo, _mm_unpacklo_epi8(vb, vb_sign)),
+          _mm_madd_epi16(va_hi, _mm_unpackhi_epi8(vb, vb_sign))));
+    }
+  }
+  for (int j = 0; j < num; ++j) {
+    int32_t lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), sums[j]);
+    dots[j] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+  return k_simd;
+#else
+  for (int j = 0; j < num; ++j) {
+    dots[j] = 0;
+  }
+  return 0;
+#endif
+}
+
+void caffe_cpu_gemm_s8(const int M, const int N, const int K,
+    const int8_t* A, const int8_t* B, int32_t* C) {
+  CHECK_LE(K, kMaxInt8GemmK);
+  // The blocks of columns are split over the threads; each one reads its
+  // rows of B for all the rows of A.
+  const int num_blocks = (N + kInt8GemmBlock - 1) / kInt8GemmBlock;
+  const int num_threads =
+      CpuLayerThreads(static_cast<int>(static_cast<int64_t>(M) * N * K >> 20));
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int block = 0; block < num_blocks; ++block) {
+    const int n0 = block * kInt8GemmBlock;
+    const int num = std::min(kInt8GemmBlock, N - n0);
+    const int8_t* b[kInt8GemmBlock];
+    for (int j = 0; j < num; ++j) {
+      b[j] = B + (n0 + j) * K;
+    }
+    for (int m = 0; m < M; ++m) {
+      const int8_t* a = A + m * K;
+      int32_t dots[kInt8GemmBlock];
+      const int k_simd = DotS8SIMD(K, a, b, num, dots);
+      for (int j = 0; j < num; ++j) {
+        int32_t dot = dots[j];
+        for (int k = k_simd; k < K; ++k) {
+          dot += static_cast<int32_t>(a[k]) * b[j][k];
+        }
+        C[m * N + n0 + j] = dot;
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void caffe_cpu_dequantize(const int M, const int N, const int32_t* C,
+    const Dtype scale, const Dtype* row_scales, const Dtype* col_scales,
+    Dtype* y) {
+  for (int m = 0; m < M; ++m) {
+    const Dtype row_scale = row_scales ? scale * row_scales[m] : scale;
+    if (col_scales) {
+      for (int n = 0; n < N; ++n) {
+        y[m * N + n] = C[m * N + n] * row_scale * col_scales[n];
+      }
+    } else {
+      for (int n = 0; n < N; ++n) {
+        y[m * N + n] = C[m * N + n] * row_scale;
+      }
+    }
+  }
+}
+
+template void caffe_cpu_dequantize<float>(const int M, const int N,
+    const int32_t* C, const float scale, const float* row_scales,
+    const float* col_scales, float* y);
+template void caffe_cpu_dequantize<double>(const int M, const int N,
+    const int32_t* C, const double scale, const double* row_scales,
+    const double* col_scales, double* y);
+
+}  // namespace caffe
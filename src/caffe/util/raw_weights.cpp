@@ -0,0 +1,131 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/util/raw_weights.hpp"
+
+namespace caffe {
+
+static const char kRawWeightsMagic[8] = {'C', 'A', 'F', 'F', 'E', 'W', 'T',
+    'S'};
+static const uint32_t kRawWeightsVersion = 1;
+
+static void WriteUint32(const uint32_t value, std::ofstream* output) {
+  output->write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void WriteRawWeights(const NetParameter& param, const string& filename) {
+  std::ofstream output(filename.c_str(),
+      std::ios::out | std::ios::trunc | std::ios::binary);
+  CHECK(output) << "Cannot write " << filename;
+  uint32_t num_layers = 0;
+  for (int i = 0; i < param.layers_size(); ++i) {
+    num_layers += param.layers(i).blobs_size() > 0;
+  }
+  output.write(kRawWeightsMagic, sizeof(kRawWeightsMagic));
+  WriteUint32(kRawWeightsVersion, &output);
+  WriteUint32(num_layers, &output);
+  const char padding[kRawWeightsAlignment] = {0};
+  for (int i = 0; i < param.layers_size(); ++i) {
+    const LayerParameter& layer_param = param.layers(i);
+    if (layer_param.blobs_size() == 0) {
+      continue;
+    }
+    WriteUint32(layer_param.name().size(), &output);
+    output.write(layer_param.name().data(), layer_param.name().size());
+    WriteUint32(layer_param.blobs_size(), &output);
+    for (int j = 0; j < layer_param.blobs_size(); ++j) {
+      // Through a blob, as the proto may be sparse.
+      Blob<float> blob;
+      blob.FromProto(layer_param.blobs(j));
+      WriteUint32(blob.num(), &output);
+      WriteUint32(blob.channels(), &output);
+      WriteUint32(blob.height(), &output);
+      WriteUint32(blob.width(), &output);
+      const int64_t offset = output.tellp();
+      output.write(padding, (kRawWeightsAlignment -
+          offset % kRawWeightsAlignment) % kRawWeightsAlignment);
+      output.write(reinterpret_cast<const char*>(blob.cpu_data()),
+          blob.count() * sizeof(float));
+    }
+  }
+  CHECK(output) << "Cannot write " << filename;
+}
+
+bool IsRawWeightsFile(const string& filename) {
+  std::ifstream input(filename.c_str(), std::ios::in | std::ios::binary);
+  char magic[sizeof(kRawWeightsMagic)];
+  input.read(magic, sizeof(magic));
+  return input && !memcmp(magic, kRawWeightsMagic, sizeof(magic));
+}
+
+// Reads a number at *offset of map, of size bytes, and moves offset past it.
+static uint32_t ReadUint32(const char* map, const size_t size,
+    size_t* offset) {
+  CHECK_LE(*offset + sizeof(uint32_t), size) << "Truncated raw weights.";
+  uint32_t value;
+  memcpy(&value, map + *offset, sizeof(value));
+  *offset += sizeof(value);
+  return value;
+}
+
+RawWeightsFile::RawWeightsFile(const string& filename) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  CHECK_NE(fd, -1) << "File not found: " << filename;
+  struct stat file_stat;
+  CHECK_EQ(fstat(fd, &file_stat), 0) << "Cannot stat " << filename;
+  size_ = file_stat.st_size;
+  CHECK_GE(size_, sizeof(kRawWeightsMagic) + 2 * sizeof(uint32_t))
+      << filename << " is not a raw weights file.";
+  // Private, so that writing to the weights copies the pages they are on.
+  map_ = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  CHECK(map_ != MAP_FAILED) << "Cannot map " << filename;
+  char* map = static_cast<char*>(map_);
+  CHECK(!memcmp(map, kRawWeightsMagic, sizeof(kRawWeightsMagic)))
+      << filename << " is not a raw weights file.";
+  size_t offset = sizeof(kRawWeightsMagic);
+  CHECK_EQ(ReadUint32(map, size_, &offset), kRawWeightsVersion)
+      << "Unknown raw weights version.";
+  const int num_layers = ReadUint32(map, size_, &offset);
+  layer_names_.resize(num_layers);
+  layer_blobs_.resize(num_layers);
+  for (int i = 0; i < num_layers; ++i) {
+    const uint32_t name_size = ReadUint32(map, size_, &offset);
+    CHECK_LE(offset + name_size, size_) << "Truncated raw weights.";
+    layer_names_[i].assign(map + offset, name_size);
+    offset += name_size;
+    layer_blobs_[i].resize(ReadUint32(map, size_, &offset));
+    for (int j = 0; j < layer_blobs_[i].size(); ++j) {
+      RawBlob& blob = layer_blobs_[i][j];
+      blob.num = ReadUint32(map, size_, &offset);
+      blob.channels = ReadUint32(map, size_, &offset);
+      blob.height = ReadUint32(map, size_, &offset);
+      blob.width = ReadUint32(map, size_, &offset);
+      offset += (kRawWeightsAlignment - offset % kRawWeightsAlignment) %
+          kRawWeightsAlignment;
+      const size_t count = static_cast<size_t>(blob.num) * blob.channels *
+          blob.height * blob.width;
+      CHECK_LE(offset + count * sizeof(float), size_)
+          << "Truncated raw weights.";
+      blob.data = reinterpret_cast<float*>(map + offset);
+      offset += count * sizeof(float);
+    }
+  }
+}
+
+RawWeightsFile::~RawWeightsFile() {
+  munmap(map_, size_);
+}
+
+}  // namespace caffe
@@ -0,0 +1,545 @@
+// Copyright 2014 BVLC and contributors.
+
+#ifdef USE_CURL
+#include <curl/curl.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>  // NOLINT(readability/streams)
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/remote_db.hpp"
+
+namespace caffe {
+
+// The size the shards written grow to before the next one is started, and
+// the number of records between two entries of their index
+const uint64_t kRecordShardSize = 64 << 20;
+const int kRecordIndexInterval = 256;
+// The attempts at fetching a block before giving up
+const int kFetchAttempts = 3;
+
+static bool IsURL(const string& path) {
+  return path.find("://") != string::npos;
+}
+
+RangeFetcher::RangeFetcher() : curl_(NULL) {}
+
+RangeFetcher::~RangeFetcher() {
+#ifdef USE_CURL
+  if (curl_) {
+    curl_easy_cleanup(static_cast<CURL*>(curl_));
+  }
+#endif
+}
+
+bool RangeFetcher::Fetch(const string& url, const uint64_t offset,
+    const size_t size, string* data) {
+  const string file_prefix = "file://";
+  if (url.compare(0, file_prefix.size(), file_prefix) == 0) {
+    return FetchFile(url.substr(file_prefix.size()), offset, size, data);
+  }
+  return IsURL(url) ? FetchURL(url, offset, size, data) :
+      FetchFile(url, offset, size, data);
+}
+
+bool RangeFetcher::FetchFile(const string& path, const uint64_t offset,
+    const size_t size, string* data) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  struct stat file_stat;
+  if (fd < 0 || fstat(fd, &file_stat) != 0) {
+    LOG(ERROR) << "Could not open or find file " << path;
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  data->resize(size ? size : file_stat.st_size - offset);
+  size_t read = 0;
+  while (read < data->size()) {
+    const ssize_t count = pread(fd, &(*data)[read], data->size() - read,
+        offset + read);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      break;
+    }
+    read += count;
+  }
+  close(fd);
+  if (read < data->size()) {
+    LOG(ERROR) << "Could not read " << data->size() << " bytes of " << path
+        << " at " << offset;
+    return false;
+  }
+  return true;
+}
+
+#ifdef USE_CURL
+
+static pthread_once_t curl_once = PTHREAD_ONCE_INIT;
+
+static void InitCurl() {
+  CHECK_EQ(curl_global_init(CURL_GLOBAL_ALL), CURLE_OK);
+}
+
+static size_t AppendToString(char* ptr, size_t size, size_t nmemb,
+    void* data) {
+  static_cast<string*>(data)->append(ptr, size * nmemb);
+  return size * nmemb;
+}
+
+bool RangeFetcher::FetchURL(const string& url, const uint64_t offset,
+    const size_t size, string* data) {
+  if (!curl_) {
+    pthread_once(&curl_once, InitCurl);
+    curl_ = curl_easy_init();
+    CHECK(curl_) << "Cannot create a curl handle.";
+  }
+  CURL* curl = static_cast<CURL*>(curl_);
+  curl_easy_reset(curl);
+  data->clear();
+  std::ostringstream range;
+  if (size) {
+    range << offset << "-" << offset + size - 1;
+    curl_easy_setopt(curl, CURLOPT_RANGE, range.str().c_str());
+  }
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, AppendToString);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, static_cast<void*>(data));
+  const CURLcode status = curl_easy_perform(curl);
+  if (status != CURLE_OK) {
+    LOG(ERROR) << "Could not fetch " << url << ": "
+        << curl_easy_strerror(status);
+    return false;
+  }
+  long response = 0;  // NOLINT(runtime/int)
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response);
+  if (size && response == 200) {
+    // The server ignored the range and sent the whole file.
+    if (data->size() < offset + size) {
+      LOG(ERROR) << url << " is shorter than expected.";
+      return false;
+    }
+    *data = data->substr(offset, size);
+  }
+  if (size && data->size() != size) {
+    LOG(ERROR) << "Got " << data->size() << " bytes of " << url << " at "
+        << offset << " instead of " << size;
+    return false;
+  }
+  return true;
+}
+
+#else  // USE_CURL
+
+bool RangeFetcher::FetchURL(const string& url, const uint64_t offset,
+    const size_t size, string* data) {
+  LOG(ERROR) << "Cannot fetch " << url << ": Caffe is built without "
+      "USE_CURL.";
+  return false;
+}
+
+#endif  // USE_CURL
+
+RemoteDBCursor::RemoteDBCursor(RemoteDB* db)
+    : db_(db), shard_(0), offset_(0), next_offset_(0), valid_(false),
+      block_shard_(-1), block_id_(-1) {
+  SeekToFirst();
+}
+
+void RemoteDBCursor::SeekToLast() {
+  const RecordManifest& manifest = db_->manifest();
+  int shard = manifest.shard_size() - 1;
+  while (shard >= 0 && manifest.shard(shard).num_records() == 0) {
+    --shard;
+  }
+  if (shard < 0) {
+    valid_ = false;
+    return;
+  }
+  // From the last record of the index on
+  const RecordShard& shard_param = manifest.shard(shard);
+  Load(shard, shard_param.index_offset_size() ?
+      shard_param.index_offset(shard_param.index_offset_size() - 1) : 0);
+  while (valid_ && next_offset_ < shard_param.size()) {
+    Load(shard, next_offset_);
+  }
+}
+
+void RemoteDBCursor::SeekToKey(const string& key) {
+  const RecordManifest& manifest = db_->manifest();
+  CHECK(manifest.sorted())
+      << "Cannot seek in a remote database whose keys are not sorted.";
+  // The last shard starting at key or before it
+  int shard = 0;
+  for (int i = 1; i < manifest.shard_size(); ++i) {
+    if (manifest.shard(i).index_key_size() &&
+        manifest.shard(i).index_key(0) <= key) {
+      shard = i;
+    }
+  }
+  // Its last record of the index at key or before it
+  const RecordShard& shard_param = manifest.shard(shard);
+  uint64_t offset = 0;
+  for (int i = 0; i < shard_param.index_key_size() &&
+       shard_param.index_key(i) <= key; ++i) {
+    offset = shard_param.index_offset(i);
+  }
+  Load(shard, offset);
+  while (valid_ && key_ < key) {
+    Next();
+  }
+}
+
+void RemoteDBCursor::Next() {
+  CHECK(valid_);
+  Load(shard_, next_offset_);
+}
+
+void RemoteDBCursor::Load(int shard, uint64_t offset) {
+  const RecordManifest& manifest = db_->manifest();
+  while (shard < manifest.shard_size() &&
+         offset >= manifest.shard(shard).size()) {
+    ++shard;
+    offset = 0;
+  }
+  valid_ = shard < manifest.shard_size();
+  if (!valid_) {
+    return;
+  }
+  shard_ = shard;
+  offset_ = offset;
+  const uint32_t key_size = ReadSize(offset);
+  key_.resize(key_size);
+  Read(offset + 4, key_size, &key_[0]);
+  const uint32_t value_size = ReadSize(offset + 4 + key_size);
+  value_.resize(value_size);
+  Read(offset + 8 + key_size, value_size, &value_[0]);
+  next_offset_ = offset + 8 + key_size + value_size;
+}
+
+uint32_t RemoteDBCursor::ReadSize(const uint64_t offset) {
+  unsigned char bytes[4];
+  Read(offset, 4, reinterpret_cast<char*>(bytes));
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) |
+      (static_cast<uint32_t>(bytes[3]) << 24);
+}
+
+void RemoteDBCursor::Read(uint64_t offset, const size_t size, char* data) {
+  const RecordManifest& manifest = db_->manifest();
+  CHECK_LE(offset + size, manifest.shard(shard_).size())
+      << "Truncated record in shard " << manifest.shard(shard_).path();
+  const size_t block_size = db_->block_size();
+  size_t copied = 0;
+  while (copied < size) {
+    const int64_t block = offset / block_size;
+    if (block_shard_ != shard_ || block_id_ != block) {
+      block_ = db_->GetBlock(shard_, block);
+      block_shard_ = shard_;
+      block_id_ = block;
+      // Ask for the blocks after it, across the shards.
+      int ahead_shard = shard_;
+      int64_t ahead_block = block;
+      for (int i = 0; i < db_->fetch_ahead_blocks(); ++i) {
+        ++ahead_block;
+        while (ahead_shard < manifest.shard_size() && ahead_block *
+               block_size >= manifest.shard(ahead_shard).size()) {
+          ++ahead_shard;
+          ahead_block = 0;
+        }
+        if (ahead_shard >= manifest.shard_size()) {
+          break;
+        }
+        db_->Prefetch(ahead_shard, ahead_block);
+      }
+    }
+    const size_t in_block = offset % block_size;
+    const size_t count = std::min(size - copied, block_->size() - in_block);
+    memcpy(data + copied, block_->data() + in_block, count);
+    copied += count;
+    offset += count;
+  }
+}
+
+void RemoteDBTransaction::Commit() {
+  db_->Append(records_);
+  records_.clear();
+}
+
+RemoteDB::RemoteDB(const DataParameter& param)
+    : param_(param), block_size_(static_cast<size_t>(param.fetch_block_kb())
+      << 10), stamp_(0), stopping_(false), writing_(false) {
+  CHECK_GT(block_size_, 0);
+  CHECK_GT(param_.fetch_threads(), 0);
+  CHECK(!pthread_mutex_init(&mutex_, NULL)) << "Mutex init failed.";
+  CHECK(!pthread_cond_init(&fetched_, NULL)) << "Condition init failed.";
+}
+
+RemoteDB::~RemoteDB() {
+  Close();
+  pthread_cond_destroy(&fetched_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void RemoteDB::Open(const string& source, Mode mode) {
+  source_ = source;
+  manifest_.Clear();
+  if (mode != READ) {
+    CHECK(!IsURL(source)) << "Remote databases are written locally.";
+    struct stat file_stat;
+    CHECK_NE(stat(source.c_str(), &file_stat), 0) << "Cannot add to the "
+        "remote database " << source << ": write a new one.";
+    LOG(INFO) << "Writing remote database " << source;
+    writing_ = true;
+    last_key_.clear();
+    WriteManifest();
+    return;
+  }
+  RangeFetcher fetcher;
+  string manifest;
+  CHECK(fetcher.Fetch(source, 0, 0, &manifest))
+      << "Cannot read the manifest " << source;
+  CHECK(manifest_.ParseFromString(manifest))
+      << "Cannot parse the manifest " << source;
+  // The shards are listed relative to the manifest.
+  const size_t slash = source.rfind('/');
+  const string dir = slash == string::npos ? "" : source.substr(0, slash + 1);
+  shard_urls_.clear();
+  uint64_t num_records = 0;
+  uint64_t size = 0;
+  for (int i = 0; i < manifest_.shard_size(); ++i) {
+    const string& path = manifest_.shard(i).path();
+    shard_urls_.push_back(IsURL(path) || path[0] == '/' ? path : dir + path);
+    num_records += manifest_.shard(i).num_records();
+    size += manifest_.shard(i).size();
+  }
+  LOG(INFO) << "Opening remote database " << source << ": "
+      << manifest_.shard_size() << " shards, " << num_records
+      << " records, " << size << " bytes.";
+  if (!param_.cache_dir().empty()) {
+    cache_.reset(new DiskBlockCache(param_.cache_dir(),
+        static_cast<size_t>(param_.cache_size_mb()) << 20));
+  }
+  stopping_ = false;
+  threads_.resize(param_.fetch_threads());
+  for (int i = 0; i < threads_.size(); ++i) {
+    CHECK(!pthread_create(&threads_[i], NULL, FetchThread,
+          static_cast<void*>(this))) << "Pthread execution failed.";
+  }
+}
+
+void RemoteDB::Close() {
+  if (writing_) {
+    shard_file_.reset();
+    WriteManifest();
+    writing_ = false;
+  }
+  if (!threads_.empty()) {
+    pthread_mutex_lock(&mutex_);
+    stopping_ = true;
+    pthread_mutex_unlock(&mutex_);
+    for (int i = 0; i < threads_.size(); ++i) {
+      queue_.push(BlockId(-1, 0));
+    }
+    for (int i = 0; i < threads_.size(); ++i) {
+      CHECK(!pthread_join(threads_[i], NULL)) << "Pthread joining failed.";
+    }
+    threads_.clear();
+  }
+  fetches_.clear();
+  cache_.reset();
+}
+
+DBCursor* RemoteDB::NewCursor() {
+  CHECK(!writing_) << "Cannot read a remote database being written.";
+  return new RemoteDBCursor(this);
+}
+
+DBTransaction* RemoteDB::NewTransaction() {
+  CHECK(writing_) << "Remote databases are read only.";
+  return new RemoteDBTransaction(this);
+}
+
+shared_ptr<const string> RemoteDB::GetBlock(const int shard,
+    const int64_t block) {
+  const BlockId id(shard, block);
+  pthread_mutex_lock(&mutex_);
+  std::map<BlockId, shared_ptr<Fetch> >::iterator it = fetches_.find(id);
+  const shared_ptr<Fetch> fetch =
+      it != fetches_.end() ? it->second : StartFetch(id);
+  while (!fetch->done) {
+    pthread_cond_wait(&fetched_, &mutex_);
+  }
+  // The cursors read the blocks once, in order.
+  it = fetches_.find(id);
+  if (it != fetches_.end() && it->second == fetch) {
+    fetches_.erase(it);
+  }
+  pthread_mutex_unlock(&mutex_);
+  CHECK(fetch->ok) << "Cannot fetch block " << block << " of "
+      << shard_urls_[shard];
+  return fetch->data;
+}
+
+void RemoteDB::Prefetch(const int shard, const int64_t block) {
+  const BlockId id(shard, block);
+  pthread_mutex_lock(&mutex_);
+  if (!fetches_.count(id)) {
+    StartFetch(id);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+shared_ptr<RemoteDB::Fetch> RemoteDB::StartFetch(const BlockId& id) {
+  // Blocks fetched ahead for a cursor that moved elsewhere
+  const int max_fetches = 4 * (param_.fetch_ahead_blocks() + 1);
+  while (fetches_.size() >= max_fetches) {
+    std::map<BlockId, shared_ptr<Fetch> >::iterator oldest = fetches_.end();
+    for (std::map<BlockId, shared_ptr<Fetch> >::iterator it =
+         fetches_.begin(); it != fetches_.end(); ++it) {
+      if (it->second->done && (oldest == fetches_.end() ||
+          it->second->stamp < oldest->second->stamp)) {
+        oldest = it;
+      }
+    }
+    if (oldest == fetches_.end()) {
+      break;
+    }
+    fetches_.erase(oldest);
+  }
+  shared_ptr<Fetch> fetch(new Fetch());
+  fetch->data.reset(new string());
+  fetch->done = false;
+  fetch->ok = false;
+  fetch->stamp = stamp_++;
+  fetches_[id] = fetch;
+  queue_.push(id);
+  return fetch;
+}
+
+void* RemoteDB::FetchThread(void* db_pointer) {
+  RemoteDB* db = static_cast<RemoteDB*>(db_pointer);
+  RangeFetcher fetcher;
+  while (true) {
+    const BlockId id = db->queue_.pop();
+    if (id.first < 0) {
+      break;
+    }
+    pthread_mutex_lock(&db->mutex_);
+    const bool stopping = db->stopping_;
+    pthread_mutex_unlock(&db->mutex_);
+    string data;
+    const bool ok = !stopping && db->FetchBlock(&fetcher, id, &data);
+    pthread_mutex_lock(&db->mutex_);
+    std::map<BlockId, shared_ptr<Fetch> >::iterator it =
+        db->fetches_.find(id);
+    if (it != db->fetches_.end() && !it->second->done) {
+      it->second->data->swap(data);
+      it->second->ok = ok;
+      it->second->done = true;
+    }
+    pthread_mutex_unlock(&db->mutex_);
+    pthread_cond_broadcast(&db->fetched_);
+  }
+  return static_cast<void*>(NULL);
+}
+
+bool RemoteDB::FetchBlock(RangeFetcher* fetcher, const BlockId& id,
+    string* data) {
+  const string& url = shard_urls_[id.first];
+  std::ostringstream key;
+  key << url << "#" << block_size_ << ":" << id.second;
+  if (cache_ && cache_->Get(key.str(), data)) {
+    return true;
+  }
+  const uint64_t offset = id.second * block_size_;
+  const size_t size = std::min(static_cast<uint64_t>(block_size_),
+      manifest_.shard(id.first).size() - offset);
+  for (int attempt = 1; attempt <= kFetchAttempts; ++attempt) {
+    if (fetcher->Fetch(url, offset, size, data)) {
+      if (cache_) {
+        cache_->Put(key.str(), *data);
+      }
+      return true;
+    }
+    if (attempt < kFetchAttempts) {
+      sleep(attempt);
+    }
+  }
+  return false;
+}
+
+static void AppendSize(const uint32_t size, std::ofstream* file) {
+  const char bytes[4] = { static_cast<char>(size & 0xFF),
+      static_cast<char>((size >> 8) & 0xFF),
+      static_cast<char>((size >> 16) & 0xFF),
+      static_cast<char>((size >> 24) & 0xFF) };
+  file->write(bytes, 4);
+}
+
+void RemoteDB::Append(
+    const std::vector<std::pair<string, string> >& records) {
+  for (int i = 0; i < records.size(); ++i) {
+    const string& key = records[i].first;
+    const string& value = records[i].second;
+    if (!shard_file_ || manifest_.shard(manifest_.shard_size() - 1).size() >=
+        kRecordShardSize) {
+      // The next shard, next to the manifest
+      char suffix[16];
+      snprintf(suffix, sizeof(suffix), "-%05d", manifest_.shard_size());
+      const string path = source_ + suffix;
+      shard_file_.reset(new std::ofstream(path.c_str(),
+          std::ios::out | std::ios::binary | std::ios::trunc));
+      CHECK(*shard_file_) << "Cannot write " << path;
+      const size_t slash = path.rfind('/');
+      manifest_.add_shard()->set_path(
+          slash == string::npos ? path : path.substr(slash + 1));
+    }
+    if (manifest_.sorted() && key < last_key_) {
+      manifest_.set_sorted(false);
+    }
+    last_key_ = key;
+    RecordShard* shard = manifest_.mutable_shard(manifest_.shard_size() - 1);
+    if (shard->num_records() % kRecordIndexInterval == 0) {
+      shard->add_index_key(key);
+      shard->add_index_offset(shard->size());
+    }
+    AppendSize(key.size(), shard_file_.get());
+    shard_file_->write(key.data(), key.size());
+    AppendSize(value.size(), shard_file_.get());
+    shard_file_->write(value.data(), value.size());
+    shard->set_size(shard->size() + 8 + key.size() + value.size());
+    shard->set_num_records(shard->num_records() + 1);
+  }
+  if (shard_file_) {
+    shard_file_->flush();
+    CHECK(*shard_file_) << "Cannot write the shards of " << source_;
+  }
+  // The records committed so far can be read.
+  WriteManifest();
+}
+
+void RemoteDB::WriteManifest() {
+  WriteProtoToBinaryFile(manifest_, source_);
+}
+
+}  // namespace caffe
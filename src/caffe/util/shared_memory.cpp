@@ -0,0 +1,58 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include "caffe/common.hpp"
+#include "caffe/util/shared_memory.hpp"
+
+namespace caffe {
+
+SharedMemorySegment::SharedMemorySegment(const string& name,
+    const Mode mode, const size_t size)
+    : name_(name), mode_(mode), data_(NULL), size_(size) {
+  CHECK(!name.empty() && name[0] == '/')
+      << "The name of a shared memory segment starts with /: " << name;
+  const int fd = mode == CREATE ?
+      shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600) :
+      shm_open(name.c_str(), O_RDWR, 0);
+  CHECK_GE(fd, 0) << "Failed to open the shared memory segment " << name
+      << ": " << strerror(errno);
+  if (mode == CREATE) {
+    CHECK_GT(size, 0);
+    // ftruncate fills the segment with 0.
+    if (ftruncate(fd, size) != 0) {
+      const int error = errno;
+      close(fd);
+      shm_unlink(name.c_str());
+      LOG(FATAL) << "Failed to size the shared memory segment " << name
+          << ": " << strerror(error);
+    }
+  } else {
+    struct stat info;
+    CHECK_EQ(fstat(fd, &info), 0) << "Failed to stat " << name;
+    size_ = info.st_size;
+    CHECK_GT(size_, 0) << "The shared memory segment " << name
+        << " is empty";
+  }
+  data_ = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  // The mapping keeps the segment open.
+  close(fd);
+  CHECK(data_ != MAP_FAILED) << "Failed to map the shared memory segment "
+      << name << ": " << strerror(errno);
+}
+
+SharedMemorySegment::~SharedMemorySegment() {
+  CHECK_EQ(munmap(data_, size_), 0) << "Failed to unmap " << name_;
+  if (mode_ == CREATE) {
+    shm_unlink(name_.c_str());
+  }
+}
+
+}  // namespace caffe
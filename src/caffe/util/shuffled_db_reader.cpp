@@ -0,0 +1,114 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "caffe/util/rng.hpp"
+#include "caffe/util/shuffled_db_reader.hpp"
+
+namespace caffe {
+
+ShuffledDBReader::ShuffledDBReader(DB* db, const int block_size,
+    const int readahead, const int num_shards, const int shard_id,
+    const unsigned int seed)
+    : db_(db), block_size_(block_size), rng_(new Caffe::RNG(seed)),
+      current_(-1), position_(0) {
+  CHECK(db_);
+  CHECK_GT(block_size_, 0);
+  CHECK_GT(readahead, 0);
+  CHECK_GT(num_shards, 0);
+  CHECK_LT(shard_id, num_shards);
+  // Split the keys of the shard into blocks.
+  {
+    shared_ptr<DBCursor> cursor(db_->NewCursor());
+    int index = 0;
+    for (cursor->SeekToFirst(); cursor->valid(); cursor->Next(), ++index) {
+      if (index % block_size_ == 0 &&
+          (index / block_size_) % num_shards == shard_id) {
+        block_keys_.push_back(cursor->key());
+      }
+    }
+  }
+  CHECK(!block_keys_.empty()) << "No blocks of " << block_size_
+      << " records in the shard";
+  LOG(INFO) << "Reading " << block_keys_.size() << " blocks of "
+      << block_size_ << " records in a random order.";
+  blocks_.resize(readahead + 1);
+  for (int i = 0; i < blocks_.size(); ++i) {
+    free_.push(i);
+  }
+  CHECK(!pthread_create(&thread_, NULL, ReadAheadThread,
+        static_cast<void*>(this))) << "Pthread execution failed.";
+}
+
+ShuffledDBReader::~ShuffledDBReader() {
+  // Drop the blocks still waiting to be read so that the readahead thread
+  // exits as soon as it has finished the block in hand.
+  int block_id;
+  while (free_.try_pop(&block_id)) {}
+  free_.push(-1);
+  CHECK(!pthread_join(thread_, NULL)) << "Pthread joining failed.";
+}
+
+unsigned int ShuffledDBReader::Rand() {
+  return (*static_cast<caffe::rng_t*>(rng_->generator()))();
+}
+
+void* ShuffledDBReader::ReadAheadThread(void* reader_pointer) {
+  CHECK(reader_pointer);
+  ShuffledDBReader* reader = static_cast<ShuffledDBReader*>(reader_pointer);
+  shared_ptr<DBCursor> cursor(reader->db_->NewCursor());
+  const int num_blocks = reader->block_keys_.size();
+  vector<int> order(num_blocks);
+  for (int i = 0; i < num_blocks; ++i) {
+    order[i] = i;
+  }
+  // Keep filling blocks, a pass in a new order after the other, until asked
+  // to exit.
+  while (true) {
+    for (int i = num_blocks - 1; i > 0; --i) {
+      std::swap(order[i], order[reader->Rand() % (i + 1)]);
+    }
+    for (int i = 0; i < num_blocks; ++i) {
+      const int block_id = reader->free_.pop();
+      if (block_id < 0) {
+        return static_cast<void*>(NULL);
+      }
+      reader->ReadBlock(order[i], cursor.get(), &reader->blocks_[block_id]);
+      reader->full_.push(block_id);
+    }
+  }
+}
+
+void ShuffledDBReader::ReadBlock(const int block, DBCursor* cursor,
+    vector<string>* values) {
+  // The strings of the previous use of the buffer are reused.
+  values->resize(block_size_);
+  int size = 0;
+  for (cursor->SeekToKey(block_keys_[block]);
+       cursor->valid() && size < block_size_; cursor->Next(), ++size) {
+    (*values)[size].assign(cursor->value_data(), cursor->value_size());
+  }
+  CHECK_GT(size, 0) << "The DB changed while being read";
+  values->resize(size);
+  for (int i = size - 1; i > 0; --i) {
+    std::swap((*values)[i], (*values)[Rand() % (i + 1)]);
+  }
+}
+
+const string& ShuffledDBReader::Next() {
+  if (current_ >= 0 && position_ == blocks_[current_].size()) {
+    free_.push(current_);
+    current_ = -1;
+  }
+  if (current_ < 0) {
+    current_ = full_.pop();
+    position_ = 0;
+  }
+  return blocks_[current_][position_++];
+}
+
+}  // namespace caffe
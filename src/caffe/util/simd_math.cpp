@@ -0,0 +1,261 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "caffe/util/cpu_dispatch.hpp"
+#include "caffe/util/simd_math.hpp"
+
+namespace caffe {
+
+#ifdef __SSE2__
+
+// The inputs of exp4 whose results are normal numbers
+static const float kExpLow = -87.f;
+static const float kExpHigh = 88.f;
+
+// exp of the 4 elements of x, all in [kExpLow, kExpHigh]: x = n log(2) + r,
+// |r| <= log(2) / 2, exp(x) = 2^n exp(r) with exp(r) a polynomial of r.
+static inline __m128 exp4(const __m128 x) {
+  const __m128i n = _mm_cvtps_epi32(
+      _mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)));
+  const __m128 fn = _mm_cvtepi32_ps(n);
+  // log(2) in two parts, the first exact in a float times n
+  __m128 r = _mm_sub_ps(x, _mm_mul_ps(fn, _mm_set1_ps(0.693359375f)));
+  r = _mm_add_ps(r, _mm_mul_ps(fn, _mm_set1_ps(2.12194440e-4f)));
+  __m128 y = _mm_set1_ps(1.9875691500e-4f);
+  y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(1.3981999507e-3f));
+  y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(8.3334519073e-3f));
+  y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(4.1665795894e-2f));
+  y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(1.6666665459e-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(5.0000001201e-1f));
+  y = _mm_mul_ps(y, _mm_mul_ps(r, r));
+  y = _mm_add_ps(_mm_add_ps(y, r), _mm_set1_ps(1.f));
+  const __m128 pow2n = _mm_castsi128_ps(
+      _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23));
+  return _mm_mul_ps(y, pow2n);
+}
+
+// Whether the 4 elements of x are all in [low, high], false for NaNs
+static inline bool InRange(const __m128 x, const float low,
+    const float high) {
+  const __m128 in = _mm_and_ps(_mm_cmpge_ps(x, _mm_set1_ps(low)),
+      _mm_cmple_ps(x, _mm_set1_ps(high)));
+  return _mm_movemask_ps(in) == 0xF;
+}
+
+// The smallest and largest positive normal floats
+static const float kMinNormal = 1.17549435e-38f;
+static const float kMaxNormal = 3.40282347e+38f;
+
+// log of the 4 elements of x, all positive normal numbers: x = 2^e m,
+// sqrt(1/2) <= m < sqrt(2), log(x) = e log(2) + log(m) with log(m) a
+// polynomial of m - 1.
+static inline __m128 log4(__m128 x) {
+  const __m128 one = _mm_set1_ps(1.f);
+  const __m128i e = _mm_sub_epi32(
+      _mm_srli_epi32(_mm_castps_si128(x), 23), _mm_set1_epi32(126));
+  __m128 fe = _mm_cvtepi32_ps(e);
+  // The mantissa in [0.5, 1)
+  x = _mm_or_ps(_mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x807FFFFF))),
+      _mm_set1_ps(0.5f));
+  const __m128 small = _mm_cmplt_ps(x, _mm_set1_ps(0.707106781186547524f));
+  fe = _mm_sub_ps(fe, _mm_and_ps(one, small));
+  x = _mm_add_ps(_mm_sub_ps(x, one), _mm_and_ps(x, small));
+  const __m128 z = _mm_mul_ps(x, x);
+  __m128 y = _mm_set1_ps(7.0376836292e-2f);
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.1514610310e-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.1676998740e-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.2420140846e-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.4249322787e-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.6668057665e-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(2.0000714765e-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-2.4999993993e-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(3.3333331174e-1f));
+  y = _mm_mul_ps(_mm_mul_ps(y, x), z);
+  y = _mm_add_ps(y, _mm_mul_ps(fe, _mm_set1_ps(-2.12194440e-4f)));
+  y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+  x = _mm_add_ps(x, y);
+  return _mm_add_ps(x, _mm_mul_ps(fe, _mm_set1_ps(0.693359375f)));
+}
+
+// tanh of the 4 elements of x, none a NaN: an odd polynomial below 0.625,
+// 1 - 2 / (exp(2 x) + 1) above, for |x| at most 9, over which it is 1.
+static inline __m128 tanh4(const __m128 x) {
+  const __m128 sign_mask = _mm_set1_ps(-0.f);
+  const __m128 sign = _mm_and_ps(x, sign_mask);
+  const __m128 abs_x = _mm_min_ps(_mm_andnot_ps(sign_mask, x),
+      _mm_set1_ps(9.f));
+  const __m128 z = _mm_mul_ps(abs_x, abs_x);
+  __m128 small = _mm_set1_ps(-5.70498872745e-3f);
+  small = _mm_add_ps(_mm_mul_ps(small, z), _mm_set1_ps(2.06390887954e-2f));
+  small = _mm_add_ps(_mm_mul_ps(small, z), _mm_set1_ps(-5.37397155531e-2f));
+  small = _mm_add_ps(_mm_mul_ps(small, z), _mm_set1_ps(1.33314422036e-1f));
+  small = _mm_add_ps(_mm_mul_ps(small, z), _mm_set1_ps(-3.33332819422e-1f));
+  small = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(small, z), abs_x), abs_x);
+  const __m128 one = _mm_set1_ps(1.f);
+  const __m128 exp2x = exp4(_mm_add_ps(abs_x, abs_x));
+  const __m128 large = _mm_sub_ps(one,
+      _mm_div_ps(_mm_set1_ps(2.f), _mm_add_ps(exp2x, one)));
+  const __m128 is_small = _mm_cmplt_ps(abs_x, _mm_set1_ps(0.625f));
+  const __m128 y = _mm_or_ps(_mm_and_ps(is_small, small),
+      _mm_andnot_ps(is_small, large));
+  return _mm_or_ps(y, sign);
+}
+
+#endif  // __SSE2__
+
+static inline float sigmoid(const float x) {
+  return 1.f / (1.f + std::exp(-x));
+}
+
+CAFFE_CPU_DISPATCH
+void simd_exp(const int n, const float* a, float* y) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 4 <= n; i += 4) {
+    const __m128 x = _mm_loadu_ps(a + i);
+    if (InRange(x, kExpLow, kExpHigh)) {
+      _mm_storeu_ps(y + i, exp4(x));
+    } else {
+      for (int j = i; j < i + 4; ++j) {
+        y[j] = std::exp(a[j]);
+      }
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    y[i] = std::exp(a[i]);
+  }
+}
+
+CAFFE_CPU_DISPATCH
+void simd_log(const int n, const float* a, float* y) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 4 <= n; i += 4) {
+    const __m128 x = _mm_loadu_ps(a + i);
+    if (InRange(x, kMinNormal, kMaxNormal)) {
+      _mm_storeu_ps(y + i, log4(x));
+    } else {
+      for (int j = i; j < i + 4; ++j) {
+        y[j] = std::log(a[j]);
+      }
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    y[i] = std::log(a[i]);
+  }
+}
+
+CAFFE_CPU_DISPATCH
+void simd_powx(const int n, const float* a, const float b, float* y) {
+  if (b == 1) {
+    for (int i = 0; i < n; ++i) {
+      y[i] = a[i];
+    }
+    return;
+  }
+  if (b == 2) {
+    for (int i = 0; i < n; ++i) {
+      y[i] = a[i] * a[i];
+    }
+    return;
+  }
+  int i = 0;
+#ifdef __SSE2__
+  // a^b = exp(b log(a)) for positive a
+  for (; i + 4 <= n; i += 4) {
+    const __m128 x = _mm_loadu_ps(a + i);
+    if (InRange(x, kMinNormal, kMaxNormal)) {
+      const __m128 t = _mm_mul_ps(log4(x), _mm_set1_ps(b));
+      if (InRange(t, kExpLow, kExpHigh)) {
+        _mm_storeu_ps(y + i, exp4(t));
+        continue;
+      }
+    }
+    for (int j = i; j < i + 4; ++j) {
+      y[j] = std::pow(a[j], b);
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    y[i] = std::pow(a[i], b);
+  }
+}
+
+CAFFE_CPU_DISPATCH
+void simd_tanh(const int n, const float* a, float* y) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 4 <= n; i += 4) {
+    const __m128 x = _mm_loadu_ps(a + i);
+    if (_mm_movemask_ps(_mm_cmpord_ps(x, x)) == 0xF) {
+      _mm_storeu_ps(y + i, tanh4(x));
+    } else {
+      for (int j = i; j < i + 4; ++j) {
+        y[j] = std::tanh(a[j]);
+      }
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    y[i] = std::tanh(a[i]);
+  }
+}
+
+CAFFE_CPU_DISPATCH
+void simd_sigmoid(const int n, const float* a, float* y) {
+  int i = 0;
+#ifdef __SSE2__
+  const __m128 one = _mm_set1_ps(1.f);
+  for (; i + 4 <= n; i += 4) {
+    const __m128 minus_x = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(a + i));
+    if (InRange(minus_x, kExpLow, kExpHigh)) {
+      _mm_storeu_ps(y + i,
+          _mm_div_ps(one, _mm_add_ps(one, exp4(minus_x))));
+    } else {
+      for (int j = i; j < i + 4; ++j) {
+        y[j] = sigmoid(a[j]);
+      }
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    y[i] = sigmoid(a[i]);
+  }
+}
+
+CAFFE_CPU_DISPATCH
+void simd_add(const int n, const float* a, const float* b, float* y) {
+  for (int i = 0; i < n; ++i) {
+    y[i] = a[i] + b[i];
+  }
+}
+
+CAFFE_CPU_DISPATCH
+void simd_sub(const int n, const float* a, const float* b, float* y) {
+  for (int i = 0; i < n; ++i) {
+    y[i] = a[i] - b[i];
+  }
+}
+
+CAFFE_CPU_DISPATCH
+void simd_mul(const int n, const float* a, const float* b, float* y) {
+  for (int i = 0; i < n; ++i) {
+    y[i] = a[i] * b[i];
+  }
+}
+
+CAFFE_CPU_DISPATCH
+void simd_div(const int n, const float* a, const float* b, float* y) {
+  for (int i = 0; i < n; ++i) {
+    y[i] = a[i] / b[i];
+  }
+}
+
+}  // namespace caffe
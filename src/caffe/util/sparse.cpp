@@ -0,0 +1,159 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/cpu_threads.hpp"
+#include "caffe/util/sparse.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void caffe_cpu_dense_to_csr(const int rows, const int cols, const Dtype* x,
+    const Dtype threshold, std::vector<Dtype>* values,
+    std::vector<int>* row_start, std::vector<int>* columns) {
+  values->clear();
+  columns->clear();
+  row_start->resize(rows + 1);
+  for (int i = 0; i < rows; ++i) {
+    (*row_start)[i] = values->size();
+    for (int j = 0; j < cols; ++j) {
+      if (std::fabs(x[i * cols + j]) > threshold) {
+        values->push_back(x[i * cols + j]);
+        columns->push_back(j);
+      }
+    }
+  }
+  (*row_start)[rows] = values->size();
+}
+
+template void caffe_cpu_dense_to_csr<float>(const int rows, const int cols,
+    const float* x, const float threshold, std::vector<float>* values,
+    std::vector<int>* row_start, std::vector<int>* columns);
+template void caffe_cpu_dense_to_csr<double>(const int rows, const int cols,
+    const double* x, const double threshold, std::vector<double>* values,
+    std::vector<int>* row_start, std::vector<int>* columns);
+
+// y = x^T for x, rows x cols, in tiles of the rows, so that the rows of y
+// being written stay in cache.
+template <typename Dtype>
+static void Transpose(const int rows, const int cols, const Dtype* x,
+    Dtype* y) {
+  const int kTile = 64;
+  for (int i0 = 0; i0 < rows; i0 += kTile) {
+    const int i1 = std::min(rows, i0 + kTile);
+    for (int j = 0; j < cols; ++j) {
+      for (int i = i0; i < i1; ++i) {
+        y[j * rows + i] = x[i * cols + j];
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void caffe_cpu_gemm_csr(const int M, const int N, const int K,
+    const Dtype* values, const int* row_start, const int* columns,
+    const Dtype* B, Dtype* C, Dtype* buffer) {
+  const int nnz = row_start[N];
+  const int num_threads = CpuLayerThreads(
+      static_cast<int>(static_cast<int64_t>(M) * nnz >> 20));
+  if (M == 1) {
+    // A sparse matrix vector product
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+    for (int n = 0; n < N; ++n) {
+      Dtype dot = 0;
+      for (int j = row_start[n]; j < row_start[n + 1]; ++j) {
+        dot += values[j] * B[columns[j]];
+      }
+      C[n] = dot;
+    }
+    return;
+  }
+  // Each value of A scales a row of B^T into a row of C^T, both contiguous
+  // over the M rows of B.
+  Dtype* B_t = buffer;
+  Dtype* C_t = buffer + K * M;
+  Transpose(M, K, B, B_t);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1)
+#endif
+  for (int n = 0; n < N; ++n) {
+    Dtype* c = C_t + n * M;
+    std::fill(c, c + M, Dtype(0));
+    for (int j = row_start[n]; j < row_start[n + 1]; ++j) {
+      const Dtype value = values[j];
+      const Dtype* b = B_t + columns[j] * M;
+      for (int m = 0; m < M; ++m) {
+        c[m] += value * b[m];
+      }
+    }
+  }
+  Transpose(N, M, C_t, C);
+}
+
+template void caffe_cpu_gemm_csr<float>(const int M, const int N,
+    const int K, const float* values, const int* row_start,
+    const int* columns, const float* B, float* C, float* buffer);
+template void caffe_cpu_gemm_csr<double>(const int M, const int N,
+    const int K, const double* values, const int* row_start,
+    const int* columns, const double* B, double* C, double* buffer);
+
+// cusparse is column major: A, N x K, times the column major K x M matrix
+// that is the row major B gives the column major N x M matrix that is the
+// row major C.
+template <>
+void caffe_gpu_gemm_csr<float>(const int M, const int N, const int K,
+    const int nnz, const float* values, const int* row_start,
+    const int* columns, const float* B, float* C) {
+  const float alpha = 1, beta = 0;
+  CUSPARSE_CHECK(cusparseScsrmm(Caffe::cusparse_handle(),
+      CUSPARSE_OPERATION_NON_TRANSPOSE, N, M, K, nnz, &alpha,
+      Caffe::cusparse_matrix_descr(), values, row_start, columns, B, K, &beta,
+      C, N));
+}
+
+template <>
+void caffe_gpu_gemm_csr<double>(const int M, const int N, const int K,
+    const int nnz, const double* values, const int* row_start,
+    const int* columns, const double* B, double* C) {
+  const double alpha = 1, beta = 0;
+  CUSPARSE_CHECK(cusparseDcsrmm(Caffe::cusparse_handle(),
+      CUSPARSE_OPERATION_NON_TRANSPOSE, N, M, K, nnz, &alpha,
+      Caffe::cusparse_matrix_descr(), values, row_start, columns, B, K, &beta,
+      C, N));
+}
+
+bool SparsifyBlobProto(const float threshold, const float max_density,
+    BlobProto* proto) {
+  CHECK_EQ(proto->sparse_row_start_size(), 0) << "The blob is already sparse.";
+  CHECK_EQ(proto->encoding(), BlobProto::REPEATED)
+      << "Only blobs of repeated values are sparsified.";
+  const int count = proto->data_size();
+  const int cols = proto->width();
+  if (count == 0 || cols == 0) {
+    return false;
+  }
+  CHECK_EQ(count % cols, 0);
+  std::vector<float> values;
+  std::vector<int> row_start, columns;
+  caffe_cpu_dense_to_csr(count / cols, cols, proto->data().data(), threshold,
+      &values, &row_start, &columns);
+  if (values.size() > max_density * count) {
+    return false;
+  }
+  proto->clear_data();
+  for (int i = 0; i < values.size(); ++i) {
+    proto->add_data(values[i]);
+    proto->add_sparse_column(columns[i]);
+  }
+  for (int i = 0; i < row_start.size(); ++i) {
+    proto->add_sparse_row_start(row_start[i]);
+  }
+  return true;
+}
+
+}  // namespace caffe
@@ -0,0 +1,186 @@
+// Copyright 2014 BVLC and contributors.
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
+#include <vector>
+
+#include "caffe/util/window_list.hpp"
+
+namespace caffe {
+
+static const char kWindowCacheMagic[8] = {'C', 'A', 'F', 'F', 'E', 'W', 'I',
+    'N'};
+static const uint32_t kWindowCacheVersion = 1;
+
+struct WindowCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_images;
+  uint64_t num_windows;
+  uint64_t names_size;
+  int64_t source_size;
+  int64_t source_mtime;
+};
+
+template <typename T>
+static const T* StorageData(const vector<T>& storage) {
+  return storage.empty() ? NULL : &storage[0];
+}
+
+static void WriteBytes(const void* data, const size_t size,
+    std::ofstream* output) {
+  if (size) {
+    output->write(static_cast<const char*>(data), size);
+  }
+}
+
+WindowList::WindowList()
+    : num_images_(0), num_windows_(0), image_offsets_(NULL),
+      image_sizes_(NULL), names_(NULL), windows_(NULL), map_(NULL),
+      map_size_(0) {}
+
+WindowList::~WindowList() {
+  if (map_) {
+    munmap(map_, map_size_);
+  }
+}
+
+void WindowList::Read(const string& window_file, const string& cache_file) {
+  CHECK(!num_images_ && !map_) << "The window list was already read.";
+  if (cache_file.empty()) {
+    ReadText(window_file);
+    return;
+  }
+  struct stat source_stat;
+  CHECK_EQ(stat(window_file.c_str(), &source_stat), 0)
+      << "Failed to open window file " << window_file;
+  if (MapCache(cache_file, source_stat.st_size, source_stat.st_mtime)) {
+    LOG(INFO) << "Read " << num_windows_ << " windows from " << cache_file;
+    return;
+  }
+  ReadText(window_file);
+  WriteCache(cache_file, source_stat.st_size, source_stat.st_mtime);
+}
+
+void WindowList::ReadText(const string& window_file) {
+  std::ifstream infile(window_file.c_str());
+  CHECK(infile.good()) << "Failed to open window file " << window_file;
+  string hashtag;
+  int image_index;
+  string image_path;
+  while (infile >> hashtag >> image_index) {
+    CHECK_EQ(hashtag, "#");
+    infile >> image_path;
+    image_offset_storage_.push_back(name_storage_.size());
+    name_storage_.insert(name_storage_.end(), image_path.begin(),
+        image_path.end());
+    name_storage_.push_back('\0');
+    for (int i = 0; i < 3; ++i) {
+      int size;
+      infile >> size;
+      image_size_storage_.push_back(size);
+    }
+    int num_windows;
+    infile >> num_windows;
+    Window window;
+    window.image_index = image_offset_storage_.size() - 1;
+    for (int i = 0; i < num_windows; ++i) {
+      infile >> window.label >> window.overlap >> window.x1 >> window.y1
+          >> window.x2 >> window.y2;
+      window_storage_.push_back(window);
+    }
+  }
+  num_images_ = image_offset_storage_.size();
+  num_windows_ = window_storage_.size();
+  image_offsets_ = StorageData(image_offset_storage_);
+  image_sizes_ = StorageData(image_size_storage_);
+  names_ = StorageData(name_storage_);
+  windows_ = StorageData(window_storage_);
+}
+
+bool WindowList::MapCache(const string& cache_file,
+    const int64_t source_size, const int64_t source_mtime) {
+  const int fd = open(cache_file.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat file_stat;
+  CHECK_EQ(fstat(fd, &file_stat), 0) << "Cannot stat " << cache_file;
+  const size_t size = file_stat.st_size;
+  if (size < sizeof(WindowCacheHeader)) {
+    close(fd);
+    return false;
+  }
+  void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  CHECK(map != MAP_FAILED) << "Cannot map " << cache_file;
+  const char* data = static_cast<const char*>(map);
+  WindowCacheHeader header;
+  memcpy(&header, data, sizeof(header));
+  const size_t offsets_size = header.num_images * sizeof(uint64_t);
+  const size_t windows_size = header.num_windows * sizeof(Window);
+  const size_t sizes_size = header.num_images * 3 * sizeof(int32_t);
+  if (memcmp(header.magic, kWindowCacheMagic, sizeof(kWindowCacheMagic)) ||
+      header.version != kWindowCacheVersion ||
+      header.source_size != source_size ||
+      header.source_mtime != source_mtime ||
+      size != sizeof(header) + offsets_size + windows_size + sizes_size +
+          header.names_size) {
+    LOG(INFO) << cache_file << " was not written for this window file.";
+    munmap(map, size);
+    return false;
+  }
+  map_ = map;
+  map_size_ = size;
+  num_images_ = header.num_images;
+  num_windows_ = header.num_windows;
+  // Each array starts at a multiple of the alignment of its elements.
+  data += sizeof(header);
+  image_offsets_ = reinterpret_cast<const uint64_t*>(data);
+  data += offsets_size;
+  windows_ = reinterpret_cast<const Window*>(data);
+  data += windows_size;
+  image_sizes_ = reinterpret_cast<const int32_t*>(data);
+  data += sizes_size;
+  names_ = data;
+  return true;
+}
+
+void WindowList::WriteCache(const string& cache_file,
+    const int64_t source_size, const int64_t source_mtime) const {
+  // Written aside and renamed, so that other processes reading the same
+  // window file never map a partial cache file.
+  const string temp_file = cache_file + ".tmp";
+  std::ofstream output(temp_file.c_str(),
+      std::ios::out | std::ios::trunc | std::ios::binary);
+  WindowCacheHeader header;
+  memcpy(header.magic, kWindowCacheMagic, sizeof(kWindowCacheMagic));
+  header.version = kWindowCacheVersion;
+  header.num_images = num_images_;
+  header.num_windows = num_windows_;
+  header.names_size = name_storage_.size();
+  header.source_size = source_size;
+  header.source_mtime = source_mtime;
+  WriteBytes(&header, sizeof(header), &output);
+  WriteBytes(image_offsets_, num_images_ * sizeof(uint64_t), &output);
+  WriteBytes(windows_, num_windows_ * sizeof(Window), &output);
+  WriteBytes(image_sizes_, num_images_ * 3 * sizeof(int32_t), &output);
+  WriteBytes(names_, name_storage_.size(), &output);
+  output.close();
+  if (!output || rename(temp_file.c_str(), cache_file.c_str())) {
+    LOG(ERROR) << "Cannot write the window cache file " << cache_file;
+    remove(temp_file.c_str());
+    return;
+  }
+  LOG(INFO) << "Wrote " << num_windows_ << " windows to " << cache_file;
+}
+
+}  // namespace caffe
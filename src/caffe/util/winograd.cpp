@@ -0,0 +1,129 @@
+// Copyright 2014 BVLC and contributors.
+
+#include "caffe/util/winograd.hpp"
+
+namespace caffe {
+
+// U = G g G^T, with G = [1 0 0; 1/2 1/2 1/2; 1/2 -1/2 1/2; 0 0 1]
+template <typename Dtype>
+void winograd_transform_weights_cpu(const Dtype* weights,
+    const int num_output, const int channels, Dtype* transformed) {
+  const int num_filters = num_output * channels;
+  for (int i = 0; i < num_filters; ++i) {
+    const Dtype* g = weights + i * 9;
+    Dtype t[4][3];
+    for (int k = 0; k < 3; ++k) {
+      t[0][k] = g[k];
+      t[1][k] = (g[k] + g[3 + k] + g[6 + k]) / 2;
+      t[2][k] = (g[k] - g[3 + k] + g[6 + k]) / 2;
+      t[3][k] = g[6 + k];
+    }
+    for (int r = 0; r < 4; ++r) {
+      transformed[(r * 4) * num_filters + i] = t[r][0];
+      transformed[(r * 4 + 1) * num_filters + i] =
+          (t[r][0] + t[r][1] + t[r][2]) / 2;
+      transformed[(r * 4 + 2) * num_filters + i] =
+          (t[r][0] - t[r][1] + t[r][2]) / 2;
+      transformed[(r * 4 + 3) * num_filters + i] = t[r][2];
+    }
+  }
+}
+
+template void winograd_transform_weights_cpu<float>(const float* weights,
+    const int num_output, const int channels, float* transformed);
+template void winograd_transform_weights_cpu<double>(const double* weights,
+    const int num_output, const int channels, double* transformed);
+
+// V = B^T d B, with B^T = [1 0 -1 0; 0 1 1 0; 0 -1 1 0; 0 1 0 -1]
+template <typename Dtype>
+void winograd_transform_input_cpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int pad, Dtype* transformed) {
+  const int tiles_h = winograd_tiles(height + 2 * pad - 2);
+  const int tiles_w = winograd_tiles(width + 2 * pad - 2);
+  const int num_tiles = tiles_h * tiles_w;
+  for (int c = 0; c < channels; ++c) {
+    const Dtype* channel_im = data_im + c * height * width;
+    for (int th = 0; th < tiles_h; ++th) {
+      for (int tw = 0; tw < tiles_w; ++tw) {
+        Dtype d[4][4];
+        for (int i = 0; i < 4; ++i) {
+          for (int j = 0; j < 4; ++j) {
+            const int h = th * 2 - pad + i;
+            const int w = tw * 2 - pad + j;
+            d[i][j] = (h >= 0 && w >= 0 && h < height && w < width) ?
+                channel_im[h * width + w] : 0;
+          }
+        }
+        Dtype t[4][4];
+        for (int j = 0; j < 4; ++j) {
+          t[0][j] = d[0][j] - d[2][j];
+          t[1][j] = d[1][j] + d[2][j];
+          t[2][j] = d[2][j] - d[1][j];
+          t[3][j] = d[1][j] - d[3][j];
+        }
+        Dtype* out = transformed + c * num_tiles + th * tiles_w + tw;
+        const int step = channels * num_tiles;
+        for (int i = 0; i < 4; ++i) {
+          out[(i * 4) * step] = t[i][0] - t[i][2];
+          out[(i * 4 + 1) * step] = t[i][1] + t[i][2];
+          out[(i * 4 + 2) * step] = t[i][2] - t[i][1];
+          out[(i * 4 + 3) * step] = t[i][1] - t[i][3];
+        }
+      }
+    }
+  }
+}
+
+template void winograd_transform_input_cpu<float>(const float* data_im,
+    const int channels, const int height, const int width, const int pad,
+    float* transformed);
+template void winograd_transform_input_cpu<double>(const double* data_im,
+    const int channels, const int height, const int width, const int pad,
+    double* transformed);
+
+// Y = A^T m A, with A^T = [1 1 1 0; 0 1 -1 -1]
+template <typename Dtype>
+void winograd_transform_output_cpu(const Dtype* transformed,
+    const int num_output, const int height_out, const int width_out,
+    const Dtype* bias, Dtype* data_out) {
+  const int tiles_h = winograd_tiles(height_out);
+  const int tiles_w = winograd_tiles(width_out);
+  const int num_tiles = tiles_h * tiles_w;
+  const int step = num_output * num_tiles;
+  for (int o = 0; o < num_output; ++o) {
+    Dtype* channel_out = data_out + o * height_out * width_out;
+    const Dtype b = bias ? bias[o] : Dtype(0);
+    for (int th = 0; th < tiles_h; ++th) {
+      for (int tw = 0; tw < tiles_w; ++tw) {
+        const Dtype* in = transformed + o * num_tiles + th * tiles_w + tw;
+        Dtype t[2][4];
+        for (int j = 0; j < 4; ++j) {
+          t[0][j] = in[j * step] + in[(4 + j) * step] + in[(8 + j) * step];
+          t[1][j] = in[(4 + j) * step] - in[(8 + j) * step] -
+              in[(12 + j) * step];
+        }
+        for (int i = 0; i < 2; ++i) {
+          const int h = th * 2 + i;
+          if (h >= height_out) {
+            continue;
+          }
+          channel_out[h * width_out + tw * 2] =
+              t[i][0] + t[i][1] + t[i][2] + b;
+          if (tw * 2 + 1 < width_out) {
+            channel_out[h * width_out + tw * 2 + 1] =
+                t[i][1] - t[i][2] - t[i][3] + b;
+          }
+        }
+      }
+    }
+  }
+}
+
+template void winograd_transform_output_cpu<float>(const float* transformed,
+    const int num_output, const int height_out, const int width_out,
+    const float* bias, float* data_out);
+template void winograd_transform_output_cpu<double>(
+    const double* transformed, const int num_output, const int height_out,
+    const int width_out, const double* bias, double* data_out);
+
+}  // namespace caffe
@@ -0,0 +1,164 @@
+// Copyright 2014 BVLC and contributors.
+
+#include "caffe/common.hpp"
+#include "caffe/util/winograd.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+__global__ void winograd_transform_weights_kernel(const int num_filters,
+    const Dtype* weights, Dtype* transformed) {
+  CUDA_KERNEL_LOOP(index, num_filters) {
+    const Dtype* g = weights + index * 9;
+    Dtype t[4][3];
+    for (int k = 0; k < 3; ++k) {
+      t[0][k] = g[k];
+      t[1][k] = (g[k] + g[3 + k] + g[6 + k]) / 2;
+      t[2][k] = (g[k] - g[3 + k] + g[6 + k]) / 2;
+      t[3][k] = g[6 + k];
+    }
+    for (int r = 0; r < 4; ++r) {
+      transformed[(r * 4) * num_filters + index] = t[r][0];
+      transformed[(r * 4 + 1) * num_filters + index] =
+          (t[r][0] + t[r][1] + t[r][2]) / 2;
+      transformed[(r * 4 + 2) * num_filters + index] =
+          (t[r][0] - t[r][1] + t[r][2]) / 2;
+      transformed[(r * 4 + 3) * num_filters + index] = t[r][2];
+    }
+  }
+}
+
+template <typename Dtype>
+void winograd_transform_weights_gpu(const Dtype* weights,
+    const int num_output, const int channels, Dtype* transformed) {
+  const int num_filters = num_output * channels;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  winograd_transform_weights_kernel<Dtype><<<CAFFE_GET_BLOCKS(num_filters),
+                                             CAFFE_CUDA_NUM_THREADS>>>(
+      num_filters, weights, transformed);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void winograd_transform_weights_gpu<float>(const float* weights,
+    const int num_output, const int channels, float* transformed);
+template void winograd_transform_weights_gpu<double>(const double* weights,
+    const int num_output, const int channels, double* transformed);
+
+// One thread per input tile of a channel
+template <typename Dtype>
+__global__ void winograd_transform_input_kernel(const int n,
+    const Dtype* data_im, const int channels, const int height,
+    const int width, const int pad, const int tiles_w, const int num_tiles,
+    Dtype* transformed) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int tile = index % num_tiles;
+    const int c = index / num_tiles;
+    const int th = tile / tiles_w;
+    const int tw = tile % tiles_w;
+    const Dtype* channel_im = data_im + c * height * width;
+    Dtype d[4][4];
+    for (int i = 0; i < 4; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        const int h = th * 2 - pad + i;
+        const int w = tw * 2 - pad + j;
+        d[i][j] = (h >= 0 && w >= 0 && h < height && w < width) ?
+            channel_im[h * width + w] : 0;
+      }
+    }
+    Dtype t[4][4];
+    for (int j = 0; j < 4; ++j) {
+      t[0][j] = d[0][j] - d[2][j];
+      t[1][j] = d[1][j] + d[2][j];
+      t[2][j] = d[2][j] - d[1][j];
+      t[3][j] = d[1][j] - d[3][j];
+    }
+    Dtype* out = transformed + index;
+    const int step = channels * num_tiles;
+    for (int i = 0; i < 4; ++i) {
+      out[(i * 4) * step] = t[i][0] - t[i][2];
+      out[(i * 4 + 1) * step] = t[i][1] + t[i][2];
+      out[(i * 4 + 2) * step] = t[i][2] - t[i][1];
+      out[(i * 4 + 3) * step] = t[i][1] - t[i][3];
+    }
+  }
+}
+
+template <typename Dtype>
+void winograd_transform_input_gpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int pad, Dtype* transformed) {
+  const int tiles_w = winograd_tiles(width + 2 * pad - 2);
+  const int num_tiles = winograd_tiles(height + 2 * pad - 2) * tiles_w;
+  const int num_kernels = channels * num_tiles;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  winograd_transform_input_kernel<Dtype><<<CAFFE_GET_BLOCKS(num_kernels),
+                                           CAFFE_CUDA_NUM_THREADS>>>(
+      num_kernels, data_im, channels, height, width, pad, tiles_w, num_tiles,
+      transformed);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void winograd_transform_input_gpu<float>(const float* data_im,
+    const int channels, const int height, const int width, const int pad,
+    float* transformed);
+template void winograd_transform_input_gpu<double>(const double* data_im,
+    const int channels, const int height, const int width, const int pad,
+    double* transformed);
+
+// One thread per output tile of a channel
+template <typename Dtype>
+__global__ void winograd_transform_output_kernel(const int n,
+    const Dtype* transformed, const int num_output, const int height_out,
+    const int width_out, const int tiles_w, const int num_tiles,
+    const Dtype* bias, Dtype* data_out) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int tile = index % num_tiles;
+    const int o = index / num_tiles;
+    const int th = tile / tiles_w;
+    const int tw = tile % tiles_w;
+    const int step = num_output * num_tiles;
+    const Dtype* in = transformed + index;
+    Dtype t[2][4];
+    for (int j = 0; j < 4; ++j) {
+      t[0][j] = in[j * step] + in[(4 + j) * step] + in[(8 + j) * step];
+      t[1][j] = in[(4 + j) * step] - in[(8 + j) * step] -
+          in[(12 + j) * step];
+    }
+    Dtype* channel_out = data_out + o * height_out * width_out;
+    const Dtype b = bias ? bias[o] : Dtype(0);
+    for (int i = 0; i < 2; ++i) {
+      const int h = th * 2 + i;
+      if (h >= height_out) {
+        continue;
+      }
+      channel_out[h * width_out + tw * 2] = t[i][0] + t[i][1] + t[i][2] + b;
+      if (tw * 2 + 1 < width_out) {
+        channel_out[h * width_out + tw * 2 + 1] =
+            t[i][1] - t[i][2] - t[i][3] + b;
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void winograd_transform_output_gpu(const Dtype* transformed,
+    const int num_output, const int height_out, const int width_out,
+    const Dtype* bias, Dtype* data_out) {
+  const int tiles_w = winograd_tiles(width_out);
+  const int num_tiles = winograd_tiles(height_out) * tiles_w;
+  const int num_kernels = num_output * num_tiles;
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  winograd_transform_output_kernel<Dtype><<<CAFFE_GET_BLOCKS(num_kernels),
+                                            CAFFE_CUDA_NUM_THREADS>>>(
+      num_kernels, transformed, num_output, height_out, width_out, tiles_w,
+      num_tiles, bias, data_out);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void winograd_transform_output_gpu<float>(const float* transformed,
+    const int num_output, const int height_out, const int width_out,
+    const float* bias, float* data_out);
+template void winograd_transform_output_gpu<double>(
+    const double* transformed, const int num_output, const int height_out,
+    const int width_out, const double* bias, double* data_out);
+
+}  // namespace caffe
@@ -0,0 +1,165 @@
+// Copyright 2014 BVLC and contributors.
+//
+// This program benchmarks a net as a whole: for each batch size, it runs the
+// net warmup times, then times trials passes, forward only and, unless the
+// net is an inference only one, forward and backward. For each it prints the
+// mean, median and 99th percentile of the time of a pass, the images per
+// second, and the share of the time spent in the data layers, those without
+// bottoms, measured in a last round of passes profiled layer by layer (see
+// Net::set_profiling). The results go to stdout as CSV, the log to stderr.
+// A batch size of 0 keeps that of the net; one of 1 measures the latency of
+// single image requests, whose products of one row or column run as GEMVs.
+// Usage:
+//    benchmark_net net_proto [CPU/GPU] [device_id=0 for GPU, threads=1 for
+//        CPU] [batch_sizes=0, e.g. 1,16,64] [trials=20] [warmup=3]
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::Blob;
+using caffe::Caffe;
+using caffe::LayerParameter;
+using caffe::Net;
+using caffe::NetParameter;
+using caffe::Timer;
+using std::string;
+using std::vector;
+
+// Sets the batch size of the inputs and of the data layers of param.
+void SetBatchSize(const int batch_size, NetParameter* param) {
+  for (int i = 0; i < param->input_size(); ++i) {
+    param->set_input_dim(i * 4, batch_size);
+  }
+  for (int i = 0; i < param->layers_size(); ++i) {
+    LayerParameter* layer_param = param->mutable_layers(i);
+    if (layer_param->has_data_param()) {
+      layer_param->mutable_data_param()->set_batch_size(batch_size);
+    }
+    if (layer_param->has_hdf5_data_param()) {
+      layer_param->mutable_hdf5_data_param()->set_batch_size(batch_size);
+    }
+    if (layer_param->has_image_data_param()) {
+      layer_param->mutable_image_data_param()->set_batch_size(batch_size);
+    }
+    if (layer_param->has_memory_data_param()) {
+      layer_param->mutable_memory_data_param()->set_batch_size(batch_size);
+    }
+    if (layer_param->has_window_data_param()) {
+      layer_param->mutable_window_data_param()->set_batch_size(batch_size);
+    }
+  }
+}
+
+void RunPass(const bool backward, Net<float>* net) {
+  if (backward) {
+    net->ForwardBackward(vector<Blob<float>*>());
+  } else {
+    net->ForwardPrefilled();
+  }
+}
+
+// Times the passes of net, and prints their statistics as a CSV row.
+void Benchmark(const bool backward, const int trials, const int warmup,
+    Net<float>* net) {
+  for (int i = 0; i < warmup; ++i) {
+    RunPass(backward, net);
+  }
+  vector<float> times(trials);
+  Timer timer;
+  for (int i = 0; i < trials; ++i) {
+    timer.Start();
+    RunPass(backward, net);
+    times[i] = timer.MilliSeconds();
+  }
+  // The time in the data layers, in passes profiled layer by layer
+  net->set_profiling(true);
+  for (int i = 0; i < trials; ++i) {
+    RunPass(backward, net);
+  }
+  double data_ms = 0, total_ms = 0;
+  for (int i = 0; i < net->layers().size(); ++i) {
+    const Net<float>::LayerProfile& profile = net->layer_profiles()[i];
+    const double layer_ms = profile.forward_ms + profile.backward_ms;
+    if (net->bottom_vecs()[i].empty()) {
+      data_ms += layer_ms;
+    }
+    total_ms += layer_ms;
+  }
+  net->set_profiling(false);
+
+  double mean = 0;
+  for (int i = 0; i < trials; ++i) {
+    mean += times[i];
+  }
+  mean /= trials;
+  std::sort(times.begin(), times.end());
+  const float median = trials % 2 ? times[trials / 2] :
+      (times[trials / 2 - 1] + times[trials / 2]) / 2;
+  const float p99 = times[std::min(trials - 1, trials * 99 / 100)];
+  const int batch_size = net->blobs()[0]->num();
+  printf("%s,%s,%s,%d,%d,%.4f,%.4f,%.4f,%.2f,%.4f\n", net->name().c_str(),
+      Caffe::mode() == Caffe::GPU ? "GPU" : "CPU",
+      backward ? "forward_backward" : "forward", batch_size, trials, mean,
+      median, p99, batch_size * 1000. / mean,
+      total_ms > 0 ? data_ms / total_ms : 0.);
+  fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc < 2 || argc > 7) {
+    LOG(ERROR) << "benchmark_net net_proto [CPU/GPU] [device_id=0 for GPU,"
+        " threads=1 for CPU] [batch_sizes=0] [trials=20] [warmup=3]";
+    return 1;
+  }
+  const bool gpu = argc > 2 && strcmp(argv[2], "GPU") == 0;
+  if (gpu) {
+    Caffe::SetDevice(argc > 3 ? atoi(argv[3]) : 0);
+    Caffe::set_mode(Caffe::GPU);
+  } else {
+    Caffe::set_mode(Caffe::CPU);
+    if (argc > 3) {
+      Caffe::set_cpu_threads(atoi(argv[3]));
+    }
+  }
+  vector<int> batch_sizes;
+  for (const char* sizes = argc > 4 ? argv[4] : "0"; sizes;
+       sizes = strchr(sizes, ',') ? strchr(sizes, ',') + 1 : NULL) {
+    batch_sizes.push_back(atoi(sizes));
+  }
+  const int trials = argc > 5 ? atoi(argv[5]) : 20;
+  const int warmup = argc > 6 ? atoi(argv[6]) : 3;
+  CHECK_GT(trials, 0);
+  CHECK_GE(warmup, 0);
+
+  Caffe::set_phase(Caffe::TRAIN);
+  NetParameter net_param;
+  caffe::ReadNetParamsFromTextFileOrDie(argv[1], &net_param);
+  printf("net,mode,pass,batch_size,trials,mean_ms,median_ms,p99_ms,"
+      "images_per_second,data_share\n");
+  for (int i = 0; i < batch_sizes.size(); ++i) {
+    NetParameter param = net_param;
+    if (batch_sizes[i] > 0) {
+      SetBatchSize(batch_sizes[i], &param);
+    }
+    Net<float> net(param);
+    LOG(ERROR) << "Benchmarking a batch of " << net.blobs()[0]->num();
+    Benchmark(false, trials, warmup, &net);
+    if (!net.inference()) {
+      Benchmark(true, trials, warmup, &net);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,176 @@
+// Copyright 2014 BVLC and contributors.
+//
+// This program caches the features a train net computes below its frozen
+// layers, to fine-tune its upper layers without running the lower ones at
+// every iteration. It runs the layers up to the blob boundary once over the
+// data, in the TEST phase (without dropout, and with the center crop and no
+// mirroring of the data layers), and writes boundary and the label of each
+// item to cache_db, a Datum each. It then writes cached_net_proto, the net
+// above boundary reading the cache through a DATA layer, which trains from
+// the same pretrained weights, its layers keeping their names (see
+// util/feature_cache.hpp). The layers below boundary must have a blobs_lr of
+// 0 for each of their weights. For a DATA layer the items are counted in its
+// DB; num_items gives those of other data layers.
+// Usage:
+//    cache_features train_net_proto pretrained_net_param boundary_blob
+//        cache_db cached_net_proto [backend=LEVELDB/LMDB] [CPU/GPU]
+//        [DEVICE_ID=0] [num_items]
+
+#include <glog/logging.h>
+#include <stdio.h>  // for snprintf
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/db.hpp"
+#include "caffe/util/feature_cache.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::Blob;
+using caffe::Caffe;
+using caffe::DataParameter;
+using caffe::DataParameter_DB;
+using caffe::Datum;
+using caffe::DB;
+using caffe::DBCursor;
+using caffe::DBTransaction;
+using caffe::LayerParameter;
+using caffe::Net;
+using caffe::NetParameter;
+using caffe::shared_ptr;
+using std::string;
+using std::vector;
+
+// The records of the DB of a DATA layer
+static int CountRecords(const DataParameter& param) {
+  shared_ptr<DB> db(caffe::GetDB(param));
+  db->Open(param.source(), DB::READ);
+  int count = 0;
+  {
+    shared_ptr<DBCursor> cursor(db->NewCursor());
+    for (cursor->SeekToFirst(); cursor->valid(); cursor->Next()) {
+      ++count;
+    }
+  }
+  db->Close();
+  return count;
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc < 6 || argc > 10) {
+    LOG(ERROR) << "cache_features train_net_proto pretrained_net_param"
+        " boundary_blob cache_db cached_net_proto [backend=LEVELDB/LMDB]"
+        " [CPU/GPU] [DEVICE_ID=0] [num_items]";
+    return 1;
+  }
+  DataParameter_DB backend = DataParameter::LEVELDB;
+  if (argc > 6) {
+    CHECK(DataParameter::DB_Parse(argv[6], &backend))
+        << "Unknown backend " << argv[6];
+  }
+  if (argc > 7 && strcmp(argv[7], "GPU") == 0) {
+    const int device_id = argc > 8 ? atoi(argv[8]) : 0;
+    LOG(ERROR) << "Using GPU " << device_id;
+    Caffe::SetDevice(device_id);
+    Caffe::set_mode(Caffe::GPU);
+  } else {
+    LOG(ERROR) << "Using CPU";
+    Caffe::set_mode(Caffe::CPU);
+  }
+  Caffe::set_phase(Caffe::TEST);
+
+  NetParameter net_param;
+  caffe::ReadNetParamsFromTextFileOrDie(argv[1], &net_param);
+  const string boundary(argv[3]);
+  NetParameter prefix_param;
+  NetParameter suffix_param;
+  const string label = caffe::SplitNetAtBlob(net_param, boundary, argv[4],
+      backend, &prefix_param, &suffix_param);
+  // The prefix is only run forward, and keeps boundary as it is after the
+  // last layer writing it.
+  prefix_param.set_inference(true);
+  prefix_param.set_auto_in_place(false);
+  Net<float> prefix(prefix_param);
+  prefix.CopyTrainedLayersFrom(string(argv[2]));
+  // Cached layers that would have been trained would never be.
+  for (int i = 1; i < prefix_param.layers_size(); ++i) {
+    const LayerParameter& layer_param = prefix_param.layers(i);
+    if (!prefix.has_layer(layer_param.name()) ||
+        prefix.layer_by_name(layer_param.name())->blobs().empty()) {
+      continue;
+    }
+    CHECK_GT(layer_param.blobs_lr_size(), 0)
+        << "The layer " << layer_param.name() << " below " << boundary
+        << " is trained: give it a blobs_lr of 0.";
+    for (int j = 0; j < layer_param.blobs_lr_size(); ++j) {
+      CHECK_EQ(layer_param.blobs_lr(j), 0)
+          << "The layer " << layer_param.name() << " below " << boundary
+          << " is trained: give it a blobs_lr of 0.";
+    }
+  }
+
+  const LayerParameter& data_param = prefix_param.layers(0);
+  int num_items;
+  if (argc > 9) {
+    num_items = atoi(argv[9]);
+  } else {
+    CHECK_EQ(data_param.type(), LayerParameter::DATA)
+        << "Give the num_items of a layer other than a DATA layer.";
+    num_items = CountRecords(data_param.data_param());
+  }
+  CHECK_GT(num_items, 0);
+
+  const shared_ptr<Blob<float> > features = prefix.blob_by_name(boundary);
+  const shared_ptr<Blob<float> > labels =
+      label.empty() ? shared_ptr<Blob<float> >() : prefix.blob_by_name(label);
+  shared_ptr<DB> db(caffe::GetDB(backend));
+  db->Open(argv[4], DB::NEW);
+  shared_ptr<DBTransaction> txn(db->NewTransaction());
+  LOG(ERROR) << "Caching " << boundary << " of " << num_items << " items";
+  Datum datum;
+  datum.set_channels(features->channels());
+  datum.set_height(features->height());
+  datum.set_width(features->width());
+  const int dim = features->count() / features->num();
+  string value;
+  const int kMaxKeyStrLength = 16;
+  char key_str[kMaxKeyStrLength];
+  for (int item = 0; item < num_items; ) {
+    prefix.ForwardPrefilled();
+    // The last batch may wrap around to the first items.
+    const int num = std::min(features->num(), num_items - item);
+    const float* feature_data = features->cpu_data();
+    for (int n = 0; n < num; ++n, ++item) {
+      datum.mutable_float_data()->Resize(dim, 0);
+      std::copy(feature_data + n * dim, feature_data + (n + 1) * dim,
+          datum.mutable_float_data()->mutable_data());
+      if (labels) {
+        datum.set_label(static_cast<int>(labels->cpu_data()[n]));
+      }
+      datum.SerializeToString(&value);
+      // Keys of a fixed width, for the items to be in their order in the DB
+      snprintf(key_str, kMaxKeyStrLength, "%08d", item);
+      txn->Put(string(key_str), value);
+    }
+    if (item % 1000 < num || item == num_items) {
+      txn->Commit();
+      LOG(ERROR) << "Cached " << item << " items";
+    }
+  }
+  txn.reset();
+  db->Close();
+
+  caffe::WriteProtoToTextFile(suffix_param, argv[5]);
+  LOG(ERROR) << "Wrote " << argv[5] << ", which trains from " << argv[4];
+  return 0;
+}
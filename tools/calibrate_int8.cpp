@@ -0,0 +1,163 @@
+// Copyright 2014 BVLC and contributors.
+//
+// This program calibrates the INT8 precision of the convolution and inner
+// product layers of a trained net (see QuantizationParameter): it runs the
+// net on the CPU over sample batches from its data layers, records the
+// largest absolute value of the bottom of each of these layers, and writes
+// the net with the layers set to INT8 and that bottom range. It then runs
+// the quantized net over the same batches, and reports how much its outputs
+// differ from those of the float net, and the time per batch of both.
+// Usage:
+//    calibrate_int8 net_proto pretrained_net_param num_batches output_proto
+//        [threads=1]
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/quantize.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::Blob;
+using caffe::Caffe;
+using caffe::Layer;
+using caffe::LayerParameter;
+using caffe::LayerParameter_LayerType_CONVOLUTION;
+using caffe::LayerParameter_LayerType_INNER_PRODUCT;
+using caffe::Net;
+using caffe::NetParameter;
+using caffe::QuantizationParameter;
+using caffe::Timer;
+using std::map;
+using std::string;
+using std::vector;
+
+static bool IsQuantizable(const LayerParameter& layer_param) {
+  return layer_param.type() == LayerParameter_LayerType_CONVOLUTION ||
+      layer_param.type() == LayerParameter_LayerType_INNER_PRODUCT;
+}
+
+// Runs net over num_batches batches, keeping the outputs of each batch, and
+// if bottom_ranges is not NULL, the largest absolute value of the bottom of
+// each quantizable layer by name. Returns the time per batch in ms.
+static float RunNet(Net<float>* net, const int num_batches,
+    vector<vector<float> >* outputs, map<string, float>* bottom_ranges) {
+  const vector<caffe::shared_ptr<Layer<float> > >& layers = net->layers();
+  Timer timer;
+  float milliseconds = 0;
+  for (int batch = 0; batch < num_batches; ++batch) {
+    if (bottom_ranges) {
+      // Layer by layer, to read each bottom before a later layer may change
+      // it in place, and only timing the layers.
+      for (int i = 0; i < layers.size(); ++i) {
+        if (IsQuantizable(layers[i]->layer_param())) {
+          const Blob<float>* bottom = net->bottom_vecs()[i][0];
+          float& range = (*bottom_ranges)[layers[i]->layer_param().name()];
+          range = std::max(range,
+              caffe::caffe_cpu_amax(bottom->count(), bottom->cpu_data()));
+        }
+        timer.Start();
+        layers[i]->Forward(net->bottom_vecs()[i], &net->top_vecs()[i]);
+        timer.Stop();
+        milliseconds += timer.MilliSeconds();
+      }
+    } else {
+      timer.Start();
+      net->ForwardPrefilled();
+      timer.Stop();
+      milliseconds += timer.MilliSeconds();
+    }
+    outputs->push_back(vector<float>());
+    for (int j = 0; j < net->output_blobs().size(); ++j) {
+      const Blob<float>* output = net->output_blobs()[j];
+      outputs->back().insert(outputs->back().end(), output->cpu_data(),
+          output->cpu_data() + output->count());
+    }
+  }
+  return milliseconds / num_batches;
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc < 5 || argc > 6) {
+    LOG(ERROR) << "calibrate_int8 net_proto pretrained_net_param num_batches"
+        " output_proto [threads=1]";
+    return 1;
+  }
+  const int num_batches = atoi(argv[3]);
+  CHECK_GT(num_batches, 0);
+  Caffe::set_mode(Caffe::CPU);
+  Caffe::set_phase(Caffe::TEST);
+  if (argc > 5) {
+    Caffe::set_cpu_threads(atoi(argv[5]));
+  }
+
+  NetParameter net_param;
+  caffe::ReadNetParamsFromTextFileOrDie(argv[1], &net_param);
+  net_param.set_inference(true);
+  map<string, float> bottom_ranges;
+  vector<vector<float> > float_outputs;
+  float float_time;
+  {
+    Net<float> net(net_param);
+    net.CopyTrainedLayersFrom(argv[2]);
+    float_time = RunNet(&net, num_batches, &float_outputs, &bottom_ranges);
+  }
+
+  for (int i = 0; i < net_param.layers_size(); ++i) {
+    LayerParameter* layer_param = net_param.mutable_layers(i);
+    map<string, float>::const_iterator it =
+        bottom_ranges.find(layer_param->name());
+    if (!IsQuantizable(*layer_param) || it == bottom_ranges.end()) {
+      continue;
+    }
+    QuantizationParameter* quantization_param =
+        layer_param->mutable_quantization_param();
+    quantization_param->set_precision(QuantizationParameter::INT8);
+    quantization_param->set_bottom_range(it->second);
+    LOG(ERROR) << layer_param->name() << ": bottom range " << it->second;
+  }
+  caffe::WriteProtoToTextFile(net_param, argv[4]);
+  LOG(ERROR) << "Wrote the INT8 net to " << argv[4];
+
+  // The batches are read again from the start, in the same order.
+  vector<vector<float> > int8_outputs;
+  float int8_time;
+  {
+    Net<float> net(net_param);
+    net.CopyTrainedLayersFrom(argv[2]);
+    int8_time = RunNet(&net, num_batches, &int8_outputs, NULL);
+  }
+  double sum_float = 0, sum_int8 = 0, sum_error = 0, max_error = 0;
+  size_t count = 0;
+  for (int batch = 0; batch < num_batches; ++batch) {
+    for (int j = 0; j < float_outputs[batch].size(); ++j) {
+      const double error =
+          std::fabs(float_outputs[batch][j] - int8_outputs[batch][j]);
+      sum_float += float_outputs[batch][j];
+      sum_int8 += int8_outputs[batch][j];
+      sum_error += error;
+      max_error = std::max(max_error, error);
+      ++count;
+    }
+  }
+  LOG(ERROR) << "Mean output: " << sum_float / count << " in float, "
+      << sum_int8 / count << " in INT8.";
+  LOG(ERROR) << "Output error: mean " << sum_error / count << ", max "
+      << max_error << ".";
+  LOG(ERROR) << "Time per batch: " << float_time << " ms in float, "
+      << int8_time << " ms in INT8 (" << float_time / int8_time
+      << "x faster).";
+  return 0;
+}
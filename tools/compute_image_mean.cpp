@@ -1,86 +1,207 @@
 // Copyright 2014 BVLC and contributors.
+// This program computes the mean image of the datums of a leveldb or lmdb.
+// Usage:
+//    compute_image_mean INPUT_DB OUTPUT_FILE [leveldb/lmdb] [NUM_THREADS]
+//        [STATS_FILE]
+// The datums are read in key order and parsed, decoded and summed by
+// NUM_THREADS threads (1 by default), each one into its own double precision
+// sums, combined at the end. If STATS_FILE is given, the mean and standard
+// deviation of each channel are computed in the same pass and written there,
+// one "channel mean std" line per channel.
 
 #include <glog/logging.h>
-#include <leveldb/db.h>
+#include <pthread.h>
 #include <stdint.h>
 
 #include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>  // NOLINT(readability/streams)
 #include <string>
+#include <vector>
 
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/db.hpp"
 #include "caffe/util/io.hpp"
 
 using caffe::Datum;
 using caffe::BlobProto;
+using caffe::DB;
+using caffe::DBCursor;
+using caffe::DecodeImageToPixels;
+using caffe::shared_ptr;
 using std::max;
+using std::string;
+using std::vector;
+
+// The number of datums read before the workers sum them.
+const int kBlockSize = 1024;
+
+struct MeanWorkerContext {
+  const vector<string>* values;
+  int num_values;
+  int worker_id;
+  int num_workers;
+  int channels;
+  int data_size;
+  // The sum of each pixel, and the sum of the squares of each channel
+  vector<double> sum;
+  vector<double> channel_sum_sq;
+  int count;
+};
+
+// Sums the datums worker_id, worker_id + num_workers, ... of the block.
+static void* MeanWorker(void* context_pointer) {
+  MeanWorkerContext* context =
+      reinterpret_cast<MeanWorkerContext*>(context_pointer);
+  const int dim = context->data_size / context->channels;
+  Datum datum;
+  // The pixels of encoded datums
+  string decoded;
+  for (int i = context->worker_id; i < context->num_values;
+       i += context->num_workers) {
+    const string& value = (*context->values)[i];
+    datum.ParseFromArray(value.data(), value.size());
+    if (datum.encoded()) {
+      CHECK(DecodeImageToPixels(datum.data().data(), datum.data().size(),
+          datum.channels(), datum.height(), datum.width(), &decoded))
+          << "Could not decode a datum";
+    }
+    const string& data = datum.encoded() ? decoded : datum.data();
+    const int size_in_datum = max<int>(data.size(), datum.float_data_size());
+    CHECK_EQ(size_in_datum, context->data_size) << "Incorrect data field size "
+        << size_in_datum;
+    for (int c = 0; c < context->channels; ++c) {
+      double* sum = &context->sum[c * dim];
+      double sum_sq = 0;
+      if (data.size() != 0) {
+        const uint8_t* pixels =
+            reinterpret_cast<const uint8_t*>(data.data()) + c * dim;
+        for (int j = 0; j < dim; ++j) {
+          const double pixel = pixels[j];
+          sum[j] += pixel;
+          sum_sq += pixel * pixel;
+        }
+      } else {
+        for (int j = 0; j < dim; ++j) {
+          const double pixel = datum.float_data(c * dim + j);
+          sum[j] += pixel;
+          sum_sq += pixel * pixel;
+        }
+      }
+      context->channel_sum_sq[c] += sum_sq;
+    }
+    ++context->count;
+  }
+  return reinterpret_cast<void*>(NULL);
+}
 
 int main(int argc, char** argv) {
   ::google::InitGoogleLogging(argv[0]);
-  if (argc != 3) {
-    LOG(ERROR) << "Usage: compute_image_mean input_leveldb output_file";
+  if (argc < 3 || argc > 6) {
+    LOG(ERROR) << "Usage: compute_image_mean input_db output_file"
+        << " [db_backend: leveldb or lmdb] [num_threads] [stats_file]";
     return 1;
   }
 
-  leveldb::DB* db;
-  leveldb::Options options;
-  options.create_if_missing = false;
-
-  LOG(INFO) << "Opening leveldb " << argv[1];
-  leveldb::Status status = leveldb::DB::Open(
-      options, argv[1], &db);
-  CHECK(status.ok()) << "Failed to open leveldb " << argv[1];
-
-  leveldb::ReadOptions read_options;
-  read_options.fill_cache = false;
-  leveldb::Iterator* it = db->NewIterator(read_options);
-  it->SeekToFirst();
+  shared_ptr<DB> db(caffe::GetDB(argc >= 4 ? argv[3] : "leveldb"));
+  db->Open(argv[1], DB::READ);
+  shared_ptr<DBCursor> it(db->NewCursor());
+  CHECK(it->valid()) << "The database is empty";
+  const int num_workers = argc >= 5 ? atoi(argv[4]) : 1;
+  CHECK_GT(num_workers, 0) << "num_threads must be positive";
   Datum datum;
   BlobProto sum_blob;
-  int count = 0;
-  datum.ParseFromString(it->value().ToString());
+  datum.ParseFromArray(it->value_data(), it->value_size());
   sum_blob.set_num(1);
   sum_blob.set_channels(datum.channels());
   sum_blob.set_height(datum.height());
   sum_blob.set_width(datum.width());
   const int data_size = datum.channels() * datum.height() * datum.width();
-  int size_in_datum = std::max<int>(datum.data().size(),
-                                    datum.float_data_size());
-  for (int i = 0; i < size_in_datum; ++i) {
-    sum_blob.add_data(0.);
+  vector<MeanWorkerContext> contexts(num_workers);
+  vector<string> values(kBlockSize);
+  for (int worker_id = 0; worker_id < num_workers; ++worker_id) {
+    contexts[worker_id].values = &values;
+    contexts[worker_id].worker_id = worker_id;
+    contexts[worker_id].num_workers = num_workers;
+    contexts[worker_id].channels = datum.channels();
+    contexts[worker_id].data_size = data_size;
+    contexts[worker_id].sum.assign(data_size, 0.);
+    contexts[worker_id].channel_sum_sq.assign(datum.channels(), 0.);
+    contexts[worker_id].count = 0;
   }
   LOG(INFO) << "Starting Iteration";
-  for (it->SeekToFirst(); it->Valid(); it->Next()) {
-    // just a dummy operation
-    datum.ParseFromString(it->value().ToString());
-    const string& data = datum.data();
-    size_in_datum = std::max<int>(datum.data().size(), datum.float_data_size());
-    CHECK_EQ(size_in_datum, data_size) << "Incorrect data field size " <<
-        size_in_datum;
-    if (data.size() != 0) {
-      for (int i = 0; i < size_in_datum; ++i) {
-        sum_blob.set_data(i, sum_blob.data(i) + (uint8_t)data[i]);
-      }
-    } else {
-      for (int i = 0; i < size_in_datum; ++i) {
-        sum_blob.set_data(i, sum_blob.data(i) +
-            static_cast<float>(datum.float_data(i)));
-      }
+  vector<pthread_t> threads(num_workers);
+  int count = 0;
+  for (it->SeekToFirst(); it->valid(); ) {
+    // The cursor is not thread safe, so the values are read here and only
+    // parsed and summed by the workers.
+    int num_values = 0;
+    for (; num_values < kBlockSize && it->valid(); ++num_values, it->Next()) {
+      values[num_values].assign(it->value_data(), it->value_size());
+    }
+    for (int worker_id = 0; worker_id < num_workers; ++worker_id) {
+      contexts[worker_id].num_values = num_values;
     }
-    ++count;
-    if (count % 10000 == 0) {
-      LOG(ERROR) << "Processed " << count << " files.";
+    for (int worker_id = 1; worker_id < num_workers; ++worker_id) {
+      CHECK(!pthread_create(&threads[worker_id], NULL, MeanWorker,
+            static_cast<void*>(&contexts[worker_id])))
+          << "Pthread execution failed.";
     }
+    MeanWorker(static_cast<void*>(&contexts[0]));
+    for (int worker_id = 1; worker_id < num_workers; ++worker_id) {
+      CHECK(!pthread_join(threads[worker_id], NULL))
+          << "Pthread joining failed.";
+    }
+    // Log every 10000 files, as the blocks go by.
+    if ((count + num_values) / 10000 > count / 10000) {
+      LOG(ERROR) << "Processed " << count + num_values << " files.";
+    }
+    count += num_values;
   }
   if (count % 10000 != 0) {
     LOG(ERROR) << "Processed " << count << " files.";
   }
-  for (int i = 0; i < sum_blob.data_size(); ++i) {
-    sum_blob.set_data(i, sum_blob.data(i) / count);
+  // Combine the sums of the workers.
+  const int channels = datum.channels();
+  const int dim = data_size / channels;
+  vector<double> sum(data_size, 0.);
+  vector<double> channel_sum_sq(channels, 0.);
+  for (int worker_id = 0; worker_id < num_workers; ++worker_id) {
+    for (int i = 0; i < data_size; ++i) {
+      sum[i] += contexts[worker_id].sum[i];
+    }
+    for (int c = 0; c < channels; ++c) {
+      channel_sum_sq[c] += contexts[worker_id].channel_sum_sq[c];
+    }
+  }
+  for (int i = 0; i < data_size; ++i) {
+    sum_blob.add_data(sum[i] / count);
   }
   // Write to disk
   LOG(INFO) << "Write to " << argv[2];
   WriteProtoToBinaryFile(sum_blob, argv[2]);
 
-  delete db;
+  if (argc >= 6) {
+    std::ofstream stats_file(argv[5]);
+    CHECK(stats_file.good()) << "Failed to open " << argv[5];
+    const double channel_count = static_cast<double>(count) * dim;
+    for (int c = 0; c < channels; ++c) {
+      double channel_sum = 0;
+      for (int j = 0; j < dim; ++j) {
+        channel_sum += sum[c * dim + j];
+      }
+      const double mean = channel_sum / channel_count;
+      const double variance =
+          std::max(0., channel_sum_sq[c] / channel_count - mean * mean);
+      LOG(INFO) << "Channel " << c << ": mean " << mean << ", std "
+          << std::sqrt(variance);
+      stats_file << c << " " << mean << " " << std::sqrt(variance) << "\n";
+    }
+    LOG(INFO) << "Wrote the channel statistics to " << argv[5];
+  }
+
+  it.reset();
+  db->Close();
   return 0;
 }
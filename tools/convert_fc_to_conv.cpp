@@ -0,0 +1,158 @@
+// Copyright 2014 BVLC and contributors.
+//
+// This program rewrites the inner product layers of a net as the equivalent
+// convolutions, so that the net takes inputs larger than those it was trained
+// on and computes a dense map of outputs over them in one forward pass. An
+// inner product over C x H x W inputs, H == W, becomes a convolution of
+// kernel H, whose weights, N x C x H x W, are those of the inner product in
+// the same order; the inner products after it become 1 x 1 convolutions.
+// The shapes are those of the net set up with the input dimensions of
+// net_proto, the ones it was trained on. The converted net keeps them unless
+// input_height and input_width are given, which replace those of the first
+// input: Net::Reshape() then only changes its batch size.
+// Usage:
+//    convert_fc_to_conv net_proto trained_net_param converted_net_proto
+//        converted_net_param [input_height input_width]
+
+#include <glog/logging.h>
+
+#include <cstdlib>
+#include <map>
+#include <string>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/io.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::Blob;
+using caffe::BlobProto;
+using caffe::Caffe;
+using caffe::ConvolutionParameter;
+using caffe::InnerProductParameter;
+using caffe::LayerParameter;
+using caffe::Net;
+using caffe::NetParameter;
+using std::map;
+using std::string;
+
+// The C x H x W inputs of an inner product layer
+struct FCInput {
+  int channels;
+  int height;
+  int width;
+};
+
+// Gives the weights of an inner product over input, dense, the shape of
+// those of the equivalent convolution.
+void ReshapeWeights(const FCInput& input, BlobProto* weights) {
+  // Sparse weights are rows of width values: they are made dense first.
+  Blob<float> blob;
+  blob.FromProto(*weights);
+  CHECK_EQ(blob.count(), blob.height() * input.channels * input.height
+      * input.width) << "The weights do not match the inputs.";
+  weights->Clear();
+  blob.ToProto(weights);
+  weights->set_num(blob.height());
+  weights->set_channels(input.channels);
+  weights->set_height(input.height);
+  weights->set_width(input.width);
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc != 5 && argc != 7) {
+    LOG(ERROR) << "convert_fc_to_conv net_proto trained_net_param"
+        " converted_net_proto converted_net_param"
+        " [input_height input_width]";
+    return 1;
+  }
+
+  NetParameter net_param;
+  caffe::ReadNetParamsFromTextFileOrDie(argv[1], &net_param);
+  // The net is only set up to read the shapes of the inputs of its layers.
+  Caffe::set_mode(Caffe::CPU);
+  Caffe::set_phase(Caffe::TEST);
+  map<string, FCInput> fc_inputs;
+  {
+    Net<float> net(net_param);
+    for (int i = 0; i < net.layers().size(); ++i) {
+      if (net.layers()[i]->layer_param().type() !=
+          LayerParameter::INNER_PRODUCT) {
+        continue;
+      }
+      const Blob<float>* bottom = net.bottom_vecs()[i][0];
+      CHECK_EQ(bottom->height(), bottom->width()) << "The inputs of "
+          << net.layer_names()[i] << " are not square: convolutions only "
+          "have square kernels.";
+      FCInput input;
+      input.channels = bottom->channels();
+      input.height = bottom->height();
+      input.width = bottom->width();
+      fc_inputs[net.layer_names()[i]] = input;
+    }
+  }
+  if (fc_inputs.empty()) {
+    LOG(ERROR) << "No inner product layers in " << argv[1];
+    return 1;
+  }
+
+  for (int i = 0; i < net_param.layers_size(); ++i) {
+    LayerParameter* layer_param = net_param.mutable_layers(i);
+    if (!fc_inputs.count(layer_param->name())) {
+      if (layer_param->type() == LayerParameter::SOFTMAX) {
+        LOG(ERROR) << "Warning: " << layer_param->name() << " normalizes "
+            "over the whole output map of a larger input, not over each "
+            "position of it.";
+      }
+      continue;
+    }
+    const FCInput& input = fc_inputs[layer_param->name()];
+    const InnerProductParameter fc_param = layer_param->inner_product_param();
+    ConvolutionParameter* conv_param =
+        layer_param->mutable_convolution_param();
+    conv_param->set_num_output(fc_param.num_output());
+    conv_param->set_bias_term(fc_param.bias_term());
+    conv_param->set_kernel_size(input.height);
+    if (fc_param.has_weight_filler()) {
+      conv_param->mutable_weight_filler()->CopyFrom(fc_param.weight_filler());
+    }
+    if (fc_param.has_bias_filler()) {
+      conv_param->mutable_bias_filler()->CopyFrom(fc_param.bias_filler());
+    }
+    layer_param->clear_inner_product_param();
+    layer_param->set_type(LayerParameter::CONVOLUTION);
+    LOG(ERROR) << layer_param->name() << ": " << fc_param.num_output()
+        << " outputs over " << input.channels << " x " << input.height
+        << " x " << input.width << " inputs to a convolution of kernel "
+        << input.height;
+  }
+  if (argc == 7) {
+    CHECK_GE(net_param.input_dim_size(), 4)
+        << "Only the input dimensions of a net can be changed.";
+    net_param.set_input_dim(2, atoi(argv[5]));
+    net_param.set_input_dim(3, atoi(argv[6]));
+  }
+
+  NetParameter trained_param;
+  caffe::ReadNetParamsFromBinaryFileOrDie(argv[2], &trained_param);
+  for (int i = 0; i < trained_param.layers_size(); ++i) {
+    LayerParameter* layer_param = trained_param.mutable_layers(i);
+    if (!fc_inputs.count(layer_param->name())) {
+      continue;
+    }
+    CHECK_GE(layer_param->blobs_size(), 1)
+        << "No weights for " << layer_param->name();
+    ReshapeWeights(fc_inputs[layer_param->name()],
+        layer_param->mutable_blobs(0));
+    layer_param->clear_inner_product_param();
+    layer_param->set_type(LayerParameter::CONVOLUTION);
+  }
+
+  caffe::WriteProtoToTextFile(net_param, argv[3]);
+  caffe::WriteProtoToBinaryFile(trained_param, argv[4]);
+  LOG(ERROR) << "Wrote " << argv[3] << " and " << argv[4];
+  return 0;
+}
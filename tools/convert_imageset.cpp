@@ -1,110 +1,249 @@
 // Copyright 2014 BVLC and contributors.
-// This program converts a set of images to a leveldb by storing them as Datum
-// proto buffers.
+// This program converts a set of images to a leveldb or lmdb by storing them
+// as Datum proto buffers.
 // Usage:
-//    convert_imageset ROOTFOLDER/ LISTFILE DB_NAME [0/1]
+//    convert_imageset ROOTFOLDER/ LISTFILE DB_NAME [0/1] [leveldb/lmdb/remote]
+//        [NUM_THREADS] [NUM_SHARDS] [0/1] [0/1]
 // where ROOTFOLDER is the root folder that holds all the images, and LISTFILE
 // should be a list of files as well as their labels, in the format as
 //   subfolder1/file1.JPEG 7
 //   ....
-// if the last argument is 1, a random shuffle will be carried out before we
-// process the file lines.
+// if the fourth argument is 1, a random shuffle will be carried out before we
+// process the file lines. The fifth argument selects the database backend,
+// leveldb by default; remote writes the record shards and the manifest of a
+// REMOTE database, to be uploaded to e.g. object storage.
+// The images are decoded by NUM_THREADS threads (1 by default). With
+// NUM_SHARDS > 1, the images are written round robin to NUM_SHARDS databases
+// named DB_NAME_000, DB_NAME_001, ..., written at the same time. The keys only
+// depend on the position of the image in the (shuffled) list, so the output
+// does not depend on the number of threads.
+// if the eighth argument is 1, the conversion resumes after the last key
+// committed to each database by a previous, interrupted run with the same
+// arguments, instead of requiring new databases.
+// if the last argument is 1, the datums hold the image files as they are
+// (e.g. JPEG) instead of their pixels, and are decoded by the DataLayer.
 
 #include <glog/logging.h>
-#include <leveldb/db.h>
-#include <leveldb/write_batch.h>
+#include <pthread.h>
 
 #include <algorithm>
+#include <cstdlib>
 #include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/db.hpp"
 #include "caffe/util/io.hpp"
 
 using namespace caffe;  // NOLINT(build/namespaces)
 using std::pair;
 using std::string;
+using std::vector;
+
+// The number of images written to each database per transaction.
+const int kCommitSize = 1000;
+
+// The images of a block being converted, decoded in parallel and then written
+// to the shards in parallel.
+struct ConvertBlock {
+  const vector<pair<string, int> >* lines;
+  string root_folder;
+  int num_shards;
+  bool encoded;
+  // The first line id of the block, and the number of lines in it
+  int line_begin;
+  int num_lines;
+  // The serialized datum of each line of the block, and its pixel count, which
+  // is -1 when the line is skipped or its image could not be read
+  vector<string> values;
+  vector<int> data_sizes;
+  // The last line id already written to each shard by a previous run
+  vector<int> resume_line_ids;
+  vector<shared_ptr<DB> > dbs;
+};
+
+struct ConvertWorkerContext {
+  ConvertBlock* block;
+  int worker_id;
+  int num_workers;
+};
+
+// The key of a line, sequential in the (shuffled) line order.
+static string LineKey(const vector<pair<string, int> >& lines,
+    const int line_id) {
+  const int kMaxKeyLength = 256;
+  char key_cstr[kMaxKeyLength];
+  snprintf(key_cstr, kMaxKeyLength, "%08d_%s", line_id,
+      lines[line_id].first.c_str());
+  return string(key_cstr);
+}
+
+// Decodes the lines worker_id, worker_id + num_workers, ... of the block.
+static void* DecodeWorker(void* context_pointer) {
+  ConvertWorkerContext* context =
+      reinterpret_cast<ConvertWorkerContext*>(context_pointer);
+  ConvertBlock* block = context->block;
+  const vector<pair<string, int> >& lines = *block->lines;
+  Datum datum;
+  for (int i = context->worker_id; i < block->num_lines;
+       i += context->num_workers) {
+    const int line_id = block->line_begin + i;
+    block->data_sizes[i] = -1;
+    if (line_id <= block->resume_line_ids[line_id % block->num_shards]) {
+      continue;
+    }
+    const string filename = block->root_folder + lines[line_id].first;
+    if (block->encoded) {
+      if (!ReadImageToEncodedDatum(filename, lines[line_id].second, &datum)) {
+        continue;
+      }
+    } else if (!ReadImageToDatum(filename, lines[line_id].second, &datum)) {
+      continue;
+    }
+    datum.SerializeToString(&block->values[i]);
+    block->data_sizes[i] = datum.channels() * datum.height() * datum.width();
+  }
+  return reinterpret_cast<void*>(NULL);
+}
+
+// Writes and commits the lines of the block going to shard worker_id.
+static void* WriteWorker(void* context_pointer) {
+  ConvertWorkerContext* context =
+      reinterpret_cast<ConvertWorkerContext*>(context_pointer);
+  ConvertBlock* block = context->block;
+  const int shard = context->worker_id;
+  shared_ptr<DBTransaction> txn(block->dbs[shard]->NewTransaction());
+  bool written = false;
+  for (int i = 0; i < block->num_lines; ++i) {
+    const int line_id = block->line_begin + i;
+    if (line_id % block->num_shards == shard && block->data_sizes[i] >= 0) {
+      txn->Put(LineKey(*block->lines, line_id), block->values[i]);
+      written = true;
+    }
+  }
+  if (written) {
+    txn->Commit();
+  }
+  return reinterpret_cast<void*>(NULL);
+}
+
+// Runs function on num_workers threads, the first one being the calling one.
+static void RunWorkers(void* (*function)(void*), ConvertBlock* block,
+    const int num_workers) {
+  vector<ConvertWorkerContext> contexts(num_workers);
+  vector<pthread_t> threads(num_workers);
+  for (int i = 0; i < num_workers; ++i) {
+    contexts[i].block = block;
+    contexts[i].worker_id = i;
+    contexts[i].num_workers = num_workers;
+  }
+  for (int i = 1; i < num_workers; ++i) {
+    CHECK(!pthread_create(&threads[i], NULL, function,
+          static_cast<void*>(&contexts[i]))) << "Pthread execution failed.";
+  }
+  function(static_cast<void*>(&contexts[0]));
+  for (int i = 1; i < num_workers; ++i) {
+    CHECK(!pthread_join(threads[i], NULL)) << "Pthread joining failed.";
+  }
+}
 
 int main(int argc, char** argv) {
   ::google::InitGoogleLogging(argv[0]);
-  if (argc < 4 || argc > 5) {
-    printf("Convert a set of images to the leveldb format used\n"
+  if (argc < 4 || argc > 10) {
+    printf("Convert a set of images to the leveldb or lmdb format used\n"
         "as input for Caffe.\n"
         "Usage:\n"
         "    convert_imageset ROOTFOLDER/ LISTFILE DB_NAME"
-        " RANDOM_SHUFFLE_DATA[0 or 1]\n"
+        " RANDOM_SHUFFLE_DATA[0 or 1] DB_BACKEND[leveldb or lmdb]"
+        " NUM_THREADS NUM_SHARDS RESUME[0 or 1] ENCODED[0 or 1]\n"
         "The ImageNet dataset for the training demo is at\n"
         "    http://www.image-net.org/download-images\n");
     return 1;
   }
   std::ifstream infile(argv[2]);
-  std::vector<std::pair<string, int> > lines;
+  vector<pair<string, int> > lines;
   string filename;
   int label;
   while (infile >> filename >> label) {
     lines.push_back(std::make_pair(filename, label));
   }
-  if (argc == 5 && argv[4][0] == '1') {
-    // randomly shuffle data
+  if (argc >= 5 && argv[4][0] == '1') {
+    // randomly shuffle data, in the same order on every run so that an
+    // interrupted conversion can be resumed
     LOG(INFO) << "Shuffling data";
     std::random_shuffle(lines.begin(), lines.end());
   }
   LOG(INFO) << "A total of " << lines.size() << " images.";
 
-  leveldb::DB* db;
-  leveldb::Options options;
-  options.error_if_exists = true;
-  options.create_if_missing = true;
-  options.write_buffer_size = 268435456;
-  LOG(INFO) << "Opening leveldb " << argv[3];
-  leveldb::Status status = leveldb::DB::Open(
-      options, argv[3], &db);
-  CHECK(status.ok()) << "Failed to open leveldb " << argv[3];
+  const string db_backend = argc >= 6 ? argv[5] : "leveldb";
+  const int num_threads = argc >= 7 ? atoi(argv[6]) : 1;
+  const int num_shards = argc >= 8 ? atoi(argv[7]) : 1;
+  const bool resume = argc >= 9 && argv[8][0] == '1';
+  const bool encoded = argc >= 10 && argv[9][0] == '1';
+  CHECK_GT(num_threads, 0) << "NUM_THREADS must be positive";
+  CHECK_GT(num_shards, 0) << "NUM_SHARDS must be positive";
 
-  string root_folder(argv[1]);
-  Datum datum;
-  int count = 0;
-  const int kMaxKeyLength = 256;
-  char key_cstr[kMaxKeyLength];
-  leveldb::WriteBatch* batch = new leveldb::WriteBatch();
-  int data_size;
-  bool data_size_initialized = false;
-  for (int line_id = 0; line_id < lines.size(); ++line_id) {
-    if (!ReadImageToDatum(root_folder + lines[line_id].first,
-                          lines[line_id].second, &datum)) {
-      continue;
+  ConvertBlock block;
+  block.lines = &lines;
+  block.root_folder = argv[1];
+  block.num_shards = num_shards;
+  block.encoded = encoded;
+  block.resume_line_ids.resize(num_shards, -1);
+  for (int shard = 0; shard < num_shards; ++shard) {
+    string db_name(argv[3]);
+    if (num_shards > 1) {
+      const int kMaxSuffixLength = 16;
+      char suffix[kMaxSuffixLength];
+      snprintf(suffix, kMaxSuffixLength, "_%03d", shard);
+      db_name += suffix;
     }
-    if (!data_size_initialized) {
-      data_size = datum.channels() * datum.height() * datum.width();
-      data_size_initialized = true;
-    } else {
-      const string& data = datum.data();
-      CHECK_EQ(data.size(), data_size) << "Incorrect data field size "
-          << data.size();
-    }
-    // sequential
-    snprintf(key_cstr, kMaxKeyLength, "%08d_%s", line_id,
-        lines[line_id].first.c_str());
-    string value;
-    // get the value
-    datum.SerializeToString(&value);
-    batch->Put(string(key_cstr), value);
-    if (++count % 1000 == 0) {
-      db->Write(leveldb::WriteOptions(), batch);
-      LOG(ERROR) << "Processed " << count << " files.";
-      delete batch;
-      batch = new leveldb::WriteBatch();
+    shared_ptr<DB> db(GetDB(db_backend));
+    db->Open(db_name, resume ? DB::WRITE : DB::NEW);
+    if (resume) {
+      // The keys start with the line id, so the last key is the last line
+      // committed to this shard.
+      shared_ptr<DBCursor> cursor(db->NewCursor());
+      cursor->SeekToLast();
+      if (cursor->valid()) {
+        block.resume_line_ids[shard] = atoi(cursor->key().c_str());
+        LOG(INFO) << "Resuming " << db_name << " after line "
+            << block.resume_line_ids[shard];
+      }
     }
+    block.dbs.push_back(db);
   }
-  // write the last batch
-  if (count % 1000 != 0) {
-    db->Write(leveldb::WriteOptions(), batch);
+
+  // Each block commits about kCommitSize images to each shard.
+  const int block_size = kCommitSize * num_shards;
+  block.values.resize(block_size);
+  block.data_sizes.resize(block_size);
+  int count = 0;
+  int data_size = -1;
+  for (int line_begin = 0; line_begin < lines.size();
+       line_begin += block_size) {
+    block.line_begin = line_begin;
+    block.num_lines = std::min(block_size,
+        static_cast<int>(lines.size()) - line_begin);
+    RunWorkers(DecodeWorker, &block, num_threads);
+    for (int i = 0; i < block.num_lines; ++i) {
+      if (block.data_sizes[i] < 0) {
+        continue;
+      }
+      if (data_size < 0) {
+        data_size = block.data_sizes[i];
+      } else {
+        CHECK_EQ(block.data_sizes[i], data_size) << "Incorrect data field size "
+            << block.data_sizes[i];
+      }
+      ++count;
+    }
+    RunWorkers(WriteWorker, &block, num_shards);
     LOG(ERROR) << "Processed " << count << " files.";
   }
-
-  delete batch;
-  delete db;
+  for (int shard = 0; shard < num_shards; ++shard) {
+    block.dbs[shard]->Close();
+  }
   return 0;
 }
@@ -0,0 +1,29 @@
+// Copyright 2014 BVLC and contributors.
+//
+// This program converts trained weights, as a binary net parameter, to raw
+// weights (see RawWeightsFile), which nets map into memory rather than
+// parse when they load them.
+// Usage:
+//    convert_to_raw_weights input_net_param output_raw_weights
+
+#include <glog/logging.h>
+
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/io.hpp"
+#include "caffe/util/raw_weights.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::NetParameter;
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc != 3) {
+    LOG(ERROR) << "convert_to_raw_weights input_net_param output_raw_weights";
+    return 1;
+  }
+  NetParameter net_param;
+  caffe::ReadNetParamsFromBinaryFileOrDie(argv[1], &net_param);
+  caffe::WriteRawWeights(net_param, argv[2]);
+  LOG(ERROR) << "Wrote " << argv[2];
+  return 0;
+}
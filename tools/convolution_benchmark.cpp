@@ -0,0 +1,88 @@
+// Copyright 2014 BVLC and contributors.
+//
+// This program times the forward pass of a 3x3, stride 1 convolution with
+// each engine, to choose the engine of a layer of that shape.
+// Usage:
+//    convolution_benchmark [num=10] [channels=64] [size=56] [num_output=64]
+//        [CPU/GPU] [iterations=10]
+
+#include <glog/logging.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/vision_layers.hpp"
+#include "caffe/util/benchmark.hpp"
+
+using caffe::Blob;
+using caffe::Caffe;
+using caffe::ConvolutionLayer;
+using caffe::ConvolutionParameter;
+using caffe::ConvolutionParameter_Engine;
+using caffe::FillerParameter;
+using caffe::GaussianFiller;
+using caffe::LayerParameter;
+using caffe::Timer;
+using std::vector;
+
+void benchmark(const char* engine_name,
+    const ConvolutionParameter_Engine engine,
+    const int num_output, const int iterations, vector<Blob<float>*>* bottom,
+    vector<Blob<float>*>* top) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_pad(1);
+  convolution_param->set_num_output(num_output);
+  convolution_param->set_engine(engine);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  ConvolutionLayer<float> layer(layer_param);
+  layer.SetUp(*bottom, top);
+  // The first pass allocates the buffers.
+  layer.Forward(*bottom, top);
+  Timer timer;
+  timer.Start();
+  for (int i = 0; i < iterations; ++i) {
+    layer.Forward(*bottom, top);
+  }
+  timer.Stop();
+  LOG(ERROR) << engine_name << ": " << timer.MilliSeconds() / iterations
+      << " ms per forward pass.";
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc > 7) {
+    LOG(ERROR) << "convolution_benchmark [num=10] [channels=64] [size=56]"
+        " [num_output=64] [CPU/GPU] [iterations=10]";
+    return 1;
+  }
+  const int num = argc > 1 ? atoi(argv[1]) : 10;
+  const int channels = argc > 2 ? atoi(argv[2]) : 64;
+  const int size = argc > 3 ? atoi(argv[3]) : 56;
+  const int num_output = argc > 4 ? atoi(argv[4]) : 64;
+  const bool gpu = argc > 5 && strcmp(argv[5], "GPU") == 0;
+  const int iterations = argc > 6 ? atoi(argv[6]) : 10;
+  CHECK_GT(iterations, 0);
+  Caffe::set_mode(gpu ? Caffe::GPU : Caffe::CPU);
+  Blob<float> bottom_blob(num, channels, size, size);
+  Blob<float> top_blob;
+  FillerParameter filler_param;
+  GaussianFiller<float> filler(filler_param);
+  filler.Fill(&bottom_blob);
+  vector<Blob<float>*> bottom(1, &bottom_blob);
+  vector<Blob<float>*> top(1, &top_blob);
+  LOG(ERROR) << "Convolving " << num << "x" << channels << "x" << size << "x"
+      << size << " images into " << num_output << " channels on the "
+      << (gpu ? "GPU" : "CPU") << ", " << iterations << " iterations.";
+  benchmark("IM2COL", ConvolutionParameter::IM2COL, num_output, iterations,
+      &bottom, &top);
+  benchmark("WINOGRAD", ConvolutionParameter::WINOGRAD, num_output,
+      iterations, &bottom, &top);
+  return 0;
+}
@@ -0,0 +1,191 @@
+// Copyright 2014 BVLC and contributors.
+//
+// This program runs the first data layer (DATA, IMAGE_DATA or WINDOW_DATA) of
+// a net on its own for a number of batches, and reports the images it gives
+// per second, the time its prefetching spends on each stage (see
+// DataLayerStats) and the CPU time the process takes, to size the hosts
+// feeding the data. The prefetch workers, the cache and the database backend
+// of the layer can be overridden, "-" keeping those of the net.
+// Usage:
+//    data_speed_benchmark net_proto [batches=100] [CPU/GPU]
+//        [prefetch_threads] [cache_size_mb] [backend=LEVELDB/LMDB/REMOTE]
+
+#include <glog/logging.h>
+#include <sys/resource.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/data_layers.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/upgrade_proto.hpp"
+
+using boost::posix_time::microsec_clock;
+using boost::posix_time::ptime;
+using caffe::Blob;
+using caffe::Caffe;
+using caffe::DataLayer;
+using caffe::DataLayerStats;
+using caffe::DataParameter;
+using caffe::DataParameter_DB;
+using caffe::ImageDataLayer;
+using caffe::Layer;
+using caffe::LayerParameter;
+using caffe::NetParameter;
+using caffe::WindowDataLayer;
+using caffe::shared_ptr;
+using std::vector;
+
+// The user and system CPU time of the process, in seconds
+static double CpuSeconds() {
+  struct rusage usage;
+  CHECK_EQ(getrusage(RUSAGE_SELF, &usage), 0);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+      (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// The stats of layer, a data layer, reset if asked to
+static DataLayerStats GetStats(Layer<float>* layer, const bool reset) {
+  DataLayerStats stats;
+  if (DataLayer<float>* data_layer = dynamic_cast<DataLayer<float>*>(layer)) {
+    stats = data_layer->stats();
+    if (reset) {
+      data_layer->ResetStats();
+    }
+  } else if (ImageDataLayer<float>* image_data_layer =
+      dynamic_cast<ImageDataLayer<float>*>(layer)) {
+    stats = image_data_layer->stats();
+    if (reset) {
+      image_data_layer->ResetStats();
+    }
+  } else {
+    WindowDataLayer<float>* window_data_layer =
+        dynamic_cast<WindowDataLayer<float>*>(layer);
+    CHECK(window_data_layer);
+    stats = window_data_layer->stats();
+    if (reset) {
+      window_data_layer->ResetStats();
+    }
+  }
+  return stats;
+}
+
+// Whether arg, an optional argument, overrides the net
+static bool Given(const int argc, char** argv, const int arg) {
+  return argc > arg && strcmp(argv[arg], "-") != 0;
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc < 2 || argc > 7) {
+    LOG(ERROR) << "data_speed_benchmark net_proto [batches=100] [CPU/GPU]"
+        " [prefetch_threads] [cache_size_mb] [backend=LEVELDB/LMDB/REMOTE]";
+    return 1;
+  }
+  const int batches = Given(argc, argv, 2) ? atoi(argv[2]) : 100;
+  CHECK_GT(batches, 0);
+  if (Given(argc, argv, 3) && strcmp(argv[3], "GPU") == 0) {
+    LOG(ERROR) << "Using GPU";
+    Caffe::set_mode(Caffe::GPU);
+  } else {
+    LOG(ERROR) << "Using CPU";
+    Caffe::set_mode(Caffe::CPU);
+  }
+  Caffe::set_phase(Caffe::TRAIN);
+
+  NetParameter net_param;
+  caffe::ReadNetParamsFromTextFileOrDie(argv[1], &net_param);
+  int layer_id = 0;
+  while (layer_id < net_param.layers_size() &&
+      net_param.layers(layer_id).type() != LayerParameter::DATA &&
+      net_param.layers(layer_id).type() != LayerParameter::IMAGE_DATA &&
+      net_param.layers(layer_id).type() != LayerParameter::WINDOW_DATA) {
+    ++layer_id;
+  }
+  CHECK_LT(layer_id, net_param.layers_size())
+      << argv[1] << " has no DATA, IMAGE_DATA or WINDOW_DATA layer";
+  LayerParameter layer_param = net_param.layers(layer_id);
+  const LayerParameter::LayerType type = layer_param.type();
+  if (Given(argc, argv, 4)) {
+    const int prefetch_threads = atoi(argv[4]);
+    CHECK_GT(prefetch_threads, 0);
+    if (type == LayerParameter::DATA) {
+      layer_param.mutable_data_param()->set_prefetch_threads(
+          prefetch_threads);
+    } else if (type == LayerParameter::IMAGE_DATA) {
+      layer_param.mutable_image_data_param()->set_prefetch_threads(
+          prefetch_threads);
+    } else {
+      layer_param.mutable_window_data_param()->set_prefetch_threads(
+          prefetch_threads);
+    }
+  }
+  // The cache of the remote records for a DATA layer, of the decoded images
+  // for the others
+  if (Given(argc, argv, 5)) {
+    const int cache_size_mb = atoi(argv[5]);
+    CHECK_GE(cache_size_mb, 0);
+    if (type == LayerParameter::DATA) {
+      layer_param.mutable_data_param()->set_cache_size_mb(cache_size_mb);
+    } else if (type == LayerParameter::IMAGE_DATA) {
+      layer_param.mutable_image_data_param()->set_cache_size_mb(
+          cache_size_mb);
+    } else {
+      layer_param.mutable_window_data_param()->set_cache_size_mb(
+          cache_size_mb);
+    }
+  }
+  if (Given(argc, argv, 6)) {
+    CHECK_EQ(type, LayerParameter::DATA) << "Only DATA layers have backends";
+    DataParameter_DB backend;
+    CHECK(DataParameter::DB_Parse(argv[6], &backend))
+        << "Unknown backend " << argv[6];
+    layer_param.mutable_data_param()->set_backend(backend);
+  }
+
+  vector<shared_ptr<Blob<float> > > tops(layer_param.top_size());
+  vector<Blob<float>*> bottom_vec;
+  vector<Blob<float>*> top_vec;
+  for (int i = 0; i < tops.size(); ++i) {
+    tops[i].reset(new Blob<float>());
+    top_vec.push_back(tops[i].get());
+  }
+  shared_ptr<Layer<float> > layer(caffe::GetLayer<float>(layer_param));
+  layer->SetUp(bottom_vec, &top_vec);
+  // The first batch waits for the prefetching to start.
+  layer->Forward(bottom_vec, &top_vec);
+  GetStats(layer.get(), true);
+
+  LOG(ERROR) << "Running " << layer_param.name() << " for " << batches
+      << " batches of " << top_vec[0]->num() << " images";
+  const double cpu_start = CpuSeconds();
+  const ptime start = microsec_clock::local_time();
+  for (int i = 0; i < batches; ++i) {
+    layer->Forward(bottom_vec, &top_vec);
+  }
+  const double elapsed_ms =
+      (microsec_clock::local_time() - start).total_microseconds() / 1000.;
+  const double cpu_ms = (CpuSeconds() - cpu_start) * 1000;
+  const DataLayerStats stats = GetStats(layer.get(), false);
+
+  const double images = static_cast<double>(batches) * top_vec[0]->num();
+  LOG(ERROR) << images * 1000 / elapsed_ms << " images per second, "
+      << elapsed_ms / batches << " ms per batch.";
+  LOG(ERROR) << "CPU usage: " << cpu_ms / elapsed_ms << " cores, "
+      << cpu_ms / images << " ms per image.";
+  LOG(ERROR) << "Per batch: waited " << stats.wait_ms / batches
+      << " ms, prefetched in " << stats.prefetch_ms / batches << " ms, read "
+      << stats.read_ms / batches << " ms, copied "
+      << stats.copy_ms / batches << " ms.";
+  LOG(ERROR) << "Per batch, summed over the workers: parsed "
+      << stats.parse_ms / batches << " ms, decoded "
+      << stats.decode_ms / batches << " ms, transformed "
+      << stats.transform_ms / batches << " ms.";
+  return 0;
+}
@@ -0,0 +1,69 @@
+// Copyright 2014 BVLC and contributors.
+//
+// This program times the transformation the data layers apply to every
+// image (uint8 to Dtype conversion, cropping, mirroring, mean subtraction and
+// scaling), and reports the cost per image.
+// Usage:
+//    data_transform_benchmark [iterations=1000] [crop_size=227] [mirror=1]
+
+#include <glog/logging.h>
+#include <stdint.h>
+
+#include <cstdlib>
+#include <vector>
+
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/data_transform.hpp"
+
+using caffe::Timer;
+using caffe::TransformImage;
+using std::vector;
+
+template <typename Dtype>
+void benchmark(const char* type_name, const int iterations,
+    const int crop_size, const bool mirror) {
+  // An ImageNet sized image.
+  const int channels = 3;
+  const int height = 256;
+  const int width = 256;
+  const int size = channels * height * width;
+  vector<uint8_t> data(size);
+  vector<Dtype> mean(size);
+  for (int i = 0; i < size; ++i) {
+    data[i] = static_cast<uint8_t>(rand() % 256);
+    mean[i] = static_cast<Dtype>(rand() % 256);
+  }
+  const int crop_height = crop_size ? crop_size : height;
+  const int crop_width = crop_size ? crop_size : width;
+  vector<Dtype> top(channels * crop_height * crop_width);
+  Timer timer;
+  timer.Start();
+  for (int i = 0; i < iterations; ++i) {
+    const int h_off = crop_size ? i % (height - crop_size) : 0;
+    const int w_off = crop_size ? (i * 7) % (width - crop_size) : 0;
+    TransformImage(&data[0], channels, height, width, h_off, w_off,
+        crop_size, mirror, &mean[0], Dtype(0.5), &top[0]);
+  }
+  timer.Stop();
+  LOG(ERROR) << type_name << ": " << timer.MilliSeconds() * 1000 / iterations
+      << " us per image.";
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc > 4) {
+    LOG(ERROR) << "data_transform_benchmark [iterations=1000]"
+        " [crop_size=227] [mirror=1]";
+    return 1;
+  }
+  const int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+  const int crop_size = argc > 2 ? atoi(argv[2]) : 227;
+  const bool mirror = argc > 3 ? atoi(argv[3]) != 0 : true;
+  CHECK_GT(iterations, 0);
+  CHECK_LT(crop_size, 256);
+  LOG(ERROR) << "Transforming 3x256x256 images with crop_size " << crop_size
+      << (mirror ? ", mirrored" : "") << ", " << iterations << " iterations.";
+  benchmark<float>("float", iterations, crop_size, mirror);
+  benchmark<double>("double", iterations, crop_size, mirror);
+  return 0;
+}
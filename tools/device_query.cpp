@@ -3,6 +3,7 @@
 
 #include "caffe/common.hpp"
 #include "caffe/net.hpp"
+#include "caffe/util/cpu_dispatch.hpp"
 
 
 using namespace caffe;  // NOLINT(build/namespaces)
@@ -12,6 +13,7 @@ int main(int argc, char** argv) {
     LOG(ERROR) << "device_query [device_id=0]";
     return 1;
   }
+  LOG(INFO) << "CPU kernels: " << CpuDispatchTarget();
   if (argc == 2) {
     LOG(INFO) << "Querying device_id=" << argv[1];
     Caffe::SetDevice(atoi(argv[1]));
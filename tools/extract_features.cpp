@@ -1,10 +1,13 @@
 // Copyright 2014 BVLC and contributors.
 
+#include <pthread.h>
 #include <stdio.h>  // for snprintf
 #include <cuda_runtime.h>
 #include <google/protobuf/text_format.h>
-#include <leveldb/db.h>
-#include <leveldb/write_batch.h>
+
+#include <algorithm>
+#include <fstream>  // NOLINT(readability/streams)
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -13,10 +16,258 @@
 #include "caffe/net.hpp"
 #include "caffe/vision_layers.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/db.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/upgrade_proto.hpp"
 
 using namespace caffe;  // NOLINT(build/namespaces)
 
+// Writes the features of one blob, a batch at a time, from the writer thread.
+template <typename Dtype>
+class FeatureWriter {
+ public:
+  FeatureWriter(const string& name, const int channels, const int height,
+      const int width)
+      : name_(name), channels_(channels), height_(height), width_(width),
+        dim_(channels * height * width) {}
+  virtual ~FeatureWriter() {}
+  // Writes num items of dim_ values each.
+  virtual void Write(const Dtype* features, const int num) = 0;
+  virtual void Close() = 0;
+
+ protected:
+  string name_;
+  int channels_;
+  int height_;
+  int width_;
+  int dim_;
+};
+
+// One Datum of float_data per item in a leveldb or lmdb, keyed by index.
+template <typename Dtype>
+class DBFeatureWriter : public FeatureWriter<Dtype> {
+ public:
+  DBFeatureWriter(const string& name, const int channels, const int height,
+      const int width, const string& backend)
+      : FeatureWriter<Dtype>(name, channels, height, width),
+        db_(GetDB(backend)), num_(0), pending_(0) {
+    db_->Open(name, DB::NEW);
+    txn_.reset(db_->NewTransaction());
+  }
+
+  virtual void Write(const Dtype* features, const int num) {
+    const int kMaxKeyStrLength = 100;
+    char key_str[kMaxKeyStrLength];
+    Datum datum;
+    datum.set_height(this->dim_);
+    datum.set_width(1);
+    datum.set_channels(1);
+    string value;
+    for (int n = 0; n < num; ++n) {
+      datum.mutable_float_data()->Resize(this->dim_, 0);
+      float* values = datum.mutable_float_data()->mutable_data();
+      for (int d = 0; d < this->dim_; ++d) {
+        values[d] = features[n * this->dim_ + d];
+      }
+      datum.SerializeToString(&value);
+      snprintf(key_str, kMaxKeyStrLength, "%d", num_++);
+      txn_->Put(string(key_str), value);
+    }
+    pending_ += num;
+    if (pending_ >= 1000) {
+      txn_->Commit();
+      pending_ = 0;
+    }
+  }
+
+  virtual void Close() {
+    if (pending_) {
+      txn_->Commit();
+    }
+    txn_.reset();
+    db_->Close();
+  }
+
+ protected:
+  shared_ptr<DB> db_;
+  shared_ptr<DBTransaction> txn_;
+  int num_;
+  int pending_;
+};
+
+// Splits the items into shards of about kShardBytes, listed one per line in
+// the file name.txt as the shards are closed.
+template <typename Dtype>
+class ShardedFeatureWriter : public FeatureWriter<Dtype> {
+ public:
+  ShardedFeatureWriter(const string& name, const int channels,
+      const int height, const int width, const string& extension)
+      : FeatureWriter<Dtype>(name, channels, height, width),
+        extension_(extension), shard_(0), shard_items_(0),
+        list_((name + ".txt").c_str()) {
+    CHECK(list_.good()) << "Failed to open " << name << ".txt";
+    items_per_shard_ = std::max<int>(1,
+        kShardBytes / (this->dim_ * sizeof(Dtype)));
+  }
+
+  virtual void Write(const Dtype* features, const int num) {
+    for (int n = 0; n < num; ) {
+      if (shard_items_ == 0) {
+        OpenShard(ShardName());
+      }
+      const int items = std::min(num - n, items_per_shard_ - shard_items_);
+      WriteShard(features + n * this->dim_, items);
+      shard_items_ += items;
+      n += items;
+      if (shard_items_ == items_per_shard_) {
+        FinishShard();
+      }
+    }
+  }
+
+  virtual void Close() {
+    if (shard_items_) {
+      FinishShard();
+    }
+    list_.close();
+  }
+
+ protected:
+  static const int kShardBytes = 256 << 20;
+
+  virtual void OpenShard(const string& filename) = 0;
+  virtual void WriteShard(const Dtype* features, const int num) = 0;
+  virtual void CloseShard() = 0;
+  // The line of the shard in the list
+  virtual string ListLine(const string& filename) { return filename; }
+
+  string ShardName() const {
+    const int kMaxKeyStrLength = 16;
+    char index_str[kMaxKeyStrLength];
+    snprintf(index_str, kMaxKeyStrLength, "_%05d", shard_);
+    return this->name_ + index_str + extension_;
+  }
+
+  void FinishShard() {
+    CloseShard();
+    list_ << ListLine(ShardName()) << std::endl;
+    ++shard_;
+    shard_items_ = 0;
+  }
+
+  string extension_;
+  int items_per_shard_;
+  int shard_;
+  int shard_items_;
+  std::ofstream list_;
+};
+
+// Raw shards: the items one after the other, dim_ Dtype values each. The
+// list gives the number of items and their dimension after each shard.
+template <typename Dtype>
+class RawFeatureWriter : public ShardedFeatureWriter<Dtype> {
+ public:
+  RawFeatureWriter(const string& name, const int channels, const int height,
+      const int width)
+      : ShardedFeatureWriter<Dtype>(name, channels, height, width, ".bin"),
+        file_(NULL) {}
+
+ protected:
+  virtual void OpenShard(const string& filename) {
+    file_ = fopen(filename.c_str(), "wb");
+    CHECK(file_) << "Failed to open " << filename;
+  }
+  virtual void WriteShard(const Dtype* features, const int num) {
+    CHECK_EQ(fwrite(features, sizeof(Dtype) * this->dim_, num, file_), num)
+        << "Failed to write features";
+  }
+  virtual void CloseShard() {
+    CHECK(!fclose(file_)) << "Failed to close a shard";
+    file_ = NULL;
+  }
+  virtual string ListLine(const string& filename) {
+    std::ostringstream line;
+    line << filename << " " << this->shard_items_ << " " << this->dim_;
+    return line.str();
+  }
+
+  FILE* file_;
+};
+
+// HDF5 shards of a "data" dataset of the shape of the blob, gathered in
+// memory until written, listed as the source of an HDF5DataLayer reads them.
+template <typename Dtype>
+class HDF5FeatureWriter : public ShardedFeatureWriter<Dtype> {
+ public:
+  HDF5FeatureWriter(const string& name, const int channels, const int height,
+      const int width)
+      : ShardedFeatureWriter<Dtype>(name, channels, height, width, ".h5") {}
+
+ protected:
+  virtual void OpenShard(const string& filename) {
+    shard_data_.Reshape(this->items_per_shard_, this->channels_,
+        this->height_, this->width_);
+  }
+  virtual void WriteShard(const Dtype* features, const int num) {
+    caffe_copy(num * this->dim_, features, shard_data_.mutable_cpu_data()
+        + this->shard_items_ * this->dim_);
+  }
+  virtual void CloseShard() {
+    shard_data_.Reshape(this->shard_items_, this->channels_, this->height_,
+        this->width_);
+    const string filename = this->ShardName();
+    hid_t file_id = H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT,
+        H5P_DEFAULT);
+    CHECK_GE(file_id, 0) << "Failed to create " << filename;
+    hdf5_save_nd_dataset(file_id, "data", shard_data_);
+    CHECK_GE(H5Fclose(file_id), 0) << "Failed to close " << filename;
+  }
+
+  Blob<Dtype> shard_data_;
+};
+
+// The features of the blobs extracted in one forward pass. Two of them go
+// back and forth between the forward passes and the writer thread.
+template <typename Dtype>
+struct FeatureBatch {
+  vector<vector<Dtype> > features;
+  int num;
+};
+
+template <typename Dtype>
+struct FeatureWriterThread {
+  vector<shared_ptr<FeatureWriter<Dtype> > > writers;
+  // The batches to write, NULL once done, and those written
+  BlockingQueue<FeatureBatch<Dtype>*> full;
+  BlockingQueue<FeatureBatch<Dtype>*> free;
+};
+
+template <typename Dtype>
+void* WriteFeatures(void* thread_pointer) {
+  FeatureWriterThread<Dtype>* thread =
+      static_cast<FeatureWriterThread<Dtype>*>(thread_pointer);
+  for (FeatureBatch<Dtype>* batch = thread->full.pop(); batch;
+       batch = thread->full.pop()) {
+    for (int i = 0; i < thread->writers.size(); ++i) {
+      thread->writers[i]->Write(&batch->features[i][0], batch->num);
+    }
+    thread->free.push(batch);
+  }
+  return NULL;
+}
+
+// Splits the comma separated names.
+static void SplitNames(const string& names, vector<string>* split) {
+  size_t start = 0;
+  for (size_t end = names.find(','); end != string::npos;
+       start = end + 1, end = names.find(',', start)) {
+    split->push_back(names.substr(start, end - start));
+  }
+  split->push_back(names.substr(start));
+}
+
 template<typename Dtype>
 int feature_extraction_pipeline(int argc, char** argv);
 
@@ -33,8 +284,11 @@ int feature_extraction_pipeline(int argc, char** argv) {
     "This program takes in a trained network and an input data layer, and then"
     " extract features of the input data produced by the net.\n"
     "Usage: demo_extract_features  pretrained_net_param"
-    "  feature_extraction_proto_file  extract_feature_blob_name"
-    "  save_feature_leveldb_name  num_mini_batches  [CPU/GPU]  [DEVICE_ID=0]";
+    "  feature_extraction_proto_file  extract_feature_blob_name1[,name2,...]"
+    "  save_feature_db_name1[,name2,...]  num_mini_batches  [CPU/GPU]"
+    "  [DEVICE_ID=0]  [BACKEND=leveldb|lmdb|raw|hdf5]\n"
+    "The blobs are extracted in one pass, each to the DB, or raw or HDF5"
+    " shards listed in name.txt, of the same position.";
     return 1;
   }
   int arg_pos = num_required_args;
@@ -87,80 +341,89 @@ int feature_extraction_pipeline(int argc, char** argv) {
    }
    */
   string feature_extraction_proto(argv[++arg_pos]);
+  // The features are only computed forward, so the net needs no diffs.
+  NetParameter feature_extraction_param;
+  ReadNetParamsFromTextFileOrDie(feature_extraction_proto,
+      &feature_extraction_param);
+  feature_extraction_param.set_inference(true);
+  // Keep the blobs before the neuron layers, which may be extracted.
+  feature_extraction_param.set_auto_in_place(false);
   shared_ptr<Net<Dtype> > feature_extraction_net(
-      new Net<Dtype>(feature_extraction_proto));
+      new Net<Dtype>(feature_extraction_param));
   feature_extraction_net->CopyTrainedLayersFrom(pretrained_binary_proto);
 
-  string extract_feature_blob_name(argv[++arg_pos]);
-  CHECK(feature_extraction_net->has_blob(extract_feature_blob_name))
-      << "Unknown feature blob name " << extract_feature_blob_name
-      << " in the network " << feature_extraction_proto;
-
-  string save_feature_leveldb_name(argv[++arg_pos]);
-  leveldb::DB* db;
-  leveldb::Options options;
-  options.error_if_exists = true;
-  options.create_if_missing = true;
-  options.write_buffer_size = 268435456;
-  LOG(INFO)<< "Opening leveldb " << save_feature_leveldb_name;
-  leveldb::Status status = leveldb::DB::Open(options,
-                                             save_feature_leveldb_name.c_str(),
-                                             &db);
-  CHECK(status.ok()) << "Failed to open leveldb " << save_feature_leveldb_name;
+  string extract_feature_blob_names(argv[++arg_pos]);
+  vector<string> blob_names;
+  SplitNames(extract_feature_blob_names, &blob_names);
+  string save_feature_db_names(argv[++arg_pos]);
+  vector<string> db_names;
+  SplitNames(save_feature_db_names, &db_names);
+  CHECK_EQ(blob_names.size(), db_names.size())
+      << "Give as many feature blob names as names to save them to.";
+  const string backend =
+      argc > num_required_args + 2 ? argv[num_required_args + 2] : "leveldb";
+
+  FeatureWriterThread<Dtype> writer_thread;
+  vector<shared_ptr<Blob<Dtype> > > feature_blobs;
+  for (int i = 0; i < blob_names.size(); ++i) {
+    CHECK(feature_extraction_net->has_blob(blob_names[i]))
+        << "Unknown feature blob name " << blob_names[i]
+        << " in the network " << feature_extraction_proto;
+    const shared_ptr<Blob<Dtype> > blob =
+        feature_extraction_net->blob_by_name(blob_names[i]);
+    feature_blobs.push_back(blob);
+    FeatureWriter<Dtype>* writer;
+    if (backend == "raw") {
+      writer = new RawFeatureWriter<Dtype>(db_names[i], blob->channels(),
+          blob->height(), blob->width());
+    } else if (backend == "hdf5") {
+      writer = new HDF5FeatureWriter<Dtype>(db_names[i], blob->channels(),
+          blob->height(), blob->width());
+    } else {
+      writer = new DBFeatureWriter<Dtype>(db_names[i], blob->channels(),
+          blob->height(), blob->width(), backend);
+    }
+    writer_thread.writers.push_back(shared_ptr<FeatureWriter<Dtype> >(writer));
+  }
+  FeatureBatch<Dtype> batches[2];
+  for (int i = 0; i < 2; ++i) {
+    batches[i].features.resize(feature_blobs.size());
+    writer_thread.free.push(&batches[i]);
+  }
+  pthread_t thread;
+  CHECK(!pthread_create(&thread, NULL, WriteFeatures<Dtype>, &writer_thread))
+      << "Pthread execution failed.";
 
   int num_mini_batches = atoi(argv[++arg_pos]);
 
   LOG(ERROR)<< "Extacting Features";
 
-  Datum datum;
-  leveldb::WriteBatch* batch = new leveldb::WriteBatch();
-  const int kMaxKeyStrLength = 100;
-  char key_str[kMaxKeyStrLength];
-  int num_bytes_of_binary_code = sizeof(Dtype);
-  vector<Blob<float>*> input_vec;
+  // The features of a batch are written while the next one is computed.
   int image_index = 0;
   for (int batch_index = 0; batch_index < num_mini_batches; ++batch_index) {
-    feature_extraction_net->Forward(input_vec);
-    const shared_ptr<Blob<Dtype> > feature_blob = feature_extraction_net
-        ->blob_by_name(extract_feature_blob_name);
-    int num_features = feature_blob->num();
-    int dim_features = feature_blob->count() / num_features;
-    Dtype* feature_blob_data;
-    for (int n = 0; n < num_features; ++n) {
-      datum.set_height(dim_features);
-      datum.set_width(1);
-      datum.set_channels(1);
-      datum.clear_data();
-      datum.clear_float_data();
-      feature_blob_data = feature_blob->mutable_cpu_data() +
-          feature_blob->offset(n);
-      for (int d = 0; d < dim_features; ++d) {
-        datum.add_float_data(feature_blob_data[d]);
-      }
-      string value;
-      datum.SerializeToString(&value);
-      snprintf(key_str, kMaxKeyStrLength, "%d", image_index);
-      batch->Put(string(key_str), value);
-      ++image_index;
-      if (image_index % 1000 == 0) {
-        db->Write(leveldb::WriteOptions(), batch);
-        LOG(ERROR)<< "Extracted features of " << image_index <<
-            " query images.";
-        delete batch;
-        batch = new leveldb::WriteBatch();
-      }
-    }  // for (int n = 0; n < num_features; ++n)
+    // Only the layers the features depend on run.
+    feature_extraction_net->ForwardBlobs(blob_names);
+    FeatureBatch<Dtype>* batch = writer_thread.free.pop();
+    batch->num = feature_blobs[0]->num();
+    for (int i = 0; i < feature_blobs.size(); ++i) {
+      CHECK_EQ(feature_blobs[i]->num(), batch->num);
+      const Dtype* data = feature_blobs[i]->cpu_data();
+      batch->features[i].assign(data, data + feature_blobs[i]->count());
+    }
+    writer_thread.full.push(batch);
+    const int previous_thousands = image_index / 1000;
+    image_index += batch->num;
+    if (image_index / 1000 > previous_thousands) {
+      LOG(ERROR)<< "Extracted features of " << image_index <<
+          " query images.";
+    }
   }  // for (int batch_index = 0; batch_index < num_mini_batches; ++batch_index)
-  // write the last batch
-  if (image_index % 1000 != 0) {
-    db->Write(leveldb::WriteOptions(), batch);
-    LOG(ERROR)<< "Extracted features of " << image_index <<
-        " query images.";
+  writer_thread.full.push(NULL);
+  CHECK(!pthread_join(thread, NULL)) << "Pthread joining failed.";
+  for (int i = 0; i < writer_thread.writers.size(); ++i) {
+    writer_thread.writers[i]->Close();
   }
-
-  delete batch;
-  delete db;
+  LOG(ERROR)<< "Extracted features of " << image_index << " query images.";
   LOG(ERROR)<< "Successfully extracted the features!";
   return 0;
 }
-
@@ -14,6 +14,7 @@ using namespace caffe;  // NOLINT(build/namespaces)
 
 int main(int argc, char** argv) {
   ::google::InitGoogleLogging(argv[0]);
+  MPIInit(&argc, &argv);
   if (argc != 3) {
     LOG(ERROR) << "Usage: finetune_net solver_proto_file pretrained_net";
     return 1;
@@ -23,11 +24,12 @@ int main(int argc, char** argv) {
   ReadProtoFromTextFileOrDie(argv[1], &solver_param);
 
   LOG(INFO) << "Starting Optimization";
-  SGDSolver<float> solver(solver_param);
+  shared_ptr<Solver<float> > solver(GetSolver<float>(solver_param));
   LOG(INFO) << "Loading from " << argv[2];
-  solver.net()->CopyTrainedLayersFrom(string(argv[2]));
-  solver.Solve();
+  solver->net()->CopyTrainedLayersFrom(string(argv[2]));
+  solver->Solve();
   LOG(INFO) << "Optimization Done.";
+  MPIFinalize();
 
   return 0;
 }
@@ -16,15 +16,17 @@
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/benchmark.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/memory_pool.hpp"
 #include "caffe/solver.hpp"
 
 using namespace caffe;  // NOLINT(build/namespaces)
 
 int main(int argc, char** argv) {
   int total_iter = 50;
-  if (argc < 2 || argc > 5) {
+  if (argc < 2 || argc > 6) {
     LOG(ERROR) << "net_speed_benchmark net_proto [iterations=50]"
-        " [CPU/GPU] [Device_id=0]";
+        " [CPU/GPU] [Device_id=0 for GPU, threads=1 for CPU]"
+        " [engine_cache_file]";
     return 1;
   }
 
@@ -46,6 +48,15 @@ int main(int argc, char** argv) {
   } else {
     LOG(ERROR) << "Using CPU";
     Caffe::set_mode(Caffe::CPU);
+    if (argc >= 5) {
+      Caffe::set_cpu_threads(atoi(argv[4]));
+      LOG(ERROR) << "Using " << Caffe::cpu_threads() << " threads";
+    }
+  }
+
+  // The AUTO engines picked are kept there for the next runs.
+  if (argc >= 6) {
+    Caffe::set_engine_cache_file(argv[5]);
   }
 
   Caffe::set_phase(Caffe::TRAIN);
@@ -96,6 +107,7 @@ int main(int argc, char** argv) {
       " milli seconds.";
   LOG(ERROR) << "Total Time: " << total_timer.MilliSeconds() <<
       " milli seconds.";
+  MemoryPool::Get().LogStats();
   LOG(ERROR) << "*** Benchmark ends ***";
   return 0;
 }
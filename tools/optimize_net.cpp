@@ -0,0 +1,48 @@
+// Copyright 2014 BVLC and contributors.
+//
+// This program rewrites a net for the TEST phase with fewer layers: the
+// dropout layers and the identity power layers are removed, and the affine
+// power layers and the scale and mean_value of the data layers are folded
+// into the weights of the convolution and inner product layers next to them
+// (see util/optimize_net.hpp). The optimized net gives the same outputs as
+// the trained one, up to rounding, under the same names.
+// Usage:
+//    optimize_net net_proto trained_net_param optimized_net_proto
+//        optimized_net_param
+
+#include <glog/logging.h>
+
+#include "caffe/common.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/io.hpp"
+#include "caffe/util/optimize_net.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::NetParameter;
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc != 5) {
+    LOG(ERROR) << "optimize_net net_proto trained_net_param"
+        " optimized_net_proto optimized_net_param";
+    return 1;
+  }
+
+  NetParameter net_param;
+  caffe::ReadNetParamsFromTextFileOrDie(argv[1], &net_param);
+  NetParameter trained_param;
+  caffe::ReadNetParamsFromBinaryFileOrDie(argv[2], &trained_param);
+  NetParameter optimized_param;
+  caffe::OptimizeNetForInference(net_param, trained_param, &optimized_param);
+  LOG(ERROR) << "Optimized " << argv[1] << " from "
+      << net_param.layers_size() << " to " << optimized_param.layers_size()
+      << " layers";
+
+  caffe::WriteProtoToBinaryFile(optimized_param, argv[4]);
+  for (int i = 0; i < optimized_param.layers_size(); ++i) {
+    optimized_param.mutable_layers(i)->clear_blobs();
+  }
+  caffe::WriteProtoToTextFile(optimized_param, argv[3]);
+  LOG(ERROR) << "Wrote " << argv[3] << " and " << argv[4];
+  return 0;
+}
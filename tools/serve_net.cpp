@@ -0,0 +1,95 @@
+// Copyright 2014 BVLC and contributors.
+//
+// This program serves a net that starts with a MemoryDataLayer to a number of
+// client threads, each of which sends requests of random images one after
+// the other, and logs the throughput, the batch fill and the latency of the
+// BatchingServer for the given max_latency_ms. Comparing max_latency_ms and
+// batch sizes shows how much latency larger batches cost.
+// Usage:
+//    serve_net net_proto [pretrained_net_proto="" for none] [CPU/GPU]
+//        [device_id=0] [clients=8] [requests=100] [max_latency_ms=5]
+
+#include <glog/logging.h>
+#include <pthread.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/serving.hpp"
+#include "caffe/util/math_functions.hpp"
+
+using caffe::BatchingServer;
+using caffe::Caffe;
+using caffe::Net;
+using caffe::shared_ptr;
+using std::vector;
+
+struct Client {
+  BatchingServer* server;
+  int requests;
+  vector<float> image;
+};
+
+void* ClientThread(void* client_pointer) {
+  Client* client = static_cast<Client*>(client_pointer);
+  vector<float> outputs;
+  for (int i = 0; i < client->requests; ++i) {
+    client->server->Serve(&client->image[0], &outputs);
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc < 2 || argc > 8) {
+    LOG(ERROR) << "serve_net net_proto [pretrained_net_proto] [CPU/GPU]"
+        " [device_id=0] [clients=8] [requests=100] [max_latency_ms=5]";
+    return 1;
+  }
+  if (argc > 3 && strcmp(argv[3], "GPU") == 0) {
+    Caffe::SetDevice(argc > 4 ? atoi(argv[4]) : 0);
+    Caffe::set_mode(Caffe::GPU);
+  } else {
+    Caffe::set_mode(Caffe::CPU);
+  }
+  const int num_clients = argc > 5 ? atoi(argv[5]) : 8;
+  const int requests = argc > 6 ? atoi(argv[6]) : 100;
+  const float max_latency_ms = argc > 7 ? atof(argv[7]) : 5;
+  CHECK_GT(num_clients, 0);
+  CHECK_GT(requests, 0);
+
+  Caffe::set_phase(Caffe::TEST);
+  shared_ptr<Net<float> > net(new Net<float>(argv[1]));
+  if (argc > 2 && strlen(argv[2])) {
+    net->CopyTrainedLayersFrom(argv[2]);
+  }
+  BatchingServer server(net, max_latency_ms);
+  LOG(INFO) << "Serving batches of " << server.batch_size() << " to "
+      << num_clients << " clients, within " << max_latency_ms << " ms";
+
+  vector<Client> clients(num_clients);
+  vector<pthread_t> threads(num_clients);
+  for (int i = 0; i < num_clients; ++i) {
+    clients[i].server = &server;
+    clients[i].requests = requests;
+    clients[i].image.resize(server.image_size());
+    caffe::caffe_rng_uniform<float>(server.image_size(), 0, 255,
+        &clients[i].image[0]);
+  }
+  // The first batch sets up the memory of the net.
+  vector<float> outputs;
+  server.Serve(&clients[0].image[0], &outputs);
+  server.ResetStats();
+  for (int i = 0; i < num_clients; ++i) {
+    CHECK(!pthread_create(&threads[i], NULL, ClientThread, &clients[i]))
+        << "Pthread execution failed.";
+  }
+  for (int i = 0; i < num_clients; ++i) {
+    CHECK(!pthread_join(threads[i], NULL)) << "Pthread joining failed.";
+  }
+  server.LogStats();
+  return 0;
+}
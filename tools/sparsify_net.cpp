@@ -0,0 +1,60 @@
+// Copyright 2014 BVLC and contributors.
+//
+// This program stores the weights of the inner product layers of a trained
+// net, e.g. a pruned one, in compressed sparse rows (see BlobProto), dropping
+// the weights whose absolute value is at most threshold. The weights of a
+// layer stay dense unless at most max_density of them are kept. The net
+// reads them back as dense blobs; set max_sparse_density of the layers to
+// also compute with them sparse.
+// Usage:
+//    sparsify_net input_net_param output_net_param [threshold=0]
+//        [max_density=0.5]
+
+#include <glog/logging.h>
+
+#include <cstdlib>
+
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/io.hpp"
+#include "caffe/util/sparse.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::BlobProto;
+using caffe::LayerParameter;
+using caffe::LayerParameter_LayerType_INNER_PRODUCT;
+using caffe::NetParameter;
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc < 3 || argc > 5) {
+    LOG(ERROR) << "sparsify_net input_net_param output_net_param"
+        " [threshold=0] [max_density=0.5]";
+    return 1;
+  }
+  const float threshold = argc > 3 ? atof(argv[3]) : 0;
+  const float max_density = argc > 4 ? atof(argv[4]) : 0.5;
+
+  NetParameter net_param;
+  caffe::ReadNetParamsFromBinaryFileOrDie(argv[1], &net_param);
+  const int dense_size = net_param.ByteSize();
+  for (int i = 0; i < net_param.layers_size(); ++i) {
+    LayerParameter* layer_param = net_param.mutable_layers(i);
+    if (layer_param->type() != LayerParameter_LayerType_INNER_PRODUCT ||
+        layer_param->blobs_size() == 0) {
+      continue;
+    }
+    // Only the weights: the bias is a single row.
+    BlobProto* weights = layer_param->mutable_blobs(0);
+    const int count = weights->data_size();
+    if (caffe::SparsifyBlobProto(threshold, max_density, weights)) {
+      LOG(ERROR) << layer_param->name() << ": kept " << weights->data_size()
+          << " of " << count << " weights.";
+    } else {
+      LOG(ERROR) << layer_param->name() << ": kept dense.";
+    }
+  }
+  caffe::WriteProtoToBinaryFile(net_param, argv[2]);
+  LOG(ERROR) << "Wrote " << argv[2] << ": " << net_param.ByteSize()
+      << " bytes, from " << dense_size << ".";
+  return 0;
+}
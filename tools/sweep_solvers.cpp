@@ -0,0 +1,68 @@
+// Copyright 2014 BVLC and contributors.
+//
+// This program trains several solvers of a hyperparameter sweep in one
+// process, over the data of one data pipeline (see solver_sweep.hpp): each
+// base_lr:weight_decay pair gives a solver of solver_proto_file, with that
+// base_lr and weight_decay, on the device_id given after them if any (of
+// solver_proto_file otherwise), snapshotting to the snapshot_prefix of
+// solver_proto_file followed by _sweep and the index of the solver, and
+// writing its telemetry, if any, to the telemetry_file of solver_proto_file
+// followed by the same.
+// Usage:
+//    sweep_solvers solver_proto_file base_lr:weight_decay[:device_id]
+//        [base_lr:weight_decay[:device_id] ...]
+
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+
+#include "caffe/caffe.hpp"
+
+using namespace caffe;  // NOLINT(build/namespaces)
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  if (argc < 3) {
+    LOG(ERROR) << "Usage: sweep_solvers solver_proto_file"
+        " base_lr:weight_decay[:device_id] ...";
+    return 1;
+  }
+
+  SolverParameter solver_param;
+  ReadProtoFromTextFileOrDie(argv[1], &solver_param);
+  vector<SolverParameter> params;
+  for (int i = 2; i < argc; ++i) {
+    float base_lr;
+    float weight_decay;
+    int device_id;
+    const int fields = sscanf(argv[i], "%f:%f:%d", &base_lr, &weight_decay,
+        &device_id);
+    CHECK_GE(fields, 2) << "Expected base_lr:weight_decay[:device_id], got "
+        << argv[i];
+    SolverParameter param = solver_param;
+    param.set_base_lr(base_lr);
+    param.set_weight_decay(weight_decay);
+    if (fields == 3) {
+      param.set_device_id(device_id);
+    }
+    if (param.has_snapshot_prefix()) {
+      std::ostringstream prefix;
+      prefix << param.snapshot_prefix() << "_sweep" << params.size();
+      param.set_snapshot_prefix(prefix.str());
+    }
+    if (param.has_telemetry_file()) {
+      std::ostringstream telemetry_file;
+      telemetry_file << param.telemetry_file() << "_sweep" << params.size();
+      param.set_telemetry_file(telemetry_file.str());
+    }
+    LOG(INFO) << "Solver " << params.size() << ": base_lr " << base_lr
+        << ", weight_decay " << weight_decay;
+    params.push_back(param);
+  }
+
+  SolverSweep<float> sweep(params);
+  sweep.Solve();
+  LOG(INFO) << "Optimization Done.";
+  return 0;
+}
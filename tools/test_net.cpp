@@ -13,6 +13,7 @@
 #include <vector>
 
 #include "caffe/caffe.hpp"
+#include "caffe/util/upgrade_proto.hpp"
 
 using namespace caffe;  // NOLINT(build/namespaces)
 
@@ -38,7 +39,10 @@ int main(int argc, char** argv) {
     Caffe::set_mode(Caffe::CPU);
   }
 
-  Net<float> caffe_test_net(argv[1]);
+  NetParameter test_net_param;
+  ReadNetParamsFromTextFileOrDie(argv[1], &test_net_param);
+  test_net_param.set_inference(true);
+  Net<float> caffe_test_net(test_net_param);
   caffe_test_net.CopyTrainedLayersFrom(argv[2]);
 
   int total_iter = atoi(argv[3]);
@@ -4,6 +4,9 @@
 // parameters are specified by text format protocol buffers.
 // Usage:
 //    train_net net_proto_file solver_proto_file [resume_point_file]
+// Started by mpirun in a build with USE_MPI, each process trains on its own
+// share of the data (see SolverParameter.staleness); every process must be
+// able to read the resume point file.
 
 #include <cuda_runtime.h>
 
@@ -15,6 +18,7 @@ using namespace caffe;  // NOLINT(build/namespaces)
 
 int main(int argc, char** argv) {
   ::google::InitGoogleLogging(argv[0]);
+  MPIInit(&argc, &argv);
   if (argc < 2 || argc > 3) {
     LOG(ERROR) << "Usage: train_net solver_proto_file [resume_point_file]";
     return 1;
@@ -24,14 +28,15 @@ int main(int argc, char** argv) {
   ReadProtoFromTextFileOrDie(argv[1], &solver_param);
 
   LOG(INFO) << "Starting Optimization";
-  SGDSolver<float> solver(solver_param);
+  shared_ptr<Solver<float> > solver(GetSolver<float>(solver_param));
   if (argc == 3) {
     LOG(INFO) << "Resuming from " << argv[2];
-    solver.Solve(argv[2]);
+    solver->Solve(argv[2]);
   } else {
-    solver.Solve();
+    solver->Solve();
   }
   LOG(INFO) << "Optimization Done.";
+  MPIFinalize();
 
   return 0;
 }